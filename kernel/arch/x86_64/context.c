@@ -1,5 +1,399 @@
 /**
  * x86-64 context switching
+ *
+ * A switch saves only what the C ABI says a callee must preserve: rbx,
+ * rbp and r12-r15 go on the outgoing kernel stack, the stack pointer
+ * goes in its thread_struct, and the incoming stack is popped the same
+ * way. Everything else is already dead at a call site. The FS base
+ * (thread-local storage) is reloaded when the two threads' differ, in
+ * ring 0 only.
+ *
+ * FPU/SSE/AVX state is lazy. A thread's registers are saved on switch
+ * out only if it touched the FPU during that slice, and restored only
+ * when it next uses the FPU on a CPU whose registers hold someone
+ * else's state. Integer-only threads never pay for either. On hardware
+ * "uses the FPU" is the #NM trap that CR0.TS raises; hosted builds
+ * cannot set TS, so code calls fpu_activate() before touching FPU
+ * registers, which does what the trap handler would.
+ *
+ * The save instruction is chosen at boot: XSAVES in ring 0 when the CPU
+ * has it (compacted, supervisor state), else XSAVEOPT (skips components
+ * unmodified since their last XRSTOR), else XSAVE, else FXSAVE.
  */
 
-/* Stubs */
+#include <kernel.h>
+#include <string.h>
+
+#define X86_CR0_TS          (1UL << 3)
+#define X86_CR4_OSFXSR      (1UL << 9)
+#define X86_CR4_OSXMMEXCPT  (1UL << 10)
+#define X86_CR4_OSXSAVE     (1UL << 18)
+
+#define XFEATURE_MASK_FPSSE 0x3ULL      /* x87 and SSE */
+#define XFEATURE_MASK_YMM   0x4ULL      /* AVX upper halves */
+#define XCOMP_BV_COMPACTED  (1ULL << 63)
+
+#define FXSAVE_SIZE         512
+#define XSAVE_HDR_OFFSET    512
+#define FCW_DEFAULT         0x037f      /* All x87 exceptions masked, extended precision */
+#define MXCSR_DEFAULT       0x1f80      /* All SSE exceptions masked, round to nearest */
+
+#define NM_VECTOR           7           /* Device not available */
+
+#define MSR_FS_BASE         0xc0000100
+
+typedef enum {
+    FPU_FXSAVE,
+    FPU_XSAVE,
+    FPU_XSAVEOPT,
+    FPU_XSAVES,
+} fpu_mode_t;
+
+static const char *const g_fpu_mode_names[] = {
+    [FPU_FXSAVE]   = "fxsave",
+    [FPU_XSAVE]    = "xsave",
+    [FPU_XSAVEOPT] = "xsaveopt",
+    [FPU_XSAVES]   = "xsaves",
+};
+
+typedef struct {
+    fpu_t *owner;                   /* Whose state the registers hold */
+    thread_struct_t *current;
+    bool ts;                        /* CR0.TS, or its hosted stand-in */
+    fpu_stats_t stats;
+} __attribute__((aligned(64))) fpu_cpu_t;
+
+static fpu_mode_t g_fpu_mode;
+static uint64_t g_xfeatures;        /* Components saved and restored */
+static size_t g_fpu_size = FXSAVE_SIZE;
+static bool g_kernel_mode;          /* Running in ring 0 */
+static bool g_fpu_ready;
+static fpu_cpu_t g_fpu_cpu[NR_CPUS];
+
+/* ============================================================================
+ * Switch primitive
+ *
+ * __switch_to_asm(prev_sp, next_sp) pushes the callee-saved registers,
+ * stores rsp in *prev_sp, loads next_sp and pops the same frame, so its
+ * ret lands wherever next last called it from. A new thread's frame
+ * (copy_thread) returns into ret_from_fork_asm instead, which calls
+ * fn(arg) from r12/r13.
+ * ============================================================================ */
+
+void __switch_to_asm(uint64_t *prev_sp, uint64_t next_sp);
+void ret_from_fork_asm(void);
+
+__asm__(
+    ".text\n"
+    ".globl __switch_to_asm\n"
+    ".type __switch_to_asm, @function\n"
+    "__switch_to_asm:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size __switch_to_asm, . - __switch_to_asm\n"
+    "\n"
+    ".globl ret_from_fork_asm\n"
+    ".type ret_from_fork_asm, @function\n"
+    "ret_from_fork_asm:\n"
+    "    movq %r13, %rdi\n"
+    "    call *%r12\n"
+    "    call thread_fn_returned\n"
+    "    ud2\n"
+    ".size ret_from_fork_asm, . - ret_from_fork_asm\n"
+);
+
+/* Frame popped by the first switch into a new thread, lowest address first */
+typedef struct {
+    uint64_t r15, r14, r13, r12, rbx, rbp;
+    uint64_t ret;
+} fork_frame_t;
+
+void thread_fn_returned(void) {
+    pr_panic("Thread function returned on CPU %u\n", smp_processor_id());
+}
+
+/**
+ * Prepare thread so that the first switch to it calls fn(arg) on the
+ * given stack. fn must never return; it leaves by switching away.
+ */
+int copy_thread(thread_struct_t *thread, void *stack, size_t size,
+                void (*fn)(void *arg), void *arg) {
+    if (!stack || size < sizeof(fork_frame_t) + 16 || !fn) return -EINVAL;
+
+    /* ret leaves rsp at the 16-byte aligned top, as after a call to fn's caller */
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    fork_frame_t *frame = (fork_frame_t *)(top - sizeof(fork_frame_t));
+    memset(frame, 0, sizeof(*frame));
+    frame->r12 = (uint64_t)(uintptr_t)fn;
+    frame->r13 = (uint64_t)(uintptr_t)arg;
+    frame->ret = (uint64_t)(uintptr_t)ret_from_fork_asm;
+
+    memset(thread, 0, sizeof(*thread));
+    thread->sp = (uint64_t)(uintptr_t)frame;
+    return 0;
+}
+
+/* ============================================================================
+ * FPU state
+ * ============================================================================ */
+
+static inline void cpuid_count(uint32_t leaf, uint32_t sub, uint32_t *a, uint32_t *b,
+                               uint32_t *c, uint32_t *d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+static inline uint64_t xgetbv(uint32_t index) {
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void xsetbv(uint32_t index, uint64_t value) {
+    __asm__ volatile("xsetbv" :: "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline unsigned long read_cr4(void) {
+    unsigned long v;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(unsigned long v) {
+    __asm__ volatile("mov %0, %%cr4" :: "r"(v) : "memory");
+}
+
+/* TS set: the next FPU instruction traps (#NM) */
+static inline void stts(fpu_cpu_t *fc) {
+    if (g_kernel_mode && !fc->ts) {
+        unsigned long cr0;
+        __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+        __asm__ volatile("mov %0, %%cr0" :: "r"(cr0 | X86_CR0_TS) : "memory");
+    }
+    fc->ts = true;
+}
+
+static inline void clts(fpu_cpu_t *fc) {
+    if (g_kernel_mode) __asm__ volatile("clts" ::: "memory");
+    fc->ts = false;
+}
+
+static void fpu_save(fpu_t *fpu) {
+    uint32_t lo = (uint32_t)g_xfeatures, hi = (uint32_t)(g_xfeatures >> 32);
+
+    switch (g_fpu_mode) {
+    case FPU_XSAVES:
+        __asm__ volatile("xsaves64 %0" : "+m"(*(char (*)[g_fpu_size])fpu->state) : "a"(lo), "d"(hi));
+        break;
+    case FPU_XSAVEOPT:
+        __asm__ volatile("xsaveopt64 %0" : "+m"(*(char (*)[g_fpu_size])fpu->state) : "a"(lo), "d"(hi));
+        break;
+    case FPU_XSAVE:
+        __asm__ volatile("xsave64 %0" : "+m"(*(char (*)[g_fpu_size])fpu->state) : "a"(lo), "d"(hi));
+        break;
+    case FPU_FXSAVE:
+        __asm__ volatile("fxsave64 %0" : "=m"(*(char (*)[FXSAVE_SIZE])fpu->state));
+        break;
+    }
+}
+
+static void fpu_restore(fpu_t *fpu) {
+    uint32_t lo = (uint32_t)g_xfeatures, hi = (uint32_t)(g_xfeatures >> 32);
+
+    switch (g_fpu_mode) {
+    case FPU_XSAVES:
+        __asm__ volatile("xrstors64 %0" :: "m"(*(char (*)[g_fpu_size])fpu->state), "a"(lo), "d"(hi));
+        break;
+    case FPU_XSAVEOPT:
+    case FPU_XSAVE:
+        __asm__ volatile("xrstor64 %0" :: "m"(*(char (*)[g_fpu_size])fpu->state), "a"(lo), "d"(hi));
+        break;
+    case FPU_FXSAVE:
+        __asm__ volatile("fxrstor64 %0" :: "m"(*(char (*)[FXSAVE_SIZE])fpu->state));
+        break;
+    }
+}
+
+/*
+ * Initial state: control words at their defaults, and an XSAVE header
+ * with every component in its init state so XRSTOR zeroes the rest.
+ */
+static int fpu_alloc_state(fpu_t *fpu) {
+    /* kmalloc objects of 64 bytes and up are 64-byte aligned, as XSAVE needs */
+    uint8_t *state = kmalloc(g_fpu_size, GFP_KERNEL);
+    if (!state) return -ENOMEM;
+    memset(state, 0, g_fpu_size);
+
+    uint16_t fcw = FCW_DEFAULT;
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    memcpy(state, &fcw, sizeof(fcw));
+    memcpy(state + 24, &mxcsr, sizeof(mxcsr));
+    if (g_fpu_mode == FPU_XSAVES) {
+        uint64_t xcomp_bv = XCOMP_BV_COMPACTED | g_xfeatures;
+        memcpy(state + XSAVE_HDR_OFFSET + 8, &xcomp_bv, sizeof(xcomp_bv));
+    }
+    fpu->state = state;
+    return 0;
+}
+
+/**
+ * Give thread the FPU on this CPU: what the #NM handler does. The
+ * registers are restored only if another thread's state, or none, is
+ * live here; a thread that is the last owner just gets TS cleared.
+ */
+int fpu_activate(thread_struct_t *thread) {
+    fpu_t *fpu = &thread->fpu;
+    if (fpu->active) return 0;
+
+    unsigned int cpu = smp_processor_id();
+    fpu_cpu_t *fc = &g_fpu_cpu[cpu];
+
+    if (!fpu->state) {
+        int ret = fpu_alloc_state(fpu);
+        if (ret < 0) return ret;
+    }
+    fc->stats.traps++;
+    clts(fc);
+    if (fc->owner == fpu && fpu->last_cpu == cpu) {
+        fc->stats.lazy_hits++;
+    } else {
+        fpu_restore(fpu);
+        fc->owner = fpu;
+        fpu->last_cpu = cpu;
+        fc->stats.restores++;
+    }
+    fpu->active = true;
+    return 0;
+}
+
+/* Drop thread's FPU state, e.g. when it exits */
+void fpu_release(thread_struct_t *thread) {
+    fpu_t *fpu = &thread->fpu;
+
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        fpu_t *owner = fpu;
+        __atomic_compare_exchange_n(&g_fpu_cpu[cpu].owner, &owner, NULL, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    kfree(fpu->state);
+    fpu->state = NULL;
+    fpu->active = false;
+}
+
+/* #NM: the current thread touched the FPU with TS set */
+static irqreturn_t fpu_nm_interrupt(unsigned int vector, void *dev) {
+    (void)vector;
+    (void)dev;
+    thread_struct_t *thread = g_fpu_cpu[smp_processor_id()].current;
+    if (!thread || fpu_activate(thread) < 0)
+        pr_panic("FPU used with no thread state to restore\n");
+    return IRQ_HANDLED;
+}
+
+/*
+ * Pick the save instruction and, in ring 0, turn on the state it needs:
+ * CR4.OSFXSR for SSE, CR4.OSXSAVE and XCR0 for XSAVE. Hosted builds
+ * inherit whatever the host enabled.
+ */
+void fpu_init(void) {
+    uint32_t a, b, c, d;
+    uint16_t cs;
+
+    if (g_fpu_ready) return;
+    __asm__ volatile("mov %%cs, %0" : "=r"(cs));
+    g_kernel_mode = (cs & 3) == 0;
+
+    cpuid_count(1, 0, &a, &b, &c, &d);
+    bool has_xsave = c & (1U << 26);
+
+    if (g_kernel_mode) {
+        unsigned long cr4 = read_cr4() | X86_CR4_OSFXSR | X86_CR4_OSXMMEXCPT;
+        if (has_xsave) cr4 |= X86_CR4_OSXSAVE;
+        write_cr4(cr4);
+        if (has_xsave) {
+            cpuid_count(0xd, 0, &a, &b, &c, &d);
+            xsetbv(0, XFEATURE_MASK_FPSSE | (a & XFEATURE_MASK_YMM));
+        }
+    } else {
+        cpuid_count(1, 0, &a, &b, &c, &d);
+        has_xsave = has_xsave && (c & (1U << 27));      /* OSXSAVE */
+    }
+
+    g_fpu_mode = FPU_FXSAVE;
+    g_xfeatures = XFEATURE_MASK_FPSSE;
+    g_fpu_size = FXSAVE_SIZE;
+    if (has_xsave) {
+        g_xfeatures = xgetbv(0);
+        cpuid_count(0xd, 0, &a, &b, &c, &d);
+        g_fpu_size = b;                 /* Standard format, for what XCR0 enables */
+        cpuid_count(0xd, 1, &a, &b, &c, &d);
+        if (g_kernel_mode && (a & (1U << 3))) {
+            g_fpu_mode = FPU_XSAVES;
+            g_fpu_size = b;             /* Compacted format */
+        } else {
+            g_fpu_mode = (a & 1U) ? FPU_XSAVEOPT : FPU_XSAVE;
+        }
+    }
+
+    if (g_kernel_mode && request_irq(NM_VECTOR, fpu_nm_interrupt, "fpu", NULL) < 0)
+        pr_panic("Cannot register the #NM handler\n");
+    g_fpu_ready = true;
+    pr_debug("FPU: %s, %zu-byte state, features %#llx\n", g_fpu_mode_names[g_fpu_mode],
+             g_fpu_size, (unsigned long long)g_xfeatures);
+}
+
+const char *fpu_mode_name(void) {
+    return g_fpu_mode_names[g_fpu_mode];
+}
+
+size_t fpu_state_size(void) {
+    return g_fpu_size;
+}
+
+void fpu_get_stats(unsigned int cpu, fpu_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (cpu < NR_CPUS) *stats = g_fpu_cpu[cpu].stats;
+}
+
+/* ============================================================================
+ * Switch
+ * ============================================================================ */
+
+/**
+ * Switch this CPU from prev to next. prev's FPU state is saved only if
+ * it used the FPU during this slice; the registers stay live, so prev
+ * gets them back for free if nobody else takes the FPU before it runs
+ * again. Returns when something switches back to prev.
+ */
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+void switch_to(thread_struct_t *prev, thread_struct_t *next) {
+    fpu_cpu_t *fc = &g_fpu_cpu[smp_processor_id()];
+
+    /* Hosted builds leave FS alone: the host's own TLS lives there */
+    if (g_kernel_mode && prev->fsbase != next->fsbase) wrmsr(MSR_FS_BASE, next->fsbase);
+
+    if (prev->fpu.active) {
+        fpu_save(&prev->fpu);
+        prev->fpu.active = false;
+        fc->stats.saves++;
+    }
+    stts(fc);
+    fc->current = next;
+    fc->stats.switches++;
+    __switch_to_asm(&prev->sp, next->sp);
+}
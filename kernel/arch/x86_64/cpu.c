@@ -1,9 +1,87 @@
 /**
  * x86-64 CPU initialization
+ *
+ * Points every IDT vector at its entry stub (interrupts.s) as a ring-0
+ * interrupt gate, so all of them land in do_IRQ(). The legacy PICs are
+ * remapped clear of the exception vectors and masked: external
+ * interrupts come through the local APIC. The GDT is still the boot
+ * loader's, and there is no TSS yet.
+ *
+ * Outside ring 0 (the hosted harness) lidt, port I/O and sti would
+ * fault, so there is nothing to set up: the host raises no hardware
+ * interrupts, and irq_deliver() calls do_IRQ() directly.
  */
 
+#include <kernel.h>
+
+#define IDT_INTERRUPT_GATE  0x8E    /* Present, DPL 0, 64-bit interrupt gate */
+
+#define PIC1_CMD            0x20
+#define PIC1_DATA           0x21
+#define PIC2_CMD            0xA0
+#define PIC2_DATA           0xA1
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t reserved;
+} __attribute__((packed)) idt_entry_t;
+
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) idt_ptr_t;
+
+extern const uint64_t interrupt_stubs[NR_VECTORS];
+
+static idt_entry_t g_idt[NR_VECTORS] __attribute__((aligned(16)));
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ volatile("outb %0, %1" :: "a"(val), "Nd"(port));
+}
+
+static void set_idt_gate(unsigned int vector, uint64_t handler, uint16_t selector) {
+    idt_entry_t *e = &g_idt[vector];
+    e->offset_low = (uint16_t)handler;
+    e->selector = selector;
+    e->ist = 0;
+    e->type_attr = IDT_INTERRUPT_GATE;
+    e->offset_mid = (uint16_t)(handler >> 16);
+    e->offset_high = (uint32_t)(handler >> 32);
+    e->reserved = 0;
+}
+
+/* ICW1-4: cascade, vectors 0x20-0x2f, 8086 mode; then mask every line */
+static void pic_disable(void) {
+    outb(PIC1_CMD, 0x11);
+    outb(PIC2_CMD, 0x11);
+    outb(PIC1_DATA, FIRST_EXTERNAL_VECTOR);
+    outb(PIC2_DATA, FIRST_EXTERNAL_VECTOR + 8);
+    outb(PIC1_DATA, 0x04);
+    outb(PIC2_DATA, 0x02);
+    outb(PIC1_DATA, 0x01);
+    outb(PIC2_DATA, 0x01);
+    outb(PIC1_DATA, 0xff);
+    outb(PIC2_DATA, 0xff);
+}
+
 void init_cpu_x86_64(void) {
-    /* TODO: Setup GDT, IDT, TSS */
+    uint16_t cs;
+    __asm__ volatile("mov %%cs, %0" : "=r"(cs));
+    if ((cs & 3) != 0) return;
+
+    for (unsigned int vector = 0; vector < NR_VECTORS; vector++)
+        set_idt_gate(vector, interrupt_stubs[vector], cs);
+
+    idt_ptr_t idtr = { .limit = sizeof(g_idt) - 1, .base = (uint64_t)(uintptr_t)g_idt };
+    __asm__ volatile("lidt %0" :: "m"(idtr));
+
+    pic_disable();
+    __asm__ volatile("sti");
 }
 
 void halt(void) {
@@ -1,9 +1,89 @@
 # x86-64 interrupt handlers
+#
+# One stub per vector. Stubs for vectors where the CPU does not push an
+# error code push a zero in its place, then every stub pushes its vector
+# and joins interrupt_common. That saves the general-purpose registers,
+# which completes a pt_regs frame on the stack, calls do_IRQ(regs), then
+# restores and returns with iretq.
+#
+# Everything runs at ring 0 for now, so there is no swapgs.
 
 .section .text
+.altmacro
 
-.global interrupt_handler
+.macro IRQ_STUB vec
+    .align 16
+irq_stub_\vec:
+    .if (\vec == 8) || ((\vec >= 10) && (\vec <= 14)) || (\vec == 17) || (\vec == 21) || (\vec == 29) || (\vec == 30)
+    .else
+    pushq $0                    # No error code from the CPU
+    .endif
+    pushq $\vec
+    jmp interrupt_common
+.endm
 
-interrupt_handler:
-    # TODO: Save registers, call C handler
-    ret
+.macro IRQ_STUB_ADDR vec
+    .quad irq_stub_\vec
+.endm
+
+.set vec, 0
+.rept 256
+    IRQ_STUB %vec
+    .set vec, vec + 1
+.endr
+
+interrupt_common:
+    cld
+    pushq %rdi
+    pushq %rsi
+    pushq %rdx
+    pushq %rcx
+    pushq %rax
+    pushq %r8
+    pushq %r9
+    pushq %r10
+    pushq %r11
+    pushq %rbx
+    pushq %rbp
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+
+    movq %rsp, %rdi             # pt_regs *
+    movq %rsp, %rbx             # Callee-saved: survives the call
+    andq $-16, %rsp             # SysV ABI stack alignment
+    call do_IRQ
+    movq %rbx, %rsp
+
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbp
+    popq %rbx
+    popq %r11
+    popq %r10
+    popq %r9
+    popq %r8
+    popq %rax
+    popq %rcx
+    popq %rdx
+    popq %rsi
+    popq %rdi
+    addq $16, %rsp              # Vector and error code
+    iretq
+
+# Stub addresses, indexed by vector, for the IDT. Absolute pointers need
+# relocating in a PIE, so the table is relro data, not .rodata.
+.section .data.rel.ro, "aw"
+.align 8
+.global interrupt_stubs
+interrupt_stubs:
+.set vec, 0
+.rept 256
+    IRQ_STUB_ADDR %vec
+    .set vec, vec + 1
+.endr
+
+.section .note.GNU-stack, "", @progbits
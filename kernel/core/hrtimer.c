@@ -0,0 +1,198 @@
+/**
+ * High-resolution timers
+ *
+ * Each CPU keeps its armed hrtimers in a red-black tree ordered by
+ * expiry, with the leftmost node cached, and its clock event device is
+ * always programmed for that leftmost expiry. hrtimer_interrupt() runs
+ * everything that is due and reprograms it. In hosted builds the clock
+ * event is a deadline that tick_poll() compares against the clock.
+ *
+ * A callback runs with its base unlocked and base->running pointing at
+ * it, so hrtimer_cancel() can wait for it to finish. A timer whose
+ * callback is running is never moved to another CPU.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+#define HRTIMER_MIGRATING   NR_CPUS     /* timer->cpu while changing bases */
+
+typedef struct {
+    spinlock_t lock;
+    rb_root_cached_t active;
+    hrtimer_t *running;             /* Callback in progress */
+    uint64_t next_event;            /* Clock event deadline, KTIME_MAX if none */
+} __attribute__((aligned(64))) hrtimer_cpu_base_t;
+
+static hrtimer_cpu_base_t g_hrtimer_bases[NR_CPUS] = {
+    [0 ... NR_CPUS - 1] = { .next_event = KTIME_MAX },
+};
+
+void hrtimer_init(hrtimer_t *timer, hrtimer_restart_t (*function)(hrtimer_t *timer)) {
+    memset(timer, 0, sizeof(*timer));
+    timer->function = function;
+    timer->cpu = smp_processor_id();
+}
+
+/* Lock the base timer is on, following it if it moves under us */
+static hrtimer_cpu_base_t *lock_hrtimer_base(hrtimer_t *timer) {
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&timer->cpu, __ATOMIC_ACQUIRE);
+        if (cpu < NR_CPUS) {
+            hrtimer_cpu_base_t *base = &g_hrtimer_bases[cpu];
+            spin_lock(&base->lock);
+            if (__atomic_load_n(&timer->cpu, __ATOMIC_RELAXED) == cpu)
+                return base;
+            spin_unlock(&base->lock);
+        }
+        cpu_relax();
+    }
+}
+
+/* Program the clock event for the earliest timer */
+static void hrtimer_reprogram(hrtimer_cpu_base_t *base) {
+    rb_node_t *first = base->active.rb_leftmost;
+    uint64_t next = first ? rb_entry(first, hrtimer_t, node)->expires : KTIME_MAX;
+    __atomic_store_n(&base->next_event, next, __ATOMIC_RELEASE);
+}
+
+static void enqueue_hrtimer(hrtimer_t *timer, hrtimer_cpu_base_t *base) {
+    rb_node_t **link = &base->active.rb_root.rb_node, *parent = NULL;
+    bool leftmost = true;
+
+    /* Equal expiries go right, so they fire in the order they were armed */
+    while (*link) {
+        parent = *link;
+        if (timer->expires < rb_entry(parent, hrtimer_t, node)->expires) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
+    }
+    rb_link_node(&timer->node, parent, link);
+    rb_insert_color_cached(&timer->node, &base->active, leftmost);
+    __atomic_store_n(&timer->state, HRTIMER_STATE_ENQUEUED, __ATOMIC_RELAXED);
+}
+
+static void remove_hrtimer(hrtimer_t *timer, hrtimer_cpu_base_t *base) {
+    rb_erase_cached(&timer->node, &base->active);
+    __atomic_store_n(&timer->state, HRTIMER_STATE_INACTIVE, __ATOMIC_RELAXED);
+}
+
+/* (Re)arm timer for an absolute expiry on cpu */
+void hrtimer_start_on(hrtimer_t *timer, uint64_t expires, unsigned int cpu) {
+    hrtimer_cpu_base_t *base = lock_hrtimer_base(timer);
+    hrtimer_cpu_base_t *new_base = &g_hrtimer_bases[cpu];
+
+    if (timer->state == HRTIMER_STATE_ENQUEUED) remove_hrtimer(timer, base);
+    timer->expires = expires;
+
+    if (base != new_base && base->running != timer) {
+        hrtimer_reprogram(base);
+        __atomic_store_n(&timer->cpu, HRTIMER_MIGRATING, __ATOMIC_RELEASE);
+        spin_unlock(&base->lock);
+        base = new_base;
+        spin_lock(&base->lock);
+        __atomic_store_n(&timer->cpu, cpu, __ATOMIC_RELEASE);
+    }
+    enqueue_hrtimer(timer, base);
+    hrtimer_reprogram(base);
+    spin_unlock(&base->lock);
+}
+
+void hrtimer_start(hrtimer_t *timer, uint64_t time, int mode) {
+    uint64_t expires = mode == HRTIMER_MODE_REL ? ktime_get_ns() + time : time;
+    if (expires < time) expires = KTIME_MAX;
+    hrtimer_start_on(timer, expires, smp_processor_id());
+}
+
+/* 1 if it was armed, 0 if not, -1 if its callback is running */
+int hrtimer_try_to_cancel(hrtimer_t *timer) {
+    hrtimer_cpu_base_t *base = lock_hrtimer_base(timer);
+    int ret = -1;
+
+    if (base->running != timer) {
+        ret = timer->state == HRTIMER_STATE_ENQUEUED;
+        if (ret) {
+            remove_hrtimer(timer, base);
+            hrtimer_reprogram(base);
+        }
+    }
+    spin_unlock(&base->lock);
+    return ret;
+}
+
+/* Disarm timer and wait out a running callback */
+int hrtimer_cancel(hrtimer_t *timer) {
+    for (;;) {
+        int ret = hrtimer_try_to_cancel(timer);
+        if (ret >= 0) return ret;
+        cpu_relax();
+    }
+}
+
+/* Push an expired timer's expiry past now in whole intervals; returns how many */
+uint64_t hrtimer_forward(hrtimer_t *timer, uint64_t now, uint64_t interval) {
+    if (now < timer->expires) return 0;
+    uint64_t overruns = (now - timer->expires) / interval + 1;
+    timer->expires += overruns * interval;
+    return overruns;
+}
+
+uint64_t hrtimer_next_event(unsigned int cpu) {
+    return __atomic_load_n(&g_hrtimer_bases[cpu].next_event, __ATOMIC_ACQUIRE);
+}
+
+/* Clock event handler: run this CPU's expired timers, then reprogram */
+void hrtimer_interrupt(void) {
+    hrtimer_cpu_base_t *base = &g_hrtimer_bases[smp_processor_id()];
+    uint64_t now = ktime_get_ns();
+    rb_node_t *node;
+
+    spin_lock(&base->lock);
+    while ((node = base->active.rb_leftmost)) {
+        hrtimer_t *timer = rb_entry(node, hrtimer_t, node);
+        if (timer->expires > now) break;
+
+        remove_hrtimer(timer, base);
+        base->running = timer;
+        spin_unlock(&base->lock);
+        hrtimer_restart_t restart = timer->function(timer);
+        spin_lock(&base->lock);
+
+        /* Unless the callback re-armed it itself; it cannot have moved */
+        if (restart == HRTIMER_RESTART && timer->state == HRTIMER_STATE_INACTIVE)
+            enqueue_hrtimer(timer, base);
+        base->running = NULL;
+    }
+    hrtimer_reprogram(base);
+    spin_unlock(&base->lock);
+}
+
+typedef struct {
+    hrtimer_t timer;
+    uint32_t done;
+} hrtimer_sleeper_t;
+
+static hrtimer_restart_t hrtimer_wakeup(hrtimer_t *timer) {
+    hrtimer_sleeper_t *sleeper = (hrtimer_sleeper_t *)timer;
+    __atomic_store_n(&sleeper->done, 1, __ATOMIC_RELEASE);
+    return HRTIMER_NORESTART;
+}
+
+/* Sleep for *req: arm a timer on this CPU and idle it until the timer fires */
+int do_nanosleep(const timespec_t *req) {
+    if (!req || req->nsec >= NSEC_PER_SEC) return -EINVAL;
+
+    hrtimer_sleeper_t sleeper;
+    hrtimer_init(&sleeper.timer, hrtimer_wakeup);
+    sleeper.done = 0;
+    hrtimer_start(&sleeper.timer, req->sec * NSEC_PER_SEC + req->nsec, HRTIMER_MODE_REL);
+    wq_worker_sleeping();
+    while (!__atomic_load_n(&sleeper.done, __ATOMIC_ACQUIRE))
+        cpu_idle();
+    wq_worker_running();
+    hrtimer_cancel(&sleeper.timer);
+    return 0;
+}
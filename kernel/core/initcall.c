@@ -0,0 +1,248 @@
+/**
+ * Initcalls
+ *
+ * Boot as a dependency graph. Each step lists the steps it needs by
+ * name; initcalls_run() checks the graph (names unique, every dependency
+ * known, no cycles, nothing waiting on an INITCALL_NOWAIT step), then
+ * queues every step with no dependencies on an unbound workqueue. A step
+ * that finishes counts down each of its dependents, and the one that
+ * takes a dependent's count to zero queues it, so there is no central
+ * scheduler: independent chains (filesystem registration, driver
+ * probing) simply run side by side on the pool's workers.
+ *
+ * The caller sleeps on a futex until every waited-for step is done.
+ * INITCALL_NOWAIT steps (TSC calibration) keep running after that; the
+ * report shows them as running until they finish.
+ *
+ * initcall.serial=1 runs the same graph in a topological order on the
+ * calling thread, waiting for everything, which is how boot went before
+ * and what the parallel run is measured against. initcall_debug=1 logs
+ * each step's return value and run time as it finishes.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+#define INITCALL_MAX        64
+
+typedef struct {
+    work_struct_t work;
+    const initcall_t *call;
+    uint32_t pending;               /* Dependencies not yet finished */
+    bool dep_failed;                /* One of them failed or was skipped */
+    unsigned int ndependents;
+    uint8_t dependents[INITCALL_MAX];
+    initcall_record_t rec;
+} initcall_node_t;
+
+static struct {
+    spinlock_t lock;                /* Guards running */
+    bool running;
+    workqueue_t *wq;
+    initcall_node_t nodes[INITCALL_MAX];
+    uint8_t order[INITCALL_MAX];    /* Topological */
+    unsigned int nr;
+    bool serial;
+    uint64_t base_ns;
+    uint64_t wall_ns;
+    uint32_t outstanding;           /* Futex word: waited-for steps not finished */
+    uint32_t live;                  /* Steps of the last run not finished */
+    bool debug;                     /* initcall_debug=1: log each step as it finishes */
+} g_initcalls = { .lock = SPINLOCK_INIT };
+
+static uint64_t initcall_now(void) {
+    return ktime_get_ns() - g_initcalls.base_ns;
+}
+
+static void initcall_ready(initcall_node_t *node);
+
+/* Run (or skip) one step, then release its dependents */
+static void initcall_exec(initcall_node_t *node) {
+    const initcall_t *call = node->call;
+
+    node->rec.cpu = smp_processor_id();
+    node->rec.start_ns = initcall_now();
+    if (__atomic_load_n(&node->dep_failed, __ATOMIC_ACQUIRE)) {
+        node->rec.ret = -ECANCELED;
+        printk(LOGLEVEL_WARNING, "initcall %s skipped: a dependency failed\n", call->name);
+    } else {
+        node->rec.ret = call->fn();
+        if (node->rec.ret > 0) node->rec.ret = 0;
+    }
+    node->rec.end_ns = initcall_now();
+    if (node->rec.ret < 0 && node->rec.ret != -ECANCELED) {
+        if (call->flags & INITCALL_FATAL)
+            pr_panic("initcall %s failed: %d\n", call->name, node->rec.ret);
+        pr_err("initcall %s failed: %d\n", call->name, node->rec.ret);
+    }
+    if (g_initcalls.debug)
+        pr_info("initcall %s returned %d after %llu us on CPU %u\n", call->name, node->rec.ret,
+                (unsigned long long)((node->rec.end_ns - node->rec.start_ns) / 1000), node->rec.cpu);
+    __atomic_store_n(&node->rec.done, true, __ATOMIC_RELEASE);
+
+    for (unsigned int i = 0; i < node->ndependents; i++) {
+        initcall_node_t *dep = &g_initcalls.nodes[node->dependents[i]];
+        if (node->rec.ret < 0) __atomic_store_n(&dep->dep_failed, true, __ATOMIC_RELEASE);
+        if (__atomic_sub_fetch(&dep->pending, 1, __ATOMIC_ACQ_REL) == 0 && !g_initcalls.serial)
+            initcall_ready(dep);
+    }
+    if (!(call->flags & INITCALL_NOWAIT) &&
+        __atomic_sub_fetch(&g_initcalls.outstanding, 1, __ATOMIC_ACQ_REL) == 0)
+        futex_wake(&g_initcalls.outstanding, 1);
+    __atomic_sub_fetch(&g_initcalls.live, 1, __ATOMIC_RELEASE);
+}
+
+static void initcall_work_fn(work_struct_t *work) {
+    initcall_exec((initcall_node_t *)work);     /* work comes first */
+}
+
+static void initcall_ready(initcall_node_t *node) {
+    node->rec.ready_ns = initcall_now();
+    queue_work(g_initcalls.wq, &node->work);
+}
+
+static int initcall_find(const initcall_t *calls, size_t n, const char *name) {
+    for (size_t i = 0; i < n; i++)
+        if (strcmp(calls[i].name, name) == 0) return (int)i;
+    return -1;
+}
+
+/* Build the graph and a topological order (Kahn); -EINVAL if it is not a DAG */
+static int initcall_build(const initcall_t *calls, size_t n) {
+    uint32_t indeg[INITCALL_MAX];
+    unsigned int head = 0, tail = 0;
+
+    memset(g_initcalls.nodes, 0, sizeof(g_initcalls.nodes));
+    for (size_t i = 0; i < n; i++) {
+        initcall_node_t *node = &g_initcalls.nodes[i];
+        node->call = &calls[i];
+        node->rec.name = calls[i].name;
+        if (initcall_find(calls, i, calls[i].name) >= 0) {
+            pr_err("initcall %s defined twice\n", calls[i].name);
+            return -EINVAL;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (unsigned int d = 0; d < INITCALL_MAX_DEPS && calls[i].deps[d]; d++) {
+            int j = initcall_find(calls, n, calls[i].deps[d]);
+            if (j < 0 || (calls[j].flags & INITCALL_NOWAIT)) {
+                pr_err("initcall %s: cannot depend on %s\n", calls[i].name, calls[i].deps[d]);
+                return -EINVAL;
+            }
+            initcall_node_t *dep = &g_initcalls.nodes[j];
+            dep->dependents[dep->ndependents++] = (uint8_t)i;
+            g_initcalls.nodes[i].pending++;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        indeg[i] = g_initcalls.nodes[i].pending;
+        if (!indeg[i]) g_initcalls.order[tail++] = (uint8_t)i;
+    }
+    while (head < tail) {
+        const initcall_node_t *node = &g_initcalls.nodes[g_initcalls.order[head++]];
+        for (unsigned int k = 0; k < node->ndependents; k++)
+            if (--indeg[node->dependents[k]] == 0) g_initcalls.order[tail++] = node->dependents[k];
+    }
+    if (tail != n) {
+        pr_err("initcalls: dependency cycle\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Run calls[0..n) in dependency order; returns once all but the
+ * INITCALL_NOWAIT ones have finished. -EBUSY while a step of an earlier
+ * run is still going, -EINVAL for a malformed graph (nothing runs).
+ */
+int initcalls_run(const initcall_t *calls, size_t n) {
+    if (n > INITCALL_MAX) return -EINVAL;
+
+    spin_lock(&g_initcalls.lock);
+    bool busy = g_initcalls.running || __atomic_load_n(&g_initcalls.live, __ATOMIC_ACQUIRE);
+    g_initcalls.running = true;
+    spin_unlock(&g_initcalls.lock);
+    if (busy) return -EBUSY;
+
+    int ret = initcall_build(calls, n);
+    if (ret < 0) {
+        g_initcalls.nr = 0;
+        goto out;
+    }
+    g_initcalls.nr = (unsigned int)n;
+
+    char val[8];
+    g_initcalls.serial = boot_param("initcall.serial", val, sizeof(val)) && strcmp(val, "0") != 0;
+    g_initcalls.debug = boot_param("initcall_debug", val, sizeof(val)) && strcmp(val, "0") != 0;
+    if (!g_initcalls.serial && !g_initcalls.wq) {
+        /* Kept across runs: a NOWAIT step may still be on it */
+        g_initcalls.wq = alloc_workqueue("initcall", WQ_UNBOUND, 0);
+        if (!g_initcalls.wq) g_initcalls.serial = true;
+    }
+
+    uint32_t waited = 0;
+    for (size_t i = 0; i < n; i++) {
+        init_work(&g_initcalls.nodes[i].work, initcall_work_fn);
+        if (!(calls[i].flags & INITCALL_NOWAIT)) waited++;
+    }
+    g_initcalls.outstanding = waited;
+    g_initcalls.live = (uint32_t)n;
+    g_initcalls.base_ns = ktime_get_ns();
+
+    if (g_initcalls.serial) {
+        for (size_t i = 0; i < n; i++) {
+            initcall_node_t *node = &g_initcalls.nodes[g_initcalls.order[i]];
+            node->rec.ready_ns = initcall_now();
+            initcall_exec(node);
+        }
+    } else {
+        /* The roots, before any of them can count a dependent down to zero */
+        initcall_node_t *roots[INITCALL_MAX];
+        unsigned int nroots = 0;
+        for (size_t i = 0; i < n; i++)
+            if (!g_initcalls.nodes[i].pending) roots[nroots++] = &g_initcalls.nodes[i];
+        for (unsigned int i = 0; i < nroots; i++)
+            initcall_ready(roots[i]);
+        uint32_t left;
+        while ((left = __atomic_load_n(&g_initcalls.outstanding, __ATOMIC_ACQUIRE)) != 0)
+            futex_wait(&g_initcalls.outstanding, left);
+    }
+    g_initcalls.wall_ns = initcall_now();
+out:
+    spin_lock(&g_initcalls.lock);
+    g_initcalls.running = false;
+    spin_unlock(&g_initcalls.lock);
+    return ret;
+}
+
+/* The last run's step at index; -ENOENT past the end */
+int initcall_get_record(unsigned int index, initcall_record_t *rec) {
+    if (index >= g_initcalls.nr) return -ENOENT;
+    const initcall_node_t *node = &g_initcalls.nodes[index];
+    *rec = node->rec;
+    rec->done = __atomic_load_n(&node->rec.done, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+void initcall_get_summary(initcall_summary_t *sum) {
+    uint64_t finish[INITCALL_MAX] = { 0 };
+
+    memset(sum, 0, sizeof(*sum));
+    sum->nr = g_initcalls.nr;
+    sum->serial = g_initcalls.serial;
+    sum->wall_ns = g_initcalls.wall_ns;
+    /* Longest path by run time, visiting the steps in topological order */
+    for (unsigned int k = 0; k < g_initcalls.nr; k++) {
+        unsigned int i = g_initcalls.order[k];
+        const initcall_node_t *node = &g_initcalls.nodes[i];
+        if (!__atomic_load_n(&node->rec.done, __ATOMIC_ACQUIRE)) continue;
+        uint64_t ran = node->rec.end_ns - node->rec.start_ns;
+        sum->busy_ns += ran;
+        finish[i] += ran;
+        if (!(node->call->flags & INITCALL_NOWAIT) && finish[i] > sum->critical_ns)
+            sum->critical_ns = finish[i];
+        for (unsigned int d = 0; d < node->ndependents; d++)
+            if (finish[i] > finish[node->dependents[d]]) finish[node->dependents[d]] = finish[i];
+    }
+}
@@ -1,10 +1,203 @@
 /**
  * Inter-process communication
+ *
+ * Pipes are a pair of files on one anonymous FIFO inode sharing a byte
+ * ring. Readers wait while the ring is empty and a writer remains;
+ * writers wait for room while a reader remains. Writes of PIPE_BUF bytes
+ * or less are never split. O_NONBLOCK files and IOCB_NOWAIT callers get
+ * -EAGAIN instead of waiting.
  */
 
 #include <kernel.h>
+#include <string.h>
+
+#define PIPE_ORDER  2                               /* 16 KiB ring */
+#define PIPE_SIZE   (PAGE_SIZE << PIPE_ORDER)
+#define PIPE_BUF    PAGE_SIZE                       /* Atomic write limit */
+
+typedef struct {
+    spinlock_t lock;
+    page_t *page;
+    char *buf;
+    size_t head, tail;      /* Free-running write and read counts */
+    int readers, writers;
+} pipe_inode_info_t;
+
+static const file_operations_t pipe_fops;
+
+static inline bool pipe_nowait(const kiocb_t *iocb) {
+    return (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+static int64_t __pipe_read(kiocb_t *iocb, iov_iter_t *iter) {
+    pipe_inode_info_t *pipe = iocb->ki_filp->inode->fs_data;
+    size_t done = 0;
+
+    if (iter->count == 0) return 0;
+    for (;;) {
+        spin_lock(&pipe->lock);
+        size_t avail = pipe->head - pipe->tail;
+        if (avail) {
+            size_t n = avail < iter->count ? avail : iter->count;
+            size_t off = pipe->tail & (PIPE_SIZE - 1);
+            size_t first = n < PIPE_SIZE - off ? n : PIPE_SIZE - off;
+            copy_to_iter(pipe->buf + off, first, iter);
+            copy_to_iter(pipe->buf, n - first, iter);
+            pipe->tail += n;
+            done = n;
+        }
+        bool eof = __atomic_load_n(&pipe->writers, __ATOMIC_ACQUIRE) == 0;
+        spin_unlock(&pipe->lock);
+
+        if (done || eof) return (int64_t)done;
+        if (pipe_nowait(iocb)) return -EAGAIN;
+        cond_resched();
+    }
+}
+
+static int64_t __pipe_write(kiocb_t *iocb, iov_iter_t *iter) {
+    pipe_inode_info_t *pipe = iocb->ki_filp->inode->fs_data;
+    size_t count = iter->count;
+    size_t done = 0;
+
+    while (done < count) {
+        spin_lock(&pipe->lock);
+        if (__atomic_load_n(&pipe->readers, __ATOMIC_ACQUIRE) == 0) {
+            spin_unlock(&pipe->lock);
+            return done ? (int64_t)done : -EPIPE;
+        }
+        size_t room = PIPE_SIZE - (pipe->head - pipe->tail);
+        size_t want = count - done;
+        if (room && (count > PIPE_BUF || room >= want)) {
+            size_t n = want < room ? want : room;
+            size_t off = pipe->head & (PIPE_SIZE - 1);
+            size_t first = n < PIPE_SIZE - off ? n : PIPE_SIZE - off;
+            copy_from_iter(pipe->buf + off, first, iter);
+            copy_from_iter(pipe->buf, n - first, iter);
+            pipe->head += n;
+            done += n;
+            spin_unlock(&pipe->lock);
+            continue;
+        }
+        spin_unlock(&pipe->lock);
+
+        if (pipe_nowait(iocb)) return done ? (int64_t)done : -EAGAIN;
+        cond_resched();
+    }
+    return (int64_t)done;
+}
+
+static int64_t pipe_read_iter(kiocb_t *iocb, iov_iter_t *iter) {
+    uint64_t start = trace_span_start(pipe_read);
+    size_t count = iter->count;
+    int64_t ret = __pipe_read(iocb, iter);
+    trace_pipe_read(iocb->ki_filp->inode->ino, count, ret, start);
+    return ret;
+}
+
+static int64_t pipe_write_iter(kiocb_t *iocb, iov_iter_t *iter) {
+    uint64_t start = trace_span_start(pipe_write);
+    size_t count = iter->count;
+    int64_t ret = __pipe_write(iocb, iter);
+    trace_pipe_write(iocb->ki_filp->inode->ino, count, ret, start);
+    return ret;
+}
+
+/* The last end to close frees the ring; the inode goes with its last file */
+static void pipe_release(inode_t *inode, file_t *file) {
+    pipe_inode_info_t *pipe = inode->fs_data;
+    int *ends = (file->f_flags & O_ACCMODE) == O_RDONLY ? &pipe->readers : &pipe->writers;
+
+    spin_lock(&pipe->lock);
+    __atomic_store_n(ends, *ends - 1, __ATOMIC_RELEASE);
+    bool last = pipe->readers == 0 && pipe->writers == 0;
+    spin_unlock(&pipe->lock);
+
+    if (last) {
+        page_free(pipe->page);
+        kfree(pipe);
+        inode->fs_data = NULL;
+    }
+}
+
+static const file_operations_t pipe_fops = {
+    .read_iter  = pipe_read_iter,
+    .write_iter = pipe_write_iter,
+    .release    = pipe_release,
+};
+
+/* Create a pipe and install its read and write ends as fds[0] and fds[1] */
+int do_pipe2(int fds[2], int flags) {
+    files_struct_t *files = current_files();
+    file_t *rfile = NULL, *wfile = NULL;
+    int ret = -ENOMEM;
+
+    if (!fds || (flags & ~O_NONBLOCK)) return -EINVAL;
+
+    pipe_inode_info_t *pipe = kmalloc(sizeof(*pipe), GFP_KERNEL);
+    inode_t *inode = new_inode(NULL);
+    page_t *page = page_alloc(PIPE_ORDER);
+    if (!pipe || !inode || !page) goto fail;
+
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->page = page;
+    pipe->buf = page_to_virt(page);
+    pipe->readers = pipe->writers = 1;
+    inode->mode = S_IFIFO | 0600;
+    inode->i_fop = &pipe_fops;
+    inode->fs_data = pipe;
+
+    /* One inode reference per end */
+    iget(inode);
+    rfile = alloc_file_pseudo(inode, O_RDONLY | flags, &pipe_fops);
+    if (!rfile) {
+        iput(inode);
+        goto fail;
+    }
+    inode = NULL;
+    wfile = alloc_file_pseudo(rfile->inode, O_WRONLY | flags, &pipe_fops);
+    if (!wfile) {
+        pipe->writers = 0;
+        iput(rfile->inode);
+        goto close;
+    }
+
+    int rfd = alloc_fd(files, 0), wfd = rfd < 0 ? rfd : alloc_fd(files, 0);
+    if (wfd < 0) {
+        if (rfd >= 0) put_unused_fd(files, (unsigned int)rfd);
+        ret = wfd;
+        goto close;
+    }
+    fd_install(files, (unsigned int)rfd, rfile);
+    fd_install(files, (unsigned int)wfd, wfile);
+    fds[0] = rfd;
+    fds[1] = wfd;
+    return 0;
+
+close:
+    if (wfile) fput(wfile);
+    fput(rfile);
+    return ret;
+fail:
+    if (page) page_free(page);
+    if (inode) iput(inode);
+    kfree(pipe);
+    return ret;
+}
 
 int pipe_create(pipe_t *read_fd, pipe_t *write_fd) {
-    /* TODO */
+    int fds[2];
+    int ret = do_pipe2(fds, 0);
+    if (ret < 0) return ret;
+    *read_fd = fds[0];
+    *write_fd = fds[1];
     return 0;
 }
+
+int pipe_write(pipe_t fd, const void *buf, size_t len) {
+    return (int)do_write(fd, buf, len);
+}
+
+int pipe_read(pipe_t fd, void *buf, size_t len) {
+    return (int)do_read(fd, buf, len);
+}
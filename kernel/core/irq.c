@@ -0,0 +1,204 @@
+/**
+ * Interrupt dispatch
+ *
+ * Each vector has a chain of irqactions; a shared vector calls each
+ * handler in turn until the chain ends. Chains are published with
+ * release stores and walked without a lock. free_irq() unlinks an
+ * action, then waits for dispatches already in flight on that vector
+ * before freeing it.
+ *
+ * Hosted builds stand in for the local APIC with a per-CPU interrupt
+ * request register (IRR). irq_inject() sets a vector's bit from any
+ * thread. irq_poll(), run by the target CPU, delivers pending vectors
+ * highest first. A vector injected again while still pending is
+ * delivered once, as with a real edge-triggered line.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+typedef struct irqaction {
+    irq_handler_t handler;
+    void *dev;
+    const char *name;
+    struct irqaction *next;
+} irqaction_t;
+
+typedef struct {
+    irqaction_t *action;
+    uint32_t active;                /* Dispatches in progress */
+} irq_desc_t;
+
+typedef struct {
+    uint64_t irr[NR_VECTORS / 64];  /* Written by injectors */
+} __attribute__((aligned(64))) irq_pending_t;
+
+typedef struct {
+    uint64_t count[NR_VECTORS];
+    uint64_t spurious;
+} __attribute__((aligned(64))) irq_stats_t;
+
+static irq_desc_t g_irq_desc[NR_VECTORS];
+static irq_pending_t g_irq_pending[NR_CPUS];
+static irq_stats_t g_irq_stats[NR_CPUS];
+static spinlock_t g_irq_lock;       /* Serialises request_irq/free_irq and vector allocation */
+
+/* Message-signalled vectors handed out to devices, and the CPU each is aimed at */
+static uint64_t g_vector_used[NR_VECTORS / 64];
+static uint8_t g_vector_cpu[NR_VECTORS];
+static unsigned int g_cpu_vectors[NR_CPUS];
+
+int request_irq(unsigned int vector, irq_handler_t handler, const char *name, void *dev) {
+    if (vector >= NR_VECTORS || !handler) return -EINVAL;
+
+    irqaction_t *action = kmalloc(sizeof(*action), GFP_KERNEL);
+    if (!action) return -ENOMEM;
+    action->handler = handler;
+    action->dev = dev;
+    action->name = name;
+    action->next = NULL;
+
+    /* Append, so handlers run in registration order */
+    spin_lock(&g_irq_lock);
+    irqaction_t **pp = &g_irq_desc[vector].action;
+    while (*pp)
+        pp = &(*pp)->next;
+    __atomic_store_n(pp, action, __ATOMIC_RELEASE);
+    spin_unlock(&g_irq_lock);
+    return 0;
+}
+
+void free_irq(unsigned int vector, void *dev) {
+    if (vector >= NR_VECTORS) return;
+    irq_desc_t *desc = &g_irq_desc[vector];
+    irqaction_t *action = NULL;
+
+    spin_lock(&g_irq_lock);
+    for (irqaction_t **pp = &desc->action; *pp; pp = &(*pp)->next) {
+        if ((*pp)->dev == dev) {
+            action = *pp;
+            __atomic_store_n(pp, action->next, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    spin_unlock(&g_irq_lock);
+    if (!action) return;
+
+    /* A dispatch that started before the unlink may still be in it */
+    while (__atomic_load_n(&desc->active, __ATOMIC_ACQUIRE))
+        cpu_relax();
+    kfree(action);
+}
+
+void do_IRQ(pt_regs_t *regs) {
+    unsigned int vector = (unsigned int)regs->vector % NR_VECTORS;
+    irq_desc_t *desc = &g_irq_desc[vector];
+    irq_stats_t *stats = &g_irq_stats[smp_processor_id()];
+    irqreturn_t ret = IRQ_NONE;
+
+    irq_enter();
+    __atomic_fetch_add(&stats->count[vector], 1, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&desc->active, 1, __ATOMIC_ACQUIRE);
+    for (irqaction_t *a = __atomic_load_n(&desc->action, __ATOMIC_ACQUIRE); a;
+         a = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE)) {
+        if (a->handler(vector, a->dev) == IRQ_HANDLED)
+            ret = IRQ_HANDLED;
+    }
+    __atomic_fetch_sub(&desc->active, 1, __ATOMIC_RELEASE);
+
+    if (ret == IRQ_NONE) {
+        if (vector < FIRST_EXTERNAL_VECTOR)
+            pr_panic("Unhandled exception %u at %#lx, error code %#lx\n", vector,
+                     (unsigned long)regs->rip, (unsigned long)regs->error_code);
+        __atomic_fetch_add(&stats->spurious, 1, __ATOMIC_RELAXED);
+    }
+    irq_exit();
+}
+
+/* Take vector on this CPU now, as if the hardware had raised it */
+void irq_deliver(unsigned int vector) {
+    pt_regs_t regs;
+    memset(&regs, 0, sizeof(regs));
+    regs.vector = vector;
+    do_IRQ(&regs);
+}
+
+void irq_inject(unsigned int cpu, unsigned int vector) {
+    if (cpu >= NR_CPUS || vector >= NR_VECTORS) return;
+    __atomic_fetch_or(&g_irq_pending[cpu].irr[vector / 64], 1ULL << (vector % 64),
+                      __ATOMIC_RELEASE);
+}
+
+/* Deliver this CPU's pending injected vectors, highest first; returns how many */
+unsigned int irq_poll(void) {
+    irq_pending_t *pending = &g_irq_pending[smp_processor_id()];
+    unsigned int delivered = 0;
+
+    for (int word = NR_VECTORS / 64 - 1; word >= 0; word--) {
+        if (!__atomic_load_n(&pending->irr[word], __ATOMIC_RELAXED)) continue;
+
+        uint64_t bits = __atomic_exchange_n(&pending->irr[word], 0, __ATOMIC_ACQUIRE);
+        while (bits) {
+            unsigned int bit = 63 - (unsigned int)__builtin_clzll(bits);
+            bits &= ~(1ULL << bit);
+            irq_deliver((unsigned int)word * 64 + bit);
+            delivered++;
+        }
+    }
+    return delivered;
+}
+
+/*
+ * Allocate a device vector and pick its CPU: *cpu if it names one, else
+ * (IRQ_ANY_CPU) the one with the fewest device vectors so far, so one
+ * device's queues and several devices' interrupts spread out instead of
+ * all landing on CPU 0. Returns the vector, -ENOSPC when none is left.
+ */
+int irq_alloc_vector(unsigned int *cpu) {
+    int vector = -ENOSPC;
+
+    spin_lock(&g_irq_lock);
+    for (unsigned int v = FIRST_DEVICE_VECTOR; v < LOCAL_TIMER_VECTOR; v++) {
+        if (!(g_vector_used[v / 64] & (1ULL << (v % 64)))) {
+            vector = (int)v;
+            break;
+        }
+    }
+    if (vector >= 0) {
+        unsigned int best = *cpu < NR_CPUS ? *cpu : 0;
+        for (unsigned int c = 1; *cpu >= NR_CPUS && c < NR_CPUS; c++)
+            if (g_cpu_vectors[c] < g_cpu_vectors[best]) best = c;
+        g_vector_used[vector / 64] |= 1ULL << (vector % 64);
+        g_vector_cpu[vector] = (uint8_t)best;
+        g_cpu_vectors[best]++;
+        *cpu = best;
+    }
+    spin_unlock(&g_irq_lock);
+    return vector;
+}
+
+void irq_free_vector(unsigned int vector) {
+    if (vector < FIRST_DEVICE_VECTOR || vector >= LOCAL_TIMER_VECTOR) return;
+    spin_lock(&g_irq_lock);
+    if (g_vector_used[vector / 64] & (1ULL << (vector % 64))) {
+        g_vector_used[vector / 64] &= ~(1ULL << (vector % 64));
+        g_cpu_vectors[g_vector_cpu[vector]]--;
+    }
+    spin_unlock(&g_irq_lock);
+}
+
+/* Counts for /proc/interrupts; -ENOENT for vectors without a handler */
+int irq_get_info(unsigned int vector, irq_info_t *info) {
+    if (vector >= NR_VECTORS) return -EINVAL;
+
+    spin_lock(&g_irq_lock);
+    irqaction_t *action = g_irq_desc[vector].action;
+    info->name = action ? action->name : NULL;
+    spin_unlock(&g_irq_lock);
+    if (!action) return -ENOENT;
+
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++)
+        info->count[cpu] = __atomic_load_n(&g_irq_stats[cpu].count[vector], __ATOMIC_RELAXED);
+    return 0;
+}
@@ -13,6 +13,49 @@ extern uint8_t __kernel_end[];
 extern uint8_t __bss_start[];
 extern uint8_t __bss_end[];
 
+extern int vfs_init(void);
+extern int register_ext4_fs(void);
+extern int register_tmpfs_fs(void);
+extern int register_procfs_fs(void);
+extern int console_driver_init(void);
+extern int block_driver_init(void);
+
+/* An invariant TSC is an upgrade, not a requirement */
+static int tsc_initcall(void) {
+    int ret = tsc_clocksource_init();
+    return ret == -ENODEV ? 0 : ret;
+}
+
+static int scheduler_initcall(void) {
+    extern int scheduler_init(void);
+    int ret = scheduler_init();
+    #ifdef __x86_64__
+    if (ret == 0) fpu_init();
+    #endif
+    return ret;
+}
+
+/*
+ * Everything after the workqueues, as init_scheduler(), init_vfs() and
+ * init_drivers() do it, with the order they imply spelled out. Driver
+ * probing and filesystem registration do not wait for each other, and
+ * nothing waits for TSC calibration.
+ */
+static const initcall_t g_boot_initcalls[] = {
+    { "tsc", tsc_initcall, { NULL }, INITCALL_NOWAIT },
+    { "trace", trace_init, { NULL }, 0 },
+    { "scheduler", scheduler_initcall, { NULL }, INITCALL_FATAL },
+    { "vfs", vfs_init, { NULL }, INITCALL_FATAL },
+    { "ext4", register_ext4_fs, { "vfs" }, 0 },
+    { "tmpfs", register_tmpfs_fs, { "vfs" }, 0 },
+    { "procfs", register_procfs_fs, { "vfs" }, 0 },
+    { "console", console_driver_init, { NULL }, 0 },
+    { "block", block_driver_init, { NULL }, 0 },
+    { "virtio-blk-model", virtio_blk_model_init, { NULL }, 0 },
+    { "pci", pci_scan_devices, { "virtio-blk-model" }, 0 },
+    { "virtio-blk", virtio_blk_init, { "pci", "block" }, 0 },
+};
+
 /**
  * kernel_main
  *
@@ -33,20 +76,25 @@ void kernel_main(void) {
     init_memory();
     pr_info("✓ Memory management initialized\n\n");
 
-    /* Initialize process scheduler */
-    pr_info("Initializing scheduler...\n");
-    init_scheduler();
-    pr_info("✓ Scheduler initialized\n\n");
-
-    /* Initialize virtual filesystem */
-    pr_info("Initializing VFS...\n");
-    init_vfs();
-    pr_info("✓ VFS initialized\n\n");
+    /* Publish the vvar page and start the tick; the TSC is calibrated later */
+    pr_info("Initializing timekeeping...\n");
+    init_time_early();
+    init_softirq();
+    init_timers();
+    init_workqueues();
+    /* Console output moves off the callers onto the flusher from here on */
+    printk_init();
+    pr_info("✓ Timekeeping initialized\n\n");
 
-    /* Initialize device drivers */
-    pr_info("Initializing drivers...\n");
-    init_drivers();
-    pr_info("✓ Drivers initialized\n\n");
+    /* The rest is a graph, run on the workqueues just started */
+    pr_info("Running initcalls...\n");
+    if (initcalls_run(g_boot_initcalls, sizeof(g_boot_initcalls) / sizeof(g_boot_initcalls[0])) < 0)
+        pr_panic("Boot initcalls are malformed\n");
+    initcall_summary_t sum;
+    initcall_get_summary(&sum);
+    pr_info("✓ %u initcalls in %llu us (%s; critical path %llu us, %llu us of work)\n\n",
+            sum.nr, (unsigned long long)(sum.wall_ns / 1000), sum.serial ? "serial" : "parallel",
+            (unsigned long long)(sum.critical_ns / 1000), (unsigned long long)(sum.busy_ns / 1000));
 
     /* Mount root filesystem */
     pr_info("Mounting root filesystem...\n");
@@ -59,6 +107,9 @@ void kernel_main(void) {
     }
     pr_info("✓ Root filesystem mounted\n\n");
 
+    if (mount_fs("proc", "/proc", "procfs") < 0)
+        pr_err("Failed to mount /proc\n");
+
     /* Create and start init process (PID 1) */
     pr_info("Forking init process...\n");
     pid_t init_pid = do_fork();
@@ -104,6 +155,17 @@ void init_cpu(void) {
     #endif
 }
 
+/* The emulated CPU the calling thread runs as; unbound threads are CPU 0 */
+static _Thread_local unsigned int g_this_cpu;
+
+unsigned int smp_processor_id(void) {
+    return g_this_cpu;
+}
+
+void cpu_bind(unsigned int cpu) {
+    g_this_cpu = cpu < NR_CPUS ? cpu : 0;
+}
+
 /**
  * init_memory
  *
@@ -112,6 +174,7 @@ void init_cpu(void) {
  * - Setup slab allocator
  * - Setup virtual memory areas (VMAs)
  * - Map kernel memory
+ * - Start kswapd
  */
 void init_memory(void) {
     /* Page allocator setup */
@@ -131,6 +194,12 @@ void init_memory(void) {
     if (mmap_init() < 0) {
         pr_panic("Memory mapping initialization failed\n");
     }
+
+    /* Background reclaim */
+    extern int kswapd_init(void);
+    if (kswapd_init() < 0) {
+        pr_panic("Cannot start kswapd\n");
+    }
 }
 
 /**
@@ -140,12 +209,16 @@ void init_memory(void) {
  * - Create idle task
  * - Setup run queue
  * - Setup load balancing (if SMP)
+ * - Pick the FPU save instruction for context switches
  */
 void init_scheduler(void) {
     extern int scheduler_init(void);
     if (scheduler_init() < 0) {
         pr_panic("Scheduler initialization failed\n");
     }
+    #ifdef __x86_64__
+    fpu_init();
+    #endif
 }
 
 /**
@@ -157,16 +230,11 @@ void init_scheduler(void) {
  * - Initialize inode/dentry caches
  */
 void init_vfs(void) {
-    extern int vfs_init(void);
     if (vfs_init() < 0) {
         pr_panic("VFS initialization failed\n");
     }
 
     /* Register built-in filesystems */
-    extern int register_ext4_fs(void);
-    extern int register_tmpfs_fs(void);
-    extern int register_procfs_fs(void);
-
     if (register_ext4_fs() < 0)
         pr_err("Failed to register ext4\n");
     if (register_tmpfs_fs() < 0)
@@ -185,9 +253,6 @@ void init_vfs(void) {
  * - Other platform devices
  */
 void init_drivers(void) {
-    extern int console_driver_init(void);
-    extern int block_driver_init(void);
-
     if (console_driver_init() < 0)
         pr_err("Console driver initialization failed\n");
 
@@ -195,21 +260,8 @@ void init_drivers(void) {
         pr_err("Block driver initialization failed\n");
 
     /* Detect and initialize PCI devices */
-    extern int pci_scan_devices(void);
+    virtio_blk_model_init();
     pci_scan_devices();
+    if (virtio_blk_init() < 0)
+        pr_err("virtio-blk driver initialization failed\n");
 }
-
-/**
- * pr_info, pr_err, pr_debug, pr_panic
- *
- * Kernel logging functions
- * Outputs to console during boot, to syslog later
- * 
- * These are defined in the test harness or bootloader
- */
-
-/* Declared but defined elsewhere */
-extern void pr_info(const char *fmt, ...);
-extern void pr_err(const char *fmt, ...);
-extern void pr_debug(const char *fmt, ...);
-extern void pr_panic(const char *fmt, ...);
@@ -8,192 +8,917 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-#define PAGE_SIZE 4096
-#define MAX_ORDER 10
-#define PHYS_MEM_SIZE (256 * 1024 * 1024)  /* 256 MB */
+#define PHYS_MEM_SIZE (256 * 1024 * 1024)  /* 256 MB unless mem= says otherwise */
 
-/* Buddy allocator */
-typedef struct free_block {
-    struct free_block *next;
-    unsigned int order;
-} free_block_t;
+/* Buddy allocator
+ *
+ * Every page frame has a page_t in mem_map. Free blocks are linked
+ * through their head descriptor (PG_buddy set, order recorded), so the
+ * buddy test is a descriptor lookup at pfn ^ (1 << order) and never
+ * touches the memory being managed.
+ *
+ * Memory is split into equal NUMA nodes (numa=fake=N, default one),
+ * each a whole number of max-order blocks with its own free lists,
+ * lock and pool. Buddies therefore never straddle nodes, and mem_map
+ * stays one array indexed by pfn.
+ *
+ * Each node is one zone with Linux's three watermarks. Allocations
+ * that would leave fewer than `low` pages free on every node they may
+ * use wake kswapd and may dip to `min`; below that, GFP_KERNEL callers
+ * reclaim for themselves and GFP_ATOMIC callers may use half of the
+ * reserve.
+ */
+#define MAX_RECLAIM_RETRIES 16
+#define MAX_BLOCK_PAGES     (1UL << (MAX_ORDER - 1))
+#define MIN_NODE_PAGES      (4 * MAX_BLOCK_PAGES)
+
+typedef struct {
+    page_t *free_lists[MAX_ORDER];
+    unsigned long nr_free[MAX_ORDER];
+    char *mem_pool;                 /* This node's memory */
+    unsigned long start_pfn;
+    unsigned long nr_pages;
+    unsigned long free_pages;
+    unsigned long watermark[NR_WMARK];
+    int host_node;                  /* Host node it is mbind()ed to, or -1 */
+    numa_stats_t stats;
+    spinlock_t lock;
+} __attribute__((aligned(64))) pg_data_t;
 
 typedef struct {
-    free_block_t *free_lists[MAX_ORDER];
-    void *mem_pool;
-    size_t mem_size;
-} buddy_allocator_t;
+    enum mempolicy_mode mode;
+    nodemask_t nodes;
+    unsigned int il_next;           /* Next interleave node */
+} mempolicy_t;
+
+static pg_data_t g_nodes[MAX_NUMNODES];
+static int g_nr_nodes = 1;
+static page_t *g_mem_map;
+static unsigned long g_nr_pages;
+static unsigned long g_node_pages;  /* Every node has this many */
+static _Thread_local mempolicy_t g_mempolicy;   /* Zeroed: MPOL_LOCAL */
+
+static inline pg_data_t *page_pgdat(const page_t *page) {
+    return &g_nodes[(unsigned long)(page - g_mem_map) / g_node_pages];
+}
+
+static void free_list_add(pg_data_t *node, page_t *page, unsigned int order) {
+    page->flags |= PG_buddy;
+    page->order = order;
+    page->prev = NULL;
+    page->next = node->free_lists[order];
+    if (page->next) page->next->prev = page;
+    node->free_lists[order] = page;
+    node->nr_free[order]++;
+}
 
-static buddy_allocator_t g_buddy;
+static void free_list_del(pg_data_t *node, page_t *page, unsigned int order) {
+    if (page->prev) page->prev->next = page->next;
+    else node->free_lists[order] = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->next = page->prev = NULL;
+    page->flags &= ~PG_buddy;
+    node->nr_free[order]--;
+}
 
-/* Initialize buddy allocator */
+static unsigned long int_sqrt(unsigned long x) {
+    unsigned long r = 0;
+    for (unsigned long bit = 1UL << 62; bit; bit >>= 2) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+    }
+    return r;
+}
+
+/*
+ * min_free_kbytes = sqrt(16 * memory in kB), shared out by node size;
+ * low and high follow at min/4 steps.
+ */
+static void setup_watermarks(void) {
+    unsigned long kb = g_nr_pages * (PAGE_SIZE / 1024);
+    unsigned long min_kb = int_sqrt(kb * 16);
+    if (min_kb < 128) min_kb = 128;
+    if (min_kb > 65536) min_kb = 65536;
+    unsigned long min_pages = min_kb / (PAGE_SIZE / 1024);
+
+    for (int nid = 0; nid < g_nr_nodes; nid++) {
+        pg_data_t *node = &g_nodes[nid];
+        unsigned long min = min_pages * node->nr_pages / g_nr_pages;
+        unsigned long step = min / 4;
+        if (step < node->nr_pages / 1000) step = node->nr_pages / 1000;
+        node->watermark[WMARK_MIN] = min;
+        node->watermark[WMARK_LOW] = min + step;
+        node->watermark[WMARK_HIGH] = min + 2 * step;
+    }
+}
+
+#ifdef __linux__
+#define HOST_MPOL_BIND              2
+#define HOST_MPOL_F_MEMS_ALLOWED    (1 << 2)
+#define HOST_MAX_NODES              256
+
+/*
+ * Bind a node's pool to a host node before anything touches it. Nodes
+ * are spread round-robin over the host nodes this process may use; on
+ * a one-node host they all share it. Returns the host node, or -1 if
+ * the host has no mbind().
+ */
+static int bind_node_memory(pg_data_t *node, int nid) {
+    unsigned long allowed[HOST_MAX_NODES / 64] = { 0 };
+    if (syscall(SYS_get_mempolicy, NULL, allowed, HOST_MAX_NODES, NULL,
+                HOST_MPOL_F_MEMS_ALLOWED) < 0)
+        return -1;
+
+    int nr_host = 0;
+    for (int i = 0; i < HOST_MAX_NODES / 64; i++)
+        nr_host += __builtin_popcountl(allowed[i]);
+    if (!nr_host) return -1;
+
+    int want = nid % nr_host, host = -1;
+    for (int n = 0; n < HOST_MAX_NODES && host < 0; n++) {
+        if ((allowed[n / 64] >> (n % 64)) & 1) {
+            if (want-- == 0) host = n;
+        }
+    }
+
+    unsigned long mask[HOST_MAX_NODES / 64] = { 0 };
+    mask[host / 64] = 1UL << (host % 64);
+    if (syscall(SYS_mbind, node->mem_pool, node->nr_pages * PAGE_SIZE, HOST_MPOL_BIND,
+                mask, HOST_MAX_NODES + 1, 0) < 0)
+        return -1;
+    return host;
+}
+#else
+static int bind_node_memory(pg_data_t *node, int nid) {
+    (void)node;
+    (void)nid;
+    return -1;
+}
+#endif
+
+/* mem= sets the total, numa=fake=N the node count; each node is rounded to whole blocks */
 int page_allocator_init(void) {
-    /* Allocate 256MB memory pool */
-    g_buddy.mem_pool = malloc(PHYS_MEM_SIZE);
-    if (!g_buddy.mem_pool) return -ENOMEM;
-    
-    g_buddy.mem_size = PHYS_MEM_SIZE;
-    
-    /* Initialize all free lists */
-    for (int i = 0; i < MAX_ORDER; i++) {
-        g_buddy.free_lists[i] = NULL;
-    }
-    
-    /* Add entire memory as one large block */
-    free_block_t *block = (free_block_t *)g_buddy.mem_pool;
-    block->order = MAX_ORDER - 1;
-    block->next = NULL;
-    g_buddy.free_lists[MAX_ORDER - 1] = block;
-    
+    char val[32];
+    uint64_t size = PHYS_MEM_SIZE;
+    int nr_nodes = 1;
+
+    if (boot_param("mem", val, sizeof(val))) size = memparse(val, NULL);
+    if (boot_param("numa", val, sizeof(val)) && !strncmp(val, "fake=", 5)) {
+        nr_nodes = atoi(val + 5);
+        if (nr_nodes < 1) nr_nodes = 1;
+        if (nr_nodes > MAX_NUMNODES) nr_nodes = MAX_NUMNODES;
+    }
+
+    unsigned long node_pages = (unsigned long)(size >> PAGE_SHIFT) / (unsigned long)nr_nodes;
+    node_pages &= ~(MAX_BLOCK_PAGES - 1);
+    if (node_pages < MIN_NODE_PAGES) {
+        pr_err("mem=%llu is too small for %d node(s); using %lu MB per node\n",
+               (unsigned long long)size, nr_nodes, (MIN_NODE_PAGES * PAGE_SIZE) >> 20);
+        node_pages = MIN_NODE_PAGES;
+    }
+
+    memset(g_nodes, 0, sizeof(g_nodes));
+    g_nr_nodes = nr_nodes;
+    g_node_pages = node_pages;
+    g_nr_pages = node_pages * (unsigned long)nr_nodes;
+    g_mem_map = calloc(g_nr_pages, sizeof(page_t));
+    if (!g_mem_map) return -ENOMEM;
+
+    for (int nid = 0; nid < nr_nodes; nid++) {
+        pg_data_t *node = &g_nodes[nid];
+        node->start_pfn = (unsigned long)nid * node_pages;
+        node->nr_pages = node_pages;
+        node->mem_pool = aligned_alloc(PAGE_SIZE, node_pages * PAGE_SIZE);
+        if (!node->mem_pool) {
+            while (nid--) free(g_nodes[nid].mem_pool);
+            free(g_mem_map);
+            g_mem_map = NULL;
+            return -ENOMEM;
+        }
+        node->host_node = bind_node_memory(node, nid);
+
+        /* Seed every max-order block of the node */
+        for (unsigned long pfn = 0; pfn < node_pages; pfn += MAX_BLOCK_PAGES)
+            free_list_add(node, &g_mem_map[node->start_pfn + pfn], MAX_ORDER - 1);
+        node->free_pages = node_pages;
+    }
+    setup_watermarks();
     return 0;
 }
 
-/* Allocate pages */
-struct page *page_alloc(unsigned int order) {
-    if (order >= MAX_ORDER) return NULL;
-    
+/* Take 2^order pages from node if at least mark pages stay free afterwards */
+static page_t *rmqueue(pg_data_t *node, unsigned int order, unsigned long mark) {
+    spin_lock(&node->lock);
+    if (node->free_pages < mark + (1UL << order)) {
+        spin_unlock(&node->lock);
+        return NULL;
+    }
+
     /* Find suitable block */
-    int current_order = order;
-    free_block_t *block = NULL;
-    
-    while (current_order < MAX_ORDER && !block) {
-        block = g_buddy.free_lists[current_order];
-        if (block) {
-            g_buddy.free_lists[current_order] = block->next;
-            break;
-        }
+    unsigned int current_order = order;
+    while (current_order < MAX_ORDER && !node->free_lists[current_order])
         current_order++;
+    if (current_order >= MAX_ORDER) {
+        spin_unlock(&node->lock);
+        return NULL;
     }
-    
-    if (!block) return NULL;
-    
-    /* Split blocks down to requested order */
+
+    page_t *page = node->free_lists[current_order];
+    free_list_del(node, page, current_order);
+
+    /* Split blocks down to requested order, returning upper halves */
     while (current_order > order) {
         current_order--;
-        size_t block_size = 1 << (current_order + PAGE_SHIFT);
-        free_block_t *buddy = (free_block_t *)((char *)block + block_size);
-        buddy->order = current_order;
-        buddy->next = g_buddy.free_lists[current_order];
-        g_buddy.free_lists[current_order] = buddy;
-        block->order = current_order;
+        free_list_add(node, page + (1UL << current_order), current_order);
+    }
+
+    node->free_pages -= 1UL << order;
+    spin_unlock(&node->lock);
+
+    page->order = order;
+    page->count = 1;
+    page->flags = 0;
+    page->mapping = NULL;
+    page->index = 0;
+    return page;
+}
+
+/* First node in allowed, starting at preferred, that stays above its mark */
+static page_t *get_page_from_freelist(int preferred, nodemask_t allowed, unsigned int order,
+                                      enum zone_watermarks wmark, bool atomic) {
+    for (int i = 0; i < g_nr_nodes; i++) {
+        int nid = (preferred + i) % g_nr_nodes;
+        if (!(allowed & (1U << nid))) continue;
+
+        pg_data_t *node = &g_nodes[nid];
+        unsigned long mark = node->watermark[wmark];
+        page_t *page = rmqueue(node, order, atomic ? mark / 2 : mark);
+        if (page) return page;
+    }
+    return NULL;
+}
+
+/* Report a failed allocation and who asked, at most ALLOC_WARN_BURST times per interval */
+#define ALLOC_WARN_BURST    10
+#define ALLOC_WARN_INTERVAL (5 * NSEC_PER_SEC)
+
+static void warn_alloc(const char *what, size_t size, const void *caller) {
+    static ratelimit_state_t rs = RATELIMIT_STATE_INIT(ALLOC_WARN_INTERVAL, ALLOC_WARN_BURST);
+    if (__ratelimit(&rs))
+        pr_err("%s: %zu-byte allocation failed, caller %p\n", what, size, caller);
+}
+
+static void numa_account(page_t *page, int preferred, bool interleave) {
+    pg_data_t *node = page_pgdat(page);
+    int nid = (int)(node - g_nodes);
+
+    if (nid == preferred) {
+        __atomic_fetch_add(&node->stats.numa_hit, 1, __ATOMIC_RELAXED);
+        if (interleave) __atomic_fetch_add(&node->stats.interleave_hit, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&node->stats.numa_miss, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&g_nodes[preferred].stats.numa_foreign, 1, __ATOMIC_RELAXED);
+    }
+    if (nid == numa_node_id()) __atomic_fetch_add(&node->stats.local_node, 1, __ATOMIC_RELAXED);
+    else __atomic_fetch_add(&node->stats.other_node, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Above `low` on some allowed node this is a free-list pop, nearest
+ * node first. Otherwise kswapd is woken for every allowed node and the
+ * caller may use pages down to `min`; past that GFP_KERNEL reclaims
+ * directly until it makes no progress, and GFP_ATOMIC takes from the
+ * reserve or fails.
+ */
+static page_t *__alloc_pages(gfp_flags_t gfp, unsigned int order, int preferred,
+                             nodemask_t allowed, bool interleave, const void *caller) {
+    if (order >= MAX_ORDER || !allowed) return NULL;
+
+    page_t *page = get_page_from_freelist(preferred, allowed, order, WMARK_LOW, false);
+    if (!page) {
+        for (int nid = 0; nid < g_nr_nodes; nid++) {
+            if (allowed & (1U << nid)) wakeup_kswapd(nid);
+        }
+        page = get_page_from_freelist(preferred, allowed, order, WMARK_MIN, gfp == GFP_ATOMIC);
+
+        for (int no_progress = 0;
+             !page && gfp != GFP_ATOMIC && no_progress < MAX_RECLAIM_RETRIES; ) {
+            unsigned long progress = 0;
+            for (int i = 0; i < g_nr_nodes && !progress; i++) {
+                int nid = (preferred + i) % g_nr_nodes;
+                if (allowed & (1U << nid)) progress = try_to_free_pages(nid, order);
+            }
+            no_progress = progress ? 0 : no_progress + 1;
+            page = get_page_from_freelist(preferred, allowed, order, WMARK_MIN, false);
+        }
+    }
+    if (page) {
+        numa_account(page, preferred, interleave);
+        trace_mm_page_alloc(page - g_mem_map, order, gfp, page_to_nid(page));
+    } else {
+        warn_alloc(gfp == GFP_ATOMIC ? "alloc_pages(GFP_ATOMIC)" : "alloc_pages",
+                   PAGE_SIZE << order, caller);
     }
-    
-    return (struct page *)block;
+    return page;
+}
+
+static nodemask_t online_nodes(void) {
+    return (nodemask_t)((1U << g_nr_nodes) - 1);
+}
+
+static page_t *alloc_pages_policy(gfp_flags_t gfp, unsigned int order, const void *caller) {
+    mempolicy_t *pol = &g_mempolicy;
+    nodemask_t online = online_nodes();
+    int local = numa_node_id();
+
+    switch (pol->mode) {
+    case MPOL_INTERLEAVE: {
+        nodemask_t nodes = pol->nodes & online;
+        if (!nodes) break;
+        int nid = (int)(pol->il_next % (unsigned int)g_nr_nodes);
+        while (!(nodes & (1U << nid)))
+            nid = (nid + 1) % g_nr_nodes;
+        pol->il_next = (unsigned int)nid + 1;
+        return __alloc_pages(gfp, order, nid, online, true, caller);
+    }
+    case MPOL_BIND: {
+        nodemask_t nodes = pol->nodes & online;
+        if (!nodes) break;
+        int nid = (nodes & (1U << local)) ? local : __builtin_ctz(nodes);
+        return __alloc_pages(gfp, order, nid, nodes, false, caller);
+    }
+    default:
+        break;
+    }
+    return __alloc_pages(gfp, order, local, online, false, caller);
+}
+
+/* Allocate 2^order contiguous pages under this thread's memory policy */
+struct page *alloc_pages(gfp_flags_t gfp, unsigned int order) {
+    return alloc_pages_policy(gfp, order, __builtin_return_address(0));
+}
+
+/* Prefer node nid regardless of policy; falls back to the others like MPOL_LOCAL */
+struct page *alloc_pages_node(int nid, gfp_flags_t gfp, unsigned int order) {
+    if (nid < 0 || nid >= g_nr_nodes) nid = numa_node_id();
+    return __alloc_pages(gfp, order, nid, online_nodes(), false, __builtin_return_address(0));
+}
+
+struct page *page_alloc(unsigned int order) {
+    return alloc_pages_policy(GFP_KERNEL, order, __builtin_return_address(0));
 }
 
 /* Free pages */
 void page_free(struct page *page) {
     if (!page) return;
-    
-    free_block_t *block = (free_block_t *)page;
-    unsigned int order = block->order;
-    
-    /* Coalesce buddies */
+
+    pg_data_t *node = page_pgdat(page);
+    unsigned int order = page->order;
+    unsigned long pfn = (unsigned long)(page - g_mem_map);
+
+    trace_mm_page_free(pfn, order);
+    page->count = 0;
+    page->flags = 0;
+    page->mapping = NULL;
+
+    spin_lock(&node->lock);
+    node->free_pages += 1UL << order;
+
+    /* Coalesce buddies; blocks are node-aligned, so a buddy is on the same node */
     while (order < MAX_ORDER - 1) {
-        size_t block_size = 1 << (order + PAGE_SHIFT);
-        uintptr_t block_addr = (uintptr_t)block;
-        uintptr_t buddy_addr = block_addr ^ block_size;
-        free_block_t *buddy = (free_block_t *)buddy_addr;
-        
-        /* Check if buddy is free */
-        if (!buddy || buddy->order != order) break;
-        
-        /* Remove buddy from free list */
-        free_block_t **list = &g_buddy.free_lists[order];
-        while (*list && *list != buddy) list = &(*list)->next;
-        if (*list) *list = buddy->next;
-        
-        /* Merge */
-        if (buddy_addr < block_addr) {
-            block = buddy;
-        }
-        block->order = ++order;
+        unsigned long buddy_pfn = pfn ^ (1UL << order);
+        page_t *buddy = &g_mem_map[buddy_pfn];
+        if (!(buddy->flags & PG_buddy) || buddy->order != order) break;
+
+        free_list_del(node, buddy, order);
+        pfn &= buddy_pfn;
+        order++;
     }
-    
-    /* Add back to free list */
-    block->next = g_buddy.free_lists[order];
-    g_buddy.free_lists[order] = block;
+
+    free_list_add(node, &g_mem_map[pfn], order);
+    spin_unlock(&node->lock);
 }
 
 void *page_to_virt(struct page *page) {
-    return (void *)page;
+    pg_data_t *node = page_pgdat(page);
+    unsigned long pfn = (unsigned long)(page - g_mem_map);
+    return node->mem_pool + (pfn - node->start_pfn) * PAGE_SIZE;
 }
 
 struct page *virt_to_page(void *vaddr) {
-    return (struct page *)vaddr;
+    for (int nid = 0; nid < g_nr_nodes; nid++) {
+        pg_data_t *node = &g_nodes[nid];
+        size_t off = (size_t)((char *)vaddr - node->mem_pool);
+        if ((char *)vaddr >= node->mem_pool && off < node->nr_pages * PAGE_SIZE)
+            return &g_mem_map[node->start_pfn + (off >> PAGE_SHIFT)];
+    }
+    return NULL;
+}
+
+unsigned long nr_free_pages(void) {
+    unsigned long free = 0;
+    for (int nid = 0; nid < g_nr_nodes; nid++)
+        free += __atomic_load_n(&g_nodes[nid].free_pages, __ATOMIC_RELAXED);
+    return free;
+}
+
+unsigned long nr_total_pages(void) {
+    return g_nr_pages;
+}
+
+unsigned long nr_free_blocks(unsigned int order) {
+    unsigned long nr = 0;
+    for (int nid = 0; nid < g_nr_nodes; nid++)
+        nr += node_free_blocks(nid, order);
+    return nr;
+}
+
+unsigned long zone_watermark(int nid, enum zone_watermarks which) {
+    if (nid < 0 || nid >= g_nr_nodes || which >= NR_WMARK) return 0;
+    return g_nodes[nid].watermark[which];
+}
+
+/* At least mark pages free on nid after taking 2^order; a hint, read without the lock */
+bool zone_watermark_ok(int nid, unsigned int order, unsigned long mark) {
+    if (nid < 0 || nid >= g_nr_nodes) return false;
+    return __atomic_load_n(&g_nodes[nid].free_pages, __ATOMIC_RELAXED) >= mark + (1UL << order);
+}
+
+/* ============================================================================
+ * NUMA nodes and memory policy
+ * ============================================================================ */
+
+int nr_online_nodes(void) {
+    return g_nr_nodes;
+}
+
+/* CPUs are split into contiguous ranges, one per node */
+int cpu_to_node(unsigned int cpu) {
+    return (int)((cpu % NR_CPUS) * (unsigned int)g_nr_nodes / NR_CPUS);
+}
+
+int numa_node_id(void) {
+    return cpu_to_node(smp_processor_id());
 }
 
-/* Slab allocator */
-#define SLAB_SIZE 4096
+int page_to_nid(const struct page *page) {
+    return (int)(page_pgdat(page) - g_nodes);
+}
+
+int node_host_node(int nid) {
+    return nid >= 0 && nid < g_nr_nodes ? g_nodes[nid].host_node : -1;
+}
+
+unsigned long node_present_pages(int nid) {
+    return nid >= 0 && nid < g_nr_nodes ? g_nodes[nid].nr_pages : 0;
+}
+
+unsigned long node_free_pages(int nid) {
+    if (nid < 0 || nid >= g_nr_nodes) return 0;
+    return __atomic_load_n(&g_nodes[nid].free_pages, __ATOMIC_RELAXED);
+}
+
+unsigned long node_free_blocks(int nid, unsigned int order) {
+    if (nid < 0 || nid >= g_nr_nodes || order >= MAX_ORDER) return 0;
+    return __atomic_load_n(&g_nodes[nid].nr_free[order], __ATOMIC_RELAXED);
+}
+
+void numa_get_stats(int nid, numa_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (nid < 0 || nid >= g_nr_nodes) return;
+    numa_stats_t *s = &g_nodes[nid].stats;
+    st->numa_hit = __atomic_load_n(&s->numa_hit, __ATOMIC_RELAXED);
+    st->numa_miss = __atomic_load_n(&s->numa_miss, __ATOMIC_RELAXED);
+    st->numa_foreign = __atomic_load_n(&s->numa_foreign, __ATOMIC_RELAXED);
+    st->interleave_hit = __atomic_load_n(&s->interleave_hit, __ATOMIC_RELAXED);
+    st->local_node = __atomic_load_n(&s->local_node, __ATOMIC_RELAXED);
+    st->other_node = __atomic_load_n(&s->other_node, __ATOMIC_RELAXED);
+}
+
+/* This thread's policy for alloc_pages(); nodes is ignored for MPOL_LOCAL */
+int set_mempolicy(enum mempolicy_mode mode, nodemask_t nodes) {
+    if (mode != MPOL_LOCAL && mode != MPOL_INTERLEAVE && mode != MPOL_BIND) return -EINVAL;
+    if (mode != MPOL_LOCAL && (!nodes || (nodes & ~online_nodes()))) return -EINVAL;
+
+    g_mempolicy.mode = mode;
+    g_mempolicy.nodes = mode == MPOL_LOCAL ? 0 : nodes;
+    g_mempolicy.il_next = 0;
+    return 0;
+}
+
+int get_mempolicy(enum mempolicy_mode *mode, nodemask_t *nodes) {
+    if (mode) *mode = g_mempolicy.mode;
+    if (nodes) *nodes = g_mempolicy.nodes;
+    return 0;
+}
+
+/* Fill in the memory part of vos_sysinfo */
+int do_sysinfo(sysinfo_t *info) {
+    if (!info) return -EINVAL;
+
+    memset(info, 0, sizeof(*info));
+    info->total_memory = (uint32_t)g_nr_pages;
+    info->free_memory = (uint32_t)nr_free_pages();
+    info->used_memory = info->total_memory - info->free_memory;
+    info->nr_processes = (uint32_t)nr_processes();
+    info->uptime = (uint32_t)(ktime_get_ns() / NSEC_PER_SEC);
+    info->shared_memory = (uint32_t)nr_shmem_pages();
+    info->cached_memory = (uint32_t)nr_pagecache_pages();
+    return 0;
+}
+
+/* Slab allocator
+ *
+ * kmalloc() rounds requests up to a power-of-two size class and carves
+ * objects out of SLAB_SIZE-aligned slabs. Every slab starts with a
+ * slab_t header, so kfree() finds the owning slab by masking the
+ * pointer. Requests above KMALLOC_MAX_SIZE get a slab of their own.
+ *
+ * With CONFIG_ALLOC_PROFILING each cache also counts calls, bytes and
+ * failures per caller and a histogram of requested sizes, updated under
+ * the cache lock it already holds; large allocations share a pseudo
+ * cache for the same. kmalloc() hands one allocation per sampling
+ * interval to the heap profiler (kernel/mm/heap_profile.c), and slabs
+ * mark their sampled objects in a bitmap so kfree() of the rest costs
+ * one load.
+ */
+#define SLAB_SIZE           (16 * 1024)
+#define SLAB_MAGIC          0x51ab51abU
+#define KMALLOC_MIN_SHIFT   4
+#define KMALLOC_MAX_SHIFT   12
+#define KMALLOC_MAX_SIZE    (1UL << KMALLOC_MAX_SHIFT)
+#define NR_KMALLOC_CACHES   (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+#define SLAB_MAX_OBJS       (SLAB_SIZE >> KMALLOC_MIN_SHIFT)
+
+struct kmem_cache;
+
 typedef struct slab {
-    void *pool;
-    size_t item_size;
-    unsigned char bitmap[512];  /* 4096 items max */
-    int num_free;
-} slab_t;
+    uint32_t magic;
+    uint32_t inuse;             /* Objects handed out */
+    struct kmem_cache *cache;   /* NULL for large allocations */
+    void *freelist;
+    struct slab *next, *prev;   /* Partial list linkage */
+    size_t size;                /* Mapping size (large allocations) */
+    bool on_partial;
+#ifdef CONFIG_ALLOC_PROFILING
+    uint64_t sampled[SLAB_MAX_OBJS / 64];   /* Objects the heap profiler is tracking */
+#endif
+} __attribute__((aligned(64))) slab_t;
 
-static slab_t g_slabs[16];
-static int g_num_slabs = 0;
+#ifdef CONFIG_ALLOC_PROFILING
+#define ALLOC_SITE_BITS     8
+#define ALLOC_SITE_SLOTS    (1U << ALLOC_SITE_BITS)
+
+typedef struct {
+    const void *caller;         /* NULL while the slot is free */
+    uint64_t calls, bytes, failures;
+} alloc_site_t;
+#endif
+
+typedef struct kmem_cache {
+    char name[24];
+    size_t object_size;         /* 0 for the large-allocation pseudo cache */
+    unsigned int objs_per_slab;
+    slab_t *partial;            /* Slabs with at least one free object */
+    unsigned long nr_slabs;
+    unsigned long nr_active;
+    spinlock_t lock;
+#ifdef CONFIG_ALLOC_PROFILING
+    alloc_site_t sites[ALLOC_SITE_SLOTS];
+    struct { uint64_t calls, bytes; } hist[ALLOC_HIST_BUCKETS];
+    uint64_t failures;
+    uint64_t untracked;         /* Calls from callers that found the site table full */
+    unsigned int hist_shift;    /* Request size bits below the histogram bucket */
+#endif
+} kmem_cache_t;
+
+static kmem_cache_t g_kmalloc_caches[NR_KMALLOC_CACHES];
+#ifdef CONFIG_ALLOC_PROFILING
+static kmem_cache_t g_kmalloc_large;
+static _Thread_local int64_t t_sample_budget;  /* Bytes left before the next sample */
+static _Thread_local bool t_sampler_armed;
+#endif
+
+static inline slab_t *obj_to_slab(const void *ptr) {
+    return (slab_t *)((uintptr_t)ptr & ~((uintptr_t)SLAB_SIZE - 1));
+}
+
+static inline unsigned int kmalloc_index(size_t size) {
+    if (size <= (1UL << KMALLOC_MIN_SHIFT))
+        return 0;
+    return (64 - __builtin_clzl(size - 1)) - KMALLOC_MIN_SHIFT;
+}
 
 int slab_allocator_init(void) {
-    g_num_slabs = 0;
+    for (int i = 0; i < NR_KMALLOC_CACHES; i++) {
+        kmem_cache_t *c = &g_kmalloc_caches[i];
+        memset(c, 0, sizeof(*c));
+        c->object_size = 1UL << (i + KMALLOC_MIN_SHIFT);
+        c->objs_per_slab = (SLAB_SIZE - sizeof(slab_t)) / c->object_size;
+        snprintf(c->name, sizeof(c->name), "kmalloc-%zu", c->object_size);
+#ifdef CONFIG_ALLOC_PROFILING
+        /* Buckets split (object_size / 2, object_size], or all of the smallest class */
+        c->hist_shift = (unsigned int)(i ? i + KMALLOC_MIN_SHIFT - 1 : KMALLOC_MIN_SHIFT) -
+                        (unsigned int)__builtin_ctz(ALLOC_HIST_BUCKETS);
+#endif
+    }
+#ifdef CONFIG_ALLOC_PROFILING
+    memset(&g_kmalloc_large, 0, sizeof(g_kmalloc_large));
+    snprintf(g_kmalloc_large.name, sizeof(g_kmalloc_large.name), "kmalloc-large");
+#endif
     return 0;
 }
 
-/* kmalloc - allocate kernel memory */
-void *kmalloc(size_t size, gfp_flags_t flags) {
-    if (size == 0 || size > SLAB_SIZE) return NULL;
-    
-    /* Find or create slab */
-    for (int i = 0; i < g_num_slabs; i++) {
-        if (g_slabs[i].item_size >= size && g_slabs[i].num_free > 0) {
-            /* Find free slot */
-            for (int j = 0; j < (SLAB_SIZE / g_slabs[i].item_size); j++) {
-                if (!g_slabs[i].bitmap[j / 8] & (1 << (j % 8))) {
-                    g_slabs[i].bitmap[j / 8] |= (1 << (j % 8));
-                    g_slabs[i].num_free--;
-                    return (char *)g_slabs[i].pool + (j * g_slabs[i].item_size);
-                }
-            }
+static void partial_add(kmem_cache_t *c, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = c->partial;
+    if (c->partial) c->partial->prev = slab;
+    c->partial = slab;
+    slab->on_partial = true;
+}
+
+static void partial_del(kmem_cache_t *c, slab_t *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else c->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->on_partial = false;
+}
+
+static slab_t *slab_new(kmem_cache_t *c) {
+    slab_t *slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (!slab) return NULL;
+
+    memset(slab, 0, sizeof(*slab));
+    slab->magic = SLAB_MAGIC;
+    slab->cache = c;
+
+    /* Thread the free list through the objects, lowest address first */
+    char *base = (char *)slab + sizeof(slab_t);
+    void **link = &slab->freelist;
+    for (unsigned int i = 0; i < c->objs_per_slab; i++) {
+        *link = base + i * c->object_size;
+        link = (void **)*link;
+    }
+    *link = NULL;
+
+    c->nr_slabs++;
+    return slab;
+}
+
+static void *kmalloc_large(size_t size) {
+    size_t total = (sizeof(slab_t) + size + SLAB_SIZE - 1) & ~((size_t)SLAB_SIZE - 1);
+    slab_t *slab = aligned_alloc(SLAB_SIZE, total);
+    if (!slab) return NULL;
+
+    memset(slab, 0, sizeof(*slab));
+    slab->magic = SLAB_MAGIC;
+    slab->size = total;
+    return (char *)slab + sizeof(slab_t);
+}
+
+#ifdef CONFIG_ALLOC_PROFILING
+/* Caller holds c->lock; NULL once the table is full */
+static alloc_site_t *alloc_site(kmem_cache_t *c, const void *caller) {
+    uint32_t h = (uint32_t)(((uintptr_t)caller * 0x9E3779B97F4A7C15ULL) >> (64 - ALLOC_SITE_BITS));
+    for (unsigned int i = 0; i < ALLOC_SITE_SLOTS; i++) {
+        alloc_site_t *site = &c->sites[(h + i) & (ALLOC_SITE_SLOTS - 1)];
+        if (site->caller == caller) return site;
+        if (!site->caller) {
+            site->caller = caller;
+            return site;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Slab caches split (object_size / 2, object_size] into equal buckets,
+ * so the histogram shows how well requests fill their objects. Large
+ * allocations use one bucket per power of two above KMALLOC_MAX_SIZE.
+ */
+static unsigned int alloc_hist_bucket(const kmem_cache_t *c, size_t size) {
+    if (!c->object_size) {
+        unsigned int b = (unsigned int)(64 - __builtin_clzl(size - 1)) - (KMALLOC_MAX_SHIFT + 1);
+        return b < ALLOC_HIST_BUCKETS ? b : ALLOC_HIST_BUCKETS - 1;
+    }
+    size_t lo = c->object_size > (1UL << KMALLOC_MIN_SHIFT) ? c->object_size / 2 : 0;
+    return (unsigned int)((size - lo - 1) >> c->hist_shift);
+}
+
+/* Caller holds c->lock */
+static void kmalloc_account(kmem_cache_t *c, size_t size, const void *caller, bool ok) {
+    alloc_site_t *site = alloc_site(c, caller);
+    if (!site) c->untracked++;
+    if (!ok) {
+        c->failures++;
+        if (site) site->failures++;
+        return;
+    }
+    unsigned int b = alloc_hist_bucket(c, size);
+    c->hist[b].calls++;
+    c->hist[b].bytes += size;
+    if (site) {
+        site->calls++;
+        site->bytes += size;
+    }
+}
+
+/* Position of obj in its slab; large allocations are object 0 */
+static inline unsigned int obj_index(const slab_t *slab, const void *obj) {
+    if (!slab->cache) return 0;
+    uintptr_t off = (uintptr_t)obj - (uintptr_t)(slab + 1);
+    return (unsigned int)(off >> __builtin_ctzl(slab->cache->object_size));
+}
+
+/* The thread's sampling budget ran out: start a new interval and maybe record obj */
+static __attribute__((noinline)) void kmalloc_sample(void *obj, size_t size, const void *caller) {
+    t_sample_budget = heap_profile_next_sample();
+    if (!t_sampler_armed) {
+        /* A thread's first allocation starts its first interval */
+        t_sampler_armed = true;
+        return;
+    }
+    if (heap_profile_sample(obj, size, caller)) {
+        slab_t *slab = obj_to_slab(obj);
+        unsigned int i = obj_index(slab, obj);
+        __atomic_fetch_or(&slab->sampled[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+    }
+}
+#endif
+
+static inline void *__kmalloc(size_t size, gfp_flags_t flags, const void *caller) {
+    (void)flags;
+    if (size == 0) return NULL;
+
+    void *obj = NULL;
+    if (size > KMALLOC_MAX_SIZE) {
+        obj = kmalloc_large(size);
+#ifdef CONFIG_ALLOC_PROFILING
+        spin_lock(&g_kmalloc_large.lock);
+        kmalloc_account(&g_kmalloc_large, size, caller, obj != NULL);
+        spin_unlock(&g_kmalloc_large.lock);
+#endif
+    } else {
+        kmem_cache_t *c = &g_kmalloc_caches[kmalloc_index(size)];
+        spin_lock(&c->lock);
+
+        slab_t *slab = c->partial;
+        if (!slab) {
+            slab = slab_new(c);
+            if (slab) partial_add(c, slab);
         }
+        if (slab) {
+            obj = slab->freelist;
+            slab->freelist = *(void **)obj;
+            slab->inuse++;
+            c->nr_active++;
+            if (!slab->freelist) partial_del(c, slab);
+        }
+#ifdef CONFIG_ALLOC_PROFILING
+        kmalloc_account(c, size, caller, obj != NULL);
+#endif
+        spin_unlock(&c->lock);
+    }
+
+    if (!obj) {
+        warn_alloc("kmalloc", size, caller);
+        return NULL;
     }
-    
-    /* Create new slab */
-    if (g_num_slabs >= 16) return NULL;
-    
-    slab_t *slab = &g_slabs[g_num_slabs];
-    slab->pool = malloc(SLAB_SIZE);
-    if (!slab->pool) return NULL;
-    
-    slab->item_size = size;
-    slab->num_free = SLAB_SIZE / size;
-    memset(slab->bitmap, 0, sizeof(slab->bitmap));
-    
-    g_num_slabs++;
-    
-    /* Allocate first item */
-    slab->bitmap[0] = 1;
-    slab->num_free--;
-    return slab->pool;
+#ifdef CONFIG_ALLOC_PROFILING
+    if ((t_sample_budget -= (int64_t)size) < 0)
+        kmalloc_sample(obj, size, caller);
+#endif
+    trace_kmalloc(caller, obj, size,
+                  size > KMALLOC_MAX_SIZE ? size : g_kmalloc_caches[kmalloc_index(size)].object_size);
+    return obj;
+}
+
+/* kmalloc - allocate kernel memory */
+void *kmalloc(size_t size, gfp_flags_t flags) {
+    return __kmalloc(size, flags, __builtin_return_address(0));
 }
 
 /* kfree - free kernel memory */
 void kfree(void *ptr) {
     if (!ptr) return;
-    
-    for (int i = 0; i < g_num_slabs; i++) {
-        if ((char *)ptr >= (char *)g_slabs[i].pool &&
-            (char *)ptr < (char *)g_slabs[i].pool + SLAB_SIZE) {
-            
-            size_t offset = (char *)ptr - (char *)g_slabs[i].pool;
-            size_t idx = offset / g_slabs[i].item_size;
-            g_slabs[i].bitmap[idx / 8] &= ~(1 << (idx % 8));
-            g_slabs[i].num_free++;
-            return;
-        }
+
+    slab_t *slab = obj_to_slab(ptr);
+    if (slab->magic != SLAB_MAGIC) {
+        pr_err("kfree: bad pointer %p\n", ptr);
+        return;
     }
+    trace_kfree(__builtin_return_address(0), ptr);
+#ifdef CONFIG_ALLOC_PROFILING
+    unsigned int i = obj_index(slab, ptr);
+    if (__atomic_load_n(&slab->sampled[i / 64], __ATOMIC_RELAXED) & (1ULL << (i % 64))) {
+        __atomic_fetch_and(&slab->sampled[i / 64], ~(1ULL << (i % 64)), __ATOMIC_RELAXED);
+        heap_profile_free(ptr);
+    }
+#endif
+
+    kmem_cache_t *c = slab->cache;
+    if (!c) {
+        free(slab);
+        return;
+    }
+
+    spin_lock(&c->lock);
+    *(void **)ptr = slab->freelist;
+    slab->freelist = ptr;
+    slab->inuse--;
+    c->nr_active--;
+
+    if (!slab->on_partial) {
+        partial_add(c, slab);
+    } else if (slab->inuse == 0 && c->partial != slab) {
+        /* Keep one empty slab cached; give the rest back */
+        partial_del(c, slab);
+        c->nr_slabs--;
+        slab->magic = 0;
+        free(slab);
+    }
+    spin_unlock(&c->lock);
+}
+
+void *kmem_cache_alloc(size_t size) {
+    return __kmalloc(size, GFP_KERNEL, __builtin_return_address(0));
+}
+
+void kmem_cache_free(void *ptr, size_t size) {
+    (void)size;
+    kfree(ptr);
+}
+
+int kmem_cache_info(unsigned int index, kmem_cache_info_t *info) {
+    if (index >= NR_KMALLOC_CACHES) return -ENOENT;
+
+    kmem_cache_t *c = &g_kmalloc_caches[index];
+    spin_lock(&c->lock);
+    memcpy(info->name, c->name, sizeof(info->name));
+    info->object_size = c->object_size;
+    info->objs_per_slab = c->objs_per_slab;
+    info->nr_slabs = c->nr_slabs;
+    info->nr_active = c->nr_active;
+    info->slab_size = SLAB_SIZE;
+    spin_unlock(&c->lock);
+    return 0;
+}
+
+#ifdef CONFIG_ALLOC_PROFILING
+/* Cache index NR_KMALLOC_CACHES is the large-allocation pseudo cache */
+static kmem_cache_t *kmalloc_stats_cache(unsigned int index) {
+    if (index < NR_KMALLOC_CACHES) return &g_kmalloc_caches[index];
+    return index == NR_KMALLOC_CACHES ? &g_kmalloc_large : NULL;
+}
+
+/* The first call site at or after *pos, which is advanced to it; -ENOENT past the last */
+int kmalloc_site_info(unsigned int *pos, alloc_site_info_t *info) {
+    for (unsigned int i = *pos; ; i++) {
+        kmem_cache_t *c = kmalloc_stats_cache(i / ALLOC_SITE_SLOTS);
+        if (!c) return -ENOENT;
+
+        alloc_site_t *site = &c->sites[i % ALLOC_SITE_SLOTS];
+        if (!__atomic_load_n(&site->caller, __ATOMIC_RELAXED)) continue;
+
+        spin_lock(&c->lock);
+        info->caller = site->caller;
+        info->object_size = c->object_size;
+        info->calls = site->calls;
+        info->bytes = site->bytes;
+        info->failures = site->failures;
+        spin_unlock(&c->lock);
+        memcpy(info->cache, c->name, sizeof(info->cache));
+        *pos = i;
+        return 0;
+    }
+}
+
+int kmalloc_size_hist(unsigned int index, alloc_size_hist_t *hist) {
+    kmem_cache_t *c = kmalloc_stats_cache(index);
+    if (!c) return -ENOENT;
+
+    spin_lock(&c->lock);
+    memcpy(hist->name, c->name, sizeof(hist->name));
+    hist->object_size = c->object_size;
+    for (unsigned int b = 0; b < ALLOC_HIST_BUCKETS; b++) {
+        hist->calls[b] = c->hist[b].calls;
+        hist->bytes[b] = c->hist[b].bytes;
+    }
+    hist->failures = c->failures;
+    hist->untracked = c->untracked;
+    spin_unlock(&c->lock);
+    return 0;
 }
+#endif
 
 int mmap_init(void) {
     return 0;  /* Virtual memory mapping - stub for now */
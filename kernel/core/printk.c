@@ -0,0 +1,390 @@
+/**
+ * printk
+ *
+ * Logging never waits for the console. A caller reserves a slot in the
+ * record ring with one atomic add, formats straight into it and
+ * publishes it through the slot's sequence word, as the trace rings do
+ * (kernel/core/trace.c); several CPUs log at once without a lock. The
+ * flusher thread writes them out in batches under the console lock.
+ * Waking it costs a futex syscall and, on a busy CPU, a switch, so
+ * callers only do so for errors or once FLUSH_BATCH records are queued;
+ * otherwise a timer wakes it FLUSH_DELAY_MS later. If it falls a full
+ * ring behind, the oldest records are overwritten and it reports how
+ * many it missed.
+ *
+ * In early boot, before printk_init() starts the flusher, with
+ * printk.synchronous=1 and on panic, callers print their own records,
+ * waiting for the console lock like the printf() this replaced.
+ *
+ * Messages at or above the log level (loglevel=, printk_set_loglevel())
+ * are dropped before they are formatted. printk.time=1 prefixes console
+ * lines with the time since boot.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#ifdef __unix__
+#include <pthread.h>
+#endif
+
+#define LOG_RECORDS         4096                    /* 1 MiB */
+#define LOG_LINE_MAX        232
+#define CONSOLE_BATCH       4096
+#define FLUSH_BATCH         256     /* Records queued before the flusher is woken at once */
+#define FLUSH_DELAY_MS      2       /* Otherwise it runs this much later */
+
+typedef struct {
+    uint64_t seq;                   /* Position + 1 once written, 0 while being written */
+    uint64_t ts_nsec;
+    uint8_t level;
+    uint8_t cpu;
+    uint16_t len;
+    uint32_t pad;
+    char text[LOG_LINE_MAX];
+} __attribute__((aligned(64))) printk_record_t;
+
+_Static_assert(sizeof(printk_record_t) == 256, "printk records are four cache lines");
+
+static void stdout_console_write(console_t *con, const char *buf, size_t len);
+
+static console_t g_stdout_console = { .name = "stdout", .write = stdout_console_write };
+
+static struct {
+    uint64_t head;                  /* Next position to reserve */
+    int loglevel;
+    bool sync;                      /* No flusher: callers print */
+    bool time;
+
+    spinlock_t console_lock;        /* Held while writing to the console */
+    console_t *console;
+    uint64_t console_seq;           /* Next position to print */
+    uint64_t dropped;
+
+    uint32_t wait;                  /* Futex word, bumped to wake the flusher */
+    int sleeping;                   /* Flusher is (about to be) waiting on it */
+    int timer_armed;
+    timer_list_t timer;             /* Wakes the flusher for records below FLUSH_BATCH */
+    bool started;
+#ifdef __unix__
+    pthread_t thread;
+#endif
+} g_printk = {
+#ifdef DEBUG
+    .loglevel = LOGLEVEL_DEBUG + 1,
+#else
+    .loglevel = LOGLEVEL_INFO + 1,
+#endif
+    .sync = true,
+    .console_lock = SPINLOCK_INIT,
+    .console = &g_stdout_console,
+};
+
+/* Static, so the first message of the boot has somewhere to go */
+static printk_record_t g_log_buf[LOG_RECORDS];
+
+static const char *const g_level_tags[] = {
+    [LOGLEVEL_EMERG]   = "[PANIC] ",
+    [LOGLEVEL_ALERT]   = "[ALERT] ",
+    [LOGLEVEL_CRIT]    = "[CRIT] ",
+    [LOGLEVEL_ERR]     = "[ERROR] ",
+    [LOGLEVEL_WARNING] = "[WARN] ",
+    [LOGLEVEL_NOTICE]  = "[NOTICE] ",
+    [LOGLEVEL_INFO]    = "[INFO] ",
+    [LOGLEVEL_DEBUG]   = "[DEBUG] ",
+};
+
+static void stdout_console_write(console_t *con, const char *buf, size_t len) {
+    (void)con;
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+}
+
+/* ============================================================================
+ * Console output
+ * ============================================================================ */
+
+typedef struct {
+    char buf[CONSOLE_BATCH];
+    size_t len;
+} console_batch_t;
+
+static void batch_flush(console_batch_t *b) {
+    if (b->len) g_printk.console->write(g_printk.console, b->buf, b->len);
+    b->len = 0;
+}
+
+static void batch_add(console_batch_t *b, const char *s, size_t len) {
+    if (b->len + len > sizeof(b->buf)) batch_flush(b);
+    memcpy(b->buf + b->len, s, len);
+    b->len += len;
+}
+
+static void batch_record(console_batch_t *b, const printk_record_t *r) {
+    char prefix[48];
+    int n = 0;
+    if (g_printk.time)
+        n = snprintf(prefix, sizeof(prefix), "[%5llu.%06llu] ",
+                     (unsigned long long)(r->ts_nsec / 1000000000ULL),
+                     (unsigned long long)(r->ts_nsec % 1000000000ULL / 1000));
+    n += snprintf(prefix + n, sizeof(prefix) - (size_t)n, "%s", g_level_tags[r->level]);
+    if (b->len + (size_t)n + r->len > sizeof(b->buf)) batch_flush(b);
+    batch_add(b, prefix, (size_t)n);
+    batch_add(b, r->text, r->len);
+}
+
+/*
+ * Caller holds the console lock. Print published records in order,
+ * stopping at one still being written. A record is copied out before it
+ * is printed, and counted as dropped if a writer a lap ahead got to it
+ * first.
+ */
+static void console_emit(void) {
+    static console_batch_t batch;   /* Only touched under the console lock */
+    static uint64_t missed;
+    printk_record_t rec;
+
+    for (;;) {
+        uint64_t head = __atomic_load_n(&g_printk.head, __ATOMIC_ACQUIRE);
+        uint64_t seq = g_printk.console_seq;
+        if (head > LOG_RECORDS && seq < head - LOG_RECORDS) {
+            missed += head - LOG_RECORDS - seq;
+            seq = head - LOG_RECORDS;
+        }
+        if (seq >= head) break;
+
+        const printk_record_t *r = &g_log_buf[seq % LOG_RECORDS];
+        uint64_t published = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        if (published == seq + 1) {
+            memcpy(&rec, r, sizeof(rec));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != published) published = 0;
+        } else if (published <= seq) {
+            __atomic_store_n(&g_printk.console_seq, seq, __ATOMIC_RELAXED);
+            break;                  /* Still being written: its writer gets it printed */
+        }
+
+        if (published == seq + 1) {
+            if (missed) {
+                char msg[64];
+                int n = snprintf(msg, sizeof(msg), "** %llu printk messages dropped **\n",
+                                 (unsigned long long)missed);
+                batch_add(&batch, msg, (size_t)n);
+                __atomic_fetch_add(&g_printk.dropped, missed, __ATOMIC_RELAXED);
+                missed = 0;
+            }
+            batch_record(&batch, &rec);
+        } else {
+            missed++;
+        }
+        __atomic_store_n(&g_printk.console_seq, seq + 1, __ATOMIC_RELAXED);
+    }
+    batch_flush(&batch);
+}
+
+void console_flush(void) {
+    spin_lock(&g_printk.console_lock);
+    console_emit();
+    spin_unlock(&g_printk.console_lock);
+}
+
+void register_console(console_t *con) {
+    spin_lock(&g_printk.console_lock);
+    console_emit();
+    g_printk.console = con ? con : &g_stdout_console;
+    spin_unlock(&g_printk.console_lock);
+}
+
+/* ============================================================================
+ * Logging
+ * ============================================================================ */
+
+static void wake_flusher(void) {
+    if (__atomic_exchange_n(&g_printk.sleeping, 0, __ATOMIC_ACQ_REL)) {
+        __atomic_fetch_add(&g_printk.wait, 1, __ATOMIC_RELEASE);
+        futex_wake(&g_printk.wait, 1);
+    }
+}
+
+static void flush_timer_fn(timer_list_t *timer) {
+    (void)timer;
+    __atomic_store_n(&g_printk.timer_armed, 0, __ATOMIC_RELAXED);
+    wake_flusher();
+}
+
+/* Record pos is published: get the flusher to it, now or shortly */
+static void defer_flush(int level, uint64_t pos) {
+    if (!__atomic_load_n(&g_printk.sleeping, __ATOMIC_SEQ_CST)) return;
+
+    uint64_t queued = pos + 1 - __atomic_load_n(&g_printk.console_seq, __ATOMIC_RELAXED);
+    if (level <= LOGLEVEL_ERR || queued >= FLUSH_BATCH)
+        wake_flusher();
+    else if (!__atomic_exchange_n(&g_printk.timer_armed, 1, __ATOMIC_ACQ_REL))
+        mod_timer(&g_printk.timer, get_jiffies_64() + msecs_to_jiffies(FLUSH_DELAY_MS));
+}
+
+static int vprintk_emit(int level, const char *fmt, va_list args) {
+    if (level < 0 || level > LOGLEVEL_DEBUG) level = LOGLEVEL_DEBUG;
+    if (level >= __atomic_load_n(&g_printk.loglevel, __ATOMIC_RELAXED)) return 0;
+
+    /* Sequentially consistent so the flusher, going to sleep, sees it was reserved */
+    uint64_t pos = __atomic_fetch_add(&g_printk.head, 1, __ATOMIC_SEQ_CST);
+    printk_record_t *r = &g_log_buf[pos % LOG_RECORDS];
+
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    int n = vsnprintf(r->text, sizeof(r->text), fmt, args);
+    r->len = (uint16_t)(n < 0 ? 0 : n < (int)sizeof(r->text) ? n : (int)sizeof(r->text) - 1);
+    r->ts_nsec = ktime_get_ns();
+    r->level = (uint8_t)level;
+    r->cpu = (uint8_t)smp_processor_id();
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&g_printk.sync, __ATOMIC_RELAXED)) {
+        /* Wait for our record even if an earlier writer is still formatting its own */
+        for (;;) {
+            console_flush();
+            if (__atomic_load_n(&g_printk.console_seq, __ATOMIC_RELAXED) > pos) break;
+            cond_resched();
+        }
+    } else {
+        defer_flush(level, pos);
+    }
+    return n;
+}
+
+int printk(int level, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vprintk_emit(level, fmt, args);
+    va_end(args);
+    return n;
+}
+
+void pr_info(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintk_emit(LOGLEVEL_INFO, fmt, args);
+    va_end(args);
+}
+
+void pr_err(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintk_emit(LOGLEVEL_ERR, fmt, args);
+    va_end(args);
+}
+
+void pr_debug(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintk_emit(LOGLEVEL_DEBUG, fmt, args);
+    va_end(args);
+}
+
+/* Print everything still queued from this CPU, then stop */
+void pr_panic(const char *fmt, ...) {
+    va_list args;
+    __atomic_store_n(&g_printk.sync, true, __ATOMIC_RELAXED);
+    va_start(args, fmt);
+    vprintk_emit(LOGLEVEL_EMERG, fmt, args);
+    va_end(args);
+    printk(LOGLEVEL_EMERG, "\nKernel halted.\n");
+    console_flush();
+    halt();
+}
+
+/*
+ * Allow rs->burst calls per rs->interval_ns. The first call of a new
+ * interval reports how many the last one suppressed.
+ */
+bool ___ratelimit(ratelimit_state_t *rs, const char *func) {
+    if (!rs->interval_ns) return true;
+
+    uint64_t now = ktime_get_ns();
+    uint64_t begin = __atomic_load_n(&rs->begin, __ATOMIC_RELAXED);
+    if ((!begin || now - begin >= rs->interval_ns) &&
+        __atomic_compare_exchange_n(&rs->begin, &begin, now ? now : 1, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        int missed = __atomic_exchange_n(&rs->missed, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&rs->printed, 0, __ATOMIC_RELAXED);
+        if (missed) printk(LOGLEVEL_WARNING, "%s: %d callbacks suppressed\n", func, missed);
+    }
+    if (__atomic_fetch_add(&rs->printed, 1, __ATOMIC_RELAXED) < rs->burst)
+        return true;
+    __atomic_fetch_add(&rs->missed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+int printk_loglevel(void) {
+    return __atomic_load_n(&g_printk.loglevel, __ATOMIC_RELAXED);
+}
+
+void printk_set_loglevel(int level) {
+    if (level < 1) level = 1;
+    if (level > LOGLEVEL_DEBUG + 1) level = LOGLEVEL_DEBUG + 1;
+    __atomic_store_n(&g_printk.loglevel, level, __ATOMIC_RELAXED);
+}
+
+/* Switching to synchronous prints the backlog first, so order is kept */
+void printk_set_sync(bool sync) {
+    if (!g_printk.started) return;
+    __atomic_store_n(&g_printk.sync, sync, __ATOMIC_RELAXED);
+    if (sync) console_flush();
+    else wake_flusher();
+}
+
+uint64_t printk_dropped(void) {
+    return __atomic_load_n(&g_printk.dropped, __ATOMIC_RELAXED);
+}
+
+/* ============================================================================
+ * Flusher
+ * ============================================================================ */
+
+#ifdef __unix__
+static void *printk_flusher(void *arg) {
+    (void)arg;
+    for (;;) {
+        spin_lock(&g_printk.console_lock);
+        console_emit();
+        uint64_t printed = g_printk.console_seq;
+        spin_unlock(&g_printk.console_lock);
+
+        uint32_t seq = __atomic_load_n(&g_printk.wait, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&g_printk.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&g_printk.head, __ATOMIC_SEQ_CST) != printed) {
+            /* Reserved since, perhaps not yet published: let its writer finish */
+            __atomic_store_n(&g_printk.sleeping, 0, __ATOMIC_RELAXED);
+            cond_resched();
+            continue;
+        }
+        futex_wait(&g_printk.wait, seq);
+    }
+    return NULL;
+}
+#endif
+
+/* Apply loglevel=, printk.time= and printk.synchronous=, then start the flusher */
+int printk_init(void) {
+    char val[16];
+    if (boot_param("loglevel", val, sizeof(val))) printk_set_loglevel(atoi(val));
+    if (boot_param("printk.time", val, sizeof(val))) g_printk.time = atoi(val) != 0;
+
+    bool sync = boot_param("printk.synchronous", val, sizeof(val)) && atoi(val);
+#ifdef __unix__
+    if (g_printk.started) return 0;
+    timer_setup(&g_printk.timer, flush_timer_fn);
+    if (!sync) {
+        if (pthread_create(&g_printk.thread, NULL, printk_flusher, NULL) != 0)
+            return -EAGAIN;
+        __atomic_store_n(&g_printk.sync, false, __ATOMIC_RELEASE);
+    }
+    g_printk.started = true;
+#else
+    (void)sync;
+#endif
+    return 0;
+}
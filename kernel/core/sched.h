@@ -0,0 +1,51 @@
+/**
+ * Scheduler - private definitions
+ *
+ * The task structure and the process table lock, shared by
+ * scheduler.c and signal.c. Everything else reaches tasks through the
+ * functions in kernel.h.
+ */
+
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <kernel.h>
+
+typedef struct process {
+    pid_t pid;                  /* Thread id */
+    pid_t tgid;                 /* Thread group id: the leader's pid */
+    pid_t ppid;
+    char name[32];
+    int state;
+    int priority;
+    uint64_t vruntime;
+    int timeslice;
+    unsigned long ti_flags;     /* TIF_*: work due before returning to user code */
+    files_struct_t *files;      /* Open file descriptors */
+    mm_struct_t *mm;            /* Address space, NULL until the first exec */
+    sighand_struct_t *sighand;  /* Signal dispositions */
+    uint64_t blocked;           /* Signal mask: bit n-1 blocks signal n */
+    sigpending_t pending;       /* Sent to this thread */
+    sigpending_t shared_pending; /* Leader only: sent to the thread group */
+    void *stack;                /* Kernel stack; a process gets it on first run */
+    thread_struct_t thread;
+    void (*fn)(void *arg);      /* do_clone() body, NULL for process_main */
+    void *arg;
+    struct process *group_leader;
+    struct process *group_next, *group_prev;   /* Ring of the thread group */
+    int nr_threads;             /* Leader only: tasks in the group */
+    struct process *hash_next;  /* pid hash chain */
+} process_t;
+
+/* scheduler.c */
+process_t *current_task(void);
+process_t *find_process(pid_t pid);             /* Caller holds the tasklist lock */
+void tasklist_lock(void);
+void tasklist_unlock(void);
+
+/* signal.c; sighand->lock held for the first two */
+void init_sigpending(sigpending_t *pending);
+void recalc_sigpending(process_t *proc);
+void flush_sigqueue(sigpending_t *pending);
+
+#endif /* __SCHED_H__ */
@@ -4,59 +4,460 @@
  * Round-robin scheduler with process queue
  */
 
-#include <kernel.h>
+#include "sched.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
-#define MAX_PROCESSES 256
-#define TIMESLICE 10
-
-typedef struct process {
-    pid_t pid;
-    char name[32];
-    int state;
-    int priority;
-    uint64_t vruntime;
-    int timeslice;
-} process_t;
+#define MAX_PROCESSES PID_MAX
+#define TIMESLICE 10                /* Ticks */
+#define PID_HASH_BITS 12
+#define PID_HASH_SIZE (1U << PID_HASH_BITS)
 
 typedef struct {
     process_t *processes[MAX_PROCESSES];
     int count;
     int current;
     pid_t next_pid;
+    process_t *pid_hash[PID_HASH_SIZE];
+    spinlock_t lock;            /* Process table, pid hash and thread groups */
+    thread_struct_t thread;     /* Context schedule() runs in */
 } scheduler_t;
 
 static scheduler_t g_scheduler;
 
+/* No task: nothing is ever due */
+static unsigned long g_idle_ti_flags;
+unsigned long *g_current_ti_flags = &g_idle_ti_flags;
+
+/*
+ * Kernel stacks: THREAD_SIZE blocks from the page allocator, not kmalloc
+ * (whose large path adds a slab header and rounds up to twice the
+ * size). Freed stacks are kept on a list, linked through their first
+ * word, up to STACK_CACHE_MAX, so a thread that comes and goes never
+ * reaches the buddy allocator.
+ */
+#define STACK_ORDER         2
+#define STACK_CACHE_MAX     64
+
+_Static_assert((PAGE_SIZE << STACK_ORDER) == THREAD_SIZE, "stack order matches THREAD_SIZE");
+
+static struct {
+    spinlock_t lock;
+    void *free;
+    unsigned int nr;
+} g_stack_cache = { .lock = SPINLOCK_INIT };
+
+static void *alloc_thread_stack(void) {
+    spin_lock(&g_stack_cache.lock);
+    void *stack = g_stack_cache.free;
+    if (stack) {
+        g_stack_cache.free = *(void **)stack;
+        g_stack_cache.nr--;
+    }
+    spin_unlock(&g_stack_cache.lock);
+    if (stack) return stack;
+
+    page_t *page = alloc_pages(GFP_KERNEL, STACK_ORDER);
+    return page ? page_to_virt(page) : NULL;
+}
+
+static void free_thread_stack(void *stack) {
+    if (!stack) return;
+    spin_lock(&g_stack_cache.lock);
+    if (g_stack_cache.nr < STACK_CACHE_MAX) {
+        *(void **)stack = g_stack_cache.free;
+        g_stack_cache.free = stack;
+        g_stack_cache.nr++;
+        spin_unlock(&g_stack_cache.lock);
+        return;
+    }
+    spin_unlock(&g_stack_cache.lock);
+    page_free(virt_to_page(stack));
+}
+
 int scheduler_init(void) {
     memset(&g_scheduler, 0, sizeof(g_scheduler));
     g_scheduler.next_pid = 1;
     return 0;
 }
 
-pid_t do_fork(void) {
-    if (g_scheduler.count >= MAX_PROCESSES) return -ENOMEM;
-    
+static inline unsigned int pid_hashfn(pid_t pid) {
+    return (unsigned int)pid & (PID_HASH_SIZE - 1);
+}
+
+/* Make processes[idx] current and republish its ids in the vvar page */
+static void set_current(int idx) {
+    g_scheduler.current = idx;
+    process_t *proc = g_scheduler.processes[idx];
+    g_current_ti_flags = &proc->ti_flags;
+    vvar_set_task(proc->tgid, proc->ppid);
+}
+
+process_t *current_task(void) {
+    int cur = g_scheduler.current;
+    return cur < g_scheduler.count ? g_scheduler.processes[cur] : NULL;
+}
+
+pid_t do_getpid(void) {
+    const process_t *proc = current_task();
+    return proc ? proc->tgid : 0;
+}
+
+pid_t do_getppid(void) {
+    const process_t *proc = current_task();
+    return proc ? proc->ppid : 0;
+}
+
+tid_t do_gettid(void) {
+    const process_t *proc = current_task();
+    return proc ? proc->pid : 0;
+}
+
+files_struct_t *current_files(void) {
+    const process_t *proc = current_task();
+    return proc && proc->files ? proc->files : init_files_struct();
+}
+
+uint64_t current_tls(void) {
+    const process_t *proc = current_task();
+    return proc ? proc->thread.fsbase : 0;
+}
+
+static void put_sighand(sighand_struct_t *sighand) {
+    if (sighand && __atomic_sub_fetch(&sighand->count, 1, __ATOMIC_ACQ_REL) == 0)
+        kfree(sighand);
+}
+
+/* A private copy of from's dispositions; all default if from is NULL */
+static sighand_struct_t *copy_sighand(sighand_struct_t *from) {
+    sighand_struct_t *sighand = kmalloc(sizeof(*sighand), GFP_KERNEL);
+    if (!sighand) return NULL;
+    memset(sighand, 0, sizeof(*sighand));
+    sighand->count = 1;
+    if (from) {
+        spin_lock(&from->lock);
+        memcpy(sighand->action, from->action, sizeof(sighand->action));
+        spin_unlock(&from->lock);
+    }
+    return sighand;
+}
+
+/*
+ * A task that is not in the table yet, set up from the caller: priority
+ * and signal mask always, and a reference to or a copy of its
+ * descriptors and signal handlers as flags say. The address space is the
+ * caller's business. NULL with *err set on failure.
+ */
+static process_t *copy_process(unsigned long flags, int *err) {
+    process_t *parent = current_task();
     process_t *proc = (process_t *)kmalloc(sizeof(process_t), GFP_KERNEL);
-    if (!proc) return -ENOMEM;
-    
-    pid_t pid = g_scheduler.next_pid++;
-    proc->pid = pid;
+    if (!proc) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    memset(proc, 0, sizeof(*proc));
     proc->state = TASK_RUNNABLE;
-    proc->priority = 0;
-    proc->vruntime = 0;
     proc->timeslice = TIMESLICE;
-    snprintf(proc->name, sizeof(proc->name), "proc-%d", pid);
-    
+    init_sigpending(&proc->pending);
+    init_sigpending(&proc->shared_pending);
+    if (parent) {
+        proc->priority = parent->priority;
+        proc->blocked = parent->blocked;
+        if (flags & CLONE_THREAD) memcpy(proc->name, parent->name, sizeof(proc->name));
+    }
+
+    if (flags & CLONE_FILES) {
+        proc->files = current_files();
+        __atomic_add_fetch(&proc->files->count, 1, __ATOMIC_RELAXED);
+    } else {
+        proc->files = dup_fd(current_files(), err);
+    }
+    if ((flags & CLONE_SIGHAND) && parent) {
+        proc->sighand = parent->sighand;
+        __atomic_add_fetch(&proc->sighand->count, 1, __ATOMIC_RELAXED);
+    } else {
+        proc->sighand = copy_sighand(parent ? parent->sighand : NULL);
+        if (!proc->sighand) *err = -ENOMEM;
+    }
+    if (!proc->files || !proc->sighand) {
+        put_files_struct(proc->files);
+        put_sighand(proc->sighand);
+        kfree(proc);
+        return NULL;
+    }
+    return proc;
+}
+
+static void process_free(process_t *proc) {
+    flush_sigqueue(&proc->pending);
+    flush_sigqueue(&proc->shared_pending);
+    put_files_struct(proc->files);
+    mmput(proc->mm);
+    put_sighand(proc->sighand);
+    fpu_release(&proc->thread);
+    free_thread_stack(proc->stack);
+    kfree(proc);
+}
+
+/*
+ * Give proc a pid and make it visible, in the caller's thread group if
+ * thread is set, else leading a group of its own; frees it on failure.
+ */
+static pid_t process_publish(process_t *proc, bool thread) {
+    spin_lock(&g_scheduler.lock);
+    if (g_scheduler.count >= MAX_PROCESSES) {
+        spin_unlock(&g_scheduler.lock);
+        process_free(proc);
+        return -ENOMEM;
+    }
+    pid_t pid = g_scheduler.next_pid++;
+    process_t *parent = current_task();
+    proc->pid = pid;
+    if (thread) {
+        process_t *leader = parent->group_leader;
+        proc->group_leader = leader;
+        proc->tgid = leader->pid;
+        proc->ppid = leader->ppid;
+        proc->group_next = leader;
+        proc->group_prev = leader->group_prev;
+        leader->group_prev->group_next = proc;
+        leader->group_prev = proc;
+        leader->nr_threads++;
+    } else {
+        proc->group_leader = proc;
+        proc->tgid = pid;
+        proc->ppid = parent ? parent->tgid : 0;
+        proc->group_next = proc->group_prev = proc;
+        proc->nr_threads = 1;
+    }
+    if (!proc->name[0]) snprintf(proc->name, sizeof(proc->name), "proc-%d", pid);
+
     g_scheduler.processes[g_scheduler.count++] = proc;
-    
+    proc->hash_next = g_scheduler.pid_hash[pid_hashfn(pid)];
+    g_scheduler.pid_hash[pid_hashfn(pid)] = proc;
+    if (g_scheduler.count == 1) set_current(0);
+    spin_unlock(&g_scheduler.lock);
     return pid;
 }
 
-int do_exec(const char *filename, char *const argv[]) {
-    /* Simulate program execution */
+void tasklist_lock(void) {
+    spin_lock(&g_scheduler.lock);
+}
+
+void tasklist_unlock(void) {
+    spin_unlock(&g_scheduler.lock);
+}
+
+/* Caller holds g_scheduler.lock */
+process_t *find_process(pid_t pid) {
+    process_t *proc = g_scheduler.pid_hash[pid_hashfn(pid)];
+    while (proc && proc->pid != pid)
+        proc = proc->hash_next;
+    return proc;
+}
+
+/* Take processes[idx] out of the table, its pid hash and its group; caller holds the lock */
+static void unhash_process(process_t *proc, int idx) {
+    process_t **link = &g_scheduler.pid_hash[pid_hashfn(proc->pid)];
+    while (*link != proc)
+        link = &(*link)->hash_next;
+    *link = proc->hash_next;
+    if (proc->group_leader != proc) {
+        proc->group_prev->group_next = proc->group_next;
+        proc->group_next->group_prev = proc->group_prev;
+        proc->group_leader->nr_threads--;
+    }
+    g_scheduler.processes[idx] = g_scheduler.processes[--g_scheduler.count];
+    if (g_scheduler.current == g_scheduler.count) g_scheduler.current = idx;
+    if (g_current_ti_flags == &proc->ti_flags) g_current_ti_flags = &g_idle_ti_flags;
+}
+
+pid_t do_fork(void) {
+    int err = 0;
+    process_t *proc = copy_process(0, &err);
+    if (!proc) return err;
+
+    /* The child starts with a copy of the parent's memory too */
+    mm_struct_t *mm = current_mm();
+    if (mm && !(proc->mm = dup_mm(mm, &err))) {
+        process_free(proc);
+        return err;
+    }
+    return process_publish(proc, false);
+}
+
+/* First code a do_clone() task runs: its body, then exit and never come back */
+static void thread_main(void *arg) {
+    process_t *proc = arg;
+    /* Its first entry to user code; it may have been killed before it ran */
+    exit_to_user_mode();
+    if (proc->state != TASK_DEAD) {
+        proc->fn(proc->arg);
+        do_exit(0);
+    }
+    for (;;)
+        switch_to(&proc->thread, &g_scheduler.thread);
+}
+
+/*
+ * clone: a task running fn(arg) on its own kernel stack. What it shares
+ * is taken by reference, so a CLONE_VM | CLONE_FILES | CLONE_SIGHAND
+ * thread costs a task, a stack from the cache and three reference
+ * counts. Without CLONE_SETTLS its FS base points at a TLS block at the
+ * top of that stack: THREAD_TLS_SIZE - 64 zeroed bytes of data below a
+ * 64-byte TCB whose first word points to itself (x86-64 TLS variant II).
+ */
+tid_t do_clone(unsigned long flags, void (*fn)(void *arg), void *arg, uint64_t tls) {
+    const unsigned long known = CLONE_VM | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SETTLS;
+    int err = 0;
+
+    if (!fn || (flags & ~known)) return -EINVAL;
+    if ((flags & CLONE_SIGHAND) && !(flags & CLONE_VM)) return -EINVAL;
+    if ((flags & CLONE_THREAD) && !(flags & CLONE_SIGHAND)) return -EINVAL;
+    if ((flags & CLONE_THREAD) && !current_task()) return -EINVAL;
+
+    process_t *proc = copy_process(flags, &err);
+    if (!proc) return err;
+    mm_struct_t *mm = current_mm();
+    if (mm && (flags & CLONE_VM)) {
+        mmget(mm);
+        proc->mm = mm;
+    } else if (mm && !(proc->mm = dup_mm(mm, &err))) {
+        goto fail;
+    }
+
+    err = -ENOMEM;
+    if (!(proc->stack = alloc_thread_stack())) goto fail;
+    uint8_t *tcb = (uint8_t *)proc->stack + THREAD_SIZE - 64;
+    if ((err = copy_thread(&proc->thread, proc->stack, THREAD_SIZE - THREAD_TLS_SIZE,
+                           thread_main, proc)) < 0)
+        goto fail;
+    if (flags & CLONE_SETTLS) {
+        proc->thread.fsbase = tls;
+    } else {
+        memset(tcb - (THREAD_TLS_SIZE - 64), 0, THREAD_TLS_SIZE);
+        *(uint64_t *)tcb = (uint64_t)(uintptr_t)tcb;
+        proc->thread.fsbase = (uint64_t)(uintptr_t)tcb;
+    }
+    proc->fn = fn;
+    proc->arg = arg;
+    return process_publish(proc, flags & CLONE_THREAD);
+
+fail:
+    process_free(proc);
+    return err;
+}
+
+/* One file action against a spawned child's table */
+int spawn_file_action(files_struct_t *files, const spawn_file_action_t *fa) {
+    file_t *file;
+    int err = 0;
+
+    if (fa->fd < 0) return -EBADF;
+    switch (fa->action) {
+    case SPAWN_FA_CLOSE:
+        return close_fd(files, (unsigned int)fa->fd);
+    case SPAWN_FA_DUP2:
+        if (fa->srcfd < 0 || !(file = fget_files(files, (unsigned int)fa->srcfd))) return -EBADF;
+        if (fa->srcfd == fa->fd) {
+            fput(file);
+            return 0;
+        }
+        return replace_fd(files, (unsigned int)fa->fd, file);
+    case SPAWN_FA_OPEN:
+        if (!(file = vfs_open(fa->path, fa->flags, fa->mode, &err))) return err;
+        return replace_fd(files, (unsigned int)fa->fd, file);
+    }
+    return -EINVAL;
+}
+
+/*
+ * posix_spawn as one operation: the child is put together from the
+ * caller's side and only enters the process table once it is complete,
+ * so a bad path or file action is an error return, not a dead child.
+ */
+pid_t do_spawn(const char *path, const spawn_file_action_t *actions, unsigned int nactions,
+               const spawn_attr_t *attr, char *const argv[], char *const envp[]) {
+    int err = 0;
+
+    if (!path || (nactions && !actions)) return -EINVAL;
+    if (attr && ((attr->flags & ~(SPAWN_SETPRIORITY | SPAWN_SETSIGMASK)) ||
+                 ((attr->flags & SPAWN_SETPRIORITY) && (attr->priority < -20 || attr->priority > 19))))
+        return -EINVAL;
+
+    process_t *proc = copy_process(0, &err);
+    if (!proc) return err;
+    /* As across exec, caught signals go back to the default; ignored stay ignored */
+    for (int sig = 0; sig < NR_SIGNALS; sig++)
+        if (proc->sighand->action[sig].handler != KSIG_IGN)
+            proc->sighand->action[sig] = (k_sigaction_t){ .handler = KSIG_DFL };
+    for (unsigned int i = 0; i < nactions; i++)
+        if ((err = spawn_file_action(proc->files, &actions[i])) < 0) goto fail;
+
+    err = -ENOMEM;
+    if (!(proc->mm = mm_alloc())) goto fail;
+    if ((err = exec_load(proc->mm, path, argv, envp)) < 0) goto fail;
+
+    if (attr && (attr->flags & SPAWN_SETPRIORITY)) proc->priority = attr->priority;
+    if (attr && (attr->flags & SPAWN_SETSIGMASK)) proc->blocked = attr->sigmask;
+    const char *comm = strrchr(path, '/');
+    snprintf(proc->name, sizeof(proc->name), "%s", comm ? comm + 1 : path);
+    return process_publish(proc, false);
+
+fail:
+    process_free(proc);
+    return err;
+}
+
+mm_struct_t *current_mm(void) {
+    const process_t *proc = current_task();
+    return proc ? proc->mm : NULL;
+}
+
+/* exec's point of no return: the process takes mm; *old is the caller's to put */
+int exec_mm_replace(pid_t pid, mm_struct_t *mm, const char *comm, mm_struct_t **old) {
+    spin_lock(&g_scheduler.lock);
+    process_t *proc = pid ? find_process(pid) : current_task();
+    if (!proc) {
+        spin_unlock(&g_scheduler.lock);
+        return -ESRCH;
+    }
+    *old = proc->mm;
+    proc->mm = mm;
+    snprintf(proc->name, sizeof(proc->name), "%s", comm);
+    spin_unlock(&g_scheduler.lock);
+    return 0;
+}
+
+/* The process's descriptor table, referenced; NULL if there is no such process */
+files_struct_t *get_task_files(pid_t pid) {
+    spin_lock(&g_scheduler.lock);
+    process_t *proc = find_process(pid);
+    files_struct_t *files = proc ? proc->files : NULL;
+    if (files) __atomic_add_fetch(&files->count, 1, __ATOMIC_RELAXED);
+    spin_unlock(&g_scheduler.lock);
+    return files;
+}
+
+/*
+ * Take a task other than the current one out of the table and free it
+ * (reaping). A group leader goes last: -EBUSY while it has threads.
+ */
+int process_release(pid_t pid) {
+    spin_lock(&g_scheduler.lock);
+    process_t *proc = find_process(pid);
+    int idx = 0;
+    while (proc && g_scheduler.processes[idx] != proc)
+        idx++;
+    if (!proc || idx == g_scheduler.current || proc->nr_threads > 1) {
+        spin_unlock(&g_scheduler.lock);
+        return proc ? -EBUSY : -ESRCH;
+    }
+    unhash_process(proc, idx);
+    spin_unlock(&g_scheduler.lock);
+
+    process_free(proc);
     return 0;
 }
 
@@ -64,7 +465,99 @@ void do_exit(int code) {
     if (g_scheduler.current < g_scheduler.count) {
         process_t *proc = g_scheduler.processes[g_scheduler.current];
         proc->state = TASK_DEAD;
+        put_files_struct(proc->files);
+        proc->files = NULL;
+        mmput(proc->mm);
+        proc->mm = NULL;
+    }
+}
+
+int nr_processes(void) {
+    return g_scheduler.count;
+}
+
+static void fill_process_info(const process_t *proc, process_info_t *info) {
+    info->pid = proc->pid;
+    info->tgid = proc->tgid;
+    info->ppid = proc->ppid;
+    memcpy(info->name, proc->name, sizeof(info->name));
+    info->state = (task_state_t)proc->state;
+    info->priority = proc->priority;
+    info->vruntime = proc->vruntime;
+    info->timeslice = proc->timeslice;
+}
+
+int process_get_info(pid_t pid, process_info_t *info) {
+    spin_lock(&g_scheduler.lock);
+    process_t *proc = find_process(pid);
+    if (proc) fill_process_info(proc, info);
+    spin_unlock(&g_scheduler.lock);
+    return proc ? 0 : -ENOENT;
+}
+
+/* Snapshot the process at *cursor (table order) and advance; 0 at the end */
+int process_iterate(int *cursor, process_info_t *info) {
+    int found = 0;
+    spin_lock(&g_scheduler.lock);
+    if (*cursor >= 0 && *cursor < g_scheduler.count) {
+        fill_process_info(g_scheduler.processes[(*cursor)++], info);
+        found = 1;
     }
+    spin_unlock(&g_scheduler.lock);
+    return found;
+}
+
+/* Tick: charge the running process and rotate when its slice is used up */
+void scheduler_tick(void) {
+    spin_lock(&g_scheduler.lock);
+    int cur = g_scheduler.current;
+    if (cur < g_scheduler.count) {
+        process_t *proc = g_scheduler.processes[cur];
+        proc->vruntime += TICK_NSEC;
+        if (--proc->timeslice <= 0) {
+            proc->timeslice = TIMESLICE;
+            for (int i = 1; i < g_scheduler.count; i++) {
+                int next = (cur + i) % g_scheduler.count;
+                if (g_scheduler.processes[next]->state == TASK_RUNNABLE) {
+                    set_current(next);
+                    break;
+                }
+            }
+        }
+    }
+    spin_unlock(&g_scheduler.lock);
+}
+
+/*
+ * Every process runs this on its own kernel stack until exec can load
+ * a real program: burn a slice, then switch back to schedule(). Each
+ * time round stands for a return to user mode, so signals that arrived
+ * meanwhile are delivered first; one may stop or kill it.
+ */
+static void process_main(void *arg) {
+    process_t *proc = arg;
+    for (;;) {
+        exit_to_user_mode();
+        if (proc->state == TASK_RUNNABLE) {
+            for (int i = 0; i < 100000; i++) {
+                __asm__ volatile("nop");
+            }
+        }
+        switch_to(&proc->thread, &g_scheduler.thread);
+    }
+}
+
+/* Switch to proc for one slice; its stack is set up on the first run. schedule() is pid 0. */
+static int run_process(process_t *proc) {
+    if (!proc->stack) {
+        proc->stack = alloc_thread_stack();
+        if (!proc->stack) return -ENOMEM;
+        copy_thread(&proc->thread, proc->stack, THREAD_SIZE, process_main, proc);
+    }
+    trace_sched_switch(0, proc->pid);
+    switch_to(&g_scheduler.thread, &proc->thread);
+    trace_sched_switch(proc->pid, 0);
+    return 0;
 }
 
 void schedule(void) {
@@ -79,16 +572,24 @@ void schedule(void) {
     for (int cycle = 0; cycle < 10; cycle++) {
         if (g_scheduler.count == 0) break;
         
-        process_t *current = g_scheduler.processes[g_scheduler.current];
-        pr_debug("Running process %d (%s)\n", current->pid, current->name);
-        
-        /* Simulate process execution */
-        for (int i = 0; i < 100000; i++) {
-            __asm__ volatile("nop");
+        int idx = g_scheduler.current;
+        process_t *current = g_scheduler.processes[idx];
+        if (current->state == TASK_RUNNABLE) {
+            pr_debug("Running process %d (%s)\n", current->pid, current->name);
+            if (run_process(current) < 0)
+                pr_err("No kernel stack for process %d\n", current->pid);
         }
         
         /* Move to next process */
-        g_scheduler.current = (g_scheduler.current + 1) % g_scheduler.count;
+        set_current((idx + 1) % g_scheduler.count);
+
+        /* Nothing waits for a thread: once it has exited and switched away, reap it */
+        if (current->state == TASK_DEAD && current->group_leader != current) {
+            spin_lock(&g_scheduler.lock);
+            unhash_process(current, idx);
+            spin_unlock(&g_scheduler.lock);
+            process_free(current);
+        }
     }
     
     pr_info("Scheduling complete. %d processes executed.\n", g_scheduler.count);
@@ -0,0 +1,541 @@
+/**
+ * Signals - generation, delivery and synchronous consumption
+ *
+ * Sending takes the process table lock, so the target and its thread
+ * group stay put, and then the group's sighand lock, which also covers
+ * every pending set and blocked mask in the group. The signal goes on
+ * the target thread's pending set (tkill) or the group's shared one
+ * (kill, sigqueue). Every thread that could take it then has
+ * TIF_SIGPENDING recalculated, and anyone in sigtimedwait or a signalfd
+ * read is woken through the sighand's futex word.
+ *
+ * Some signals act when they are sent, as on Linux. SIGCONT resumes a
+ * stopped group and discards pending stops, and a stop signal discards
+ * a pending SIGCONT. A signal that is ignored and not blocked is
+ * dropped. An unblocked signal whose default action is fatal becomes
+ * SIGKILL for every thread in the group, so the group dies at its
+ * threads' next return to user code without running anything else.
+ *
+ * Delivery happens in exit_to_user_mode_slow(), on the current task
+ * only. It takes signals one at a time, the lowest number first and the
+ * thread's own before the group's. A handler runs with the signal and
+ * its sa_mask added to the blocked mask, and the old mask is restored
+ * when it returns. Default actions stop the group or terminate it.
+ */
+
+#include "sched.h"
+#include <string.h>
+
+/* Default actions other than terminate */
+#define SIG_DFL_IGNORE_MASK (SIGMASK(SIGCHLD) | SIGMASK(SIGURG) | SIGMASK(SIGWINCH) | SIGMASK(SIGCONT))
+#define SIG_DFL_STOP_MASK   (SIGMASK(SIGSTOP) | SIGMASK(SIGTSTP) | SIGMASK(SIGTTIN) | SIGMASK(SIGTTOU))
+/* Never caught, blocked or ignored */
+#define SIG_KERNEL_ONLY_MASK (SIGMASK(SIGKILL) | SIGMASK(SIGSTOP))
+
+static int g_nr_sigqueue;           /* Queued siginfos, against SIGQUEUE_MAX */
+
+static inline bool valid_signal(int sig) {
+    return sig >= 1 && sig <= NR_SIGNALS;
+}
+
+/* Every thread of p's group, leader first; caller holds the tasklist lock */
+#define for_each_thread(p, t) \
+    for (process_t *t = (p)->group_leader, *t##_first = t; t; \
+         t = t->group_next == t##_first ? NULL : t->group_next)
+
+/* ============================================================================
+ * Pending sets
+ * ============================================================================ */
+
+void init_sigpending(sigpending_t *pending) {
+    pending->signal = 0;
+    pending->head = NULL;
+    pending->tail = &pending->head;
+}
+
+static void sigqueue_free(sigqueue_t *q) {
+    kfree(q);
+    __atomic_sub_fetch(&g_nr_sigqueue, 1, __ATOMIC_RELAXED);
+}
+
+void flush_sigqueue(sigpending_t *pending) {
+    sigqueue_t *q = pending->head;
+    while (q) {
+        sigqueue_t *next = q->next;
+        sigqueue_free(q);
+        q = next;
+    }
+    init_sigpending(pending);
+}
+
+/* Drop every instance of the signals in mask */
+static void flush_signals(sigpending_t *pending, uint64_t mask) {
+    if (!(pending->signal & mask)) return;
+    pending->signal &= ~mask;
+    sigqueue_t **link = &pending->head;
+    while (*link) {
+        sigqueue_t *q = *link;
+        if (mask & SIGMASK(q->info.signo)) {
+            *link = q->next;
+            sigqueue_free(q);
+        } else {
+            link = &q->next;
+        }
+    }
+    pending->tail = link;
+}
+
+void recalc_sigpending(process_t *proc) {
+    uint64_t pending = proc->pending.signal | proc->group_leader->shared_pending.signal;
+    if (pending & ~proc->blocked)
+        __atomic_or_fetch(&proc->ti_flags, TIF_SIGPENDING, __ATOMIC_RELEASE);
+    else
+        __atomic_and_fetch(&proc->ti_flags, ~TIF_SIGPENDING, __ATOMIC_RELAXED);
+}
+
+/* Take the lowest-numbered signal in mask off pending; 0 if there is none */
+static int dequeue_from(sigpending_t *pending, uint64_t mask, k_siginfo_t *info) {
+    uint64_t ready = pending->signal & mask;
+    if (!ready) return 0;
+
+    int sig = __builtin_ctzll(ready) + 1;
+    sigqueue_t **link = &pending->head, *q;
+    while ((q = *link) && q->info.signo != sig)
+        link = &q->next;
+    if (q) {
+        *info = q->info;
+        *link = q->next;
+        if (pending->tail == &q->next) pending->tail = link;
+        sigqueue_free(q);
+        /* Another queued instance keeps it pending */
+        for (sigqueue_t *r = *link; r; r = r->next)
+            if (r->info.signo == sig) return sig;
+    } else {
+        /* Its siginfo could not be queued */
+        *info = (k_siginfo_t){ .signo = sig, .code = KSI_KERNEL };
+    }
+    pending->signal &= ~SIGMASK(sig);
+    return sig;
+}
+
+/* Caller holds proc->sighand->lock */
+static int dequeue_signal(process_t *proc, uint64_t mask, k_siginfo_t *info) {
+    int sig = dequeue_from(&proc->pending, mask, info);
+    if (!sig) sig = dequeue_from(&proc->group_leader->shared_pending, mask, info);
+    recalc_sigpending(proc);
+    return sig;
+}
+
+static void signal_wake_waiters(sighand_struct_t *sighand) {
+    __atomic_add_fetch(&sighand->wait_seq, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&sighand->nr_waiters, __ATOMIC_ACQUIRE))
+        futex_wake(&sighand->wait_seq, INT32_MAX);
+}
+
+/* ============================================================================
+ * Generation
+ * ============================================================================ */
+
+static bool sig_ignored(const process_t *t, int sig) {
+    if (t->blocked & SIGMASK(sig)) return false;    /* The handler may change before unblocking */
+    k_sighandler_t handler = t->sighand->action[sig - 1].handler;
+    return handler == KSIG_IGN ||
+           (handler == KSIG_DFL && (SIG_DFL_IGNORE_MASK & SIGMASK(sig)));
+}
+
+/*
+ * What happens at generation, whatever the disposition; false if the
+ * signal goes no further. Caller holds both locks.
+ */
+static bool prepare_signal(process_t *t, int sig) {
+    process_t *leader = t->group_leader;
+
+    if (SIG_DFL_STOP_MASK & SIGMASK(sig)) {
+        flush_signals(&leader->shared_pending, SIGMASK(SIGCONT));
+        for_each_thread(t, p)
+            flush_signals(&p->pending, SIGMASK(SIGCONT));
+    } else if (sig == SIGCONT) {
+        flush_signals(&leader->shared_pending, SIG_DFL_STOP_MASK);
+        for_each_thread(t, p) {
+            flush_signals(&p->pending, SIG_DFL_STOP_MASK);
+            if (p->state == TASK_STOPPED) p->state = TASK_RUNNABLE;
+        }
+    }
+    return sig == SIGKILL || !sig_ignored(t, sig);
+}
+
+static void group_kill(process_t *t) {
+    for_each_thread(t, p) {
+        p->pending.signal |= SIGMASK(SIGKILL);
+        if (p->state == TASK_STOPPED) p->state = TASK_RUNNABLE;
+        recalc_sigpending(p);
+    }
+}
+
+/* Flag the signal to whoever can take it; caller holds both locks */
+static void complete_signal(process_t *t, int sig, bool group) {
+    k_sighandler_t handler = t->sighand->action[sig - 1].handler;
+    bool fatal = sig == SIGKILL ||
+                 (handler == KSIG_DFL && !(t->blocked & SIGMASK(sig)) &&
+                  !((SIG_DFL_IGNORE_MASK | SIG_DFL_STOP_MASK) & SIGMASK(sig)));
+
+    if (fatal) {
+        group_kill(t);
+    } else if (group) {
+        for_each_thread(t, p)
+            recalc_sigpending(p);
+    } else {
+        recalc_sigpending(t);
+    }
+}
+
+/* Caller holds the tasklist lock */
+static int send_signal(process_t *t, int sig, const k_siginfo_t *info, bool group) {
+    sighand_struct_t *sighand = t->sighand;
+    int ret = 0;
+
+    /* A group outlives its leader's exit; a thread does not */
+    if (!group && t->state == TASK_DEAD) return 0;
+    spin_lock(&sighand->lock);
+    if (!prepare_signal(t, sig)) goto out;
+
+    sigpending_t *pending = group ? &t->group_leader->shared_pending : &t->pending;
+    if (sig < KSIGRTMIN && (pending->signal & SIGMASK(sig))) goto out;    /* Coalesces */
+
+    sigqueue_t *q = NULL;
+    if (__atomic_add_fetch(&g_nr_sigqueue, 1, __ATOMIC_RELAXED) <= SIGQUEUE_MAX)
+        q = kmalloc(sizeof(*q), GFP_KERNEL);
+    if (q) {
+        q->next = NULL;
+        q->info = *info;
+        *pending->tail = q;
+        pending->tail = &q->next;
+    } else {
+        __atomic_sub_fetch(&g_nr_sigqueue, 1, __ATOMIC_RELAXED);
+        /* sigqueue() promises the value or fails; kill() still sets the bit */
+        if (info->code == KSI_QUEUE) {
+            ret = -EAGAIN;
+            goto out;
+        }
+    }
+    pending->signal |= SIGMASK(sig);
+    complete_signal(t, sig, group);
+    signal_wake_waiters(sighand);
+out:
+    spin_unlock(&sighand->lock);
+    return ret;
+}
+
+static int kill_pid_info(pid_t pid, int sig, int code, uint64_t value, bool group) {
+    if (sig != 0 && !valid_signal(sig)) return -EINVAL;
+    if (pid <= 0) return -EINVAL;       /* No process groups */
+
+    process_t *self = current_task();
+    k_siginfo_t info = {
+        .signo = sig,
+        .code = code,
+        .pid = self ? self->tgid : 0,
+        .value = value,
+    };
+    tasklist_lock();
+    process_t *t = find_process(pid);
+    int ret = !t ? -ESRCH : sig ? send_signal(group ? t->group_leader : t, sig, &info, group) : 0;
+    tasklist_unlock();
+    return ret;
+}
+
+/* Send sig to the process (thread group) pid belongs to; sig 0 only checks it exists */
+int do_kill(pid_t pid, int sig) {
+    return kill_pid_info(pid, sig, KSI_USER, 0, true);
+}
+
+/* Send sig to thread tid alone */
+int do_tkill(tid_t tid, int sig) {
+    return kill_pid_info(tid, sig, KSI_TKILL, 0, false);
+}
+
+/* kill() with a payload; -EAGAIN if the siginfo cannot be queued */
+int do_sigqueue(pid_t pid, int sig, uint64_t value) {
+    return kill_pid_info(pid, sig, KSI_QUEUE, value, true);
+}
+
+/* ============================================================================
+ * Delivery
+ * ============================================================================ */
+
+static void group_stop(process_t *proc) {
+    tasklist_lock();
+    spin_lock(&proc->sighand->lock);
+    for_each_thread(proc, p)
+        if (p->state == TASK_RUNNABLE) p->state = TASK_STOPPED;
+    spin_unlock(&proc->sighand->lock);
+    tasklist_unlock();
+}
+
+/* proc dies of sig, and takes the rest of its group with it */
+static void signal_exit(process_t *proc, int sig) {
+    tasklist_lock();
+    spin_lock(&proc->sighand->lock);
+    group_kill(proc);
+    flush_sigqueue(&proc->pending);
+    __atomic_and_fetch(&proc->ti_flags, ~TIF_SIGPENDING, __ATOMIC_RELAXED);
+    spin_unlock(&proc->sighand->lock);
+    tasklist_unlock();
+    do_exit(sig);
+}
+
+void exit_to_user_mode_slow(void) {
+    process_t *proc = current_task();
+    if (!proc) return;
+    sighand_struct_t *sighand = proc->sighand;
+    k_siginfo_t info;
+
+    while (proc->state != TASK_DEAD) {
+        spin_lock(&sighand->lock);
+        int sig = dequeue_signal(proc, ~proc->blocked, &info);
+        if (!sig) {
+            spin_unlock(&sighand->lock);
+            return;
+        }
+        k_sigaction_t *ka = &sighand->action[sig - 1];
+        k_sighandler_t handler = ka->handler;
+
+        if (handler == KSIG_IGN) {
+            spin_unlock(&sighand->lock);
+            continue;
+        }
+        if (handler == KSIG_DFL) {
+            spin_unlock(&sighand->lock);
+            if (SIG_DFL_IGNORE_MASK & SIGMASK(sig)) continue;
+            if (SIG_DFL_STOP_MASK & SIGMASK(sig)) {
+                group_stop(proc);
+                continue;
+            }
+            signal_exit(proc, sig);
+            return;
+        }
+
+        uint64_t saved = proc->blocked;
+        proc->blocked |= ka->mask;
+        if (!(ka->flags & KSA_NODEFER)) proc->blocked |= SIGMASK(sig);
+        proc->blocked &= ~SIG_KERNEL_ONLY_MASK;
+        if (ka->flags & KSA_RESETHAND) *ka = (k_sigaction_t){ .handler = KSIG_DFL };
+        recalc_sigpending(proc);
+        spin_unlock(&sighand->lock);
+
+        handler(sig);
+
+        spin_lock(&sighand->lock);
+        proc->blocked = saved;
+        recalc_sigpending(proc);
+        spin_unlock(&sighand->lock);
+    }
+    __atomic_and_fetch(&proc->ti_flags, ~TIF_SIGPENDING, __ATOMIC_RELAXED);
+}
+
+/* ============================================================================
+ * Dispositions and masks
+ * ============================================================================ */
+
+int do_sigaction(int sig, const k_sigaction_t *act, k_sigaction_t *oact) {
+    process_t *proc = current_task();
+    if (!valid_signal(sig)) return -EINVAL;
+    if (act && (SIG_KERNEL_ONLY_MASK & SIGMASK(sig))) return -EINVAL;
+    if (!proc) return -ESRCH;
+
+    tasklist_lock();
+    spin_lock(&proc->sighand->lock);
+    k_sigaction_t *ka = &proc->sighand->action[sig - 1];
+    if (oact) *oact = *ka;
+    if (act) {
+        *ka = *act;
+        ka->mask &= ~SIG_KERNEL_ONLY_MASK;
+        /* Ignoring a signal discards what is pending of it (POSIX) */
+        if (act->handler == KSIG_IGN ||
+            (act->handler == KSIG_DFL && (SIG_DFL_IGNORE_MASK & SIGMASK(sig)))) {
+            flush_signals(&proc->group_leader->shared_pending, SIGMASK(sig));
+            for_each_thread(proc, p) {
+                flush_signals(&p->pending, SIGMASK(sig));
+                recalc_sigpending(p);
+            }
+        }
+    }
+    spin_unlock(&proc->sighand->lock);
+    tasklist_unlock();
+    return 0;
+}
+
+/* The calling thread's mask; newly unblocked signals go out on the way back to user code */
+int do_sigprocmask(int how, const uint64_t *set, uint64_t *oset) {
+    process_t *proc = current_task();
+    if (!proc) return -ESRCH;
+
+    spin_lock(&proc->sighand->lock);
+    uint64_t blocked = proc->blocked;
+    if (oset) *oset = blocked;
+    if (set) {
+        switch (how) {
+        case KSIG_BLOCK:
+            blocked |= *set;
+            break;
+        case KSIG_UNBLOCK:
+            blocked &= ~*set;
+            break;
+        case KSIG_SETMASK:
+            blocked = *set;
+            break;
+        default:
+            spin_unlock(&proc->sighand->lock);
+            return -EINVAL;
+        }
+        proc->blocked = blocked & ~SIG_KERNEL_ONLY_MASK;
+        recalc_sigpending(proc);
+    }
+    spin_unlock(&proc->sighand->lock);
+    return 0;
+}
+
+/* Pending signals the calling thread blocks */
+int do_sigpending(uint64_t *set) {
+    process_t *proc = current_task();
+    if (!proc) return -ESRCH;
+    spin_lock(&proc->sighand->lock);
+    *set = (proc->pending.signal | proc->group_leader->shared_pending.signal) & proc->blocked;
+    spin_unlock(&proc->sighand->lock);
+    return 0;
+}
+
+/* ============================================================================
+ * Synchronous consumption
+ * ============================================================================ */
+
+/*
+ * Take a signal in set, blocked or not, waiting up to timeout_ns for one
+ * (0: don't wait, negative: no limit). An unblocked signal outside set
+ * ends the wait with -EINTR, to be delivered on the way out.
+ */
+static int signal_wait(uint64_t set, k_siginfo_t *info, int64_t timeout_ns) {
+    process_t *proc = current_task();
+    if (!proc) return -ESRCH;
+    sighand_struct_t *sighand = proc->sighand;
+    uint64_t deadline = timeout_ns > 0 ? ktime_get_ns() + (uint64_t)timeout_ns : KTIME_MAX;
+    int ret = -EAGAIN;
+    bool waiting = false;
+
+    set &= ~SIG_KERNEL_ONLY_MASK;
+    for (;;) {
+        spin_lock(&sighand->lock);
+        int sig = dequeue_signal(proc, set, info);
+        uint32_t seq = sighand->wait_seq;
+        bool interrupted = !sig && (proc->ti_flags & TIF_SIGPENDING);
+        if (!waiting && !sig && !interrupted && timeout_ns != 0) {
+            sighand->nr_waiters++;
+            waiting = true;
+        }
+        spin_unlock(&sighand->lock);
+
+        if (sig) {
+            ret = sig;
+            break;
+        }
+        if (interrupted) {
+            ret = -EINTR;
+            break;
+        }
+        if (timeout_ns == 0 || (timeout_ns > 0 && ktime_get_ns() >= deadline)) break;
+        /* Timed out: one more look, then the deadline check above ends it */
+        futex_wait_until(&sighand->wait_seq, seq, deadline);
+    }
+    if (waiting) __atomic_sub_fetch(&sighand->nr_waiters, 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/* sigtimedwait: the signal number, -EAGAIN on timeout or -EINTR */
+int do_sigtimedwait(uint64_t set, k_siginfo_t *info, int64_t timeout_ns) {
+    k_siginfo_t dummy;
+    return signal_wait(set, info ? info : &dummy, timeout_ns);
+}
+
+typedef struct {
+    uint64_t mask;
+} signalfd_ctx_t;
+
+static const file_operations_t signalfd_fops;
+
+/* As many k_siginfo_t records as fit, waiting for the first unless non-blocking */
+static int64_t signalfd_read_iter(kiocb_t *iocb, iov_iter_t *iter) {
+    signalfd_ctx_t *ctx = iocb->ki_filp->private_data;
+    bool nowait = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    uint64_t mask = __atomic_load_n(&ctx->mask, __ATOMIC_RELAXED);
+    k_siginfo_t info;
+    int64_t done = 0;
+
+    if (iter->count < sizeof(info)) return -EINVAL;
+    int ret = signal_wait(mask, &info, nowait ? 0 : -1);
+    while (ret > 0) {
+        copy_to_iter(&info, sizeof(info), iter);
+        done += (int64_t)sizeof(info);
+        if (iter->count < sizeof(info)) break;
+        ret = signal_wait(mask, &info, 0);
+    }
+    return done ? done : ret;
+}
+
+static void signalfd_release(inode_t *inode, file_t *file) {
+    (void)inode;
+    kfree(file->private_data);
+}
+
+static const file_operations_t signalfd_fops = {
+    .read_iter = signalfd_read_iter,
+    .release   = signalfd_release,
+};
+
+/*
+ * A file that reads the caller's pending signals in mask as k_siginfo_t
+ * records (fd -1), or a new mask for an existing one. The signals should
+ * be blocked, or they may be delivered before anyone reads them.
+ */
+int do_signalfd(int fd, uint64_t mask, int flags) {
+    if (flags & ~O_NONBLOCK) return -EINVAL;
+    mask &= ~SIG_KERNEL_ONLY_MASK;
+
+    if (fd >= 0) {
+        file_t *file = fget((unsigned int)fd);
+        if (!file) return -EBADF;
+        int ret = -EINVAL;
+        if (file->f_op == &signalfd_fops) {
+            signalfd_ctx_t *ctx = file->private_data;
+            __atomic_store_n(&ctx->mask, mask, __ATOMIC_RELAXED);
+            ret = fd;
+        }
+        fput(file);
+        return ret;
+    }
+    if (fd != -1) return -EBADF;
+
+    signalfd_ctx_t *ctx = kmalloc(sizeof(*ctx), GFP_KERNEL);
+    inode_t *inode = new_inode(NULL);
+    files_struct_t *files = current_files();
+    file_t *file = NULL;
+    int ret = -ENOMEM;
+    if (!ctx || !inode) goto fail;
+    ctx->mask = mask;
+
+    ret = alloc_fd(files, 0);
+    if (ret < 0) goto fail;
+    file = alloc_file_pseudo(inode, O_RDONLY | flags, &signalfd_fops);
+    if (!file) {
+        put_unused_fd(files, (unsigned int)ret);
+        ret = -ENOMEM;
+        goto fail;
+    }
+    file->private_data = ctx;
+    fd_install(files, (unsigned int)ret, file);
+    return ret;
+
+fail:
+    if (inode) iput(inode);
+    kfree(ctx);
+    return ret;
+}
@@ -0,0 +1,243 @@
+/**
+ * Softirqs and tasklets
+ *
+ * preempt_count tracks interrupt nesting for the running context:
+ * hardirq depth in bits 16-23, softirq depth in bits 8-15 (serving a
+ * softirq adds SOFTIRQ_OFFSET, local_bh_disable() adds twice that).
+ * Hosted builds keep it per thread, since several threads may run as
+ * the same emulated CPU.
+ *
+ * Pending softirqs are a per-CPU bitmask. One pass runs every pending
+ * handler; raises that arrive meanwhile restart the pass, up to
+ * MAX_SOFTIRQ_RESTART times or MAX_SOFTIRQ_TIME_NS. Anything left after
+ * that waits for the next irq_exit() or idle loop instead of starving
+ * the interrupted context.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+#define MAX_SOFTIRQ_RESTART     10
+#define MAX_SOFTIRQ_TIME_NS     (2 * 1000 * 1000ULL)
+
+typedef struct {
+    tasklet_t *head;
+    tasklet_t **tail;
+} tasklet_head_t;
+
+typedef struct {
+    uint32_t pending;               /* 1 << nr per raised softirq */
+    spinlock_t lock;                /* One softirq pass at a time */
+    spinlock_t tasklet_lock;
+    tasklet_head_t tasklet_vec;
+    tasklet_head_t tasklet_hi_vec;
+    uint64_t count[NR_SOFTIRQS];
+} __attribute__((aligned(64))) softirq_cpu_t;
+
+static const char *const g_softirq_names[NR_SOFTIRQS] = {
+    [HI_SOFTIRQ]      = "HI",
+    [TIMER_SOFTIRQ]   = "TIMER",
+    [BLOCK_SOFTIRQ]   = "BLOCK",
+    [TASKLET_SOFTIRQ] = "TASKLET",
+};
+
+static void (*g_softirq_vec[NR_SOFTIRQS])(void);
+static softirq_cpu_t g_softirq_cpu[NR_CPUS];
+static _Thread_local unsigned int g_preempt_count;
+
+unsigned int preempt_count(void) {
+    return g_preempt_count;
+}
+
+void open_softirq(unsigned int nr, void (*action)(void)) {
+    if (nr < NR_SOFTIRQS) g_softirq_vec[nr] = action;
+}
+
+/* Mark nr pending without running anything */
+static inline void __raise_softirq(unsigned int nr) {
+    __atomic_fetch_or(&g_softirq_cpu[smp_processor_id()].pending, 1U << nr, __ATOMIC_SEQ_CST);
+}
+
+bool local_softirq_pending(void) {
+    return __atomic_load_n(&g_softirq_cpu[smp_processor_id()].pending, __ATOMIC_SEQ_CST) != 0;
+}
+
+/* Returns false if it gave up with softirqs still pending */
+static bool __do_softirq(softirq_cpu_t *sc) {
+    uint64_t end = ktime_get_ns() + MAX_SOFTIRQ_TIME_NS;
+    int restart = MAX_SOFTIRQ_RESTART;
+
+    g_preempt_count += SOFTIRQ_OFFSET;
+    for (;;) {
+        uint32_t pending = __atomic_exchange_n(&sc->pending, 0, __ATOMIC_SEQ_CST);
+        while (pending) {
+            unsigned int nr = (unsigned int)__builtin_ctz(pending);
+            pending &= pending - 1;
+            __atomic_fetch_add(&sc->count[nr], 1, __ATOMIC_RELAXED);
+            if (g_softirq_vec[nr]) g_softirq_vec[nr]();
+        }
+        if (!__atomic_load_n(&sc->pending, __ATOMIC_SEQ_CST)) break;
+        if (--restart == 0 || ktime_get_ns() >= end) {
+            g_preempt_count -= SOFTIRQ_OFFSET;
+            return false;
+        }
+    }
+    g_preempt_count -= SOFTIRQ_OFFSET;
+    return true;
+}
+
+void do_softirq(void) {
+    if (in_interrupt()) return;
+
+    softirq_cpu_t *sc = &g_softirq_cpu[smp_processor_id()];
+    /*
+     * Another thread on this CPU may be mid-pass. It rechecks pending
+     * after unlocking, so a raise that loses the trylock is not lost.
+     */
+    while (__atomic_load_n(&sc->pending, __ATOMIC_SEQ_CST) && spin_trylock(&sc->lock)) {
+        bool done = __do_softirq(sc);
+        spin_unlock(&sc->lock);
+        if (!done) break;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/* Raise nr on this CPU; outside interrupt context it runs before returning */
+void raise_softirq(unsigned int nr) {
+    __raise_softirq(nr);
+    if (!in_interrupt()) do_softirq();
+}
+
+void irq_enter(void) {
+    g_preempt_count += HARDIRQ_OFFSET;
+}
+
+/* Leaving the outermost interrupt runs what its handlers raised */
+void irq_exit(void) {
+    g_preempt_count -= HARDIRQ_OFFSET;
+    if (!in_interrupt() && local_softirq_pending())
+        do_softirq();
+}
+
+void local_bh_disable(void) {
+    g_preempt_count += SOFTIRQ_DISABLE_OFFSET;
+}
+
+void local_bh_enable(void) {
+    g_preempt_count -= SOFTIRQ_DISABLE_OFFSET;
+    if (!in_interrupt() && local_softirq_pending())
+        do_softirq();
+}
+
+const char *softirq_name(unsigned int nr) {
+    return nr < NR_SOFTIRQS ? g_softirq_names[nr] : NULL;
+}
+
+uint64_t softirq_count(unsigned int nr, unsigned int cpu) {
+    if (nr >= NR_SOFTIRQS || cpu >= NR_CPUS) return 0;
+    return __atomic_load_n(&g_softirq_cpu[cpu].count[nr], __ATOMIC_RELAXED);
+}
+
+/* ============================================================================
+ * Tasklets
+ * ============================================================================ */
+
+void tasklet_setup(tasklet_t *t, void (*func)(tasklet_t *t)) {
+    memset(t, 0, sizeof(*t));
+    t->func = func;
+}
+
+static void tasklet_enqueue(tasklet_t *t, bool hi) {
+    softirq_cpu_t *sc = &g_softirq_cpu[smp_processor_id()];
+    tasklet_head_t *list = hi ? &sc->tasklet_hi_vec : &sc->tasklet_vec;
+
+    spin_lock(&sc->tasklet_lock);
+    t->next = NULL;
+    *list->tail = t;
+    list->tail = &t->next;
+    spin_unlock(&sc->tasklet_lock);
+}
+
+static void __tasklet_schedule(tasklet_t *t, bool hi) {
+    if (__atomic_fetch_or(&t->state, TASKLET_STATE_SCHED, __ATOMIC_ACQ_REL) & TASKLET_STATE_SCHED)
+        return;                     /* Already queued: it will run once */
+    tasklet_enqueue(t, hi);
+    raise_softirq(hi ? HI_SOFTIRQ : TASKLET_SOFTIRQ);
+}
+
+void tasklet_schedule(tasklet_t *t) {
+    __tasklet_schedule(t, false);
+}
+
+void tasklet_hi_schedule(tasklet_t *t) {
+    __tasklet_schedule(t, true);
+}
+
+static void tasklet_action_common(bool hi) {
+    softirq_cpu_t *sc = &g_softirq_cpu[smp_processor_id()];
+    tasklet_head_t *list = hi ? &sc->tasklet_hi_vec : &sc->tasklet_vec;
+
+    spin_lock(&sc->tasklet_lock);
+    tasklet_t *t = list->head;
+    list->head = NULL;
+    list->tail = &list->head;
+    spin_unlock(&sc->tasklet_lock);
+
+    while (t) {
+        tasklet_t *next = t->next;
+        uint32_t old = __atomic_fetch_or(&t->state, TASKLET_STATE_RUN, __ATOMIC_ACQUIRE);
+        if (!(old & TASKLET_STATE_RUN)) {
+            if (!__atomic_load_n(&t->count, __ATOMIC_ACQUIRE)) {
+                __atomic_fetch_and(&t->state, ~TASKLET_STATE_SCHED, __ATOMIC_ACQ_REL);
+                t->func(t);
+                __atomic_fetch_and(&t->state, ~TASKLET_STATE_RUN, __ATOMIC_RELEASE);
+                t = next;
+                continue;
+            }
+            __atomic_fetch_and(&t->state, ~TASKLET_STATE_RUN, __ATOMIC_RELEASE);
+        }
+        /* Disabled, or running on another CPU: try again next pass */
+        tasklet_enqueue(t, hi);
+        __raise_softirq(hi ? HI_SOFTIRQ : TASKLET_SOFTIRQ);
+        t = next;
+    }
+}
+
+static void tasklet_action(void) {
+    tasklet_action_common(false);
+}
+
+static void tasklet_hi_action(void) {
+    tasklet_action_common(true);
+}
+
+/* Keep t from running; waits for a run in progress */
+void tasklet_disable(tasklet_t *t) {
+    __atomic_fetch_add(&t->count, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) & TASKLET_STATE_RUN)
+        cpu_relax();
+}
+
+void tasklet_enable(tasklet_t *t) {
+    __atomic_fetch_sub(&t->count, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Wait until t is neither queued nor running; it must not reschedule itself */
+void tasklet_kill(tasklet_t *t) {
+    while (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) & TASKLET_STATE_SCHED) {
+        do_softirq();
+        cond_resched();
+    }
+    while (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) & TASKLET_STATE_RUN)
+        cpu_relax();
+}
+
+void init_softirq(void) {
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        softirq_cpu_t *sc = &g_softirq_cpu[cpu];
+        sc->tasklet_vec.tail = &sc->tasklet_vec.head;
+        sc->tasklet_hi_vec.tail = &sc->tasklet_hi_vec.head;
+    }
+    open_softirq(TASKLET_SOFTIRQ, tasklet_action);
+    open_softirq(HI_SOFTIRQ, tasklet_hi_action);
+}
@@ -3,11 +3,203 @@
  */
 
 #include <kernel.h>
+#ifdef __unix__
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define SPIN_BEFORE_YIELD   128
+
+/**
+ * cond_resched
+ *
+ * Give up the CPU if something else wants it. Hosted builds share CPUs
+ * with other threads, so waiters must not burn the lock holder's slice.
+ */
+void cond_resched(void) {
+#ifdef __unix__
+    sched_yield();
+#endif
+}
 
 void spin_lock(spinlock_t *lock) {
-    /* TODO */
+    while (__atomic_exchange_n(&lock->val, 1, __ATOMIC_ACQUIRE)) {
+        /* Spin on a plain load so waiters don't bounce the cache line */
+        for (int spins = 0; __atomic_load_n(&lock->val, __ATOMIC_RELAXED); spins++) {
+            if (spins < SPIN_BEFORE_YIELD) {
+                cpu_relax();
+            } else {
+                cond_resched();
+                spins = 0;
+            }
+        }
+    }
 }
 
 void spin_unlock(spinlock_t *lock) {
-    /* TODO */
+    __atomic_store_n(&lock->val, 0, __ATOMIC_RELEASE);
+}
+
+int spin_trylock(spinlock_t *lock) {
+    if (__atomic_load_n(&lock->val, __ATOMIC_RELAXED))
+        return 0;
+    return !__atomic_exchange_n(&lock->val, 1, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Futexes
+ *
+ * Waiters hang off a hash bucket chosen by address. The value check in
+ * futex_queue() and the wakeup in futex_wake() both run under the bucket
+ * lock, so a waker that changes *uaddr before calling futex_wake() can
+ * never slip between a waiter's check and its enqueue.
+ */
+#define FUTEX_HASH_BITS     8
+#define FUTEX_HASH_SIZE     (1U << FUTEX_HASH_BITS)
+
+typedef struct {
+    spinlock_t lock;
+    futex_q_t *head;
+} futex_bucket_t;
+
+static futex_bucket_t g_futex_queues[FUTEX_HASH_SIZE];
+
+static futex_bucket_t *futex_hash(const uint32_t *uaddr) {
+    uint64_t key = (uint64_t)(uintptr_t)uaddr * 0x9E3779B97F4A7C15ULL;
+    return &g_futex_queues[key >> (64 - FUTEX_HASH_BITS)];
+}
+
+/* Queue q on uaddr if it still holds val; -EAGAIN if it does not */
+int futex_queue(futex_q_t *q, uint32_t *uaddr, uint32_t val) {
+    futex_bucket_t *hb = futex_hash(uaddr);
+
+    q->uaddr = uaddr;
+    q->woken = 0;
+    spin_lock(&hb->lock);
+    if (__atomic_load_n(uaddr, __ATOMIC_RELAXED) != val) {
+        spin_unlock(&hb->lock);
+        return -EAGAIN;
+    }
+    futex_q_t **pp = &hb->head;
+    while (*pp) pp = &(*pp)->next;
+    q->next = NULL;
+    *pp = q;
+    spin_unlock(&hb->lock);
+    return 0;
+}
+
+/* Take q back off its queue; false if a wakeup already claimed it */
+bool futex_unqueue(futex_q_t *q) {
+    futex_bucket_t *hb = futex_hash(q->uaddr);
+    bool found = false;
+
+    spin_lock(&hb->lock);
+    for (futex_q_t **pp = &hb->head; *pp; pp = &(*pp)->next) {
+        if (*pp == q) {
+            *pp = q->next;
+            found = true;
+            break;
+        }
+    }
+    spin_unlock(&hb->lock);
+    return found;
+}
+
+/*
+ * A synchronous waiter spins briefly, then sleeps until woken or until the
+ * ktime clock passes deadline (KTIME_MAX: never). Hosted Linux builds
+ * park the thread on its own woken word (0 -> 2 marks a sleeper), so a
+ * workqueue worker blocked here costs its CPU nothing while the pool
+ * runs another worker in its place.
+ */
+int futex_wait_until(uint32_t *uaddr, uint32_t val, uint64_t deadline) {
+    futex_q_t q = { .wake = NULL };
+    int ret = futex_queue(&q, uaddr, val);
+    if (ret < 0) return ret;
+
+    for (int spins = 0; spins < SPIN_BEFORE_YIELD; spins++) {
+        if (__atomic_load_n(&q.woken, __ATOMIC_ACQUIRE)) return 0;
+        cpu_relax();
+    }
+
+    wq_worker_sleeping();
+    /* 2 only marks a sleeper: the waker stores 1 once q is off the queue */
+    while (__atomic_load_n(&q.woken, __ATOMIC_ACQUIRE) != 1) {
+        uint64_t now = deadline != KTIME_MAX ? ktime_get_ns() : 0;
+        if (now >= deadline) {
+            if (futex_unqueue(&q)) {
+                ret = -ETIMEDOUT;
+                break;
+            }
+            /* A wakeup claimed q first; q must outlive its store */
+            while (__atomic_load_n(&q.woken, __ATOMIC_ACQUIRE) != 1) cpu_relax();
+            break;
+        }
+#ifdef __linux__
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&q.woken, &idle, 2, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || idle == 2) {
+            struct timespec ts, *timeout = NULL;
+            if (deadline != KTIME_MAX) {
+                ts.tv_sec = (time_t)((deadline - now) / NSEC_PER_SEC);
+                ts.tv_nsec = (long)((deadline - now) % NSEC_PER_SEC);
+                timeout = &ts;
+            }
+            syscall(SYS_futex, &q.woken, FUTEX_WAIT_PRIVATE, 2, timeout, NULL, 0);
+        }
+#else
+        cond_resched();
+#endif
+    }
+    wq_worker_running();
+    return ret;
+}
+
+int futex_wait(uint32_t *uaddr, uint32_t val) {
+    return futex_wait_until(uaddr, val, KTIME_MAX);
+}
+
+/* Wake up to nr waiters on uaddr in arrival order; returns how many woke */
+int futex_wake(uint32_t *uaddr, int nr) {
+    futex_bucket_t *hb = futex_hash(uaddr);
+    futex_q_t *woken = NULL, **tail = &woken;
+    int n = 0;
+
+    spin_lock(&hb->lock);
+    for (futex_q_t **pp = &hb->head; *pp && n < nr; ) {
+        futex_q_t *q = *pp;
+        if (q->uaddr != uaddr) {
+            pp = &q->next;
+            continue;
+        }
+        *pp = q->next;
+        q->next = NULL;
+        *tail = q;
+        tail = &q->next;
+        n++;
+    }
+    spin_unlock(&hb->lock);
+
+    /* A synchronous waiter's q is gone the moment woken is set */
+    while (woken) {
+        futex_q_t *q = woken;
+        woken = q->next;
+        if (q->wake) {
+            q->wake(q);
+            continue;
+        }
+#ifdef __linux__
+        /* The waiter may return as soon as woken is 1; only its address is used */
+        if (__atomic_exchange_n(&q->woken, 1, __ATOMIC_ACQ_REL) == 2)
+            syscall(SYS_futex, &q->woken, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+        __atomic_store_n(&q->woken, 1, __ATOMIC_RELEASE);
+#endif
+    }
+    return n;
 }
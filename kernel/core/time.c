@@ -0,0 +1,208 @@
+/**
+ * Timekeeping and the vvar page
+ *
+ * Time starts on the platform reference clock. The TSC is calibrated
+ * against it, which takes a while, so boot does it off the critical
+ * path; if it is invariant it then takes over as the clocksource: the
+ * vvar page holds an anchor (cycle_last, mono_ns) plus mult/shift, and
+ * every reader extrapolates from it. timekeeping_update() moves the anchor forward;
+ * with a 128-bit product the anchor never has to move for correctness.
+ *
+ * The same page carries the current pid/ppid, republished by the
+ * scheduler on every switch, so vdso_getpid() never enters the kernel.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#define CALIBRATE_NS    (20 * 1000 * 1000ULL)
+
+typedef struct {
+    vvar_data_t *vvar;
+    page_t *page;
+    spinlock_t lock;            /* Serialises vvar writers */
+    uint64_t boot_ref_ns;       /* Reference clock at init_time() */
+} timekeeper_t;
+
+static timekeeper_t g_tk;
+
+/* Reference clock: the host's monotonic clock, standing in for HPET/PIT */
+static uint64_t ref_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/* CPUID.80000007H:EDX[8]: the TSC ticks at a constant rate in all P/C-states */
+static bool tsc_invariant(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return false;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1U << 8);
+#else
+    return false;
+#endif
+}
+
+/*
+ * Count TSC cycles across CALIBRATE_NS of reference time. Only the end
+ * points matter, so with timers running the wait can be a sleep and
+ * leave the CPU to the rest of boot.
+ */
+static uint64_t tsc_calibrate(bool sleep) {
+    uint64_t ref0 = ref_clock_ns(), tsc0 = rdtsc_ordered();
+    uint64_t ref1;
+    if (sleep) {
+        timespec_t ts = { 0, (uint32_t)CALIBRATE_NS };
+        do_nanosleep(&ts);
+    }
+    do {
+        cpu_relax();
+        ref1 = ref_clock_ns();
+    } while (ref1 - ref0 < CALIBRATE_NS);
+    uint64_t tsc1 = rdtsc_ordered();
+    return (uint64_t)((unsigned __int128)(tsc1 - tsc0) * NSEC_PER_SEC / (ref1 - ref0));
+}
+
+/*
+ * mult and shift for (cycles * mult) >> shift to turn from-Hz cycles into
+ * to-Hz units, as Linux's clocks_calc_mult_shift(): the largest shift, so
+ * the most precision, for which mult fits in 32 bits and maxsec worth of
+ * cycles times mult still fits in 64.
+ */
+void clocks_calc_mult_shift(uint32_t *mult, uint32_t *shift, uint64_t from, uint64_t to,
+                            uint32_t maxsec) {
+    uint32_t sft, sftacc = 32;
+    uint64_t tmp = ((unsigned __int128)maxsec * from) >> 32;
+
+    /* Bits the largest delta needs above 32 come out of mult's */
+    while (tmp) {
+        tmp >>= 1;
+        sftacc--;
+    }
+    for (sft = 32; sft > 0; sft--) {
+        tmp = (uint64_t)((((unsigned __int128)to << sft) + from / 2) / from);
+        if ((tmp >> sftacc) == 0) break;
+    }
+    *mult = (uint32_t)tmp;
+    *shift = sft;
+}
+
+static void vvar_write_begin(vvar_data_t *v) {
+    __atomic_store_n(&v->seq, v->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void vvar_write_end(vvar_data_t *v) {
+    __atomic_store_n(&v->seq, v->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* The vvar page on the reference clock: ktime works from here on */
+void init_time_early(void) {
+    page_t *page = page_alloc(0);
+    if (!page) {
+        pr_panic("Cannot allocate the vvar page\n");
+        return;
+    }
+    vvar_data_t *v = page_to_virt(page);
+    memset(v, 0, PAGE_SIZE);
+
+    g_tk.page = page;
+    g_tk.boot_ref_ns = ref_clock_ns();
+    __atomic_store_n(&g_tk.vvar, v, __ATOMIC_RELEASE);
+}
+
+static int tsc_switch(bool sleep) {
+    vvar_data_t *v = g_tk.vvar;
+    if (!v) return -EINVAL;
+    if (!tsc_invariant()) return -ENODEV;
+    uint64_t hz = tsc_calibrate(sleep);
+    if (!hz) return -EIO;
+
+    uint32_t mult, shift;
+    clocks_calc_mult_shift(&mult, &shift, hz, NSEC_PER_SEC, CLOCKSOURCE_MAX_SEC);
+
+    /* The new anchor is the reference clock's reading: time runs on without a step */
+    spin_lock(&g_tk.lock);
+    vvar_write_begin(v);
+    v->tsc_hz = hz;
+    v->mult = mult;
+    v->shift = shift;
+    v->mono_ns = ref_clock_ns() - g_tk.boot_ref_ns;
+    v->cycle_last = rdtsc_ordered();
+    v->clock_mode = VCLOCK_TSC;
+    vvar_write_end(v);
+    spin_unlock(&g_tk.lock);
+    pr_debug("time: clocksource tsc, %lu Hz\n", (unsigned long)hz);
+    return 0;
+}
+
+/* Calibrate the TSC asleep and switch to it if it is invariant; needs the timers */
+int tsc_clocksource_init(void) {
+    return tsc_switch(true);
+}
+
+void init_time(void) {
+    init_time_early();
+    tsc_switch(false);
+}
+
+uint64_t ktime_get_ns(void) {
+    const vvar_data_t *v = __atomic_load_n(&g_tk.vvar, __ATOMIC_ACQUIRE);
+    if (!v || __atomic_load_n(&v->clock_mode, __ATOMIC_ACQUIRE) != VCLOCK_TSC)
+        return ref_clock_ns() - g_tk.boot_ref_ns;
+
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        seq = vvar_read_begin(v);
+        ns = vvar_mono_ns(v, rdtsc_ordered());
+    } while (vvar_read_retry(v, seq));
+    return ns;
+}
+
+/* Move the anchor to now, as the periodic tick does */
+void timekeeping_update(void) {
+    vvar_data_t *v = g_tk.vvar;
+    if (!v || v->clock_mode != VCLOCK_TSC) return;
+
+    spin_lock(&g_tk.lock);
+    uint64_t now = rdtsc_ordered();
+    uint64_t ns = vvar_mono_ns(v, now);
+    vvar_write_begin(v);
+    v->cycle_last = now;
+    v->mono_ns = ns;
+    vvar_write_end(v);
+    spin_unlock(&g_tk.lock);
+}
+
+void vvar_set_task(pid_t pid, pid_t ppid) {
+    vvar_data_t *v = g_tk.vvar;
+    if (!v) return;
+
+    spin_lock(&g_tk.lock);
+    vvar_write_begin(v);
+    v->pid = pid;
+    v->ppid = ppid;
+    vvar_write_end(v);
+    spin_unlock(&g_tk.lock);
+}
+
+/* Where the vvar page is mapped; NULL before init_time() */
+const vvar_data_t *vdso_vvar_page(void) {
+    return __atomic_load_n(&g_tk.vvar, __ATOMIC_ACQUIRE);
+}
+
+int do_clock_gettime(timespec_t *ts) {
+    if (!ts) return -EINVAL;
+    uint64_t ns = ktime_get_ns();
+    ts->sec = (uint32_t)(ns / NSEC_PER_SEC);
+    ts->nsec = (uint32_t)(ns % NSEC_PER_SEC);
+    return 0;
+}
@@ -0,0 +1,508 @@
+/**
+ * Timer wheel and the tick
+ *
+ * Each CPU has a wheel of LVL_DEPTH levels with LVL_SIZE buckets each.
+ * Level n buckets are 8^n jiffies wide, so a timer lands in the first
+ * level whose span covers its timeout and is rounded up to that
+ * level's granularity: it may fire up to 1/8 of its timeout late, never
+ * early. Nothing cascades between levels, so add and delete are O(1)
+ * and a timer that is cancelled before it expires (the common case for
+ * timeouts) costs only its hlist insert and removal. A per-level bitmap
+ * of non-empty buckets finds the next expiry without walking lists.
+ *
+ * Wheel callbacks run in TIMER_SOFTIRQ, all of a tick's expiries in one
+ * batch, after the timer interrupt has returned.
+ *
+ * The tick is an hrtimer per CPU. When a CPU goes idle it stops the tick
+ * and programs that hrtimer for the wheel's next expiry instead, so an
+ * idle CPU takes no interrupts until it has work.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <time.h>
+
+#define LVL_CLK_SHIFT   3
+#define LVL_CLK_DIV     (1UL << LVL_CLK_SHIFT)
+#define LVL_CLK_MASK    (LVL_CLK_DIV - 1)
+#define LVL_SHIFT(n)    ((n) * LVL_CLK_SHIFT)
+#define LVL_GRAN(n)     (1UL << LVL_SHIFT(n))
+
+#define LVL_BITS        6
+#define LVL_SIZE        (1UL << LVL_BITS)
+#define LVL_MASK        (LVL_SIZE - 1)
+#define LVL_OFFS(n)     ((n) * LVL_SIZE)
+#define LVL_DEPTH       9
+#define LVL_START(n)    ((LVL_SIZE - 1) << (((n) - 1) * LVL_CLK_SHIFT))
+#define WHEEL_SIZE      (LVL_SIZE * LVL_DEPTH)
+
+/* Longer timeouts are clamped to about 12 days at HZ=1000 */
+#define WHEEL_TIMEOUT_CUTOFF    LVL_START(LVL_DEPTH)
+#define WHEEL_TIMEOUT_MAX       (WHEEL_TIMEOUT_CUTOFF - LVL_GRAN(LVL_DEPTH - 1))
+#define NEXT_TIMER_MAX_DELTA    ((1ULL << 30) - 1)
+
+#define TIMER_MIGRATING NR_CPUS     /* timer->cpu while changing bases */
+#define HALT_MAX_NS     (10 * 1000 * 1000ULL)
+
+typedef struct {
+    spinlock_t lock;
+    timer_list_t *running;          /* Callback in progress */
+    uint64_t clk;                   /* Next jiffy to process */
+    uint64_t next_expiry;           /* Earliest bucket expiry */
+    bool next_expiry_recalc;        /* A bucket emptied; next_expiry may be early */
+    bool timers_pending;
+    uint64_t pending_map[LVL_DEPTH];
+    timer_list_t *vectors[WHEEL_SIZE];
+} __attribute__((aligned(64))) timer_base_t;
+
+typedef struct {
+    hrtimer_t sched_timer;
+    uint64_t last_tick;             /* Expiry of the last tick handled */
+    bool idle;
+    bool stopped;                   /* Tick stopped for idle */
+    spinlock_t idle_lock;           /* Held by the thread idling this CPU */
+    tick_stats_t stats;
+} __attribute__((aligned(64))) tick_sched_t;
+
+static timer_base_t g_timer_bases[NR_CPUS];
+static tick_sched_t g_tick_sched[NR_CPUS];
+static uint64_t g_jiffies;
+static spinlock_t g_jiffies_lock;
+
+uint64_t get_jiffies_64(void) {
+    return __atomic_load_n(&g_jiffies, __ATOMIC_ACQUIRE);
+}
+
+/* Bring jiffies up to now; whichever CPU gets here first does the work */
+static void tick_do_update_jiffies(uint64_t now) {
+    uint64_t jiffies = now / TICK_NSEC;
+
+    if (jiffies <= get_jiffies_64()) return;
+    spin_lock(&g_jiffies_lock);
+    if (jiffies > g_jiffies) {
+        __atomic_store_n(&g_jiffies, jiffies, __ATOMIC_RELEASE);
+        timekeeping_update();
+    }
+    spin_unlock(&g_jiffies_lock);
+}
+
+/* ============================================================================
+ * Timer wheel
+ * ============================================================================ */
+
+/* Round up to the level's granularity so a timer never fires early */
+static unsigned int calc_index(uint64_t expires, unsigned int lvl, uint64_t *bucket_expiry) {
+    expires = (expires >> LVL_SHIFT(lvl)) + 1;
+    *bucket_expiry = expires << LVL_SHIFT(lvl);
+    return LVL_OFFS(lvl) + (unsigned int)(expires & LVL_MASK);
+}
+
+static unsigned int calc_wheel_index(uint64_t expires, uint64_t clk, uint64_t *bucket_expiry) {
+    if (expires < clk) {
+        /* Already due: the bucket for clk runs on the next tick */
+        *bucket_expiry = clk;
+        return (unsigned int)(clk & LVL_MASK);
+    }
+
+    uint64_t delta = expires - clk;
+    for (unsigned int lvl = 0; lvl < LVL_DEPTH - 1; lvl++) {
+        if (delta < LVL_START(lvl + 1))
+            return calc_index(expires, lvl, bucket_expiry);
+    }
+    if (delta >= WHEEL_TIMEOUT_CUTOFF) expires = clk + WHEEL_TIMEOUT_MAX;
+    return calc_index(expires, LVL_DEPTH - 1, bucket_expiry);
+}
+
+static void enqueue_timer(timer_base_t *base, timer_list_t *timer, unsigned int idx,
+                          uint64_t bucket_expiry) {
+    timer_list_t **head = &base->vectors[idx];
+
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    __atomic_store_n(&timer->pprev, head, __ATOMIC_RELAXED);
+    *head = timer;
+    base->pending_map[idx / LVL_SIZE] |= 1ULL << (idx % LVL_SIZE);
+    timer->idx = idx;
+
+    if (bucket_expiry < base->next_expiry) {
+        base->next_expiry = bucket_expiry;
+        base->timers_pending = true;
+        base->next_expiry_recalc = false;
+    }
+}
+
+static void detach_timer(timer_list_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    __atomic_store_n(&timer->pprev, NULL, __ATOMIC_RELAXED);
+}
+
+static int detach_if_pending(timer_list_t *timer, timer_base_t *base) {
+    unsigned int idx = timer->idx;
+
+    if (!timer_pending(timer)) return 0;
+    detach_timer(timer);
+    if (!base->vectors[idx]) {
+        base->pending_map[idx / LVL_SIZE] &= ~(1ULL << (idx % LVL_SIZE));
+        base->next_expiry_recalc = true;
+    }
+    return 1;
+}
+
+/* Distance from clk to the next non-empty bucket of one level, or -1 */
+static int next_pending_bucket(const timer_base_t *base, unsigned int lvl, unsigned int clk) {
+    uint64_t map = base->pending_map[lvl];
+    if (!map) return -1;
+    uint64_t rotated = clk ? (map >> clk) | (map << (LVL_SIZE - clk)) : map;
+    return __builtin_ctzll(rotated);
+}
+
+/* Earliest bucket expiry across all levels */
+static uint64_t __next_timer_interrupt(timer_base_t *base) {
+    uint64_t clk = base->clk;
+    uint64_t next = base->clk + NEXT_TIMER_MAX_DELTA;
+
+    for (unsigned int lvl = 0; lvl < LVL_DEPTH; lvl++) {
+        int pos = next_pending_bucket(base, lvl, (unsigned int)(clk & LVL_MASK));
+        unsigned int lvl_clk = (unsigned int)(clk & LVL_CLK_MASK);
+
+        if (pos >= 0) {
+            uint64_t tmp = (clk + (uint64_t)pos) << LVL_SHIFT(lvl);
+            if (tmp < next) next = tmp;
+            /* Nothing in a coarser level can expire before this one */
+            if ((unsigned int)pos <= ((LVL_CLK_DIV - lvl_clk) & LVL_CLK_MASK))
+                break;
+        }
+        /*
+         * The next level's bucket for clk covers jiffies that may already
+         * be behind us; start from the one after it unless clk is aligned.
+         */
+        clk = (clk >> LVL_CLK_SHIFT) + (lvl_clk ? 1 : 0);
+    }
+    base->next_expiry_recalc = false;
+    base->timers_pending = next != base->clk + NEXT_TIMER_MAX_DELTA;
+    return next;
+}
+
+/* Catch base->clk up after a quiet period so new timers index from now */
+static void forward_timer_base(timer_base_t *base) {
+    uint64_t jnow = get_jiffies_64();
+
+    if (jnow <= base->clk) return;
+    if (base->next_expiry > jnow)
+        base->clk = jnow;
+    else if (base->next_expiry > base->clk)
+        base->clk = base->next_expiry;
+}
+
+static timer_base_t *lock_timer_base(timer_list_t *timer) {
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&timer->cpu, __ATOMIC_ACQUIRE);
+        if (cpu < NR_CPUS) {
+            timer_base_t *base = &g_timer_bases[cpu];
+            spin_lock(&base->lock);
+            if (__atomic_load_n(&timer->cpu, __ATOMIC_RELAXED) == cpu)
+                return base;
+            spin_unlock(&base->lock);
+        }
+        cpu_relax();
+    }
+}
+
+void timer_setup(timer_list_t *timer, void (*function)(timer_list_t *timer)) {
+    memset(timer, 0, sizeof(*timer));
+    timer->function = function;
+    timer->cpu = smp_processor_id();
+}
+
+/*
+ * Arm (or re-arm) timer for expires on this CPU. Returns 1 if it was
+ * pending, 0 if not.
+ */
+int mod_timer(timer_list_t *timer, uint64_t expires) {
+    timer_base_t *base = lock_timer_base(timer);
+    timer_base_t *new_base = &g_timer_bases[smp_processor_id()];
+    uint64_t bucket_expiry;
+
+    forward_timer_base(base);
+
+    /* Re-arming into the same bucket just updates expires */
+    if (timer_pending(timer) && base == new_base) {
+        unsigned int idx = calc_wheel_index(expires, base->clk, &bucket_expiry);
+        if (idx == timer->idx) {
+            timer->expires = expires;
+            spin_unlock(&base->lock);
+            return 1;
+        }
+    }
+
+    int ret = detach_if_pending(timer, base);
+    if (base != new_base && base->running != timer) {
+        __atomic_store_n(&timer->cpu, TIMER_MIGRATING, __ATOMIC_RELEASE);
+        spin_unlock(&base->lock);
+        base = new_base;
+        spin_lock(&base->lock);
+        __atomic_store_n(&timer->cpu, smp_processor_id(), __ATOMIC_RELEASE);
+        forward_timer_base(base);
+    }
+
+    timer->expires = expires;
+    unsigned int idx = calc_wheel_index(expires, base->clk, &bucket_expiry);
+    enqueue_timer(base, timer, idx, bucket_expiry);
+    spin_unlock(&base->lock);
+    return ret;
+}
+
+void add_timer(timer_list_t *timer) {
+    mod_timer(timer, timer->expires);
+}
+
+/* Returns 1 if timer was pending; its callback may still be running elsewhere */
+int del_timer(timer_list_t *timer) {
+    if (!timer_pending(timer)) return 0;
+
+    timer_base_t *base = lock_timer_base(timer);
+    int ret = detach_if_pending(timer, base);
+    spin_unlock(&base->lock);
+    return ret;
+}
+
+/* Deactivate timer and wait for a running callback to finish */
+int del_timer_sync(timer_list_t *timer) {
+    for (;;) {
+        timer_base_t *base = lock_timer_base(timer);
+        if (base->running != timer) {
+            int ret = detach_if_pending(timer, base);
+            spin_unlock(&base->lock);
+            return ret;
+        }
+        spin_unlock(&base->lock);
+        cpu_relax();
+    }
+}
+
+/* Run the callbacks of one collected bucket */
+static void expire_timers(timer_base_t *base, timer_list_t **head) {
+    while (*head) {
+        timer_list_t *timer = *head;
+        void (*fn)(timer_list_t *) = timer->function;
+
+        detach_timer(timer);
+        base->running = timer;
+        spin_unlock(&base->lock);
+        fn(timer);
+        spin_lock(&base->lock);
+        base->running = NULL;
+    }
+}
+
+/* Move every bucket due at base->clk onto heads; returns how many */
+static unsigned int collect_expired_timers(timer_base_t *base, timer_list_t **heads) {
+    uint64_t clk = base->clk = base->next_expiry;
+    unsigned int levels = 0;
+
+    for (unsigned int lvl = 0; lvl < LVL_DEPTH; lvl++) {
+        unsigned int idx = (unsigned int)(clk & LVL_MASK) + LVL_OFFS(lvl);
+        uint64_t bit = 1ULL << (idx % LVL_SIZE);
+
+        if (base->pending_map[lvl] & bit) {
+            base->pending_map[lvl] &= ~bit;
+            heads[levels] = base->vectors[idx];
+            heads[levels]->pprev = &heads[levels];
+            base->vectors[idx] = NULL;
+            levels++;
+        }
+        /* Coarser levels only have a bucket boundary when clk is aligned */
+        if (clk & LVL_CLK_MASK) break;
+        clk >>= LVL_CLK_SHIFT;
+    }
+    return levels;
+}
+
+/* TIMER_SOFTIRQ: run everything on this CPU that is due by jiffies */
+static void run_timer_softirq(void) {
+    timer_base_t *base = &g_timer_bases[smp_processor_id()];
+    timer_list_t *heads[LVL_DEPTH];
+    uint64_t jiffies = get_jiffies_64();
+
+    spin_lock(&base->lock);
+    while (jiffies >= base->clk && jiffies >= base->next_expiry) {
+        unsigned int levels = collect_expired_timers(base, heads);
+        base->clk++;
+        base->next_expiry = __next_timer_interrupt(base);
+        while (levels--)
+            expire_timers(base, &heads[levels]);
+    }
+    spin_unlock(&base->lock);
+}
+
+/* From the tick: raise the timer softirq if anything is due */
+void run_local_timers(void) {
+    timer_base_t *base = &g_timer_bases[smp_processor_id()];
+    if (get_jiffies_64() >= __atomic_load_n(&base->next_expiry, __ATOMIC_RELAXED))
+        raise_softirq(TIMER_SOFTIRQ);
+}
+
+/* Next wheel expiry in jiffies for an idle CPU, or KTIME_MAX if none */
+static uint64_t get_next_timer_interrupt(unsigned int cpu, uint64_t basej) {
+    timer_base_t *base = &g_timer_bases[cpu];
+    uint64_t next = KTIME_MAX;
+
+    spin_lock(&base->lock);
+    if (base->next_expiry_recalc)
+        base->next_expiry = __next_timer_interrupt(base);
+    forward_timer_base(base);
+    if (base->timers_pending)
+        next = base->next_expiry > basej ? base->next_expiry : basej;
+    spin_unlock(&base->lock);
+    return next;
+}
+
+/* ============================================================================
+ * Tick
+ * ============================================================================ */
+
+static hrtimer_restart_t tick_sched_timer(hrtimer_t *timer) {
+    tick_sched_t *ts = (tick_sched_t *)timer;
+    uint64_t now = ktime_get_ns();
+
+    tick_do_update_jiffies(now);
+    ts->last_tick = timer->expires;
+    ts->stats.ticks++;
+    if (!ts->idle) scheduler_tick();
+    run_local_timers();
+
+    /* A stopped tick fired for a wheel timer; idle decides what comes next */
+    if (ts->stopped) return HRTIMER_NORESTART;
+    hrtimer_forward(timer, now, TICK_NSEC);
+    return HRTIMER_RESTART;
+}
+
+/* Resume periodic ticks on the first tick boundary after now */
+static void tick_nohz_restart(tick_sched_t *ts, unsigned int cpu, uint64_t now) {
+    uint64_t next = ts->last_tick + ((now - ts->last_tick) / TICK_NSEC + 1) * TICK_NSEC;
+    ts->stopped = false;
+    hrtimer_start_on(&ts->sched_timer, next, cpu);
+}
+
+/*
+ * This CPU is about to idle: unless a wheel timer is due within a tick,
+ * stop the tick and program its hrtimer for the next wheel expiry.
+ * Safe to call again while idle; each call re-evaluates.
+ */
+void tick_nohz_idle_enter(void) {
+    unsigned int cpu = smp_processor_id();
+    tick_sched_t *ts = &g_tick_sched[cpu];
+    uint64_t now = ktime_get_ns();
+
+    ts->idle = true;
+    tick_do_update_jiffies(now);
+    uint64_t basej = get_jiffies_64();
+    uint64_t next = get_next_timer_interrupt(cpu, basej);
+
+    if (next <= basej + 1) {
+        if (ts->stopped) tick_nohz_restart(ts, cpu, now);
+        return;
+    }
+
+    uint64_t expires = next == KTIME_MAX ? KTIME_MAX : next * TICK_NSEC;
+    if (!ts->stopped) ts->stats.stops++;
+    ts->stopped = true;
+    if (expires == KTIME_MAX)
+        hrtimer_cancel(&ts->sched_timer);
+    else if (!hrtimer_active(&ts->sched_timer) || ts->sched_timer.expires != expires)
+        hrtimer_start_on(&ts->sched_timer, expires, cpu);
+}
+
+void tick_nohz_idle_exit(void) {
+    unsigned int cpu = smp_processor_id();
+    tick_sched_t *ts = &g_tick_sched[cpu];
+
+    ts->idle = false;
+    if (ts->stopped) {
+        uint64_t now = ktime_get_ns();
+        tick_do_update_jiffies(now);
+        tick_nohz_restart(ts, cpu, now);
+    }
+}
+
+static irqreturn_t local_timer_interrupt(unsigned int vector, void *dev) {
+    (void)vector;
+    (void)dev;
+    g_tick_sched[smp_processor_id()].stats.interrupts++;
+    hrtimer_interrupt();
+    return IRQ_HANDLED;
+}
+
+/* Stand-in for the local APIC timer: take this CPU's interrupt if it is due */
+bool tick_poll(void) {
+    if (ktime_get_ns() < hrtimer_next_event(smp_processor_id())) return false;
+    irq_deliver(LOCAL_TIMER_VECTOR);
+    return true;
+}
+
+/* hlt: the host sleeps in bounded slices so idle can re-evaluate */
+static void cpu_halt(uint64_t until) {
+    uint64_t now = ktime_get_ns();
+    if (until <= now) return;
+
+    uint64_t ns = until - now < HALT_MAX_NS ? until - now : HALT_MAX_NS;
+    struct timespec req = { .tv_sec = 0, .tv_nsec = (long)ns };
+    nanosleep(&req, NULL);
+}
+
+/*
+ * One idle period: run deferred work if there is any; otherwise stop
+ * the tick if possible, halt, and take the next interrupt. Injected
+ * interrupts wait for the end of the current halt slice. Hosted builds
+ * may run several threads as one CPU (workers, sleepers); one of them
+ * drives the CPU's tick, the others just wait for its next event.
+ */
+void cpu_idle(void) {
+    unsigned int cpu = smp_processor_id();
+    tick_sched_t *ts = &g_tick_sched[cpu];
+
+    do_softirq();
+    if (process_scheduled_works(cpu)) return;
+
+    if (!spin_trylock(&ts->idle_lock)) {
+        /* Sleep until the holder's next event, or let it take one that is due */
+        uint64_t next = hrtimer_next_event(cpu);
+        if (ktime_get_ns() < next) cpu_halt(next);
+        else cond_resched();
+        return;
+    }
+    tick_nohz_idle_enter();
+    while (!tick_poll() && !irq_poll()) {
+        cpu_halt(hrtimer_next_event(cpu));
+        tick_nohz_idle_enter();
+    }
+    tick_nohz_idle_exit();
+    spin_unlock(&ts->idle_lock);
+}
+
+void tick_get_stats(unsigned int cpu, tick_stats_t *stats) {
+    *stats = g_tick_sched[cpu < NR_CPUS ? cpu : 0].stats;
+}
+
+/* Start every CPU's wheel at the current jiffy and its periodic tick */
+void init_timers(void) {
+    uint64_t now = ktime_get_ns();
+
+    open_softirq(TIMER_SOFTIRQ, run_timer_softirq);
+    if (request_irq(LOCAL_TIMER_VECTOR, local_timer_interrupt, "timer", NULL) < 0)
+        pr_panic("Cannot register the local timer interrupt\n");
+
+    g_jiffies = now / TICK_NSEC;
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        timer_base_t *base = &g_timer_bases[cpu];
+        base->clk = g_jiffies;
+        base->next_expiry = base->clk + NEXT_TIMER_MAX_DELTA;
+
+        tick_sched_t *ts = &g_tick_sched[cpu];
+        hrtimer_init(&ts->sched_timer, tick_sched_timer);
+        ts->last_tick = g_jiffies * TICK_NSEC;
+        hrtimer_start_on(&ts->sched_timer, ts->last_tick + TICK_NSEC, cpu);
+    }
+}
@@ -0,0 +1,329 @@
+/**
+ * Event tracing
+ *
+ * Each CPU has a ring of fixed 64-byte slots. A writer reserves the
+ * next position with one atomic add on its ring's head, fills the slot
+ * and publishes it by storing position + 1 in the slot's sequence word;
+ * nothing is locked, and hosted threads sharing a CPU id simply reserve
+ * different slots. A full ring overwrites its oldest records.
+ *
+ * Readers check the sequence word before and after copying a slot, as
+ * with a seqlock, so a record overwritten mid-copy is skipped rather
+ * than returned torn. Records are read back per CPU in position order
+ * and can be written out as Chrome trace-event JSON, which Perfetto
+ * and chrome://tracing both load.
+ *
+ * Timestamps are raw TSC reads while timekeeping runs on the TSC:
+ * skipping the fence and scaling in ktime_get_ns() saves about a third
+ * of an event's cost. trace_read() scales them with the clocksource's
+ * mult and shift as of when the rings were set up.
+ *
+ * Rings are allocated when the first event is enabled, either at boot
+ * with trace_event=name,... or later with trace_event_enable().
+ * trace_buf_size= sets the bytes per CPU (default 512K).
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define TRACE_DEFAULT_BUF_SIZE  (512UL << 10)
+#define TRACE_MIN_ENTRIES       64
+
+typedef struct {
+    uint64_t seq;                   /* Position + 1 once written, 0 while being written */
+    uint64_t ts;
+    uint16_t id;
+    uint16_t cpu;
+    uint32_t pad;
+    uint64_t args[TRACE_MAX_ARGS];
+} __attribute__((aligned(64))) trace_slot_t;
+
+typedef struct {
+    uint64_t head;                  /* Next position to reserve */
+    trace_slot_t *slots;
+} __attribute__((aligned(64))) trace_ring_t;
+
+typedef struct {
+    const char *name;
+    const char *cat;
+    unsigned int flags;
+    const char *args[TRACE_MAX_ARGS];
+} trace_event_t;
+
+static const trace_event_t g_trace_events[NR_TRACE_EVENTS] = {
+#define TRACE_EVENT_DESC(name, cat, flags, a0, a1, a2, a3, a4) \
+    [TRACE_##name] = { #name, cat, flags, { a0, a1, a2, a3, a4 } },
+    TRACE_EVENT_LIST(TRACE_EVENT_DESC)
+#undef TRACE_EVENT_DESC
+};
+
+static_key_t g_trace_keys[NR_TRACE_EVENTS];
+
+static struct {
+    spinlock_t lock;                /* Ring allocation and enabling */
+    uint64_t mask;                  /* Entries per ring - 1 */
+    bool tsc;                       /* Records hold TSC cycles, converted with clock */
+    vvar_data_t clock;
+    trace_ring_t rings[NR_CPUS];
+} g_trace = { .lock = SPINLOCK_INIT };
+
+_Static_assert(sizeof(trace_slot_t) == 64, "trace slots are one cache line");
+
+uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (g_trace.tsc) return __builtin_ia32_rdtsc();
+#endif
+    return ktime_get_ns();
+}
+
+static uint64_t trace_clock_to_ns(uint64_t t) {
+    return g_trace.tsc ? vvar_mono_ns(&g_trace.clock, t) : t;
+}
+
+/* Caller holds g_trace.lock */
+static void trace_clock_init(void) {
+    const vvar_data_t *v = vdso_vvar_page();
+    if (!v) return;
+    uint32_t seq;
+    do {
+        seq = vvar_read_begin(v);
+        g_trace.clock = *v;
+    } while (vvar_read_retry(v, seq));
+#if defined(__x86_64__) || defined(__i386__)
+    g_trace.tsc = g_trace.clock.clock_mode == VCLOCK_TSC;
+#endif
+}
+
+/* Caller holds g_trace.lock */
+static int trace_alloc_rings(void) {
+    if (g_trace.rings[0].slots) return 0;
+
+    char val[32];
+    uint64_t bytes = TRACE_DEFAULT_BUF_SIZE;
+    if (boot_param("trace_buf_size", val, sizeof(val))) bytes = memparse(val, NULL);
+    uint64_t entries = bytes / sizeof(trace_slot_t);
+    if (entries < TRACE_MIN_ENTRIES) entries = TRACE_MIN_ENTRIES;
+    entries = 1ULL << (63 - __builtin_clzll(entries));     /* Round down to a power of two */
+
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        trace_slot_t *slots = aligned_alloc(sizeof(trace_slot_t), entries * sizeof(trace_slot_t));
+        if (!slots) {
+            while (--cpu >= 0) {
+                free(g_trace.rings[cpu].slots);
+                g_trace.rings[cpu].slots = NULL;
+            }
+            return -ENOMEM;
+        }
+        memset(slots, 0, entries * sizeof(trace_slot_t));
+        g_trace.rings[cpu].slots = slots;
+        g_trace.rings[cpu].head = 0;
+    }
+    g_trace.mask = entries - 1;
+    trace_clock_init();
+    return 0;
+}
+
+/* Called through a tracepoint whose key is on */
+void trace_event_write(enum trace_event_id id, uint64_t a0, uint64_t a1, uint64_t a2,
+                       uint64_t a3, uint64_t a4) {
+    unsigned int cpu = (unsigned int)smp_processor_id();
+    trace_ring_t *ring = &g_trace.rings[cpu % NR_CPUS];
+    if (!ring->slots) return;
+
+    uint64_t pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    trace_slot_t *slot = &ring->slots[pos & g_trace.mask];
+
+    /* Invalidate before overwriting, so a reader never takes a mix of two records */
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->ts = trace_clock();
+    slot->id = (uint16_t)id;
+    slot->cpu = (uint16_t)cpu;
+    slot->args[0] = a0;
+    slot->args[1] = a1;
+    slot->args[2] = a2;
+    slot->args[3] = a3;
+    slot->args[4] = a4;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Turn one event, or "all", on or off; the first enable allocates the rings */
+int trace_event_enable(const char *name, bool enable) {
+    bool all = !strcmp(name, "all");
+    int ret = -ENOENT;
+
+    spin_lock(&g_trace.lock);
+    if (enable) {
+        int err = trace_alloc_rings();
+        if (err) {
+            spin_unlock(&g_trace.lock);
+            return err;
+        }
+    }
+    for (int id = 0; id < NR_TRACE_EVENTS; id++) {
+        if (all || !strcmp(name, g_trace_events[id].name)) {
+            __atomic_store_n(&g_trace_keys[id].enabled, enable, __ATOMIC_RELEASE);
+            ret = 0;
+        }
+    }
+    spin_unlock(&g_trace.lock);
+    return ret;
+}
+
+/* Enable the comma-separated events named by trace_event= */
+int trace_init(void) {
+    char val[256];
+    if (!boot_param("trace_event", val, sizeof(val))) return 0;
+
+    for (char *name = strtok(val, ","); name; name = strtok(NULL, ",")) {
+        int ret = trace_event_enable(name, true);
+        if (ret == -ENOMEM) return ret;
+        if (ret < 0) pr_err("trace: unknown event %s\n", name);
+    }
+    return 0;
+}
+
+/* Empty every ring. Events should be off: a concurrent writer's record may survive. */
+void trace_reset(void) {
+    spin_lock(&g_trace.lock);
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        trace_ring_t *ring = &g_trace.rings[cpu];
+        if (!ring->slots) continue;
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+        for (uint64_t i = 0; i <= g_trace.mask; i++)
+            __atomic_store_n(&ring->slots[i].seq, 0, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&g_trace.lock);
+}
+
+/*
+ * Copy the oldest record of cpu at or after *pos and advance *pos past
+ * it. Positions already overwritten are skipped. -ENOENT once the reader
+ * has caught up, including with a record still being written.
+ */
+int trace_read(unsigned int cpu, uint64_t *pos, trace_entry_t *entry) {
+    if (cpu >= NR_CPUS || !g_trace.rings[cpu].slots) return -ENOENT;
+    trace_ring_t *ring = &g_trace.rings[cpu];
+    uint64_t size = g_trace.mask + 1;
+
+    for (;;) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head > size && *pos < head - size) *pos = head - size;
+        if (*pos >= head) return -ENOENT;
+
+        trace_slot_t *slot = &ring->slots[*pos & g_trace.mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == *pos + 1) {
+            entry->ts = slot->ts;
+            entry->id = slot->id;
+            entry->cpu = slot->cpu;
+            memcpy(entry->args, slot->args, sizeof(entry->args));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+                entry->ts = trace_clock_to_ns(entry->ts);
+                if (entry->id < NR_TRACE_EVENTS && (g_trace_events[entry->id].flags & TRACE_SPAN) &&
+                    entry->args[TRACE_MAX_ARGS - 1])
+                    entry->args[TRACE_MAX_ARGS - 1] = trace_clock_to_ns(entry->args[TRACE_MAX_ARGS - 1]);
+                (*pos)++;
+                return 0;
+            }
+        } else if (seq <= *pos) {
+            return -ENOENT;             /* Reserved, not yet published */
+        }
+        (*pos)++;                       /* Overwritten by a later lap */
+    }
+}
+
+/* Records cpu has overwritten since the last reset */
+uint64_t trace_lost(unsigned int cpu) {
+    if (cpu >= NR_CPUS || !g_trace.rings[cpu].slots) return 0;
+    uint64_t head = __atomic_load_n(&g_trace.rings[cpu].head, __ATOMIC_RELAXED);
+    return head > g_trace.mask + 1 ? head - (g_trace.mask + 1) : 0;
+}
+
+const char *trace_event_name(unsigned int id) {
+    return id < NR_TRACE_EVENTS ? g_trace_events[id].name : NULL;
+}
+
+/* ============================================================================
+ * Chrome trace-event JSON
+ * ============================================================================ */
+
+static bool trace_arg_is_address(const char *name) {
+    return !strcmp(name, "ptr") || !strcmp(name, "call_site");
+}
+
+/* Nanoseconds as the format's microseconds, keeping full precision */
+static int trace_fmt_us(char *buf, size_t len, uint64_t ns) {
+    return snprintf(buf, len, "%llu.%03llu", (unsigned long long)(ns / 1000),
+                    (unsigned long long)(ns % 1000));
+}
+
+/* One event, preceded by the comma separating it from the one before */
+static int trace_fmt_event(char *buf, size_t len, const trace_entry_t *e) {
+    const trace_event_t *ev = &g_trace_events[e->id];
+    char ts[32], dur[32];
+    int n;
+
+    if (ev->flags & TRACE_SPAN) {
+        uint64_t start = e->args[TRACE_MAX_ARGS - 1];
+        if (!start || start > e->ts) start = e->ts;
+        trace_fmt_us(ts, sizeof(ts), start);
+        trace_fmt_us(dur, sizeof(dur), e->ts - start);
+        n = snprintf(buf, len, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%s,"
+                     "\"dur\":%s,\"pid\":0,\"tid\":%u,\"args\":{",
+                     ev->name, ev->cat, ts, dur, e->cpu);
+    } else {
+        trace_fmt_us(ts, sizeof(ts), e->ts);
+        n = snprintf(buf, len, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+                     "\"ts\":%s,\"pid\":0,\"tid\":%u,\"args\":{",
+                     ev->name, ev->cat, ts, e->cpu);
+    }
+
+    for (int i = 0; i < TRACE_MAX_ARGS && ev->args[i][0]; i++) {
+        if (trace_arg_is_address(ev->args[i]))
+            n += snprintf(buf + n, len - (size_t)n, "%s\"%s\":\"0x%llx\"", i ? "," : "",
+                          ev->args[i], (unsigned long long)e->args[i]);
+        else
+            n += snprintf(buf + n, len - (size_t)n, "%s\"%s\":%lld", i ? "," : "",
+                          ev->args[i], (long long)e->args[i]);
+    }
+    n += snprintf(buf + n, len - (size_t)n, "}}");
+    return n;
+}
+
+/*
+ * Write every record, CPU by CPU, through write(ctx, buf, len), which
+ * returns a negative errno to stop. Each CPU is one thread of pid 0.
+ */
+int trace_write_json(int (*write)(void *ctx, const char *buf, size_t len), void *ctx) {
+    char buf[512];
+    int n, ret;
+
+    n = snprintf(buf, sizeof(buf), "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                 "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"kernel\"}}");
+    if ((ret = write(ctx, buf, (size_t)n)) < 0) return ret;
+
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!g_trace.rings[cpu].slots || !__atomic_load_n(&g_trace.rings[cpu].head, __ATOMIC_RELAXED))
+            continue;
+        n = snprintf(buf, sizeof(buf), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+                     "\"tid\":%u,\"args\":{\"name\":\"CPU %u\"}}", cpu, cpu);
+        if ((ret = write(ctx, buf, (size_t)n)) < 0) return ret;
+    }
+
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        trace_entry_t e;
+        uint64_t pos = 0;
+        while (trace_read(cpu, &pos, &e) == 0) {
+            if (e.id >= NR_TRACE_EVENTS) continue;
+            n = trace_fmt_event(buf, sizeof(buf), &e);
+            if ((ret = write(ctx, buf, (size_t)n)) < 0) return ret;
+        }
+    }
+
+    n = snprintf(buf, sizeof(buf), "\n]}\n");
+    return write(ctx, buf, (size_t)n);
+}
@@ -0,0 +1,53 @@
+/**
+ * vDSO - kernel code that runs in user space
+ *
+ * These functions are mapped into every process next to the read-only
+ * vvar page and answer from it directly, so the calls never trap. They
+ * touch nothing but the vvar page; when it cannot answer (no page yet,
+ * or no usable TSC) they fall back to the real system call.
+ */
+
+#include <kernel.h>
+
+int vdso_clock_gettime(timespec_t *ts) {
+    const vvar_data_t *v = vdso_vvar_page();
+    if (!ts) return -EINVAL;
+    if (!v || v->clock_mode != VCLOCK_TSC) return do_clock_gettime(ts);
+
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        seq = vvar_read_begin(v);
+        ns = vvar_mono_ns(v, rdtsc_ordered());
+    } while (vvar_read_retry(v, seq));
+
+    ts->sec = (uint32_t)(ns / NSEC_PER_SEC);
+    ts->nsec = (uint32_t)(ns % NSEC_PER_SEC);
+    return 0;
+}
+
+pid_t vdso_getpid(void) {
+    const vvar_data_t *v = vdso_vvar_page();
+    if (!v) return do_getpid();
+
+    uint32_t seq;
+    pid_t pid;
+    do {
+        seq = vvar_read_begin(v);
+        pid = v->pid;
+    } while (vvar_read_retry(v, seq));
+    return pid;
+}
+
+pid_t vdso_getppid(void) {
+    const vvar_data_t *v = vdso_vvar_page();
+    if (!v) return do_getppid();
+
+    uint32_t seq;
+    pid_t ppid;
+    do {
+        seq = vvar_read_begin(v);
+        ppid = v->ppid;
+    } while (vvar_read_retry(v, seq));
+    return ppid;
+}
@@ -0,0 +1,646 @@
+/**
+ * Workqueues
+ *
+ * Deferred work in process context. A workqueue is only a front end:
+ * bound queues feed one worker pool per CPU, an unbound queue gets a
+ * pool of its own sized by max_active, and an ordered queue is an
+ * unbound queue that runs one item at a time in queueing order.
+ *
+ * Every worker owns a work-stealing deque (Chase-Lev). Work queued by a
+ * worker for its own pool goes on that deque without a lock; work from
+ * anywhere else goes on the pool's shared worklist, which workers drain
+ * WQ_BATCH items at a time into their deques. A worker that runs dry
+ * steals the oldest item from a sibling before it goes idle.
+ *
+ * Pools are concurrency managed. A per-CPU pool keeps one worker
+ * running, an unbound pool up to max_active. When a running worker
+ * blocks (futex_wait, do_nanosleep) the pool wakes an idle worker, or
+ * starts one, up to WQ_MAX_WORKERS, so the rest of the queue - including
+ * what sits in the blocked worker's deque - keeps moving.
+ *
+ * Hosted builds run workers as host threads bound to the pool's CPU.
+ * Where there are none, a CPU runs its pool's work from the idle loop.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <stdio.h>
+#ifdef __unix__
+#include <pthread.h>
+#endif
+
+#define WQ_DEQUE_SIZE       256     /* Power of two */
+#define WQ_BATCH            16      /* Items taken from the worklist at once */
+#define WQ_MAX_WORKERS      64      /* Per pool */
+#define WQ_DFL_ACTIVE       NR_CPUS /* Unbound concurrency when max_active is 0 */
+
+struct worker_pool;
+
+typedef struct worker {
+    /* Chase-Lev deque: the owner pushes and pops at bottom, thieves take top */
+    int64_t top __attribute__((aligned(64)));
+    int64_t bottom __attribute__((aligned(64)));
+    work_struct_t *deque[WQ_DEQUE_SIZE];
+
+    struct worker_pool *pool;
+    unsigned int id;
+    work_struct_t *current;         /* Item being executed */
+    uint32_t wake;                  /* Futex word, bumped to wake an idle worker */
+    bool idle;                      /* On the pool's idle list */
+    bool blocked;                   /* Asleep inside a work item */
+    struct worker *next_idle;
+    uint64_t executed;
+    uint64_t stolen;
+#ifdef __unix__
+    pthread_t thread;
+#endif
+} worker_t;
+
+typedef struct worker_pool {
+    spinlock_t lock;
+    int cpu;                        /* -1 for an unbound pool */
+    work_struct_t *head, **tail;    /* Shared worklist */
+    uint32_t nr_queued;             /* Items on the worklist */
+    worker_t *workers[WQ_MAX_WORKERS];
+    uint32_t nr_workers;
+    uint32_t nr_running;            /* Workers neither idle nor blocked */
+    uint32_t concurrency;           /* Target for nr_running */
+    worker_t *idle_list;
+    uint32_t nr_idle;
+    bool stopping;
+    uint64_t created_on_block;      /* Workers started because one blocked */
+    spinlock_t exec;                /* Idle-loop fallback: one runner at a time */
+    work_struct_t *fallback_current;
+} __attribute__((aligned(64))) worker_pool_t;
+
+struct workqueue {
+    char name[24];
+    unsigned int flags;
+    worker_pool_t *pool;            /* Unbound queues' own pool */
+    uint32_t nr_in_flight;          /* Queued or running */
+    spinlock_t lock;                /* Ordered queues: activation */
+    int nr_active;
+    work_struct_t *inactive, **inactive_tail;
+};
+
+static worker_pool_t g_cpu_pools[NR_CPUS];
+static workqueue_t *g_system_wq;
+static _Thread_local worker_t *g_current_worker;
+
+static void wake_or_create_worker(worker_pool_t *pool);
+static void pool_dispatch(worker_pool_t *pool, work_struct_t *work);
+
+/* ============================================================================
+ * Work-stealing deque
+ * ============================================================================ */
+
+static bool deque_push(worker_t *w, work_struct_t *work) {
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= WQ_DEQUE_SIZE) return false;
+    __atomic_store_n(&w->deque[b & (WQ_DEQUE_SIZE - 1)], work, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Owner only: newest item first */
+static work_struct_t *deque_pop(worker_t *w) {
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    work_struct_t *work = __atomic_load_n(&w->deque[b & (WQ_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        /* Last item: race the thieves for it */
+        if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            work = NULL;
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return work;
+}
+
+/* Any thread: oldest item first; NULL if empty or another thief won */
+static work_struct_t *deque_steal(worker_t *w) {
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b) return NULL;
+    work_struct_t *work = __atomic_load_n(&w->deque[t & (WQ_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return work;
+}
+
+static bool deque_empty(worker_t *w) {
+    return __atomic_load_n(&w->top, __ATOMIC_ACQUIRE) >=
+           __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+}
+
+/* ============================================================================
+ * Pools and workers
+ * ============================================================================ */
+
+static void pool_init(worker_pool_t *pool, int cpu, uint32_t concurrency) {
+    memset(pool, 0, sizeof(*pool));
+    pool->cpu = cpu;
+    pool->tail = &pool->head;
+    pool->concurrency = concurrency;
+}
+
+/* Anything queued on the worklist or in a worker's deque */
+static bool pool_has_work(worker_pool_t *pool) {
+    if (__atomic_load_n(&pool->nr_queued, __ATOMIC_ACQUIRE)) return true;
+    uint32_t n = __atomic_load_n(&pool->nr_workers, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < n; i++) {
+        if (!deque_empty(pool->workers[i])) return true;
+    }
+    return false;
+}
+
+static work_struct_t *worklist_take(worker_pool_t *pool) {
+    work_struct_t *work = pool->head;
+    if (work) {
+        pool->head = work->next;
+        if (!pool->head) pool->tail = &pool->head;
+        __atomic_store_n(&pool->nr_queued, pool->nr_queued - 1, __ATOMIC_RELEASE);
+    }
+    return work;
+}
+
+/* Own deque, then a batch from the worklist, then a sibling's deque */
+static work_struct_t *worker_find_work(worker_t *w) {
+    worker_pool_t *pool = w->pool;
+    work_struct_t *work = deque_pop(w);
+    if (work) return work;
+
+    if (__atomic_load_n(&pool->nr_queued, __ATOMIC_ACQUIRE)) {
+        spin_lock(&pool->lock);
+        work = worklist_take(pool);
+        for (int i = 1; work && i < WQ_BATCH && pool->head; i++) {
+            if (!deque_push(w, pool->head)) break;
+            worklist_take(pool);
+        }
+        spin_unlock(&pool->lock);
+        if (work) return work;
+    }
+
+    uint32_t n = __atomic_load_n(&pool->nr_workers, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 1; i < n; i++) {
+        worker_t *victim = pool->workers[(w->id + i) % n];
+        if ((work = deque_steal(victim))) {
+            w->stolen++;
+            return work;
+        }
+    }
+    return NULL;
+}
+
+static void work_done(workqueue_t *wq) {
+    if (wq->flags & WQ_ORDERED) {
+        spin_lock(&wq->lock);
+        work_struct_t *next = wq->inactive;
+        if (next) {
+            wq->inactive = next->next;
+            if (!wq->inactive) wq->inactive_tail = &wq->inactive;
+        } else {
+            wq->nr_active--;
+        }
+        spin_unlock(&wq->lock);
+        if (next) pool_dispatch(wq->pool, next);
+    }
+    __atomic_fetch_sub(&wq->nr_in_flight, 1, __ATOMIC_RELEASE);
+}
+
+/* slot shows flush_work() what is running until func returns */
+static void run_work(work_struct_t **slot, work_struct_t *work) {
+    workqueue_t *wq = work->wq;
+    void (*func)(work_struct_t *) = work->func;
+
+    __atomic_store_n(slot, work, __ATOMIC_RELEASE);
+    /* Clear pending first: the item may requeue or free itself */
+    __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+    func(work);
+    __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+    work_done(wq);
+}
+
+/* Park w until woken; false once the pool is stopping */
+static bool worker_idle(worker_t *w) {
+    worker_pool_t *pool = w->pool;
+
+    spin_lock(&pool->lock);
+    if (pool_has_work(pool) && !pool->stopping) {
+        spin_unlock(&pool->lock);
+        return true;
+    }
+    if (pool->stopping) {
+        pool->nr_running--;
+        spin_unlock(&pool->lock);
+        return false;
+    }
+    __atomic_store_n(&w->idle, true, __ATOMIC_RELAXED);
+    w->next_idle = pool->idle_list;
+    pool->idle_list = w;
+    pool->nr_idle++;
+    pool->nr_running--;
+    spin_unlock(&pool->lock);
+
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&w->wake, __ATOMIC_ACQUIRE);
+        if (!__atomic_load_n(&w->idle, __ATOMIC_ACQUIRE)) break;
+        futex_wait(&w->wake, seq);
+    }
+    return !__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE);
+}
+
+#ifdef __unix__
+static void *worker_thread(void *arg) {
+    worker_t *w = arg;
+    worker_pool_t *pool = w->pool;
+
+    cpu_bind(pool->cpu >= 0 ? (unsigned int)pool->cpu : w->id % NR_CPUS);
+    g_current_worker = w;
+    for (;;) {
+        work_struct_t *work = worker_find_work(w);
+        if (work) {
+            run_work(&w->current, work);
+            w->executed++;
+        } else if (!worker_idle(w)) {
+            break;
+        }
+    }
+    return NULL;
+}
+#endif
+
+/* Start a worker that counts as running; caller holds pool->lock */
+static int create_worker(worker_pool_t *pool) {
+#ifdef __unix__
+    if (pool->nr_workers >= WQ_MAX_WORKERS) return -EAGAIN;
+
+    worker_t *w = kmalloc(sizeof(*w), GFP_KERNEL);
+    if (!w) return -ENOMEM;
+    memset(w, 0, sizeof(*w));
+    w->pool = pool;
+    w->id = pool->nr_workers;
+    if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+        kfree(w);
+        return -EAGAIN;
+    }
+    pool->workers[w->id] = w;
+    __atomic_store_n(&pool->nr_workers, w->id + 1, __ATOMIC_RELEASE);
+    pool->nr_running++;
+    return 0;
+#else
+    (void)pool;
+    return -ENOSYS;
+#endif
+}
+
+/* Bring nr_running up by one if work is waiting; caller holds pool->lock */
+static void wake_or_create_worker(worker_pool_t *pool) {
+    if (pool->stopping || pool->nr_running >= pool->concurrency) return;
+
+    worker_t *w = pool->idle_list;
+    if (w) {
+        pool->idle_list = w->next_idle;
+        pool->nr_idle--;
+        pool->nr_running++;
+        __atomic_store_n(&w->idle, false, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&w->wake, 1, __ATOMIC_RELEASE);
+        futex_wake(&w->wake, 1);
+    } else {
+        create_worker(pool);
+    }
+}
+
+static void pool_dispatch(worker_pool_t *pool, work_struct_t *work) {
+    worker_t *self = g_current_worker;
+
+    __atomic_store_n(&work->pool, pool, __ATOMIC_RELEASE);
+    /* A worker feeding its own pool skips the lock; interrupts may not touch its deque */
+    if (self && self->pool == pool && !in_interrupt() && deque_push(self, work)) {
+        if (__atomic_load_n(&pool->nr_running, __ATOMIC_RELAXED) < pool->concurrency) {
+            spin_lock(&pool->lock);
+            wake_or_create_worker(pool);
+            spin_unlock(&pool->lock);
+        }
+        return;
+    }
+
+    spin_lock(&pool->lock);
+    work->next = NULL;
+    *pool->tail = work;
+    pool->tail = &work->next;
+    __atomic_store_n(&pool->nr_queued, pool->nr_queued + 1, __ATOMIC_RELEASE);
+    wake_or_create_worker(pool);
+    spin_unlock(&pool->lock);
+}
+
+/* Blocking hooks, called by futex_wait() and do_nanosleep() */
+void wq_worker_sleeping(void) {
+    worker_t *w = g_current_worker;
+    if (!w || !w->current || w->blocked) return;
+
+    worker_pool_t *pool = w->pool;
+    spin_lock(&pool->lock);
+    w->blocked = true;
+    pool->nr_running--;
+    if (pool_has_work(pool)) {
+        uint32_t before = pool->nr_workers;
+        wake_or_create_worker(pool);
+        if (pool->nr_workers > before) pool->created_on_block++;
+    }
+    spin_unlock(&pool->lock);
+}
+
+void wq_worker_running(void) {
+    worker_t *w = g_current_worker;
+    if (!w || !w->blocked) return;
+
+    spin_lock(&w->pool->lock);
+    w->blocked = false;
+    w->pool->nr_running++;
+    spin_unlock(&w->pool->lock);
+}
+
+/* ============================================================================
+ * Workqueues
+ * ============================================================================ */
+
+workqueue_t *alloc_workqueue(const char *name, unsigned int flags, int max_active) {
+    if (max_active < 0 || max_active > WQ_MAX_WORKERS) return NULL;
+    if (flags & WQ_ORDERED) {
+        flags |= WQ_UNBOUND;
+        max_active = 1;
+    }
+
+    workqueue_t *wq = kmalloc(sizeof(*wq), GFP_KERNEL);
+    if (!wq) return NULL;
+    memset(wq, 0, sizeof(*wq));
+    snprintf(wq->name, sizeof(wq->name), "%s", name);
+    wq->flags = flags;
+    wq->inactive_tail = &wq->inactive;
+
+    if (flags & WQ_UNBOUND) {
+        wq->pool = kmalloc(sizeof(*wq->pool), GFP_KERNEL);
+        if (!wq->pool) {
+            kfree(wq);
+            return NULL;
+        }
+        pool_init(wq->pool, -1, max_active ? (uint32_t)max_active : WQ_DFL_ACTIVE);
+    }
+    return wq;
+}
+
+workqueue_t *alloc_ordered_workqueue(const char *name) {
+    return alloc_workqueue(name, WQ_ORDERED, 1);
+}
+
+/* Drain wq, then stop the workers of its own pool */
+void destroy_workqueue(workqueue_t *wq) {
+    if (!wq) return;
+    flush_workqueue(wq);
+
+    worker_pool_t *pool = wq->pool;
+    if (pool) {
+        spin_lock(&pool->lock);
+        __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+        for (worker_t *w = pool->idle_list; w; w = w->next_idle) {
+            __atomic_store_n(&w->idle, false, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&w->wake, 1, __ATOMIC_RELEASE);
+            futex_wake(&w->wake, 1);
+        }
+        pool->idle_list = NULL;
+        spin_unlock(&pool->lock);
+
+        for (uint32_t i = 0; i < pool->nr_workers; i++) {
+#ifdef __unix__
+            pthread_join(pool->workers[i]->thread, NULL);
+#endif
+            kfree(pool->workers[i]);
+        }
+        kfree(pool);
+    }
+    kfree(wq);
+}
+
+static void __queue_work(int cpu, workqueue_t *wq, work_struct_t *work) {
+    work->wq = wq;
+    __atomic_fetch_add(&wq->nr_in_flight, 1, __ATOMIC_RELAXED);
+
+    if (wq->flags & WQ_ORDERED) {
+        spin_lock(&wq->lock);
+        if (wq->nr_active) {
+            work->next = NULL;
+            *wq->inactive_tail = work;
+            wq->inactive_tail = &work->next;
+            __atomic_store_n(&work->pool, wq->pool, __ATOMIC_RELEASE);
+            spin_unlock(&wq->lock);
+            return;
+        }
+        wq->nr_active = 1;
+        spin_unlock(&wq->lock);
+    }
+
+    if (wq->pool) {
+        pool_dispatch(wq->pool, work);
+    } else {
+        if (cpu < 0 || cpu >= NR_CPUS) cpu = (int)smp_processor_id();
+        pool_dispatch(&g_cpu_pools[cpu], work);
+    }
+}
+
+/* Queue work on cpu's pool (bound queues; -1 is this CPU); false if already pending */
+bool queue_work_on(int cpu, workqueue_t *wq, work_struct_t *work) {
+    if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL))
+        return false;
+    __queue_work(cpu, wq, work);
+    return true;
+}
+
+bool queue_work(workqueue_t *wq, work_struct_t *work) {
+    return queue_work_on(-1, wq, work);
+}
+
+void init_work(work_struct_t *work, void (*func)(work_struct_t *work)) {
+    memset(work, 0, sizeof(*work));
+    work->func = func;
+}
+
+bool schedule_work(work_struct_t *work) {
+    return queue_work(g_system_wq, work);
+}
+
+static bool work_running(worker_pool_t *pool, work_struct_t *work) {
+    if (__atomic_load_n(&pool->fallback_current, __ATOMIC_ACQUIRE) == work) return true;
+    uint32_t n = __atomic_load_n(&pool->nr_workers, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < n; i++) {
+        if (__atomic_load_n(&pool->workers[i]->current, __ATOMIC_ACQUIRE) == work)
+            return true;
+    }
+    return false;
+}
+
+/* Wait until work is neither pending nor running; true if it had to wait */
+bool flush_work(work_struct_t *work) {
+    bool waited = false;
+
+    for (;;) {
+        worker_pool_t *pool = __atomic_load_n(&work->pool, __ATOMIC_ACQUIRE);
+        bool pending = __atomic_load_n(&work->pending, __ATOMIC_ACQUIRE);
+        if (!pool || (!pending && !work_running(pool, work))) break;
+
+        if (!waited) wq_worker_sleeping();
+        waited = true;
+        /* Without workers nobody else will run it */
+        if (pool->cpu >= 0 && !__atomic_load_n(&pool->nr_workers, __ATOMIC_ACQUIRE))
+            process_scheduled_works((unsigned int)pool->cpu);
+        cond_resched();
+    }
+    if (waited) wq_worker_running();
+    return waited;
+}
+
+/* Wait until nothing queued on wq, including work queued meanwhile, remains */
+void flush_workqueue(workqueue_t *wq) {
+    bool waited = false;
+
+    while (__atomic_load_n(&wq->nr_in_flight, __ATOMIC_ACQUIRE)) {
+        if (!waited) wq_worker_sleeping();
+        waited = true;
+        if (!wq->pool) {
+            for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+                if (!__atomic_load_n(&g_cpu_pools[cpu].nr_workers, __ATOMIC_ACQUIRE))
+                    process_scheduled_works(cpu);
+            }
+        }
+        cond_resched();
+    }
+    if (waited) wq_worker_running();
+}
+
+/* Idle-loop fallback for a CPU pool without workers; true if anything ran */
+bool process_scheduled_works(unsigned int cpu) {
+    worker_pool_t *pool = &g_cpu_pools[cpu < NR_CPUS ? cpu : 0];
+    bool ran = false;
+
+    if (__atomic_load_n(&pool->nr_workers, __ATOMIC_ACQUIRE) ||
+        !__atomic_load_n(&pool->nr_queued, __ATOMIC_ACQUIRE) || !spin_trylock(&pool->exec))
+        return false;
+    for (;;) {
+        spin_lock(&pool->lock);
+        work_struct_t *work = worklist_take(pool);
+        spin_unlock(&pool->lock);
+        if (!work) break;
+        run_work(&pool->fallback_current, work);
+        ran = true;
+    }
+    spin_unlock(&pool->exec);
+    return ran;
+}
+
+/* ============================================================================
+ * Delayed work
+ * ============================================================================ */
+
+static void delayed_work_timer_fn(timer_list_t *timer) {
+    delayed_work_t *dwork = (delayed_work_t *)((char *)timer - offsetof(delayed_work_t, timer));
+    __queue_work(dwork->cpu, dwork->wq, &dwork->work);
+}
+
+void init_delayed_work(delayed_work_t *dwork, void (*func)(work_struct_t *work)) {
+    init_work(&dwork->work, func);
+    timer_setup(&dwork->timer, delayed_work_timer_fn);
+    dwork->wq = NULL;
+    dwork->cpu = -1;
+}
+
+/**
+ * Queue dwork after delay jiffies. The timer runs on this CPU's wheel;
+ * the work then goes to cpu's pool as queue_work_on() would send it.
+ */
+bool queue_delayed_work_on(int cpu, workqueue_t *wq, delayed_work_t *dwork, unsigned long delay) {
+    if (__atomic_exchange_n(&dwork->work.pending, 1, __ATOMIC_ACQ_REL))
+        return false;
+    if (!delay) {
+        __queue_work(cpu, wq, &dwork->work);
+        return true;
+    }
+    dwork->wq = wq;
+    dwork->cpu = cpu;
+    mod_timer(&dwork->timer, get_jiffies_64() + delay);
+    return true;
+}
+
+bool queue_delayed_work(workqueue_t *wq, delayed_work_t *dwork, unsigned long delay) {
+    return queue_delayed_work_on(-1, wq, dwork, delay);
+}
+
+bool schedule_delayed_work(delayed_work_t *dwork, unsigned long delay) {
+    return queue_delayed_work(g_system_wq, dwork, delay);
+}
+
+/* Stop dwork while its timer is pending; false if it was not waiting on one */
+bool cancel_delayed_work(delayed_work_t *dwork) {
+    if (!del_timer(&dwork->timer)) return false;
+    __atomic_store_n(&dwork->work.pending, 0, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Cancel the timer, or wait for the work it already queued */
+bool cancel_delayed_work_sync(delayed_work_t *dwork) {
+    if (del_timer_sync(&dwork->timer)) {
+        __atomic_store_n(&dwork->work.pending, 0, __ATOMIC_RELEASE);
+        return true;
+    }
+    flush_work(&dwork->work);
+    return false;
+}
+
+/* Run dwork now if its timer is pending, then wait for it */
+bool flush_delayed_work(delayed_work_t *dwork) {
+    if (del_timer_sync(&dwork->timer))
+        __queue_work(dwork->cpu, dwork->wq, &dwork->work);
+    return flush_work(&dwork->work);
+}
+
+/* ============================================================================
+ * Setup and statistics
+ * ============================================================================ */
+
+static void pool_stats(worker_pool_t *pool, wq_stats_t *st) {
+    uint32_t n = __atomic_load_n(&pool->nr_workers, __ATOMIC_ACQUIRE);
+    st->workers += n;
+    st->created_on_block += pool->created_on_block;
+    for (uint32_t i = 0; i < n; i++) {
+        st->executed += pool->workers[i]->executed;
+        st->stolen += pool->workers[i]->stolen;
+    }
+}
+
+void workqueue_get_stats(workqueue_t *wq, wq_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (wq->pool) {
+        pool_stats(wq->pool, st);
+    } else {
+        for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++)
+            pool_stats(&g_cpu_pools[cpu], st);
+    }
+}
+
+void init_workqueues(void) {
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+        pool_init(&g_cpu_pools[cpu], cpu, 1);
+    g_system_wq = alloc_workqueue("events", 0, 0);
+    if (!g_system_wq) pr_panic("Cannot allocate the system workqueue\n");
+}
@@ -1,10 +1,445 @@
 /**
  * Block device driver
+ *
+ * Block device registry, hosted backends (RAM disk and image file) and
+ * the buffer cache that filesystems use for metadata blocks.
+ *
+ * Asynchronous requests complete onto a lock-free per-CPU list that
+ * BLOCK_SOFTIRQ drains, so an interrupt that finishes many requests
+ * costs one push each and their end_io callbacks run together.
  */
 
 #include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef __unix__
+#include <unistd.h>
+#endif
+
+#define BCACHE_HASH_BITS    14
+#define BCACHE_HASH_SIZE    (1U << BCACHE_HASH_BITS)
+#define BCACHE_MAX_BUFFERS  16384
+
+static block_device_t *g_block_devices;
+static spinlock_t g_block_lock = SPINLOCK_INIT;
+
+static struct {
+    spinlock_t lock;
+    buffer_head_t *hash[BCACHE_HASH_SIZE];
+    buffer_head_t *lru_head, *lru_tail;     /* Unreferenced buffers, MRU first */
+    unsigned long nr_buffers;
+} g_bcache;
+
+typedef struct {
+    block_request_t *head;          /* Completed requests, newest first */
+} __attribute__((aligned(64))) block_done_t;
+
+static block_done_t g_block_done[NR_CPUS];
+
+static void block_softirq(void);
 
 int block_driver_init(void) {
-    /* TODO */
+    memset(&g_bcache, 0, sizeof(g_bcache));
+    open_softirq(BLOCK_SOFTIRQ, block_softirq);
     return 0;
 }
+
+int block_device_register(block_device_t *bdev) {
+    if (!bdev || !bdev->ops) return -EINVAL;
+
+    spin_lock(&g_block_lock);
+    for (block_device_t *d = g_block_devices; d; d = d->next) {
+        if (strcmp(d->name, bdev->name) == 0) {
+            spin_unlock(&g_block_lock);
+            return -EBUSY;
+        }
+    }
+    bdev->next = g_block_devices;
+    g_block_devices = bdev;
+    spin_unlock(&g_block_lock);
+
+    pr_debug("Block device %s registered (%llu bytes)\n",
+             bdev->name, (unsigned long long)bdev->size);
+    return 0;
+}
+
+/* Drop bdev from the registry; its driver frees it */
+void block_device_unregister(block_device_t *bdev) {
+    spin_lock(&g_block_lock);
+    for (block_device_t **pp = &g_block_devices; *pp; pp = &(*pp)->next) {
+        if (*pp == bdev) {
+            *pp = bdev->next;
+            break;
+        }
+    }
+    spin_unlock(&g_block_lock);
+}
+
+block_device_t *block_device_lookup(const char *name) {
+    spin_lock(&g_block_lock);
+    block_device_t *d = g_block_devices;
+    while (d && strcmp(d->name, name) != 0)
+        d = d->next;
+    spin_unlock(&g_block_lock);
+    return d;
+}
+
+int block_read(block_device_t *bdev, uint64_t offset, void *buf, size_t len) {
+    if (offset + len > bdev->size) return -EIO;
+    return bdev->ops->read(bdev, offset, buf, len);
+}
+
+int block_write(block_device_t *bdev, uint64_t offset, const void *buf, size_t len) {
+    if (offset + len > bdev->size) return -EIO;
+    return bdev->ops->write(bdev, offset, buf, len);
+}
+
+int block_flush(block_device_t *bdev) {
+    return bdev->ops->flush ? bdev->ops->flush(bdev) : 0;
+}
+
+/* Safe from interrupt handlers: a push onto this CPU's completion list */
+void block_complete_request(block_request_t *rq) {
+    block_done_t *done = &g_block_done[smp_processor_id()];
+    block_request_t *head = __atomic_load_n(&done->head, __ATOMIC_RELAXED);
+
+    do {
+        rq->next = head;
+    } while (!__atomic_compare_exchange_n(&done->head, &head, rq, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    raise_softirq(BLOCK_SOFTIRQ);
+}
+
+static void block_softirq(void) {
+    block_done_t *done = &g_block_done[smp_processor_id()];
+    block_request_t *rq = __atomic_exchange_n(&done->head, NULL, __ATOMIC_ACQUIRE);
+    block_request_t *fifo = NULL;
+
+    /* Run end_io in completion order */
+    while (rq) {
+        block_request_t *next = rq->next;
+        rq->next = fifo;
+        fifo = rq;
+        rq = next;
+    }
+    while (fifo) {
+        block_request_t *next = fifo->next;
+        fifo->next = NULL;
+        if (fifo->end_io) fifo->end_io(fifo);
+        fifo = next;
+    }
+}
+
+/**
+ * Start an asynchronous request. Devices without a submit op run it
+ * now; either way end_io is called from BLOCK_SOFTIRQ with rq->error
+ * set, never from inside this call unless softirqs are enabled here.
+ */
+int block_submit(block_request_t *rq) {
+    block_device_t *bdev = rq->bdev;
+
+    if (!bdev || !rq->end_io) return -EINVAL;
+    if (rq->op < BLOCK_OP_READ || rq->op > BLOCK_OP_FLUSH) return -EINVAL;
+    if (rq->op != BLOCK_OP_FLUSH && rq->offset + rq->len > bdev->size) return -EIO;
+    rq->error = 0;
+    rq->next = NULL;
+    if (bdev->ops->submit) return bdev->ops->submit(bdev, rq);
+
+    switch (rq->op) {
+    case BLOCK_OP_READ:
+        rq->error = bdev->ops->read(bdev, rq->offset, rq->buf, rq->len);
+        break;
+    case BLOCK_OP_WRITE:
+        rq->error = bdev->ops->write(bdev, rq->offset, rq->buf, rq->len);
+        break;
+    default:
+        rq->error = block_flush(bdev);
+        break;
+    }
+    if (rq->error > 0) rq->error = 0;
+    block_complete_request(rq);
+    return 0;
+}
+
+/* RAM disk backend */
+static int ram_read(block_device_t *bdev, uint64_t offset, void *buf, size_t len) {
+    memcpy(buf, (uint8_t *)bdev->private + offset, len);
+    return 0;
+}
+
+static int ram_write(block_device_t *bdev, uint64_t offset, const void *buf, size_t len) {
+    memcpy((uint8_t *)bdev->private + offset, buf, len);
+    return 0;
+}
+
+static const block_device_ops_t ram_ops = {
+    .read = ram_read,
+    .write = ram_write,
+};
+
+block_device_t *block_device_create_ram(const char *name, uint64_t size) {
+    block_device_t *bdev = kmalloc(sizeof(*bdev), GFP_KERNEL);
+    if (!bdev) return NULL;
+    memset(bdev, 0, sizeof(*bdev));
+
+    bdev->private = calloc(1, size);
+    if (!bdev->private) {
+        kfree(bdev);
+        return NULL;
+    }
+    strncpy(bdev->name, name, sizeof(bdev->name) - 1);
+    bdev->size = size;
+    bdev->ops = &ram_ops;
+
+    if (block_device_register(bdev) < 0) {
+        free(bdev->private);
+        kfree(bdev);
+        return NULL;
+    }
+    return bdev;
+}
+
+/* Image file backend (hosted builds) */
+typedef struct {
+    FILE *fp;
+    spinlock_t lock;
+} file_disk_t;
+
+static int file_read(block_device_t *bdev, uint64_t offset, void *buf, size_t len) {
+    file_disk_t *disk = bdev->private;
+    int ret = 0;
+
+    spin_lock(&disk->lock);
+    if (fseek(disk->fp, (long)offset, SEEK_SET) != 0 ||
+        fread(buf, 1, len, disk->fp) != len)
+        ret = -EIO;
+    spin_unlock(&disk->lock);
+    return ret;
+}
+
+static int file_write(block_device_t *bdev, uint64_t offset, const void *buf, size_t len) {
+    file_disk_t *disk = bdev->private;
+    int ret = 0;
+
+    spin_lock(&disk->lock);
+    if (fseek(disk->fp, (long)offset, SEEK_SET) != 0 ||
+        fwrite(buf, 1, len, disk->fp) != len)
+        ret = -EIO;
+    spin_unlock(&disk->lock);
+    return ret;
+}
+
+static int file_flush(block_device_t *bdev) {
+    file_disk_t *disk = bdev->private;
+    int ret = 0;
+
+    spin_lock(&disk->lock);
+    if (fflush(disk->fp) != 0)
+        ret = -EIO;
+#ifdef __unix__
+    else if (fdatasync(fileno(disk->fp)) != 0)
+        ret = -EIO;
+#endif
+    spin_unlock(&disk->lock);
+    return ret;
+}
+
+static const block_device_ops_t file_ops = {
+    .read = file_read,
+    .write = file_write,
+    .flush = file_flush,
+};
+
+block_device_t *block_device_create_file(const char *name, const char *path) {
+    FILE *fp = fopen(path, "r+b");
+    if (!fp) return NULL;
+
+    block_device_t *bdev = kmalloc(sizeof(*bdev), GFP_KERNEL);
+    file_disk_t *disk = kmalloc(sizeof(*disk), GFP_KERNEL);
+    if (!bdev || !disk) goto fail;
+    memset(bdev, 0, sizeof(*bdev));
+    memset(disk, 0, sizeof(*disk));
+
+    fseek(fp, 0, SEEK_END);
+    bdev->size = (uint64_t)ftell(fp);
+    disk->fp = fp;
+    strncpy(bdev->name, name, sizeof(bdev->name) - 1);
+    bdev->ops = &file_ops;
+    bdev->private = disk;
+
+    if (block_device_register(bdev) < 0) goto fail;
+    return bdev;
+
+fail:
+    kfree(disk);
+    kfree(bdev);
+    fclose(fp);
+    return NULL;
+}
+
+/* Buffer cache */
+static inline unsigned int bh_hash(block_device_t *bdev, uint64_t blocknr) {
+    uint64_t key = blocknr ^ ((uintptr_t)bdev >> 6);
+    return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> (64 - BCACHE_HASH_BITS));
+}
+
+static void lru_del(buffer_head_t *bh) {
+    if (bh->b_lru_prev) bh->b_lru_prev->b_lru_next = bh->b_lru_next;
+    else g_bcache.lru_head = bh->b_lru_next;
+    if (bh->b_lru_next) bh->b_lru_next->b_lru_prev = bh->b_lru_prev;
+    else g_bcache.lru_tail = bh->b_lru_prev;
+    bh->b_lru_prev = bh->b_lru_next = NULL;
+}
+
+static void lru_add(buffer_head_t *bh) {
+    bh->b_lru_prev = NULL;
+    bh->b_lru_next = g_bcache.lru_head;
+    if (g_bcache.lru_head) g_bcache.lru_head->b_lru_prev = bh;
+    else g_bcache.lru_tail = bh;
+    g_bcache.lru_head = bh;
+}
+
+static int write_buffer(buffer_head_t *bh) {
+    int ret = block_write(bh->b_bdev, bh->b_blocknr * bh->b_size, bh->b_data, bh->b_size);
+    if (ret == 0)
+        bh->b_state &= ~BH_Dirty;
+    return ret;
+}
+
+static void bh_unhash(buffer_head_t *bh) {
+    buffer_head_t **pp = &g_bcache.hash[bh_hash(bh->b_bdev, bh->b_blocknr)];
+    while (*pp != bh)
+        pp = &(*pp)->b_hash_next;
+    *pp = bh->b_hash_next;
+    g_bcache.nr_buffers--;
+}
+
+/* Drop unreferenced buffers from the cold end of the LRU. Caller holds lock. */
+static void bcache_shrink(void) {
+    while (g_bcache.nr_buffers > BCACHE_MAX_BUFFERS && g_bcache.lru_tail) {
+        buffer_head_t *bh = g_bcache.lru_tail;
+        if ((bh->b_state & BH_Dirty) && write_buffer(bh) < 0)
+            break;
+        lru_del(bh);
+        bh_unhash(bh);
+        kfree(bh->b_data);
+        kfree(bh);
+    }
+}
+
+buffer_head_t *getblk(block_device_t *bdev, uint64_t blocknr, uint32_t size) {
+    unsigned int h = bh_hash(bdev, blocknr);
+
+    spin_lock(&g_bcache.lock);
+    for (buffer_head_t *bh = g_bcache.hash[h]; bh; bh = bh->b_hash_next) {
+        if (bh->b_bdev == bdev && bh->b_blocknr == blocknr && bh->b_size == size) {
+            if (bh->b_count++ == 0)
+                lru_del(bh);
+            spin_unlock(&g_bcache.lock);
+            return bh;
+        }
+    }
+
+    buffer_head_t *bh = kmalloc(sizeof(*bh), GFP_KERNEL);
+    uint8_t *data = kmalloc(size, GFP_KERNEL);
+    if (!bh || !data) {
+        spin_unlock(&g_bcache.lock);
+        kfree(bh);
+        kfree(data);
+        return NULL;
+    }
+    memset(bh, 0, sizeof(*bh));
+    bh->b_bdev = bdev;
+    bh->b_blocknr = blocknr;
+    bh->b_size = size;
+    bh->b_data = data;
+    bh->b_count = 1;
+    bh->b_hash_next = g_bcache.hash[h];
+    g_bcache.hash[h] = bh;
+    g_bcache.nr_buffers++;
+    bcache_shrink();
+    spin_unlock(&g_bcache.lock);
+
+    return bh;
+}
+
+buffer_head_t *bread(block_device_t *bdev, uint64_t blocknr, uint32_t size) {
+    buffer_head_t *bh = getblk(bdev, blocknr, size);
+    if (!bh || (bh->b_state & BH_Uptodate))
+        return bh;
+
+    if (block_read(bdev, blocknr * size, bh->b_data, size) < 0) {
+        brelse(bh);
+        return NULL;
+    }
+    bh->b_state |= BH_Uptodate;
+    return bh;
+}
+
+void get_bh(buffer_head_t *bh) {
+    spin_lock(&g_bcache.lock);
+    if (bh->b_count++ == 0)
+        lru_del(bh);
+    spin_unlock(&g_bcache.lock);
+}
+
+void brelse(buffer_head_t *bh) {
+    if (!bh) return;
+
+    spin_lock(&g_bcache.lock);
+    if (--bh->b_count == 0) {
+        lru_add(bh);
+        bcache_shrink();
+    }
+    spin_unlock(&g_bcache.lock);
+}
+
+void mark_buffer_dirty(buffer_head_t *bh) {
+    bh->b_state |= BH_Dirty | BH_Uptodate;
+}
+
+int sync_dirty_buffer(buffer_head_t *bh) {
+    if (!(bh->b_state & BH_Dirty))
+        return 0;
+    return write_buffer(bh);
+}
+
+/**
+ * sync_blockdev
+ *
+ * Write back every dirty buffer of a device that the journal does not
+ * own. Callers that need durability follow up with block_flush().
+ */
+int sync_blockdev(block_device_t *bdev) {
+    int ret = 0;
+
+    spin_lock(&g_bcache.lock);
+    for (unsigned int i = 0; i < BCACHE_HASH_SIZE; i++) {
+        for (buffer_head_t *bh = g_bcache.hash[i]; bh; bh = bh->b_hash_next) {
+            if (bh->b_bdev != bdev || (bh->b_state & BH_JBD))
+                continue;
+            if ((bh->b_state & BH_Dirty) && write_buffer(bh) < 0)
+                ret = -EIO;
+        }
+    }
+    spin_unlock(&g_bcache.lock);
+    return ret;
+}
+
+/* Forget all unreferenced buffers of a device (after umount) */
+void invalidate_bdev(block_device_t *bdev) {
+    spin_lock(&g_bcache.lock);
+    buffer_head_t *bh = g_bcache.lru_head;
+    while (bh) {
+        buffer_head_t *next = bh->b_lru_next;
+        if (bh->b_bdev == bdev) {
+            lru_del(bh);
+            bh_unhash(bh);
+            kfree(bh->b_data);
+            kfree(bh);
+        }
+        bh = next;
+    }
+    spin_unlock(&g_bcache.lock);
+}
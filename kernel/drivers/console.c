@@ -1,10 +1,537 @@
 /**
  * Console driver
+ *
+ * printk hands the console whole batches of lines (kernel/core/printk.c)
+ * and each backend here costs per batch, not per byte:
+ *
+ *  - VGA text mode is repainted from a screen model. Its lines are a
+ *    ring of rows, so scrolling moves the origin and clears one row
+ *    instead of shifting the screen up; the cells changed since the last
+ *    repaint are tracked as a dirty rectangle and copied to video memory
+ *    once at the end of the batch. A batch that scrolls past a whole
+ *    screen still copies one screenful.
+ *  - The 16550 UART is far slower than the log can be. Bytes go into a
+ *    transmit ring and the FIFO is topped up whenever the line is idle,
+ *    by the writer and by a timer, never waited for. When the ring is
+ *    full bytes are dropped and counted instead of stalling the printk
+ *    flusher.
+ *  - Hosted builds stream to stdout, one write per batch.
+ *
+ * console= picks the backends: tty0 (VGA), ttyS0[,baud] (serial) and
+ * stdout. Hosted builds default to stdout, keep the VGA buffer in memory
+ * and emulate the UART on the stdout stream; given a baud rate, the
+ * emulated line is paced like a real one.
  */
 
 #include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define VT_COLS             80
+#define VT_ROWS             25
+#define VT_ATTR             0x07            /* Light grey on black */
+#define VT_TAB              8
+
+#define VGA_TEXT_BASE       0xB8000UL
+#define VGA_CRTC_INDEX      0x3D4
+#define VGA_CRTC_DATA       0x3D5
+
+#define UART_BASE           0x3F8           /* COM1 */
+#define UART_THR            0               /* Transmit holding (DLAB=0) */
+#define UART_DLL            0               /* Divisor latch (DLAB=1) */
+#define UART_IER            1
+#define UART_DLM            1
+#define UART_FCR            2
+#define UART_LCR            3
+#define UART_MCR            4
+#define UART_LSR            5
+#define UART_LSR_THRE       0x20            /* Transmit FIFO empty */
+#define UART_LCR_DLAB       0x80
+#define UART_LCR_8N1        0x03
+#define UART_FCR_ENABLE     0xC7            /* Enable and clear FIFOs, 14-byte trigger */
+#define UART_MCR_DTR_RTS    0x03
+#define UART_FIFO_SIZE      16
+#define UART_CLOCK          115200          /* Divisor 1 */
+#define SERIAL_XMIT_SIZE    (64 * 1024)     /* Power of two */
+
+typedef struct {
+    uint16_t cells[VT_ROWS][VT_COLS];   /* Ring of lines; origin is the top of the screen */
+    unsigned int origin;
+    unsigned int x, y;                  /* Cursor, in screen rows */
+    unsigned int top, bottom;           /* Dirty rows [top, bottom), screen-relative */
+    unsigned int left, right;           /* Dirty columns [left, right) */
+    uint32_t utf_cp;                    /* UTF-8 sequence being decoded */
+    unsigned int utf_left;
+} vt_screen_t;
+
+static struct {
+    spinlock_t lock;                    /* Screen, transmit ring and stats */
+    unsigned int backends;              /* CON_* */
+    vt_screen_t vt;
+    volatile uint16_t *vga;
+    unsigned int vga_cursor;
+
+    char xmit[SERIAL_XMIT_SIZE];
+    uint64_t xmit_head, xmit_tail;      /* Free-running; tail is the next byte to send */
+    unsigned int baud;
+    timer_list_t xmit_timer;            /* Drains the ring while the writer is quiet */
+    int timer_armed;
+#ifdef __unix__
+    uint8_t uart_lcr;                   /* Emulated UART: line control, for DLAB */
+    uint64_t line_busy_until;           /* Emulated UART: ns at which the FIFO is empty */
+    FILE *out;                          /* NULL = stdout */
+#endif
+    console_stats_t stats;
+    bool initialized;
+} g_con = { .lock = SPINLOCK_INIT };
+
+static void console_driver_write(console_t *con, const char *buf, size_t len);
+
+static console_t g_tty_console = { .name = "tty", .write = console_driver_write };
+
+/* ============================================================================
+ * Hardware access
+ * ============================================================================ */
+
+#ifdef __unix__
+/* Emulated VGA text memory; the console only ever writes it */
+static uint16_t g_vga_shadow[VT_ROWS * VT_COLS];
+
+static FILE *host_out(void) {
+    return g_con.out ? g_con.out : stdout;
+}
+
+/* An emulated 16550 whose transmitter writes to the host stream */
+static uint8_t uart_in(unsigned int reg) {
+    if (reg != UART_LSR) return 0;
+    if (g_con.baud && ktime_get_ns() < g_con.line_busy_until) return 0;
+    return UART_LSR_THRE;
+}
+
+static void uart_out(unsigned int reg, uint8_t val) {
+    if (reg == UART_LCR) g_con.uart_lcr = val;
+    if (reg != UART_THR || (g_con.uart_lcr & UART_LCR_DLAB)) return;
+    putc(val, host_out());
+    if (g_con.baud) {
+        /* Ten bit times per byte with start and stop bits */
+        uint64_t now = ktime_get_ns();
+        if (g_con.line_busy_until < now) g_con.line_busy_until = now;
+        g_con.line_busy_until += 10ULL * 1000000000ULL / g_con.baud;
+    }
+}
+
+static void uart_flush(void) {
+    fflush(host_out());
+}
+
+static void vga_set_cursor(unsigned int pos) {
+    (void)pos;
+}
+#else
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ volatile("outb %0, %1" :: "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t val;
+    __asm__ volatile("inb %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+static uint8_t uart_in(unsigned int reg) {
+    return inb((uint16_t)(UART_BASE + reg));
+}
+
+static void uart_out(unsigned int reg, uint8_t val) {
+    outb((uint16_t)(UART_BASE + reg), val);
+}
+
+static void uart_flush(void) {
+}
+
+static void vga_set_cursor(unsigned int pos) {
+    outb(VGA_CRTC_INDEX, 0x0F);
+    outb(VGA_CRTC_DATA, (uint8_t)pos);
+    outb(VGA_CRTC_INDEX, 0x0E);
+    outb(VGA_CRTC_DATA, (uint8_t)(pos >> 8));
+}
+#endif
+
+/* 8N1 at baud, FIFOs on, interrupts off: the transmit timer polls */
+static void uart_setup(unsigned int baud) {
+    unsigned int div = baud ? UART_CLOCK / baud : 1;
+    if (!div) div = 1;
+    uart_out(UART_IER, 0);
+    uart_out(UART_LCR, UART_LCR_DLAB);
+    uart_out(UART_DLL, (uint8_t)div);
+    uart_out(UART_DLM, (uint8_t)(div >> 8));
+    uart_out(UART_LCR, UART_LCR_8N1);
+    uart_out(UART_FCR, UART_FCR_ENABLE);
+    uart_out(UART_MCR, UART_MCR_DTR_RTS);
+}
+
+/* ============================================================================
+ * Screen model
+ * ============================================================================ */
+
+static inline uint16_t *vt_row(vt_screen_t *vt, unsigned int y) {
+    unsigned int r = vt->origin + y;
+    return vt->cells[r >= VT_ROWS ? r - VT_ROWS : r];
+}
+
+static void vt_fill(uint16_t *cells, unsigned int n) {
+    for (unsigned int i = 0; i < n; i++)
+        cells[i] = (uint16_t)(VT_ATTR << 8 | ' ');
+}
+
+static inline void vt_dirty(vt_screen_t *vt, unsigned int y, unsigned int x0, unsigned int x1) {
+    if (y < vt->top) vt->top = y;
+    if (y + 1 > vt->bottom) vt->bottom = y + 1;
+    if (x0 < vt->left) vt->left = x0;
+    if (x1 > vt->right) vt->right = x1;
+}
+
+static void vt_clean(vt_screen_t *vt) {
+    vt->top = VT_ROWS;
+    vt->bottom = 0;
+    vt->left = VT_COLS;
+    vt->right = 0;
+}
+
+static void vt_reset(vt_screen_t *vt) {
+    for (unsigned int y = 0; y < VT_ROWS; y++)
+        vt_fill(vt->cells[y], VT_COLS);
+    vt->origin = vt->x = vt->y = 0;
+    vt->utf_left = 0;
+    vt_clean(vt);
+    vt_dirty(vt, 0, 0, VT_COLS);
+    vt_dirty(vt, VT_ROWS - 1, 0, VT_COLS);
+}
+
+/* Every row now shows different text, so the whole screen is dirty */
+static void vt_scroll(vt_screen_t *vt) {
+    vt->origin = vt->origin + 1 == VT_ROWS ? 0 : vt->origin + 1;
+    vt_fill(vt_row(vt, VT_ROWS - 1), VT_COLS);
+    vt->top = vt->left = 0;
+    vt->bottom = VT_ROWS;
+    vt->right = VT_COLS;
+    g_con.stats.scrolls++;
+}
+
+static void vt_newline(vt_screen_t *vt) {
+    vt->x = 0;
+    if (vt->y + 1 < VT_ROWS) vt->y++;
+    else vt_scroll(vt);
+}
+
+/* Code page 437 has no glyph for most of Unicode */
+static uint8_t vt_glyph(uint32_t cp) {
+    switch (cp) {
+    case 0x2713: case 0x2714: case 0x221A: return 0xFB;    /* ✓ ✔ √ */
+    case 0x00B0: return 0xF8;                               /* ° */
+    case 0x00B7: case 0x2022: return 0xF9;                  /* · • */
+    case 0x2500: return 0xC4;                               /* ─ */
+    case 0x2502: return 0xB3;                               /* │ */
+    case 0x2588: return 0xDB;                               /* █ */
+    default: return '?';
+    }
+}
+
+static void vt_putglyph(vt_screen_t *vt, uint8_t c) {
+    if (vt->x == VT_COLS) vt_newline(vt);
+    vt_row(vt, vt->y)[vt->x] = (uint16_t)(VT_ATTR << 8 | c);
+    vt_dirty(vt, vt->y, vt->x, vt->x + 1);
+    vt->x++;
+}
+
+/* Lines end with LF alone: the console translates it to CR LF */
+static void vt_write(vt_screen_t *vt, const char *buf, size_t len) {
+    const uint8_t *s = (const uint8_t *)buf, *end = s + len;
+
+    while (s < end) {
+        /* Runs of printable ASCII, up to the end of the row, are the common case */
+        if (!vt->utf_left && *s >= 0x20 && *s < 0x7F) {
+            if (vt->x == VT_COLS) vt_newline(vt);
+            uint16_t *row = vt_row(vt, vt->y);
+            unsigned int x0 = vt->x, x = x0;
+            while (s < end && x < VT_COLS && *s >= 0x20 && *s < 0x7F)
+                row[x++] = (uint16_t)(VT_ATTR << 8 | *s++);
+            vt_dirty(vt, vt->y, x0, x);
+            vt->x = x;
+            continue;
+        }
+
+        uint8_t c = *s++;
+        if (vt->utf_left) {
+            if ((c & 0xC0) == 0x80) {
+                vt->utf_cp = vt->utf_cp << 6 | (c & 0x3F);
+                if (--vt->utf_left == 0) vt_putglyph(vt, vt_glyph(vt->utf_cp));
+                continue;
+            }
+            /* Truncated sequence: show it, then take c afresh */
+            vt->utf_left = 0;
+            vt_putglyph(vt, '?');
+        }
+
+        switch (c) {
+        case '\n':
+            g_con.stats.lines++;
+            vt_newline(vt);
+            break;
+        case '\r':
+            vt->x = 0;
+            break;
+        case '\t':
+            do vt_putglyph(vt, ' ');
+            while (vt->x % VT_TAB && vt->x < VT_COLS);
+            break;
+        case '\b':
+            if (vt->x) vt->x--;
+            break;
+        default:
+            if (c >= 0xF8) vt_putglyph(vt, '?');
+            else if (c >= 0xF0) { vt->utf_cp = c & 0x07; vt->utf_left = 3; }
+            else if (c >= 0xE0) { vt->utf_cp = c & 0x0F; vt->utf_left = 2; }
+            else if (c >= 0xC0) { vt->utf_cp = c & 0x1F; vt->utf_left = 1; }
+            else if (c >= 0x7F) vt_putglyph(vt, c == 0x7F ? ' ' : '?');
+            break;
+        }
+    }
+}
+
+/* ============================================================================
+ * Backends
+ * ============================================================================ */
+
+/* Copy the dirty rectangle to video memory */
+static void vga_update(void) {
+    vt_screen_t *vt = &g_con.vt;
+
+    if (vt->top < vt->bottom && vt->left < vt->right) {
+        unsigned int width = vt->right - vt->left;
+        for (unsigned int y = vt->top; y < vt->bottom; y++)
+            memcpy((uint16_t *)g_con.vga + y * VT_COLS + vt->left, vt_row(vt, y) + vt->left,
+                   width * sizeof(uint16_t));
+        g_con.stats.repaints++;
+        g_con.stats.cells += (uint64_t)width * (vt->bottom - vt->top);
+    }
+    vt_clean(vt);
+
+    unsigned int x = vt->x < VT_COLS ? vt->x : VT_COLS - 1;
+    unsigned int pos = vt->y * VT_COLS + x;
+    if (pos != g_con.vga_cursor) {
+        g_con.vga_cursor = pos;
+        vga_set_cursor(pos);
+    }
+}
+
+/* Caller holds the lock. Top up the FIFO for as long as the line takes bytes. */
+static void serial_drain(void) {
+    uint64_t tail = g_con.xmit_tail;
+    bool sent = false;
+
+    while (tail != g_con.xmit_head && (uart_in(UART_LSR) & UART_LSR_THRE)) {
+        for (int i = 0; i < UART_FIFO_SIZE && tail != g_con.xmit_head; i++)
+            uart_out(UART_THR, (uint8_t)g_con.xmit[tail++ & (SERIAL_XMIT_SIZE - 1)]);
+        sent = true;
+    }
+    g_con.xmit_tail = tail;
+    if (sent) uart_flush();
+
+    if (tail != g_con.xmit_head && !g_con.timer_armed) {
+        g_con.timer_armed = 1;
+        mod_timer(&g_con.xmit_timer, get_jiffies_64() + 1);
+    }
+}
+
+static void serial_xmit_timer_fn(timer_list_t *timer) {
+    (void)timer;
+    /* The writer may hold the lock on this CPU; it drains on its way out */
+    if (!spin_trylock(&g_con.lock)) {
+        mod_timer(&g_con.xmit_timer, get_jiffies_64() + 1);
+        return;
+    }
+    g_con.timer_armed = 0;
+    if (g_con.backends & CON_SERIAL) serial_drain();
+    spin_unlock(&g_con.lock);
+}
+
+/* Queue buf with LF expanded to CR LF; what does not fit is dropped */
+static void serial_write(const char *buf, size_t len) {
+    uint64_t head = g_con.xmit_head;
+    uint64_t limit = g_con.xmit_tail + SERIAL_XMIT_SIZE;
+    size_t i = 0;
+
+    for (; i < len && head < limit; i++) {
+        if (buf[i] == '\n') {
+            if (head + 2 > limit) break;
+            g_con.xmit[head++ & (SERIAL_XMIT_SIZE - 1)] = '\r';
+        }
+        g_con.xmit[head++ & (SERIAL_XMIT_SIZE - 1)] = buf[i];
+    }
+    g_con.xmit_head = head;
+    g_con.stats.serial_dropped += len - i;
+    serial_drain();
+}
+
+static void stdout_write(const char *buf, size_t len) {
+#ifdef __unix__
+    FILE *f = host_out();
+    fwrite(buf, 1, len, f);
+    fflush(f);
+#else
+    (void)buf;
+    (void)len;
+#endif
+}
+
+/* ============================================================================
+ * Console interface
+ * ============================================================================ */
+
+/* Write to every selected backend at once; printk calls this once per batch */
+void console_write(const char *buf, size_t len) {
+    if (!len) return;
+    spin_lock(&g_con.lock);
+    g_con.stats.bytes += len;
+    if (g_con.backends & CON_VGA) {
+        vt_write(&g_con.vt, buf, len);
+        vga_update();
+    }
+    if (g_con.backends & CON_SERIAL) serial_write(buf, len);
+    if (g_con.backends & CON_STDOUT) stdout_write(buf, len);
+    spin_unlock(&g_con.lock);
+}
+
+static void console_driver_write(console_t *con, const char *buf, size_t len) {
+    (void)con;
+    console_write(buf, len);
+}
+
+unsigned int console_backends(void) {
+    return __atomic_load_n(&g_con.backends, __ATOMIC_RELAXED);
+}
+
+/* Switch to the CON_* backends in mask; a newly selected screen starts blank */
+int console_set_backends(unsigned int mask) {
+    if (mask & ~(CON_VGA | CON_SERIAL | CON_STDOUT)) return -EINVAL;
+#ifndef __unix__
+    if (mask & CON_STDOUT) return -ENODEV;
+#endif
+    spin_lock(&g_con.lock);
+    if ((mask & CON_VGA) && !(g_con.backends & CON_VGA)) {
+        vt_reset(&g_con.vt);
+        g_con.vga_cursor = ~0U;
+        vga_update();
+    }
+    if ((mask & CON_SERIAL) && !(g_con.backends & CON_SERIAL)) uart_setup(g_con.baud);
+    if (!(mask & CON_SERIAL)) {
+        /* Nothing will drain what is still queued */
+        g_con.stats.serial_dropped += g_con.xmit_head - g_con.xmit_tail;
+        g_con.xmit_tail = g_con.xmit_head;
+    }
+    g_con.backends = mask;
+    spin_unlock(&g_con.lock);
+    return 0;
+}
+
+/* Pace the serial line at baud; 0 leaves a hosted UART unpaced */
+void console_set_baud(unsigned int baud) {
+    spin_lock(&g_con.lock);
+    g_con.baud = baud;
+    if (g_con.backends & CON_SERIAL) uart_setup(baud);
+    spin_unlock(&g_con.lock);
+}
+
+/* Hosted: the stdio stream stdout and the emulated UART write to; NULL = stdout */
+void console_set_output(void *file) {
+    spin_lock(&g_con.lock);
+#ifdef __unix__
+    if (g_con.out) fflush(g_con.out);
+    g_con.out = file;
+#else
+    (void)file;
+#endif
+    spin_unlock(&g_con.lock);
+}
+
+/* Text of screen row `row` as VGA memory shows it, trailing blanks removed */
+int console_read_screen(unsigned int row, char *buf, size_t len) {
+    if (row >= VT_ROWS || !len) return -EINVAL;
+    spin_lock(&g_con.lock);
+    size_t n = 0;
+    for (unsigned int x = 0; x < VT_COLS && n + 1 < len; x++)
+        buf[n++] = (char)(g_con.vga[row * VT_COLS + x] & 0xFF);
+    spin_unlock(&g_con.lock);
+    while (n && buf[n - 1] == ' ')
+        n--;
+    buf[n] = '\0';
+    return (int)n;
+}
+
+void console_get_stats(console_stats_t *st) {
+    spin_lock(&g_con.lock);
+    *st = g_con.stats;
+    st->serial_queued = g_con.xmit_head - g_con.xmit_tail;
+    spin_unlock(&g_con.lock);
+}
+
+void console_reset_stats(void) {
+    spin_lock(&g_con.lock);
+    memset(&g_con.stats, 0, sizeof(g_con.stats));
+    spin_unlock(&g_con.lock);
+}
+
+/* console=tty0,ttyS0,115200,stdout: a number is the baud rate of the serial port before it */
+static unsigned int parse_console_param(const char *val, unsigned int *baud) {
+    unsigned int mask = 0;
+    char name[16];
+
+    while (*val) {
+        size_t n = strcspn(val, ",");
+        if (n < sizeof(name)) {
+            memcpy(name, val, n);
+            name[n] = '\0';
+            if (!strcmp(name, "tty0")) mask |= CON_VGA;
+            else if (!strcmp(name, "ttyS0")) mask |= CON_SERIAL;
+            else if (!strcmp(name, "stdout")) mask |= CON_STDOUT;
+            else if (name[0] >= '0' && name[0] <= '9' && (mask & CON_SERIAL)) *baud = (unsigned int)atoi(name);
+            else pr_err("console: unknown console %s\n", name);
+        }
+        val += n;
+        if (*val == ',') val++;
+    }
+    return mask;
+}
 
 int console_driver_init(void) {
-    /* TODO */
+    if (g_con.initialized) return 0;
+
+#ifdef __unix__
+    g_con.vga = g_vga_shadow;
+    unsigned int mask = CON_STDOUT;
+    g_con.baud = 0;
+#else
+    g_con.vga = (volatile uint16_t *)VGA_TEXT_BASE;
+    unsigned int mask = CON_VGA | CON_SERIAL;
+    g_con.baud = UART_CLOCK;
+#endif
+    timer_setup(&g_con.xmit_timer, serial_xmit_timer_fn);
+
+    char val[64];
+    if (boot_param("console", val, sizeof(val))) {
+        unsigned int baud = g_con.baud;
+        unsigned int sel = parse_console_param(val, &baud);
+        if (sel) {
+            mask = sel;
+            g_con.baud = baud;
+        }
+    }
+    int ret = console_set_backends(mask);
+    if (ret < 0) return ret;
+
+    g_con.initialized = true;
+    register_console(&g_tty_console);
     return 0;
 }
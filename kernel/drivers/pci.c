@@ -1,10 +1,829 @@
 /**
  * PCI device enumeration
+ *
+ * pci_scan_devices() walks bus 0 and every bus behind a bridge, as
+ * firmware numbered them, and reads each function's header once: IDs,
+ * class, BARs and capability list. BARs are sized the usual way, by
+ * writing all-ones with decoding off and reading back which address
+ * bits stick.
+ *
+ * Config space is read through ECAM where possible: one memory access
+ * per register, where conf1 needs two port accesses (address, then
+ * data) under a lock for its single address latch, and reaches only
+ * the first 256 bytes. Without ACPI there is no MCFG table to find the
+ * ECAM window in, so bare metal uses it only when pci.ecam=<address>
+ * names it. Until the MMU maps device memory, ECAM and BARs are used at
+ * their physical addresses.
+ *
+ * Hosted builds have no bus: pci.image=<file> or pci_ecam_load_image()
+ * loads a synthetic ECAM window, 4 KiB per function at
+ * bus << 20 | devfn << 12, where absent functions read as zero or
+ * all-ones. A BAR's size is the lowest set bit of the address it holds,
+ * so images give each BAR an odd multiple of its size; writes to BARs
+ * keep only the bits above it, as hardware does. Mapped BARs are zeroed
+ * host memory, and conf1 is emulated over the same image. A device model
+ * adds its own function with pci_emulate_function() and traps accesses
+ * to its BARs with iomem_emulate().
+ *
+ * MSI-X vectors each get a CPU from irq_alloc_vector(), which spreads
+ * them over the CPUs with the fewest, or with PCI_IRQ_AFFINITY the CPU
+ * their entry number names. pci_msix_signal() stands in for a
+ * device's message write: it injects the entry's vector on the CPU its
+ * address names.
  */
 
 #include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 
-int pci_scan_devices(void) {
-    /* TODO: Implement PCI scanning */
+#define PCI_MAX_BUSES           256
+#define PCI_CFG_SPACE_SIZE      256
+#define PCI_CFG_SPACE_EXP_SIZE  4096
+#define PCI_ECAM_BUS_SIZE       (1UL << 20)
+
+#define PCI_VENDOR_ID           0x00
+#define PCI_STATUS_CAP_LIST     0x0010
+#define PCI_CLASS_REVISION      0x08
+#define PCI_HEADER_TYPE_DWORD   0x0c    /* Header type is its third byte */
+#define PCI_BASE_ADDRESS_0      0x10
+#define PCI_BRIDGE_BUSES        0x18    /* Primary, secondary, subordinate */
+#define PCI_CAPABILITY_LIST     0x34
+#define PCI_FIND_CAP_TTL        48
+
+#define PCI_BASE_ADDRESS_SPACE_IO       0x01
+#define PCI_BASE_ADDRESS_MEM_TYPE_MASK  0x06
+#define PCI_BASE_ADDRESS_MEM_TYPE_64    0x04
+#define PCI_BASE_ADDRESS_MEM_PREFETCH   0x08
+#define PCI_BASE_ADDRESS_MEM_MASK       (~0x0fU)
+#define PCI_BASE_ADDRESS_IO_MASK        (~0x03U)
+
+#define PCI_MSIX_FLAGS          2
+#define PCI_MSIX_FLAGS_QSIZE    0x07ff
+#define PCI_MSIX_FLAGS_MASKALL  0x4000
+#define PCI_MSIX_FLAGS_ENABLE   0x8000
+#define PCI_MSIX_TABLE          4
+#define PCI_MSIX_PBA            8
+#define PCI_MSIX_BIR            0x7
+#define PCI_MSIX_ENTRY_SIZE     16
+#define PCI_MSIX_ENTRY_ADDR     0
+#define PCI_MSIX_ENTRY_ADDR_HI  4
+#define PCI_MSIX_ENTRY_DATA     8
+#define PCI_MSIX_ENTRY_CTRL     12
+#define PCI_MSIX_ENTRY_MASKBIT  0x1
+
+#define MSI_ADDR_BASE           0xfee00000U
+#define MSI_ADDR_DEST_SHIFT     12
+
+#define CONF1_ADDRESS           0xcf8
+#define CONF1_DATA              0xcfc
+#define CONF1_ENABLE            0x80000000U
+
+#define PCI_HOSTED_BAR_MAX      (64UL << 20)    /* Largest BAR pci_iomap() backs with host memory */
+
+static struct {
+    int access;                     /* PCI_ACCESS_* */
+    volatile uint8_t *ecam;         /* Bus 0's window */
+    unsigned int ecam_buses;
+    spinlock_t conf1_lock;          /* One address latch for every CPU */
+    uint64_t accesses;
+    pci_dev_t *devices, **tail;
+    bool initialized;
+#ifdef __unix__
+    uint8_t *image;                 /* Emulated ECAM window */
+    size_t image_size;
+    uint32_t *bar_wmask;            /* Writable bits of BAR dwords 0x10-0x24, per function */
+    uint32_t conf1_addr;
+#endif
+} g_pci = { .access = PCI_ACCESS_CONF1, .conf1_lock = SPINLOCK_INIT };
+
+static void pci_release_devices(void);
+static void pci_init_access(void);
+
+static inline uint32_t size_mask(int size) {
+    return size == 4 ? ~0U : (1U << (size * 8)) - 1;
+}
+
+/* ============================================================================
+ * Config space access
+ * ============================================================================ */
+
+static volatile uint8_t *ecam_addr(unsigned int bus, unsigned int devfn, unsigned int where) {
+    if (!g_pci.ecam || bus >= g_pci.ecam_buses) return NULL;
+    return g_pci.ecam + ((size_t)bus << 20 | (size_t)devfn << 12 | where);
+}
+
+static uint32_t ecam_read(volatile uint8_t *p, int size) {
+    switch (size) {
+    case 1: return *p;
+    case 2: return *(volatile uint16_t *)p;
+    default: return *(volatile uint32_t *)p;
+    }
+}
+
+#ifdef __unix__
+/* BAR dwords keep their low address bits; everything else in the image is plain memory */
+static void ecam_write(volatile uint8_t *p, int size, uint32_t val) {
+    size_t off = (size_t)((uint8_t *)p - g_pci.image);
+    unsigned int reg = off & (PCI_CFG_SPACE_EXP_SIZE - 1);
+
+    if (reg >= PCI_BASE_ADDRESS_0 && reg < PCI_BASE_ADDRESS_0 + 4 * PCI_NUM_BARS) {
+        uint32_t *dw = (uint32_t *)(g_pci.image + (off & ~(size_t)3));
+        unsigned int shift = (unsigned int)(off & 3) * 8;
+        uint32_t wm = g_pci.bar_wmask[(off >> 12) * PCI_NUM_BARS + (reg - PCI_BASE_ADDRESS_0) / 4] &
+                      (size_mask(size) << shift);
+        *dw = (*dw & ~wm) | ((val << shift) & wm);
+        return;
+    }
+    memcpy((uint8_t *)p, &val, (size_t)size);
+}
+
+/* Ports 0xCF8-0xCFF of a conf1 host bridge over the ECAM image */
+static uint32_t port_in(uint16_t port, int size) {
+    uint32_t addr = g_pci.conf1_addr;
+    if (port == CONF1_ADDRESS) return addr;
+    if (!(addr & CONF1_ENABLE) || port < CONF1_DATA) return size_mask(size);
+    volatile uint8_t *p = ecam_addr((addr >> 16) & 0xff, (addr >> 8) & 0xff,
+                                    (addr & 0xfc) + (port - CONF1_DATA));
+    return p ? ecam_read(p, size) : size_mask(size);
+}
+
+static void port_out(uint16_t port, int size, uint32_t val) {
+    uint32_t addr = g_pci.conf1_addr;
+    if (port == CONF1_ADDRESS && size == 4) {
+        g_pci.conf1_addr = val;
+        return;
+    }
+    if (!(addr & CONF1_ENABLE) || port < CONF1_DATA) return;
+    volatile uint8_t *p = ecam_addr((addr >> 16) & 0xff, (addr >> 8) & 0xff,
+                                    (addr & 0xfc) + (port - CONF1_DATA));
+    if (p) ecam_write(p, size, val);
+}
+#else
+static void ecam_write(volatile uint8_t *p, int size, uint32_t val) {
+    switch (size) {
+    case 1: *p = (uint8_t)val; break;
+    case 2: *(volatile uint16_t *)p = (uint16_t)val; break;
+    default: *(volatile uint32_t *)p = val; break;
+    }
+}
+
+static uint32_t port_in(uint16_t port, int size) {
+    uint32_t val;
+    switch (size) {
+    case 1: { uint8_t v; __asm__ volatile("inb %1, %0" : "=a"(v) : "Nd"(port)); val = v; break; }
+    case 2: { uint16_t v; __asm__ volatile("inw %1, %0" : "=a"(v) : "Nd"(port)); val = v; break; }
+    default: __asm__ volatile("inl %1, %0" : "=a"(val) : "Nd"(port)); break;
+    }
+    return val;
+}
+
+static void port_out(uint16_t port, int size, uint32_t val) {
+    switch (size) {
+    case 1: __asm__ volatile("outb %0, %1" :: "a"((uint8_t)val), "Nd"(port)); break;
+    case 2: __asm__ volatile("outw %0, %1" :: "a"((uint16_t)val), "Nd"(port)); break;
+    default: __asm__ volatile("outl %0, %1" :: "a"(val), "Nd"(port)); break;
+    }
+}
+#endif
+
+/* Absent functions read as all-ones, -ENODEV */
+static int pci_bus_read(unsigned int bus, unsigned int devfn, unsigned int where, int size, uint32_t *val) {
+    if (where & (unsigned int)(size - 1)) return -EINVAL;
+    __atomic_fetch_add(&g_pci.accesses, 1, __ATOMIC_RELAXED);
+
+    if (g_pci.access == PCI_ACCESS_ECAM) {
+        volatile uint8_t *p = where < PCI_CFG_SPACE_EXP_SIZE ? ecam_addr(bus, devfn, where) : NULL;
+        *val = p ? ecam_read(p, size) : size_mask(size);
+        return p ? 0 : -ENODEV;
+    }
+
+    if (where >= PCI_CFG_SPACE_SIZE) {
+        *val = size_mask(size);
+        return -ENODEV;
+    }
+    spin_lock(&g_pci.conf1_lock);
+    port_out(CONF1_ADDRESS, 4, CONF1_ENABLE | bus << 16 | devfn << 8 | (where & 0xfc));
+    *val = port_in((uint16_t)(CONF1_DATA + (where & 3)), size);
+    spin_unlock(&g_pci.conf1_lock);
+    return 0;
+}
+
+static int pci_bus_write(unsigned int bus, unsigned int devfn, unsigned int where, int size, uint32_t val) {
+    if (where & (unsigned int)(size - 1)) return -EINVAL;
+    __atomic_fetch_add(&g_pci.accesses, 1, __ATOMIC_RELAXED);
+
+    if (g_pci.access == PCI_ACCESS_ECAM) {
+        volatile uint8_t *p = where < PCI_CFG_SPACE_EXP_SIZE ? ecam_addr(bus, devfn, where) : NULL;
+        if (!p) return -ENODEV;
+        ecam_write(p, size, val);
+        return 0;
+    }
+
+    if (where >= PCI_CFG_SPACE_SIZE) return -ENODEV;
+    spin_lock(&g_pci.conf1_lock);
+    port_out(CONF1_ADDRESS, 4, CONF1_ENABLE | bus << 16 | devfn << 8 | (where & 0xfc));
+    port_out((uint16_t)(CONF1_DATA + (where & 3)), size, val);
+    spin_unlock(&g_pci.conf1_lock);
+    return 0;
+}
+
+int pci_read_config_byte(pci_dev_t *dev, unsigned int where, uint8_t *val) {
+    uint32_t v;
+    int ret = pci_bus_read(dev->bus, dev->devfn, where, 1, &v);
+    *val = (uint8_t)v;
+    return ret;
+}
+
+int pci_read_config_word(pci_dev_t *dev, unsigned int where, uint16_t *val) {
+    uint32_t v;
+    int ret = pci_bus_read(dev->bus, dev->devfn, where, 2, &v);
+    *val = (uint16_t)v;
+    return ret;
+}
+
+int pci_read_config_dword(pci_dev_t *dev, unsigned int where, uint32_t *val) {
+    return pci_bus_read(dev->bus, dev->devfn, where, 4, val);
+}
+
+int pci_write_config_byte(pci_dev_t *dev, unsigned int where, uint8_t val) {
+    return pci_bus_write(dev->bus, dev->devfn, where, 1, val);
+}
+
+int pci_write_config_word(pci_dev_t *dev, unsigned int where, uint16_t val) {
+    return pci_bus_write(dev->bus, dev->devfn, where, 2, val);
+}
+
+int pci_write_config_dword(pci_dev_t *dev, unsigned int where, uint32_t val) {
+    return pci_bus_write(dev->bus, dev->devfn, where, 4, val);
+}
+
+int pci_set_config_access(int mode) {
+    if (mode != PCI_ACCESS_ECAM && mode != PCI_ACCESS_CONF1) return -EINVAL;
+    if (mode == PCI_ACCESS_ECAM && !g_pci.ecam) return -ENODEV;
+    g_pci.access = mode;
     return 0;
 }
+
+uint64_t pci_config_accesses(void) {
+    return __atomic_load_n(&g_pci.accesses, __ATOMIC_RELAXED);
+}
+
+/* ============================================================================
+ * Hosted ECAM image
+ * ============================================================================ */
+
+#ifdef __unix__
+/* What a sizing write leaves writable in each BAR of the image's functions */
+static void image_bar_masks(void) {
+    size_t nfn = g_pci.image_size / PCI_CFG_SPACE_EXP_SIZE;
+
+    for (size_t fn = 0; fn < nfn; fn++) {
+        const uint8_t *cfg = g_pci.image + fn * PCI_CFG_SPACE_EXP_SIZE;
+        uint32_t *wm = &g_pci.bar_wmask[fn * PCI_NUM_BARS];
+        uint32_t bar[PCI_NUM_BARS];
+        uint16_t vendor;
+
+        for (unsigned int i = 0; i < PCI_NUM_BARS; i++)
+            wm[i] = ~0U;
+        memcpy(&vendor, cfg + PCI_VENDOR_ID, sizeof(vendor));
+        if (vendor == 0 || vendor == 0xffff) continue;
+
+        unsigned int type = cfg[PCI_HEADER_TYPE_DWORD + 2] & 0x7f;
+        unsigned int nbars = type == 0 ? 6 : type == 1 ? 2 : 0;
+        memcpy(bar, cfg + PCI_BASE_ADDRESS_0, sizeof(bar));
+        for (unsigned int i = 0; i < nbars; i++) {
+            if (bar[i] & PCI_BASE_ADDRESS_SPACE_IO) {
+                uint32_t addr = bar[i] & PCI_BASE_ADDRESS_IO_MASK;
+                wm[i] = addr ? ~((addr & -addr) - 1) & PCI_BASE_ADDRESS_IO_MASK : 0;
+            } else if ((bar[i] & PCI_BASE_ADDRESS_MEM_TYPE_MASK) == PCI_BASE_ADDRESS_MEM_TYPE_64 &&
+                       i + 1 < nbars) {
+                uint64_t addr = (uint64_t)bar[i + 1] << 32 | (bar[i] & PCI_BASE_ADDRESS_MEM_MASK);
+                uint64_t mask = addr ? ~((addr & -addr) - 1) : 0;
+                wm[i] = (uint32_t)mask & PCI_BASE_ADDRESS_MEM_MASK;
+                wm[i + 1] = (uint32_t)(mask >> 32);
+                i++;
+            } else {
+                uint32_t addr = bar[i] & PCI_BASE_ADDRESS_MEM_MASK;
+                wm[i] = addr ? ~((addr & -addr) - 1) & PCI_BASE_ADDRESS_MEM_MASK : 0;
+            }
+        }
+    }
+}
+#endif
+
+/*
+ * Use the ECAM image in path, whole buses from bus 0, as the config
+ * space of a hosted machine. Devices found so far are forgotten.
+ */
+int pci_ecam_load_image(const char *path) {
+#ifdef __unix__
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -ENOENT;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (len <= 0 || (size_t)len > PCI_MAX_BUSES * PCI_ECAM_BUS_SIZE) {
+        fclose(fp);
+        return -EINVAL;
+    }
+
+    /* Host memory, like the machine it stands in for; the tail of the last bus reads all-ones */
+    size_t size = ((size_t)len + PCI_ECAM_BUS_SIZE - 1) & ~(PCI_ECAM_BUS_SIZE - 1);
+    uint8_t *image = malloc(size);
+    uint32_t *wmask = malloc(size / PCI_CFG_SPACE_EXP_SIZE * PCI_NUM_BARS * sizeof(uint32_t));
+    if (!image || !wmask || fread(image, 1, (size_t)len, fp) != (size_t)len) {
+        fclose(fp);
+        free(image);
+        free(wmask);
+        return image && wmask ? -EIO : -ENOMEM;
+    }
+    fclose(fp);
+    memset(image + len, 0xff, size - (size_t)len);
+
+    pci_release_devices();
+    free(g_pci.image);
+    free(g_pci.bar_wmask);
+    g_pci.image = image;
+    g_pci.image_size = size;
+    g_pci.bar_wmask = wmask;
+    image_bar_masks();
+    g_pci.ecam = image;
+    g_pci.ecam_buses = (unsigned int)(size / PCI_ECAM_BUS_SIZE);
+    g_pci.access = PCI_ACCESS_ECAM;
+    return 0;
+#else
+    (void)path;
+    return -ENODEV;
+#endif
+}
+
+/*
+ * Put a function with config space cfg (len bytes from offset 0) in the
+ * first free slot of bus 0, for a device model to answer behind it;
+ * without an image loaded, bus 0 starts out empty. Returns its devfn.
+ * The next scan finds it.
+ */
+int pci_emulate_function(const void *cfg, size_t len) {
+#ifdef __unix__
+    if (!cfg || len < 0x40 || len > PCI_CFG_SPACE_EXP_SIZE) return -EINVAL;
+    if (!g_pci.initialized) pci_init_access();
+    if (!g_pci.image) {
+        uint8_t *image = malloc(PCI_ECAM_BUS_SIZE);
+        uint32_t *wmask = malloc(PCI_ECAM_BUS_SIZE / PCI_CFG_SPACE_EXP_SIZE * PCI_NUM_BARS * sizeof(uint32_t));
+        if (!image || !wmask) {
+            free(image);
+            free(wmask);
+            return -ENOMEM;
+        }
+        memset(image, 0xff, PCI_ECAM_BUS_SIZE);
+        g_pci.image = image;
+        g_pci.image_size = PCI_ECAM_BUS_SIZE;
+        g_pci.bar_wmask = wmask;
+        image_bar_masks();
+        g_pci.ecam = image;
+        g_pci.ecam_buses = 1;
+        g_pci.access = PCI_ACCESS_ECAM;
+    }
+
+    for (unsigned int slot = 0; slot < 32; slot++) {
+        uint8_t *fn = g_pci.image + ((size_t)PCI_DEVFN(slot, 0) << 12);
+        uint16_t vendor;
+        memcpy(&vendor, fn + PCI_VENDOR_ID, sizeof(vendor));
+        if (vendor != 0xffff && vendor != 0) continue;
+        memset(fn, 0, PCI_CFG_SPACE_EXP_SIZE);
+        memcpy(fn, cfg, len);
+        image_bar_masks();
+        return PCI_DEVFN(slot, 0);
+    }
+    return -ENOSPC;
+#else
+    (void)cfg;
+    (void)len;
+    return -ENODEV;
+#endif
+}
+
+/* Empty the slot of a function pci_emulate_function() put on bus 0 */
+void pci_remove_emulated_function(unsigned int devfn) {
+#ifdef __unix__
+    if (!g_pci.image || devfn > 0xff) return;
+    memset(g_pci.image + ((size_t)devfn << 12), 0xff, PCI_CFG_SPACE_EXP_SIZE);
+#else
+    (void)devfn;
+#endif
+}
+
+/* ============================================================================
+ * Enumeration
+ * ============================================================================ */
+
+/* Vendor and device ID as read from an empty slot, or from one that is not answering */
+static inline bool pci_id_valid(uint32_t id) {
+    uint16_t vendor = (uint16_t)id;
+    return vendor != 0xffff && vendor != 0;
+}
+
+/* Size BAR i from what a write of all-ones leaves; returns the BAR slots it takes */
+static unsigned int pci_size_bar(pci_dev_t *dev, unsigned int i, unsigned int nbars) {
+    unsigned int reg = PCI_BASE_ADDRESS_0 + 4 * i;
+    pci_bar_t *bar = &dev->bar[i];
+    uint32_t orig, mask;
+
+    pci_read_config_dword(dev, reg, &orig);
+    pci_write_config_dword(dev, reg, ~0U);
+    pci_read_config_dword(dev, reg, &mask);
+    pci_write_config_dword(dev, reg, orig);
+    if (!mask || mask == ~0U) return 1;
+
+    if (orig & PCI_BASE_ADDRESS_SPACE_IO) {
+        uint32_t m = mask & PCI_BASE_ADDRESS_IO_MASK & 0xffff;
+        bar->flags = PCI_BAR_IO;
+        bar->start = orig & PCI_BASE_ADDRESS_IO_MASK;
+        bar->size = m & -m;
+        return 1;
+    }
+
+    uint64_t m = mask & PCI_BASE_ADDRESS_MEM_MASK;
+    uint64_t start = orig & PCI_BASE_ADDRESS_MEM_MASK;
+    unsigned int used = 1;
+    if (orig & PCI_BASE_ADDRESS_MEM_PREFETCH) bar->flags |= PCI_BAR_PREFETCH;
+    if ((orig & PCI_BASE_ADDRESS_MEM_TYPE_MASK) == PCI_BASE_ADDRESS_MEM_TYPE_64 && i + 1 < nbars) {
+        uint32_t orig_hi, mask_hi;
+        pci_read_config_dword(dev, reg + 4, &orig_hi);
+        pci_write_config_dword(dev, reg + 4, ~0U);
+        pci_read_config_dword(dev, reg + 4, &mask_hi);
+        pci_write_config_dword(dev, reg + 4, orig_hi);
+        m |= (uint64_t)mask_hi << 32;
+        start |= (uint64_t)orig_hi << 32;
+        bar->flags |= PCI_BAR_MEM64;
+        used = 2;
+    }
+    if (!m) {
+        bar->flags = 0;
+        return used;
+    }
+    bar->start = start;
+    bar->size = m & -m;
+    return used;
+}
+
+/* Decoding stays off while BARs hold all-ones, so they cannot claim stray cycles */
+static void pci_read_bases(pci_dev_t *dev, unsigned int nbars) {
+    uint16_t cmd;
+    pci_read_config_word(dev, PCI_COMMAND, &cmd);
+    if (cmd & (PCI_COMMAND_IO | PCI_COMMAND_MEMORY))
+        pci_write_config_word(dev, PCI_COMMAND, cmd & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+
+    for (unsigned int i = 0; i < nbars;)
+        i += pci_size_bar(dev, i, nbars);
+
+    if (cmd & (PCI_COMMAND_IO | PCI_COMMAND_MEMORY))
+        pci_write_config_word(dev, PCI_COMMAND, cmd);
+}
+
+/* Offset of the first capability cap in the list, 0 if there is none */
+unsigned int pci_find_capability(pci_dev_t *dev, unsigned int cap) {
+    uint16_t status;
+    uint8_t pos;
+
+    pci_read_config_word(dev, PCI_COMMAND + 2, &status);
+    if (!(status & PCI_STATUS_CAP_LIST)) return 0;
+    pci_read_config_byte(dev, PCI_CAPABILITY_LIST, &pos);
+
+    for (int ttl = PCI_FIND_CAP_TTL; ttl && pos >= 0x40; ttl--) {
+        uint16_t ent;
+        pos &= ~3;
+        pci_read_config_word(dev, pos, &ent);
+        if ((ent & 0xff) == 0xff) break;
+        if ((ent & 0xff) == cap) return pos;
+        pos = (uint8_t)(ent >> 8);
+    }
+    return 0;
+}
+
+/* PCI Express extended capabilities, past the first 256 bytes: ECAM only */
+unsigned int pci_find_ext_capability(pci_dev_t *dev, unsigned int cap) {
+    unsigned int pos = PCI_CFG_SPACE_SIZE;
+    uint32_t header;
+
+    if (!dev->pcie_cap || pci_read_config_dword(dev, pos, &header) < 0 || !header || header == ~0U)
+        return 0;
+    for (int ttl = (PCI_CFG_SPACE_EXP_SIZE - PCI_CFG_SPACE_SIZE) / 8; ttl; ttl--) {
+        if ((header & 0xffff) == cap) return pos;
+        pos = header >> 20;
+        if (pos < PCI_CFG_SPACE_SIZE) break;
+        if (pci_read_config_dword(dev, pos, &header) < 0) break;
+    }
+    return 0;
+}
+
+/* One walk of the capability list for the ones drivers and MSI-X look for */
+static void pci_read_caps(pci_dev_t *dev, uint16_t status) {
+    uint8_t pos;
+
+    if (!(status & PCI_STATUS_CAP_LIST)) return;
+    pci_read_config_byte(dev, PCI_CAPABILITY_LIST, &pos);
+    for (int ttl = PCI_FIND_CAP_TTL; ttl && pos >= 0x40; ttl--) {
+        uint16_t ent;
+        pos &= ~3;
+        pci_read_config_word(dev, pos, &ent);
+        switch (ent & 0xff) {
+        case 0xff: return;
+        case PCI_CAP_ID_MSI: if (!dev->msi_cap) dev->msi_cap = pos; break;
+        case PCI_CAP_ID_MSIX: if (!dev->msix_cap) dev->msix_cap = pos; break;
+        case PCI_CAP_ID_EXP: if (!dev->pcie_cap) dev->pcie_cap = pos; break;
+        }
+        pos = (uint8_t)(ent >> 8);
+    }
+}
+
+static pci_dev_t *pci_setup_device(unsigned int bus, unsigned int devfn, uint32_t id, uint8_t hdr) {
+    pci_dev_t *dev = kmalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev) return NULL;
+    memset(dev, 0, sizeof(*dev));
+    dev->bus = (uint8_t)bus;
+    dev->devfn = (uint8_t)devfn;
+    dev->vendor = (uint16_t)id;
+    dev->device = (uint16_t)(id >> 16);
+    dev->hdr_type = hdr & 0x7f;
+
+    uint32_t v;
+    pci_read_config_dword(dev, PCI_CLASS_REVISION, &v);
+    dev->revision = (uint8_t)v;
+    dev->class = v >> 8;
+
+    unsigned int nbars = 0;
+    if (dev->hdr_type == 0) {
+        nbars = 6;
+    } else if (dev->hdr_type == 1) {
+        nbars = 2;
+        pci_read_config_dword(dev, PCI_BRIDGE_BUSES, &v);
+        dev->secondary = (uint8_t)(v >> 8);
+    }
+    pci_read_bases(dev, nbars);
+
+    pci_read_config_dword(dev, PCI_COMMAND, &v);
+    pci_read_caps(dev, (uint16_t)(v >> 16));
+
+    pr_debug("PCI: %02x:%02x.%u [%04x:%04x] class %06x%s\n", bus, PCI_SLOT(devfn), PCI_FUNC(devfn),
+             dev->vendor, dev->device, dev->class, dev->hdr_type == 1 ? " bridge" : "");
+    return dev;
+}
+
+/*
+ * Scan every slot of bus, then the buses behind its bridges. Function 0
+ * says whether there are others, so single-function slots cost two reads
+ * before the header proper.
+ */
+static unsigned int pci_scan_bus(unsigned int bus, uint64_t *seen) {
+    uint8_t children[PCI_MAX_BUSES];
+    unsigned int nchildren = 0, found = 0;
+
+    seen[bus / 64] |= 1ULL << (bus % 64);
+    for (unsigned int slot = 0; slot < 32; slot++) {
+        unsigned int nfn = 1;
+        for (unsigned int fn = 0; fn < nfn; fn++) {
+            unsigned int devfn = PCI_DEVFN(slot, fn);
+            uint32_t id, v;
+            pci_bus_read(bus, devfn, PCI_VENDOR_ID, 4, &id);
+            if (!pci_id_valid(id)) continue;
+            pci_bus_read(bus, devfn, PCI_HEADER_TYPE_DWORD, 4, &v);
+            uint8_t hdr = (uint8_t)(v >> 16);
+            if (fn == 0 && (hdr & 0x80)) nfn = 8;
+
+            pci_dev_t *dev = pci_setup_device(bus, devfn, id, hdr);
+            if (!dev) return found;
+            *g_pci.tail = dev;
+            g_pci.tail = &dev->next;
+            found++;
+
+            unsigned int sec = dev->secondary;
+            if (dev->hdr_type == 1 && sec > bus && !(seen[sec / 64] & (1ULL << (sec % 64))))
+                children[nchildren++] = (uint8_t)sec;
+        }
+    }
+
+    for (unsigned int i = 0; i < nchildren; i++)
+        if (!(seen[children[i] / 64] & (1ULL << (children[i] % 64))))
+            found += pci_scan_bus(children[i], seen);
+    return found;
+}
+
+static void pci_release_devices(void) {
+    pci_dev_t *dev = g_pci.devices;
+    while (dev) {
+        pci_dev_t *next = dev->next;
+        pci_free_irq_vectors(dev);
+#ifdef __unix__
+        for (unsigned int i = 0; i < PCI_NUM_BARS; i++)
+            free(dev->bar[i].virt);
+#endif
+        kfree(dev);
+        dev = next;
+    }
+    g_pci.devices = NULL;
+    g_pci.tail = &g_pci.devices;
+}
+
+/* Pick config access once, from the command line */
+static void pci_init_access(void) {
+    char val[256];
+
+    g_pci.initialized = true;
+    g_pci.tail = &g_pci.devices;
+#ifdef __unix__
+    if (boot_param("pci.image", val, sizeof(val))) {
+        int ret = pci_ecam_load_image(val);
+        if (ret < 0) pr_err("PCI: cannot load config space image %s: %d\n", val, ret);
+    }
+#else
+    if (boot_param("pci.ecam", val, sizeof(val))) {
+        g_pci.ecam = (volatile uint8_t *)(uintptr_t)strtoull(val, NULL, 0);
+        g_pci.ecam_buses = PCI_MAX_BUSES;
+        g_pci.access = PCI_ACCESS_ECAM;
+    }
+#endif
+}
+
+/* Enumerate every function reachable from bus 0; returns how many, replacing the last scan's */
+int pci_scan_devices(void) {
+    uint64_t seen[PCI_MAX_BUSES / 64] = { 0 };
+
+    if (!g_pci.initialized) pci_init_access();
+    pci_release_devices();
+
+    unsigned int found = pci_scan_bus(0, seen);
+    unsigned int buses = 0;
+    for (unsigned int i = 0; i < PCI_MAX_BUSES / 64; i++)
+        buses += (unsigned int)__builtin_popcountll(seen[i]);
+    if (found)
+        pr_info("PCI: %u functions on %u buses (%s)\n", found, buses,
+                g_pci.access == PCI_ACCESS_ECAM ? "ECAM" : "conf1");
+    return (int)found;
+}
+
+/* The next device after from matching vendor and device, PCI_ANY_ID for either */
+pci_dev_t *pci_get_device(uint16_t vendor, uint16_t device, pci_dev_t *from) {
+    for (pci_dev_t *dev = from ? from->next : g_pci.devices; dev; dev = dev->next)
+        if ((vendor == PCI_ANY_ID || dev->vendor == vendor) &&
+            (device == PCI_ANY_ID || dev->device == device))
+            return dev;
+    return NULL;
+}
+
+/* ============================================================================
+ * Resources
+ * ============================================================================ */
+
+int pci_enable_device(pci_dev_t *dev) {
+    uint16_t cmd, want = PCI_COMMAND_MASTER;
+    for (unsigned int i = 0; i < PCI_NUM_BARS; i++) {
+        if (!dev->bar[i].size) continue;
+        want |= dev->bar[i].flags & PCI_BAR_IO ? PCI_COMMAND_IO : PCI_COMMAND_MEMORY;
+    }
+    int ret = pci_read_config_word(dev, PCI_COMMAND, &cmd);
+    if (ret < 0) return ret;
+    if ((cmd & want) != want) ret = pci_write_config_word(dev, PCI_COMMAND, cmd | want);
+    return ret;
+}
+
+/* A memory BAR's registers; NULL for I/O or unimplemented BARs */
+void *pci_iomap(pci_dev_t *dev, unsigned int bar) {
+    if (bar >= PCI_NUM_BARS) return NULL;
+    pci_bar_t *b = &dev->bar[bar];
+    if (!b->size || (b->flags & PCI_BAR_IO)) return NULL;
+    if (!b->virt) {
+#ifdef __unix__
+        if (b->size <= PCI_HOSTED_BAR_MAX) b->virt = calloc(1, b->size);
+#else
+        b->virt = (void *)(uintptr_t)b->start;
+#endif
+    }
+    return b->virt;
+}
+
+/* ============================================================================
+ * MSI-X
+ * ============================================================================ */
+
+/* Table (or PBA, at PCI_MSIX_PBA) location, checked against its BAR */
+static volatile uint8_t *msix_region(pci_dev_t *dev, unsigned int reg, size_t len) {
+    uint32_t v;
+    pci_read_config_dword(dev, dev->msix_cap + reg, &v);
+    unsigned int bir = v & PCI_MSIX_BIR;
+    size_t off = v & ~PCI_MSIX_BIR;
+    uint8_t *base = bir < PCI_NUM_BARS ? pci_iomap(dev, bir) : NULL;
+    if (!base || off + len > dev->bar[bir].size) return NULL;
+    return base + off;
+}
+
+static unsigned int msix_table_size(pci_dev_t *dev, uint16_t *ctrl) {
+    pci_read_config_word(dev, dev->msix_cap + PCI_MSIX_FLAGS, ctrl);
+    return (*ctrl & PCI_MSIX_FLAGS_QSIZE) + 1U;
+}
+
+/*
+ * Enable MSI-X with between min and max vectors, one per table entry
+ * from 0, and return how many. The function is masked while the table
+ * is written; entries past the last vector stay masked.
+ */
+int pci_alloc_irq_vectors(pci_dev_t *dev, unsigned int min, unsigned int max, unsigned int flags) {
+    if (!min || min > max) return -EINVAL;
+    if (!dev->msix_cap) return -ENODEV;
+    if (dev->nr_irqs) return -EBUSY;
+
+    uint16_t ctrl;
+    unsigned int qsize = msix_table_size(dev, &ctrl);
+    unsigned int nvec = max < qsize ? max : qsize;
+    if (nvec < min) return -ENOSPC;
+    volatile uint8_t *table = msix_region(dev, PCI_MSIX_TABLE, (size_t)qsize * PCI_MSIX_ENTRY_SIZE);
+    if (!table) return -ENODEV;
+    pci_irq_t *irqs = kmalloc(nvec * sizeof(*irqs), GFP_KERNEL);
+    if (!irqs) return -ENOMEM;
+
+    pci_write_config_word(dev, dev->msix_cap + PCI_MSIX_FLAGS,
+                          ctrl | PCI_MSIX_FLAGS_MASKALL | PCI_MSIX_FLAGS_ENABLE);
+    unsigned int n = 0;
+    for (; n < nvec; n++) {
+        unsigned int cpu = flags & PCI_IRQ_AFFINITY ? n % NR_CPUS : IRQ_ANY_CPU;
+        int vector = irq_alloc_vector(&cpu);
+        if (vector < 0) break;
+        irqs[n].vector = (uint8_t)vector;
+        irqs[n].cpu = (uint8_t)cpu;
+
+        volatile uint8_t *e = table + n * PCI_MSIX_ENTRY_SIZE;
+        iowrite32(MSI_ADDR_BASE | cpu << MSI_ADDR_DEST_SHIFT, e + PCI_MSIX_ENTRY_ADDR);
+        iowrite32(0, e + PCI_MSIX_ENTRY_ADDR_HI);
+        iowrite32((uint32_t)vector, e + PCI_MSIX_ENTRY_DATA);
+        iowrite32(0, e + PCI_MSIX_ENTRY_CTRL);
+    }
+    if (n < min) {
+        for (unsigned int i = 0; i < n; i++)
+            irq_free_vector(irqs[i].vector);
+        kfree(irqs);
+        pci_write_config_word(dev, dev->msix_cap + PCI_MSIX_FLAGS,
+                              ctrl & ~(PCI_MSIX_FLAGS_MASKALL | PCI_MSIX_FLAGS_ENABLE));
+        return -ENOSPC;
+    }
+    for (unsigned int i = n; i < qsize; i++)
+        iowrite32(PCI_MSIX_ENTRY_MASKBIT, table + i * PCI_MSIX_ENTRY_SIZE + PCI_MSIX_ENTRY_CTRL);
+
+    dev->irqs = irqs;
+    dev->nr_irqs = n;
+
+    uint16_t cmd;
+    pci_read_config_word(dev, PCI_COMMAND, &cmd);
+    pci_write_config_word(dev, PCI_COMMAND, cmd | PCI_COMMAND_INTX_DISABLE);
+    pci_write_config_word(dev, dev->msix_cap + PCI_MSIX_FLAGS,
+                          (ctrl & ~PCI_MSIX_FLAGS_MASKALL) | PCI_MSIX_FLAGS_ENABLE);
+    return (int)n;
+}
+
+int pci_irq_vector(pci_dev_t *dev, unsigned int nr) {
+    return nr < dev->nr_irqs ? dev->irqs[nr].vector : -EINVAL;
+}
+
+void pci_free_irq_vectors(pci_dev_t *dev) {
+    if (!dev->nr_irqs) return;
+
+    uint16_t ctrl;
+    unsigned int qsize = msix_table_size(dev, &ctrl);
+    volatile uint8_t *table = msix_region(dev, PCI_MSIX_TABLE, (size_t)qsize * PCI_MSIX_ENTRY_SIZE);
+    pci_write_config_word(dev, dev->msix_cap + PCI_MSIX_FLAGS, ctrl & ~PCI_MSIX_FLAGS_ENABLE);
+    for (unsigned int i = 0; i < dev->nr_irqs; i++) {
+        if (table)
+            iowrite32(PCI_MSIX_ENTRY_MASKBIT, table + i * PCI_MSIX_ENTRY_SIZE + PCI_MSIX_ENTRY_CTRL);
+        irq_free_vector(dev->irqs[i].vector);
+    }
+    kfree(dev->irqs);
+    dev->irqs = NULL;
+    dev->nr_irqs = 0;
+}
+
+/*
+ * The device side of MSI-X, for emulated devices: send entry's message,
+ * or leave it pending in the PBA while the entry or function is masked.
+ */
+void pci_msix_signal(pci_dev_t *dev, unsigned int entry) {
+    uint16_t ctrl;
+    if (!dev->msix_cap) return;
+    unsigned int qsize = msix_table_size(dev, &ctrl);
+    if (!(ctrl & PCI_MSIX_FLAGS_ENABLE) || entry >= qsize) return;
+
+    volatile uint8_t *e = msix_region(dev, PCI_MSIX_TABLE, (size_t)qsize * PCI_MSIX_ENTRY_SIZE);
+    if (!e) return;
+    e += entry * PCI_MSIX_ENTRY_SIZE;
+    if ((ctrl & PCI_MSIX_FLAGS_MASKALL) ||
+        (ioread32(e + PCI_MSIX_ENTRY_CTRL) & PCI_MSIX_ENTRY_MASKBIT)) {
+        volatile uint8_t *pba = msix_region(dev, PCI_MSIX_PBA, (qsize + 63) / 64 * 8);
+        if (pba) {
+            volatile uint8_t *w = pba + entry / 32 * 4;
+            iowrite32(ioread32(w) | 1U << (entry % 32), w);
+        }
+        return;
+    }
+    uint32_t addr = ioread32(e + PCI_MSIX_ENTRY_ADDR);
+    uint32_t data = ioread32(e + PCI_MSIX_ENTRY_DATA);
+    irq_inject((addr >> MSI_ADDR_DEST_SHIFT) & 0xff, data & 0xff);
+}
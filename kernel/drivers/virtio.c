@@ -0,0 +1,1287 @@
+/**
+ * Virtio over PCI
+ *
+ * The modern (1.x) transport: vendor capabilities in config space say
+ * which BAR holds the common configuration, the notification doorbells,
+ * the ISR byte and the device-specific configuration. Features are
+ * negotiated once, then each queue gets its rings, an MSI-X vector aimed
+ * at the CPU of the same number, and a doorbell.
+ *
+ * Queues come in two layouts. A split ring is three arrays: descriptors,
+ * the available ring the driver appends chain heads to, and the used
+ * ring the device hands them back on. A packed ring is one descriptor
+ * array both sides walk in order, ownership of a slot flipping with a
+ * wrap counter each lap, so the device reads and writes back a buffer in
+ * the same cache line. In either layout a buffer of several segments
+ * takes a single slot when the device reads indirect tables: the slot
+ * points at a table allocated for that buffer, and a 64 KiB request of
+ * 16 pages stops needing 18 slots of a 256-slot ring.
+ *
+ * Notifications are suppressed both ways. Without event indexes a side
+ * can only switch the other's notifications off while it is busy. With
+ * them it publishes the position it next wants to hear about: the driver
+ * kicks only when new buffers cross the device's avail event, the device
+ * interrupts only when completions cross the driver's used event. The
+ * usual reaping loop (disable, drain, re-enable, look again) then takes
+ * one interrupt per burst.
+ *
+ * Rings are little-endian, as is every CPU this kernel runs on, and hold
+ * physical addresses, which are the kernel's own until the MMU maps
+ * otherwise; hosted, they are host addresses the model shares.
+ *
+ * The device side at the end serves hosted models (virtio_blk.c): it
+ * builds a function's config space, traps its BAR, answers the common
+ * configuration and walks rings the way a device does.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* struct virtio_pci_cap */
+#define VIRTIO_PCI_CAP_NEXT         1
+#define VIRTIO_PCI_CAP_LEN          2
+#define VIRTIO_PCI_CAP_CFG_TYPE     3
+#define VIRTIO_PCI_CAP_BAR          4
+#define VIRTIO_PCI_CAP_OFFSET       8
+#define VIRTIO_PCI_CAP_LENGTH       12
+#define VIRTIO_PCI_NOTIFY_CAP_MULT  16
+
+#define VIRTIO_PCI_CAP_COMMON_CFG   1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG   2
+#define VIRTIO_PCI_CAP_ISR_CFG      3
+#define VIRTIO_PCI_CAP_DEVICE_CFG   4
+
+/* Common configuration */
+#define VIRTIO_PCI_COMMON_DFSELECT  0x00
+#define VIRTIO_PCI_COMMON_DF        0x04
+#define VIRTIO_PCI_COMMON_GFSELECT  0x08
+#define VIRTIO_PCI_COMMON_GF        0x0c
+#define VIRTIO_PCI_COMMON_MSIX      0x10
+#define VIRTIO_PCI_COMMON_NUMQ      0x12
+#define VIRTIO_PCI_COMMON_STATUS    0x14
+#define VIRTIO_PCI_COMMON_CFGGEN    0x15
+#define VIRTIO_PCI_COMMON_Q_SELECT  0x16
+#define VIRTIO_PCI_COMMON_Q_SIZE    0x18
+#define VIRTIO_PCI_COMMON_Q_MSIX    0x1a
+#define VIRTIO_PCI_COMMON_Q_ENABLE  0x1c
+#define VIRTIO_PCI_COMMON_Q_NOFF    0x1e
+#define VIRTIO_PCI_COMMON_Q_DESCLO  0x20
+#define VIRTIO_PCI_COMMON_Q_DESCHI  0x24
+#define VIRTIO_PCI_COMMON_Q_AVAILLO 0x28
+#define VIRTIO_PCI_COMMON_Q_AVAILHI 0x2c
+#define VIRTIO_PCI_COMMON_Q_USEDLO  0x30
+#define VIRTIO_PCI_COMMON_Q_USEDHI  0x34
+#define VIRTIO_PCI_COMMON_SIZE      0x38
+
+#define VIRTIO_MSI_NO_VECTOR        0xffff
+
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE 0x01
+#define VIRTIO_CONFIG_S_DRIVER      0x02
+#define VIRTIO_CONFIG_S_DRIVER_OK   0x04
+#define VIRTIO_CONFIG_S_FEATURES_OK 0x08
+#define VIRTIO_CONFIG_S_FAILED      0x80
+
+/* Rings */
+#define VRING_DESC_F_NEXT           0x0001
+#define VRING_DESC_F_WRITE          0x0002
+#define VRING_DESC_F_INDIRECT       0x0004
+#define VRING_PACKED_DESC_F_AVAIL   0x0080
+#define VRING_PACKED_DESC_F_USED    0x8000
+
+#define VRING_AVAIL_F_NO_INTERRUPT  1
+#define VRING_USED_F_NO_NOTIFY      1
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2   /* Notify at off_wrap; needs EVENT_IDX */
+#define VRING_PACKED_EVENT_WRAP_SHIFT   15
+
+#define VIRTQUEUE_MAX_SIZE          32768   /* Packed wrap counters need a lap to divide 2^16 */
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} vring_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];                /* Then used_event */
+} vring_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} vring_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    vring_used_elem_t ring[];       /* Then avail_event */
+} vring_used_t;
+
+/* The event indexes trailing each split ring */
+static inline volatile uint16_t *vring_used_event(vring_avail_t *avail, unsigned int num) {
+    return &avail->ring[num];
+}
+
+static inline volatile uint16_t *vring_avail_event(vring_used_t *used, unsigned int num) {
+    return (volatile uint16_t *)((uint8_t *)used + offsetof(vring_used_t, ring) +
+                                 num * sizeof(vring_used_elem_t));
+}
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} vring_packed_desc_t;
+
+typedef struct {
+    uint16_t off_wrap;
+    uint16_t flags;
+} vring_packed_event_t;
+
+typedef struct {
+    virtqueue_t vq;
+    bool packed_ring, indirect, event_idx;
+    bool cb_disabled;
+    uint16_t mask;                  /* num - 1 */
+    volatile void *notify_addr;
+    uint16_t num_added;             /* Slots made available since the last kick check */
+    uint16_t free_head;
+    uint16_t last_used;             /* Free-running: used index, or packed descriptor */
+    void **data;                    /* Per buffer ID */
+    void **indir;                   /* Indirect table per buffer ID, or NULL */
+    union {
+        struct {
+            vring_desc_t *desc;
+            vring_avail_t *avail;
+            vring_used_t *used;
+            uint16_t avail_idx;     /* Free-running, as last published */
+        } split;
+        struct {
+            vring_packed_desc_t *desc;
+            vring_packed_event_t *driver, *device;
+            uint16_t next_avail;    /* Free-running descriptor count */
+            uint16_t *next_id;      /* Free buffer IDs */
+            uint16_t *ndescs;       /* Slots each buffer ID took */
+        } packed;
+    };
+} vring_virtqueue_t;
+
+#define to_vvq(_vq)     ((vring_virtqueue_t *)(_vq))
+
+/* Has the index moved from old to new past event? The same test either side */
+static inline bool vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+/*
+ * Packed rings count in free-running descriptor positions, so a lap is
+ * num of them and the wrap counter is the lap's parity (1 on the first).
+ * An event names a slot and a wrap counter, which pins it to a position
+ * modulo two laps; that is all vring_need_event() needs.
+ */
+static inline bool packed_wrap(uint16_t pos, uint16_t num) {
+    return !(pos & num);
+}
+
+static inline uint16_t packed_event_off_wrap(uint16_t pos, uint16_t num) {
+    return (uint16_t)((pos & (num - 1)) | (uint16_t)packed_wrap(pos, num) << VRING_PACKED_EVENT_WRAP_SHIFT);
+}
+
+static inline bool packed_need_event(uint16_t off_wrap, uint16_t new_pos, uint16_t old, uint16_t num) {
+    uint16_t event = (off_wrap & ((1U << VRING_PACKED_EVENT_WRAP_SHIFT) - 1)) |
+                     (off_wrap >> VRING_PACKED_EVENT_WRAP_SHIFT ? 0 : num);
+    return (uint16_t)((new_pos - event - 1) & (2 * num - 1)) < (uint16_t)(new_pos - old);
+}
+
+static inline uint64_t vring_addr(const void *p) {
+    return (uint64_t)(uintptr_t)p;
+}
+
+static inline void *vring_ptr(uint64_t addr) {
+    return (void *)(uintptr_t)addr;
+}
+
+/* ============================================================================
+ * Virtqueues, driver side
+ * ============================================================================ */
+
+static void *alloc_indirect(unsigned int total, size_t entry) {
+    return kmalloc(total * entry, GFP_ATOMIC);
+}
+
+static int add_split(vring_virtqueue_t *vvq, const virtio_sg_t *sg, unsigned int out,
+                     unsigned int in, void *data) {
+    unsigned int total = out + in, descs = total;
+    vring_desc_t *desc = vvq->split.desc, *table = NULL;
+
+    if (vvq->indirect && total > 1 && vvq->vq.num_free) {
+        table = alloc_indirect(total, sizeof(*table));
+        if (table) descs = 1;
+    }
+    if (vvq->vq.num_free < descs) {
+        kfree(table);
+        return -ENOSPC;
+    }
+
+    uint16_t head = vvq->free_head, i = head;
+    if (table) {
+        for (unsigned int n = 0; n < total; n++) {
+            table[n].addr = vring_addr(sg[n].addr);
+            table[n].len = sg[n].len;
+            table[n].flags = (uint16_t)((n + 1 < total ? VRING_DESC_F_NEXT : 0) |
+                                        (n >= out ? VRING_DESC_F_WRITE : 0));
+            table[n].next = (uint16_t)(n + 1);
+        }
+        desc[head].addr = vring_addr(table);
+        desc[head].len = total * (uint32_t)sizeof(*table);
+        desc[head].flags = VRING_DESC_F_INDIRECT;
+        i = desc[head].next;
+    } else {
+        /* The free list's own links become the chain's */
+        uint16_t prev = head;
+        for (unsigned int n = 0; n < total; n++) {
+            desc[i].addr = vring_addr(sg[n].addr);
+            desc[i].len = sg[n].len;
+            desc[i].flags = (uint16_t)(VRING_DESC_F_NEXT | (n >= out ? VRING_DESC_F_WRITE : 0));
+            prev = i;
+            i = desc[i].next;
+        }
+        desc[prev].flags &= (uint16_t)~VRING_DESC_F_NEXT;
+    }
+    vvq->free_head = i;
+    vvq->vq.num_free -= descs;
+    vvq->data[head] = data;
+    vvq->indir[head] = table;
+
+    vvq->split.avail->ring[vvq->split.avail_idx & vvq->mask] = head;
+    vvq->split.avail_idx++;
+    __atomic_store_n(&vvq->split.avail->idx, vvq->split.avail_idx, __ATOMIC_RELEASE);
+    vvq->num_added++;
+    return 0;
+}
+
+static int add_packed(vring_virtqueue_t *vvq, const virtio_sg_t *sg, unsigned int out,
+                      unsigned int in, void *data) {
+    unsigned int total = out + in, descs = total;
+    uint16_t num = (uint16_t)vvq->vq.num;
+    vring_packed_desc_t *ring = vvq->packed.desc, *table = NULL;
+
+    if (vvq->indirect && total > 1 && vvq->vq.num_free) {
+        table = alloc_indirect(total, sizeof(*table));
+        if (table) descs = 1;
+    }
+    if (vvq->vq.num_free < descs) {
+        kfree(table);
+        return -ENOSPC;
+    }
+
+    uint16_t id = vvq->free_head, start = vvq->packed.next_avail, head_flags;
+    if (table) {
+        for (unsigned int n = 0; n < total; n++) {
+            table[n].addr = vring_addr(sg[n].addr);
+            table[n].len = sg[n].len;
+            table[n].id = 0;
+            table[n].flags = n >= out ? VRING_DESC_F_WRITE : 0;
+        }
+        ring[start & vvq->mask].addr = vring_addr(table);
+        ring[start & vvq->mask].len = total * (uint32_t)sizeof(*table);
+        ring[start & vvq->mask].id = id;
+        head_flags = VRING_DESC_F_INDIRECT;
+    } else {
+        head_flags = 0;
+        for (unsigned int n = 0; n < total; n++) {
+            vring_packed_desc_t *d = &ring[(start + n) & vvq->mask];
+            uint16_t flags = (uint16_t)((n + 1 < total ? VRING_DESC_F_NEXT : 0) |
+                                        (n >= out ? VRING_DESC_F_WRITE : 0));
+            d->addr = vring_addr(sg[n].addr);
+            d->len = sg[n].len;
+            d->id = id;
+            if (n == 0) {
+                head_flags = flags;
+                continue;
+            }
+            d->flags = (uint16_t)(flags | (packed_wrap((uint16_t)(start + n), num) ?
+                                           VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED));
+        }
+    }
+    /* The head's flags hand the whole chain over */
+    head_flags |= packed_wrap(start, num) ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+    __atomic_store_n(&ring[start & vvq->mask].flags, head_flags, __ATOMIC_RELEASE);
+
+    vvq->packed.next_avail = (uint16_t)(start + descs);
+    vvq->packed.ndescs[id] = (uint16_t)descs;
+    vvq->free_head = vvq->packed.next_id[id];
+    vvq->vq.num_free -= descs;
+    vvq->num_added = (uint16_t)(vvq->num_added + descs);
+    vvq->data[id] = data;
+    vvq->indir[id] = table;
+    return 0;
+}
+
+/*
+ * Make sg available to the device: out segments it reads, then in
+ * segments it writes. data comes back from virtqueue_get_buf(). The
+ * caller serializes calls on one queue and kicks when it is done adding.
+ */
+int virtqueue_add_sgs(virtqueue_t *vq, const virtio_sg_t *sg, unsigned int out, unsigned int in,
+                      void *data) {
+    vring_virtqueue_t *vvq = to_vvq(vq);
+    if (!data || (!out && !in) || out + in > vq->num) return -EINVAL;
+    return vvq->packed_ring ? add_packed(vvq, sg, out, in, data) : add_split(vvq, sg, out, in, data);
+}
+
+/* Whether the device wants to hear about what was added since the last check */
+bool virtqueue_kick_prepare(virtqueue_t *vq) {
+    vring_virtqueue_t *vvq = to_vvq(vq);
+
+    /* New buffers are visible before the device's suppression is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint16_t added = vvq->num_added;
+    vvq->num_added = 0;
+    if (!added) return false;
+
+    if (vvq->packed_ring) {
+        uint16_t new_pos = vvq->packed.next_avail;
+        vring_packed_event_t ev = *(volatile vring_packed_event_t *)vvq->packed.device;
+        if (ev.flags == VRING_PACKED_EVENT_FLAG_DESC && vvq->event_idx)
+            return packed_need_event(ev.off_wrap, new_pos, (uint16_t)(new_pos - added), (uint16_t)vq->num);
+        return ev.flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    }
+
+    uint16_t new_idx = vvq->split.avail_idx;
+    if (vvq->event_idx) {
+        uint16_t avail_event = *vring_avail_event(vvq->split.used, vq->num);
+        return vring_need_event(avail_event, new_idx, (uint16_t)(new_idx - added));
+    }
+    return !(*(volatile uint16_t *)&vvq->split.used->flags & VRING_USED_F_NO_NOTIFY);
+}
+
+void virtqueue_notify(virtqueue_t *vq) {
+    iowrite16((uint16_t)vq->index, to_vvq(vq)->notify_addr);
+    __atomic_fetch_add(&vq->kicks, 1, __ATOMIC_RELAXED);
+}
+
+static void *get_buf_split(vring_virtqueue_t *vvq, uint32_t *len) {
+    if (__atomic_load_n(&vvq->split.used->idx, __ATOMIC_ACQUIRE) == vvq->last_used)
+        return NULL;
+
+    vring_used_elem_t *e = &vvq->split.used->ring[vvq->last_used & vvq->mask];
+    uint32_t id = e->id;
+    if (id >= vvq->vq.num || !vvq->data[id]) {
+        pr_err("virtio: queue %u returned bad buffer %u\n", vvq->vq.index, id);
+        return NULL;
+    }
+    if (len) *len = e->len;
+    vvq->last_used++;
+
+    void *data = vvq->data[id];
+    unsigned int n = 1;
+    uint16_t tail = (uint16_t)id;
+    vvq->data[id] = NULL;
+    if (vvq->indir[id]) {
+        kfree(vvq->indir[id]);
+        vvq->indir[id] = NULL;
+    } else {
+        while (vvq->split.desc[tail].flags & VRING_DESC_F_NEXT) {
+            tail = vvq->split.desc[tail].next;
+            n++;
+        }
+    }
+    vvq->split.desc[tail].next = vvq->free_head;
+    vvq->free_head = (uint16_t)id;
+    vvq->vq.num_free += n;
+    return data;
+}
+
+static bool packed_used(vring_virtqueue_t *vvq, uint16_t pos, uint16_t flags) {
+    bool wrap = packed_wrap(pos, (uint16_t)vvq->vq.num);
+    return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap && !!(flags & VRING_PACKED_DESC_F_USED) == wrap;
+}
+
+static void *get_buf_packed(vring_virtqueue_t *vvq, uint32_t *len) {
+    uint16_t pos = vvq->last_used;
+    vring_packed_desc_t *d = &vvq->packed.desc[pos & vvq->mask];
+    if (!packed_used(vvq, pos, __atomic_load_n(&d->flags, __ATOMIC_ACQUIRE)))
+        return NULL;
+
+    uint16_t id = d->id;
+    if (id >= vvq->vq.num || !vvq->data[id]) {
+        pr_err("virtio: queue %u returned bad buffer %u\n", vvq->vq.index, id);
+        return NULL;
+    }
+    if (len) *len = d->len;
+
+    void *data = vvq->data[id];
+    vvq->data[id] = NULL;
+    kfree(vvq->indir[id]);
+    vvq->indir[id] = NULL;
+    vvq->last_used = (uint16_t)(pos + vvq->packed.ndescs[id]);
+    vvq->vq.num_free += vvq->packed.ndescs[id];
+    vvq->packed.next_id[id] = vvq->free_head;
+    vvq->free_head = id;
+    return data;
+}
+
+/* The next buffer the device is done with, and how much it wrote; NULL if none */
+void *virtqueue_get_buf(virtqueue_t *vq, uint32_t *len) {
+    vring_virtqueue_t *vvq = to_vvq(vq);
+    return vvq->packed_ring ? get_buf_packed(vvq, len) : get_buf_split(vvq, len);
+}
+
+static bool more_used(vring_virtqueue_t *vvq) {
+    if (vvq->packed_ring) {
+        uint16_t pos = vvq->last_used;
+        return packed_used(vvq, pos, __atomic_load_n(&vvq->packed.desc[pos & vvq->mask].flags,
+                                                     __ATOMIC_ACQUIRE));
+    }
+    return __atomic_load_n(&vvq->split.used->idx, __ATOMIC_ACQUIRE) != vvq->last_used;
+}
+
+/* A hint: the device may still interrupt once, for what it already passed */
+void virtqueue_disable_cb(virtqueue_t *vq) {
+    vring_virtqueue_t *vvq = to_vvq(vq);
+
+    if (vvq->cb_disabled) return;
+    vvq->cb_disabled = true;
+    if (vvq->packed_ring)
+        *(volatile uint16_t *)&vvq->packed.driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    else if (!vvq->event_idx)
+        *(volatile uint16_t *)&vvq->split.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    /* With event indexes a stale used_event already holds interrupts back */
+}
+
+/*
+ * Ask for an interrupt at the next completion. Returns false if some
+ * came back while interrupts were off, which the caller reaps now.
+ */
+bool virtqueue_enable_cb(virtqueue_t *vq) {
+    vring_virtqueue_t *vvq = to_vvq(vq);
+
+    vvq->cb_disabled = false;
+    if (vvq->packed_ring) {
+        volatile vring_packed_event_t *ev = vvq->packed.driver;
+        if (vvq->event_idx) {
+            ev->off_wrap = packed_event_off_wrap(vvq->last_used, (uint16_t)vq->num);
+            ev->flags = VRING_PACKED_EVENT_FLAG_DESC;
+        } else {
+            ev->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+        }
+    } else if (vvq->event_idx) {
+        *vring_used_event(vvq->split.avail, vq->num) = vvq->last_used;
+    } else {
+        *(volatile uint16_t *)&vvq->split.avail->flags = 0;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return !more_used(vvq);
+}
+
+static irqreturn_t vring_interrupt(unsigned int vector, void *dev) {
+    virtqueue_t *vq = dev;
+    (void)vector;
+    __atomic_fetch_add(&vq->interrupts, 1, __ATOMIC_RELAXED);
+    if (vq->callback) vq->callback(vq);
+    return IRQ_HANDLED;
+}
+
+static void vring_free(vring_virtqueue_t *vvq) {
+    if (!vvq) return;
+    for (unsigned int i = 0; vvq->indir && i < vvq->vq.num; i++)
+        kfree(vvq->indir[i]);
+    kfree(vvq->data);
+    kfree(vvq->indir);
+    if (vvq->packed_ring) {
+        kfree(vvq->packed.desc);
+        kfree(vvq->packed.driver);
+        kfree(vvq->packed.device);
+        kfree(vvq->packed.next_id);
+        kfree(vvq->packed.ndescs);
+    } else {
+        kfree(vvq->split.desc);
+        kfree(vvq->split.avail);
+        kfree(vvq->split.used);
+    }
+    kfree(vvq);
+}
+
+static void *kzalloc(size_t size) {
+    void *p = kmalloc(size, GFP_KERNEL);
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+static vring_virtqueue_t *vring_create(virtio_device_t *vdev, unsigned int index, uint16_t num) {
+    vring_virtqueue_t *vvq = kzalloc(sizeof(*vvq));
+    if (!vvq) return NULL;
+    vvq->vq.vdev = vdev;
+    vvq->vq.index = index;
+    vvq->vq.num = num;
+    vvq->vq.num_free = num;
+    vvq->mask = (uint16_t)(num - 1);
+    vvq->packed_ring = virtio_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    vvq->indirect = virtio_has_feature(vdev, VIRTIO_F_RING_INDIRECT_DESC);
+    vvq->event_idx = virtio_has_feature(vdev, VIRTIO_F_RING_EVENT_IDX);
+    vvq->data = kzalloc(num * sizeof(void *));
+    vvq->indir = kzalloc(num * sizeof(void *));
+
+    bool ok = vvq->data && vvq->indir;
+    if (vvq->packed_ring) {
+        vvq->packed.desc = kzalloc(num * sizeof(vring_packed_desc_t));
+        vvq->packed.driver = kzalloc(sizeof(vring_packed_event_t));
+        vvq->packed.device = kzalloc(sizeof(vring_packed_event_t));
+        vvq->packed.next_id = kmalloc(num * sizeof(uint16_t), GFP_KERNEL);
+        vvq->packed.ndescs = kzalloc(num * sizeof(uint16_t));
+        ok = ok && vvq->packed.desc && vvq->packed.driver && vvq->packed.device &&
+             vvq->packed.next_id && vvq->packed.ndescs;
+        for (unsigned int i = 0; ok && i < num; i++)
+            vvq->packed.next_id[i] = (uint16_t)(i + 1);
+    } else {
+        vvq->split.desc = kzalloc(num * sizeof(vring_desc_t));
+        vvq->split.avail = kzalloc(sizeof(vring_avail_t) + (num + 1) * sizeof(uint16_t));
+        vvq->split.used = kzalloc(sizeof(vring_used_t) + num * sizeof(vring_used_elem_t) + sizeof(uint16_t));
+        ok = ok && vvq->split.desc && vvq->split.avail && vvq->split.used;
+        for (unsigned int i = 0; ok && i < num; i++)
+            vvq->split.desc[i].next = (uint16_t)(i + 1);
+    }
+    if (!ok) {
+        vring_free(vvq);
+        return NULL;
+    }
+    return vvq;
+}
+
+/* ============================================================================
+ * PCI transport
+ * ============================================================================ */
+
+static inline volatile void *common_reg(virtio_device_t *vdev, unsigned int off) {
+    return vdev->common + off;
+}
+
+static uint8_t vp_get_status(virtio_device_t *vdev) {
+    return ioread8(common_reg(vdev, VIRTIO_PCI_COMMON_STATUS));
+}
+
+static void vp_set_status(virtio_device_t *vdev, uint8_t status) {
+    iowrite8(status, common_reg(vdev, VIRTIO_PCI_COMMON_STATUS));
+}
+
+static void vp_iowrite64(uint64_t val, volatile uint8_t *lo) {
+    iowrite32((uint32_t)val, lo);
+    iowrite32((uint32_t)(val >> 32), lo + 4);
+}
+
+/* Zero the status and wait for the device to agree: it has let go of every ring */
+static void vp_reset(virtio_device_t *vdev) {
+    vp_set_status(vdev, 0);
+    while (vp_get_status(vdev))
+        cpu_relax();
+}
+
+/*
+ * Find the transport's structures behind pci's vendor capabilities,
+ * reset the device and acknowledge it. The first capability of each
+ * type the driver can map wins.
+ */
+int virtio_pci_probe(virtio_device_t *vdev, pci_dev_t *pci) {
+    memset(vdev, 0, sizeof(*vdev));
+    vdev->pci = pci;
+    int ret = pci_enable_device(pci);
+    if (ret < 0) return ret;
+
+    unsigned int pos = pci_find_capability(pci, PCI_CAP_ID_VNDR);
+    for (int ttl = 48; pos >= 0x40 && ttl; ttl--) {
+        uint8_t id, next, type, bar;
+        uint32_t off, len;
+        pci_read_config_byte(pci, pos, &id);
+        pci_read_config_byte(pci, pos + VIRTIO_PCI_CAP_NEXT, &next);
+        if (id == PCI_CAP_ID_VNDR) {
+            pci_read_config_byte(pci, pos + VIRTIO_PCI_CAP_CFG_TYPE, &type);
+            pci_read_config_byte(pci, pos + VIRTIO_PCI_CAP_BAR, &bar);
+            pci_read_config_dword(pci, pos + VIRTIO_PCI_CAP_OFFSET, &off);
+            pci_read_config_dword(pci, pos + VIRTIO_PCI_CAP_LENGTH, &len);
+            uint8_t *base = bar < PCI_NUM_BARS ? pci_iomap(pci, bar) : NULL;
+            if (base && (uint64_t)off + len <= pci->bar[bar].size) {
+                switch (type) {
+                case VIRTIO_PCI_CAP_COMMON_CFG:
+                    if (!vdev->common && len >= VIRTIO_PCI_COMMON_SIZE) vdev->common = base + off;
+                    break;
+                case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                    if (!vdev->notify) {
+                        vdev->notify = base + off;
+                        pci_read_config_dword(pci, pos + VIRTIO_PCI_NOTIFY_CAP_MULT, &vdev->notify_mult);
+                    }
+                    break;
+                case VIRTIO_PCI_CAP_ISR_CFG:
+                    if (!vdev->isr) vdev->isr = base + off;
+                    break;
+                case VIRTIO_PCI_CAP_DEVICE_CFG:
+                    if (!vdev->config) vdev->config = base + off;
+                    break;
+                }
+            }
+        }
+        pos = next & ~3U;
+    }
+    if (!vdev->common || !vdev->notify) return -ENODEV;
+
+    vp_reset(vdev);
+    vp_set_status(vdev, VIRTIO_CONFIG_S_ACKNOWLEDGE);
+    vp_set_status(vdev, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+    return 0;
+}
+
+/* Accept the features in wanted that the device offers; 1.x devices only */
+int virtio_negotiate_features(virtio_device_t *vdev, uint64_t wanted) {
+    uint64_t offered = 0;
+    for (unsigned int i = 0; i < 2; i++) {
+        iowrite32(i, common_reg(vdev, VIRTIO_PCI_COMMON_DFSELECT));
+        offered |= (uint64_t)ioread32(common_reg(vdev, VIRTIO_PCI_COMMON_DF)) << (32 * i);
+    }
+    if (!(offered & VIRTIO_F(VIRTIO_F_VERSION_1))) {
+        vp_set_status(vdev, vp_get_status(vdev) | VIRTIO_CONFIG_S_FAILED);
+        return -ENODEV;
+    }
+
+    vdev->features = (offered & wanted) | VIRTIO_F(VIRTIO_F_VERSION_1);
+    for (unsigned int i = 0; i < 2; i++) {
+        iowrite32(i, common_reg(vdev, VIRTIO_PCI_COMMON_GFSELECT));
+        iowrite32((uint32_t)(vdev->features >> (32 * i)), common_reg(vdev, VIRTIO_PCI_COMMON_GF));
+    }
+    vp_set_status(vdev, vp_get_status(vdev) | VIRTIO_CONFIG_S_FEATURES_OK);
+    if (!(vp_get_status(vdev) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        vp_set_status(vdev, vp_get_status(vdev) | VIRTIO_CONFIG_S_FAILED);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+uint8_t virtio_cread8(virtio_device_t *vdev, unsigned int off) {
+    return vdev->config ? ioread8(vdev->config + off) : 0;
+}
+
+uint16_t virtio_cread16(virtio_device_t *vdev, unsigned int off) {
+    return vdev->config ? ioread16(vdev->config + off) : 0;
+}
+
+uint32_t virtio_cread32(virtio_device_t *vdev, unsigned int off) {
+    return vdev->config ? ioread32(vdev->config + off) : 0;
+}
+
+/* Two reads; the generation counter says whether the device changed it in between */
+uint64_t virtio_cread64(virtio_device_t *vdev, unsigned int off) {
+    uint8_t gen;
+    uint64_t val;
+
+    if (!vdev->config) return 0;
+    do {
+        gen = ioread8(common_reg(vdev, VIRTIO_PCI_COMMON_CFGGEN));
+        val = ioread32(vdev->config + off) | (uint64_t)ioread32(vdev->config + off + 4) << 32;
+    } while (gen != ioread8(common_reg(vdev, VIRTIO_PCI_COMMON_CFGGEN)));
+    return val;
+}
+
+static void virtio_del_vqs(virtio_device_t *vdev) {
+    for (unsigned int i = 0; i < vdev->nvqs; i++) {
+        int vector = pci_irq_vector(vdev->pci, i);
+        if (vector >= 0) free_irq((unsigned int)vector, vdev->vqs[i]);
+        vring_free(to_vvq(vdev->vqs[i]));
+    }
+    pci_free_irq_vectors(vdev->pci);
+    kfree(vdev->vqs);
+    vdev->vqs = NULL;
+    vdev->nvqs = 0;
+}
+
+static int setup_vq(virtio_device_t *vdev, unsigned int index, unsigned int max_size,
+                    void (*callback)(virtqueue_t *vq)) {
+    iowrite16((uint16_t)index, common_reg(vdev, VIRTIO_PCI_COMMON_Q_SELECT));
+    unsigned int num = ioread16(common_reg(vdev, VIRTIO_PCI_COMMON_Q_SIZE));
+    if (!num || ioread16(common_reg(vdev, VIRTIO_PCI_COMMON_Q_ENABLE))) return -ENOENT;
+    if (num > max_size) num = max_size;
+    if (num > VIRTQUEUE_MAX_SIZE) num = VIRTQUEUE_MAX_SIZE;
+    num = 1U << (31 - __builtin_clz(num));
+
+    vring_virtqueue_t *vvq = vring_create(vdev, index, (uint16_t)num);
+    if (!vvq) return -ENOMEM;
+    vvq->vq.callback = callback;
+    vvq->vq.cpu = vdev->pci->irqs[index].cpu;
+    vdev->vqs[index] = &vvq->vq;
+    vdev->nvqs = index + 1;
+
+    iowrite16((uint16_t)num, common_reg(vdev, VIRTIO_PCI_COMMON_Q_SIZE));
+    if (vvq->packed_ring) {
+        vp_iowrite64(vring_addr(vvq->packed.desc), common_reg(vdev, VIRTIO_PCI_COMMON_Q_DESCLO));
+        vp_iowrite64(vring_addr(vvq->packed.driver), common_reg(vdev, VIRTIO_PCI_COMMON_Q_AVAILLO));
+        vp_iowrite64(vring_addr(vvq->packed.device), common_reg(vdev, VIRTIO_PCI_COMMON_Q_USEDLO));
+    } else {
+        vp_iowrite64(vring_addr(vvq->split.desc), common_reg(vdev, VIRTIO_PCI_COMMON_Q_DESCLO));
+        vp_iowrite64(vring_addr(vvq->split.avail), common_reg(vdev, VIRTIO_PCI_COMMON_Q_AVAILLO));
+        vp_iowrite64(vring_addr(vvq->split.used), common_reg(vdev, VIRTIO_PCI_COMMON_Q_USEDLO));
+    }
+    iowrite16((uint16_t)index, common_reg(vdev, VIRTIO_PCI_COMMON_Q_MSIX));
+    if (ioread16(common_reg(vdev, VIRTIO_PCI_COMMON_Q_MSIX)) == VIRTIO_MSI_NO_VECTOR)
+        return -EBUSY;
+    uint16_t off = ioread16(common_reg(vdev, VIRTIO_PCI_COMMON_Q_NOFF));
+    vvq->notify_addr = vdev->notify + (size_t)off * vdev->notify_mult;
+
+    int ret = request_irq((unsigned int)pci_irq_vector(vdev->pci, index), vring_interrupt, "virtio", &vvq->vq);
+    if (ret < 0) return ret;
+    iowrite16(1, common_reg(vdev, VIRTIO_PCI_COMMON_Q_ENABLE));
+    return 0;
+}
+
+/*
+ * Set up nvqs queues of at most max_size slots, each with an MSI-X
+ * vector aimed at the CPU of its number; callback runs from a queue's
+ * interrupt. The device has no configuration-change vector.
+ */
+int virtio_find_vqs(virtio_device_t *vdev, unsigned int nvqs, unsigned int max_size,
+                    void (*callback)(virtqueue_t *vq)) {
+    if (!nvqs || nvqs > ioread16(common_reg(vdev, VIRTIO_PCI_COMMON_NUMQ))) return -EINVAL;
+    vdev->vqs = kzalloc(nvqs * sizeof(*vdev->vqs));
+    if (!vdev->vqs) return -ENOMEM;
+
+    int ret = pci_alloc_irq_vectors(vdev->pci, nvqs, nvqs, PCI_IRQ_AFFINITY);
+    if (ret < 0) {
+        kfree(vdev->vqs);
+        vdev->vqs = NULL;
+        return ret;
+    }
+    iowrite16(VIRTIO_MSI_NO_VECTOR, common_reg(vdev, VIRTIO_PCI_COMMON_MSIX));
+    for (unsigned int i = 0; i < nvqs; i++) {
+        ret = setup_vq(vdev, i, max_size, callback);
+        if (ret < 0) {
+            vp_reset(vdev);
+            virtio_del_vqs(vdev);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+void virtio_device_ready(virtio_device_t *vdev) {
+    vp_set_status(vdev, vp_get_status(vdev) | VIRTIO_CONFIG_S_DRIVER_OK);
+}
+
+void virtio_reset_device(virtio_device_t *vdev) {
+    vp_reset(vdev);
+    if (vdev->vqs) virtio_del_vqs(vdev);
+}
+
+/* ============================================================================
+ * Device side (hosted models)
+ * ============================================================================ */
+
+#ifdef __unix__
+/* Where a model's function keeps things: MSI-X in BAR 0, the rest in BAR 4 */
+#define VM_MSIX_BAR         0
+#define VM_MSIX_BAR_SIZE    0x1000
+#define VM_MSIX_PBA         0x800
+#define VM_BAR              4
+#define VM_BAR_SIZE         0x4000
+#define VM_COMMON_OFF       0x0000
+#define VM_ISR_OFF          0x1000
+#define VM_DEVICE_OFF       0x2000
+#define VM_NOTIFY_OFF       0x3000
+#define VM_NOTIFY_MULT      4
+
+typedef struct {
+    uint16_t size, msix_vector, enable;
+    uint64_t desc, driver, device;  /* As the driver wrote them */
+    bool packed, event_idx;
+    uint16_t last_avail;            /* Free-running: next avail index, or packed descriptor */
+    uint16_t used;                  /* Free-running: next used index, or packed descriptor */
+    uint16_t signalled;             /* used at the last vring_flush() */
+} vring_dev_t;
+
+struct virtio_model_state {
+    pci_dev_t *pci;
+    int devfn;
+    uint8_t *bar;                   /* Trapped while attached */
+    uint32_t dfselect, gfselect;
+    uint64_t driver_features;
+    uint16_t msix_config, queue_select;
+    uint8_t status, generation;
+    vring_dev_t vqs[];
+};
+
+static unsigned int g_virtio_models;     /* Functions ever added; spreads their BARs */
+
+static void vm_reset(virtio_model_t *m) {
+    struct virtio_model_state *s = m->state;
+
+    s->dfselect = s->gfselect = 0;
+    s->driver_features = 0;
+    s->msix_config = VIRTIO_MSI_NO_VECTOR;
+    s->queue_select = 0;
+    s->status = 0;
+    for (unsigned int i = 0; i < m->nvqs; i++) {
+        memset(&s->vqs[i], 0, sizeof(s->vqs[i]));
+        s->vqs[i].size = m->queue_size;
+        s->vqs[i].msix_vector = VIRTIO_MSI_NO_VECTOR;
+    }
+}
+
+static void vm_set_status(virtio_model_t *m, uint8_t status) {
+    struct virtio_model_state *s = m->state;
+
+    if (!status) {
+        if (m->set_status) m->set_status(m, 0);
+        vm_reset(m);
+        return;
+    }
+    /* FEATURES_OK sticks only for a subset of what was offered */
+    if ((status & VIRTIO_CONFIG_S_FEATURES_OK) && !(s->status & VIRTIO_CONFIG_S_FEATURES_OK) &&
+        ((s->driver_features & ~m->features) || !(s->driver_features & VIRTIO_F(VIRTIO_F_VERSION_1))))
+        status &= (uint8_t)~VIRTIO_CONFIG_S_FEATURES_OK;
+    bool ready = (status & VIRTIO_CONFIG_S_DRIVER_OK) && !(s->status & VIRTIO_CONFIG_S_DRIVER_OK);
+    s->status = status;
+    if (ready && m->set_status) m->set_status(m, status);
+}
+
+static void vm_queue_enable(virtio_model_t *m, vring_dev_t *vr) {
+    struct virtio_model_state *s = m->state;
+
+    vr->packed = s->driver_features & VIRTIO_F(VIRTIO_F_RING_PACKED);
+    vr->event_idx = s->driver_features & VIRTIO_F(VIRTIO_F_RING_EVENT_IDX);
+    vr->last_avail = vr->used = vr->signalled = 0;
+    __atomic_store_n(&vr->enable, 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t vm_common_read(virtio_model_t *m, size_t off) {
+    struct virtio_model_state *s = m->state;
+    vring_dev_t *vr = s->queue_select < m->nvqs ? &s->vqs[s->queue_select] : NULL;
+
+    switch (off) {
+    case VIRTIO_PCI_COMMON_DFSELECT: return s->dfselect;
+    case VIRTIO_PCI_COMMON_DF: return s->dfselect < 2 ? (uint32_t)(m->features >> (32 * s->dfselect)) : 0;
+    case VIRTIO_PCI_COMMON_GFSELECT: return s->gfselect;
+    case VIRTIO_PCI_COMMON_GF:
+        return s->gfselect < 2 ? (uint32_t)(s->driver_features >> (32 * s->gfselect)) : 0;
+    case VIRTIO_PCI_COMMON_MSIX: return s->msix_config;
+    case VIRTIO_PCI_COMMON_NUMQ: return m->nvqs;
+    case VIRTIO_PCI_COMMON_STATUS: return s->status;
+    case VIRTIO_PCI_COMMON_CFGGEN: return s->generation;
+    case VIRTIO_PCI_COMMON_Q_SELECT: return s->queue_select;
+    }
+    if (!vr) return 0;
+    switch (off) {
+    case VIRTIO_PCI_COMMON_Q_SIZE: return vr->size;
+    case VIRTIO_PCI_COMMON_Q_MSIX: return vr->msix_vector;
+    case VIRTIO_PCI_COMMON_Q_ENABLE: return vr->enable;
+    case VIRTIO_PCI_COMMON_Q_NOFF: return s->queue_select;
+    case VIRTIO_PCI_COMMON_Q_DESCLO: return (uint32_t)vr->desc;
+    case VIRTIO_PCI_COMMON_Q_DESCHI: return (uint32_t)(vr->desc >> 32);
+    case VIRTIO_PCI_COMMON_Q_AVAILLO: return (uint32_t)vr->driver;
+    case VIRTIO_PCI_COMMON_Q_AVAILHI: return (uint32_t)(vr->driver >> 32);
+    case VIRTIO_PCI_COMMON_Q_USEDLO: return (uint32_t)vr->device;
+    case VIRTIO_PCI_COMMON_Q_USEDHI: return (uint32_t)(vr->device >> 32);
+    }
+    return 0;
+}
+
+static void set_half(uint64_t *reg, bool high, uint32_t val) {
+    *reg = high ? (*reg & 0xffffffffULL) | (uint64_t)val << 32 : (*reg & ~0xffffffffULL) | val;
+}
+
+static void vm_common_write(virtio_model_t *m, size_t off, uint32_t val) {
+    struct virtio_model_state *s = m->state;
+    vring_dev_t *vr = s->queue_select < m->nvqs ? &s->vqs[s->queue_select] : NULL;
+
+    switch (off) {
+    case VIRTIO_PCI_COMMON_DFSELECT: s->dfselect = val; return;
+    case VIRTIO_PCI_COMMON_GFSELECT: s->gfselect = val; return;
+    case VIRTIO_PCI_COMMON_GF:
+        if (s->gfselect < 2 && !(s->status & VIRTIO_CONFIG_S_FEATURES_OK))
+            set_half(&s->driver_features, s->gfselect, val);
+        return;
+    case VIRTIO_PCI_COMMON_MSIX: s->msix_config = (uint16_t)val; return;
+    case VIRTIO_PCI_COMMON_STATUS: vm_set_status(m, (uint8_t)val); return;
+    case VIRTIO_PCI_COMMON_Q_SELECT: s->queue_select = (uint16_t)val; return;
+    }
+    if (!vr || (vr->enable && off != VIRTIO_PCI_COMMON_Q_MSIX)) return;
+    switch (off) {
+    case VIRTIO_PCI_COMMON_Q_SIZE:
+        if (val && val <= m->queue_size && !(val & (val - 1))) vr->size = (uint16_t)val;
+        break;
+    case VIRTIO_PCI_COMMON_Q_MSIX: vr->msix_vector = (uint16_t)val; break;
+    case VIRTIO_PCI_COMMON_Q_ENABLE: if (val == 1) vm_queue_enable(m, vr); break;
+    case VIRTIO_PCI_COMMON_Q_DESCLO: case VIRTIO_PCI_COMMON_Q_DESCHI:
+        set_half(&vr->desc, off == VIRTIO_PCI_COMMON_Q_DESCHI, val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_AVAILLO: case VIRTIO_PCI_COMMON_Q_AVAILHI:
+        set_half(&vr->driver, off == VIRTIO_PCI_COMMON_Q_AVAILHI, val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_USEDLO: case VIRTIO_PCI_COMMON_Q_USEDHI:
+        set_half(&vr->device, off == VIRTIO_PCI_COMMON_Q_USEDHI, val);
+        break;
+    }
+}
+
+static uint32_t vm_read(void *opaque, size_t off, unsigned int size) {
+    virtio_model_t *m = opaque;
+
+    if (off < VM_COMMON_OFF + VIRTIO_PCI_COMMON_SIZE)
+        return vm_common_read(m, off - VM_COMMON_OFF);
+    if (off >= VM_DEVICE_OFF && off - VM_DEVICE_OFF + size <= m->config_len) {
+        uint32_t val = 0;
+        memcpy(&val, (const uint8_t *)m->config + (off - VM_DEVICE_OFF), size);
+        return val;
+    }
+    return 0;                       /* ISR: interrupts are MSI-X only */
+}
+
+static void vm_write(void *opaque, size_t off, uint32_t val, unsigned int size) {
+    virtio_model_t *m = opaque;
+    (void)size;
+
+    if (off < VM_COMMON_OFF + VIRTIO_PCI_COMMON_SIZE) {
+        vm_common_write(m, off - VM_COMMON_OFF, val);
+    } else if (off >= VM_NOTIFY_OFF && off < VM_NOTIFY_OFF + VM_NOTIFY_MULT * m->nvqs) {
+        /* The doorbell: what a hypervisor turns into an eventfd signal */
+        if (val < m->nvqs && m->state->vqs[val].enable && m->notify)
+            m->notify(m, val);
+    }
+}
+
+static const iomem_ops_t vm_ops = {
+    .read = vm_read,
+    .write = vm_write,
+};
+
+static void put_cap(uint8_t *cfg, unsigned int pos, unsigned int next, uint8_t type,
+                    uint32_t off, uint32_t len, unsigned int caplen) {
+    cfg[pos] = PCI_CAP_ID_VNDR;
+    cfg[pos + VIRTIO_PCI_CAP_NEXT] = (uint8_t)next;
+    cfg[pos + VIRTIO_PCI_CAP_LEN] = (uint8_t)caplen;
+    cfg[pos + VIRTIO_PCI_CAP_CFG_TYPE] = type;
+    cfg[pos + VIRTIO_PCI_CAP_BAR] = VM_BAR;
+    memcpy(cfg + pos + VIRTIO_PCI_CAP_OFFSET, &off, 4);
+    memcpy(cfg + pos + VIRTIO_PCI_CAP_LENGTH, &len, 4);
+}
+
+/* Put m's function on bus 0: MSI-X, then the four virtio structures */
+int virtio_model_add(virtio_model_t *m) {
+    if (!m->nvqs || !m->queue_size || (m->queue_size & (m->queue_size - 1)) ||
+        m->queue_size > VIRTQUEUE_MAX_SIZE || m->config_len > VM_NOTIFY_OFF - VM_DEVICE_OFF)
+        return -EINVAL;
+    if ((m->nvqs + 1) * 16 > VM_MSIX_PBA) return -EINVAL;
+
+    uint8_t cfg[256] = { 0 };
+    uint16_t w;
+    uint32_t d;
+    unsigned int n = g_virtio_models++;
+
+    w = VIRTIO_PCI_VENDOR_ID; memcpy(cfg + 0x00, &w, 2);
+    w = (uint16_t)VIRTIO_PCI_DEVICE_ID(m->device_type); memcpy(cfg + 0x02, &w, 2);
+    w = 0x0010; memcpy(cfg + 0x06, &w, 2);                  /* Capability list */
+    d = (m->device_type == VIRTIO_ID_BLOCK ? 0x018000U : 0xff0000U) << 8 | 1;
+    memcpy(cfg + 0x08, &d, 4);
+    d = 0xfe800000U + (2 * n + 1) * VM_MSIX_BAR_SIZE;        /* BAR 0, an odd multiple of its size */
+    memcpy(cfg + 0x10 + 4 * VM_MSIX_BAR, &d, 4);
+    uint64_t q = 0xe000000000ULL + (2ULL * n + 1) * VM_BAR_SIZE;
+    d = (uint32_t)q | 0x4; memcpy(cfg + 0x10 + 4 * VM_BAR, &d, 4);    /* 64-bit */
+    d = (uint32_t)(q >> 32); memcpy(cfg + 0x14 + 4 * VM_BAR, &d, 4);
+    w = VIRTIO_PCI_VENDOR_ID; memcpy(cfg + 0x2c, &w, 2);
+    w = m->device_type; memcpy(cfg + 0x2e, &w, 2);
+    cfg[0x34] = 0x40;
+
+    /* MSI-X: a vector per queue and one for configuration changes */
+    cfg[0x40] = PCI_CAP_ID_MSIX;
+    cfg[0x41] = 0x4c;
+    w = (uint16_t)m->nvqs; memcpy(cfg + 0x42, &w, 2);
+    d = VM_MSIX_BAR; memcpy(cfg + 0x44, &d, 4);
+    d = VM_MSIX_PBA | VM_MSIX_BAR; memcpy(cfg + 0x48, &d, 4);
+
+    put_cap(cfg, 0x4c, 0x5c, VIRTIO_PCI_CAP_COMMON_CFG, VM_COMMON_OFF, VIRTIO_PCI_COMMON_SIZE, 16);
+    put_cap(cfg, 0x5c, 0x70, VIRTIO_PCI_CAP_NOTIFY_CFG, VM_NOTIFY_OFF, VM_NOTIFY_MULT * m->nvqs, 20);
+    d = VM_NOTIFY_MULT; memcpy(cfg + 0x5c + VIRTIO_PCI_NOTIFY_CAP_MULT, &d, 4);
+    put_cap(cfg, 0x70, 0x80, VIRTIO_PCI_CAP_ISR_CFG, VM_ISR_OFF, 4, 16);
+    put_cap(cfg, 0x80, 0, VIRTIO_PCI_CAP_DEVICE_CFG, VM_DEVICE_OFF, (uint32_t)m->config_len, 16);
+
+    struct virtio_model_state *s = calloc(1, sizeof(*s) + m->nvqs * sizeof(vring_dev_t));
+    if (!s) return -ENOMEM;
+    int devfn = pci_emulate_function(cfg, sizeof(cfg));
+    if (devfn < 0) {
+        free(s);
+        return devfn;
+    }
+    s->devfn = devfn;
+    m->state = s;
+    vm_reset(m);
+    return 0;
+}
+
+/* Once a scan has found m's function: trap the registers the driver will map */
+int virtio_model_attach(virtio_model_t *m) {
+    struct virtio_model_state *s = m->state;
+    pci_dev_t *pci = NULL;
+
+    if (!s) return -EINVAL;
+    if (s->bar) return 0;
+    while ((pci = pci_get_device(VIRTIO_PCI_VENDOR_ID, PCI_ANY_ID, pci)) != NULL)
+        if (pci->bus == 0 && pci->devfn == s->devfn) break;
+    if (!pci) return -ENODEV;
+
+    uint8_t *bar = pci_iomap(pci, VM_BAR);
+    if (!bar || !pci_iomap(pci, VM_MSIX_BAR)) return -ENOMEM;
+    int ret = iomem_emulate(bar, VM_BAR_SIZE, &vm_ops, m);
+    if (ret < 0) return ret;
+    s->pci = pci;
+    s->bar = bar;
+    return 0;
+}
+
+/* Reset the device and take its function off the bus; rescan afterwards */
+void virtio_model_remove(virtio_model_t *m) {
+    struct virtio_model_state *s = m->state;
+    if (!s) return;
+    vm_set_status(m, 0);
+    if (s->bar) iomem_unemulate(s->bar);
+    pci_remove_emulated_function((unsigned int)s->devfn);
+    free(s);
+    m->state = NULL;
+}
+
+uint64_t virtio_model_features(virtio_model_t *m) {
+    return m->state->driver_features;
+}
+
+bool virtio_model_queue_ready(virtio_model_t *m, unsigned int q) {
+    return q < m->nvqs && __atomic_load_n(&m->state->vqs[q].enable, __ATOMIC_ACQUIRE);
+}
+
+static bool pop_split(vring_dev_t *vr, vring_elem_t *elem) {
+    vring_avail_t *avail = vring_ptr(vr->driver);
+    if (__atomic_load_n(&avail->idx, __ATOMIC_ACQUIRE) == vr->last_avail) return false;
+
+    uint16_t head = avail->ring[vr->last_avail & (vr->size - 1)];
+    vr->last_avail++;
+    elem->id = head;
+    elem->ndescs = 1;
+    elem->out = elem->in = 0;
+    if (head >= vr->size) return true;
+
+    const vring_desc_t *table = vring_ptr(vr->desc);
+    unsigned int max = vr->size, i = head;
+    if (table[head].flags & VRING_DESC_F_INDIRECT) {
+        max = table[head].len / sizeof(vring_desc_t);
+        table = vring_ptr(table[head].addr);
+        i = 0;
+    }
+    unsigned int out = 0, in = 0;
+    for (unsigned int n = 0;; n++) {
+        if (i >= max || n >= max || n >= VRING_ELEM_MAX_SG) return true;
+        const vring_desc_t *d = &table[i];
+        if (d->flags & VRING_DESC_F_WRITE) in++;
+        else if (in) return true;
+        else out++;
+        elem->sg[n].addr = vring_ptr(d->addr);
+        elem->sg[n].len = d->len;
+        if (!(d->flags & VRING_DESC_F_NEXT)) break;
+        i = d->next;
+    }
+    elem->out = out;
+    elem->in = in;
+    return true;
+}
+
+static bool pop_packed(vring_dev_t *vr, vring_elem_t *elem) {
+    vring_packed_desc_t *ring = vring_ptr(vr->desc);
+    uint16_t pos = vr->last_avail, mask = (uint16_t)(vr->size - 1);
+    uint16_t flags = __atomic_load_n(&ring[pos & mask].flags, __ATOMIC_ACQUIRE);
+    bool wrap = packed_wrap(pos, vr->size);
+    if (!!(flags & VRING_PACKED_DESC_F_AVAIL) != wrap || !!(flags & VRING_PACKED_DESC_F_USED) == wrap)
+        return false;
+
+    unsigned int out = 0, in = 0, n = 0, ndescs = 0;
+    bool bad = false;
+    for (;;) {
+        const vring_packed_desc_t *d = &ring[(pos + ndescs) & mask];
+        uint16_t f = ndescs ? d->flags : flags;
+        ndescs++;
+        elem->id = d->id;
+        if (f & VRING_DESC_F_INDIRECT) {
+            const vring_packed_desc_t *table = vring_ptr(d->addr);
+            unsigned int cnt = d->len / sizeof(*table);
+            for (unsigned int t = 0; t < cnt && !bad; t++) {
+                if (n >= VRING_ELEM_MAX_SG) bad = true;
+                else if (table[t].flags & VRING_DESC_F_WRITE) in++;
+                else if (in) bad = true;
+                else out++;
+                if (!bad) {
+                    elem->sg[n].addr = vring_ptr(table[t].addr);
+                    elem->sg[n++].len = table[t].len;
+                }
+            }
+        } else if (!bad) {
+            if (n >= VRING_ELEM_MAX_SG) bad = true;
+            else if (f & VRING_DESC_F_WRITE) in++;
+            else if (in) bad = true;
+            else out++;
+            if (!bad) {
+                elem->sg[n].addr = vring_ptr(d->addr);
+                elem->sg[n++].len = d->len;
+            }
+        }
+        if (!(f & VRING_DESC_F_NEXT) || ndescs >= vr->size) break;
+    }
+    vr->last_avail = (uint16_t)(pos + ndescs);
+    elem->ndescs = (uint16_t)ndescs;
+    elem->out = bad ? 0 : out;
+    elem->in = bad ? 0 : in;
+    return true;
+}
+
+/* Take the next available buffer off queue q; false if there is none */
+bool vring_pop(virtio_model_t *m, unsigned int q, vring_elem_t *elem) {
+    vring_dev_t *vr = &m->state->vqs[q];
+    if (!virtio_model_queue_ready(m, q)) return false;
+    return vr->packed ? pop_packed(vr, elem) : pop_split(vr, elem);
+}
+
+/* Hand elem back having written len bytes; the driver sees it at vring_flush() */
+void vring_push(virtio_model_t *m, unsigned int q, const vring_elem_t *elem, uint32_t len) {
+    vring_dev_t *vr = &m->state->vqs[q];
+
+    if (vr->packed) {
+        vring_packed_desc_t *d = &((vring_packed_desc_t *)vring_ptr(vr->desc))[vr->used & (vr->size - 1)];
+        d->id = elem->id;
+        d->len = len;
+        __atomic_store_n(&d->flags, packed_wrap(vr->used, vr->size) ?
+                         VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0, __ATOMIC_RELEASE);
+        vr->used = (uint16_t)(vr->used + elem->ndescs);
+        return;
+    }
+    vring_used_t *used = vring_ptr(vr->device);
+    used->ring[vr->used & (vr->size - 1)].id = elem->id;
+    used->ring[vr->used & (vr->size - 1)].len = len;
+    vr->used++;
+}
+
+/* Publish what was pushed, and interrupt if it crossed what the driver asked for */
+void vring_flush(virtio_model_t *m, unsigned int q) {
+    struct virtio_model_state *s = m->state;
+    vring_dev_t *vr = &s->vqs[q];
+    uint16_t old = vr->signalled, new_idx = vr->used;
+    bool need;
+
+    if (old == new_idx) return;
+    if (!vr->packed)
+        __atomic_store_n(&((vring_used_t *)vring_ptr(vr->device))->idx, new_idx, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    vr->signalled = new_idx;
+
+    if (vr->packed) {
+        vring_packed_event_t ev = *(volatile vring_packed_event_t *)vring_ptr(vr->driver);
+        if (ev.flags == VRING_PACKED_EVENT_FLAG_DESC && vr->event_idx)
+            need = packed_need_event(ev.off_wrap, new_idx, old, vr->size);
+        else
+            need = ev.flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else {
+        vring_avail_t *avail = vring_ptr(vr->driver);
+        if (vr->event_idx)
+            need = vring_need_event(*vring_used_event(avail, vr->size), new_idx, old);
+        else
+            need = !(*(volatile uint16_t *)&avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+    if (need && vr->msix_vector != VIRTIO_MSI_NO_VECTOR && s->pci)
+        pci_msix_signal(s->pci, vr->msix_vector);
+}
+
+/*
+ * Ask for a kick at the next buffer, before the model sleeps. Returns
+ * true if one arrived meanwhile, which the model takes now instead.
+ */
+bool vring_enable_notify(virtio_model_t *m, unsigned int q) {
+    vring_dev_t *vr = &m->state->vqs[q];
+
+    if (vr->packed) {
+        volatile vring_packed_event_t *ev = vring_ptr(vr->device);
+        if (vr->event_idx) {
+            ev->off_wrap = packed_event_off_wrap(vr->last_avail, vr->size);
+            ev->flags = VRING_PACKED_EVENT_FLAG_DESC;
+        } else {
+            ev->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        vring_packed_desc_t *d = &((vring_packed_desc_t *)vring_ptr(vr->desc))[vr->last_avail & (vr->size - 1)];
+        uint16_t flags = __atomic_load_n(&d->flags, __ATOMIC_ACQUIRE);
+        bool wrap = packed_wrap(vr->last_avail, vr->size);
+        return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap && !!(flags & VRING_PACKED_DESC_F_USED) != wrap;
+    }
+
+    vring_used_t *used = vring_ptr(vr->device);
+    if (vr->event_idx)
+        *vring_avail_event(used, vr->size) = vr->last_avail;
+    else
+        *(volatile uint16_t *)&used->flags = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&((vring_avail_t *)vring_ptr(vr->driver))->idx, __ATOMIC_ACQUIRE) != vr->last_avail;
+}
+
+/* While the model works the queue; with event indexes the stale avail event does it */
+void vring_disable_notify(virtio_model_t *m, unsigned int q) {
+    vring_dev_t *vr = &m->state->vqs[q];
+
+    if (vr->packed)
+        *(volatile uint16_t *)&((vring_packed_event_t *)vring_ptr(vr->device))->flags =
+            VRING_PACKED_EVENT_FLAG_DISABLE;
+    else if (!vr->event_idx)
+        *(volatile uint16_t *)&((vring_used_t *)vring_ptr(vr->device))->flags = VRING_USED_F_NO_NOTIFY;
+}
+#else
+int virtio_model_add(virtio_model_t *m) {
+    (void)m;
+    return -ENODEV;
+}
+
+int virtio_model_attach(virtio_model_t *m) {
+    (void)m;
+    return -ENODEV;
+}
+
+void virtio_model_remove(virtio_model_t *m) {
+    (void)m;
+}
+
+uint64_t virtio_model_features(virtio_model_t *m) {
+    (void)m;
+    return 0;
+}
+
+bool virtio_model_queue_ready(virtio_model_t *m, unsigned int q) {
+    (void)m;
+    (void)q;
+    return false;
+}
+
+bool vring_pop(virtio_model_t *m, unsigned int q, vring_elem_t *elem) {
+    (void)m; (void)q; (void)elem;
+    return false;
+}
+
+void vring_push(virtio_model_t *m, unsigned int q, const vring_elem_t *elem, uint32_t len) {
+    (void)m; (void)q; (void)elem; (void)len;
+}
+
+void vring_flush(virtio_model_t *m, unsigned int q) {
+    (void)m; (void)q;
+}
+
+bool vring_enable_notify(virtio_model_t *m, unsigned int q) {
+    (void)m; (void)q;
+    return false;
+}
+
+void vring_disable_notify(virtio_model_t *m, unsigned int q) {
+    (void)m; (void)q;
+}
+#endif
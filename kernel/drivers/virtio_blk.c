@@ -0,0 +1,665 @@
+/**
+ * virtio-blk
+ *
+ * A block device per virtio-blk function, with a virtqueue per CPU (as
+ * many as the device offers) whose interrupt is aimed at that CPU. A
+ * request goes on the submitting CPU's queue, so submitters on different
+ * CPUs never share a lock or a ring, and completes on the same CPU,
+ * into its BLOCK_SOFTIRQ batch.
+ *
+ * A request is a header the device reads, the data split at page
+ * boundaries as physical memory is, and a status byte the device writes.
+ * When the ring is full, requests wait on a per-queue backlog that
+ * completions restart. The synchronous read and write ops submit and
+ * poll for their own completion.
+ *
+ * Hosted builds have a device model to go with it: a virtio-blk
+ * function over an image file, a host thread per queue standing in for
+ * a hypervisor's I/O thread. A kick wakes the queue's thread; it serves
+ * everything available with pread()/pwrite(), hands the batch back and
+ * raises the queue's MSI-X vector if the driver asked, then asks for a
+ * kick before it sleeps again.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef __unix__
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#define VIRTIO_BLK_F_SEG_MAX    2
+#define VIRTIO_BLK_F_BLK_SIZE   6
+#define VIRTIO_BLK_F_FLUSH      9
+#define VIRTIO_BLK_F_MQ         12
+
+/* struct virtio_blk_config */
+#define VIRTIO_BLK_CFG_CAPACITY     0x00    /* 512-byte sectors */
+#define VIRTIO_BLK_CFG_SEG_MAX      0x0c
+#define VIRTIO_BLK_CFG_BLK_SIZE     0x14
+#define VIRTIO_BLK_CFG_NUM_QUEUES   0x22
+#define VIRTIO_BLK_CFG_SIZE         0x24
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_GET_ID     8
+
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_IOERR      1
+#define VIRTIO_BLK_S_UNSUPP     2
+
+#define VIRTIO_BLK_ID_BYTES     20
+#define SECTOR_SHIFT            9
+
+#define VBLK_QUEUE_SIZE         256
+#define VBLK_MAX_SEGS           128     /* Data segments per request */
+
+typedef struct {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+} virtio_blk_outhdr_t;
+
+typedef struct vblk_req {
+    virtio_blk_outhdr_t hdr;
+    uint8_t status;
+    block_request_t *rq;
+    struct vblk_req *next;          /* Free list */
+} vblk_req_t;
+
+typedef struct {
+    spinlock_t lock;
+    virtqueue_t *vq;
+    vblk_req_t *reqs, *free;
+    block_request_t *backlog, **backlog_tail;   /* Waiting for ring space */
+} __attribute__((aligned(64))) vblk_queue_t;
+
+typedef struct virtio_blk {
+    virtio_device_t vdev;
+    block_device_t bdev;
+    unsigned int nqueues;
+    unsigned int seg_max;
+    vblk_queue_t *queues;
+    struct virtio_blk *next;
+} virtio_blk_t;
+
+static virtio_blk_t *g_vblk_devices;
+static unsigned int g_vblk_index;
+
+#ifdef __unix__
+static void vblk_model_attach_all(void);
+#endif
+
+/* ============================================================================
+ * Requests
+ * ============================================================================ */
+
+/* Queue rq on q; -ENOSPC when the ring or the request pool is full */
+static int vblk_queue_rq(virtio_blk_t *vblk, vblk_queue_t *q, block_request_t *rq) {
+    virtio_sg_t sg[VBLK_MAX_SEGS + 2];
+    vblk_req_t *req = q->free;
+    unsigned int nseg = 0;
+
+    if (!req) return -ENOSPC;
+    if (rq->op != BLOCK_OP_FLUSH) {
+        uint8_t *p = rq->buf, *end = p + rq->len;
+        if ((rq->offset | rq->len) & ((1U << SECTOR_SHIFT) - 1)) return -EINVAL;
+        while (p < end) {
+            uint8_t *seg_end = (uint8_t *)(((uintptr_t)p & ~(PAGE_SIZE - 1)) + PAGE_SIZE);
+            if (seg_end > end) seg_end = end;
+            if (nseg == vblk->seg_max) return -EINVAL;
+            sg[1 + nseg].addr = p;
+            sg[1 + nseg].len = (uint32_t)(seg_end - p);
+            nseg++;
+            p = seg_end;
+        }
+    }
+
+    req->hdr.type = rq->op == BLOCK_OP_READ ? VIRTIO_BLK_T_IN :
+                    rq->op == BLOCK_OP_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_FLUSH;
+    req->hdr.ioprio = 0;
+    req->hdr.sector = rq->op == BLOCK_OP_FLUSH ? 0 : rq->offset >> SECTOR_SHIFT;
+    req->status = 0xff;
+    req->rq = rq;
+    sg[0].addr = &req->hdr;
+    sg[0].len = sizeof(req->hdr);
+    sg[1 + nseg].addr = &req->status;
+    sg[1 + nseg].len = 1;
+
+    unsigned int out = rq->op == BLOCK_OP_WRITE ? 1 + nseg : 1;
+    int ret = virtqueue_add_sgs(q->vq, sg, out, nseg + 2 - out, req);
+    if (ret < 0) return ret;
+    q->free = req->next;
+    return 0;
+}
+
+static void vblk_backlog_add(vblk_queue_t *q, block_request_t *rq) {
+    rq->next = NULL;
+    *q->backlog_tail = rq;
+    q->backlog_tail = &rq->next;
+}
+
+/*
+ * Start what waited for space; true if anything went on the ring.
+ * Requests that cannot go at all join the completions at *tail. Caller
+ * holds q->lock.
+ */
+static bool vblk_restart(virtio_blk_t *vblk, vblk_queue_t *q, block_request_t ***tail) {
+    bool queued = false;
+
+    while (q->backlog) {
+        block_request_t *rq = q->backlog;
+        int ret = vblk_queue_rq(vblk, q, rq);
+        if (ret == -ENOSPC) break;
+        q->backlog = rq->next;
+        if (!q->backlog) q->backlog_tail = &q->backlog;
+        rq->next = NULL;
+        if (ret < 0) {
+            rq->error = ret;
+            **tail = rq;
+            *tail = &rq->next;
+        } else {
+            queued = true;
+        }
+    }
+    return queued;
+}
+
+/*
+ * Complete whatever the device handed back on q, from its interrupt or
+ * a poller. end_io may submit again, so it runs with the lock dropped.
+ */
+static void vblk_reap(virtio_blk_t *vblk, vblk_queue_t *q) {
+    block_request_t *done = NULL, **tail = &done;
+    vblk_req_t *req;
+    bool kick = false;
+
+    spin_lock(&q->lock);
+    do {
+        virtqueue_disable_cb(q->vq);
+        while ((req = virtqueue_get_buf(q->vq, NULL)) != NULL) {
+            block_request_t *rq = req->rq;
+            rq->error = req->status == VIRTIO_BLK_S_OK ? 0 :
+                        req->status == VIRTIO_BLK_S_UNSUPP ? -EOPNOTSUPP : -EIO;
+            req->next = q->free;
+            q->free = req;
+            rq->next = NULL;
+            *tail = rq;
+            tail = &rq->next;
+        }
+    } while (!virtqueue_enable_cb(q->vq));
+    if (q->backlog && vblk_restart(vblk, q, &tail))
+        kick = virtqueue_kick_prepare(q->vq);
+    spin_unlock(&q->lock);
+    if (kick) virtqueue_notify(q->vq);
+
+    while (done) {
+        block_request_t *rq = done;
+        done = rq->next;
+        block_complete_request(rq);
+    }
+}
+
+static void vblk_done(virtqueue_t *vq) {
+    vblk_reap((virtio_blk_t *)vq->vdev, vq->priv);     /* vdev comes first */
+}
+
+static int vblk_submit(block_device_t *bdev, block_request_t *rq) {
+    virtio_blk_t *vblk = bdev->private;
+    vblk_queue_t *q = &vblk->queues[smp_processor_id() % vblk->nqueues];
+    bool kick = false;
+    int ret = 0;
+
+    spin_lock(&q->lock);
+    if (q->backlog) {
+        vblk_backlog_add(q, rq);            /* Behind the ones already waiting */
+    } else {
+        ret = vblk_queue_rq(vblk, q, rq);
+        if (ret == -ENOSPC) {
+            vblk_backlog_add(q, rq);
+            ret = 0;
+        } else if (ret == 0) {
+            kick = virtqueue_kick_prepare(q->vq);
+        }
+    }
+    spin_unlock(&q->lock);
+    if (kick) virtqueue_notify(q->vq);
+    return ret;
+}
+
+static void vblk_sync_end_io(block_request_t *rq) {
+    __atomic_store_n((int *)rq->private, 1, __ATOMIC_RELEASE);
+}
+
+/* Submit and wait, taking the interrupt if it comes here, else reaping the queue */
+static int vblk_rw_sync(block_device_t *bdev, int op, uint64_t offset, void *buf, size_t len) {
+    virtio_blk_t *vblk = bdev->private;
+    size_t max = op == BLOCK_OP_FLUSH ? 0 : (size_t)(vblk->seg_max - 1) * PAGE_SIZE;
+
+    do {
+        size_t n = len < max ? len : max;
+        int done = 0;
+        block_request_t rq = {
+            .bdev = bdev, .op = op, .offset = offset, .buf = buf, .len = n,
+            .end_io = vblk_sync_end_io, .private = &done,
+        };
+        int ret = block_submit(&rq);
+        if (ret < 0) return ret;
+        while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+            if (!irq_poll()) {
+                vblk_reap(vblk, &vblk->queues[smp_processor_id() % vblk->nqueues]);
+                if (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) cond_resched();
+            }
+        }
+        if (rq.error) return rq.error;
+        offset += n;
+        buf = (uint8_t *)buf + n;
+        len -= n;
+    } while (len);
+    return 0;
+}
+
+static int vblk_read(block_device_t *bdev, uint64_t offset, void *buf, size_t len) {
+    return vblk_rw_sync(bdev, BLOCK_OP_READ, offset, buf, len);
+}
+
+static int vblk_write(block_device_t *bdev, uint64_t offset, const void *buf, size_t len) {
+    return vblk_rw_sync(bdev, BLOCK_OP_WRITE, offset, (void *)buf, len);
+}
+
+static int vblk_flush(block_device_t *bdev) {
+    virtio_blk_t *vblk = bdev->private;
+    if (!virtio_has_feature(&vblk->vdev, VIRTIO_BLK_F_FLUSH)) return 0;
+    return vblk_rw_sync(bdev, BLOCK_OP_FLUSH, 0, NULL, 0);
+}
+
+static const block_device_ops_t vblk_ops = {
+    .read = vblk_read,
+    .write = vblk_write,
+    .flush = vblk_flush,
+    .submit = vblk_submit,
+};
+
+/* ============================================================================
+ * Probe
+ * ============================================================================ */
+
+static void vblk_free(virtio_blk_t *vblk) {
+    for (unsigned int i = 0; vblk->queues && i < vblk->nqueues; i++)
+        kfree(vblk->queues[i].reqs);
+    kfree(vblk->queues);
+    kfree(vblk);
+}
+
+static int vblk_init_queues(virtio_blk_t *vblk) {
+    vblk->queues = kmalloc(vblk->nqueues * sizeof(*vblk->queues), GFP_KERNEL);
+    if (!vblk->queues) return -ENOMEM;
+    memset(vblk->queues, 0, vblk->nqueues * sizeof(*vblk->queues));
+
+    for (unsigned int i = 0; i < vblk->nqueues; i++) {
+        vblk_queue_t *q = &vblk->queues[i];
+        virtqueue_t *vq = vblk->vdev.vqs[i];
+        q->vq = vq;
+        q->backlog_tail = &q->backlog;
+        q->reqs = kmalloc(vq->num * sizeof(*q->reqs), GFP_KERNEL);
+        if (!q->reqs) return -ENOMEM;
+        for (unsigned int r = 0; r < vq->num; r++)
+            q->reqs[r].next = r + 1 < vq->num ? &q->reqs[r + 1] : NULL;
+        q->free = q->reqs;
+        vq->priv = q;
+    }
+    return 0;
+}
+
+static int vblk_probe(pci_dev_t *pci) {
+    virtio_blk_t *vblk = kmalloc(sizeof(*vblk), GFP_KERNEL);
+    if (!vblk) return -ENOMEM;
+    memset(vblk, 0, sizeof(*vblk));
+
+    virtio_device_t *vdev = &vblk->vdev;
+    int ret = virtio_pci_probe(vdev, pci);
+    if (ret == 0)
+        ret = virtio_negotiate_features(vdev, VIRTIO_F(VIRTIO_F_VERSION_1) |
+                                        VIRTIO_F(VIRTIO_F_RING_INDIRECT_DESC) |
+                                        VIRTIO_F(VIRTIO_F_RING_EVENT_IDX) |
+                                        VIRTIO_F(VIRTIO_F_RING_PACKED) |
+                                        VIRTIO_F(VIRTIO_BLK_F_SEG_MAX) |
+                                        VIRTIO_F(VIRTIO_BLK_F_BLK_SIZE) |
+                                        VIRTIO_F(VIRTIO_BLK_F_FLUSH) |
+                                        VIRTIO_F(VIRTIO_BLK_F_MQ));
+    if (ret < 0) {
+        kfree(vblk);
+        return ret;
+    }
+
+    vblk->nqueues = virtio_has_feature(vdev, VIRTIO_BLK_F_MQ) ?
+                    virtio_cread16(vdev, VIRTIO_BLK_CFG_NUM_QUEUES) : 1;
+    if (!vblk->nqueues) vblk->nqueues = 1;
+    if (vblk->nqueues > NR_CPUS) vblk->nqueues = NR_CPUS;
+    vblk->seg_max = VBLK_MAX_SEGS;
+    if (virtio_has_feature(vdev, VIRTIO_BLK_F_SEG_MAX)) {
+        uint32_t seg_max = virtio_cread32(vdev, VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < vblk->seg_max) vblk->seg_max = seg_max;
+    }
+    if (vblk->seg_max < 2) vblk->seg_max = 2;
+
+    ret = virtio_find_vqs(vdev, vblk->nqueues, VBLK_QUEUE_SIZE, vblk_done);
+    if (ret == 0) ret = vblk_init_queues(vblk);
+    if (ret < 0) {
+        virtio_reset_device(vdev);
+        vblk_free(vblk);
+        return ret;
+    }
+
+    block_device_t *bdev = &vblk->bdev;
+    snprintf(bdev->name, sizeof(bdev->name), "vd%c", 'a' + (int)(g_vblk_index++ % 26));
+    bdev->size = virtio_cread64(vdev, VIRTIO_BLK_CFG_CAPACITY) << SECTOR_SHIFT;
+    bdev->ops = &vblk_ops;
+    bdev->private = vblk;
+
+    virtio_device_ready(vdev);
+    ret = block_device_register(bdev);
+    if (ret < 0) {
+        virtio_reset_device(vdev);
+        vblk_free(vblk);
+        return ret;
+    }
+    pci->driver_data = vblk;
+    vblk->next = g_vblk_devices;
+    g_vblk_devices = vblk;
+
+    pr_info("virtio-blk %s: %llu MiB, %u queues of %u, %s ring%s%s\n", bdev->name,
+            (unsigned long long)(bdev->size >> 20), vblk->nqueues, vdev->vqs[0]->num,
+            virtio_has_feature(vdev, VIRTIO_F_RING_PACKED) ? "packed" : "split",
+            virtio_has_feature(vdev, VIRTIO_F_RING_INDIRECT_DESC) ? ", indirect" : "",
+            virtio_has_feature(vdev, VIRTIO_F_RING_EVENT_IDX) ? ", event index" : "");
+    return 0;
+}
+
+/* Bind every virtio-blk function the last PCI scan found; returns how many */
+int virtio_blk_init(void) {
+    int bound = 0;
+
+#ifdef __unix__
+    vblk_model_attach_all();
+#endif
+    for (pci_dev_t *pci = NULL;
+         (pci = pci_get_device(VIRTIO_PCI_VENDOR_ID, VIRTIO_PCI_DEVICE_ID(VIRTIO_ID_BLOCK), pci)) != NULL;) {
+        if (pci->driver_data) continue;
+        int ret = vblk_probe(pci);
+        if (ret < 0)
+            pr_err("virtio-blk %02x:%02x.%u: probe failed: %d\n",
+                   pci->bus, PCI_SLOT(pci->devfn), PCI_FUNC(pci->devfn), ret);
+        else
+            bound++;
+    }
+    return bound;
+}
+
+/* Unregister every disk and reset its device; requests must have completed */
+void virtio_blk_exit(void) {
+    while (g_vblk_devices) {
+        virtio_blk_t *vblk = g_vblk_devices;
+        g_vblk_devices = vblk->next;
+        block_device_unregister(&vblk->bdev);
+        vblk->vdev.pci->driver_data = NULL;
+        virtio_reset_device(&vblk->vdev);
+        vblk_free(vblk);
+    }
+    g_vblk_index = 0;
+}
+
+/* ============================================================================
+ * Hosted device model
+ * ============================================================================ */
+
+#ifdef __unix__
+typedef struct vblk_model vblk_model_t;
+
+typedef struct {
+    uint32_t kick;                  /* Futex word, bumped by each notification */
+    bool running, stop;
+    pthread_t thread;
+    vblk_model_t *model;
+    unsigned int index;
+} __attribute__((aligned(64))) vblk_model_queue_t;
+
+/* struct virtio_blk_config, as far as num_queues */
+typedef struct {
+    uint64_t capacity;
+    uint32_t size_max;
+    uint32_t seg_max;
+    uint8_t geometry[4];
+    uint32_t blk_size;
+    uint8_t topology[8];
+    uint8_t writeback;
+    uint8_t unused;
+    uint16_t num_queues;
+} __attribute__((packed)) vblk_model_config_t;
+
+struct vblk_model {
+    virtio_model_t m;
+    FILE *fp;
+    int fd;
+    vblk_model_config_t config;
+    vblk_model_queue_t queues[NR_CPUS];
+    vblk_model_t *next;
+};
+
+static vblk_model_t *g_vblk_models;
+
+/* Move len bytes between the image at off and segments sg[0..n), merging neighbours */
+static bool vblk_model_io(vblk_model_t *vm, bool write, uint64_t off, const virtio_sg_t *sg,
+                          unsigned int n, uint32_t *moved) {
+    uint64_t size = vm->config.capacity << SECTOR_SHIFT;
+
+    for (unsigned int i = 0; i < n;) {
+        uint8_t *addr = sg[i].addr;
+        size_t len = sg[i].len;
+        for (i++; i < n && (uint8_t *)sg[i].addr == addr + len; i++)
+            len += sg[i].len;
+        if (off + len > size) return false;
+        ssize_t r = write ? pwrite(vm->fd, addr, len, (off_t)off) : pread(vm->fd, addr, len, (off_t)off);
+        if (r != (ssize_t)len) return false;
+        off += len;
+        if (!write) *moved += (uint32_t)len;
+    }
+    return true;
+}
+
+/* Serve one request; returns the bytes written into the buffer */
+static uint32_t vblk_model_handle(vblk_model_t *vm, const vring_elem_t *e) {
+    virtio_blk_outhdr_t hdr;
+    unsigned int nsg = e->out + e->in;
+
+    if (!e->out || !e->in || e->sg[0].len < sizeof(hdr) || e->sg[nsg - 1].len < 1) return 0;
+    memcpy(&hdr, e->sg[0].addr, sizeof(hdr));
+    uint8_t *status = e->sg[nsg - 1].addr;
+    uint32_t written = 0;
+    uint8_t s = VIRTIO_BLK_S_OK;
+
+    switch (hdr.type) {
+    case VIRTIO_BLK_T_IN:
+        if (!vblk_model_io(vm, false, hdr.sector << SECTOR_SHIFT, &e->sg[e->out], e->in - 1, &written))
+            s = VIRTIO_BLK_S_IOERR;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        if (!vblk_model_io(vm, true, hdr.sector << SECTOR_SHIFT, &e->sg[1], e->out - 1, &written))
+            s = VIRTIO_BLK_S_IOERR;
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        if (fdatasync(vm->fd) != 0) s = VIRTIO_BLK_S_IOERR;
+        break;
+    case VIRTIO_BLK_T_GET_ID:
+        if (e->in < 2) {
+            s = VIRTIO_BLK_S_IOERR;
+        } else {
+            char id[VIRTIO_BLK_ID_BYTES] = "vos-virtio-blk";
+            written = e->sg[e->out].len < sizeof(id) ? e->sg[e->out].len : (uint32_t)sizeof(id);
+            memcpy(e->sg[e->out].addr, id, written);
+        }
+        break;
+    default:
+        s = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+    *status = s;
+    return written + 1;
+}
+
+/* A queue's I/O thread: serve everything available, then sleep until kicked */
+static void *vblk_model_thread(void *arg) {
+    vblk_model_queue_t *mq = arg;
+    virtio_model_t *m = &mq->model->m;
+    vring_elem_t *elem = malloc(sizeof(*elem));
+
+    while (elem) {
+        uint32_t seq = __atomic_load_n(&mq->kick, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&mq->stop, __ATOMIC_ACQUIRE)) break;
+
+        unsigned int served = 0;
+        while (vring_pop(m, mq->index, elem)) {
+            vring_push(m, mq->index, elem, vblk_model_handle(mq->model, elem));
+            served++;
+        }
+        if (served) {
+            vring_flush(m, mq->index);
+            continue;
+        }
+        if (vring_enable_notify(m, mq->index)) continue;
+        futex_wait(&mq->kick, seq);
+        vring_disable_notify(m, mq->index);
+    }
+    free(elem);
+    return NULL;
+}
+
+static void vblk_model_notify(virtio_model_t *m, unsigned int q) {
+    vblk_model_queue_t *mq = &((vblk_model_t *)m)->queues[q];
+    __atomic_fetch_add(&mq->kick, 1, __ATOMIC_RELEASE);
+    futex_wake(&mq->kick, 1);
+}
+
+static void vblk_model_stop(vblk_model_t *vm) {
+    for (unsigned int i = 0; i < vm->m.nvqs; i++) {
+        vblk_model_queue_t *mq = &vm->queues[i];
+        if (!mq->running) continue;
+        __atomic_store_n(&mq->stop, true, __ATOMIC_RELEASE);
+        vblk_model_notify(&vm->m, i);
+        pthread_join(mq->thread, NULL);
+        mq->running = false;
+    }
+}
+
+/* DRIVER_OK starts a thread per queue the driver enabled; reset stops them */
+static void vblk_model_set_status(virtio_model_t *m, uint8_t status) {
+    vblk_model_t *vm = (vblk_model_t *)m;
+
+    vblk_model_stop(vm);
+    if (!status) return;
+    for (unsigned int i = 0; i < m->nvqs; i++) {
+        vblk_model_queue_t *mq = &vm->queues[i];
+        if (!virtio_model_queue_ready(m, i)) continue;
+        mq->stop = false;
+        mq->running = pthread_create(&mq->thread, NULL, vblk_model_thread, mq) == 0;
+    }
+}
+
+/*
+ * A virtio-blk function over the image at path, a queue per CPU,
+ * offering the ring features in ring_features. It is on the bus from
+ * the next scan; virtio_blk_init() attaches it before binding.
+ */
+int virtio_blk_model_create(const char *path, uint64_t ring_features) {
+    vblk_model_t *vm = calloc(1, sizeof(*vm));
+    if (!vm) return -ENOMEM;
+    vm->fp = fopen(path, "r+b");
+    if (!vm->fp) {
+        free(vm);
+        return -ENOENT;
+    }
+    fseek(vm->fp, 0, SEEK_END);
+    vm->fd = fileno(vm->fp);
+    vm->config.capacity = (uint64_t)ftell(vm->fp) >> SECTOR_SHIFT;
+    vm->config.seg_max = VBLK_MAX_SEGS;
+    vm->config.blk_size = 1U << SECTOR_SHIFT;
+    vm->config.num_queues = NR_CPUS;
+
+    vm->m.device_type = VIRTIO_ID_BLOCK;
+    vm->m.features = VIRTIO_F(VIRTIO_F_VERSION_1) | VIRTIO_F(VIRTIO_BLK_F_SEG_MAX) |
+                     VIRTIO_F(VIRTIO_BLK_F_BLK_SIZE) | VIRTIO_F(VIRTIO_BLK_F_FLUSH) |
+                     VIRTIO_F(VIRTIO_BLK_F_MQ) |
+                     (ring_features & (VIRTIO_F(VIRTIO_F_RING_INDIRECT_DESC) |
+                                       VIRTIO_F(VIRTIO_F_RING_EVENT_IDX) |
+                                       VIRTIO_F(VIRTIO_F_RING_PACKED)));
+    vm->m.nvqs = NR_CPUS;
+    vm->m.queue_size = VBLK_QUEUE_SIZE;
+    vm->m.config = &vm->config;
+    vm->m.config_len = sizeof(vm->config);
+    vm->m.notify = vblk_model_notify;
+    vm->m.set_status = vblk_model_set_status;
+    for (unsigned int i = 0; i < NR_CPUS; i++) {
+        vm->queues[i].model = vm;
+        vm->queues[i].index = i;
+    }
+
+    int ret = virtio_model_add(&vm->m);
+    if (ret < 0) {
+        fclose(vm->fp);
+        free(vm);
+        return ret;
+    }
+    vm->next = g_vblk_models;
+    g_vblk_models = vm;
+    return 0;
+}
+
+static void vblk_model_attach_all(void) {
+    for (vblk_model_t *vm = g_vblk_models; vm; vm = vm->next) {
+        int ret = virtio_model_attach(&vm->m);
+        if (ret < 0) pr_err("virtio-blk model: cannot attach: %d\n", ret);
+    }
+}
+
+/* Take every model off the bus; virtio_blk_exit() first, then rescan */
+void virtio_blk_model_destroy(void) {
+    while (g_vblk_models) {
+        vblk_model_t *vm = g_vblk_models;
+        g_vblk_models = vm->next;
+        virtio_model_remove(&vm->m);
+        vblk_model_stop(vm);
+        fclose(vm->fp);
+        free(vm);
+    }
+}
+
+/*
+ * virtio_blk.image=<file> puts a model disk on the bus before the first
+ * scan. Without it the bus is just emptier, so this never fails.
+ */
+int virtio_blk_model_init(void) {
+    char path[256];
+    if (!boot_param("virtio_blk.image", path, sizeof(path))) return 0;
+    int ret = virtio_blk_model_create(path, VIRTIO_F(VIRTIO_F_RING_INDIRECT_DESC) |
+                                            VIRTIO_F(VIRTIO_F_RING_EVENT_IDX) |
+                                            VIRTIO_F(VIRTIO_F_RING_PACKED));
+    if (ret < 0) pr_err("virtio-blk model: %s: %d\n", path, ret);
+    return 0;
+}
+#else
+int virtio_blk_model_create(const char *path, uint64_t ring_features) {
+    (void)path;
+    (void)ring_features;
+    return -ENODEV;
+}
+
+void virtio_blk_model_destroy(void) {
+}
+
+int virtio_blk_model_init(void) {
+    return 0;
+}
+#endif
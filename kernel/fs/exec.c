@@ -0,0 +1,525 @@
+/**
+ * exec and the ELF64 loader
+ *
+ * exec_load() turns an empty mm into a process image without reading
+ * the program: each PT_LOAD segment becomes a file mapping of the
+ * binary (private, so writes to .data copy the page), the part of .bss
+ * past the file an anonymous one, and the pages arrive later through
+ * faults on the page cache. The only data written up front are the
+ * zeroes in the page .data and .bss share, and the initial stack:
+ *
+ *      stack_top ->  execfn string
+ *                    envp strings, argv strings
+ *                    "x86_64", 16 random bytes (AT_RANDOM)
+ *                    auxv (AT_NULL last), NULL, envp[], NULL, argv[]
+ *      sp ------->   argc                      (16-byte aligned)
+ *
+ * The ELF and program headers are parsed once and hung off the inode
+ * (inode->i_exec) with the i_version and size they were read at; an exec
+ * that finds them still current skips the header reads and checks
+ * entirely. Writes and truncation bump i_version, and the last iput()
+ * frees them.
+ *
+ * ET_DYN images (PIE) and interpreters are placed at a random base, as
+ * are the stack and mmap_base, unless norandmaps=1.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+#define ELF_MAX_PHNUM       256
+#define ELF_MAX_ALIGN       (1ULL << 30)
+#define ELF_INTERP_MAX      4096
+#define ELF_ET_DYN_BASE     ((TASK_SIZE / 3 * 2) & PAGE_MASK)
+#define ELF_PLATFORM        "x86_64"
+
+#define STACK_RND_BITS      22          /* In pages: up to 16 GiB below STACK_TOP */
+#define MMAP_RND_BITS       28
+#define STACK_GUARD_GAP     (128ULL << 20)
+
+#define AUXV_ENTRIES        18
+
+#define PAGE_ALIGN(x)       (((x) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1))
+
+typedef struct {
+    uint64_t vaddr, memsz;
+    uint64_t offset, filesz;
+    unsigned int vm_flags;
+} elf_seg_t;
+
+typedef struct {
+    int refs;                   /* The inode's, plus one per exec using it */
+    uint64_t version, size;     /* The inode's when parsed */
+    uint16_t type, phnum;
+    uint64_t entry;
+    uint64_t phdr_vaddr;        /* The program headers as mapped, 0 if not */
+    uint64_t lo, hi;            /* Page-aligned span of the segments */
+    uint64_t align;             /* Largest segment alignment */
+    bool exec_stack;
+    char *interp;               /* PT_INTERP path, or NULL */
+    unsigned int nsegs;
+    elf_seg_t segs[];
+} elf_info_t;
+
+static struct {
+    spinlock_t lock;            /* inode->i_exec and refs */
+    int randomize;              /* -1 until the command line is read */
+    uint64_t seed;
+    exec_stats_t stats;
+} g_exec = { .lock = SPINLOCK_INIT, .randomize = -1 };
+
+static bool exec_randomize(void) {
+    int r = __atomic_load_n(&g_exec.randomize, __ATOMIC_RELAXED);
+    if (r < 0) {
+        char val[8];
+        r = !(boot_param("norandmaps", val, sizeof(val)) && strcmp(val, "0") != 0);
+        __atomic_fetch_xor(&g_exec.seed, rdtsc_ordered(), __ATOMIC_RELAXED);
+        __atomic_store_n(&g_exec.randomize, r, __ATOMIC_RELAXED);
+    }
+    return r;
+}
+
+/* splitmix64; layout randomization, not cryptography */
+static uint64_t exec_random(void) {
+    uint64_t z = __atomic_add_fetch(&g_exec.seed, 0x9e3779b97f4a7c15ULL, __ATOMIC_RELAXED);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t exec_random_pages(unsigned int bits) {
+    if (!exec_randomize()) return 0;
+    return (exec_random() & ((1ULL << bits) - 1)) << PAGE_SHIFT;
+}
+
+/* ============================================================================
+ * Headers
+ * ============================================================================ */
+
+/* Header bytes come through the page cache, like the segments will */
+static int exec_read(inode_t *inode, uint64_t off, void *buf, size_t len) {
+    char *dst = buf;
+
+    if (off > inode->size || len > inode->size - off) return -ENOEXEC;
+    while (len) {
+        size_t in_page = (size_t)(off & (PAGE_SIZE - 1));
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > len) chunk = len;
+
+        int err = 0;
+        page_t *page = find_or_create_page(&inode->i_data, off >> PAGE_SHIFT, &err);
+        if (!page) return err;
+        memcpy(dst, (char *)page_to_virt(page) + in_page, chunk);
+        put_page(page);
+        dst += chunk;
+        off += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static bool elf_ehdr_ok(const Elf64_Ehdr *eh) {
+    return memcmp(eh->e_ident, "\177ELF", 4) == 0 &&
+           eh->e_ident[4] == ELFCLASS64 && eh->e_ident[5] == ELFDATA2LSB &&
+           eh->e_ident[6] == EV_CURRENT && eh->e_version == EV_CURRENT &&
+           (eh->e_type == ET_EXEC || eh->e_type == ET_DYN) &&
+           eh->e_machine == EM_X86_64 && eh->e_phentsize == sizeof(Elf64_Phdr) &&
+           eh->e_phnum && eh->e_phnum <= ELF_MAX_PHNUM;
+}
+
+static void elf_info_free(elf_info_t *info) {
+    kfree(info->interp);
+    kfree(info);
+}
+
+static int elf_parse_load(elf_info_t *info, const Elf64_Ehdr *eh, const Elf64_Phdr *ph,
+                          uint64_t size) {
+    if (ph->p_filesz > ph->p_memsz || ph->p_offset > size || ph->p_filesz > size - ph->p_offset ||
+        ((ph->p_vaddr - ph->p_offset) & (PAGE_SIZE - 1)) ||
+        ph->p_vaddr >= TASK_SIZE || ph->p_memsz > TASK_SIZE - ph->p_vaddr)
+        return -ENOEXEC;
+
+    elf_seg_t *seg = &info->segs[info->nsegs++];
+    seg->vaddr = ph->p_vaddr;
+    seg->memsz = ph->p_memsz;
+    seg->offset = ph->p_offset;
+    seg->filesz = ph->p_filesz;
+    seg->vm_flags = ((ph->p_flags & PF_R) ? VM_READ : 0) | ((ph->p_flags & PF_W) ? VM_WRITE : 0) |
+                    ((ph->p_flags & PF_X) ? VM_EXEC : 0);
+
+    uint64_t lo = ph->p_vaddr & PAGE_MASK, hi = PAGE_ALIGN(ph->p_vaddr + ph->p_memsz);
+    if (lo < info->lo) info->lo = lo;
+    if (hi > info->hi) info->hi = hi;
+    if (ph->p_align > info->align && ph->p_align <= ELF_MAX_ALIGN &&
+        !(ph->p_align & (ph->p_align - 1)))
+        info->align = ph->p_align;
+
+    /* Without PT_PHDR, the headers are wherever a segment maps their file bytes */
+    uint64_t phsize = (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr);
+    if (!info->phdr_vaddr && eh->e_phoff >= ph->p_offset &&
+        eh->e_phoff + phsize <= ph->p_offset + ph->p_filesz)
+        info->phdr_vaddr = ph->p_vaddr + (eh->e_phoff - ph->p_offset);
+    return 0;
+}
+
+static elf_info_t *elf_parse(inode_t *inode, uint64_t version, int *err) {
+    uint64_t size = inode->size;
+    elf_info_t *info = NULL;
+    Elf64_Phdr *phdrs = NULL;
+    Elf64_Ehdr eh;
+    int ret;
+
+    if ((ret = exec_read(inode, 0, &eh, sizeof(eh))) < 0) goto fail;
+    ret = -ENOEXEC;
+    if (!elf_ehdr_ok(&eh)) goto fail;
+
+    size_t phsize = (size_t)eh.e_phnum * sizeof(Elf64_Phdr);
+    phdrs = kmalloc(phsize, GFP_KERNEL);
+    ret = -ENOMEM;
+    if (!phdrs) goto fail;
+    if ((ret = exec_read(inode, eh.e_phoff, phdrs, phsize)) < 0) goto fail;
+
+    unsigned int nload = 0;
+    for (unsigned int i = 0; i < eh.e_phnum; i++)
+        if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_memsz) nload++;
+    ret = -ENOEXEC;
+    if (!nload) goto fail;
+
+    info = kmalloc(sizeof(*info) + nload * sizeof(elf_seg_t), GFP_KERNEL);
+    ret = -ENOMEM;
+    if (!info) goto fail;
+    memset(info, 0, sizeof(*info));
+    info->version = version;
+    info->size = size;
+    info->type = eh.e_type;
+    info->phnum = eh.e_phnum;
+    info->entry = eh.e_entry;
+    info->lo = UINT64_MAX;
+    info->align = PAGE_SIZE;
+
+    for (unsigned int i = 0; i < eh.e_phnum; i++) {
+        const Elf64_Phdr *ph = &phdrs[i];
+        switch (ph->p_type) {
+        case PT_LOAD:
+            if (ph->p_memsz && (ret = elf_parse_load(info, &eh, ph, size)) < 0) goto fail;
+            break;
+        case PT_INTERP:
+            ret = -ENOEXEC;
+            if (info->interp || ph->p_filesz < 2 || ph->p_filesz > ELF_INTERP_MAX) goto fail;
+            info->interp = kmalloc(ph->p_filesz, GFP_KERNEL);
+            ret = -ENOMEM;
+            if (!info->interp) goto fail;
+            if ((ret = exec_read(inode, ph->p_offset, info->interp, ph->p_filesz)) < 0) goto fail;
+            ret = -ENOEXEC;
+            if (strnlen(info->interp, ph->p_filesz) != ph->p_filesz - 1) goto fail;
+            break;
+        case PT_PHDR:
+            info->phdr_vaddr = ph->p_vaddr;
+            break;
+        case PT_GNU_STACK:
+            info->exec_stack = ph->p_flags & PF_X;
+            break;
+        }
+    }
+    ret = -ENOEXEC;
+    if (info->type == ET_EXEC && info->lo < MMAP_MIN_ADDR) goto fail;
+
+    kfree(phdrs);
+    return info;
+
+fail:
+    if (info) elf_info_free(info);
+    kfree(phdrs);
+    *err = ret;
+    return NULL;
+}
+
+static void elf_info_put(elf_info_t *info) {
+    spin_lock(&g_exec.lock);
+    int left = --info->refs;
+    spin_unlock(&g_exec.lock);
+    if (!left) elf_info_free(info);
+}
+
+/* The inode's parsed headers, parsing them if they are missing or stale */
+static elf_info_t *elf_info_get(inode_t *inode, int *err) {
+    uint64_t version = __atomic_load_n(&inode->i_version, __ATOMIC_ACQUIRE);
+
+    spin_lock(&g_exec.lock);
+    elf_info_t *info = inode->i_exec;
+    if (info && info->version == version && info->size == inode->size) {
+        info->refs++;
+        spin_unlock(&g_exec.lock);
+        __atomic_fetch_add(&g_exec.stats.hdr_cache_hits, 1, __ATOMIC_RELAXED);
+        return info;
+    }
+    spin_unlock(&g_exec.lock);
+
+    __atomic_fetch_add(&g_exec.stats.hdr_cache_misses, 1, __ATOMIC_RELAXED);
+    info = elf_parse(inode, version, err);
+    if (!info) return NULL;
+    info->refs = 2;
+
+    spin_lock(&g_exec.lock);
+    elf_info_t *old = inode->i_exec;
+    inode->i_exec = info;
+    spin_unlock(&g_exec.lock);
+    if (old) elf_info_put(old);
+    return info;
+}
+
+void exec_cache_drop(inode_t *inode) {
+    spin_lock(&g_exec.lock);
+    elf_info_t *info = inode->i_exec;
+    inode->i_exec = NULL;
+    spin_unlock(&g_exec.lock);
+    if (info) elf_info_put(info);
+}
+
+/* ============================================================================
+ * Building the image
+ * ============================================================================ */
+
+static int elf_open(const char *path, inode_t **res) {
+    int ret = vfs_lookup(path, res);
+    if (ret < 0) return ret;
+    if (!S_ISREG((*res)->mode) || !((*res)->mode & 0111)) {
+        iput(*res);
+        return -EACCES;
+    }
+    return 0;
+}
+
+/* Map the segments at bias: file-backed up to p_filesz, anonymous to p_memsz */
+static int elf_map(mm_struct_t *mm, inode_t *inode, const elf_info_t *info, uint64_t bias,
+                   bool main) {
+    for (unsigned int i = 0; i < info->nsegs; i++) {
+        const elf_seg_t *seg = &info->segs[i];
+        uint64_t start = (bias + seg->vaddr) & PAGE_MASK;
+        uint64_t file_end = bias + seg->vaddr + seg->filesz;
+        uint64_t mem_end = bias + seg->vaddr + seg->memsz;
+        uint64_t anon = start;
+        int64_t ret;
+
+        if (seg->filesz) {
+            ret = do_mmap(mm, start, PAGE_ALIGN(file_end) - start, seg->vm_flags, MAP_FIXED,
+                          inode, seg->offset >> PAGE_SHIFT);
+            if (ret < 0) return (int)ret;
+            anon = PAGE_ALIGN(file_end);
+            /* The rest of the last file page is .bss, but holds whatever follows in the file */
+            if (mem_end > file_end && (file_end & (PAGE_SIZE - 1)) && (seg->vm_flags & VM_WRITE) &&
+                (ret = clear_mm(mm, file_end, anon - file_end)) < 0)
+                return (int)ret;
+        }
+        if (PAGE_ALIGN(mem_end) > anon) {
+            ret = do_mmap(mm, anon, PAGE_ALIGN(mem_end) - anon, seg->vm_flags, MAP_FIXED, NULL, 0);
+            if (ret < 0) return (int)ret;
+        }
+
+        if (!main) continue;
+        if (seg->vm_flags & VM_EXEC) {
+            if (!mm->start_code || start < mm->start_code) mm->start_code = start;
+            if (file_end > mm->end_code) mm->end_code = file_end;
+        } else {
+            if (!mm->start_data || start < mm->start_data) mm->start_data = start;
+            if (file_end > mm->end_data) mm->end_data = file_end;
+        }
+        if (PAGE_ALIGN(mem_end) > mm->start_brk) mm->start_brk = PAGE_ALIGN(mem_end);
+    }
+    if (main) mm->brk = mm->start_brk;
+    return 0;
+}
+
+/* Load an interpreter anywhere in the mmap area; returns its bias */
+static int64_t elf_map_interp(mm_struct_t *mm, inode_t *inode, const elf_info_t *info) {
+    uint64_t span = info->hi - info->lo + info->align - PAGE_SIZE;
+    int64_t addr = do_mmap(mm, 0, span, 0, 0, NULL, 0);
+    if (addr < 0) return addr;
+    do_munmap(mm, (uint64_t)addr, span);
+
+    uint64_t base = ((uint64_t)addr + info->align - 1) & ~(info->align - 1);
+    int ret = elf_map(mm, inode, info, base - info->lo, false);
+    return ret < 0 ? ret : (int64_t)(base - info->lo);
+}
+
+static int count_strings(char *const strs[], size_t *bytes, unsigned int *n) {
+    for (*n = 0; strs && strs[*n]; (*n)++) {
+        *bytes += strlen(strs[*n]) + 1 + sizeof(uint64_t);
+        if (*bytes > ARG_MAX) return -E2BIG;
+    }
+    return 0;
+}
+
+/* Copy strs to the image at *pos (buf mirrors [base, ...)), filling ptrs */
+static void put_strings(char *buf, uint64_t base, uint64_t *pos, char *const strs[],
+                        unsigned int n, uint64_t *ptrs) {
+    for (unsigned int i = 0; i < n; i++) {
+        size_t len = strlen(strs[i]) + 1;
+        memcpy(buf + (*pos - base), strs[i], len);
+        ptrs[i] = *pos;
+        *pos += len;
+    }
+    ptrs[n] = 0;
+}
+
+static int setup_stack(mm_struct_t *mm, uint64_t stack_top, const char *filename,
+                       char *const argv[], char *const envp[], const uint64_t *auxv) {
+    size_t bytes = strlen(filename) + 1;
+    unsigned int argc, envc;
+    int ret;
+
+    if ((ret = count_strings(argv, &bytes, &argc)) < 0 ||
+        (ret = count_strings(envp, &bytes, &envc)) < 0)
+        return ret;
+
+    /* Work down from the top to find sp, then fill a copy of [sp, stack_top) upwards */
+    size_t str_bytes = bytes - (size_t)(argc + envc) * sizeof(uint64_t);
+    uint64_t strings = stack_top - sizeof(uint64_t) - str_bytes;
+    uint64_t platform = strings - sizeof(ELF_PLATFORM);
+    uint64_t rnd = (platform - 16) & ~15ULL;
+    size_t nwords = 1 + (argc + 1) + (envc + 1) + 2 * AUXV_ENTRIES;
+    uint64_t sp = (rnd - nwords * sizeof(uint64_t)) & ~15ULL;
+
+    size_t size = (size_t)(stack_top - sp);
+    char *buf = kmalloc(size, GFP_KERNEL);
+    if (!buf) return -ENOMEM;
+    memset(buf, 0, size);
+
+    uint64_t *words = (uint64_t *)buf;
+    uint64_t pos = strings;
+    words[0] = argc;
+    put_strings(buf, sp, &pos, argv, argc, &words[1]);
+    mm->arg_start = strings;
+    mm->arg_end = mm->env_start = pos;
+    put_strings(buf, sp, &pos, envp, envc, &words[1 + argc + 1]);
+    mm->env_end = pos;
+    uint64_t execfn = pos;
+    memcpy(buf + (execfn - sp), filename, strlen(filename) + 1);
+    memcpy(buf + (platform - sp), ELF_PLATFORM, sizeof(ELF_PLATFORM));
+    for (unsigned int i = 0; i < 16; i += sizeof(uint64_t)) {
+        uint64_t r = exec_random();
+        memcpy(buf + (rnd - sp) + i, &r, sizeof(r));
+    }
+
+    uint64_t *aux = &words[1 + argc + 1 + envc + 1];
+    memcpy(aux, auxv, 2 * AUXV_ENTRIES * sizeof(uint64_t));
+    for (unsigned int i = 0; i < AUXV_ENTRIES; i++) {
+        if (aux[2 * i] == AT_RANDOM) aux[2 * i + 1] = rnd;
+        else if (aux[2 * i] == AT_PLATFORM) aux[2 * i + 1] = platform;
+        else if (aux[2 * i] == AT_EXECFN) aux[2 * i + 1] = execfn;
+    }
+
+    ret = copy_to_mm(mm, sp, buf, size);
+    kfree(buf);
+    if (ret < 0) return ret;
+    mm->start_stack = sp;
+    return 0;
+}
+
+/*
+ * Build filename's image in mm, which must be empty: mappings, brk,
+ * the initial stack, and mm->entry and mm->start_stack for the first
+ * instruction. mm is unusable after a failure.
+ */
+int exec_load(mm_struct_t *mm, const char *filename, char *const argv[], char *const envp[]) {
+    inode_t *inode = NULL, *interp_inode = NULL;
+    elf_info_t *info = NULL, *interp = NULL;
+    uint64_t bias = 0, interp_bias = 0;
+
+    int ret = elf_open(filename, &inode);
+    if (ret < 0) return ret;
+    info = elf_info_get(inode, &ret);
+    if (!info) goto out;
+    if (info->interp) {
+        if ((ret = elf_open(info->interp, &interp_inode)) < 0) goto out;
+        interp = elf_info_get(interp_inode, &ret);
+        if (!interp) goto out;
+        ret = -ENOEXEC;
+        if (interp->type != ET_DYN || interp->interp) goto out;
+    }
+
+    uint64_t stack_top = STACK_TOP - exec_random_pages(STACK_RND_BITS);
+    mm->mmap_base = stack_top - STACK_SIZE_DEFAULT - STACK_GUARD_GAP -
+                    exec_random_pages(MMAP_RND_BITS);
+    int64_t addr = do_mmap(mm, stack_top - STACK_SIZE_DEFAULT, STACK_SIZE_DEFAULT,
+                           VM_READ | VM_WRITE | (info->exec_stack ? VM_EXEC : 0),
+                           MAP_FIXED, NULL, 0);
+    if (addr < 0) {
+        ret = (int)addr;
+        goto out;
+    }
+
+    if (info->type == ET_DYN) {
+        uint64_t base = ELF_ET_DYN_BASE + exec_random_pages(MMAP_RND_BITS);
+        base = (base + info->align - 1) & ~(info->align - 1);
+        bias = base - info->lo;
+    }
+    if ((ret = elf_map(mm, inode, info, bias, true)) < 0) goto out;
+    mm->entry = bias + info->entry;
+    if (interp) {
+        int64_t b = elf_map_interp(mm, interp_inode, interp);
+        if (b < 0) {
+            ret = (int)b;
+            goto out;
+        }
+        interp_bias = (uint64_t)b;
+        mm->entry = interp_bias + interp->entry;
+    }
+
+    const uint64_t auxv[2 * AUXV_ENTRIES] = {
+        AT_PHDR,   info->phdr_vaddr ? bias + info->phdr_vaddr : 0,
+        AT_PHENT,  sizeof(Elf64_Phdr),
+        AT_PHNUM,  info->phnum,
+        AT_PAGESZ, PAGE_SIZE,
+        AT_BASE,   interp_bias,
+        AT_FLAGS,  0,
+        AT_ENTRY,  bias + info->entry,
+        AT_UID,    0,
+        AT_EUID,   0,
+        AT_GID,    0,
+        AT_EGID,   0,
+        AT_SECURE, 0,
+        AT_CLKTCK, 100,
+        AT_HWCAP,  0,
+        AT_RANDOM, 0,           /* Addresses filled in by setup_stack() */
+        AT_PLATFORM, 0,
+        AT_EXECFN, 0,
+        AT_NULL,   0,
+    };
+    ret = setup_stack(mm, stack_top, filename, argv, envp, auxv);
+    if (ret == 0) __atomic_fetch_add(&g_exec.stats.execs, 1, __ATOMIC_RELAXED);
+
+out:
+    if (interp) elf_info_put(interp);
+    if (interp_inode) iput(interp_inode);
+    if (info) elf_info_put(info);
+    iput(inode);
+    return ret;
+}
+
+int do_execve(const char *filename, char *const argv[], char *const envp[]) {
+    mm_struct_t *mm = mm_alloc(), *old = NULL;
+    if (!mm) return -ENOMEM;
+
+    int ret = exec_load(mm, filename, argv, envp);
+    if (ret == 0) {
+        const char *comm = strrchr(filename, '/');
+        ret = exec_mm_replace(0, mm, comm ? comm + 1 : filename, &old);
+    }
+    if (ret < 0) {
+        mmput(mm);
+        return ret;
+    }
+    mmput(old);
+    return 0;
+}
+
+int do_exec(const char *filename, char *const argv[]) {
+    return do_execve(filename, argv, NULL);
+}
+
+void exec_get_stats(exec_stats_t *stats) {
+    stats->execs = __atomic_load_n(&g_exec.stats.execs, __ATOMIC_RELAXED);
+    stats->hdr_cache_hits = __atomic_load_n(&g_exec.stats.hdr_cache_hits, __ATOMIC_RELAXED);
+    stats->hdr_cache_misses = __atomic_load_n(&g_exec.stats.hdr_cache_misses, __ATOMIC_RELAXED);
+}
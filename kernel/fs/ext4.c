@@ -1,7 +1,2339 @@
 /**
  * Ext4 filesystem
+ *
+ * Read/write ext4 on top of the buffer cache and a JBD2 journal.
+ *
+ * - Inodes and blocks are allocated from the group bitmaps. Files stay
+ *   in their parent's group; directories are spread across groups with
+ *   spare inodes (Orlov-style), and data extends the file's last extent.
+ * - File data uses delayed allocation: writes land in a per-inode cache
+ *   and blocks are only chosen at writeback, so a file written in many
+ *   small pieces still gets one contiguous extent.
+ * - Extent trees of depth 0 and 1 are grown in place; deeper trees
+ *   (from other implementations) are readable.
+ * - Metadata goes through the journal in ordered mode. Checksummed
+ *   filesystems (metadata_csum, gdt_csum) and bigalloc mount read-only.
+ * - register_ext4_fs() exposes all of this to the VFS as "ext4".
  */
 
-#include <kernel.h>
+#include "ext4.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
 
-/* Stubs */
+static inline uint32_t ext4_now(void) {
+    return (uint32_t)time(NULL);
+}
+
+static inline bool test_bit_le(const uint8_t *map, uint32_t bit) {
+    return map[bit >> 3] & (1U << (bit & 7));
+}
+
+static inline void set_bit_le(uint8_t *map, uint32_t bit) {
+    map[bit >> 3] |= (uint8_t)(1U << (bit & 7));
+}
+
+static inline void clear_bit_le(uint8_t *map, uint32_t bit) {
+    map[bit >> 3] &= (uint8_t)~(1U << (bit & 7));
+}
+
+/* ============================================================================
+ * Group descriptors
+ * ============================================================================ */
+
+static struct ext4_group_desc *ext4_get_group_desc(ext4_fs_t *fs, uint32_t group,
+                                                   buffer_head_t **bhp) {
+    uint32_t per_block = fs->s_block_size / fs->s_desc_size;
+    buffer_head_t *bh = fs->s_group_desc[group / per_block];
+    if (bhp) *bhp = bh;
+    return (struct ext4_group_desc *)(bh->b_data + (group % per_block) * fs->s_desc_size);
+}
+
+#define GD_GET64(fs, gd, f) \
+    ((uint64_t)(gd)->f##_lo | ((fs)->s_desc_size >= 64 ? (uint64_t)(gd)->f##_hi << 32 : 0))
+#define GD_GET32(fs, gd, f) \
+    ((uint32_t)(gd)->f##_lo | ((fs)->s_desc_size >= 64 ? (uint32_t)(gd)->f##_hi << 16 : 0))
+#define GD_SET32(fs, gd, f, v) do { \
+        uint32_t __v = (uint32_t)(v); \
+        (gd)->f##_lo = (uint16_t)__v; \
+        if ((fs)->s_desc_size >= 64) (gd)->f##_hi = (uint16_t)(__v >> 16); \
+    } while (0)
+
+static inline uint64_t group_first_block(ext4_fs_t *fs, uint32_t group) {
+    return fs->s_es.s_first_data_block + (uint64_t)group * fs->s_blocks_per_group;
+}
+
+static inline uint32_t group_nr_blocks(ext4_fs_t *fs, uint32_t group) {
+    uint64_t left = fs->s_blocks_count - group_first_block(fs, group);
+    return left < fs->s_blocks_per_group ? (uint32_t)left : fs->s_blocks_per_group;
+}
+
+/* Adjust a group's counters inside the handle's transaction */
+static int ext4_group_update(handle_t *handle, ext4_fs_t *fs, uint32_t group,
+                             int64_t blocks, int32_t inodes, int32_t dirs) {
+    buffer_head_t *bh;
+    struct ext4_group_desc *gd = ext4_get_group_desc(fs, group, &bh);
+
+    int ret = jbd2_journal_get_write_access(handle, bh);
+    if (ret < 0) return ret;
+
+    GD_SET32(fs, gd, bg_free_blocks_count, GD_GET32(fs, gd, bg_free_blocks_count) + blocks);
+    GD_SET32(fs, gd, bg_free_inodes_count, GD_GET32(fs, gd, bg_free_inodes_count) + inodes);
+    GD_SET32(fs, gd, bg_used_dirs_count, GD_GET32(fs, gd, bg_used_dirs_count) + dirs);
+    mark_buffer_dirty(bh);
+    return 0;
+}
+
+/* ============================================================================
+ * Inode cache
+ * ============================================================================ */
+
+static buffer_head_t *ext4_inode_bh(ext4_fs_t *fs, uint32_t ino, uint32_t *offset) {
+    uint32_t group = (ino - 1) / fs->s_inodes_per_group;
+    uint32_t index = (ino - 1) % fs->s_inodes_per_group;
+    struct ext4_group_desc *gd = ext4_get_group_desc(fs, group, NULL);
+    uint64_t byte = (uint64_t)index * fs->s_inode_size;
+
+    *offset = (uint32_t)(byte % fs->s_block_size);
+    return bread(fs->s_bdev, GD_GET64(fs, gd, bg_inode_table) + byte / fs->s_block_size,
+                 fs->s_block_size);
+}
+
+static inline size_t ext4_raw_inode_bytes(ext4_fs_t *fs) {
+    return fs->s_inode_size < sizeof(struct ext4_inode) ? fs->s_inode_size
+                                                        : sizeof(struct ext4_inode);
+}
+
+static inline uint64_t ext4_isize(const struct ext4_inode *raw) {
+    return raw->i_size_lo | ((uint64_t)raw->i_size_high << 32);
+}
+
+static inline void ext4_set_isize(struct ext4_inode *raw, uint64_t size) {
+    raw->i_size_lo = (uint32_t)size;
+    raw->i_size_high = (uint32_t)(size >> 32);
+}
+
+/* Account nblocks filesystem blocks (possibly negative) to i_blocks */
+static void ext4_add_iblocks(ext4_fs_t *fs, ext4_inode_info_t *ei, int64_t nblocks) {
+    struct ext4_inode *raw = &ei->i_raw;
+    uint64_t cur = raw->i_blocks_lo | ((uint64_t)raw->i_blocks_high << 32);
+
+    if (!(raw->i_flags & EXT4_HUGE_FILE_FL))
+        nblocks *= fs->s_block_size / 512;
+    cur += nblocks;
+    raw->i_blocks_lo = (uint32_t)cur;
+    raw->i_blocks_high = (uint16_t)(cur >> 32);
+}
+
+static unsigned int icache_hash(uint32_t ino) {
+    return (ino * 0x9e3779b1U) >> (32 - EXT4_ICACHE_BITS);
+}
+
+static void ilru_del(ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    if (ei->i_lru_prev) ei->i_lru_prev->i_lru_next = ei->i_lru_next;
+    else if (fs->s_ilru_head == ei) fs->s_ilru_head = ei->i_lru_next;
+    else return;    /* Not on the LRU */
+    if (ei->i_lru_next) ei->i_lru_next->i_lru_prev = ei->i_lru_prev;
+    else fs->s_ilru_tail = ei->i_lru_prev;
+    ei->i_lru_prev = ei->i_lru_next = NULL;
+}
+
+static void ilru_add(ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    ei->i_lru_prev = NULL;
+    ei->i_lru_next = fs->s_ilru_head;
+    if (fs->s_ilru_head) fs->s_ilru_head->i_lru_prev = ei;
+    else fs->s_ilru_tail = ei;
+    fs->s_ilru_head = ei;
+}
+
+static void ext4_destroy_inode(ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    ext4_inode_info_t **pp = &fs->s_icache[icache_hash(ei->i_ino)];
+    while (*pp != ei) pp = &(*pp)->i_hash_next;
+    *pp = ei->i_hash_next;
+    fs->s_nr_inodes--;
+
+    for (uint32_t i = 0; i < ei->i_delalloc_cap && ei->i_delalloc_count; i++) {
+        if (ei->i_delalloc[i]) {
+            kfree(ei->i_delalloc[i]);
+            ei->i_delalloc_count--;
+            fs->s_dirty_blocks--;
+        }
+    }
+    kfree(ei->i_delalloc);
+    kfree(ei->i_dx);
+    kfree(ei);
+}
+
+static void ext4_shrink_icache(ext4_fs_t *fs) {
+    while (fs->s_nr_inodes > EXT4_ICACHE_MAX && fs->s_ilru_tail) {
+        ext4_inode_info_t *ei = fs->s_ilru_tail;
+        ilru_del(fs, ei);
+        ext4_destroy_inode(fs, ei);
+    }
+}
+
+static ext4_inode_info_t *ext4_iget(ext4_fs_t *fs, uint32_t ino, int *err) {
+    if (ino == 0 || ino > fs->s_es.s_inodes_count) {
+        *err = -EINVAL;
+        return NULL;
+    }
+
+    for (ext4_inode_info_t *ei = fs->s_icache[icache_hash(ino)]; ei; ei = ei->i_hash_next) {
+        if (ei->i_ino == ino) {
+            if (ei->i_count++ == 0)
+                ilru_del(fs, ei);
+            return ei;
+        }
+    }
+
+    uint32_t off;
+    buffer_head_t *bh = ext4_inode_bh(fs, ino, &off);
+    if (!bh) {
+        *err = -EIO;
+        return NULL;
+    }
+
+    ext4_inode_info_t *ei = kmalloc(sizeof(*ei), GFP_KERNEL);
+    if (!ei) {
+        brelse(bh);
+        *err = -ENOMEM;
+        return NULL;
+    }
+    memset(ei, 0, sizeof(*ei));
+    memcpy(&ei->i_raw, bh->b_data + off, ext4_raw_inode_bytes(fs));
+    brelse(bh);
+
+    ei->i_ino = ino;
+    ei->i_count = 1;
+    ei->i_size = ext4_isize(&ei->i_raw);
+    ei->i_sync_tid = fs->s_journal ? fs->s_journal->j_commit_sequence : 0;
+
+    unsigned int h = icache_hash(ino);
+    ei->i_hash_next = fs->s_icache[h];
+    fs->s_icache[h] = ei;
+    fs->s_nr_inodes++;
+    ext4_shrink_icache(fs);
+    return ei;
+}
+
+static void ext4_iput(ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    if (--ei->i_count > 0 || ei->i_dirty_list)
+        return;
+    if (ei->i_raw.i_links_count == 0) {
+        ext4_destroy_inode(fs, ei);
+        return;
+    }
+    ilru_add(fs, ei);
+    ext4_shrink_icache(fs);
+}
+
+/* Copy the in-core inode into its inode table block within the handle */
+static int ext4_mark_inode_dirty(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    uint32_t off;
+    buffer_head_t *bh = ext4_inode_bh(fs, ei->i_ino, &off);
+    if (!bh) return -EIO;
+
+    int ret = jbd2_journal_get_write_access(handle, bh);
+    if (ret == 0) {
+        memcpy(bh->b_data + off, &ei->i_raw, ext4_raw_inode_bytes(fs));
+        mark_buffer_dirty(bh);
+        ei->i_sync_tid = handle->h_transaction->t_tid;
+    }
+    brelse(bh);
+    return ret;
+}
+
+static void ext4_mark_delalloc(ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    if (ei->i_dirty_list) return;
+    ei->i_dirty_list = true;
+    ei->i_dirty_next = fs->s_dirty_inodes;
+    fs->s_dirty_inodes = ei;
+}
+
+/* ============================================================================
+ * Block and inode allocation
+ * ============================================================================ */
+
+static inline bool block_is_free(buffer_head_t *bh, uint32_t bit) {
+    journal_head_t *jh = bh->b_private;
+    if (test_bit_le(bh->b_data, bit))
+        return false;
+    /* Freed in the running transaction: not reusable until committed */
+    return !(jh && jh->b_committed_data && test_bit_le(jh->b_committed_data, bit));
+}
+
+/**
+ * ext4_new_blocks
+ *
+ * Allocate up to *count contiguous blocks, searching from goal onwards
+ * and wrapping around the groups. On success *count holds the length
+ * actually allocated (at least one).
+ */
+static int ext4_new_blocks(handle_t *handle, ext4_fs_t *fs, uint64_t goal,
+                           uint32_t *count, uint64_t *start) {
+    uint32_t fdb = fs->s_es.s_first_data_block;
+    if (goal < fdb || goal >= fs->s_blocks_count)
+        goal = fdb;
+
+    uint32_t group = (uint32_t)((goal - fdb) / fs->s_blocks_per_group);
+    uint32_t offset = (uint32_t)((goal - fdb) % fs->s_blocks_per_group);
+
+    for (uint32_t n = 0; n <= fs->s_groups_count; n++, offset = 0) {
+        uint32_t g = (group + n) % fs->s_groups_count;
+        struct ext4_group_desc *gd = ext4_get_group_desc(fs, g, NULL);
+        if (GD_GET32(fs, gd, bg_free_blocks_count) == 0)
+            continue;
+        if (offset < fs->s_bb_hint[g])
+            offset = fs->s_bb_hint[g];
+
+        buffer_head_t *bh = bread(fs->s_bdev, GD_GET64(fs, gd, bg_block_bitmap), fs->s_block_size);
+        if (!bh) return -EIO;
+
+        uint32_t nbits = group_nr_blocks(fs, g);
+        uint32_t bit = offset;
+        while (bit < nbits) {
+            /* Skip fully used bytes quickly */
+            if ((bit & 7) == 0 && bh->b_data[bit >> 3] == 0xff) {
+                bit += 8;
+                continue;
+            }
+            if (block_is_free(bh, bit)) break;
+            bit++;
+        }
+        if (offset == fs->s_bb_hint[g] && bit > offset)
+            fs->s_bb_hint[g] = bit;
+        if (bit >= nbits) {
+            brelse(bh);
+            continue;
+        }
+
+        uint32_t len = 1;
+        while (len < *count && bit + len < nbits && block_is_free(bh, bit + len))
+            len++;
+
+        int ret = jbd2_journal_get_undo_access(handle, bh);
+        if (ret == 0) {
+            for (uint32_t i = 0; i < len; i++)
+                set_bit_le(bh->b_data, bit + i);
+            mark_buffer_dirty(bh);
+            ret = ext4_group_update(handle, fs, g, -(int64_t)len, 0, 0);
+        }
+        brelse(bh);
+        if (ret < 0) return ret;
+
+        fs->s_free_blocks -= len;
+        *count = len;
+        *start = group_first_block(fs, g) + bit;
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+static int ext4_free_blocks(handle_t *handle, ext4_fs_t *fs, uint64_t block,
+                            uint32_t count, bool metadata) {
+    uint32_t fdb = fs->s_es.s_first_data_block;
+
+    while (count) {
+        uint32_t g = (uint32_t)((block - fdb) / fs->s_blocks_per_group);
+        uint32_t bit = (uint32_t)((block - fdb) % fs->s_blocks_per_group);
+        uint32_t n = fs->s_blocks_per_group - bit;
+        if (n > count) n = count;
+
+        struct ext4_group_desc *gd = ext4_get_group_desc(fs, g, NULL);
+        buffer_head_t *bh = bread(fs->s_bdev, GD_GET64(fs, gd, bg_block_bitmap), fs->s_block_size);
+        if (!bh) return -EIO;
+
+        int ret = jbd2_journal_get_undo_access(handle, bh);
+        if (ret == 0) {
+            for (uint32_t i = 0; i < n; i++)
+                clear_bit_le(bh->b_data, bit + i);
+            mark_buffer_dirty(bh);
+            ret = ext4_group_update(handle, fs, g, n, 0, 0);
+        }
+        brelse(bh);
+        if (ret < 0) return ret;
+
+        if (bit < fs->s_bb_hint[g])
+            fs->s_bb_hint[g] = bit;
+        fs->s_free_blocks += n;
+
+        /* Stale logged copies of freed metadata must never be replayed */
+        for (uint32_t i = 0; metadata && i < n; i++) {
+            buffer_head_t *mbh = getblk(fs->s_bdev, block + i, fs->s_block_size);
+            ret = jbd2_journal_revoke(handle, block + i, mbh);
+            brelse(mbh);
+            if (ret < 0) return ret;
+        }
+        block += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/* Orlov-style: spread directories over groups with spare inodes */
+static uint32_t find_group_dir(ext4_fs_t *fs) {
+    uint32_t avg_inodes = fs->s_free_inodes / fs->s_groups_count;
+    uint32_t best = UINT32_MAX, best_dirs = UINT32_MAX, best_blocks = 0;
+
+    for (uint32_t n = 0; n < fs->s_groups_count; n++) {
+        uint32_t g = (fs->s_last_dir_group + 1 + n) % fs->s_groups_count;
+        struct ext4_group_desc *gd = ext4_get_group_desc(fs, g, NULL);
+        uint32_t inodes = GD_GET32(fs, gd, bg_free_inodes_count);
+        uint32_t dirs = GD_GET32(fs, gd, bg_used_dirs_count);
+        uint32_t blocks = GD_GET32(fs, gd, bg_free_blocks_count);
+
+        if (inodes == 0 || inodes < avg_inodes)
+            continue;
+        if (dirs < best_dirs || (dirs == best_dirs && blocks > best_blocks)) {
+            best = g;
+            best_dirs = dirs;
+            best_blocks = blocks;
+        }
+    }
+    if (best != UINT32_MAX)
+        fs->s_last_dir_group = best;
+    return best;
+}
+
+/* Files go next to their parent directory when there is room */
+static uint32_t find_group_other(ext4_fs_t *fs, uint32_t parent_group) {
+    for (uint32_t n = 0; n < fs->s_groups_count; n++) {
+        uint32_t g = (parent_group + n) % fs->s_groups_count;
+        struct ext4_group_desc *gd = ext4_get_group_desc(fs, g, NULL);
+        if (GD_GET32(fs, gd, bg_free_inodes_count) &&
+            (n > 0 || GD_GET32(fs, gd, bg_free_blocks_count)))
+            return g;
+    }
+    return UINT32_MAX;
+}
+
+static ext4_inode_info_t *ext4_new_inode(handle_t *handle, ext4_fs_t *fs,
+                                         ext4_inode_info_t *dir, uint16_t mode, int *err) {
+    uint32_t parent_group = (dir->i_ino - 1) / fs->s_inodes_per_group;
+    bool is_dir = EXT4_S_ISDIR(mode);
+    uint32_t first = is_dir ? find_group_dir(fs) : find_group_other(fs, parent_group);
+    if (first == UINT32_MAX)
+        first = find_group_other(fs, parent_group);
+    if (first == UINT32_MAX) {
+        *err = -ENOSPC;
+        return NULL;
+    }
+
+    for (uint32_t n = 0; n < fs->s_groups_count; n++) {
+        uint32_t g = (first + n) % fs->s_groups_count;
+        struct ext4_group_desc *gd = ext4_get_group_desc(fs, g, NULL);
+        if (GD_GET32(fs, gd, bg_free_inodes_count) == 0)
+            continue;
+
+        buffer_head_t *bh = bread(fs->s_bdev, GD_GET64(fs, gd, bg_inode_bitmap), fs->s_block_size);
+        if (!bh) {
+            *err = -EIO;
+            return NULL;
+        }
+
+        uint32_t bit = fs->s_ib_hint[g];
+        while (bit < fs->s_inodes_per_group &&
+               (test_bit_le(bh->b_data, bit) || g * fs->s_inodes_per_group + bit + 1 < fs->s_first_ino))
+            bit++;
+        fs->s_ib_hint[g] = bit;
+        if (bit >= fs->s_inodes_per_group) {
+            brelse(bh);
+            continue;
+        }
+
+        int ret = jbd2_journal_get_write_access(handle, bh);
+        if (ret == 0) {
+            set_bit_le(bh->b_data, bit);
+            mark_buffer_dirty(bh);
+            ret = ext4_group_update(handle, fs, g, 0, -1, is_dir ? 1 : 0);
+        }
+        brelse(bh);
+        if (ret < 0) {
+            *err = ret;
+            return NULL;
+        }
+        fs->s_free_inodes--;
+
+        /* Build the new inode in core, then write the whole slot out */
+        uint32_t ino = g * fs->s_inodes_per_group + bit + 1;
+        uint32_t off;
+        buffer_head_t *ibh = ext4_inode_bh(fs, ino, &off);
+        if (!ibh || (ret = jbd2_journal_get_write_access(handle, ibh)) < 0) {
+            brelse(ibh);
+            *err = ibh ? ret : -EIO;
+            return NULL;
+        }
+        memset(ibh->b_data + off, 0, fs->s_inode_size);
+        mark_buffer_dirty(ibh);
+        brelse(ibh);
+
+        ext4_inode_info_t *ei = ext4_iget(fs, ino, err);
+        if (!ei) return NULL;
+
+        uint32_t now = ext4_now();
+        struct ext4_inode *raw = &ei->i_raw;
+        memset(raw, 0, sizeof(*raw));
+        raw->i_mode = mode;
+        raw->i_atime = raw->i_ctime = raw->i_mtime = raw->i_crtime = now;
+        raw->i_links_count = 1;
+        raw->i_flags = EXT4_EXTENTS_FL;
+        raw->i_generation = ++fs->s_generation;
+        if (fs->s_inode_size > EXT4_GOOD_OLD_INODE_SIZE)
+            raw->i_extra_isize = sizeof(struct ext4_inode) - EXT4_GOOD_OLD_INODE_SIZE;
+
+        struct ext4_extent_header *eh = (struct ext4_extent_header *)raw->i_block;
+        eh->eh_magic = EXT4_EXT_MAGIC;
+        eh->eh_max = (sizeof(raw->i_block) - sizeof(*eh)) / sizeof(struct ext4_extent);
+
+        ei->i_size = 0;
+        *err = ext4_mark_inode_dirty(handle, fs, ei);
+        if (*err < 0) {
+            ext4_iput(fs, ei);
+            return NULL;
+        }
+        return ei;
+    }
+    *err = -ENOSPC;
+    return NULL;
+}
+
+static int ext4_free_inode(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    uint32_t g = (ei->i_ino - 1) / fs->s_inodes_per_group;
+    uint32_t bit = (ei->i_ino - 1) % fs->s_inodes_per_group;
+    struct ext4_group_desc *gd = ext4_get_group_desc(fs, g, NULL);
+    bool is_dir = EXT4_S_ISDIR(ei->i_raw.i_mode);
+
+    buffer_head_t *bh = bread(fs->s_bdev, GD_GET64(fs, gd, bg_inode_bitmap), fs->s_block_size);
+    if (!bh) return -EIO;
+
+    int ret = jbd2_journal_get_write_access(handle, bh);
+    if (ret == 0) {
+        clear_bit_le(bh->b_data, bit);
+        mark_buffer_dirty(bh);
+        ret = ext4_group_update(handle, fs, g, 0, 1, is_dir ? -1 : 0);
+    }
+    brelse(bh);
+    if (ret < 0) return ret;
+
+    if (bit < fs->s_ib_hint[g])
+        fs->s_ib_hint[g] = bit;
+    fs->s_free_inodes++;
+
+    ei->i_raw.i_links_count = 0;
+    ei->i_raw.i_dtime = ext4_now();
+    ext4_set_isize(&ei->i_raw, 0);
+    ei->i_size = 0;
+    return ext4_mark_inode_dirty(handle, fs, ei);
+}
+
+/* ============================================================================
+ * Extent trees
+ * ============================================================================ */
+
+static inline uint64_t ext_pblk(const struct ext4_extent *ex) {
+    return ex->ee_start_lo | ((uint64_t)ex->ee_start_hi << 32);
+}
+
+static inline void ext_set_pblk(struct ext4_extent *ex, uint64_t pblk) {
+    ex->ee_start_lo = (uint32_t)pblk;
+    ex->ee_start_hi = (uint16_t)(pblk >> 32);
+}
+
+static inline uint64_t idx_pblk(const struct ext4_extent_idx *ix) {
+    return ix->ei_leaf_lo | ((uint64_t)ix->ei_leaf_hi << 32);
+}
+
+static inline uint32_t ext_len(const struct ext4_extent *ex) {
+    return ex->ee_len > EXT4_EXT_INIT_MAX_LEN ? ex->ee_len - EXT4_EXT_INIT_MAX_LEN : ex->ee_len;
+}
+
+static inline bool ext_unwritten(const struct ext4_extent *ex) {
+    return ex->ee_len > EXT4_EXT_INIT_MAX_LEN;
+}
+
+static inline struct ext4_extent_header *ext_root(ext4_inode_info_t *ei) {
+    return (struct ext4_extent_header *)ei->i_raw.i_block;
+}
+
+#define EXT_FIRST_EXTENT(h) ((struct ext4_extent *)((h) + 1))
+#define EXT_FIRST_INDEX(h)  ((struct ext4_extent_idx *)((h) + 1))
+
+/* Index entry whose subtree covers lblk (the first one if lblk precedes all) */
+static int ext_find_idx(struct ext4_extent_header *eh, uint32_t lblk) {
+    struct ext4_extent_idx *ix = EXT_FIRST_INDEX(eh);
+    int lo = 1, hi = eh->eh_entries - 1, found = 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ix[mid].ei_block <= lblk) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/**
+ * ext4_ext_map
+ *
+ * Translate a logical block. Returns 1 and the physical block if mapped
+ * (with *len contiguous blocks following it and *unwritten set for
+ * preallocated extents), 0 for a hole, or a negative error.
+ */
+static int ext4_ext_map(ext4_fs_t *fs, ext4_inode_info_t *ei, uint32_t lblk,
+                        uint64_t *pblk, uint32_t *len, bool *unwritten) {
+    struct ext4_extent_header *eh = ext_root(ei);
+    buffer_head_t *bh = NULL;
+    int ret = 0;
+
+    if (!(ei->i_raw.i_flags & EXT4_EXTENTS_FL))
+        return -ENOTIMPL;
+
+    for (;;) {
+        if (eh->eh_magic != EXT4_EXT_MAGIC) {
+            ret = -EUCLEAN;
+            break;
+        }
+        if (eh->eh_depth == 0) {
+            struct ext4_extent *ex = EXT_FIRST_EXTENT(eh);
+            int lo = 0, hi = eh->eh_entries - 1;
+            while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+                if (lblk < ex[mid].ee_block) {
+                    hi = mid - 1;
+                } else if (lblk >= ex[mid].ee_block + ext_len(&ex[mid])) {
+                    lo = mid + 1;
+                } else {
+                    uint32_t delta = lblk - ex[mid].ee_block;
+                    *pblk = ext_pblk(&ex[mid]) + delta;
+                    if (len) *len = ext_len(&ex[mid]) - delta;
+                    if (unwritten) *unwritten = ext_unwritten(&ex[mid]);
+                    ret = 1;
+                    break;
+                }
+            }
+            break;
+        }
+        if (eh->eh_entries == 0)
+            break;
+
+        struct ext4_extent_idx *ix = EXT_FIRST_INDEX(eh) + ext_find_idx(eh, lblk);
+        buffer_head_t *next = bread(fs->s_bdev, idx_pblk(ix), fs->s_block_size);
+        brelse(bh);
+        if (!(bh = next)) return -EIO;
+        eh = (struct ext4_extent_header *)bh->b_data;
+    }
+    brelse(bh);
+    return ret;
+}
+
+static uint64_t ext4_inode_goal(ext4_fs_t *fs, ext4_inode_info_t *ei, uint32_t lblk) {
+    uint64_t pblk;
+    if (lblk > 0 && ext4_ext_map(fs, ei, lblk - 1, &pblk, NULL, NULL) == 1)
+        return pblk + 1;
+    /* Fresh file: start of its inode's group data area */
+    return group_first_block(fs, (ei->i_ino - 1) / fs->s_inodes_per_group);
+}
+
+/* Insert ex into a leaf, merging with its left neighbour when contiguous */
+static bool ext_leaf_insert(struct ext4_extent_header *eh, const struct ext4_extent *new_ex) {
+    struct ext4_extent *ex = EXT_FIRST_EXTENT(eh);
+    int pos = 0;
+    while (pos < eh->eh_entries && ex[pos].ee_block < new_ex->ee_block)
+        pos++;
+
+    if (pos > 0) {
+        struct ext4_extent *prev = &ex[pos - 1];
+        if (!ext_unwritten(prev) &&
+            prev->ee_block + prev->ee_len == new_ex->ee_block &&
+            ext_pblk(prev) + prev->ee_len == ext_pblk(new_ex) &&
+            prev->ee_len + new_ex->ee_len <= EXT4_EXT_INIT_MAX_LEN) {
+            prev->ee_len += new_ex->ee_len;
+            return true;
+        }
+    }
+    if (eh->eh_entries >= eh->eh_max)
+        return false;
+
+    memmove(&ex[pos + 1], &ex[pos], (eh->eh_entries - pos) * sizeof(*ex));
+    ex[pos] = *new_ex;
+    eh->eh_entries++;
+    return true;
+}
+
+static buffer_head_t *ext4_new_tree_block(handle_t *handle, ext4_fs_t *fs,
+                                          ext4_inode_info_t *ei, uint64_t goal, int *err) {
+    uint32_t count = 1;
+    uint64_t blk;
+
+    if ((*err = ext4_new_blocks(handle, fs, goal, &count, &blk)) < 0)
+        return NULL;
+    buffer_head_t *bh = getblk(fs->s_bdev, blk, fs->s_block_size);
+    if (!bh) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    if ((*err = jbd2_journal_get_write_access(handle, bh)) < 0) {
+        brelse(bh);
+        return NULL;
+    }
+    memset(bh->b_data, 0, fs->s_block_size);
+    mark_buffer_dirty(bh);
+    ext4_add_iblocks(fs, ei, 1);
+    return bh;
+}
+
+/* Extents and index entries are both 12 bytes keyed by their first field */
+#define EXT_ENTRY(h, i)     ((uint8_t *)((h) + 1) + (size_t)(i) * 12)
+#define EXT_KEY(h, i)       (*(uint32_t *)EXT_ENTRY(h, i))
+#define EXT4_EXT_MAX_DEPTH  5
+
+typedef struct {
+    buffer_head_t *bh;                  /* NULL for the root in the inode */
+    struct ext4_extent_header *hdr;
+    int pos;                            /* Index entry followed downwards */
+} ext_path_t;
+
+static void ext_path_release(ext_path_t *path, int depth) {
+    for (int k = 1; k <= depth; k++)
+        brelse(path[k].bh);
+}
+
+static int ext_find_path(ext4_fs_t *fs, ext4_inode_info_t *ei, uint32_t lblk,
+                         ext_path_t *path, int *depthp) {
+    struct ext4_extent_header *eh = ext_root(ei);
+    int depth = eh->eh_depth;
+
+    if (eh->eh_magic != EXT4_EXT_MAGIC || depth > EXT4_EXT_MAX_DEPTH)
+        return -EUCLEAN;
+    path[0] = (ext_path_t){ .bh = NULL, .hdr = eh };
+    for (int k = 0; k < depth; k++) {
+        if (path[k].hdr->eh_entries == 0) {
+            ext_path_release(path, k);
+            return -EUCLEAN;
+        }
+        path[k].pos = ext_find_idx(path[k].hdr, lblk);
+        struct ext4_extent_idx *ix = EXT_FIRST_INDEX(path[k].hdr) + path[k].pos;
+        buffer_head_t *bh = bread(fs->s_bdev, idx_pblk(ix), fs->s_block_size);
+        if (!bh) {
+            ext_path_release(path, k);
+            return -EIO;
+        }
+        eh = (struct ext4_extent_header *)bh->b_data;
+        path[k + 1] = (ext_path_t){ .bh = bh, .hdr = eh };
+        if (eh->eh_magic != EXT4_EXT_MAGIC || eh->eh_depth != depth - k - 1) {
+            ext_path_release(path, k + 1);
+            return -EUCLEAN;
+        }
+    }
+    *depthp = depth;
+    return 0;
+}
+
+/* Journal a tree node before changing it; the root lives in the inode */
+static inline int ext_access(handle_t *handle, ext_path_t *p) {
+    return p->bh ? jbd2_journal_get_write_access(handle, p->bh) : 0;
+}
+
+static inline void ext_dirty(ext_path_t *p) {
+    if (p->bh) mark_buffer_dirty(p->bh);
+}
+
+/* Root is full at every level: move it into a block and add a level */
+static int ext_grow_root(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *ei, uint64_t goal) {
+    struct ext4_extent_header *root = ext_root(ei);
+    int ret;
+
+    if (root->eh_depth >= EXT4_EXT_MAX_DEPTH)
+        return -EFBIG;
+    buffer_head_t *bh = ext4_new_tree_block(handle, fs, ei, goal, &ret);
+    if (!bh) return ret;
+
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)bh->b_data;
+    memcpy(eh, root, sizeof(*root) + root->eh_entries * 12);
+    eh->eh_max = (uint16_t)((fs->s_block_size - sizeof(*eh)) / 12);
+
+    struct ext4_extent_idx *ix = EXT_FIRST_INDEX(root);
+    ix->ei_block = root->eh_entries ? EXT_KEY(root, 0) : 0;
+    ix->ei_leaf_lo = (uint32_t)bh->b_blocknr;
+    ix->ei_leaf_hi = (uint16_t)(bh->b_blocknr >> 32);
+    ix->ei_unused = 0;
+    root->eh_entries = 1;
+    root->eh_depth++;
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Split the full node at path level k (its parent has room). Appends to
+ * the last leaf start a fresh leaf holding just new_ex, which keeps
+ * sequentially written files' leaves full; otherwise move half across.
+ */
+static int ext_split(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *ei, ext_path_t *path,
+                     int k, int depth, const struct ext4_extent *new_ex, bool *done) {
+    ext_path_t *node = &path[k], *parent = &path[k - 1];
+    struct ext4_extent_header *eh = node->hdr;
+    int ret;
+
+    if ((ret = ext_access(handle, parent)) < 0 || (ret = ext_access(handle, node)) < 0)
+        return ret;
+    buffer_head_t *nbh = ext4_new_tree_block(handle, fs, ei, node->bh->b_blocknr + 1, &ret);
+    if (!nbh) return ret;
+
+    struct ext4_extent_header *neh = (struct ext4_extent_header *)nbh->b_data;
+    neh->eh_magic = EXT4_EXT_MAGIC;
+    neh->eh_max = (uint16_t)((fs->s_block_size - sizeof(*neh)) / 12);
+    neh->eh_depth = eh->eh_depth;
+
+    if (k == depth && new_ex->ee_block > EXT_KEY(eh, eh->eh_entries - 1)) {
+        memcpy(EXT_ENTRY(neh, 0), new_ex, 12);
+        neh->eh_entries = 1;
+        *done = true;
+    } else {
+        int keep = eh->eh_entries / 2;
+        neh->eh_entries = (uint16_t)(eh->eh_entries - keep);
+        memcpy(EXT_ENTRY(neh, 0), EXT_ENTRY(eh, keep), neh->eh_entries * 12);
+        eh->eh_entries = (uint16_t)keep;
+        ext_dirty(node);
+    }
+
+    struct ext4_extent_header *peh = parent->hdr;
+    int at = parent->pos + 1;
+    memmove(EXT_ENTRY(peh, at + 1), EXT_ENTRY(peh, at), (peh->eh_entries - at) * 12);
+    struct ext4_extent_idx *ix = (struct ext4_extent_idx *)EXT_ENTRY(peh, at);
+    ix->ei_block = EXT_KEY(neh, 0);
+    ix->ei_leaf_lo = (uint32_t)nbh->b_blocknr;
+    ix->ei_leaf_hi = (uint16_t)(nbh->b_blocknr >> 32);
+    ix->ei_unused = 0;
+    peh->eh_entries++;
+    ext_dirty(parent);
+    brelse(nbh);
+    return 0;
+}
+
+/**
+ * ext4_ext_insert
+ *
+ * Map [lblk, lblk + len) to pblk. A full leaf is split below the lowest
+ * ancestor with a free slot; when every level is full the root moves
+ * into a new block and the tree gets one level deeper. The caller marks
+ * the inode dirty.
+ */
+static int ext4_ext_insert(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *ei,
+                           uint32_t lblk, uint64_t pblk, uint32_t len) {
+    struct ext4_extent new_ex = { .ee_block = lblk, .ee_len = (uint16_t)len };
+    ext_path_t path[EXT4_EXT_MAX_DEPTH + 1];
+    int depth, ret;
+    ext_set_pblk(&new_ex, pblk);
+
+    for (;;) {
+        if ((ret = ext_find_path(fs, ei, lblk, path, &depth)) < 0)
+            return ret;
+
+        ext_path_t *leaf = &path[depth];
+        if ((ret = ext_access(handle, leaf)) < 0)
+            break;
+        if (ext_leaf_insert(leaf->hdr, &new_ex)) {
+            ext_dirty(leaf);
+            /* A new first extent moves the keys of the indexes above it */
+            for (int k = depth - 1; k >= 0 && ret == 0; k--) {
+                uint32_t key = EXT_KEY(path[k + 1].hdr, 0);
+                if (EXT_KEY(path[k].hdr, path[k].pos) != key &&
+                    (ret = ext_access(handle, &path[k])) == 0) {
+                    EXT_KEY(path[k].hdr, path[k].pos) = key;
+                    ext_dirty(&path[k]);
+                }
+                if (path[k].pos != 0) break;
+            }
+            break;
+        }
+
+        int k = depth - 1;
+        while (k >= 0 && path[k].hdr->eh_entries >= path[k].hdr->eh_max)
+            k--;
+        bool done = false;
+        ret = k < 0 ? ext_grow_root(handle, fs, ei, pblk)
+                    : ext_split(handle, fs, ei, path, k + 1, depth, &new_ex, &done);
+        if (ret < 0 || done)
+            break;
+        ext_path_release(path, depth);
+    }
+    ext_path_release(path, depth);
+    return ret;
+}
+
+/* Free every block mapped by a (sub)tree, then the tree blocks themselves */
+static int ext4_ext_free_tree(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *ei,
+                              struct ext4_extent_header *eh, bool data_is_metadata) {
+    int ret = 0;
+
+    if (eh->eh_magic != EXT4_EXT_MAGIC)
+        return -EUCLEAN;
+
+    if (eh->eh_depth == 0) {
+        struct ext4_extent *ex = EXT_FIRST_EXTENT(eh);
+        for (int i = 0; i < eh->eh_entries && ret == 0; i++) {
+            ret = ext4_free_blocks(handle, fs, ext_pblk(&ex[i]), ext_len(&ex[i]), data_is_metadata);
+            ext4_add_iblocks(fs, ei, -(int64_t)ext_len(&ex[i]));
+        }
+        return ret;
+    }
+
+    struct ext4_extent_idx *ix = EXT_FIRST_INDEX(eh);
+    for (int i = 0; i < eh->eh_entries && ret == 0; i++) {
+        buffer_head_t *bh = bread(fs->s_bdev, idx_pblk(&ix[i]), fs->s_block_size);
+        if (!bh) return -EIO;
+        ret = ext4_ext_free_tree(handle, fs, ei, (struct ext4_extent_header *)bh->b_data,
+                                 data_is_metadata);
+        brelse(bh);
+        if (ret == 0)
+            ret = ext4_free_blocks(handle, fs, idx_pblk(&ix[i]), 1, true);
+        ext4_add_iblocks(fs, ei, -1);
+    }
+    return ret;
+}
+
+/* ============================================================================
+ * Delayed allocation and writeback
+ * ============================================================================ */
+
+static int ext4_delalloc_reserve(ext4_fs_t *fs, ext4_inode_info_t *ei, uint32_t lblk) {
+    if (lblk >= ei->i_delalloc_cap) {
+        uint32_t cap = ei->i_delalloc_cap ? ei->i_delalloc_cap : 4;
+        while (cap <= lblk) cap *= 2;
+        uint8_t **arr = kmalloc(cap * sizeof(uint8_t *), GFP_KERNEL);
+        if (!arr) return -ENOMEM;
+        memset(arr, 0, cap * sizeof(uint8_t *));
+        if (ei->i_delalloc)
+            memcpy(arr, ei->i_delalloc, ei->i_delalloc_cap * sizeof(uint8_t *));
+        kfree(ei->i_delalloc);
+        ei->i_delalloc = arr;
+        ei->i_delalloc_cap = cap;
+    }
+    if (ei->i_delalloc[lblk])
+        return 0;
+
+    /* Keep slack for the extent and directory blocks writeback may need */
+    uint64_t slack = fs->s_dirty_blocks / 64 + 16;
+    if (fs->s_free_blocks < fs->s_dirty_blocks + slack + 1)
+        return -ENOSPC;
+
+    ei->i_delalloc[lblk] = kmalloc(fs->s_block_size, GFP_KERNEL);
+    if (!ei->i_delalloc[lblk]) return -ENOMEM;
+    memset(ei->i_delalloc[lblk], 0, fs->s_block_size);
+    ei->i_delalloc_count++;
+    fs->s_dirty_blocks++;
+    return 0;
+}
+
+/**
+ * ext4_writeback_inode
+ *
+ * Allocate blocks for the inode's delayed data, one extent per run of
+ * contiguous logical blocks, copy the data into the buffer cache (the
+ * commit writes it before the metadata), and update the on-disk size.
+ */
+static int ext4_writeback_inode(ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    handle_t handle;
+    uint32_t lblk = 0;
+    int ret = 0;
+
+    while (ei->i_delalloc_count && lblk < ei->i_delalloc_cap) {
+        if (!ei->i_delalloc[lblk]) {
+            lblk++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (lblk + run < ei->i_delalloc_cap && ei->i_delalloc[lblk + run] &&
+               run < EXT4_EXT_INIT_MAX_LEN)
+            run++;
+
+        if (!jbd2_journal_start(fs->s_journal, &handle, 8))
+            return -ENOMEM;
+
+        uint64_t pblk;
+        ret = ext4_new_blocks(&handle, fs, ext4_inode_goal(fs, ei, lblk), &run, &pblk);
+        if (ret == 0)
+            ret = ext4_ext_insert(&handle, fs, ei, lblk, pblk, run);
+        if (ret == 0) {
+            ext4_add_iblocks(fs, ei, run);
+            for (uint32_t i = 0; i < run; i++) {
+                buffer_head_t *bh = getblk(fs->s_bdev, pblk + i, fs->s_block_size);
+                if (!bh) {
+                    ret = -ENOMEM;
+                    break;
+                }
+                memcpy(bh->b_data, ei->i_delalloc[lblk + i], fs->s_block_size);
+                mark_buffer_dirty(bh);
+                brelse(bh);
+                kfree(ei->i_delalloc[lblk + i]);
+                ei->i_delalloc[lblk + i] = NULL;
+                ei->i_delalloc_count--;
+                fs->s_dirty_blocks--;
+            }
+        }
+        if (ret == 0)
+            ret = ext4_mark_inode_dirty(&handle, fs, ei);
+        jbd2_journal_stop(&handle);
+        if (ret < 0)
+            return ret;
+        lblk += run;
+    }
+
+    if (ext4_isize(&ei->i_raw) != ei->i_size) {
+        if (!jbd2_journal_start(fs->s_journal, &handle, 1))
+            return -ENOMEM;
+        ext4_set_isize(&ei->i_raw, ei->i_size);
+        ei->i_raw.i_mtime = ei->i_raw.i_ctime = ext4_now();
+        ret = ext4_mark_inode_dirty(&handle, fs, ei);
+        jbd2_journal_stop(&handle);
+    }
+    return ret;
+}
+
+static int ext4_writeback_all(ext4_fs_t *fs) {
+    int ret = 0;
+
+    while (fs->s_dirty_inodes) {
+        ext4_inode_info_t *ei = fs->s_dirty_inodes;
+        fs->s_dirty_inodes = ei->i_dirty_next;
+        ei->i_dirty_next = NULL;
+        ei->i_dirty_list = false;
+
+        int err = ext4_writeback_inode(fs, ei);
+        if (err < 0 && ret == 0) ret = err;
+
+        /* Balance the list's reference */
+        ei->i_count++;
+        ext4_iput(fs, ei);
+    }
+    return ret;
+}
+
+static void ext4_writeback_remove(ext4_fs_t *fs, ext4_inode_info_t *ei) {
+    if (!ei->i_dirty_list) return;
+    ext4_inode_info_t **pp = &fs->s_dirty_inodes;
+    while (*pp != ei) pp = &(*pp)->i_dirty_next;
+    *pp = ei->i_dirty_next;
+    ei->i_dirty_next = NULL;
+    ei->i_dirty_list = false;
+}
+
+/* ============================================================================
+ * Directories
+ * ============================================================================ */
+
+static inline uint8_t ext4_file_type(ext4_fs_t *fs, uint16_t mode) {
+    if (!(fs->s_es.s_feature_incompat & EXT4_FEATURE_INCOMPAT_FILETYPE))
+        return 0;
+    switch (mode & EXT4_S_IFMT) {
+    case EXT4_S_IFREG: return EXT4_FT_REG_FILE;
+    case EXT4_S_IFDIR: return EXT4_FT_DIR;
+    case EXT4_S_IFLNK: return EXT4_FT_SYMLINK;
+    default: return 0;
+    }
+}
+
+static buffer_head_t *ext4_dir_bread(ext4_fs_t *fs, ext4_inode_info_t *dir,
+                                     uint32_t lblk, int *err) {
+    uint64_t pblk;
+    int ret = ext4_ext_map(fs, dir, lblk, &pblk, NULL, NULL);
+    if (ret <= 0) {
+        *err = ret < 0 ? ret : -EUCLEAN;   /* Directories have no holes */
+        return NULL;
+    }
+    buffer_head_t *bh = bread(fs->s_bdev, pblk, fs->s_block_size);
+    if (!bh) *err = -EIO;
+    return bh;
+}
+
+static inline bool dirent_valid(ext4_fs_t *fs, struct ext4_dir_entry_2 *de, uint32_t off) {
+    return de->rec_len >= 12 && (de->rec_len & 3) == 0 &&
+           off + de->rec_len <= fs->s_block_size &&
+           EXT4_DIR_REC_LEN(de->name_len) <= de->rec_len;
+}
+
+/*
+ * In-core name index: large directories get a hash of name -> block so
+ * lookups and duplicate checks read one block instead of all of them.
+ * Built on first use and kept in step with every insert and delete.
+ */
+static inline uint32_t dx_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    return h < 2 ? h + 2 : h;
+}
+
+static void ext4_dx_free(ext4_inode_info_t *dir) {
+    kfree(dir->i_dx);
+    dir->i_dx = NULL;
+    dir->i_dx_mask = dir->i_dx_used = 0;
+}
+
+static void dx_insert_slot(ext4_dx_slot_t *slots, uint32_t mask, uint32_t hash, uint32_t lblk) {
+    uint32_t i = hash & mask;
+    while (slots[i].hash > 1)
+        i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].lblk = lblk;
+}
+
+static int ext4_dx_insert(ext4_inode_info_t *dir, uint32_t hash, uint32_t lblk) {
+    if ((dir->i_dx_used + 1) * 2 > dir->i_dx_mask + 1) {
+        uint32_t cap = (dir->i_dx_mask + 1) * 2;
+        ext4_dx_slot_t *slots = kmalloc(cap * sizeof(*slots), GFP_KERNEL);
+        if (!slots) {
+            ext4_dx_free(dir);
+            return -ENOMEM;
+        }
+        memset(slots, 0, cap * sizeof(*slots));
+        dir->i_dx_used = 0;
+        for (uint32_t i = 0; i <= dir->i_dx_mask; i++) {
+            if (dir->i_dx[i].hash > 1) {
+                dx_insert_slot(slots, cap - 1, dir->i_dx[i].hash, dir->i_dx[i].lblk);
+                dir->i_dx_used++;
+            }
+        }
+        kfree(dir->i_dx);
+        dir->i_dx = slots;
+        dir->i_dx_mask = cap - 1;
+    }
+    dx_insert_slot(dir->i_dx, dir->i_dx_mask, hash, lblk);
+    dir->i_dx_used++;
+    return 0;
+}
+
+static void ext4_dx_remove(ext4_inode_info_t *dir, uint32_t hash, uint32_t lblk) {
+    for (uint32_t i = hash & dir->i_dx_mask; dir->i_dx[i].hash; i = (i + 1) & dir->i_dx_mask) {
+        if (dir->i_dx[i].hash == hash && dir->i_dx[i].lblk == lblk) {
+            dir->i_dx[i].hash = 1;
+            return;
+        }
+    }
+}
+
+/* Returns the matching entry in a directory block, NULL, or ERR via *err */
+static struct ext4_dir_entry_2 *ext4_search_block(ext4_fs_t *fs, buffer_head_t *bh,
+                                                  const char *name, size_t len,
+                                                  struct ext4_dir_entry_2 **prev_de, int *err) {
+    struct ext4_dir_entry_2 *prev = NULL;
+
+    for (uint32_t off = 0; off < fs->s_block_size; ) {
+        struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(bh->b_data + off);
+        if (!dirent_valid(fs, de, off)) {
+            *err = -EUCLEAN;
+            return NULL;
+        }
+        if (de->inode && de->name_len == len && memcmp(de->name, name, len) == 0) {
+            if (prev_de) *prev_de = prev;
+            return de;
+        }
+        prev = de;
+        off += de->rec_len;
+    }
+    return NULL;
+}
+
+static void ext4_dx_build(ext4_fs_t *fs, ext4_inode_info_t *dir) {
+    uint32_t nblocks = (uint32_t)(dir->i_size / fs->s_block_size);
+    int err;
+
+    dir->i_dx = kmalloc(1024 * sizeof(ext4_dx_slot_t), GFP_KERNEL);
+    if (!dir->i_dx) return;
+    memset(dir->i_dx, 0, 1024 * sizeof(ext4_dx_slot_t));
+    dir->i_dx_mask = 1023;
+    dir->i_dx_used = 0;
+
+    for (uint32_t b = 0; b < nblocks && dir->i_dx; b++) {
+        buffer_head_t *bh = ext4_dir_bread(fs, dir, b, &err);
+        if (!bh) {
+            ext4_dx_free(dir);
+            return;
+        }
+        for (uint32_t off = 0; off < fs->s_block_size && dir->i_dx; ) {
+            struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(bh->b_data + off);
+            if (!dirent_valid(fs, de, off)) {
+                ext4_dx_free(dir);
+                break;
+            }
+            if (de->inode)
+                ext4_dx_insert(dir, dx_hash(de->name, de->name_len), b);
+            off += de->rec_len;
+        }
+        brelse(bh);
+    }
+}
+
+/**
+ * ext4_find_entry
+ *
+ * Look a name up in a directory. On success returns the buffer holding
+ * the entry (caller releases it) with *res_de and *prev_de pointing into
+ * it and *lblk set to its block.
+ */
+static buffer_head_t *ext4_find_entry(ext4_fs_t *fs, ext4_inode_info_t *dir,
+                                      const char *name, size_t len,
+                                      struct ext4_dir_entry_2 **res_de,
+                                      struct ext4_dir_entry_2 **prev_de,
+                                      uint32_t *lblk, int *err) {
+    uint32_t nblocks = (uint32_t)(dir->i_size / fs->s_block_size);
+    *err = -ENOENT;
+
+    if (!dir->i_dx && nblocks >= EXT4_DX_MIN_BLOCKS)
+        ext4_dx_build(fs, dir);
+
+    if (dir->i_dx) {
+        uint32_t hash = dx_hash(name, len);
+        for (uint32_t i = hash & dir->i_dx_mask; dir->i_dx[i].hash; i = (i + 1) & dir->i_dx_mask) {
+            if (dir->i_dx[i].hash != hash)
+                continue;
+            buffer_head_t *bh = ext4_dir_bread(fs, dir, dir->i_dx[i].lblk, err);
+            if (!bh) return NULL;
+            if ((*res_de = ext4_search_block(fs, bh, name, len, prev_de, err))) {
+                if (lblk) *lblk = dir->i_dx[i].lblk;
+                return bh;
+            }
+            brelse(bh);
+            if (*err != -ENOENT) return NULL;
+        }
+        return NULL;
+    }
+
+    for (uint32_t b = 0; b < nblocks; b++) {
+        buffer_head_t *bh = ext4_dir_bread(fs, dir, b, err);
+        if (!bh) return NULL;
+        if ((*res_de = ext4_search_block(fs, bh, name, len, prev_de, err))) {
+            if (lblk) *lblk = b;
+            return bh;
+        }
+        brelse(bh);
+        if (*err != -ENOENT) return NULL;
+    }
+    return NULL;
+}
+
+static void dirent_fill(struct ext4_dir_entry_2 *de, uint32_t ino, uint16_t rec_len,
+                        const char *name, size_t len, uint8_t type) {
+    de->inode = ino;
+    de->rec_len = rec_len;
+    de->name_len = (uint8_t)len;
+    de->file_type = type;
+    memcpy(de->name, name, len);
+}
+
+/* Append an entry using the first slot with enough slack, else a new block */
+static int ext4_add_entry(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *dir,
+                          const char *name, size_t len, uint32_t ino, uint8_t type) {
+    uint32_t need = EXT4_DIR_REC_LEN(len);
+    uint32_t nblocks = (uint32_t)(dir->i_size / fs->s_block_size);
+    int ret = 0;
+
+    /* Linear inserts would leave a hash index stale; drop the index */
+    if (dir->i_raw.i_flags & EXT4_INDEX_FL)
+        dir->i_raw.i_flags &= ~EXT4_INDEX_FL;
+
+    for (uint32_t b = dir->i_dir_hint; b < nblocks; b++) {
+        buffer_head_t *bh = ext4_dir_bread(fs, dir, b, &ret);
+        if (!bh) return ret;
+
+        for (uint32_t off = 0; off < fs->s_block_size; ) {
+            struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(bh->b_data + off);
+            if (!dirent_valid(fs, de, off)) {
+                brelse(bh);
+                return -EUCLEAN;
+            }
+            uint32_t used = de->inode ? EXT4_DIR_REC_LEN(de->name_len) : 0;
+            if (de->rec_len - used >= need) {
+                if ((ret = jbd2_journal_get_write_access(handle, bh)) < 0) {
+                    brelse(bh);
+                    return ret;
+                }
+                if (used) {
+                    struct ext4_dir_entry_2 *nde = (struct ext4_dir_entry_2 *)((uint8_t *)de + used);
+                    dirent_fill(nde, ino, (uint16_t)(de->rec_len - used), name, len, type);
+                    de->rec_len = (uint16_t)used;
+                } else {
+                    dirent_fill(de, ino, de->rec_len, name, len, type);
+                }
+                mark_buffer_dirty(bh);
+                brelse(bh);
+                if (dir->i_dx)
+                    ext4_dx_insert(dir, dx_hash(name, len), b);
+                dir->i_raw.i_mtime = dir->i_raw.i_ctime = ext4_now();
+                return ext4_mark_inode_dirty(handle, fs, dir);
+            }
+            off += de->rec_len;
+        }
+        brelse(bh);
+        /* Full for this name length: later inserts start further on */
+        if (b == dir->i_dir_hint)
+            dir->i_dir_hint = b + 1;
+    }
+
+    /* No room: grow the directory by one block */
+    uint32_t count = 1;
+    uint64_t pblk;
+    if ((ret = ext4_new_blocks(handle, fs, ext4_inode_goal(fs, dir, nblocks), &count, &pblk)) < 0)
+        return ret;
+    if ((ret = ext4_ext_insert(handle, fs, dir, nblocks, pblk, 1)) < 0)
+        return ret;
+    ext4_add_iblocks(fs, dir, 1);
+
+    buffer_head_t *bh = getblk(fs->s_bdev, pblk, fs->s_block_size);
+    if (!bh) return -ENOMEM;
+    if ((ret = jbd2_journal_get_write_access(handle, bh)) == 0) {
+        memset(bh->b_data, 0, fs->s_block_size);
+        dirent_fill((struct ext4_dir_entry_2 *)bh->b_data, ino, (uint16_t)fs->s_block_size,
+                    name, len, type);
+        mark_buffer_dirty(bh);
+    }
+    brelse(bh);
+    if (ret < 0) return ret;
+
+    if (dir->i_dx)
+        ext4_dx_insert(dir, dx_hash(name, len), nblocks);
+    dir->i_dir_hint = nblocks;
+    dir->i_size += fs->s_block_size;
+    ext4_set_isize(&dir->i_raw, dir->i_size);
+    dir->i_raw.i_mtime = dir->i_raw.i_ctime = ext4_now();
+    return ext4_mark_inode_dirty(handle, fs, dir);
+}
+
+static int ext4_delete_entry(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *dir,
+                             buffer_head_t *bh, uint32_t lblk, struct ext4_dir_entry_2 *de,
+                             struct ext4_dir_entry_2 *prev) {
+    int ret = jbd2_journal_get_write_access(handle, bh);
+    if (ret < 0) return ret;
+
+    if (dir->i_dx)
+        ext4_dx_remove(dir, dx_hash(de->name, de->name_len), lblk);
+    if (lblk < dir->i_dir_hint)
+        dir->i_dir_hint = lblk;
+
+    if (prev)
+        prev->rec_len += de->rec_len;
+    else
+        de->inode = 0;
+    mark_buffer_dirty(bh);
+
+    dir->i_raw.i_mtime = dir->i_raw.i_ctime = ext4_now();
+    return ext4_mark_inode_dirty(handle, fs, dir);
+}
+
+static int ext4_dir_is_empty(ext4_fs_t *fs, ext4_inode_info_t *dir) {
+    uint32_t nblocks = (uint32_t)(dir->i_size / fs->s_block_size);
+    int ret = 0;
+
+    for (uint32_t b = 0; b < nblocks; b++) {
+        buffer_head_t *bh = ext4_dir_bread(fs, dir, b, &ret);
+        if (!bh) return ret;
+        for (uint32_t off = 0; off < fs->s_block_size; ) {
+            struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(bh->b_data + off);
+            if (!dirent_valid(fs, de, off)) {
+                brelse(bh);
+                return -EUCLEAN;
+            }
+            bool dot = (de->name_len == 1 && de->name[0] == '.') ||
+                       (de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.');
+            if (de->inode && !dot) {
+                brelse(bh);
+                return 0;
+            }
+            off += de->rec_len;
+        }
+        brelse(bh);
+    }
+    return 1;
+}
+
+/* ============================================================================
+ * Path resolution
+ * ============================================================================ */
+
+static int ext4_lookup_name(ext4_fs_t *fs, ext4_inode_info_t *dir, const char *name,
+                            size_t len, uint32_t *ino) {
+    struct ext4_dir_entry_2 *de;
+    int err;
+
+    if (!EXT4_S_ISDIR(dir->i_raw.i_mode))
+        return -ENOTDIR;
+    buffer_head_t *bh = ext4_find_entry(fs, dir, name, len, &de, NULL, NULL, &err);
+    if (!bh) return err;
+    *ino = de->inode;
+    brelse(bh);
+    return 0;
+}
+
+/**
+ * ext4_path_parent
+ *
+ * Resolve every component but the last. Returns the referenced parent
+ * directory and points name and len at the final component.
+ */
+static ext4_inode_info_t *ext4_path_parent(ext4_fs_t *fs, const char *path,
+                                           const char **name, size_t *len, int *err) {
+    ext4_inode_info_t *dir = ext4_iget(fs, EXT4_ROOT_INO, err);
+    if (!dir) return NULL;
+
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') p++;
+        const char *end = p;
+        while (*end && *end != '/') end++;
+        const char *next = end;
+        while (*next == '/') next++;
+
+        if (*next == '\0') {
+            *name = p;
+            *len = (size_t)(end - p);
+            if (*len == 0) {
+                *err = -EINVAL;
+                break;
+            }
+            if (*len > EXT4_NAME_LEN) {
+                *err = -ENAMETOOLONG;
+                break;
+            }
+            return dir;
+        }
+
+        uint32_t ino = 0;
+        if ((*err = ext4_lookup_name(fs, dir, p, (size_t)(end - p), &ino)) < 0)
+            break;
+        ext4_inode_info_t *child = ext4_iget(fs, ino, err);
+        if (!child) break;
+        ext4_iput(fs, dir);
+        dir = child;
+        p = next;
+    }
+    ext4_iput(fs, dir);
+    return NULL;
+}
+
+static ext4_inode_info_t *ext4_path_lookup(ext4_fs_t *fs, const char *path, int *err) {
+    const char *p = path;
+    while (*p == '/') p++;
+    if (*p == '\0')
+        return ext4_iget(fs, EXT4_ROOT_INO, err);
+
+    const char *name;
+    size_t len;
+    uint32_t ino = 0;
+    ext4_inode_info_t *dir = ext4_path_parent(fs, path, &name, &len, err);
+    if (!dir) return NULL;
+    *err = ext4_lookup_name(fs, dir, name, len, &ino);
+    ext4_iput(fs, dir);
+    if (*err < 0) return NULL;
+    return ext4_iget(fs, ino, err);
+}
+
+/* ============================================================================
+ * Namespace operations
+ * ============================================================================ */
+
+static int ext4_init_dir_block(handle_t *handle, ext4_fs_t *fs, ext4_inode_info_t *ei,
+                               uint32_t parent_ino) {
+    uint32_t count = 1;
+    uint64_t pblk;
+    int ret = ext4_new_blocks(handle, fs, ext4_inode_goal(fs, ei, 0), &count, &pblk);
+    if (ret < 0) return ret;
+    if ((ret = ext4_ext_insert(handle, fs, ei, 0, pblk, 1)) < 0)
+        return ret;
+    ext4_add_iblocks(fs, ei, 1);
+
+    buffer_head_t *bh = getblk(fs->s_bdev, pblk, fs->s_block_size);
+    if (!bh) return -ENOMEM;
+    if ((ret = jbd2_journal_get_write_access(handle, bh)) == 0) {
+        uint8_t type = ext4_file_type(fs, EXT4_S_IFDIR);
+        struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)bh->b_data;
+        memset(bh->b_data, 0, fs->s_block_size);
+        dirent_fill(de, ei->i_ino, EXT4_DIR_REC_LEN(1), ".", 1, type);
+        de = (struct ext4_dir_entry_2 *)(bh->b_data + EXT4_DIR_REC_LEN(1));
+        dirent_fill(de, parent_ino, (uint16_t)(fs->s_block_size - EXT4_DIR_REC_LEN(1)),
+                    "..", 2, type);
+        mark_buffer_dirty(bh);
+    }
+    brelse(bh);
+
+    ei->i_size = fs->s_block_size;
+    ext4_set_isize(&ei->i_raw, ei->i_size);
+    return ret;
+}
+
+static void ext4_inc_nlink(ext4_inode_info_t *dir) {
+    /* dir_nlink: past the 16-bit limit a count of 1 means "many" */
+    if (dir->i_raw.i_links_count > 1 && dir->i_raw.i_links_count < 65000)
+        dir->i_raw.i_links_count++;
+    else if (dir->i_raw.i_links_count >= 65000)
+        dir->i_raw.i_links_count = 1;
+}
+
+static void ext4_dec_nlink(ext4_inode_info_t *dir) {
+    if (dir->i_raw.i_links_count > 2)
+        dir->i_raw.i_links_count--;
+}
+
+static int ext4_create_at(ext4_fs_t *fs, ext4_inode_info_t *dir, const char *name,
+                          size_t len, uint16_t mode, uint32_t *ino_out) {
+    int ret;
+    uint32_t existing;
+
+    if (fs->s_rdonly) return -EROFS;
+    if (len == 0) return -EINVAL;
+    if (len > EXT4_NAME_LEN) return -ENAMETOOLONG;
+
+    ret = ext4_lookup_name(fs, dir, name, len, &existing);
+    if (ret != -ENOENT)
+        return ret == 0 ? -EEXIST : ret;
+
+    handle_t handle;
+    if (!jbd2_journal_start(fs->s_journal, &handle, 16))
+        return -ENOMEM;
+
+    ext4_inode_info_t *ei = ext4_new_inode(&handle, fs, dir, mode, &ret);
+    if (ei) {
+        if (EXT4_S_ISDIR(mode)) {
+            ei->i_raw.i_links_count = 2;
+            ret = ext4_init_dir_block(&handle, fs, ei, dir->i_ino);
+            if (ret == 0)
+                ext4_inc_nlink(dir);
+        }
+        if (ret == 0)
+            ret = ext4_mark_inode_dirty(&handle, fs, ei);
+        if (ret == 0)
+            ret = ext4_add_entry(&handle, fs, dir, name, len, ei->i_ino, ext4_file_type(fs, mode));
+        if (ret == 0 && ino_out)
+            *ino_out = ei->i_ino;
+        ext4_iput(fs, ei);
+    }
+    jbd2_journal_stop(&handle);
+    return ret;
+}
+
+static int ext4_do_create(ext4_fs_t *fs, const char *path, uint16_t mode, uint32_t *ino_out) {
+    const char *name;
+    size_t len;
+    int ret;
+
+    if (fs->s_rdonly) return -EROFS;
+
+    ext4_inode_info_t *dir = ext4_path_parent(fs, path, &name, &len, &ret);
+    if (!dir) return ret;
+    ret = ext4_create_at(fs, dir, name, len, mode, ino_out);
+    ext4_iput(fs, dir);
+    return ret;
+}
+
+int ext4_create(ext4_fs_t *fs, const char *path, uint16_t mode, uint32_t *ino) {
+    spin_lock(&fs->s_lock);
+    int ret = ext4_do_create(fs, path, EXT4_S_IFREG | (mode & 07777), ino);
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+int ext4_mkdir(ext4_fs_t *fs, const char *path, uint16_t mode) {
+    spin_lock(&fs->s_lock);
+    int ret = ext4_do_create(fs, path, EXT4_S_IFDIR | (mode & 07777), NULL);
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+static int ext4_remove_at(ext4_fs_t *fs, ext4_inode_info_t *dir, const char *name,
+                          size_t len, bool want_dir) {
+    int ret;
+
+    if (fs->s_rdonly) return -EROFS;
+    if (!EXT4_S_ISDIR(dir->i_raw.i_mode)) return -ENOTDIR;
+
+    struct ext4_dir_entry_2 *de, *prev;
+    uint32_t lblk;
+    buffer_head_t *bh = ext4_find_entry(fs, dir, name, len, &de, &prev, &lblk, &ret);
+    ext4_inode_info_t *ei = bh ? ext4_iget(fs, de->inode, &ret) : NULL;
+    if (!ei) goto out;
+
+    bool is_dir = EXT4_S_ISDIR(ei->i_raw.i_mode);
+    if (is_dir != want_dir) {
+        ret = is_dir ? -EISDIR : -ENOTDIR;
+        goto out;
+    }
+    if (is_dir && (ret = ext4_dir_is_empty(fs, ei)) <= 0) {
+        ret = ret == 0 ? -ENOTEMPTY : ret;
+        goto out;
+    }
+
+    handle_t handle;
+    if (!jbd2_journal_start(fs->s_journal, &handle, 16)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    ret = ext4_delete_entry(&handle, fs, dir, bh, lblk, de, prev);
+    if (ret == 0) {
+        if (is_dir) {
+            ext4_dec_nlink(dir);
+            ret = ext4_mark_inode_dirty(&handle, fs, dir);
+            ei->i_raw.i_links_count = 0;
+        } else {
+            ei->i_raw.i_links_count--;
+        }
+    }
+    if (ret == 0 && ei->i_raw.i_links_count == 0) {
+        /* Last link gone: drop cached data, then every block and the inode */
+        ext4_writeback_remove(fs, ei);
+        for (uint32_t i = 0; i < ei->i_delalloc_cap && ei->i_delalloc_count; i++) {
+            if (ei->i_delalloc[i]) {
+                kfree(ei->i_delalloc[i]);
+                ei->i_delalloc[i] = NULL;
+                ei->i_delalloc_count--;
+                fs->s_dirty_blocks--;
+            }
+        }
+        ret = ext4_ext_free_tree(&handle, fs, ei, ext_root(ei), is_dir);
+        if (ret == 0) {
+            struct ext4_extent_header *eh = ext_root(ei);
+            eh->eh_entries = 0;
+            eh->eh_depth = 0;
+            eh->eh_max = 4;
+            ret = ext4_free_inode(&handle, fs, ei);
+        }
+    } else if (ret == 0) {
+        ei->i_raw.i_ctime = ext4_now();
+        ret = ext4_mark_inode_dirty(&handle, fs, ei);
+    }
+    jbd2_journal_stop(&handle);
+
+out:
+    if (ei) ext4_iput(fs, ei);
+    brelse(bh);
+    return ret;
+}
+
+static int ext4_do_remove(ext4_fs_t *fs, const char *path, bool want_dir) {
+    const char *name;
+    size_t len;
+    int ret;
+
+    if (fs->s_rdonly) return -EROFS;
+
+    ext4_inode_info_t *dir = ext4_path_parent(fs, path, &name, &len, &ret);
+    if (!dir) return ret;
+    ret = ext4_remove_at(fs, dir, name, len, want_dir);
+    ext4_iput(fs, dir);
+    return ret;
+}
+
+int ext4_unlink(ext4_fs_t *fs, const char *path) {
+    spin_lock(&fs->s_lock);
+    int ret = ext4_do_remove(fs, path, false);
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+int ext4_rmdir(ext4_fs_t *fs, const char *path) {
+    spin_lock(&fs->s_lock);
+    int ret = ext4_do_remove(fs, path, true);
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+int ext4_lookup(ext4_fs_t *fs, const char *path, uint32_t *ino) {
+    int ret = 0;
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *ei = ext4_path_lookup(fs, path, &ret);
+    if (ei) {
+        *ino = ei->i_ino;
+        ext4_iput(fs, ei);
+    }
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+int ext4_stat(ext4_fs_t *fs, uint32_t ino, inode_t *st) {
+    int ret = 0;
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *ei = ext4_iget(fs, ino, &ret);
+    if (ei) {
+        /* Attributes only: st may be a live VFS inode */
+        st->ino = ino;
+        st->size = ei->i_size;
+        st->mode = ei->i_raw.i_mode;
+        st->nlink = ei->i_raw.i_links_count;
+        st->uid = ei->i_raw.i_uid | ((uint32_t)ei->i_raw.i_uid_high << 16);
+        st->gid = ei->i_raw.i_gid | ((uint32_t)ei->i_raw.i_gid_high << 16);
+        st->atime = ei->i_raw.i_atime;
+        st->mtime = ei->i_raw.i_mtime;
+        st->ctime = ei->i_raw.i_ctime;
+        ext4_iput(fs, ei);
+    }
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+/* ============================================================================
+ * File data
+ * ============================================================================ */
+
+int ext4_read(ext4_fs_t *fs, uint32_t ino, void *buf, size_t count, uint64_t offset) {
+    int ret = 0;
+    size_t done = 0;
+
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *ei = ext4_iget(fs, ino, &ret);
+    if (!ei) goto out;
+    if (EXT4_S_ISDIR(ei->i_raw.i_mode)) {
+        ret = -EISDIR;
+        goto put;
+    }
+    if (offset >= ei->i_size) goto put;
+    if (count > ei->i_size - offset)
+        count = (size_t)(ei->i_size - offset);
+
+    while (done < count) {
+        uint64_t pos = offset + done;
+        uint32_t lblk = (uint32_t)(pos / fs->s_block_size);
+        uint32_t boff = (uint32_t)(pos % fs->s_block_size);
+        size_t n = fs->s_block_size - boff;
+        if (n > count - done) n = count - done;
+
+        uint64_t pblk;
+        bool unwritten = false;
+        if (lblk < ei->i_delalloc_cap && ei->i_delalloc[lblk]) {
+            memcpy((uint8_t *)buf + done, ei->i_delalloc[lblk] + boff, n);
+        } else if ((ret = ext4_ext_map(fs, ei, lblk, &pblk, NULL, &unwritten)) < 0) {
+            goto put;
+        } else if (ret == 0 || unwritten) {
+            memset((uint8_t *)buf + done, 0, n);
+        } else {
+            buffer_head_t *bh = bread(fs->s_bdev, pblk, fs->s_block_size);
+            if (!bh) {
+                ret = -EIO;
+                goto put;
+            }
+            memcpy((uint8_t *)buf + done, bh->b_data + boff, n);
+            brelse(bh);
+        }
+        done += n;
+    }
+    ret = 0;
+put:
+    ext4_iput(fs, ei);
+out:
+    spin_unlock(&fs->s_lock);
+    return ret < 0 ? ret : (int)done;
+}
+
+int ext4_write(ext4_fs_t *fs, uint32_t ino, const void *buf, size_t count, uint64_t offset) {
+    int ret = 0;
+    size_t done = 0;
+
+    if (fs->s_rdonly) return -EROFS;
+
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *ei = ext4_iget(fs, ino, &ret);
+    if (!ei) goto out;
+    if (!EXT4_S_ISREG(ei->i_raw.i_mode)) {
+        ret = EXT4_S_ISDIR(ei->i_raw.i_mode) ? -EISDIR : -EINVAL;
+        goto put;
+    }
+
+    while (done < count) {
+        uint64_t pos = offset + done;
+        uint32_t lblk = (uint32_t)(pos / fs->s_block_size);
+        uint32_t boff = (uint32_t)(pos % fs->s_block_size);
+        size_t n = fs->s_block_size - boff;
+        if (n > count - done) n = count - done;
+
+        uint64_t pblk;
+        bool unwritten = false;
+        if (lblk < ei->i_delalloc_cap && ei->i_delalloc[lblk]) {
+            memcpy(ei->i_delalloc[lblk] + boff, (const uint8_t *)buf + done, n);
+        } else if ((ret = ext4_ext_map(fs, ei, lblk, &pblk, NULL, &unwritten)) < 0) {
+            goto put;
+        } else if (ret == 1) {
+            if (unwritten) {
+                /* Converting preallocated extents is not supported */
+                ret = -ENOTIMPL;
+                goto put;
+            }
+            /* Overwrite in place through the buffer cache */
+            buffer_head_t *bh = n == fs->s_block_size
+                ? getblk(fs->s_bdev, pblk, fs->s_block_size)
+                : bread(fs->s_bdev, pblk, fs->s_block_size);
+            if (!bh) {
+                ret = -EIO;
+                goto put;
+            }
+            memcpy(bh->b_data + boff, (const uint8_t *)buf + done, n);
+            mark_buffer_dirty(bh);
+            brelse(bh);
+        } else {
+            if ((ret = ext4_delalloc_reserve(fs, ei, lblk)) < 0)
+                goto put;
+            memcpy(ei->i_delalloc[lblk] + boff, (const uint8_t *)buf + done, n);
+        }
+        done += n;
+    }
+    ret = 0;
+
+    if (offset + done > ei->i_size)
+        ei->i_size = offset + done;
+    ext4_mark_delalloc(fs, ei);
+
+    if (fs->s_dirty_blocks > EXT4_DELALLOC_MAX)
+        ret = ext4_writeback_all(fs);
+put:
+    ext4_iput(fs, ei);
+out:
+    spin_unlock(&fs->s_lock);
+    return ret < 0 ? ret : (int)done;
+}
+
+/**
+ * ext4_fsync
+ *
+ * Write back the file's delayed data and wait for the transaction that
+ * last touched it. Concurrent callers share one commit.
+ */
+int ext4_fsync(ext4_fs_t *fs, uint32_t ino) {
+    int ret = 0;
+    if (fs->s_rdonly) return 0;
+
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *ei = ext4_iget(fs, ino, &ret);
+    if (!ei) {
+        spin_unlock(&fs->s_lock);
+        return ret;
+    }
+    if (ei->i_dirty_list) {
+        ext4_writeback_remove(fs, ei);
+        ret = ext4_writeback_inode(fs, ei);
+    }
+    uint32_t tid = ei->i_sync_tid;
+    ext4_iput(fs, ei);
+    spin_unlock(&fs->s_lock);
+
+    if (ret == 0)
+        ret = jbd2_complete_transaction(fs->s_journal, tid);
+    return ret;
+}
+
+void ext4_journal_stats(ext4_fs_t *fs, ext4_journal_stats_t *stats) {
+    journal_t *j = fs->s_journal;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!j) return;
+    spin_lock(&fs->s_lock);
+    stats->commits = j->j_stat_commits;
+    stats->blocks_logged = j->j_stat_blocks_logged;
+    stats->fsync_batched = j->j_stat_fsync_batched;
+    spin_unlock(&fs->s_lock);
+}
+
+/* ============================================================================
+ * Mount / unmount
+ * ============================================================================ */
+
+static int ext4_commit_super(ext4_fs_t *fs) {
+    struct ext4_super_block *es = &fs->s_es;
+
+    es->s_free_blocks_count_lo = (uint32_t)fs->s_free_blocks;
+    es->s_free_blocks_count_hi = (uint32_t)(fs->s_free_blocks >> 32);
+    es->s_free_inodes_count = fs->s_free_inodes;
+    es->s_wtime = ext4_now();
+    return block_write(fs->s_bdev, EXT4_SUPERBLOCK_OFFSET, es, sizeof(*es));
+}
+
+int ext4_sync_fs(ext4_fs_t *fs) {
+    if (fs->s_rdonly) return 0;
+
+    spin_lock(&fs->s_lock);
+    int ret = ext4_writeback_all(fs);
+    if (ret == 0)
+        ret = jbd2_journal_commit_transaction(fs->s_journal);
+    if (ret == 0)
+        ret = ext4_commit_super(fs);
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+static void ext4_put_groups(ext4_fs_t *fs) {
+    for (uint32_t i = 0; fs->s_group_desc && i < fs->s_gdb_count; i++)
+        brelse(fs->s_group_desc[i]);
+    kfree(fs->s_group_desc);
+    fs->s_group_desc = NULL;
+}
+
+static int ext4_load_groups(ext4_fs_t *fs) {
+    fs->s_group_desc = kmalloc(fs->s_gdb_count * sizeof(buffer_head_t *), GFP_KERNEL);
+    if (!fs->s_group_desc) return -ENOMEM;
+    memset(fs->s_group_desc, 0, fs->s_gdb_count * sizeof(buffer_head_t *));
+
+    uint64_t first = fs->s_es.s_first_data_block + 1;
+    for (uint32_t i = 0; i < fs->s_gdb_count; i++) {
+        fs->s_group_desc[i] = bread(fs->s_bdev, first + i, fs->s_block_size);
+        if (!fs->s_group_desc[i]) return -EIO;
+    }
+
+    fs->s_free_blocks = 0;
+    fs->s_free_inodes = 0;
+    for (uint32_t g = 0; g < fs->s_groups_count; g++) {
+        struct ext4_group_desc *gd = ext4_get_group_desc(fs, g, NULL);
+        fs->s_free_blocks += GD_GET32(fs, gd, bg_free_blocks_count);
+        fs->s_free_inodes += GD_GET32(fs, gd, bg_free_inodes_count);
+    }
+    return 0;
+}
+
+/* Map every block of the journal inode for jbd2 */
+static journal_t *ext4_load_journal(ext4_fs_t *fs) {
+    int err;
+    ext4_inode_info_t *ji = ext4_iget(fs, fs->s_es.s_journal_inum, &err);
+    if (!ji) return NULL;
+
+    uint32_t nr = (uint32_t)(ji->i_size / fs->s_block_size);
+    uint64_t *map = nr ? kmalloc(nr * sizeof(uint64_t), GFP_KERNEL) : NULL;
+    journal_t *j = NULL;
+
+    for (uint32_t l = 0; map && l < nr; ) {
+        uint64_t pblk;
+        uint32_t len;
+        if (ext4_ext_map(fs, ji, l, &pblk, &len, NULL) != 1) {
+            pr_err("ext4: journal inode is not fully mapped by extents\n");
+            goto out;
+        }
+        for (uint32_t i = 0; i < len && l < nr; i++, l++)
+            map[l] = pblk + i;
+    }
+    if (map)
+        j = jbd2_journal_load(fs->s_bdev, fs->s_block_size, map, nr, &fs->s_lock);
+out:
+    if (!j) kfree(map);
+    ji->i_count--;
+    ext4_destroy_inode(fs, ji);
+    return j;
+}
+
+static int ext4_read_super(ext4_fs_t *fs) {
+    struct ext4_super_block *es = &fs->s_es;
+
+    if (block_read(fs->s_bdev, EXT4_SUPERBLOCK_OFFSET, es, sizeof(*es)) < 0)
+        return -EIO;
+    if (es->s_magic != EXT4_SUPER_MAGIC)
+        return -EINVAL;
+    if (es->s_feature_incompat & ~EXT4_FEATURE_INCOMPAT_SUPP) {
+        pr_err("ext4: unsupported incompatible features 0x%x\n",
+               es->s_feature_incompat & ~EXT4_FEATURE_INCOMPAT_SUPP);
+        return -EINVAL;
+    }
+
+    fs->s_block_size = 1024U << es->s_log_block_size;
+    if (fs->s_block_size > PAGE_SIZE)
+        return -EINVAL;
+    fs->s_blocks_per_group = es->s_blocks_per_group;
+    fs->s_inodes_per_group = es->s_inodes_per_group;
+    fs->s_inode_size = es->s_rev_level ? es->s_inode_size : EXT4_GOOD_OLD_INODE_SIZE;
+    fs->s_first_ino = es->s_rev_level ? es->s_first_ino : 11;
+    fs->s_desc_size = (es->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) ? es->s_desc_size : 32;
+    fs->s_blocks_count = es->s_blocks_count_lo;
+    if (es->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+        fs->s_blocks_count |= (uint64_t)es->s_blocks_count_hi << 32;
+
+    if (fs->s_blocks_per_group == 0 || fs->s_inodes_per_group == 0 || fs->s_desc_size < 32)
+        return -EINVAL;
+    fs->s_groups_count = (uint32_t)((fs->s_blocks_count - es->s_first_data_block +
+                                     fs->s_blocks_per_group - 1) / fs->s_blocks_per_group);
+    uint32_t per_block = fs->s_block_size / fs->s_desc_size;
+    fs->s_gdb_count = (fs->s_groups_count + per_block - 1) / per_block;
+    return 0;
+}
+
+/**
+ * ext4_mount
+ *
+ * Mount the ext4 filesystem on a registered block device, replaying the
+ * journal if the last shutdown was unclean.
+ */
+int ext4_mount(const char *device, unsigned int flags, ext4_fs_t **out) {
+    block_device_t *bdev = block_device_lookup(device);
+    if (!bdev) return -ENOENT;
+
+    ext4_fs_t *fs = kmalloc(sizeof(*fs), GFP_KERNEL);
+    if (!fs) return -ENOMEM;
+    memset(fs, 0, sizeof(*fs));
+    fs->s_bdev = bdev;
+    fs->s_flags = flags;
+
+    int ret = ext4_read_super(fs);
+    if (ret < 0) goto fail;
+
+    struct ext4_super_block *es = &fs->s_es;
+    fs->s_rdonly = (flags & EXT4_MOUNT_RDONLY) ||
+                   (es->s_feature_ro_compat & ~EXT4_FEATURE_RO_COMPAT_SUPP) ||
+                   es->s_log_cluster_size != es->s_log_block_size ||
+                   !(es->s_feature_compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL);
+    if (fs->s_rdonly && !(flags & EXT4_MOUNT_RDONLY))
+        pr_info("ext4: %s has features this driver cannot write, mounting read-only\n", device);
+
+    if ((ret = ext4_load_groups(fs)) < 0) goto fail;
+
+    if (es->s_feature_compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL) {
+        fs->s_journal = ext4_load_journal(fs);
+        if (!fs->s_journal) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        journal_superblock_t *jsb = (journal_superblock_t *)fs->s_journal->j_sb_bh->b_data;
+        if (jsb->s_start != 0) {
+            if ((ret = jbd2_journal_recover(fs->s_journal)) < 0)
+                goto fail;
+            /* Replay wrote behind the cache's back: reload metadata */
+            ext4_put_groups(fs);
+            invalidate_bdev(bdev);
+            if ((ret = ext4_read_super(fs)) < 0 || (ret = ext4_load_groups(fs)) < 0)
+                goto fail;
+        }
+        if (flags & EXT4_MOUNT_GROUP_COMMIT)
+            fs->s_journal->j_flags |= JBD2_GROUP_COMMIT;
+    }
+
+    fs->s_bb_hint = kmalloc(fs->s_groups_count * sizeof(uint32_t), GFP_KERNEL);
+    fs->s_ib_hint = kmalloc(fs->s_groups_count * sizeof(uint32_t), GFP_KERNEL);
+    if (!fs->s_bb_hint || !fs->s_ib_hint) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+    memset(fs->s_bb_hint, 0, fs->s_groups_count * sizeof(uint32_t));
+    memset(fs->s_ib_hint, 0, fs->s_groups_count * sizeof(uint32_t));
+    fs->s_generation = ext4_now();
+
+    int err;
+    ext4_inode_info_t *root = ext4_iget(fs, EXT4_ROOT_INO, &err);
+    if (!root || !EXT4_S_ISDIR(root->i_raw.i_mode)) {
+        ret = root ? -EUCLEAN : err;
+        if (root) ext4_iput(fs, root);
+        goto fail;
+    }
+    ext4_iput(fs, root);
+
+    if (!fs->s_rdonly) {
+        es->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_RECOVER;
+        es->s_mnt_count++;
+        es->s_mtime = ext4_now();
+        if ((ret = ext4_commit_super(fs)) < 0 || (ret = block_flush(bdev)) < 0)
+            goto fail;
+    }
+
+    pr_debug("ext4: mounted %s (%u groups, %u-byte blocks%s)\n", device,
+             fs->s_groups_count, fs->s_block_size, fs->s_rdonly ? ", read-only" : "");
+    *out = fs;
+    return 0;
+
+fail:
+    if (fs->s_journal) jbd2_journal_destroy(fs->s_journal, false);
+    ext4_put_groups(fs);
+    kfree(fs->s_bb_hint);
+    kfree(fs->s_ib_hint);
+    kfree(fs);
+    invalidate_bdev(bdev);
+    return ret;
+}
+
+static void ext4_release(ext4_fs_t *fs) {
+    for (unsigned int h = 0; h < (1U << EXT4_ICACHE_BITS); h++) {
+        while (fs->s_icache[h])
+            ext4_destroy_inode(fs, fs->s_icache[h]);
+    }
+    ext4_put_groups(fs);
+    invalidate_bdev(fs->s_bdev);
+    kfree(fs->s_bb_hint);
+    kfree(fs->s_ib_hint);
+    kfree(fs);
+}
+
+int ext4_umount(ext4_fs_t *fs) {
+    int ret = 0;
+
+    spin_lock(&fs->s_lock);
+    if (!fs->s_rdonly) {
+        ret = ext4_writeback_all(fs);
+        jbd2_journal_destroy(fs->s_journal, ret == 0);
+        fs->s_journal = NULL;
+        if (ret == 0) {
+            fs->s_es.s_feature_incompat &= ~EXT4_FEATURE_INCOMPAT_RECOVER;
+            ret = ext4_commit_super(fs);
+        }
+        if (sync_blockdev(fs->s_bdev) < 0 || block_flush(fs->s_bdev) < 0)
+            ret = -EIO;
+    } else if (fs->s_journal) {
+        jbd2_journal_destroy(fs->s_journal, false);
+    }
+    spin_unlock(&fs->s_lock);
+
+    ext4_release(fs);
+    return ret;
+}
+
+/**
+ * ext4_shutdown
+ *
+ * Commit what has been written so far and stop without checkpointing or
+ * marking the filesystem clean, leaving the image exactly as a power
+ * failure right after the commit would. Used to exercise recovery.
+ */
+int ext4_shutdown(ext4_fs_t *fs) {
+    int ret = 0;
+
+    spin_lock(&fs->s_lock);
+    if (!fs->s_rdonly)
+        ret = ext4_writeback_all(fs);
+    if (fs->s_journal)
+        jbd2_journal_destroy(fs->s_journal, false);
+    fs->s_journal = NULL;
+    spin_unlock(&fs->s_lock);
+
+    ext4_release(fs);
+    return ret;
+}
+
+/* ============================================================================
+ * VFS glue
+ *
+ * VFS inodes are thin handles over the ext4 inode cache: each carries the
+ * ext4 inode number, and file data stays in ext4's delayed-allocation
+ * cache rather than the generic page cache.
+ * ============================================================================ */
+
+static const inode_operations_t ext4_dir_inode_ops;
+static const file_operations_t ext4_file_ops;
+static const file_operations_t ext4_dir_ops;
+static const address_space_operations_t ext4_aops;
+
+static inline ext4_fs_t *EXT4_SB(super_block_t *sb) {
+    return (ext4_fs_t *)sb->fs_info;
+}
+
+static inode_t *ext4_vfs_iget(super_block_t *sb, uint32_t ino, int *err) {
+    inode_t *inode = new_inode(sb);
+    if (!inode) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    if ((*err = ext4_stat(EXT4_SB(sb), ino, inode)) < 0) {
+        iput(inode);
+        return NULL;
+    }
+    if (S_ISDIR(inode->mode)) {
+        inode->i_op = &ext4_dir_inode_ops;
+        inode->i_fop = &ext4_dir_ops;
+    } else {
+        inode->i_fop = &ext4_file_ops;
+        inode->i_data.a_ops = &ext4_aops;
+    }
+    return inode;
+}
+
+static int ext4_vfs_lookup(inode_t *dir, const char *name, size_t len, inode_t **res) {
+    ext4_fs_t *fs = EXT4_SB(dir->sb);
+    uint32_t ino = 0;
+    int ret = 0;
+
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *ei = ext4_iget(fs, dir->ino, &ret);
+    if (ei) {
+        ret = ext4_lookup_name(fs, ei, name, len, &ino);
+        ext4_iput(fs, ei);
+    }
+    spin_unlock(&fs->s_lock);
+    if (ret < 0) return ret;
+
+    *res = ext4_vfs_iget(dir->sb, ino, &ret);
+    return *res ? 0 : ret;
+}
+
+static int ext4_vfs_create_at(inode_t *dir, const char *name, size_t len, uint16_t mode,
+                              uint32_t *ino) {
+    ext4_fs_t *fs = EXT4_SB(dir->sb);
+    int ret = 0;
+
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *ei = ext4_iget(fs, dir->ino, &ret);
+    if (ei) {
+        ret = ext4_create_at(fs, ei, name, len, mode, ino);
+        ext4_iput(fs, ei);
+    }
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+static int ext4_vfs_create(inode_t *dir, const char *name, size_t len, uint16_t mode,
+                           inode_t **res) {
+    uint32_t ino;
+    int ret = ext4_vfs_create_at(dir, name, len, EXT4_S_IFREG | (mode & 07777), &ino);
+    if (ret < 0) return ret;
+    *res = ext4_vfs_iget(dir->sb, ino, &ret);
+    return *res ? 0 : ret;
+}
+
+static int ext4_vfs_mkdir(inode_t *dir, const char *name, size_t len, uint16_t mode) {
+    return ext4_vfs_create_at(dir, name, len, EXT4_S_IFDIR | (mode & 07777), NULL);
+}
+
+static int ext4_vfs_remove(inode_t *dir, const char *name, size_t len, bool want_dir) {
+    ext4_fs_t *fs = EXT4_SB(dir->sb);
+    int ret = 0;
+
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *ei = ext4_iget(fs, dir->ino, &ret);
+    if (ei) {
+        ret = ext4_remove_at(fs, ei, name, len, want_dir);
+        ext4_iput(fs, ei);
+    }
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+static int ext4_vfs_unlink(inode_t *dir, const char *name, size_t len) {
+    return ext4_vfs_remove(dir, name, len, false);
+}
+
+static int ext4_vfs_rmdir(inode_t *dir, const char *name, size_t len) {
+    return ext4_vfs_remove(dir, name, len, true);
+}
+
+static int64_t ext4_file_read(file_t *file, void *buf, size_t count, uint64_t *pos) {
+    inode_t *inode = file->inode;
+    int ret = ext4_read(EXT4_SB(inode->sb), inode->ino, buf, count, *pos);
+    if (ret > 0) *pos += (uint64_t)ret;
+    return ret;
+}
+
+/* Writes bypass the page cache, so they drop what it holds from the first written page on */
+static int64_t ext4_file_write(file_t *file, const void *buf, size_t count, uint64_t *pos) {
+    inode_t *inode = file->inode;
+    int ret = ext4_write(EXT4_SB(inode->sb), inode->ino, buf, count, *pos);
+    if (ret > 0) {
+        if (inode->i_data.nrpages) truncate_inode_pages(&inode->i_data, *pos >> PAGE_SHIFT);
+        inode_inc_iversion(inode);
+        *pos += (uint64_t)ret;
+        if (*pos > inode->size) inode->size = *pos;
+    }
+    return ret;
+}
+
+/* Fill a page cache page for mmap; reads still go straight to ext4 */
+static int ext4_readpage(address_space_t *mapping, page_t *page) {
+    inode_t *inode = mapping->host;
+    char *data = page_to_virt(page);
+    int ret = ext4_read(EXT4_SB(inode->sb), inode->ino, data, PAGE_SIZE,
+                        page->index << PAGE_SHIFT);
+    if (ret < 0) return ret;
+    memset(data + ret, 0, PAGE_SIZE - (size_t)ret);
+    return 0;
+}
+
+static int ext4_file_fsync(file_t *file) {
+    return ext4_fsync(EXT4_SB(file->inode->sb), file->inode->ino);
+}
+
+/* Emit entries from file->f_pos onwards; f_pos counts live entries */
+static int ext4_dir_readdir(file_t *file, filldir_t filldir, void *ctx) {
+    ext4_fs_t *fs = EXT4_SB(file->inode->sb);
+    uint64_t index = 0;
+    int ret = 0;
+
+    spin_lock(&fs->s_lock);
+    ext4_inode_info_t *dir = ext4_iget(fs, file->inode->ino, &ret);
+    if (!dir) goto out;
+
+    uint32_t nblocks = (uint32_t)(dir->i_size / fs->s_block_size);
+    for (uint32_t b = 0; b < nblocks; b++) {
+        buffer_head_t *bh = ext4_dir_bread(fs, dir, b, &ret);
+        if (!bh) break;
+        for (uint32_t off = 0; off < fs->s_block_size; ) {
+            struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(bh->b_data + off);
+            if (!dirent_valid(fs, de, off)) {
+                ret = -EUCLEAN;
+                break;
+            }
+            off += de->rec_len;
+            if (!de->inode || index++ < file->f_pos) continue;
+
+            uint16_t mode = de->file_type == EXT4_FT_DIR ? S_IFDIR :
+                            de->file_type == EXT4_FT_REG_FILE ? S_IFREG : 0;
+            if (filldir(ctx, de->name, de->name_len, de->inode, mode)) {
+                brelse(bh);
+                goto done;
+            }
+            file->f_pos++;
+        }
+        brelse(bh);
+        if (ret < 0) break;
+    }
+done:
+    ext4_iput(fs, dir);
+out:
+    spin_unlock(&fs->s_lock);
+    return ret;
+}
+
+static int ext4_vfs_sync_fs(super_block_t *sb) {
+    return ext4_sync_fs(EXT4_SB(sb));
+}
+
+static void ext4_put_super(super_block_t *sb) {
+    ext4_umount(EXT4_SB(sb));
+    sb->fs_info = NULL;
+}
+
+static const inode_operations_t ext4_dir_inode_ops = {
+    .lookup = ext4_vfs_lookup,
+    .create = ext4_vfs_create,
+    .mkdir  = ext4_vfs_mkdir,
+    .unlink = ext4_vfs_unlink,
+    .rmdir  = ext4_vfs_rmdir,
+};
+
+static const file_operations_t ext4_file_ops = {
+    .read  = ext4_file_read,
+    .write = ext4_file_write,
+    .fsync = ext4_file_fsync,
+};
+
+static const address_space_operations_t ext4_aops = {
+    .readpage = ext4_readpage,
+};
+
+static const file_operations_t ext4_dir_ops = {
+    .readdir = ext4_dir_readdir,
+};
+
+static const super_operations_t ext4_super_ops = {
+    .sync_fs   = ext4_vfs_sync_fs,
+    .put_super = ext4_put_super,
+};
+
+static int ext4_fill_super(super_block_t *sb, const char *device) {
+    ext4_fs_t *fs;
+    int ret = ext4_mount(device, EXT4_MOUNT_GROUP_COMMIT, &fs);
+    if (ret < 0) return ret;
+
+    sb->fs_info = fs;
+    sb->s_op = &ext4_super_ops;
+    sb->root = ext4_vfs_iget(sb, EXT4_ROOT_INO, &ret);
+    if (!sb->root) {
+        ext4_umount(fs);
+        sb->fs_info = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+static file_system_type_t ext4_fs_type = {
+    .name  = "ext4",
+    .mount = ext4_fill_super,
+};
+
+int register_ext4_fs(void) {
+    return register_filesystem(&ext4_fs_type);
+}
@@ -0,0 +1,432 @@
+/**
+ * Ext4 filesystem - private definitions
+ *
+ * On-disk layouts for ext4 and its JBD2 journal, plus the in-memory
+ * state shared by ext4.c and jbd2.c. All ext4 fields are little-endian
+ * (native on our targets); all JBD2 fields are big-endian.
+ */
+
+#ifndef __EXT4_H__
+#define __EXT4_H__
+
+#include <kernel.h>
+
+#define EXT4_SUPER_MAGIC        0xEF53
+#define EXT4_SUPERBLOCK_OFFSET  1024
+#define EXT4_ROOT_INO           2
+#define EXT4_JOURNAL_INO        8
+#define EXT4_NAME_LEN           255
+
+/* Feature flags */
+#define EXT4_FEATURE_COMPAT_HAS_JOURNAL         0x0004
+
+#define EXT4_FEATURE_INCOMPAT_FILETYPE          0x0002
+#define EXT4_FEATURE_INCOMPAT_RECOVER           0x0004
+#define EXT4_FEATURE_INCOMPAT_EXTENTS           0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT             0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG           0x0200
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR          0x4000
+#define EXT4_FEATURE_INCOMPAT_SUPP  (EXT4_FEATURE_INCOMPAT_FILETYPE | \
+                                     EXT4_FEATURE_INCOMPAT_RECOVER | \
+                                     EXT4_FEATURE_INCOMPAT_EXTENTS | \
+                                     EXT4_FEATURE_INCOMPAT_64BIT | \
+                                     EXT4_FEATURE_INCOMPAT_FLEX_BG | \
+                                     EXT4_FEATURE_INCOMPAT_LARGEDIR)
+
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER     0x0001
+#define EXT4_FEATURE_RO_COMPAT_LARGE_FILE       0x0002
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE        0x0008
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK        0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE      0x0040
+/* Anything else (checksums, bigalloc, quota, ...) mounts read-only */
+#define EXT4_FEATURE_RO_COMPAT_SUPP (EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER | \
+                                     EXT4_FEATURE_RO_COMPAT_LARGE_FILE | \
+                                     EXT4_FEATURE_RO_COMPAT_HUGE_FILE | \
+                                     EXT4_FEATURE_RO_COMPAT_DIR_NLINK | \
+                                     EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE)
+
+/* Inode modes and flags */
+#define EXT4_S_IFMT     0xF000
+#define EXT4_S_IFREG    0x8000
+#define EXT4_S_IFDIR    0x4000
+#define EXT4_S_IFLNK    0xA000
+#define EXT4_S_ISDIR(m) (((m) & EXT4_S_IFMT) == EXT4_S_IFDIR)
+#define EXT4_S_ISREG(m) (((m) & EXT4_S_IFMT) == EXT4_S_IFREG)
+
+#define EXT4_INDEX_FL       0x00001000  /* Hash-indexed directory */
+#define EXT4_HUGE_FILE_FL   0x00040000  /* i_blocks in fs blocks */
+#define EXT4_EXTENTS_FL     0x00080000
+
+#define EXT4_FT_REG_FILE    1
+#define EXT4_FT_DIR         2
+#define EXT4_FT_SYMLINK     7
+
+struct ext4_super_block {
+    uint32_t s_inodes_count;
+    uint32_t s_blocks_count_lo;
+    uint32_t s_r_blocks_count_lo;
+    uint32_t s_free_blocks_count_lo;
+    uint32_t s_free_inodes_count;
+    uint32_t s_first_data_block;
+    uint32_t s_log_block_size;
+    uint32_t s_log_cluster_size;
+    uint32_t s_blocks_per_group;
+    uint32_t s_clusters_per_group;
+    uint32_t s_inodes_per_group;
+    uint32_t s_mtime;
+    uint32_t s_wtime;
+    uint16_t s_mnt_count;
+    uint16_t s_max_mnt_count;
+    uint16_t s_magic;
+    uint16_t s_state;
+    uint16_t s_errors;
+    uint16_t s_minor_rev_level;
+    uint32_t s_lastcheck;
+    uint32_t s_checkinterval;
+    uint32_t s_creator_os;
+    uint32_t s_rev_level;
+    uint16_t s_def_resuid;
+    uint16_t s_def_resgid;
+    uint32_t s_first_ino;
+    uint16_t s_inode_size;
+    uint16_t s_block_group_nr;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t  s_uuid[16];
+    char     s_volume_name[16];
+    char     s_last_mounted[64];
+    uint32_t s_algorithm_usage_bitmap;
+    uint8_t  s_prealloc_blocks;
+    uint8_t  s_prealloc_dir_blocks;
+    uint16_t s_reserved_gdt_blocks;
+    uint8_t  s_journal_uuid[16];
+    uint32_t s_journal_inum;
+    uint32_t s_journal_dev;
+    uint32_t s_last_orphan;
+    uint32_t s_hash_seed[4];
+    uint8_t  s_def_hash_version;
+    uint8_t  s_jnl_backup_type;
+    uint16_t s_desc_size;
+    uint32_t s_default_mount_opts;
+    uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_count_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
+    uint8_t  s_reserved[668];
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct ext4_super_block) == 1024, "ext4 superblock layout");
+
+struct ext4_group_desc {
+    uint32_t bg_block_bitmap_lo;
+    uint32_t bg_inode_bitmap_lo;
+    uint32_t bg_inode_table_lo;
+    uint16_t bg_free_blocks_count_lo;
+    uint16_t bg_free_inodes_count_lo;
+    uint16_t bg_used_dirs_count_lo;
+    uint16_t bg_flags;
+    uint32_t bg_exclude_bitmap_lo;
+    uint16_t bg_block_bitmap_csum_lo;
+    uint16_t bg_inode_bitmap_csum_lo;
+    uint16_t bg_itable_unused_lo;
+    uint16_t bg_checksum;
+    /* Present when s_desc_size >= 64 (64bit feature) */
+    uint32_t bg_block_bitmap_hi;
+    uint32_t bg_inode_bitmap_hi;
+    uint32_t bg_inode_table_hi;
+    uint16_t bg_free_blocks_count_hi;
+    uint16_t bg_free_inodes_count_hi;
+    uint16_t bg_used_dirs_count_hi;
+    uint16_t bg_itable_unused_hi;
+    uint32_t bg_exclude_bitmap_hi;
+    uint16_t bg_block_bitmap_csum_hi;
+    uint16_t bg_inode_bitmap_csum_hi;
+    uint32_t bg_reserved;
+} __attribute__((packed));
+
+struct ext4_inode {
+    uint16_t i_mode;
+    uint16_t i_uid;
+    uint32_t i_size_lo;
+    uint32_t i_atime;
+    uint32_t i_ctime;
+    uint32_t i_mtime;
+    uint32_t i_dtime;
+    uint16_t i_gid;
+    uint16_t i_links_count;
+    uint32_t i_blocks_lo;
+    uint32_t i_flags;
+    uint32_t i_osd1;
+    uint32_t i_block[15];
+    uint32_t i_generation;
+    uint32_t i_file_acl_lo;
+    uint32_t i_size_high;
+    uint32_t i_obso_faddr;
+    uint16_t i_blocks_high;
+    uint16_t i_file_acl_high;
+    uint16_t i_uid_high;
+    uint16_t i_gid_high;
+    uint16_t i_checksum_lo;
+    uint16_t i_reserved;
+    /* Large inode fields (s_inode_size > 128) */
+    uint16_t i_extra_isize;
+    uint16_t i_checksum_hi;
+    uint32_t i_ctime_extra;
+    uint32_t i_mtime_extra;
+    uint32_t i_atime_extra;
+    uint32_t i_crtime;
+    uint32_t i_crtime_extra;
+    uint32_t i_version_hi;
+    uint32_t i_projid;
+} __attribute__((packed));
+
+#define EXT4_GOOD_OLD_INODE_SIZE    128
+
+/* Extent tree */
+#define EXT4_EXT_MAGIC          0xF30A
+#define EXT4_EXT_INIT_MAX_LEN   32768
+
+struct ext4_extent_header {
+    uint16_t eh_magic;
+    uint16_t eh_entries;
+    uint16_t eh_max;
+    uint16_t eh_depth;
+    uint32_t eh_generation;
+} __attribute__((packed));
+
+struct ext4_extent {
+    uint32_t ee_block;
+    uint16_t ee_len;
+    uint16_t ee_start_hi;
+    uint32_t ee_start_lo;
+} __attribute__((packed));
+
+struct ext4_extent_idx {
+    uint32_t ei_block;
+    uint32_t ei_leaf_lo;
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+} __attribute__((packed));
+
+struct ext4_dir_entry_2 {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t  name_len;
+    uint8_t  file_type;
+    char     name[];
+} __attribute__((packed));
+
+#define EXT4_DIR_REC_LEN(name_len)  (((name_len) + 8 + 3) & ~3U)
+
+/* JBD2 on-disk format (big-endian) */
+#define JBD2_MAGIC_NUMBER           0xc03b3998U
+
+#define JBD2_DESCRIPTOR_BLOCK       1
+#define JBD2_COMMIT_BLOCK           2
+#define JBD2_SUPERBLOCK_V1          3
+#define JBD2_SUPERBLOCK_V2          4
+#define JBD2_REVOKE_BLOCK           5
+
+#define JBD2_FEATURE_INCOMPAT_REVOKE    0x00000001
+#define JBD2_FEATURE_INCOMPAT_64BIT     0x00000002
+#define JBD2_KNOWN_INCOMPAT_FEATURES    (JBD2_FEATURE_INCOMPAT_REVOKE | \
+                                         JBD2_FEATURE_INCOMPAT_64BIT)
+
+#define JBD2_FLAG_ESCAPE        1
+#define JBD2_FLAG_SAME_UUID     2
+#define JBD2_FLAG_DELETED       4
+#define JBD2_FLAG_LAST_TAG      8
+
+typedef struct journal_header {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+} __attribute__((packed)) journal_header_t;
+
+typedef struct journal_block_tag {
+    uint32_t t_blocknr;
+    uint16_t t_checksum;
+    uint16_t t_flags;
+    uint32_t t_blocknr_high;    /* Only with JBD2_FEATURE_INCOMPAT_64BIT */
+} __attribute__((packed)) journal_block_tag_t;
+
+typedef struct jbd2_journal_revoke_header {
+    journal_header_t r_header;
+    uint32_t r_count;           /* Bytes used in the block */
+} __attribute__((packed)) jbd2_journal_revoke_header_t;
+
+struct commit_header {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint8_t  h_chksum_type;
+    uint8_t  h_chksum_size;
+    uint8_t  h_padding[2];
+    uint32_t h_chksum[8];
+    uint64_t h_commit_sec;
+    uint32_t h_commit_nsec;
+} __attribute__((packed));
+
+typedef struct journal_superblock {
+    journal_header_t s_header;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;
+    uint32_t s_first;
+    uint32_t s_sequence;
+    uint32_t s_start;
+    int32_t  s_errno;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t  s_uuid[16];
+    uint32_t s_nr_users;
+    uint32_t s_dynsuper;
+    uint32_t s_max_transaction;
+    uint32_t s_max_trans_data;
+} __attribute__((packed)) journal_superblock_t;
+
+/* In-memory journal state */
+struct transaction;
+
+typedef struct journal_head {
+    buffer_head_t *b_bh;
+    struct transaction *b_transaction;      /* Running tx that logs this buffer */
+    struct transaction *b_cp_transaction;   /* Committed tx owing a checkpoint */
+    struct journal_head *b_tnext;
+    struct journal_head *b_cpnext, *b_cpprev;
+    uint8_t *b_committed_data;              /* Bitmap as of the last commit */
+} journal_head_t;
+
+typedef struct transaction {
+    uint32_t t_tid;
+    journal_head_t *t_buffers;
+    unsigned int t_nr_buffers;
+    journal_head_t *t_checkpoint_list;
+    uint64_t *t_revoked;
+    unsigned int t_nr_revoked, t_max_revoked;
+    unsigned int t_updates;                 /* Open handles */
+    uint32_t t_log_start;
+    struct transaction *t_cpnext;
+} transaction_t;
+
+typedef struct handle {
+    transaction_t *h_transaction;
+} handle_t;
+
+typedef struct journal {
+    block_device_t *j_dev;
+    uint32_t j_blocksize;
+    buffer_head_t *j_sb_bh;
+    uint64_t *j_blockmap;           /* Log block -> device block */
+    uint32_t j_first, j_last;       /* Usable log area [first, last) */
+    uint32_t j_head;                /* Next log block to write */
+    uint32_t j_tail;                /* Oldest log block still needed */
+    uint32_t j_tail_sequence;
+    uint32_t j_free;
+    uint32_t j_transaction_sequence;        /* Next tid to hand out */
+    volatile uint32_t j_commit_sequence;    /* Last committed tid */
+    uint32_t j_max_transaction_buffers;
+    uint32_t j_incompat;
+    uint32_t j_tag_bytes;
+    uint8_t j_uuid[16];
+    transaction_t *j_running;
+    transaction_t *j_checkpoint_first, *j_checkpoint_last;
+    spinlock_t *j_lock;             /* Filesystem lock serialising handles */
+    unsigned int j_flags;
+    volatile unsigned int j_fsync_waiters;  /* Group commit batching */
+    uint64_t j_stat_commits;
+    uint64_t j_stat_blocks_logged;
+    uint64_t j_stat_fsync_batched;
+} journal_t;
+
+#define JBD2_GROUP_COMMIT       (1U << 0)
+#define JBD2_LOG_DIRTY          (1U << 1)   /* s_start != 0 on disk */
+
+static inline bool tid_geq(uint32_t x, uint32_t y) {
+    return (int32_t)(x - y) >= 0;
+}
+
+journal_t *jbd2_journal_load(block_device_t *bdev, uint32_t blocksize,
+                             const uint64_t *blockmap, uint32_t nr_blocks,
+                             spinlock_t *lock);
+int jbd2_journal_recover(journal_t *journal);
+void jbd2_journal_destroy(journal_t *journal, bool clean);
+handle_t *jbd2_journal_start(journal_t *journal, handle_t *handle, unsigned int nblocks);
+void jbd2_journal_stop(handle_t *handle);
+int jbd2_journal_get_write_access(handle_t *handle, buffer_head_t *bh);
+int jbd2_journal_get_undo_access(handle_t *handle, buffer_head_t *bh);
+int jbd2_journal_revoke(handle_t *handle, uint64_t blocknr, buffer_head_t *bh);
+int jbd2_journal_commit_transaction(journal_t *journal);
+int jbd2_complete_transaction(journal_t *journal, uint32_t tid);
+int jbd2_log_checkpoint_all(journal_t *journal);
+uint32_t jbd2_running_tid(journal_t *journal);
+
+/* In-memory ext4 state */
+
+/* In-core directory name index slot: hash 0 is empty, 1 a tombstone */
+typedef struct {
+    uint32_t hash;
+    uint32_t lblk;
+} ext4_dx_slot_t;
+
+typedef struct ext4_inode_info {
+    uint32_t i_ino;
+    int i_count;
+    struct ext4_inode i_raw;        /* In-core copy of the on-disk inode */
+    uint64_t i_size;                /* Includes delayed-allocation data */
+    uint32_t i_sync_tid;            /* Last transaction that touched us */
+    uint8_t **i_delalloc;           /* Cached data for unallocated blocks */
+    uint32_t i_delalloc_cap;
+    uint32_t i_delalloc_count;
+    bool i_dirty_list;
+    ext4_dx_slot_t *i_dx;           /* Name hash -> directory block, or NULL */
+    uint32_t i_dx_mask;
+    uint32_t i_dx_used;             /* Live entries plus tombstones */
+    uint32_t i_dir_hint;            /* First block worth trying for inserts */
+    struct ext4_inode_info *i_hash_next;
+    struct ext4_inode_info *i_dirty_next;
+    struct ext4_inode_info *i_lru_prev, *i_lru_next;
+} ext4_inode_info_t;
+
+#define EXT4_ICACHE_BITS    12
+#define EXT4_ICACHE_MAX     8192
+#define EXT4_DELALLOC_MAX   8192    /* Blocks buffered before forced writeback */
+#define EXT4_DX_MIN_BLOCKS  4       /* Index directories at least this large */
+
+struct ext4_fs {
+    block_device_t *s_bdev;
+    struct ext4_super_block s_es;
+    uint32_t s_block_size;
+    uint32_t s_blocks_per_group;
+    uint32_t s_inodes_per_group;
+    uint32_t s_inode_size;
+    uint32_t s_desc_size;
+    uint32_t s_groups_count;
+    uint64_t s_blocks_count;
+    uint64_t s_free_blocks;
+    uint64_t s_dirty_blocks;        /* Reserved by delayed allocation */
+    uint32_t s_free_inodes;
+    uint32_t s_first_ino;
+    uint32_t s_gdb_count;
+    buffer_head_t **s_group_desc;   /* Pinned group descriptor blocks */
+    journal_t *s_journal;
+    unsigned int s_flags;
+    bool s_rdonly;
+    spinlock_t s_lock;              /* Serialises all metadata updates */
+    uint32_t s_generation;
+    uint32_t s_last_dir_group;
+    uint32_t *s_bb_hint;            /* Per group: no free block below this bit */
+    uint32_t *s_ib_hint;            /* Per group: no free inode below this bit */
+    ext4_inode_info_t *s_icache[1U << EXT4_ICACHE_BITS];
+    ext4_inode_info_t *s_ilru_head, *s_ilru_tail;
+    unsigned int s_nr_inodes;
+    ext4_inode_info_t *s_dirty_inodes;
+};
+
+#endif /* __EXT4_H__ */
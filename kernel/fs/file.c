@@ -0,0 +1,455 @@
+/**
+ * File descriptor tables and fd-based file I/O
+ *
+ * Writers (alloc_fd, fd_install, close_fd, table growth) serialise on
+ * files->file_lock. fget() is lock-free: it loads the current table and
+ * the file pointer with acquire ordering, takes a reference only if the
+ * count is still nonzero, then checks the slot still holds that file.
+ * That is safe because file_t objects are type-stable (vfs.c recycles
+ * them and never frees them) and retired tables outlive all readers.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+#define BITS_PER_LONG   (8 * sizeof(unsigned long))
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static files_struct_t g_init_files;
+
+static unsigned int find_next_zero_bit(const unsigned long *map, unsigned int size,
+                                       unsigned int start) {
+    while (start < size) {
+        unsigned long word = ~map[start / BITS_PER_LONG] >> (start % BITS_PER_LONG);
+        if (word) {
+            start += (unsigned int)__builtin_ctzl(word);
+            return start < size ? start : size;
+        }
+        start = (start / BITS_PER_LONG + 1) * BITS_PER_LONG;
+    }
+    return size;
+}
+
+static void files_init(files_struct_t *files) {
+    memset(files, 0, sizeof(*files));
+    files->count = 1;
+    files->fdtab.max_fds = NR_OPEN_DEFAULT;
+    files->fdtab.fd = files->fd_array;
+    files->fdtab.open_fds = files->open_fds_init;
+    files->fdtab.full_fds_bits = files->full_fds_bits_init;
+    files->fdt = &files->fdtab;
+}
+
+/* Table used before any process exists (and by the kernel itself) */
+files_struct_t *init_files_struct(void) {
+    if (!g_init_files.fdt) files_init(&g_init_files);
+    return &g_init_files;
+}
+
+files_struct_t *files_alloc(void) {
+    files_struct_t *files = kmalloc(sizeof(files_struct_t), GFP_KERNEL);
+    if (files) files_init(files);
+    return files;
+}
+
+static void free_fdtable(fdtable_t *fdt) {
+    kfree(fdt->fd);
+    kfree(fdt->open_fds);
+    kfree(fdt->full_fds_bits);
+    kfree(fdt);
+}
+
+static fdtable_t *alloc_fdtable(unsigned int nr) {
+    fdtable_t *fdt = kmalloc(sizeof(fdtable_t), GFP_KERNEL);
+    if (!fdt) return NULL;
+
+    size_t nwords = BITS_TO_LONGS(nr);
+    memset(fdt, 0, sizeof(*fdt));
+    fdt->max_fds = nr;
+    fdt->fd = kmalloc(nr * sizeof(file_t *), GFP_KERNEL);
+    fdt->open_fds = kmalloc(nwords * sizeof(unsigned long), GFP_KERNEL);
+    fdt->full_fds_bits = kmalloc(BITS_TO_LONGS(nwords) * sizeof(unsigned long), GFP_KERNEL);
+    if (!fdt->fd || !fdt->open_fds || !fdt->full_fds_bits) {
+        free_fdtable(fdt);
+        return NULL;
+    }
+    memset(fdt->fd, 0, nr * sizeof(file_t *));
+    memset(fdt->open_fds, 0, nwords * sizeof(unsigned long));
+    memset(fdt->full_fds_bits, 0, BITS_TO_LONGS(nwords) * sizeof(unsigned long));
+    return fdt;
+}
+
+/* Copy the first old->max_fds slots and bitmaps of old into new */
+static void copy_fdtable(fdtable_t *new, const fdtable_t *old) {
+    size_t nwords = BITS_TO_LONGS(old->max_fds);
+    memcpy(new->fd, old->fd, old->max_fds * sizeof(file_t *));
+    memcpy(new->open_fds, old->open_fds, nwords * sizeof(unsigned long));
+    memcpy(new->full_fds_bits, old->full_fds_bits,
+           BITS_TO_LONGS(nwords) * sizeof(unsigned long));
+}
+
+/* Grow so that fd fits; caller holds file_lock */
+static int expand_files(files_struct_t *files, unsigned int fd) {
+    fdtable_t *old = files->fdt;
+    if (fd < old->max_fds) return 0;
+    if (fd >= NR_OPEN_MAX) return -EMFILE;
+
+    unsigned int nr = old->max_fds * 2;
+    while (nr <= fd) nr *= 2;
+    if (nr > NR_OPEN_MAX) nr = NR_OPEN_MAX;
+
+    fdtable_t *new = alloc_fdtable(nr);
+    if (!new) return -ENOMEM;
+    copy_fdtable(new, old);
+
+    /* The embedded table lives as long as files; only heap tables retire */
+    new->retired = old == &files->fdtab ? NULL : old;
+    __atomic_store_n(&files->fdt, new, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void set_open_fd(fdtable_t *fdt, unsigned int fd) {
+    unsigned int word = fd / BITS_PER_LONG;
+    fdt->open_fds[word] |= 1UL << (fd % BITS_PER_LONG);
+    if (!~fdt->open_fds[word])
+        fdt->full_fds_bits[word / BITS_PER_LONG] |= 1UL << (word % BITS_PER_LONG);
+}
+
+static void clear_open_fd(fdtable_t *fdt, unsigned int fd) {
+    unsigned int word = fd / BITS_PER_LONG;
+    fdt->open_fds[word] &= ~(1UL << (fd % BITS_PER_LONG));
+    fdt->full_fds_bits[word / BITS_PER_LONG] &= ~(1UL << (word % BITS_PER_LONG));
+}
+
+/* Lowest clear bit at or after start: skip full words, then ctz within one */
+static unsigned int find_next_fd(fdtable_t *fdt, unsigned int start) {
+    unsigned int nwords = BITS_TO_LONGS(fdt->max_fds);
+    unsigned int word = find_next_zero_bit(fdt->full_fds_bits, nwords, start / BITS_PER_LONG);
+    unsigned int first = word * BITS_PER_LONG;
+    if (first > start) start = first;
+    return find_next_zero_bit(fdt->open_fds, fdt->max_fds, start);
+}
+
+/* Reserve the lowest free fd >= start; fd_install() fills it in */
+int alloc_fd(files_struct_t *files, unsigned int start) {
+    int ret;
+
+    spin_lock(&files->file_lock);
+    unsigned int fd = start > files->next_fd ? start : files->next_fd;
+    fd = find_next_fd(files->fdt, fd);
+    if ((ret = expand_files(files, fd)) < 0) {
+        spin_unlock(&files->file_lock);
+        return ret;
+    }
+    set_open_fd(files->fdt, fd);
+    if (start <= files->next_fd)
+        files->next_fd = fd + 1;
+    spin_unlock(&files->file_lock);
+    return (int)fd;
+}
+
+/* Give back an fd from alloc_fd() that was never installed */
+void put_unused_fd(files_struct_t *files, unsigned int fd) {
+    spin_lock(&files->file_lock);
+    clear_open_fd(files->fdt, fd);
+    if (fd < files->next_fd) files->next_fd = fd;
+    spin_unlock(&files->file_lock);
+}
+
+void fd_install(files_struct_t *files, unsigned int fd, file_t *file) {
+    spin_lock(&files->file_lock);
+    __atomic_store_n(&files->fdt->fd[fd], file, __ATOMIC_RELEASE);
+    spin_unlock(&files->file_lock);
+}
+
+int close_fd(files_struct_t *files, unsigned int fd) {
+    spin_lock(&files->file_lock);
+    fdtable_t *fdt = files->fdt;
+    file_t *file = fd < fdt->max_fds ? fdt->fd[fd] : NULL;
+    if (!file) {
+        spin_unlock(&files->file_lock);
+        return -EBADF;
+    }
+    __atomic_store_n(&fdt->fd[fd], NULL, __ATOMIC_RELEASE);
+    clear_open_fd(fdt, fd);
+    if (fd < files->next_fd) files->next_fd = fd;
+    spin_unlock(&files->file_lock);
+
+    fput(file);
+    return 0;
+}
+
+/* dup2: install file at fd, closing what was there; takes the reference even on error */
+int replace_fd(files_struct_t *files, unsigned int fd, file_t *file) {
+    int ret;
+
+    spin_lock(&files->file_lock);
+    if ((ret = expand_files(files, fd)) < 0) goto out;
+    fdtable_t *fdt = files->fdt;
+    file_t *old = fdt->fd[fd];
+    if (!old && (fdt->open_fds[fd / BITS_PER_LONG] & (1UL << (fd % BITS_PER_LONG)))) {
+        ret = -EBUSY;                   /* Reserved by alloc_fd, not installed yet */
+        goto out;
+    }
+    __atomic_store_n(&fdt->fd[fd], file, __ATOMIC_RELEASE);
+    set_open_fd(fdt, fd);
+    spin_unlock(&files->file_lock);
+
+    if (old) fput(old);
+    return 0;
+out:
+    spin_unlock(&files->file_lock);
+    fput(file);
+    return ret;
+}
+
+static bool get_file_unless_zero(file_t *file) {
+    int count = __atomic_load_n(&file->f_count, __ATOMIC_RELAXED);
+    do {
+        if (count == 0) return false;
+    } while (!__atomic_compare_exchange_n(&file->f_count, &count, count + 1, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+/* Look up fd without taking file_lock; returns a referenced file or NULL */
+file_t *fget_files(files_struct_t *files, unsigned int fd) {
+    for (;;) {
+        fdtable_t *fdt = __atomic_load_n(&files->fdt, __ATOMIC_ACQUIRE);
+        if (fd >= fdt->max_fds) return NULL;
+
+        file_t *file = __atomic_load_n(&fdt->fd[fd], __ATOMIC_ACQUIRE);
+        if (!file) return NULL;
+        if (!get_file_unless_zero(file)) continue;      /* Being closed */
+
+        /* Still installed? (The table may have grown meanwhile.) */
+        fdt = __atomic_load_n(&files->fdt, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&fdt->fd[fd], __ATOMIC_ACQUIRE) == file)
+            return file;
+        fput(file);
+    }
+}
+
+file_t *fget(unsigned int fd) {
+    return fget_files(current_files(), fd);
+}
+
+/* Copy a table for fork: same fds, each file gains a reference */
+files_struct_t *dup_fd(files_struct_t *old, int *err) {
+    files_struct_t *files = files_alloc();
+    if (!files) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+
+    spin_lock(&old->file_lock);
+    fdtable_t *ofdt = old->fdt;
+    while (ofdt->max_fds > files->fdt->max_fds) {
+        /* Allocation may sleep: drop the lock and recheck */
+        unsigned int nr = ofdt->max_fds;
+        spin_unlock(&old->file_lock);
+        fdtable_t *fdt = alloc_fdtable(nr);
+        if (!fdt) {
+            put_files_struct(files);
+            *err = -ENOMEM;
+            return NULL;
+        }
+        fdt->retired = files->fdt == &files->fdtab ? NULL : files->fdt;
+        files->fdt = fdt;
+        spin_lock(&old->file_lock);
+        ofdt = old->fdt;
+    }
+
+    fdtable_t *nfdt = files->fdt;
+    copy_fdtable(nfdt, ofdt);
+    for (unsigned int fd = 0; fd < ofdt->max_fds; fd++) {
+        if (nfdt->fd[fd])
+            get_file(nfdt->fd[fd]);
+        else if (nfdt->open_fds[fd / BITS_PER_LONG] & (1UL << (fd % BITS_PER_LONG)))
+            clear_open_fd(nfdt, fd);    /* Reserved, not yet installed */
+    }
+    spin_unlock(&old->file_lock);
+    return files;
+}
+
+void put_files_struct(files_struct_t *files) {
+    if (!files || __atomic_sub_fetch(&files->count, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    fdtable_t *fdt = files->fdt;
+    for (unsigned int fd = 0; fd < fdt->max_fds; fd++) {
+        if (fdt->fd[fd]) fput(fdt->fd[fd]);
+    }
+    while (fdt && fdt != &files->fdtab) {
+        fdtable_t *older = fdt->retired;
+        free_fdtable(fdt);
+        fdt = older;
+    }
+    if (files != &g_init_files) kfree(files);
+}
+
+/* ============================================================================
+ * fd-based I/O
+ * ============================================================================ */
+
+int do_open(const char *path, int flags, uint16_t mode) {
+    files_struct_t *files = current_files();
+    int fd = alloc_fd(files, 0);
+    if (fd < 0) return fd;
+
+    int err = 0;
+    file_t *file = vfs_open(path, flags, mode, &err);
+    if (!file) {
+        put_unused_fd(files, (unsigned int)fd);
+        return err;
+    }
+    fd_install(files, (unsigned int)fd, file);
+    return fd;
+}
+
+int do_close(int fd) {
+    if (fd < 0) return -EBADF;
+    return close_fd(current_files(), (unsigned int)fd);
+}
+
+int64_t do_read(int fd, void *buf, size_t count) {
+    file_t *file = fd < 0 ? NULL : fget((unsigned int)fd);
+    if (!file) return -EBADF;
+    int64_t ret = vfs_read(file, buf, count);
+    fput(file);
+    return ret;
+}
+
+int64_t do_write(int fd, const void *buf, size_t count) {
+    file_t *file = fd < 0 ? NULL : fget((unsigned int)fd);
+    if (!file) return -EBADF;
+    int64_t ret = vfs_write(file, buf, count);
+    fput(file);
+    return ret;
+}
+
+int64_t do_lseek(int fd, int64_t offset, int whence) {
+    file_t *file = fd < 0 ? NULL : fget((unsigned int)fd);
+    if (!file) return -EBADF;
+
+    if (S_ISFIFO(file->inode->mode)) {
+        fput(file);
+        return -ESPIPE;
+    }
+
+    int64_t base;
+    switch (whence) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = (int64_t)file->f_pos; break;
+    case SEEK_END: base = (int64_t)file->inode->size; break;
+    default: base = -1; break;
+    }
+    int64_t ret = -EINVAL;
+    if (base >= 0 && base + offset >= 0) {
+        file->f_pos = (uint64_t)(base + offset);
+        ret = base + offset;
+    }
+    fput(file);
+    return ret;
+}
+
+/* Validate a user segment array and set up an iterator over it */
+static int import_iovec(const iovec_t *iov, int iovcnt, iov_iter_t *iter) {
+    size_t total = 0;
+
+    if (iovcnt < 0 || iovcnt > IOV_MAX || (iovcnt && !iov)) return -EINVAL;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len && !iov[i].iov_base) return -EINVAL;
+        if (iov[i].iov_len > (size_t)INT64_MAX - total) return -EINVAL;
+        total += iov[i].iov_len;
+    }
+    iov_iter_init(iter, iov, (unsigned long)iovcnt, total);
+    return 0;
+}
+
+/* offset < 0 means the file position, which is then advanced */
+static int64_t do_iter_rw(int fd, const iovec_t *iov, int iovcnt, int64_t offset,
+                          int flags, bool write) {
+    iov_iter_t iter;
+    int ret = import_iovec(iov, iovcnt, &iter);
+    if (ret < 0) return ret;
+
+    file_t *file = fd < 0 ? NULL : fget((unsigned int)fd);
+    if (!file) return -EBADF;
+
+    if (offset >= 0 && S_ISFIFO(file->inode->mode)) {
+        fput(file);
+        return -ESPIPE;
+    }
+
+    uint64_t pos = offset < 0 ? file->f_pos : (uint64_t)offset;
+    int64_t n = write ? vfs_iter_write(file, &iter, &pos, flags)
+                      : vfs_iter_read(file, &iter, &pos, flags);
+    if (offset < 0 && n >= 0) file->f_pos = pos;
+    fput(file);
+    return n;
+}
+
+int64_t do_readv(int fd, const iovec_t *iov, int iovcnt) {
+    return do_iter_rw(fd, iov, iovcnt, -1, 0, false);
+}
+
+int64_t do_writev(int fd, const iovec_t *iov, int iovcnt) {
+    return do_iter_rw(fd, iov, iovcnt, -1, 0, true);
+}
+
+int64_t do_pread(int fd, void *buf, size_t count, int64_t offset) {
+    iovec_t iov = { .iov_base = buf, .iov_len = count };
+    if (offset < 0) return -EINVAL;
+    return do_iter_rw(fd, &iov, 1, offset, 0, false);
+}
+
+int64_t do_pwrite(int fd, const void *buf, size_t count, int64_t offset) {
+    iovec_t iov = { .iov_base = (void *)buf, .iov_len = count };
+    if (offset < 0) return -EINVAL;
+    return do_iter_rw(fd, &iov, 1, offset, 0, true);
+}
+
+/* offset -1 reads at and advances the file position, like readv */
+int64_t do_preadv2(int fd, const iovec_t *iov, int iovcnt, int64_t offset, int flags) {
+    if (flags & ~RWF_NOWAIT) return -EOPNOTSUPP;
+    if (offset < -1) return -EINVAL;
+    return do_iter_rw(fd, iov, iovcnt, offset,
+                      (flags & RWF_NOWAIT) ? IOCB_NOWAIT : 0, false);
+}
+
+int do_fsync(int fd) {
+    file_t *file = fd < 0 ? NULL : fget((unsigned int)fd);
+    if (!file) return -EBADF;
+    int ret = vfs_fsync(file);
+    fput(file);
+    return ret;
+}
+
+static void fill_stat(const inode_t *inode, stat_t *st) {
+    st->ino = inode->ino;
+    st->size = (uint32_t)inode->size;
+    st->mode = inode->mode;
+    st->uid = inode->uid;
+    st->gid = inode->gid;
+    st->atime = inode->atime;
+    st->mtime = inode->mtime;
+    st->ctime = inode->ctime;
+}
+
+int do_stat(const char *path, stat_t *st) {
+    inode_t *inode;
+    int ret = vfs_lookup(path, &inode);
+    if (ret < 0) return ret;
+    fill_stat(inode, st);
+    iput(inode);
+    return 0;
+}
+
+int do_fstat(int fd, stat_t *st) {
+    file_t *file = fd < 0 ? NULL : fget((unsigned int)fd);
+    if (!file) return -EBADF;
+    fill_stat(file->inode, st);
+    fput(file);
+    return 0;
+}
@@ -0,0 +1,572 @@
+/**
+ * io_uring - batched submission and completion rings
+ *
+ * io_uring_enter() consumes a batch of SQEs, copying each into a request
+ * so its slot can be reused at once, and issues them in order. Requests
+ * are tried without waiting first: those that would block (a pipe with
+ * nothing to read or no room) stay on a pending list and are retried on
+ * every later enter, and futex waits stay queued on the futex until a
+ * wake completes them. Files that cannot say "would block" are simply
+ * run to completion inline.
+ *
+ * IOSQE_IO_LINK chains a request to the next one in the batch; the next
+ * is issued only when the previous succeeds in full, and the rest of a
+ * failed chain completes with -ECANCELED.
+ *
+ * Completions are posted under completion_lock while a futex wait is
+ * armed, since its wake posts from the waker's context; otherwise only
+ * the submitter posts and the lock is skipped. When the CQ is full they
+ * queue on an overflow list and are flushed as the submitter frees CQ
+ * space, so none are lost.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+#define EIOCBQUEUED     529     /* Internal: request parked, not complete */
+
+typedef struct io_ring_ctx io_ring_ctx_t;
+
+typedef struct io_kiocb {
+    io_ring_ctx_t *ctx;
+    uint8_t opcode;
+    uint8_t flags;
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t op_flags;
+    uint64_t user_data;
+    int32_t res;
+    struct io_kiocb *link;      /* Issued when this one succeeds */
+    struct io_kiocb *next;      /* Pending, overflow or deferred list */
+    struct io_kiocb **pprev;    /* Position on the futex list */
+    futex_q_t futex;
+} io_kiocb_t;
+
+struct io_ring_ctx {
+    io_rings_t *rings;
+    io_uring_sqe_t *sqes;
+    uint32_t sq_entries, cq_entries;
+    page_t *rings_page, *sqes_page;
+    spinlock_t uring_lock;          /* One submitter at a time */
+    io_kiocb_t *pending;            /* Would block; retried on each enter */
+    io_kiocb_t *free_reqs;          /* Request cache, under uring_lock */
+
+    spinlock_t completion_lock;     /* CQ tail and everything below */
+    io_kiocb_t *overflow, **overflow_tail;
+    io_kiocb_t *deferred;           /* Links of requests completed by futex wakes */
+    io_kiocb_t *futex_list;         /* Armed futex waits */
+    int nr_futex;
+};
+
+static const file_operations_t io_uring_fops;
+
+/* ============================================================================
+ * Completion
+ * ============================================================================ */
+
+static io_kiocb_t *io_alloc_req(io_ring_ctx_t *ctx) {
+    io_kiocb_t *req = ctx->free_reqs;
+    if (!req) return kmalloc(sizeof(io_kiocb_t), GFP_KERNEL);
+    ctx->free_reqs = req->next;
+    return req;
+}
+
+/* Recycle req; only the submitter, holding uring_lock, may use the cache */
+static void io_free_req(io_ring_ctx_t *ctx, io_kiocb_t *req, bool submitter) {
+    if (!submitter) {
+        kfree(req);
+        return;
+    }
+    req->next = ctx->free_reqs;
+    ctx->free_reqs = req;
+}
+
+/* Futex wakes post concurrently only while a futex wait is armed */
+static bool io_cq_lock(io_ring_ctx_t *ctx, bool submitter) {
+    if (submitter && !__atomic_load_n(&ctx->nr_futex, __ATOMIC_ACQUIRE)) return false;
+    spin_lock(&ctx->completion_lock);
+    return true;
+}
+
+static void io_cq_unlock(io_ring_ctx_t *ctx, bool locked) {
+    if (locked) spin_unlock(&ctx->completion_lock);
+}
+
+/* Write one CQE, or queue req on the overflow list; caller holds completion_lock */
+static bool __io_post_cqe(io_ring_ctx_t *ctx, io_kiocb_t *req) {
+    io_rings_t *r = ctx->rings;
+    uint32_t tail = r->cq.tail;
+
+    if (ctx->overflow || tail - __atomic_load_n(&r->cq.head, __ATOMIC_ACQUIRE) >= ctx->cq_entries) {
+        req->next = NULL;
+        *ctx->overflow_tail = req;
+        ctx->overflow_tail = &req->next;
+        r->cq_overflow++;
+        return false;
+    }
+    io_uring_cqe_t *cqe = &r->cqes[tail & r->cq_ring_mask];
+    cqe->user_data = req->user_data;
+    cqe->res = req->res;
+    cqe->flags = 0;
+    __atomic_store_n(&r->cq.tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void io_flush_overflow(io_ring_ctx_t *ctx) {
+    io_rings_t *r = ctx->rings;
+    io_kiocb_t *done = NULL;
+
+    bool locked = io_cq_lock(ctx, true);
+    while (ctx->overflow) {
+        uint32_t tail = r->cq.tail;
+        if (tail - __atomic_load_n(&r->cq.head, __ATOMIC_ACQUIRE) >= ctx->cq_entries)
+            break;
+        io_kiocb_t *req = ctx->overflow;
+        ctx->overflow = req->next;
+        io_uring_cqe_t *cqe = &r->cqes[tail & r->cq_ring_mask];
+        cqe->user_data = req->user_data;
+        cqe->res = req->res;
+        cqe->flags = 0;
+        __atomic_store_n(&r->cq.tail, tail + 1, __ATOMIC_RELEASE);
+        r->cq_overflow--;
+        req->next = done;
+        done = req;
+    }
+    if (!ctx->overflow) ctx->overflow_tail = &ctx->overflow;
+    io_cq_unlock(ctx, locked);
+
+    while (done) {
+        io_kiocb_t *req = done;
+        done = req->next;
+        io_free_req(ctx, req, true);
+    }
+}
+
+static bool io_req_failed(const io_kiocb_t *req) {
+    if (req->res < 0) return true;
+    switch (req->opcode) {
+    case IORING_OP_READ:
+    case IORING_OP_WRITE:
+        return (uint32_t)req->res < req->len;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Post req's result. Returns its link if that should be issued next;
+ * after a failure the rest of the chain is posted as -ECANCELED.
+ * submitter is false when called from a futex waker.
+ */
+static io_kiocb_t *io_req_complete(io_ring_ctx_t *ctx, io_kiocb_t *req, int32_t res,
+                                   bool submitter) {
+    io_kiocb_t *link = req->link;
+    bool failed;
+
+    req->res = res;
+    failed = io_req_failed(req);
+    req->link = NULL;
+
+    bool locked = io_cq_lock(ctx, submitter);
+    bool posted = __io_post_cqe(ctx, req);
+    while (failed && link) {
+        io_kiocb_t *next = link->link;
+        link->res = -ECANCELED;
+        link->link = NULL;
+        if (__io_post_cqe(ctx, link)) io_free_req(ctx, link, submitter);
+        link = next;
+    }
+    io_cq_unlock(ctx, locked);
+
+    if (posted) io_free_req(ctx, req, submitter);
+    return link;
+}
+
+/* ============================================================================
+ * Issue
+ * ============================================================================ */
+
+static int64_t io_rw_once(file_t *file, const iovec_t *iov, unsigned long nr_segs,
+                          size_t count, uint64_t off, int flags, bool write) {
+    bool at_pos = off == (uint64_t)-1;
+    uint64_t pos = at_pos ? file->f_pos : off;
+    iov_iter_t iter;
+
+    iov_iter_init(&iter, iov, nr_segs, count);
+    int64_t ret = write ? vfs_iter_write(file, &iter, &pos, flags)
+                        : vfs_iter_read(file, &iter, &pos, flags);
+    if (ret >= 0 && at_pos) file->f_pos = pos;
+    return ret;
+}
+
+static int64_t io_rw(io_kiocb_t *req, bool write) {
+    iovec_t single;
+    const iovec_t *iov = &single;
+    unsigned long nr_segs = 1;
+    size_t count;
+
+    if (req->opcode == IORING_OP_READV || req->opcode == IORING_OP_WRITEV) {
+        iov = (const iovec_t *)(uintptr_t)req->addr;
+        nr_segs = req->len;
+        if (!iov || nr_segs > IOV_MAX) return -EINVAL;
+        count = 0;
+        for (unsigned long i = 0; i < nr_segs; i++) {
+            if (iov[i].iov_len > (size_t)INT64_MAX - count) return -EINVAL;
+            count += iov[i].iov_len;
+        }
+    } else {
+        single.iov_base = (void *)(uintptr_t)req->addr;
+        single.iov_len = count = req->len;
+        if (count && !single.iov_base) return -EINVAL;
+    }
+
+    file_t *file = req->fd < 0 ? NULL : fget((unsigned int)req->fd);
+    if (!file) return -EBADF;
+
+    if (req->off != (uint64_t)-1 && S_ISFIFO(file->inode->mode)) {
+        fput(file);
+        return -ESPIPE;
+    }
+
+    /*
+     * Try without blocking first. A file that cannot tell runs inline; one
+     * that would block is parked, unless the caller asked for -EAGAIN.
+     */
+    bool nowait = (req->op_flags & RWF_NOWAIT) || (file->f_flags & O_NONBLOCK);
+    int64_t ret = io_rw_once(file, iov, nr_segs, count, req->off, IOCB_NOWAIT, write);
+    if (ret == -EOPNOTSUPP && !(req->op_flags & RWF_NOWAIT))
+        ret = io_rw_once(file, iov, nr_segs, count, req->off, 0, write);
+    if (ret == -EAGAIN && !nowait) ret = -EIOCBQUEUED;
+    fput(file);
+    return ret;
+}
+
+static void io_futex_wake_fn(futex_q_t *q) {
+    io_kiocb_t *req = (io_kiocb_t *)((char *)q - offsetof(io_kiocb_t, futex));
+    io_ring_ctx_t *ctx = req->ctx;
+
+    spin_lock(&ctx->completion_lock);
+    *req->pprev = req->next;
+    if (req->next) req->next->pprev = req->pprev;
+    spin_unlock(&ctx->completion_lock);
+
+    /* The waker posts the CQE; the submitter issues any link on its next enter */
+    io_kiocb_t *link = io_req_complete(ctx, req, 0, false);
+    spin_lock(&ctx->completion_lock);
+    if (link) {
+        link->next = ctx->deferred;
+        ctx->deferred = link;
+    }
+    __atomic_store_n(&ctx->nr_futex, ctx->nr_futex - 1, __ATOMIC_RELEASE);
+    spin_unlock(&ctx->completion_lock);
+}
+
+static int io_futex_wait(io_ring_ctx_t *ctx, io_kiocb_t *req) {
+    uint32_t *uaddr = (uint32_t *)(uintptr_t)req->addr;
+    if (!uaddr || ((uintptr_t)uaddr & 3)) return -EINVAL;
+
+    /* On the futex list before it can be woken, so a wake finds it there */
+    spin_lock(&ctx->completion_lock);
+    req->next = ctx->futex_list;
+    if (req->next) req->next->pprev = &req->next;
+    req->pprev = &ctx->futex_list;
+    ctx->futex_list = req;
+    ctx->nr_futex++;
+    spin_unlock(&ctx->completion_lock);
+
+    req->futex.wake = io_futex_wake_fn;
+    int ret = futex_queue(&req->futex, uaddr, (uint32_t)req->off);
+    if (ret == 0) return -EIOCBQUEUED;
+
+    spin_lock(&ctx->completion_lock);
+    *req->pprev = req->next;
+    if (req->next) req->next->pprev = req->pprev;
+    ctx->nr_futex--;
+    spin_unlock(&ctx->completion_lock);
+    return ret;
+}
+
+static int64_t io_issue(io_ring_ctx_t *ctx, io_kiocb_t *req) {
+    switch (req->opcode) {
+    case IORING_OP_NOP:
+        return 0;
+    case IORING_OP_READ:
+    case IORING_OP_READV:
+        return io_rw(req, false);
+    case IORING_OP_WRITE:
+    case IORING_OP_WRITEV:
+        return io_rw(req, true);
+    case IORING_OP_OPENAT:
+        return do_open((const char *)(uintptr_t)req->addr, (int)req->op_flags, (uint16_t)req->len);
+    case IORING_OP_CLOSE:
+        return do_close(req->fd);
+    case IORING_OP_FSYNC:
+        return do_fsync(req->fd);
+    case IORING_OP_PIPE:
+        return do_pipe2((int *)(uintptr_t)req->addr, (int)req->op_flags);
+    case IORING_OP_FUTEX_WAIT:
+        return io_futex_wait(ctx, req);
+    case IORING_OP_FUTEX_WAKE:
+        if (!req->addr || (req->addr & 3)) return -EINVAL;
+        return futex_wake((uint32_t *)(uintptr_t)req->addr, (int)req->len);
+    default:
+        return -EINVAL;
+    }
+}
+
+/* Issue req and, while each succeeds, the rest of its chain */
+static void io_queue(io_ring_ctx_t *ctx, io_kiocb_t *req) {
+    while (req) {
+        /* A queued futex wait may be woken and freed before io_issue returns */
+        bool futex = req->opcode == IORING_OP_FUTEX_WAIT;
+        int64_t ret = io_issue(ctx, req);
+        if (ret == -EIOCBQUEUED) {
+            if (!futex) {
+                req->next = ctx->pending;
+                ctx->pending = req;
+            }
+            return;
+        }
+        req = io_req_complete(ctx, req, (int32_t)ret, true);
+    }
+}
+
+static void io_retry_pending(io_ring_ctx_t *ctx) {
+    io_kiocb_t *list = ctx->pending;
+    ctx->pending = NULL;
+    while (list) {
+        io_kiocb_t *req = list;
+        list = req->next;
+        io_queue(ctx, req);
+    }
+}
+
+static void io_run_deferred(io_ring_ctx_t *ctx) {
+    if (!__atomic_load_n(&ctx->deferred, __ATOMIC_RELAXED)) return;
+
+    spin_lock(&ctx->completion_lock);
+    io_kiocb_t *list = ctx->deferred;
+    ctx->deferred = NULL;
+    spin_unlock(&ctx->completion_lock);
+
+    while (list) {
+        io_kiocb_t *req = list;
+        list = req->next;
+        io_queue(ctx, req);
+    }
+}
+
+/* Consume up to nr SQEs; returns how many were taken */
+static int io_submit_sqes(io_ring_ctx_t *ctx, uint32_t nr) {
+    io_rings_t *r = ctx->rings;
+    uint32_t head = r->sq.head;
+    uint32_t avail = __atomic_load_n(&r->sq.tail, __ATOMIC_ACQUIRE) - head;
+    io_kiocb_t *chain = NULL, *chain_tail = NULL;
+    uint32_t i;
+
+    if (nr > avail) nr = avail;
+    for (i = 0; i < nr; i++) {
+        const io_uring_sqe_t *sqe = &ctx->sqes[(head + i) & r->sq_ring_mask];
+        io_kiocb_t *req = io_alloc_req(ctx);
+        if (!req) break;
+
+        req->ctx = ctx;
+        req->opcode = sqe->opcode;
+        req->flags = sqe->flags;
+        req->fd = sqe->fd;
+        req->off = sqe->off;
+        req->addr = sqe->addr;
+        req->len = sqe->len;
+        req->op_flags = sqe->op_flags;
+        req->user_data = sqe->user_data;
+        req->link = NULL;
+        req->next = NULL;
+
+        if (chain) chain_tail->link = req;
+        else chain = req;
+        chain_tail = req;
+        if (!(req->flags & IOSQE_IO_LINK)) {
+            io_queue(ctx, chain);
+            chain = NULL;
+        }
+    }
+    /* A link flag on the batch's last SQE links to nothing */
+    if (chain) io_queue(ctx, chain);
+
+    __atomic_store_n(&r->sq.head, head + i, __ATOMIC_RELEASE);
+    return (int)i;
+}
+
+static uint32_t io_cqring_events(io_ring_ctx_t *ctx) {
+    io_rings_t *r = ctx->rings;
+    return __atomic_load_n(&r->cq.tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&r->cq.head, __ATOMIC_ACQUIRE);
+}
+
+int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    file_t *file = fd < 0 ? NULL : fget((unsigned int)fd);
+    if (!file) return -EBADF;
+    if (file->f_op != &io_uring_fops) {
+        fput(file);
+        return -EOPNOTSUPP;
+    }
+    io_ring_ctx_t *ctx = file->private_data;
+
+    spin_lock(&ctx->uring_lock);
+    if (ctx->overflow) io_flush_overflow(ctx);
+    io_run_deferred(ctx);
+    int submitted = to_submit ? io_submit_sqes(ctx, to_submit) : 0;
+    if (ctx->pending) io_retry_pending(ctx);
+
+    if (flags & IORING_ENTER_GETEVENTS) {
+        if (min_complete > ctx->cq_entries) min_complete = ctx->cq_entries;
+        for (int spins = 0; io_cqring_events(ctx) < min_complete; spins++) {
+            /* Stop when nothing left in flight could complete */
+            if (!ctx->pending && !ctx->overflow &&
+                !__atomic_load_n(&ctx->nr_futex, __ATOMIC_ACQUIRE) &&
+                !__atomic_load_n(&ctx->deferred, __ATOMIC_ACQUIRE))
+                break;
+            if (spins >= 16) {
+                cond_resched();
+                spins = 0;
+            }
+            if (ctx->overflow) io_flush_overflow(ctx);
+            io_run_deferred(ctx);
+            if (ctx->pending) io_retry_pending(ctx);
+        }
+    }
+    spin_unlock(&ctx->uring_lock);
+    fput(file);
+    return submitted;
+}
+
+/* ============================================================================
+ * Setup and teardown
+ * ============================================================================ */
+
+static void io_free_chain(io_kiocb_t *req) {
+    while (req) {
+        io_kiocb_t *link = req->link;
+        kfree(req);
+        req = link;
+    }
+}
+
+static void io_free_list(io_kiocb_t *list) {
+    while (list) {
+        io_kiocb_t *req = list;
+        list = req->next;
+        io_free_chain(req);
+    }
+}
+
+/* Last close of the ring fd: cancel everything in flight, without CQEs */
+static void io_uring_release(inode_t *inode, file_t *file) {
+    (void)inode;
+    io_ring_ctx_t *ctx = file->private_data;
+
+    spin_lock(&ctx->completion_lock);
+    io_kiocb_t *req = ctx->futex_list;
+    while (req) {
+        io_kiocb_t *next = req->next;
+        if (futex_unqueue(&req->futex)) {
+            *req->pprev = req->next;
+            if (req->next) req->next->pprev = req->pprev;
+            ctx->nr_futex--;
+            io_free_chain(req);
+        }
+        req = next;
+    }
+    spin_unlock(&ctx->completion_lock);
+
+    /* Wakes already under way finish with the ring still mapped */
+    while (__atomic_load_n(&ctx->nr_futex, __ATOMIC_ACQUIRE))
+        cond_resched();
+
+    io_free_list(ctx->pending);
+    io_free_list(ctx->deferred);
+    io_free_list(ctx->overflow);
+    io_kiocb_t *req_cache = ctx->free_reqs;
+    while (req_cache) {
+        io_kiocb_t *next = req_cache->next;
+        kfree(req_cache);
+        req_cache = next;
+    }
+    page_free(ctx->sqes_page);
+    page_free(ctx->rings_page);
+    kfree(ctx);
+}
+
+static const file_operations_t io_uring_fops = {
+    .release = io_uring_release,
+};
+
+static unsigned int pages_order(size_t size) {
+    unsigned int order = 0;
+    while ((PAGE_SIZE << order) < size) order++;
+    return order;
+}
+
+/* Create a ring pair of at least entries SQEs and return an fd for it */
+int io_uring_setup(uint32_t entries, io_uring_params_t *p) {
+    if (!p || entries == 0 || entries > IORING_MAX_ENTRIES) return -EINVAL;
+
+    uint32_t sq_entries = 1;
+    while (sq_entries < entries) sq_entries <<= 1;
+    uint32_t cq_entries = 2 * sq_entries;
+
+    /* Both regions are whole pages, as they would be if mapped to user space */
+    size_t rings_size = sizeof(io_rings_t) + cq_entries * sizeof(io_uring_cqe_t);
+    size_t sqes_size = sq_entries * sizeof(io_uring_sqe_t);
+    io_ring_ctx_t *ctx = kmalloc(sizeof(*ctx), GFP_KERNEL);
+    page_t *rings_page = page_alloc(pages_order(rings_size));
+    page_t *sqes_page = page_alloc(pages_order(sqes_size));
+    inode_t *inode = new_inode(NULL);
+    file_t *file = NULL;
+    int fd = -ENOMEM;
+    if (!ctx || !rings_page || !sqes_page || !inode) goto fail;
+
+    io_rings_t *rings = page_to_virt(rings_page);
+    io_uring_sqe_t *sqes = page_to_virt(sqes_page);
+    memset(ctx, 0, sizeof(*ctx));
+    memset(rings, 0, rings_size);
+    memset(sqes, 0, sqes_size);
+    ctx->rings_page = rings_page;
+    ctx->sqes_page = sqes_page;
+    rings->sq_ring_mask = sq_entries - 1;
+    rings->cq_ring_mask = cq_entries - 1;
+    rings->sq_ring_entries = sq_entries;
+    rings->cq_ring_entries = cq_entries;
+    ctx->rings = rings;
+    ctx->sqes = sqes;
+    ctx->sq_entries = sq_entries;
+    ctx->cq_entries = cq_entries;
+    ctx->overflow_tail = &ctx->overflow;
+
+    files_struct_t *files = current_files();
+    fd = alloc_fd(files, 0);
+    if (fd < 0) goto fail;
+    file = alloc_file_pseudo(inode, O_RDWR, &io_uring_fops);
+    if (!file) {
+        put_unused_fd(files, (unsigned int)fd);
+        fd = -ENOMEM;
+        goto fail;
+    }
+    file->private_data = ctx;
+    fd_install(files, (unsigned int)fd, file);
+
+    p->sq_entries = sq_entries;
+    p->cq_entries = cq_entries;
+    p->rings = rings;
+    p->sqes = sqes;
+    return fd;
+
+fail:
+    if (inode) iput(inode);
+    if (sqes_page) page_free(sqes_page);
+    if (rings_page) page_free(rings_page);
+    kfree(ctx);
+    return fd;
+}
@@ -0,0 +1,737 @@
+/**
+ * JBD2 journal
+ *
+ * Block journal compatible with the Linux JBD2 on-disk format (v2
+ * superblock, revoke and 64bit features, no checksums). Metadata
+ * buffers joined to the running transaction are pinned in memory
+ * until the transaction is logged; a commit writes descriptor, data,
+ * revoke and commit blocks, and checkpointing later copies the logged
+ * buffers to their home locations so the log can be reused.
+ *
+ * All entry points except jbd2_complete_transaction() are called with
+ * the filesystem lock (j_lock) held, which also serialises handles.
+ */
+
+#include "ext4.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Yields per round and rounds a group-commit leader waits for joiners */
+#define JBD2_BATCH_YIELDS   8
+#define JBD2_BATCH_ROUNDS   8
+
+static inline uint32_t be32(uint32_t x) { return __builtin_bswap32(x); }
+static inline uint16_t be16(uint16_t x) { return __builtin_bswap16(x); }
+static inline uint64_t be64(uint64_t x) { return __builtin_bswap64(x); }
+
+static inline uint32_t log_next(journal_t *j, uint32_t blk) {
+    return ++blk == j->j_last ? j->j_first : blk;
+}
+
+static int log_write(journal_t *j, uint32_t blk, const void *buf) {
+    return block_write(j->j_dev, j->j_blockmap[blk] * j->j_blocksize, buf, j->j_blocksize);
+}
+
+static int log_read(journal_t *j, uint32_t blk, void *buf) {
+    return block_read(j->j_dev, j->j_blockmap[blk] * j->j_blocksize, buf, j->j_blocksize);
+}
+
+static int journal_update_sb(journal_t *j, uint32_t start, uint32_t sequence) {
+    journal_superblock_t *jsb = (journal_superblock_t *)j->j_sb_bh->b_data;
+
+    jsb->s_start = be32(start);
+    jsb->s_sequence = be32(sequence);
+    mark_buffer_dirty(j->j_sb_bh);
+    if (sync_dirty_buffer(j->j_sb_bh) < 0)
+        return -EIO;
+    return block_flush(j->j_dev);
+}
+
+/**
+ * jbd2_journal_load
+ *
+ * Attach to the journal whose log blocks map to the given device blocks.
+ * Takes ownership of blockmap.
+ */
+journal_t *jbd2_journal_load(block_device_t *bdev, uint32_t blocksize,
+                             const uint64_t *blockmap, uint32_t nr_blocks,
+                             spinlock_t *lock) {
+    buffer_head_t *bh = bread(bdev, blockmap[0], blocksize);
+    if (!bh) return NULL;
+
+    journal_superblock_t *jsb = (journal_superblock_t *)bh->b_data;
+    uint32_t incompat = be32(jsb->s_feature_incompat);
+
+    if (be32(jsb->s_header.h_magic) != JBD2_MAGIC_NUMBER ||
+        be32(jsb->s_header.h_blocktype) != JBD2_SUPERBLOCK_V2 ||
+        be32(jsb->s_blocksize) != blocksize ||
+        be32(jsb->s_maxlen) > nr_blocks ||
+        be32(jsb->s_first) == 0 || be32(jsb->s_first) >= be32(jsb->s_maxlen)) {
+        pr_err("jbd2: invalid journal superblock\n");
+        brelse(bh);
+        return NULL;
+    }
+    if (incompat & ~JBD2_KNOWN_INCOMPAT_FEATURES) {
+        pr_err("jbd2: unsupported journal features 0x%x\n", incompat);
+        brelse(bh);
+        return NULL;
+    }
+
+    journal_t *j = kmalloc(sizeof(*j), GFP_KERNEL);
+    if (!j) {
+        brelse(bh);
+        return NULL;
+    }
+    memset(j, 0, sizeof(*j));
+
+    j->j_dev = bdev;
+    j->j_blocksize = blocksize;
+    j->j_sb_bh = bh;
+    j->j_blockmap = (uint64_t *)blockmap;
+    j->j_first = be32(jsb->s_first);
+    j->j_last = be32(jsb->s_maxlen);
+    j->j_incompat = incompat;
+    j->j_tag_bytes = (incompat & JBD2_FEATURE_INCOMPAT_64BIT) ? 12 : 8;
+    memcpy(j->j_uuid, jsb->s_uuid, sizeof(j->j_uuid));
+    j->j_lock = lock;
+
+    j->j_transaction_sequence = be32(jsb->s_sequence);
+    j->j_commit_sequence = j->j_transaction_sequence - 1;
+    j->j_head = j->j_tail = j->j_first;
+    j->j_tail_sequence = j->j_transaction_sequence;
+    j->j_free = j->j_last - j->j_first;
+
+    /* Leave room for descriptors and a commit block in every quarter */
+    j->j_max_transaction_buffers = j->j_free / 4;
+    if (j->j_max_transaction_buffers > 64)
+        j->j_max_transaction_buffers -= 32;
+
+    return j;
+}
+
+/* Revoke table used during recovery: block -> newest revoking tid */
+typedef struct {
+    uint64_t *blocks;
+    uint32_t *tids;
+    uint32_t cap, count;
+} revoke_table_t;
+
+static uint32_t *revoke_slot(revoke_table_t *rt, uint64_t block, bool insert) {
+    if (insert && (rt->count + 1) * 2 > rt->cap) {
+        uint32_t new_cap = rt->cap ? rt->cap * 2 : 1024;
+        uint64_t *blocks = kmalloc(new_cap * sizeof(uint64_t), GFP_KERNEL);
+        uint32_t *tids = kmalloc(new_cap * sizeof(uint32_t), GFP_KERNEL);
+        if (!blocks || !tids) {
+            kfree(blocks);
+            kfree(tids);
+            return NULL;
+        }
+        memset(blocks, 0xff, new_cap * sizeof(uint64_t));
+        for (uint32_t i = 0; i < rt->cap; i++) {
+            if (rt->blocks[i] == UINT64_MAX) continue;
+            uint32_t h = (uint32_t)(rt->blocks[i] * 0x9e3779b97f4a7c15ULL >> 32) & (new_cap - 1);
+            while (blocks[h] != UINT64_MAX) h = (h + 1) & (new_cap - 1);
+            blocks[h] = rt->blocks[i];
+            tids[h] = rt->tids[i];
+        }
+        kfree(rt->blocks);
+        kfree(rt->tids);
+        rt->blocks = blocks;
+        rt->tids = tids;
+        rt->cap = new_cap;
+    }
+    if (!rt->cap) return NULL;
+
+    uint32_t h = (uint32_t)(block * 0x9e3779b97f4a7c15ULL >> 32) & (rt->cap - 1);
+    while (rt->blocks[h] != UINT64_MAX) {
+        if (rt->blocks[h] == block) return &rt->tids[h];
+        h = (h + 1) & (rt->cap - 1);
+    }
+    if (!insert) return NULL;
+    rt->blocks[h] = block;
+    rt->count++;
+    return &rt->tids[h];
+}
+
+enum { PASS_SCAN, PASS_REPLAY };
+
+/*
+ * One sweep over the log from the tail. PASS_SCAN finds the end of the
+ * committed log and fills the revoke table; PASS_REPLAY copies every
+ * logged block that was not revoked by a later transaction home.
+ */
+static int do_one_pass(journal_t *j, int pass, revoke_table_t *rt,
+                       uint32_t *end_tid, unsigned int *replayed) {
+    journal_superblock_t *jsb = (journal_superblock_t *)j->j_sb_bh->b_data;
+    uint32_t blk = be32(jsb->s_start);
+    uint32_t tid = be32(jsb->s_sequence);
+    uint8_t *buf = kmalloc(j->j_blocksize, GFP_KERNEL);
+    uint8_t *data = kmalloc(j->j_blocksize, GFP_KERNEL);
+    int ret = 0;
+
+    if (!buf || !data) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (;;) {
+        if (pass == PASS_REPLAY && tid == *end_tid)
+            break;
+        if (log_read(j, blk, buf) < 0) {
+            ret = -EIO;
+            break;
+        }
+
+        journal_header_t *hdr = (journal_header_t *)buf;
+        if (be32(hdr->h_magic) != JBD2_MAGIC_NUMBER || be32(hdr->h_sequence) != tid)
+            break;
+        blk = log_next(j, blk);
+
+        switch (be32(hdr->h_blocktype)) {
+        case JBD2_DESCRIPTOR_BLOCK: {
+            unsigned int off = sizeof(journal_header_t);
+            while (off + j->j_tag_bytes <= j->j_blocksize) {
+                journal_block_tag_t *tag = (journal_block_tag_t *)(buf + off);
+                uint16_t flags = be16(tag->t_flags);
+                uint64_t home = be32(tag->t_blocknr);
+                if (j->j_incompat & JBD2_FEATURE_INCOMPAT_64BIT)
+                    home |= (uint64_t)be32(tag->t_blocknr_high) << 32;
+
+                if (pass == PASS_REPLAY) {
+                    uint32_t *rtid = revoke_slot(rt, home, false);
+                    if (!rtid || !tid_geq(*rtid, tid)) {
+                        if (log_read(j, blk, data) < 0) {
+                            ret = -EIO;
+                            goto out;
+                        }
+                        if (flags & JBD2_FLAG_ESCAPE)
+                            *(uint32_t *)data = be32(JBD2_MAGIC_NUMBER);
+                        if (block_write(j->j_dev, home * j->j_blocksize, data, j->j_blocksize) < 0) {
+                            ret = -EIO;
+                            goto out;
+                        }
+                        (*replayed)++;
+                    }
+                }
+                blk = log_next(j, blk);
+                off += j->j_tag_bytes;
+                if (!(flags & JBD2_FLAG_SAME_UUID)) off += 16;
+                if (flags & JBD2_FLAG_LAST_TAG) break;
+            }
+            break;
+        }
+        case JBD2_REVOKE_BLOCK:
+            if (pass == PASS_SCAN) {
+                jbd2_journal_revoke_header_t *rh = (jbd2_journal_revoke_header_t *)buf;
+                uint32_t used = be32(rh->r_count);
+                unsigned int rec = (j->j_incompat & JBD2_FEATURE_INCOMPAT_64BIT) ? 8 : 4;
+                if (used > j->j_blocksize) used = j->j_blocksize;
+                for (uint32_t off = sizeof(*rh); off + rec <= used; off += rec) {
+                    uint64_t block = rec == 8 ? be64(*(uint64_t *)(buf + off))
+                                              : be32(*(uint32_t *)(buf + off));
+                    uint32_t *rtid = revoke_slot(rt, block, true);
+                    if (!rtid) {
+                        ret = -ENOMEM;
+                        goto out;
+                    }
+                    *rtid = tid;
+                }
+            }
+            break;
+        case JBD2_COMMIT_BLOCK:
+            tid++;
+            break;
+        default:
+            goto done;
+        }
+    }
+done:
+    if (pass == PASS_SCAN)
+        *end_tid = tid;
+out:
+    kfree(buf);
+    kfree(data);
+    return ret;
+}
+
+/**
+ * jbd2_journal_recover
+ *
+ * Replay every committed transaction left in the log by an unclean
+ * shutdown, then mark the log empty.
+ */
+int jbd2_journal_recover(journal_t *j) {
+    journal_superblock_t *jsb = (journal_superblock_t *)j->j_sb_bh->b_data;
+    if (jsb->s_start == 0)
+        return 0;
+
+    revoke_table_t rt = { 0 };
+    uint32_t start_tid = be32(jsb->s_sequence), end_tid = start_tid;
+    unsigned int replayed = 0;
+
+    int ret = do_one_pass(j, PASS_SCAN, &rt, &end_tid, &replayed);
+    if (ret == 0)
+        ret = do_one_pass(j, PASS_REPLAY, &rt, &end_tid, &replayed);
+    kfree(rt.blocks);
+    kfree(rt.tids);
+    if (ret < 0)
+        return ret;
+    if (block_flush(j->j_dev) < 0)
+        return -EIO;
+
+    pr_info("jbd2: recovery replayed %u blocks from transactions %u-%u\n",
+            replayed, start_tid, end_tid - 1);
+
+    /* Skip a tid so stale blocks past the old head can never match */
+    j->j_transaction_sequence = end_tid + 1;
+    j->j_commit_sequence = end_tid;
+    j->j_tail_sequence = j->j_transaction_sequence;
+    return journal_update_sb(j, 0, j->j_transaction_sequence);
+}
+
+static void cp_add(transaction_t *t, journal_head_t *jh) {
+    jh->b_cp_transaction = t;
+    jh->b_cpprev = NULL;
+    jh->b_cpnext = t->t_checkpoint_list;
+    if (t->t_checkpoint_list) t->t_checkpoint_list->b_cpprev = jh;
+    t->t_checkpoint_list = jh;
+}
+
+static void cp_del(journal_head_t *jh) {
+    transaction_t *t = jh->b_cp_transaction;
+    if (jh->b_cpprev) jh->b_cpprev->b_cpnext = jh->b_cpnext;
+    else t->t_checkpoint_list = jh->b_cpnext;
+    if (jh->b_cpnext) jh->b_cpnext->b_cpprev = jh->b_cpprev;
+    jh->b_cp_transaction = NULL;
+}
+
+/* Release the journal's hold on a buffer */
+static void journal_put_buffer(journal_head_t *jh) {
+    buffer_head_t *bh = jh->b_bh;
+    bh->b_private = NULL;
+    bh->b_state &= ~BH_JBD;
+    kfree(jh->b_committed_data);
+    kfree(jh);
+    brelse(bh);
+}
+
+static transaction_t *start_transaction(journal_t *j) {
+    transaction_t *t = kmalloc(sizeof(*t), GFP_KERNEL);
+    if (!t) return NULL;
+    memset(t, 0, sizeof(*t));
+    t->t_tid = j->j_transaction_sequence++;
+    j->j_running = t;
+    return t;
+}
+
+/**
+ * jbd2_journal_start
+ *
+ * Open a handle on the running transaction, committing it first if the
+ * caller's worst-case nblocks would overflow it, and checkpointing if
+ * the log is running out of room.
+ */
+handle_t *jbd2_journal_start(journal_t *j, handle_t *handle, unsigned int nblocks) {
+    transaction_t *t = j->j_running;
+
+    if (t && t->t_updates == 0 &&
+        t->t_nr_buffers + nblocks > j->j_max_transaction_buffers) {
+        if (jbd2_journal_commit_transaction(j) < 0)
+            return NULL;
+        t = j->j_running;
+    }
+
+    /* A commit must always find a full transaction's worth of log free */
+    if (j->j_free < 2 * j->j_max_transaction_buffers + 64 &&
+        (!t || t->t_updates == 0)) {
+        if (jbd2_log_checkpoint_all(j) < 0)
+            return NULL;
+        t = j->j_running;
+    }
+
+    if (!t && !(t = start_transaction(j)))
+        return NULL;
+
+    t->t_updates++;
+    handle->h_transaction = t;
+    return handle;
+}
+
+void jbd2_journal_stop(handle_t *handle) {
+    handle->h_transaction->t_updates--;
+    handle->h_transaction = NULL;
+}
+
+/**
+ * jbd2_journal_get_write_access
+ *
+ * Join a metadata buffer to the handle's transaction. From here until
+ * it is checkpointed, the buffer is only ever written to the log.
+ */
+int jbd2_journal_get_write_access(handle_t *handle, buffer_head_t *bh) {
+    transaction_t *t = handle->h_transaction;
+    journal_head_t *jh = bh->b_private;
+
+    if (!jh) {
+        jh = kmalloc(sizeof(*jh), GFP_KERNEL);
+        if (!jh) return -ENOMEM;
+        memset(jh, 0, sizeof(*jh));
+        jh->b_bh = bh;
+        bh->b_private = jh;
+        bh->b_state |= BH_JBD;
+        get_bh(bh);
+    }
+    if (jh->b_transaction == t)
+        return 0;
+
+    jh->b_transaction = t;
+    jh->b_tnext = t->t_buffers;
+    t->t_buffers = jh;
+    t->t_nr_buffers++;
+    return 0;
+}
+
+/**
+ * jbd2_journal_get_undo_access
+ *
+ * Like get_write_access, but keeps a copy of the committed contents.
+ * Allocation bitmaps use it so blocks freed in the running transaction
+ * are not handed out again until the free is durable.
+ */
+int jbd2_journal_get_undo_access(handle_t *handle, buffer_head_t *bh) {
+    int ret = jbd2_journal_get_write_access(handle, bh);
+    if (ret < 0) return ret;
+
+    journal_head_t *jh = bh->b_private;
+    if (!jh->b_committed_data) {
+        jh->b_committed_data = kmalloc(bh->b_size, GFP_KERNEL);
+        if (!jh->b_committed_data) return -ENOMEM;
+        memcpy(jh->b_committed_data, bh->b_data, bh->b_size);
+    }
+    return 0;
+}
+
+/**
+ * jbd2_journal_revoke
+ *
+ * Record that a freed metadata block must not be replayed from older
+ * transactions, and drop any pending journal writes of it.
+ */
+int jbd2_journal_revoke(handle_t *handle, uint64_t blocknr, buffer_head_t *bh) {
+    transaction_t *t = handle->h_transaction;
+
+    if (t->t_nr_revoked == t->t_max_revoked) {
+        unsigned int cap = t->t_max_revoked ? t->t_max_revoked * 2 : 64;
+        uint64_t *revoked = kmalloc(cap * sizeof(uint64_t), GFP_KERNEL);
+        if (!revoked) return -ENOMEM;
+        if (t->t_revoked)
+            memcpy(revoked, t->t_revoked, t->t_nr_revoked * sizeof(uint64_t));
+        kfree(t->t_revoked);
+        t->t_revoked = revoked;
+        t->t_max_revoked = cap;
+    }
+    t->t_revoked[t->t_nr_revoked++] = blocknr;
+
+    journal_head_t *jh = bh ? bh->b_private : NULL;
+    if (jh) {
+        if (jh->b_transaction == t) {
+            journal_head_t **pp = &t->t_buffers;
+            while (*pp != jh) pp = &(*pp)->b_tnext;
+            *pp = jh->b_tnext;
+            t->t_nr_buffers--;
+        }
+        if (jh->b_cp_transaction)
+            cp_del(jh);
+        bh->b_state &= ~BH_Dirty;
+        journal_put_buffer(jh);
+    } else if (bh) {
+        bh->b_state &= ~BH_Dirty;
+    }
+    return 0;
+}
+
+/* Write the running transaction's revoke records to the log */
+static int write_revoke_records(journal_t *j, transaction_t *t, uint8_t *buf) {
+    unsigned int rec = (j->j_incompat & JBD2_FEATURE_INCOMPAT_64BIT) ? 8 : 4;
+    unsigned int i = 0;
+
+    while (i < t->t_nr_revoked) {
+        jbd2_journal_revoke_header_t *rh = (jbd2_journal_revoke_header_t *)buf;
+        uint32_t off = sizeof(*rh);
+
+        memset(buf, 0, j->j_blocksize);
+        rh->r_header.h_magic = be32(JBD2_MAGIC_NUMBER);
+        rh->r_header.h_blocktype = be32(JBD2_REVOKE_BLOCK);
+        rh->r_header.h_sequence = be32(t->t_tid);
+        for (; i < t->t_nr_revoked && off + rec <= j->j_blocksize; i++, off += rec) {
+            if (rec == 8) *(uint64_t *)(buf + off) = be64(t->t_revoked[i]);
+            else *(uint32_t *)(buf + off) = be32((uint32_t)t->t_revoked[i]);
+        }
+        rh->r_count = be32(off);
+
+        if (log_write(j, j->j_head, buf) < 0) return -EIO;
+        j->j_head = log_next(j, j->j_head);
+        j->j_free--;
+    }
+    return 0;
+}
+
+/**
+ * jbd2_journal_commit_transaction
+ *
+ * Log the running transaction: flush ordered file data, write descriptor
+ * and metadata blocks, then a commit block once they are stable.
+ */
+int jbd2_journal_commit_transaction(journal_t *j) {
+    transaction_t *t = j->j_running;
+    if (!t || (t->t_nr_buffers == 0 && t->t_nr_revoked == 0))
+        return 0;
+    if (t->t_updates)
+        return -EBUSY;
+
+    unsigned int per_desc = (j->j_blocksize - sizeof(journal_header_t) - 16) / j->j_tag_bytes;
+    unsigned int needed = t->t_nr_buffers + t->t_nr_buffers / per_desc + 2 +
+                          t->t_nr_revoked / ((j->j_blocksize - 16) / 4) + 1;
+    if (needed > j->j_free) {
+        pr_err("jbd2: transaction %u needs %u log blocks, %u free\n",
+               t->t_tid, needed, j->j_free);
+        return -ENOSPC;
+    }
+
+    uint8_t *desc = kmalloc(j->j_blocksize, GFP_KERNEL);
+    uint8_t *escaped = kmalloc(j->j_blocksize, GFP_KERNEL);
+    int ret = -ENOMEM;
+    if (!desc || !escaped) goto out;
+    ret = -EIO;
+
+    j->j_running = NULL;
+
+    /* Ordered mode: file data is on disk before metadata pointing at it */
+    if (sync_blockdev(j->j_dev) < 0) goto out;
+
+    if (!(j->j_flags & JBD2_LOG_DIRTY)) {
+        j->j_tail = j->j_head;
+        j->j_tail_sequence = t->t_tid;
+        if (journal_update_sb(j, j->j_head, t->t_tid) < 0) goto out;
+        j->j_flags |= JBD2_LOG_DIRTY;
+    }
+    t->t_log_start = j->j_head;
+
+    if (write_revoke_records(j, t, desc) < 0) goto out;
+
+    journal_head_t *jh = t->t_buffers;
+    while (jh) {
+        uint32_t desc_blk = j->j_head;
+        unsigned int off = sizeof(journal_header_t);
+        journal_block_tag_t *last = NULL;
+
+        j->j_head = log_next(j, j->j_head);
+        j->j_free--;
+        memset(desc, 0, j->j_blocksize);
+        journal_header_t *hdr = (journal_header_t *)desc;
+        hdr->h_magic = be32(JBD2_MAGIC_NUMBER);
+        hdr->h_blocktype = be32(JBD2_DESCRIPTOR_BLOCK);
+        hdr->h_sequence = be32(t->t_tid);
+
+        while (jh && off + j->j_tag_bytes + (last ? 0 : 16) <= j->j_blocksize) {
+            buffer_head_t *bh = jh->b_bh;
+            const uint8_t *data = bh->b_data;
+            uint16_t flags = last ? JBD2_FLAG_SAME_UUID : 0;
+
+            if (be32(*(const uint32_t *)data) == JBD2_MAGIC_NUMBER) {
+                memcpy(escaped, data, j->j_blocksize);
+                *(uint32_t *)escaped = 0;
+                data = escaped;
+                flags |= JBD2_FLAG_ESCAPE;
+            }
+            if (log_write(j, j->j_head, data) < 0) goto out;
+            j->j_head = log_next(j, j->j_head);
+            j->j_free--;
+
+            journal_block_tag_t *tag = (journal_block_tag_t *)(desc + off);
+            tag->t_blocknr = be32((uint32_t)bh->b_blocknr);
+            tag->t_flags = be16(flags);
+            if (j->j_incompat & JBD2_FEATURE_INCOMPAT_64BIT)
+                tag->t_blocknr_high = be32((uint32_t)(bh->b_blocknr >> 32));
+            off += j->j_tag_bytes;
+            if (!last) {
+                memcpy(desc + off, j->j_uuid, 16);
+                off += 16;
+            }
+            last = tag;
+            jh = jh->b_tnext;
+        }
+        last->t_flags |= be16(JBD2_FLAG_LAST_TAG);
+        if (log_write(j, desc_blk, desc) < 0) goto out;
+    }
+
+    /* Everything before the commit block must be stable first */
+    if (block_flush(j->j_dev) < 0) goto out;
+
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    memset(desc, 0, j->j_blocksize);
+    struct commit_header *ch = (struct commit_header *)desc;
+    ch->h_magic = be32(JBD2_MAGIC_NUMBER);
+    ch->h_blocktype = be32(JBD2_COMMIT_BLOCK);
+    ch->h_sequence = be32(t->t_tid);
+    ch->h_commit_sec = be64((uint64_t)now.tv_sec);
+    ch->h_commit_nsec = be32((uint32_t)now.tv_nsec);
+    if (log_write(j, j->j_head, desc) < 0) goto out;
+    j->j_head = log_next(j, j->j_head);
+    j->j_free--;
+    if (block_flush(j->j_dev) < 0) goto out;
+
+    /* Logged buffers now owe a checkpoint write to their home location */
+    for (jh = t->t_buffers; jh; ) {
+        journal_head_t *next = jh->b_tnext;
+        jh->b_transaction = NULL;
+        jh->b_tnext = NULL;
+        kfree(jh->b_committed_data);
+        jh->b_committed_data = NULL;
+        if (jh->b_cp_transaction)
+            cp_del(jh);
+        cp_add(t, jh);
+        jh = next;
+    }
+    j->j_stat_commits++;
+    j->j_stat_blocks_logged += t->t_nr_buffers;
+    t->t_buffers = NULL;
+    kfree(t->t_revoked);
+    t->t_revoked = NULL;
+    t->t_nr_revoked = t->t_max_revoked = 0;
+
+    if (j->j_checkpoint_last) j->j_checkpoint_last->t_cpnext = t;
+    else j->j_checkpoint_first = t;
+    j->j_checkpoint_last = t;
+
+    __atomic_store_n(&j->j_commit_sequence, t->t_tid, __ATOMIC_RELEASE);
+    ret = 0;
+out:
+    if (ret < 0) {
+        /* The log may now be inconsistent; stop accepting updates */
+        pr_err("jbd2: commit of transaction %u failed (%d)\n", t->t_tid, ret);
+        if (!j->j_running) j->j_running = t;
+    }
+    kfree(desc);
+    kfree(escaped);
+    return ret;
+}
+
+/**
+ * jbd2_log_checkpoint_all
+ *
+ * Commit the running transaction, write every logged buffer home and
+ * reset the log to empty.
+ */
+int jbd2_log_checkpoint_all(journal_t *j) {
+    int ret = jbd2_journal_commit_transaction(j);
+    if (ret < 0) return ret;
+
+    for (transaction_t *t = j->j_checkpoint_first; t; ) {
+        transaction_t *next = t->t_cpnext;
+        while (t->t_checkpoint_list) {
+            journal_head_t *jh = t->t_checkpoint_list;
+            cp_del(jh);
+            if (sync_dirty_buffer(jh->b_bh) < 0)
+                ret = -EIO;
+            if (!jh->b_transaction)
+                journal_put_buffer(jh);
+        }
+        kfree(t);
+        t = next;
+    }
+    j->j_checkpoint_first = j->j_checkpoint_last = NULL;
+    if (ret < 0) return ret;
+    if (block_flush(j->j_dev) < 0) return -EIO;
+
+    j->j_tail = j->j_head;
+    j->j_tail_sequence = j->j_transaction_sequence;
+    j->j_free = j->j_last - j->j_first;
+    return journal_update_sb(j, j->j_head, j->j_tail_sequence);
+}
+
+uint32_t jbd2_running_tid(journal_t *j) {
+    return j->j_running ? j->j_running->t_tid : j->j_commit_sequence;
+}
+
+/**
+ * jbd2_complete_transaction
+ *
+ * Make transaction tid durable. Called without the filesystem lock so
+ * that concurrent fsync() callers can pile into the same transaction:
+ * in group-commit mode the caller first yields while other fsyncs keep
+ * arriving, then whichever caller gets the lock first commits for all.
+ */
+int jbd2_complete_transaction(journal_t *j, uint32_t tid) {
+    if (tid_geq(__atomic_load_n(&j->j_commit_sequence, __ATOMIC_ACQUIRE), tid))
+        return 0;
+
+    if (j->j_flags & JBD2_GROUP_COMMIT) {
+        unsigned int old, rounds = 0;
+        __atomic_add_fetch(&j->j_fsync_waiters, 1, __ATOMIC_RELAXED);
+        do {
+            old = __atomic_load_n(&j->j_fsync_waiters, __ATOMIC_RELAXED);
+            for (int i = 0; i < JBD2_BATCH_YIELDS; i++)
+                cond_resched();
+        } while (old != __atomic_load_n(&j->j_fsync_waiters, __ATOMIC_RELAXED) &&
+                 ++rounds < JBD2_BATCH_ROUNDS &&
+                 !tid_geq(__atomic_load_n(&j->j_commit_sequence, __ATOMIC_ACQUIRE), tid));
+    }
+
+    int ret = 0;
+    spin_lock(j->j_lock);
+    if (!tid_geq(j->j_commit_sequence, tid) && j->j_running && j->j_running->t_tid == tid)
+        ret = jbd2_journal_commit_transaction(j);
+    else
+        j->j_stat_fsync_batched++;
+    spin_unlock(j->j_lock);
+    return ret;
+}
+
+/**
+ * jbd2_journal_destroy
+ *
+ * Detach from the journal. A clean shutdown checkpoints everything and
+ * marks the log empty; otherwise the log is left for recovery, as if the
+ * machine lost power after the last commit.
+ */
+void jbd2_journal_destroy(journal_t *j, bool clean) {
+    if (clean) {
+        if (jbd2_log_checkpoint_all(j) == 0)
+            journal_update_sb(j, 0, j->j_transaction_sequence);
+    } else {
+        jbd2_journal_commit_transaction(j);
+    }
+
+    /* Anything still pinned is dropped without reaching its home block */
+    transaction_t *running = j->j_running;
+    if (running) {
+        while (running->t_buffers) {
+            journal_head_t *jh = running->t_buffers;
+            running->t_buffers = jh->b_tnext;
+            jh->b_transaction = NULL;
+            if (jh->b_cp_transaction) cp_del(jh);
+            jh->b_bh->b_state &= ~BH_Dirty;
+            journal_put_buffer(jh);
+        }
+        kfree(running->t_revoked);
+        kfree(running);
+    }
+    for (transaction_t *t = j->j_checkpoint_first; t; ) {
+        transaction_t *next = t->t_cpnext;
+        while (t->t_checkpoint_list) {
+            journal_head_t *jh = t->t_checkpoint_list;
+            cp_del(jh);
+            jh->b_bh->b_state &= ~BH_Dirty;
+            journal_put_buffer(jh);
+        }
+        kfree(t);
+        t = next;
+    }
+
+    brelse(j->j_sb_bh);
+    kfree(j->j_blockmap);
+    kfree(j);
+}
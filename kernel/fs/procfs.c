@@ -0,0 +1,576 @@
+/**
+ * procfs
+ *
+ * Live views of kernel state, generated on read through seq_file:
+ *
+ *   /proc/meminfo      totals from the buddy free lists and page cache
+ *   /proc/vmstat       reclaim and LRU event counters
+ *   /proc/buddyinfo    free blocks per order
+ *   /proc/slabinfo     kmalloc caches (slabinfo 2.1 layout)
+ *   /proc/mounts       the VFS mount table
+ *   /proc/interrupts   per-CPU counts for each vector with a handler
+ *   /proc/softirqs     per-CPU counts of softirq runs
+ *   /proc/initcalls    the boot report: when each initcall ran and for how long
+ *   /proc/<pid>/stat   one line per process (Linux field order)
+ *
+ * Inodes are built on lookup and freed on the last iput; nothing is
+ * cached, so a lookup of an exited pid simply fails.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#define PROC_ROOT_INO       1
+#define PROC_PID_INO(pid, n) (((uint32_t)(pid) << 8) | (n))
+
+typedef struct proc_entry {
+    const char *name;
+    const seq_operations_t *seq_ops;
+} proc_entry_t;
+
+static const inode_operations_t proc_root_inode_ops;
+static const inode_operations_t proc_pid_inode_ops;
+static const file_operations_t proc_root_ops;
+static const file_operations_t proc_pid_ops;
+static const file_operations_t proc_seq_ops;
+
+/* ============================================================================
+ * Generators
+ *
+ * Records are numbered from 0; the iterator cookie is index + 1 so that
+ * record 0 is not a NULL pointer.
+ * ============================================================================ */
+
+static inline void *rec_cookie(uint64_t index) {
+    return (void *)(uintptr_t)(index + 1);
+}
+
+static inline uint64_t rec_index(void *v) {
+    return (uint64_t)(uintptr_t)v - 1;
+}
+
+static void *single_start(seq_file_t *m, uint64_t *index) {
+    (void)m;
+    return *index == 0 ? rec_cookie(0) : NULL;
+}
+
+static void *single_next(seq_file_t *m, void *v, uint64_t *index) {
+    (void)m;
+    (void)v;
+    ++*index;
+    return NULL;
+}
+
+static void *table_next(seq_file_t *m, void *v, uint64_t *index) {
+    (void)v;
+    ++*index;
+    return m->op->start(m, index);
+}
+
+static unsigned long slab_pages(void) {
+    kmem_cache_info_t ci;
+    unsigned long bytes = 0;
+    for (unsigned int i = 0; kmem_cache_info(i, &ci) == 0; i++)
+        bytes += ci.nr_slabs * ci.slab_size;
+    return bytes >> PAGE_SHIFT;
+}
+
+static int meminfo_show(seq_file_t *m, void *v) {
+    (void)v;
+    unsigned long free = 0;
+    for (unsigned int order = 0; order < MAX_ORDER; order++)
+        free += nr_free_blocks(order) << order;
+
+    unsigned long kb = PAGE_SIZE / 1024;
+    seq_printf(m, "MemTotal:       %8lu kB\n", nr_total_pages() * kb);
+    seq_printf(m, "MemFree:        %8lu kB\n", free * kb);
+    seq_printf(m, "MemAvailable:   %8lu kB\n",
+               (free + nr_pagecache_pages() - nr_shmem_pages()) * kb);
+    seq_printf(m, "Cached:         %8lu kB\n", nr_pagecache_pages() * kb);
+    seq_printf(m, "Active:         %8lu kB\n",
+               (nr_lru_pages(LRU_ACTIVE_ANON) + nr_lru_pages(LRU_ACTIVE_FILE)) * kb);
+    seq_printf(m, "Inactive:       %8lu kB\n",
+               (nr_lru_pages(LRU_INACTIVE_ANON) + nr_lru_pages(LRU_INACTIVE_FILE)) * kb);
+    seq_printf(m, "Active(anon):   %8lu kB\n", nr_lru_pages(LRU_ACTIVE_ANON) * kb);
+    seq_printf(m, "Inactive(anon): %8lu kB\n", nr_lru_pages(LRU_INACTIVE_ANON) * kb);
+    seq_printf(m, "Active(file):   %8lu kB\n", nr_lru_pages(LRU_ACTIVE_FILE) * kb);
+    seq_printf(m, "Inactive(file): %8lu kB\n", nr_lru_pages(LRU_INACTIVE_FILE) * kb);
+    seq_printf(m, "Shmem:          %8lu kB\n", nr_shmem_pages() * kb);
+    seq_printf(m, "Slab:           %8lu kB\n", slab_pages() * kb);
+    return 0;
+}
+
+static const seq_operations_t meminfo_seq_ops = {
+    .start = single_start,
+    .next  = single_next,
+    .show  = meminfo_show,
+};
+
+/* Free pages, watermarks and NUMA counters summed over nodes, then one line per event counter */
+static int vmstat_show(seq_file_t *m, void *v) {
+    (void)v;
+    unsigned long wmark[NR_WMARK] = { 0 };
+    numa_stats_t sum = { 0 }, st;
+    for (int nid = 0; nid < nr_online_nodes(); nid++) {
+        for (int w = 0; w < NR_WMARK; w++)
+            wmark[w] += zone_watermark(nid, (enum zone_watermarks)w);
+        numa_get_stats(nid, &st);
+        sum.numa_hit += st.numa_hit;
+        sum.numa_miss += st.numa_miss;
+        sum.numa_foreign += st.numa_foreign;
+        sum.interleave_hit += st.interleave_hit;
+        sum.local_node += st.local_node;
+        sum.other_node += st.other_node;
+    }
+
+    seq_printf(m, "nr_free_pages %lu\n", nr_free_pages());
+    seq_printf(m, "nr_inactive_anon %lu\n", nr_lru_pages(LRU_INACTIVE_ANON));
+    seq_printf(m, "nr_active_anon %lu\n", nr_lru_pages(LRU_ACTIVE_ANON));
+    seq_printf(m, "nr_inactive_file %lu\n", nr_lru_pages(LRU_INACTIVE_FILE));
+    seq_printf(m, "nr_active_file %lu\n", nr_lru_pages(LRU_ACTIVE_FILE));
+    seq_printf(m, "nr_min_free %lu\n", wmark[WMARK_MIN]);
+    seq_printf(m, "nr_low_free %lu\n", wmark[WMARK_LOW]);
+    seq_printf(m, "nr_high_free %lu\n", wmark[WMARK_HIGH]);
+    seq_printf(m, "numa_hit %lu\n", (unsigned long)sum.numa_hit);
+    seq_printf(m, "numa_miss %lu\n", (unsigned long)sum.numa_miss);
+    seq_printf(m, "numa_foreign %lu\n", (unsigned long)sum.numa_foreign);
+    seq_printf(m, "numa_interleave %lu\n", (unsigned long)sum.interleave_hit);
+    seq_printf(m, "numa_local %lu\n", (unsigned long)sum.local_node);
+    seq_printf(m, "numa_other %lu\n", (unsigned long)sum.other_node);
+    for (unsigned int i = 0; i < NR_VM_EVENT_ITEMS; i++)
+        seq_printf(m, "%s %lu\n", vm_event_name(i), (unsigned long)vm_event_count(i));
+    return 0;
+}
+
+static const seq_operations_t vmstat_seq_ops = {
+    .start = single_start,
+    .next  = single_next,
+    .show  = vmstat_show,
+};
+
+static int buddyinfo_show(seq_file_t *m, void *v) {
+    (void)v;
+    for (int nid = 0; nid < nr_online_nodes(); nid++) {
+        seq_printf(m, "Node %d, zone   Normal ", nid);
+        for (unsigned int order = 0; order < MAX_ORDER; order++)
+            seq_printf(m, "%6lu ", node_free_blocks(nid, order));
+        seq_write(m, "\n", 1);
+    }
+    return 0;
+}
+
+static const seq_operations_t buddyinfo_seq_ops = {
+    .start = single_start,
+    .next  = single_next,
+    .show  = buddyinfo_show,
+};
+
+/* Record 0 is the header, record i + 1 is cache i */
+static void *slabinfo_start(seq_file_t *m, uint64_t *index) {
+    (void)m;
+    kmem_cache_info_t ci;
+    if (*index == 0 || kmem_cache_info((unsigned int)(*index - 1), &ci) == 0)
+        return rec_cookie(*index);
+    return NULL;
+}
+
+static int slabinfo_show(seq_file_t *m, void *v) {
+    uint64_t index = rec_index(v);
+    kmem_cache_info_t ci;
+
+    if (index == 0) {
+        seq_printf(m, "slabinfo - version: 2.1\n");
+        seq_printf(m, "# name            <active_objs> <num_objs> <objsize> <objperslab> "
+                      "<pagesperslab> : tunables <limit> <batchcount> <sharedfactor> : "
+                      "slabdata <active_slabs> <num_slabs> <sharedavail>\n");
+        return 0;
+    }
+    if (kmem_cache_info((unsigned int)(index - 1), &ci) < 0)
+        return 0;
+    seq_printf(m, "%-17s %6lu %6lu %6zu %4u %4zu : tunables %4u %4u %4u : slabdata %6lu %6lu %6u\n",
+               ci.name, ci.nr_active, ci.nr_slabs * ci.objs_per_slab, ci.object_size,
+               ci.objs_per_slab, ci.slab_size >> PAGE_SHIFT, 0, 0, 0,
+               ci.nr_slabs, ci.nr_slabs, 0);
+    return 0;
+}
+
+static const seq_operations_t slabinfo_seq_ops = {
+    .start = slabinfo_start,
+    .next  = table_next,
+    .show  = slabinfo_show,
+};
+
+#ifdef CONFIG_ALLOC_PROFILING
+/* Record 0 is the header; then the index is the call-site slot, skipping empty ones */
+static void *allocinfo_start(seq_file_t *m, uint64_t *index) {
+    (void)m;
+    alloc_site_info_t si;
+    if (*index == 0) return rec_cookie(0);
+
+    unsigned int pos = (unsigned int)(*index - 1);
+    if (kmalloc_site_info(&pos, &si) < 0) return NULL;
+    *index = pos + 1;
+    return rec_cookie(*index);
+}
+
+/* Like Linux's /proc/allocinfo, but bytes and calls are totals since boot */
+static int allocinfo_show(seq_file_t *m, void *v) {
+    uint64_t index = rec_index(v);
+    alloc_site_info_t si;
+
+    if (index == 0) {
+        seq_printf(m, "allocinfo - version: 1.0\n");
+        seq_printf(m, "#        <bytes>    <calls> <failures> <cache>         <caller>\n");
+        return 0;
+    }
+    unsigned int pos = (unsigned int)(index - 1);
+    if (kmalloc_site_info(&pos, &si) < 0)
+        return 0;
+    seq_printf(m, "%16llu %10llu %10llu %-15s %p\n", (unsigned long long)si.bytes,
+               (unsigned long long)si.calls, (unsigned long long)si.failures, si.cache, si.caller);
+    return 0;
+}
+
+static const seq_operations_t allocinfo_seq_ops = {
+    .start = allocinfo_start,
+    .next  = table_next,
+    .show  = allocinfo_show,
+};
+#endif
+
+static void *mounts_start(seq_file_t *m, uint64_t *index) {
+    (void)m;
+    mount_info_t mi;
+    return vfs_get_mount((int)*index, &mi) == 0 ? rec_cookie(*index) : NULL;
+}
+
+static int mounts_show(seq_file_t *m, void *v) {
+    mount_info_t mi;
+    if (vfs_get_mount((int)rec_index(v), &mi) < 0)
+        return 0;   /* Unmounted since start() */
+    seq_printf(m, "%s %s %s rw 0 0\n", mi.device[0] ? mi.device : "none", mi.path, mi.fs_type);
+    return 0;
+}
+
+static const seq_operations_t mounts_seq_ops = {
+    .start = mounts_start,
+    .next  = table_next,
+    .show  = mounts_show,
+};
+
+static void seq_cpu_header(seq_file_t *m, int indent) {
+    seq_printf(m, "%*s", indent, "");
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++)
+        seq_printf(m, "       CPU%u", cpu);
+    seq_write(m, "\n", 1);
+}
+
+/* Record 0 is the header, record i + 1 is vector i; vectors without a handler are skipped */
+static void *interrupts_start(seq_file_t *m, uint64_t *index) {
+    (void)m;
+    irq_info_t info;
+    if (*index == 0) return rec_cookie(0);
+    for (; *index <= NR_VECTORS; ++*index) {
+        if (irq_get_info((unsigned int)(*index - 1), &info) == 0)
+            return rec_cookie(*index);
+    }
+    return NULL;
+}
+
+static int interrupts_show(seq_file_t *m, void *v) {
+    uint64_t index = rec_index(v);
+    irq_info_t info;
+
+    if (index == 0) {
+        seq_cpu_header(m, 4);
+        return 0;
+    }
+    if (irq_get_info((unsigned int)(index - 1), &info) < 0)
+        return 0;   /* Freed since start() */
+    seq_printf(m, "%3u:", (unsigned int)(index - 1));
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++)
+        seq_printf(m, " %10llu", (unsigned long long)info.count[cpu]);
+    seq_printf(m, "  %s\n", info.name ? info.name : "");
+    return 0;
+}
+
+static const seq_operations_t interrupts_seq_ops = {
+    .start = interrupts_start,
+    .next  = table_next,
+    .show  = interrupts_show,
+};
+
+static int softirqs_show(seq_file_t *m, void *v) {
+    (void)v;
+    seq_cpu_header(m, 13);
+    for (unsigned int nr = 0; nr < NR_SOFTIRQS; nr++) {
+        seq_printf(m, "%12s:", softirq_name(nr));
+        for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++)
+            seq_printf(m, " %10llu", (unsigned long long)softirq_count(nr, cpu));
+        seq_write(m, "\n", 1);
+    }
+    return 0;
+}
+
+static const seq_operations_t softirqs_seq_ops = {
+    .start = single_start,
+    .next  = single_next,
+    .show  = softirqs_show,
+};
+
+/* Record 0 is the summary, record i + 1 is initcall i */
+static void *initcalls_start(seq_file_t *m, uint64_t *index) {
+    (void)m;
+    initcall_record_t rec;
+    if (*index == 0 || initcall_get_record((unsigned int)(*index - 1), &rec) == 0)
+        return rec_cookie(*index);
+    return NULL;
+}
+
+static int initcalls_show(seq_file_t *m, void *v) {
+    uint64_t index = rec_index(v);
+    initcall_record_t rec;
+
+    if (index == 0) {
+        initcall_summary_t sum;
+        initcall_get_summary(&sum);
+        seq_printf(m, "# %u initcalls, %s: %llu us, critical path %llu us, %llu us of work\n",
+                   sum.nr, sum.serial ? "serial" : "parallel",
+                   (unsigned long long)(sum.wall_ns / 1000),
+                   (unsigned long long)(sum.critical_ns / 1000),
+                   (unsigned long long)(sum.busy_ns / 1000));
+        seq_printf(m, "%-20s %4s %10s %10s %10s %6s\n", "# name", "cpu", "ready_us", "start_us",
+                   "run_us", "ret");
+        return 0;
+    }
+    if (initcall_get_record((unsigned int)(index - 1), &rec) < 0)
+        return 0;
+    if (!rec.done) {
+        seq_printf(m, "%-20s %4s %10llu %10s %10s %6s\n", rec.name, "-",
+                   (unsigned long long)(rec.ready_ns / 1000), "-", "-", "run");
+        return 0;
+    }
+    seq_printf(m, "%-20s %4u %10llu %10llu %10llu %6d\n", rec.name, rec.cpu,
+               (unsigned long long)(rec.ready_ns / 1000), (unsigned long long)(rec.start_ns / 1000),
+               (unsigned long long)((rec.end_ns - rec.start_ns) / 1000), rec.ret);
+    return 0;
+}
+
+static const seq_operations_t initcalls_seq_ops = {
+    .start = initcalls_start,
+    .next  = table_next,
+    .show  = initcalls_show,
+};
+
+static char task_state_char(task_state_t state) {
+    switch (state) {
+    case TASK_RUNNABLE:        return 'R';
+    case TASK_INTERRUPTIBLE:   return 'S';
+    case TASK_UNINTERRUPTIBLE: return 'D';
+    case TASK_STOPPED:         return 'T';
+    case TASK_TRACED:          return 't';
+    case TASK_DEAD:            return 'X';
+    }
+    return '?';
+}
+
+/* Fields 1-20 of Linux's /proc/<pid>/stat; utime is the vruntime */
+static int pid_stat_show(seq_file_t *m, void *v) {
+    (void)v;
+    process_info_t pi;
+    int ret = process_get_info((pid_t)(intptr_t)m->private, &pi);
+    if (ret < 0) return ret;
+
+    seq_printf(m, "%d (%s) %c %d %d %d 0 -1 0 0 0 0 0 %llu 0 0 0 %d %d 1\n",
+               pi.pid, pi.name, task_state_char(pi.state), pi.ppid, pi.pid, pi.pid,
+               (unsigned long long)pi.vruntime, pi.priority + 20, pi.priority);
+    return 0;
+}
+
+static const seq_operations_t pid_stat_seq_ops = {
+    .start = single_start,
+    .next  = single_next,
+    .show  = pid_stat_show,
+};
+
+static const proc_entry_t proc_root_entries[] = {
+    { "meminfo",   &meminfo_seq_ops },
+    { "vmstat",    &vmstat_seq_ops },
+    { "buddyinfo", &buddyinfo_seq_ops },
+    { "slabinfo",  &slabinfo_seq_ops },
+#ifdef CONFIG_ALLOC_PROFILING
+    { "allocinfo", &allocinfo_seq_ops },
+#endif
+    { "mounts",    &mounts_seq_ops },
+    { "interrupts", &interrupts_seq_ops },
+    { "softirqs",  &softirqs_seq_ops },
+    { "initcalls", &initcalls_seq_ops },
+};
+
+static const proc_entry_t proc_pid_entries[] = {
+    { "stat", &pid_stat_seq_ops },
+};
+
+#define NR_ROOT_ENTRIES (sizeof(proc_root_entries) / sizeof(proc_root_entries[0]))
+#define NR_PID_ENTRIES  (sizeof(proc_pid_entries) / sizeof(proc_pid_entries[0]))
+
+/* ============================================================================
+ * Inodes
+ * ============================================================================ */
+
+static inode_t *proc_get_inode(super_block_t *sb, uint32_t ino, uint16_t mode,
+                               const proc_entry_t *entry) {
+    inode_t *inode = new_inode(sb);
+    if (!inode) return NULL;
+
+    inode->ino = ino;
+    inode->mode = mode;
+    inode->atime = inode->mtime = inode->ctime = (uint32_t)time(NULL);
+    inode->fs_data = (void *)entry;
+    if (S_ISDIR(mode)) {
+        inode->nlink = 2;
+        inode->i_op = ino == PROC_ROOT_INO ? &proc_root_inode_ops : &proc_pid_inode_ops;
+        inode->i_fop = ino == PROC_ROOT_INO ? &proc_root_ops : &proc_pid_ops;
+    } else {
+        inode->i_fop = &proc_seq_ops;
+    }
+    return inode;
+}
+
+static bool parse_pid(const char *name, size_t len, pid_t *pid) {
+    if (len == 0 || len > 5 || name[0] == '0') return false;
+    long v = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] < '0' || name[i] > '9') return false;
+        v = v * 10 + (name[i] - '0');
+    }
+    if (v > PID_MAX) return false;
+    *pid = (pid_t)v;
+    return true;
+}
+
+static int proc_root_lookup(inode_t *dir, const char *name, size_t len, inode_t **res) {
+    for (size_t i = 0; i < NR_ROOT_ENTRIES; i++) {
+        const proc_entry_t *e = &proc_root_entries[i];
+        if (strlen(e->name) == len && memcmp(e->name, name, len) == 0) {
+            *res = proc_get_inode(dir->sb, (uint32_t)(2 + i), S_IFREG | 0444, e);
+            return *res ? 0 : -ENOMEM;
+        }
+    }
+
+    pid_t pid;
+    process_info_t pi;
+    if (!parse_pid(name, len, &pid) || process_get_info(pid, &pi) < 0)
+        return -ENOENT;
+    *res = proc_get_inode(dir->sb, PROC_PID_INO(pid, 0), S_IFDIR | 0555, NULL);
+    return *res ? 0 : -ENOMEM;
+}
+
+static int proc_pid_lookup(inode_t *dir, const char *name, size_t len, inode_t **res) {
+    pid_t pid = (pid_t)(dir->ino >> 8);
+    process_info_t pi;
+
+    if (process_get_info(pid, &pi) < 0) return -ENOENT;
+    for (size_t i = 0; i < NR_PID_ENTRIES; i++) {
+        const proc_entry_t *e = &proc_pid_entries[i];
+        if (strlen(e->name) == len && memcmp(e->name, name, len) == 0) {
+            *res = proc_get_inode(dir->sb, PROC_PID_INO(pid, 1 + i), S_IFREG | 0444, e);
+            return *res ? 0 : -ENOMEM;
+        }
+    }
+    return -ENOENT;
+}
+
+/* ".", "..", the fixed entries, then one directory per process */
+static int proc_root_readdir(file_t *file, filldir_t filldir, void *ctx) {
+    uint64_t fixed = 2 + NR_ROOT_ENTRIES;
+
+    while (file->f_pos < fixed) {
+        uint64_t i = file->f_pos;
+        int stop = i == 0 ? filldir(ctx, ".", 1, PROC_ROOT_INO, S_IFDIR) :
+                   i == 1 ? filldir(ctx, "..", 2, PROC_ROOT_INO, S_IFDIR) :
+                   filldir(ctx, proc_root_entries[i - 2].name,
+                           strlen(proc_root_entries[i - 2].name), (uint32_t)i, S_IFREG);
+        if (stop) return 0;
+        file->f_pos++;
+    }
+
+    int cursor = (int)(file->f_pos - fixed);
+    process_info_t pi;
+    char name[16];
+    while (process_iterate(&cursor, &pi)) {
+        if (pi.pid != pi.tgid) {            /* Threads are reachable by tid, not listed */
+            file->f_pos++;
+            continue;
+        }
+        int len = snprintf(name, sizeof(name), "%d", pi.pid);
+        if (filldir(ctx, name, (size_t)len, PROC_PID_INO(pi.pid, 0), S_IFDIR))
+            break;
+        file->f_pos++;
+    }
+    return 0;
+}
+
+static int proc_pid_readdir(file_t *file, filldir_t filldir, void *ctx) {
+    uint32_t ino = file->inode->ino;
+
+    while (file->f_pos < 2 + NR_PID_ENTRIES) {
+        uint64_t i = file->f_pos;
+        int stop = i == 0 ? filldir(ctx, ".", 1, ino, S_IFDIR) :
+                   i == 1 ? filldir(ctx, "..", 2, PROC_ROOT_INO, S_IFDIR) :
+                   filldir(ctx, proc_pid_entries[i - 2].name,
+                           strlen(proc_pid_entries[i - 2].name),
+                           ino | (uint32_t)(i - 1), S_IFREG);
+        if (stop) break;
+        file->f_pos++;
+    }
+    return 0;
+}
+
+static int proc_seq_open(inode_t *inode, file_t *file) {
+    const proc_entry_t *e = inode->fs_data;
+    return seq_open(file, e->seq_ops, (void *)(intptr_t)(inode->ino >> 8));
+}
+
+static const inode_operations_t proc_root_inode_ops = {
+    .lookup = proc_root_lookup,
+};
+
+static const inode_operations_t proc_pid_inode_ops = {
+    .lookup = proc_pid_lookup,
+};
+
+static const file_operations_t proc_root_ops = {
+    .readdir = proc_root_readdir,
+};
+
+static const file_operations_t proc_pid_ops = {
+    .readdir = proc_pid_readdir,
+};
+
+static const file_operations_t proc_seq_ops = {
+    .open    = proc_seq_open,
+    .release = seq_release,
+    .read    = seq_read,
+};
+
+/* ============================================================================
+ * Superblock
+ * ============================================================================ */
+
+static int proc_fill_super(super_block_t *sb, const char *device) {
+    (void)device;
+    sb->root = proc_get_inode(sb, PROC_ROOT_INO, S_IFDIR | 0555, NULL);
+    return sb->root ? 0 : -ENOMEM;
+}
+
+static file_system_type_t proc_fs_type = {
+    .name  = "procfs",
+    .mount = proc_fill_super,
+};
+
+int register_procfs_fs(void) {
+    return register_filesystem(&proc_fs_type);
+}
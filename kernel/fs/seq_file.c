@@ -0,0 +1,113 @@
+/**
+ * seq_file - generated files streamed into the reader's buffer
+ *
+ * A read restarts the record iterator at the record it stopped in last
+ * time and discards the part of that record already returned, so output
+ * is formatted straight into the caller's buffer and nothing is held
+ * between calls but a record index and a byte offset. Reads at any other
+ * position regenerate from the start and skip forward.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+/* Longest single seq_printf() result; longer output is truncated */
+#define SEQ_LINE_MAX 512
+
+int seq_open(file_t *file, const seq_operations_t *op, void *private) {
+    seq_file_t *m = kmalloc(sizeof(seq_file_t), GFP_KERNEL);
+    if (!m) return -ENOMEM;
+
+    memset(m, 0, sizeof(*m));
+    m->op = op;
+    m->private = private;
+    file->private_data = m;
+    return 0;
+}
+
+void seq_release(inode_t *inode, file_t *file) {
+    (void)inode;
+    kfree(file->private_data);
+    file->private_data = NULL;
+}
+
+int seq_write(seq_file_t *m, const void *data, size_t len) {
+    const char *p = data;
+
+    if (m->overflow) return -1;
+    if (m->skip) {
+        size_t n = len < m->skip ? len : m->skip;
+        m->skip -= n;
+        m->rec_bytes += n;
+        p += n;
+        len -= n;
+    }
+
+    size_t room = m->size - m->count;
+    size_t n = len < room ? len : room;
+    memcpy(m->buf + m->count, p, n);
+    m->count += n;
+    m->rec_bytes += n;
+    if (n < len) {
+        m->overflow = true;
+        return -1;
+    }
+    return 0;
+}
+
+int seq_printf(seq_file_t *m, const char *fmt, ...) {
+    char line[SEQ_LINE_MAX];
+    va_list args;
+
+    if (m->overflow) return -1;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (n < 0) return n;
+    if ((size_t)n >= sizeof(line)) n = sizeof(line) - 1;
+    return seq_write(m, line, (size_t)n);
+}
+
+int64_t seq_read(file_t *file, void *buf, size_t count, uint64_t *pos) {
+    seq_file_t *m = file->private_data;
+    int ret = 0;
+
+    if (count == 0) return 0;
+
+    /* Anything but a sequential read regenerates from the first record */
+    if (*pos == 0 || *pos < m->pos) {
+        m->index = 0;
+        m->rec_off = 0;
+        m->pos = 0;
+    }
+    m->buf = buf;
+    m->size = count;
+    m->count = 0;
+    m->overflow = false;
+    m->skip = m->rec_off + (size_t)(*pos - m->pos);
+
+    uint64_t index = m->index;
+    void *v = m->op->start(m, &index);
+    while (v) {
+        m->rec_bytes = 0;
+        ret = m->op->show(m, v);
+        if (ret < 0 || m->overflow) break;
+        v = m->op->next(m, v, &index);
+    }
+    if (m->op->stop) m->op->stop(m, v);
+
+    if (ret < 0 && m->count == 0) {
+        m->buf = NULL;
+        return ret;
+    }
+
+    /* Resume inside the record that did not fit, or after the last one */
+    m->index = index;
+    m->rec_off = m->overflow ? m->rec_bytes : 0;
+    m->pos = *pos + m->count;
+    *pos = m->pos;
+    m->buf = NULL;
+    return (int64_t)m->count;
+}
@@ -0,0 +1,514 @@
+/**
+ * tmpfs
+ *
+ * Memory-only filesystem. File data lives in the shared page cache
+ * (AS_SHMEM mappings) and is charged against the mount's size limit
+ * through address_space_operations.reserve, so page-cache accounting
+ * and vos_sysinfo see tmpfs usage as shared memory.
+ *
+ * Directories keep a hash of name -> entry for lookups and a list in
+ * creation order for readdir. Each entry holds a reference to its
+ * inode; unlink drops it, and the inode is freed with its pages once
+ * the last open file goes away.
+ *
+ * Mount options come in the device string: "size=64M,nr_inodes=4096".
+ * size also accepts k/m/g suffixes or a percentage of RAM; the default
+ * is half of RAM, with one inode allowed per page.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TMPFS_DIR_MIN_BUCKETS 8
+
+typedef struct tmpfs_dirent {
+    struct tmpfs_dirent *hash_next;
+    struct tmpfs_dirent *next, *prev;   /* Creation order */
+    inode_t *inode;
+    uint32_t hash;
+    uint16_t len;
+    char name[];
+} tmpfs_dirent_t;
+
+typedef struct {
+    tmpfs_dirent_t **buckets;
+    uint32_t mask;                      /* Bucket count - 1 */
+    uint32_t count;
+    tmpfs_dirent_t *head, *tail;
+    uint32_t parent_ino;
+} tmpfs_dir_t;
+
+typedef struct {
+    spinlock_t lock;                    /* Serialises namespace changes */
+    unsigned long max_pages;
+    unsigned long used_pages;
+    unsigned long max_inodes;
+    unsigned long used_inodes;
+    uint32_t next_ino;
+} tmpfs_sb_info_t;
+
+static const inode_operations_t tmpfs_dir_inode_ops;
+static const inode_operations_t tmpfs_file_inode_ops;
+static const file_operations_t tmpfs_file_ops;
+static const file_operations_t tmpfs_dir_ops;
+static const address_space_operations_t tmpfs_aops;
+
+static inline tmpfs_sb_info_t *TMPFS_SB(super_block_t *sb) {
+    return (tmpfs_sb_info_t *)sb->fs_info;
+}
+
+static inline uint32_t tmpfs_now(void) {
+    return (uint32_t)time(NULL);
+}
+
+static inline uint32_t name_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    return h;
+}
+
+/* ============================================================================
+ * Accounting
+ * ============================================================================ */
+
+static int tmpfs_reserve(address_space_t *mapping, long nr) {
+    tmpfs_sb_info_t *sbi = TMPFS_SB(mapping->host->sb);
+
+    if (nr <= 0) {
+        __atomic_sub_fetch(&sbi->used_pages, (unsigned long)-nr, __ATOMIC_RELAXED);
+        return 0;
+    }
+    unsigned long used = __atomic_add_fetch(&sbi->used_pages, (unsigned long)nr,
+                                            __ATOMIC_RELAXED);
+    if (used > sbi->max_pages) {
+        __atomic_sub_fetch(&sbi->used_pages, (unsigned long)nr, __ATOMIC_RELAXED);
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+static const address_space_operations_t tmpfs_aops = {
+    .reserve = tmpfs_reserve,
+};
+
+/* ============================================================================
+ * Directories
+ * ============================================================================ */
+
+static tmpfs_dir_t *tmpfs_dir_alloc(uint32_t parent_ino) {
+    tmpfs_dir_t *d = kmalloc(sizeof(tmpfs_dir_t), GFP_KERNEL);
+    if (!d) return NULL;
+    memset(d, 0, sizeof(*d));
+    d->buckets = kmalloc(TMPFS_DIR_MIN_BUCKETS * sizeof(tmpfs_dirent_t *), GFP_KERNEL);
+    if (!d->buckets) {
+        kfree(d);
+        return NULL;
+    }
+    memset(d->buckets, 0, TMPFS_DIR_MIN_BUCKETS * sizeof(tmpfs_dirent_t *));
+    d->mask = TMPFS_DIR_MIN_BUCKETS - 1;
+    d->parent_ino = parent_ino;
+    return d;
+}
+
+static tmpfs_dirent_t *tmpfs_dir_find(tmpfs_dir_t *d, const char *name, size_t len,
+                                      uint32_t hash) {
+    tmpfs_dirent_t *de = d->buckets[hash & d->mask];
+    while (de && !(de->hash == hash && de->len == len && memcmp(de->name, name, len) == 0))
+        de = de->hash_next;
+    return de;
+}
+
+/* Double the bucket array once the load factor passes 1; failure is harmless */
+static void tmpfs_dir_grow(tmpfs_dir_t *d) {
+    uint32_t nb = (d->mask + 1) * 2;
+    tmpfs_dirent_t **buckets = kmalloc(nb * sizeof(tmpfs_dirent_t *), GFP_KERNEL);
+    if (!buckets) return;
+    memset(buckets, 0, nb * sizeof(tmpfs_dirent_t *));
+
+    for (tmpfs_dirent_t *de = d->head; de; de = de->next) {
+        de->hash_next = buckets[de->hash & (nb - 1)];
+        buckets[de->hash & (nb - 1)] = de;
+    }
+    kfree(d->buckets);
+    d->buckets = buckets;
+    d->mask = nb - 1;
+}
+
+static int tmpfs_dir_add(tmpfs_dir_t *d, const char *name, size_t len, uint32_t hash,
+                         inode_t *inode) {
+    tmpfs_dirent_t *de = kmalloc(sizeof(tmpfs_dirent_t) + len, GFP_KERNEL);
+    if (!de) return -ENOMEM;
+
+    de->inode = inode;
+    de->hash = hash;
+    de->len = (uint16_t)len;
+    memcpy(de->name, name, len);
+
+    if (d->count >= d->mask + 1) tmpfs_dir_grow(d);
+    de->hash_next = d->buckets[hash & d->mask];
+    d->buckets[hash & d->mask] = de;
+
+    de->next = NULL;
+    de->prev = d->tail;
+    if (d->tail) d->tail->next = de;
+    else d->head = de;
+    d->tail = de;
+    d->count++;
+    return 0;
+}
+
+static void tmpfs_dir_del(tmpfs_dir_t *d, tmpfs_dirent_t *de) {
+    tmpfs_dirent_t **link = &d->buckets[de->hash & d->mask];
+    while (*link != de) link = &(*link)->hash_next;
+    *link = de->hash_next;
+
+    if (de->prev) de->prev->next = de->next;
+    else d->head = de->next;
+    if (de->next) de->next->prev = de->prev;
+    else d->tail = de->prev;
+    d->count--;
+    kfree(de);
+}
+
+/* ============================================================================
+ * Inodes
+ * ============================================================================ */
+
+static inode_t *tmpfs_get_inode(super_block_t *sb, uint16_t mode, uint32_t parent_ino,
+                                int *err) {
+    tmpfs_sb_info_t *sbi = TMPFS_SB(sb);
+
+    if (__atomic_add_fetch(&sbi->used_inodes, 1, __ATOMIC_RELAXED) > sbi->max_inodes) {
+        __atomic_sub_fetch(&sbi->used_inodes, 1, __ATOMIC_RELAXED);
+        *err = -ENOSPC;
+        return NULL;
+    }
+
+    inode_t *inode = new_inode(sb);
+    if (!inode) {
+        __atomic_sub_fetch(&sbi->used_inodes, 1, __ATOMIC_RELAXED);
+        *err = -ENOMEM;
+        return NULL;
+    }
+    inode->ino = __atomic_fetch_add(&sbi->next_ino, 1, __ATOMIC_RELAXED);
+    inode->mode = mode;
+    inode->atime = inode->mtime = inode->ctime = tmpfs_now();
+    inode->i_data.a_ops = &tmpfs_aops;
+    inode->i_data.flags = AS_SHMEM;
+
+    if (S_ISDIR(mode)) {
+        inode->fs_data = tmpfs_dir_alloc(parent_ino ? parent_ino : inode->ino);
+        if (!inode->fs_data) {
+            iput(inode);
+            *err = -ENOMEM;
+            return NULL;
+        }
+        inode->nlink = 2;
+        inode->i_op = &tmpfs_dir_inode_ops;
+        inode->i_fop = &tmpfs_dir_ops;
+    } else {
+        inode->i_op = &tmpfs_file_inode_ops;
+        inode->i_fop = &tmpfs_file_ops;
+    }
+    return inode;
+}
+
+static void tmpfs_evict_inode(inode_t *inode) {
+    tmpfs_sb_info_t *sbi = TMPFS_SB(inode->sb);
+    tmpfs_dir_t *d = inode->fs_data;
+
+    if (d) {
+        /* Only an unmount evicts a non-empty directory */
+        while (d->head) {
+            inode_t *child = d->head->inode;
+            tmpfs_dir_del(d, d->head);
+            iput(child);
+        }
+        kfree(d->buckets);
+        kfree(d);
+        inode->fs_data = NULL;
+    }
+    __atomic_sub_fetch(&sbi->used_inodes, 1, __ATOMIC_RELAXED);
+}
+
+static int tmpfs_lookup(inode_t *dir, const char *name, size_t len, inode_t **res) {
+    tmpfs_sb_info_t *sbi = TMPFS_SB(dir->sb);
+    tmpfs_dir_t *d = dir->fs_data;
+
+    spin_lock(&sbi->lock);
+    tmpfs_dirent_t *de = tmpfs_dir_find(d, name, len, name_hash(name, len));
+    if (de) {
+        iget(de->inode);
+        *res = de->inode;
+    }
+    spin_unlock(&sbi->lock);
+    return de ? 0 : -ENOENT;
+}
+
+/* Link a new inode into dir; the entry keeps the inode's initial reference */
+static int tmpfs_mknod(inode_t *dir, const char *name, size_t len, uint16_t mode,
+                       inode_t **res) {
+    tmpfs_sb_info_t *sbi = TMPFS_SB(dir->sb);
+    tmpfs_dir_t *d = dir->fs_data;
+    uint32_t hash = name_hash(name, len);
+    int ret = 0;
+
+    inode_t *inode = tmpfs_get_inode(dir->sb, mode, dir->ino, &ret);
+    if (!inode) return ret;
+
+    spin_lock(&sbi->lock);
+    if (tmpfs_dir_find(d, name, len, hash))
+        ret = -EEXIST;
+    else
+        ret = tmpfs_dir_add(d, name, len, hash, inode);
+    if (ret == 0) {
+        if (S_ISDIR(mode)) dir->nlink++;
+        dir->mtime = dir->ctime = inode->ctime;
+        if (res) {
+            iget(inode);
+            *res = inode;
+        }
+    }
+    spin_unlock(&sbi->lock);
+
+    if (ret < 0) iput(inode);
+    return ret;
+}
+
+static int tmpfs_create(inode_t *dir, const char *name, size_t len, uint16_t mode,
+                        inode_t **res) {
+    return tmpfs_mknod(dir, name, len, S_IFREG | (mode & 07777), res);
+}
+
+static int tmpfs_mkdir(inode_t *dir, const char *name, size_t len, uint16_t mode) {
+    return tmpfs_mknod(dir, name, len, S_IFDIR | (mode & 07777), NULL);
+}
+
+static int tmpfs_remove(inode_t *dir, const char *name, size_t len, bool want_dir) {
+    tmpfs_sb_info_t *sbi = TMPFS_SB(dir->sb);
+    tmpfs_dir_t *d = dir->fs_data;
+    inode_t *inode = NULL;
+    int ret = 0;
+
+    spin_lock(&sbi->lock);
+    tmpfs_dirent_t *de = tmpfs_dir_find(d, name, len, name_hash(name, len));
+    if (!de) {
+        ret = -ENOENT;
+    } else if (S_ISDIR(de->inode->mode) != want_dir) {
+        ret = want_dir ? -ENOTDIR : -EISDIR;
+    } else if (want_dir && ((tmpfs_dir_t *)de->inode->fs_data)->count) {
+        ret = -ENOTEMPTY;
+    } else {
+        inode = de->inode;
+        tmpfs_dir_del(d, de);
+        if (want_dir) {
+            dir->nlink--;
+            inode->nlink = 0;
+        } else {
+            inode->nlink--;
+        }
+        dir->mtime = dir->ctime = inode->ctime = tmpfs_now();
+    }
+    spin_unlock(&sbi->lock);
+
+    /* Open files keep the inode (and its pages) alive until closed */
+    if (inode) iput(inode);
+    return ret;
+}
+
+static int tmpfs_unlink(inode_t *dir, const char *name, size_t len) {
+    return tmpfs_remove(dir, name, len, false);
+}
+
+static int tmpfs_rmdir(inode_t *dir, const char *name, size_t len) {
+    return tmpfs_remove(dir, name, len, true);
+}
+
+static int tmpfs_truncate(inode_t *inode, uint64_t size) {
+    uint64_t tail = size & (PAGE_SIZE - 1);
+
+    truncate_inode_pages(&inode->i_data, (size + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    if (tail && size < inode->size) {
+        /* Zero the rest of the last page so a later extension reads zeroes */
+        page_t *page = find_get_page(&inode->i_data, size >> PAGE_SHIFT);
+        if (page) {
+            memset((char *)page_to_virt(page) + tail, 0, PAGE_SIZE - tail);
+            put_page(page);
+        }
+    }
+    inode->size = size;
+    inode->mtime = inode->ctime = tmpfs_now();
+    inode_inc_iversion(inode);
+    return 0;
+}
+
+/* ============================================================================
+ * Files
+ * ============================================================================ */
+
+static int64_t tmpfs_file_write(file_t *file, const void *buf, size_t count, uint64_t *pos) {
+    int64_t ret = generic_file_write(file, buf, count, pos);
+    if (ret > 0) file->inode->mtime = file->inode->ctime = tmpfs_now();
+    return ret;
+}
+
+static int64_t tmpfs_file_write_iter(kiocb_t *iocb, iov_iter_t *iter) {
+    int64_t ret = generic_file_write_iter(iocb, iter);
+    if (ret > 0) iocb->ki_filp->inode->mtime = iocb->ki_filp->inode->ctime = tmpfs_now();
+    return ret;
+}
+
+/* Emit ".", ".." and then entries in creation order, from file->f_pos */
+static int tmpfs_readdir(file_t *file, filldir_t filldir, void *ctx) {
+    inode_t *dir = file->inode;
+    tmpfs_sb_info_t *sbi = TMPFS_SB(dir->sb);
+    tmpfs_dir_t *d = dir->fs_data;
+
+    spin_lock(&sbi->lock);
+    if (file->f_pos == 0) {
+        if (filldir(ctx, ".", 1, dir->ino, S_IFDIR)) goto out;
+        file->f_pos++;
+    }
+    if (file->f_pos == 1) {
+        if (filldir(ctx, "..", 2, d->parent_ino, S_IFDIR)) goto out;
+        file->f_pos++;
+    }
+
+    uint64_t index = 2;
+    for (tmpfs_dirent_t *de = d->head; de; de = de->next, index++) {
+        if (index < file->f_pos) continue;
+        if (filldir(ctx, de->name, de->len, de->inode->ino, de->inode->mode & S_IFMT))
+            break;
+        file->f_pos++;
+    }
+out:
+    spin_unlock(&sbi->lock);
+    return 0;
+}
+
+static const inode_operations_t tmpfs_dir_inode_ops = {
+    .lookup = tmpfs_lookup,
+    .create = tmpfs_create,
+    .mkdir  = tmpfs_mkdir,
+    .unlink = tmpfs_unlink,
+    .rmdir  = tmpfs_rmdir,
+};
+
+static const inode_operations_t tmpfs_file_inode_ops = {
+    .truncate = tmpfs_truncate,
+};
+
+static const file_operations_t tmpfs_file_ops = {
+    .read       = generic_file_read,
+    .write      = tmpfs_file_write,
+    .read_iter  = generic_file_read_iter,
+    .write_iter = tmpfs_file_write_iter,
+};
+
+static const file_operations_t tmpfs_dir_ops = {
+    .readdir = tmpfs_readdir,
+};
+
+/* ============================================================================
+ * Superblock
+ * ============================================================================ */
+
+static void tmpfs_put_super(super_block_t *sb) {
+    kfree(sb->fs_info);
+    sb->fs_info = NULL;
+}
+
+static const super_operations_t tmpfs_super_ops = {
+    .evict_inode = tmpfs_evict_inode,
+    .put_super   = tmpfs_put_super,
+};
+
+/* Parse a size with an optional k/m/g suffix or a % of RAM, in pages */
+static int parse_size(const char *s, size_t len, unsigned long *pages) {
+    char *end;
+    char buf[32];
+
+    if (len == 0 || len >= sizeof(buf)) return -EINVAL;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    unsigned long long v = strtoull(buf, &end, 10);
+    if (*end == '%') {
+        v = v * nr_total_pages() / 100;
+        end++;
+    } else {
+        switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        }
+        v = (v + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    }
+    if (*end != '\0') return -EINVAL;
+    *pages = (unsigned long)v;
+    return 0;
+}
+
+static int tmpfs_parse_options(tmpfs_sb_info_t *sbi, const char *opts) {
+    const char *p = opts;
+
+    while (p && *p) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        if (len > 5 && memcmp(p, "size=", 5) == 0) {
+            if (parse_size(p + 5, len - 5, &sbi->max_pages) < 0)
+                return -EINVAL;
+        } else if (len > 10 && memcmp(p, "nr_inodes=", 10) == 0) {
+            char *e;
+            sbi->max_inodes = strtoul(p + 10, &e, 10);
+            if (e != p + len) return -EINVAL;
+        } else if (len && !(len == 5 && memcmp(p, "tmpfs", 5) == 0) &&
+                   !(len == 4 && memcmp(p, "none", 4) == 0)) {
+            /* A bare "tmpfs"/"none" is the conventional device name */
+            return -EINVAL;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+static int tmpfs_fill_super(super_block_t *sb, const char *device) {
+    tmpfs_sb_info_t *sbi = kmalloc(sizeof(tmpfs_sb_info_t), GFP_KERNEL);
+    if (!sbi) return -ENOMEM;
+
+    memset(sbi, 0, sizeof(*sbi));
+    sbi->max_pages = nr_total_pages() / 2;
+    sbi->max_inodes = 0;
+    sbi->next_ino = 1;
+
+    int ret = tmpfs_parse_options(sbi, device);
+    if (ret < 0) {
+        kfree(sbi);
+        return ret;
+    }
+    if (!sbi->max_inodes)
+        sbi->max_inodes = sbi->max_pages ? sbi->max_pages : 1;
+
+    sb->fs_info = sbi;
+    sb->s_op = &tmpfs_super_ops;
+    sb->root = tmpfs_get_inode(sb, S_IFDIR | 01777, 0, &ret);
+    if (!sb->root) {
+        kfree(sbi);
+        sb->fs_info = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+static file_system_type_t tmpfs_fs_type = {
+    .name  = "tmpfs",
+    .mount = tmpfs_fill_super,
+};
+
+int register_tmpfs_fs(void) {
+    return register_filesystem(&tmpfs_fs_type);
+}
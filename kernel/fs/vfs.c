@@ -1,155 +1,617 @@
 /**
- * Virtual File System - Production Grade
- * 
- * Simple in-memory filesystem
+ * Virtual File System
+ *
+ * Filesystems register a file_system_type; mount_fs() asks it to fill in
+ * a super_block whose root inode anchors the mount. Paths resolve from
+ * the longest mounted prefix, one component at a time, through each
+ * directory's inode_operations. Open files dispatch through the inode's
+ * file_operations.
+ *
+ * Inodes are reference counted. Lookups and creates return a reference
+ * the caller drops with iput(); the last iput() evicts the inode and its
+ * cached pages.
  */
 
 #include <kernel.h>
 #include <string.h>
 #include <stdlib.h>
 
-#define MAX_FILES 1024
-#define MAX_MOUNTS 10
-
-typedef struct inode_impl {
-    uint32_t ino;
-    uint32_t size;
-    uint16_t mode;
-    uint32_t uid, gid;
-    uint32_t atime, mtime, ctime;
-    void *fs_data;
-} inode_impl_t;
+#define MAX_MOUNTS 16
+#define NAME_MAX   255
 
 typedef struct mount_point {
     char path[256];
-    char fs_type[32];
-    inode_impl_t *root;
+    size_t len;
+    super_block_t *sb;
 } mount_point_t;
 
 typedef struct {
-    inode_impl_t *inodes[MAX_FILES];
-    int count;
+    file_system_type_t *fs_types;
     mount_point_t mounts[MAX_MOUNTS];
     int mount_count;
+    spinlock_t lock;
 } vfs_t;
 
 static vfs_t g_vfs;
 
 int vfs_init(void) {
     memset(&g_vfs, 0, sizeof(g_vfs));
-    
-    /* Create root inode */
-    inode_impl_t *root = (inode_impl_t *)kmalloc(sizeof(inode_impl_t), GFP_KERNEL);
-    if (!root) return -ENOMEM;
-    
-    root->ino = 0;
-    root->mode = 0755;
-    root->size = 0;
-    root->fs_data = NULL;
-    
-    g_vfs.inodes[0] = root;
-    g_vfs.count = 1;
-    
     return 0;
 }
 
-int register_ext4_fs(void) {
-    pr_debug("ext4 filesystem registered\n");
+int register_filesystem(file_system_type_t *fs) {
+    spin_lock(&g_vfs.lock);
+    for (file_system_type_t *t = g_vfs.fs_types; t; t = t->next) {
+        if (strcmp(t->name, fs->name) == 0) {
+            spin_unlock(&g_vfs.lock);
+            return -EBUSY;
+        }
+    }
+    fs->next = g_vfs.fs_types;
+    g_vfs.fs_types = fs;
+    spin_unlock(&g_vfs.lock);
+
+    pr_debug("%s filesystem registered\n", fs->name);
     return 0;
 }
 
-int register_tmpfs_fs(void) {
-    pr_debug("tmpfs filesystem registered\n");
+static file_system_type_t *find_filesystem(const char *name) {
+    file_system_type_t *t;
+    spin_lock(&g_vfs.lock);
+    for (t = g_vfs.fs_types; t; t = t->next)
+        if (strcmp(t->name, name) == 0) break;
+    spin_unlock(&g_vfs.lock);
+    return t;
+}
+
+/* ============================================================================
+ * Inodes
+ * ============================================================================ */
+
+inode_t *new_inode(super_block_t *sb) {
+    inode_t *inode = kmalloc(sizeof(inode_t), GFP_KERNEL);
+    if (!inode) return NULL;
+
+    memset(inode, 0, sizeof(*inode));
+    inode->count = 1;
+    inode->nlink = 1;
+    inode->sb = sb;
+    inode->i_data.host = inode;
+    return inode;
+}
+
+void iget(inode_t *inode) {
+    __atomic_add_fetch(&inode->count, 1, __ATOMIC_RELAXED);
+}
+
+void iput(inode_t *inode) {
+    if (!inode || __atomic_sub_fetch(&inode->count, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    truncate_inode_pages(&inode->i_data, 0);
+    exec_cache_drop(inode);
+    if (inode->sb && inode->sb->s_op && inode->sb->s_op->evict_inode)
+        inode->sb->s_op->evict_inode(inode);
+    kfree(inode);
+}
+
+/* Kernel-internal file I/O at an explicit offset */
+int inode_read(inode_t *ino, void *buf, size_t count, uint64_t offset) {
+    if (!ino || !ino->i_fop || !ino->i_fop->read) return -EINVAL;
+    file_t file = { .inode = ino, .f_op = ino->i_fop, .f_flags = O_RDONLY };
+    uint64_t pos = offset, start = trace_span_start(inode_read);
+    int ret = (int)ino->i_fop->read(&file, buf, count, &pos);
+    trace_inode_read(ino->ino, offset, count, ret, start);
+    return ret;
+}
+
+int inode_write(inode_t *ino, const void *buf, size_t count, uint64_t offset) {
+    if (!ino || !ino->i_fop || !ino->i_fop->write) return -EINVAL;
+    file_t file = { .inode = ino, .f_op = ino->i_fop, .f_flags = O_WRONLY };
+    uint64_t pos = offset, start = trace_span_start(inode_write);
+    int ret = (int)ino->i_fop->write(&file, buf, count, &pos);
+    trace_inode_write(ino->ino, offset, count, ret, start);
+    return ret;
+}
+
+/* ============================================================================
+ * Mounts and path resolution
+ * ============================================================================ */
+
+/* Mount whose path is the longest component-aligned prefix of path */
+static mount_point_t *find_mount(const char *path, size_t len) {
+    mount_point_t *best = NULL;
+    for (int i = 0; i < g_vfs.mount_count; i++) {
+        mount_point_t *mp = &g_vfs.mounts[i];
+        size_t ml = mp->len;
+        if (ml > len || memcmp(mp->path, path, ml) != 0) continue;
+        if (ml > 1 && ml < len && path[ml] != '/') continue;
+        if (!best || ml > best->len) best = mp;
+    }
+    return best;
+}
+
+/* Resolve the first len bytes of an absolute path to a referenced inode */
+static int path_walk(const char *path, size_t len, inode_t **res) {
+    if (len == 0 || path[0] != '/') return -EINVAL;
+
+    /* Ignore trailing slashes so "/mnt/" matches the mount at "/mnt" */
+    while (len > 1 && path[len - 1] == '/') len--;
+
+    spin_lock(&g_vfs.lock);
+    mount_point_t *mp = find_mount(path, len);
+    if (!mp) {
+        spin_unlock(&g_vfs.lock);
+        return -ENOENT;
+    }
+    inode_t *inode = mp->sb->root;
+    iget(inode);
+    const char *p = path + mp->len;
+    spin_unlock(&g_vfs.lock);
+
+    const char *end = path + len;
+    while (p < end) {
+        while (p < end && *p == '/') p++;
+        const char *c = p;
+        while (p < end && *p != '/') p++;
+        size_t clen = (size_t)(p - c);
+
+        if (clen == 0 || (clen == 1 && c[0] == '.')) continue;
+        if (clen > NAME_MAX) {
+            iput(inode);
+            return -ENAMETOOLONG;
+        }
+        if (!S_ISDIR(inode->mode)) {
+            iput(inode);
+            return -ENOTDIR;
+        }
+        if (!inode->i_op || !inode->i_op->lookup) {
+            iput(inode);
+            return -ENOENT;
+        }
+
+        inode_t *child;
+        int ret = inode->i_op->lookup(inode, c, clen, &child);
+        iput(inode);
+        if (ret < 0) return ret;
+        inode = child;
+    }
+
+    *res = inode;
     return 0;
 }
 
-int register_procfs_fs(void) {
-    pr_debug("procfs filesystem registered\n");
+/* Resolve the parent directory of path; name/len point at the last component */
+static int path_parent(const char *path, inode_t **dir, const char **name, size_t *len) {
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/') n--;
+
+    size_t slash = n;
+    while (slash > 0 && path[slash - 1] != '/') slash--;
+    if (slash == 0) return -EINVAL;     /* Relative path */
+    if (slash == n) return -EEXIST;     /* "/" itself */
+
+    *name = path + slash;
+    *len = n - slash;
+    if (*len > NAME_MAX) return -ENAMETOOLONG;
+    if (**name == '.' && (*len == 1 || (*len == 2 && (*name)[1] == '.')))
+        return -EINVAL;
+
+    int ret = path_walk(path, slash, dir);
+    if (ret < 0) return ret;
+    if (!S_ISDIR((*dir)->mode)) {
+        iput(*dir);
+        return -ENOTDIR;
+    }
     return 0;
 }
 
+int vfs_lookup(const char *path, inode_t **res) {
+    if (!path || !res) return -EINVAL;
+    return path_walk(path, strlen(path), res);
+}
+
 int mount_fs(const char *device, const char *mount_point, const char *fs_type) {
-    if (g_vfs.mount_count >= MAX_MOUNTS) return -ENOMEM;
-    
-    mount_point_t *mp = &g_vfs.mounts[g_vfs.mount_count];
-    strncpy(mp->path, mount_point, sizeof(mp->path) - 1);
-    strncpy(mp->fs_type, fs_type, sizeof(mp->fs_type) - 1);
-    
-    /* Use root inode as mount root */
-    mp->root = g_vfs.inodes[0];
-    
-    g_vfs.mount_count++;
-    pr_debug("Mounted %s at %s (type: %s)\n", device, mount_point, fs_type);
-    
+    if (!mount_point || !fs_type) return -EINVAL;
+
+    size_t len = strlen(mount_point);
+    while (len > 1 && mount_point[len - 1] == '/') len--;
+    if (len == 0 || mount_point[0] != '/' || len >= sizeof(g_vfs.mounts[0].path))
+        return -EINVAL;
+
+    file_system_type_t *type = find_filesystem(fs_type);
+    if (!type) return -ENODEV;
+
+    /* Anything but the first root mount needs an existing directory */
+    if (g_vfs.mount_count > 0) {
+        inode_t *dir;
+        int ret = path_walk(mount_point, len, &dir);
+        if (ret < 0) return ret;
+        bool is_dir = S_ISDIR(dir->mode);
+        iput(dir);
+        if (!is_dir) return -ENOTDIR;
+    }
+
+    super_block_t *sb = kmalloc(sizeof(super_block_t), GFP_KERNEL);
+    if (!sb) return -ENOMEM;
+    memset(sb, 0, sizeof(*sb));
+    sb->type = type;
+    if (device) strncpy(sb->device, device, sizeof(sb->device) - 1);
+
+    int ret = type->mount(sb, device);
+    if (ret < 0) {
+        kfree(sb);
+        return ret;
+    }
+
+    spin_lock(&g_vfs.lock);
+    for (int i = 0; i < g_vfs.mount_count; i++) {
+        if (g_vfs.mounts[i].len == len && memcmp(g_vfs.mounts[i].path, mount_point, len) == 0)
+            ret = -EBUSY;
+    }
+    if (ret == 0 && g_vfs.mount_count >= MAX_MOUNTS)
+        ret = -ENOMEM;
+    if (ret == 0) {
+        mount_point_t *mp = &g_vfs.mounts[g_vfs.mount_count++];
+        memcpy(mp->path, mount_point, len);
+        mp->path[len] = '\0';
+        mp->len = len;
+        mp->sb = sb;
+    }
+    spin_unlock(&g_vfs.lock);
+
+    if (ret < 0) {
+        iput(sb->root);
+        if (sb->s_op && sb->s_op->put_super) sb->s_op->put_super(sb);
+        kfree(sb);
+        return ret;
+    }
+
+    pr_debug("Mounted %s at %s (type: %s)\n", device ? device : "none", mount_point, fs_type);
     return 0;
 }
 
-int unmount_fs(const char *mount_point) {
+int umount_fs(const char *mount_point) {
+    if (!mount_point) return -EINVAL;
+
+    size_t len = strlen(mount_point);
+    while (len > 1 && mount_point[len - 1] == '/') len--;
+
+    spin_lock(&g_vfs.lock);
+    int idx = -1;
     for (int i = 0; i < g_vfs.mount_count; i++) {
-        if (strcmp(g_vfs.mounts[i].path, mount_point) == 0) {
-            for (int j = i; j < g_vfs.mount_count - 1; j++) {
-                g_vfs.mounts[j] = g_vfs.mounts[j + 1];
-            }
-            g_vfs.mount_count--;
-            return 0;
-        }
+        mount_point_t *mp = &g_vfs.mounts[i];
+        if (mp->len == len && memcmp(mp->path, mount_point, len) == 0)
+            idx = i;
     }
-    return -ENOENT;
-}
-
-inode_t *inode_alloc(void) {
-    if (g_vfs.count >= MAX_FILES) return NULL;
-    
-    inode_impl_t *ino = (inode_impl_t *)kmalloc(sizeof(inode_impl_t), GFP_KERNEL);
-    if (!ino) return NULL;
-    
-    ino->ino = g_vfs.count;
-    ino->size = 0;
-    ino->mode = 0644;
-    ino->fs_data = NULL;
-    
-    g_vfs.inodes[g_vfs.count++] = ino;
-    
-    return (inode_t *)ino;
-}
-
-void inode_free(inode_t *ino) {
-    if (ino && ino != (inode_t *)g_vfs.inodes[0]) {
-        kfree(ino);
-    }
-}
-
-int inode_read(inode_t *ino, void *buf, size_t count, uint32_t offset) {
-    if (!ino || !ino->fs_data) return 0;
-    
-    inode_impl_t *impl = (inode_impl_t *)ino;
-    if (offset >= impl->size) return 0;
-    
-    size_t readable = (offset + count > impl->size) ? (impl->size - offset) : count;
-    memcpy(buf, (char *)impl->fs_data + offset, readable);
-    
-    return readable;
-}
-
-int inode_write(inode_t *ino, const void *buf, size_t count, uint32_t offset) {
-    if (!ino) return -EINVAL;
-    
-    inode_impl_t *impl = (inode_impl_t *)ino;
-    
-    /* Allocate/reallocate if needed */
-    if (!impl->fs_data || offset + count > impl->size) {
-        void *new_data = kmalloc(offset + count + 1024, GFP_KERNEL);
-        if (!new_data) return -ENOMEM;
-        
-        if (impl->fs_data && impl->size > 0) {
-            memcpy(new_data, impl->fs_data, impl->size);
-            kfree(impl->fs_data);
+    if (idx < 0) {
+        spin_unlock(&g_vfs.lock);
+        return -ENOENT;
+    }
+
+    /* Refuse while something is mounted beneath, or the root is in use */
+    super_block_t *sb = g_vfs.mounts[idx].sb;
+    for (int i = 0; i < g_vfs.mount_count; i++) {
+        mount_point_t *mp = &g_vfs.mounts[i];
+        if (i != idx && mp->len > len && memcmp(mp->path, mount_point, len) == 0 &&
+            (len == 1 || mp->path[len] == '/')) {
+            spin_unlock(&g_vfs.lock);
+            return -EBUSY;
         }
-        impl->fs_data = new_data;
-        impl->size = offset + count;
     }
-    
-    memcpy((char *)impl->fs_data + offset, buf, count);
-    
-    return count;
+    if (sb->root->count > 1) {
+        spin_unlock(&g_vfs.lock);
+        return -EBUSY;
+    }
+
+    for (int j = idx; j < g_vfs.mount_count - 1; j++)
+        g_vfs.mounts[j] = g_vfs.mounts[j + 1];
+    g_vfs.mount_count--;
+    spin_unlock(&g_vfs.lock);
+
+    iput(sb->root);
+    if (sb->s_op && sb->s_op->put_super)
+        sb->s_op->put_super(sb);
+    kfree(sb);
+    return 0;
+}
+
+/* Copy out mount table entry index (mount order); -ENOENT past the end */
+int vfs_get_mount(int index, mount_info_t *info) {
+    int ret = -ENOENT;
+    spin_lock(&g_vfs.lock);
+    if (index >= 0 && index < g_vfs.mount_count) {
+        mount_point_t *mp = &g_vfs.mounts[index];
+        memcpy(info->device, mp->sb->device, sizeof(info->device));
+        memcpy(info->path, mp->path, sizeof(info->path));
+        strncpy(info->fs_type, mp->sb->type->name, sizeof(info->fs_type) - 1);
+        info->fs_type[sizeof(info->fs_type) - 1] = '\0';
+        ret = 0;
+    }
+    spin_unlock(&g_vfs.lock);
+    return ret;
+}
+
+/* ============================================================================
+ * Namespace operations
+ * ============================================================================ */
+
+int vfs_mkdir(const char *path, uint16_t mode) {
+    inode_t *dir;
+    const char *name;
+    size_t len;
+    int ret = path_parent(path, &dir, &name, &len);
+    if (ret < 0) return ret;
+
+    ret = dir->i_op && dir->i_op->mkdir ? dir->i_op->mkdir(dir, name, len, mode) : -EROFS;
+    iput(dir);
+    return ret;
+}
+
+int vfs_unlink(const char *path) {
+    inode_t *dir;
+    const char *name;
+    size_t len;
+    int ret = path_parent(path, &dir, &name, &len);
+    if (ret < 0) return ret;
+
+    ret = dir->i_op && dir->i_op->unlink ? dir->i_op->unlink(dir, name, len) : -EROFS;
+    iput(dir);
+    return ret;
+}
+
+int vfs_rmdir(const char *path) {
+    inode_t *dir;
+    const char *name;
+    size_t len;
+    int ret = path_parent(path, &dir, &name, &len);
+    if (ret < 0) return ret;
+
+    ret = dir->i_op && dir->i_op->rmdir ? dir->i_op->rmdir(dir, name, len) : -EROFS;
+    iput(dir);
+    return ret;
+}
+
+/* ============================================================================
+ * Open files
+ *
+ * file_t objects are recycled through a free list and never returned to
+ * kmalloc, so a lock-free fd lookup (fget) may still read f_count of a
+ * file that was just closed; it sees zero and retries.
+ * ============================================================================ */
+
+typedef struct {
+    file_t *free;
+    spinlock_t lock;
+} file_cache_t;
+
+static file_cache_t g_file_cache;
+
+static file_t *alloc_file(void) {
+    spin_lock(&g_file_cache.lock);
+    file_t *file = g_file_cache.free;
+    if (file) g_file_cache.free = file->private_data;
+    spin_unlock(&g_file_cache.lock);
+
+    if (!file && !(file = kmalloc(sizeof(file_t), GFP_KERNEL)))
+        return NULL;
+
+    /* f_count stays 0 until the file is fully set up */
+    file->inode = NULL;
+    file->f_op = NULL;
+    file->f_pos = 0;
+    file->f_flags = 0;
+    file->private_data = NULL;
+    return file;
+}
+
+static void free_file(file_t *file) {
+    spin_lock(&g_file_cache.lock);
+    file->private_data = g_file_cache.free;
+    g_file_cache.free = file;
+    spin_unlock(&g_file_cache.lock);
+}
+
+static int vfs_open_create(const char *path, int flags, uint16_t mode, inode_t **res) {
+    inode_t *dir;
+    const char *name;
+    size_t len;
+    int ret = path_parent(path, &dir, &name, &len);
+    if (ret < 0) return ret;
+
+    ret = dir->i_op && dir->i_op->lookup ? dir->i_op->lookup(dir, name, len, res) : -ENOENT;
+    if (ret == 0 && (flags & O_EXCL)) {
+        iput(*res);
+        ret = -EEXIST;
+    } else if (ret == -ENOENT) {
+        ret = dir->i_op && dir->i_op->create ?
+              dir->i_op->create(dir, name, len, S_IFREG | (mode & 07777), res) : -EROFS;
+    }
+    iput(dir);
+    return ret;
+}
+
+file_t *vfs_open(const char *path, int flags, uint16_t mode, int *err) {
+    inode_t *inode;
+    int ret;
+
+    if (!path) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    ret = (flags & O_CREAT) ? vfs_open_create(path, flags, mode, &inode)
+                            : vfs_lookup(path, &inode);
+    if (ret < 0) goto fail;
+
+    if (S_ISDIR(inode->mode) && (flags & O_ACCMODE) != O_RDONLY) {
+        ret = -EISDIR;
+        goto put;
+    }
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY && inode->size) {
+        ret = inode->i_op && inode->i_op->truncate ?
+              inode->i_op->truncate(inode, 0) : -ENOTIMPL;
+        if (ret < 0) goto put;
+    }
+
+    file_t *file = alloc_file();
+    if (!file) {
+        ret = -ENOMEM;
+        goto put;
+    }
+    file->inode = inode;
+    file->f_op = inode->i_fop;
+    file->f_flags = flags;
+
+    if (file->f_op && file->f_op->open && (ret = file->f_op->open(inode, file)) < 0) {
+        free_file(file);
+        goto put;
+    }
+    __atomic_store_n(&file->f_count, 1, __ATOMIC_RELEASE);
+    return file;
+
+put:
+    iput(inode);
+fail:
+    if (err) *err = ret;
+    return NULL;
+}
+
+/* Open a file on an inode with no path (pipes, rings); consumes the inode reference */
+file_t *alloc_file_pseudo(inode_t *inode, int flags, const file_operations_t *fop) {
+    file_t *file = alloc_file();
+    if (!file) return NULL;
+
+    file->inode = inode;
+    file->f_op = fop;
+    file->f_flags = flags;
+    __atomic_store_n(&file->f_count, 1, __ATOMIC_RELEASE);
+    return file;
+}
+
+void get_file(file_t *file) {
+    __atomic_add_fetch(&file->f_count, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference; the last one releases the file */
+void fput(file_t *file) {
+    if (!file || __atomic_sub_fetch(&file->f_count, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if (file->f_op && file->f_op->release)
+        file->f_op->release(file->inode, file);
+    iput(file->inode);
+    free_file(file);
+}
+
+void vfs_close(file_t *file) {
+    fput(file);
+}
+
+int64_t vfs_read(file_t *file, void *buf, size_t count) {
+    if (!file || !buf) return -EINVAL;
+    if ((file->f_flags & O_ACCMODE) == O_WRONLY) return -EBADF;
+    if (S_ISDIR(file->inode->mode)) return -EISDIR;
+    if (file->f_op && !file->f_op->read && file->f_op->read_iter) {
+        iovec_t iov = { .iov_base = buf, .iov_len = count };
+        iov_iter_t iter;
+        iov_iter_init(&iter, &iov, 1, count);
+        return vfs_iter_read(file, &iter, &file->f_pos, 0);
+    }
+    if (!file->f_op || !file->f_op->read) return -EINVAL;
+    return file->f_op->read(file, buf, count, &file->f_pos);
+}
+
+int64_t vfs_write(file_t *file, const void *buf, size_t count) {
+    if (!file || !buf) return -EINVAL;
+    if ((file->f_flags & O_ACCMODE) == O_RDONLY) return -EBADF;
+    if (file->f_op && !file->f_op->write && file->f_op->write_iter) {
+        iovec_t iov = { .iov_base = (void *)buf, .iov_len = count };
+        iov_iter_t iter;
+        iov_iter_init(&iter, &iov, 1, count);
+        return vfs_iter_write(file, &iter, &file->f_pos, 0);
+    }
+    if (!file->f_op || !file->f_op->write) return -EINVAL;
+    if (file->f_flags & O_APPEND) file->f_pos = file->inode->size;
+    return file->f_op->write(file, buf, count, &file->f_pos);
+}
+
+/*
+ * Vectored I/O at *pos. Files with read_iter/write_iter take the whole
+ * iterator in one call; the rest are fed one segment at a time and do
+ * not support IOCB_NOWAIT.
+ */
+int64_t vfs_iter_read(file_t *file, iov_iter_t *iter, uint64_t *pos, int flags) {
+    if (!file || !iter) return -EINVAL;
+    if ((file->f_flags & O_ACCMODE) == O_WRONLY) return -EBADF;
+    if (S_ISDIR(file->inode->mode)) return -EISDIR;
+    if (!file->f_op) return -EINVAL;
+
+    if (file->f_op->read_iter) {
+        kiocb_t iocb = { .ki_filp = file, .ki_pos = *pos, .ki_flags = flags };
+        int64_t ret = file->f_op->read_iter(&iocb, iter);
+        if (ret > 0) *pos = iocb.ki_pos;
+        return ret;
+    }
+    if (flags & IOCB_NOWAIT) return -EOPNOTSUPP;
+    if (!file->f_op->read) return -EINVAL;
+
+    int64_t done = 0;
+    while (iter->count) {
+        const iovec_t *iov = iter->iov;
+        size_t len = iov->iov_len - iter->iov_offset;
+        int64_t ret = file->f_op->read(file, (char *)iov->iov_base + iter->iov_offset, len, pos);
+        if (ret < 0) return done ? done : ret;
+        iter->iov_offset += (size_t)ret;
+        iter->count -= (size_t)ret;
+        done += ret;
+        if ((size_t)ret < len) break;
+        iter->iov++;
+        iter->nr_segs--;
+        iter->iov_offset = 0;
+    }
+    return done;
+}
+
+int64_t vfs_iter_write(file_t *file, iov_iter_t *iter, uint64_t *pos, int flags) {
+    if (!file || !iter) return -EINVAL;
+    if ((file->f_flags & O_ACCMODE) == O_RDONLY) return -EBADF;
+    if (!file->f_op) return -EINVAL;
+    if (file->f_flags & O_APPEND) *pos = file->inode->size;
+
+    if (file->f_op->write_iter) {
+        kiocb_t iocb = { .ki_filp = file, .ki_pos = *pos, .ki_flags = flags };
+        int64_t ret = file->f_op->write_iter(&iocb, iter);
+        if (ret > 0) *pos = iocb.ki_pos;
+        return ret;
+    }
+    if (flags & IOCB_NOWAIT) return -EOPNOTSUPP;
+    if (!file->f_op->write) return -EINVAL;
+
+    int64_t done = 0;
+    while (iter->count) {
+        const iovec_t *iov = iter->iov;
+        size_t len = iov->iov_len - iter->iov_offset;
+        int64_t ret = file->f_op->write(file, (char *)iov->iov_base + iter->iov_offset, len, pos);
+        if (ret < 0) return done ? done : ret;
+        iter->iov_offset += (size_t)ret;
+        iter->count -= (size_t)ret;
+        done += ret;
+        if ((size_t)ret < len) break;
+        iter->iov++;
+        iter->nr_segs--;
+        iter->iov_offset = 0;
+    }
+    return done;
+}
+
+int vfs_fsync(file_t *file) {
+    if (!file) return -EINVAL;
+    if (!file->f_op || !file->f_op->fsync) return 0;
+    return file->f_op->fsync(file);
+}
+
+int vfs_readdir(file_t *file, filldir_t filldir, void *ctx) {
+    if (!file || !filldir) return -EINVAL;
+    if (!S_ISDIR(file->inode->mode)) return -ENOTDIR;
+    if (!file->f_op || !file->f_op->readdir) return -EINVAL;
+    return file->f_op->readdir(file, filldir, ctx);
 }
@@ -0,0 +1,23 @@
+/**
+ * Return to user mode
+ *
+ * The check every return to user code makes for pending work. Kept apart
+ * from kernel.h so the VOS library's system call wrappers can make the
+ * same check without the rest of the kernel's definitions.
+ */
+
+#ifndef __ENTRY_H__
+#define __ENTRY_H__
+
+#define TIF_SIGPENDING  (1UL << 0)          /* An unblocked signal is pending */
+
+extern unsigned long *g_current_ti_flags;
+void exit_to_user_mode_slow(void);
+
+/* Every return to user code comes through here */
+static inline void exit_to_user_mode(void) {
+    if (__builtin_expect(__atomic_load_n(g_current_ti_flags, __ATOMIC_RELAXED) != 0, 0))
+        exit_to_user_mode_slow();
+}
+
+#endif /* __ENTRY_H__ */
@@ -11,6 +11,8 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include <entry.h>
+
 /* Architecture-specific */
 #ifdef __x86_64__
     #include "arch/x86_64.h"
@@ -20,19 +22,107 @@
     #include "arch/riscv64.h"
 #endif
 
-/* Kernel printk */
-void pr_info(const char *fmt, ...);
-void pr_err(const char *fmt, ...);
-void pr_debug(const char *fmt, ...);
-void pr_panic(const char *fmt, ...);
+/*
+ * Kernel printk (kernel/core/printk.c): callers format into a lockless
+ * record ring and return; a flusher thread writes records out to the
+ * console. Messages at or above the log level are dropped unformatted.
+ */
+#define LOGLEVEL_EMERG      0
+#define LOGLEVEL_ALERT      1
+#define LOGLEVEL_CRIT       2
+#define LOGLEVEL_ERR        3
+#define LOGLEVEL_WARNING    4
+#define LOGLEVEL_NOTICE     5
+#define LOGLEVEL_INFO       6
+#define LOGLEVEL_DEBUG      7
+
+int printk(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void pr_info(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void pr_err(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void pr_debug(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void pr_panic(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+typedef struct console {
+    const char *name;
+    void (*write)(struct console *con, const char *buf, size_t len);
+    void *data;
+} console_t;
+
+int printk_init(void);
+void register_console(console_t *con);     /* NULL restores the built-in stdout console */
+void console_flush(void);                  /* Write out everything logged so far */
+int printk_loglevel(void);
+void printk_set_loglevel(int level);       /* Print levels below this */
+void printk_set_sync(bool sync);           /* Callers print their own messages */
+uint64_t printk_dropped(void);
+void halt(void) __attribute__((noreturn));
+
+/* Allow burst messages per interval_ns; the rest are counted and reported later */
+typedef struct {
+    uint64_t interval_ns;
+    int burst;
+    uint64_t begin;
+    int printed;
+    int missed;
+} ratelimit_state_t;
+
+#define DEFAULT_RATELIMIT_INTERVAL  (5 * 1000000000ULL)
+#define DEFAULT_RATELIMIT_BURST     10
+#define RATELIMIT_STATE_INIT(interval_init, burst_init) \
+    { .interval_ns = (interval_init), .burst = (burst_init) }
+
+bool ___ratelimit(ratelimit_state_t *rs, const char *func);
+#define __ratelimit(rs) ___ratelimit(rs, __func__)
+
+/* Each call site gets its own limit */
+#define printk_ratelimited(level, fmt, ...) do { \
+        static ratelimit_state_t _rs = \
+            RATELIMIT_STATE_INIT(DEFAULT_RATELIMIT_INTERVAL, DEFAULT_RATELIMIT_BURST); \
+        if (__ratelimit(&_rs)) printk(level, fmt, ##__VA_ARGS__); \
+    } while (0)
+#define pr_err_ratelimited(fmt, ...)    printk_ratelimited(LOGLEVEL_ERR, fmt, ##__VA_ARGS__)
+#define pr_info_ratelimited(fmt, ...)   printk_ratelimited(LOGLEVEL_INFO, fmt, ##__VA_ARGS__)
+#define pr_debug_ratelimited(fmt, ...)  printk_ratelimited(LOGLEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
+/* Kernel command line (kernel/lib/cmdline.c): "mem=512M numa=fake=2" */
+#define COMMAND_LINE_SIZE   256
+
+void setup_command_line(const char *cmdline);
+const char *boot_command_line(void);
+bool boot_param(const char *name, char *val, size_t len);
+uint64_t memparse(const char *s, char **end);
 
 /* Error codes (kernel) */
 #define ENOMEM      12
 #define ENOENT      2
+#define ESRCH       3
+#define EINTR       4
+#define EIO         5
+#define E2BIG       7
+#define ENOEXEC     8
+#define EBADF       9
+#define EAGAIN      11
 #define EACCES      13
+#define EFAULT      14
 #define EBUSY       16
+#define EEXIST      17
+#define ENODEV      19
+#define ENOTDIR     20
+#define EISDIR      21
 #define EINVAL      22
+#define EMFILE      24
+#define EFBIG       27
+#define ENOSPC      28
+#define ESPIPE      29
+#define EROFS       30
+#define EPIPE       32
+#define ENAMETOOLONG 36
 #define ENOTIMPL    38
+#define ENOTEMPTY   39
+#define EOPNOTSUPP  95
+#define ETIMEDOUT   110
+#define ECANCELED   125
+#define EUCLEAN     117     /* Filesystem needs cleaning */
 
 /* PID & TID */
 typedef int32_t pid_t;
@@ -60,12 +150,214 @@ void kfree(void *ptr);
 void *kmem_cache_alloc(size_t size);
 void kmem_cache_free(void *ptr, size_t size);
 
+/* Slab cache statistics (/proc/slabinfo) */
+typedef struct {
+    char name[24];
+    size_t object_size;
+    unsigned int objs_per_slab;
+    unsigned long nr_slabs;
+    unsigned long nr_active;        /* Objects in use */
+    size_t slab_size;               /* Bytes per slab */
+} kmem_cache_info_t;
+
+int kmem_cache_info(unsigned int index, kmem_cache_info_t *info);
+
+/*
+ * Allocation profiling, built only with CONFIG_ALLOC_PROFILING
+ * (cmake -DENABLE_ALLOC_PROFILING=ON): kmalloc counters per call site
+ * and size class (/proc/allocinfo), and a sampling heap profiler that
+ * records the stack of one allocation per ~rate bytes
+ * (kernel/mm/heap_profile.c). Without it none of this is compiled.
+ */
+#ifdef CONFIG_ALLOC_PROFILING
+#define ALLOC_HIST_BUCKETS          8
+#define HEAP_PROFILE_DEFAULT_RATE   (512 * 1024)    /* Mean bytes between samples */
+#define HEAP_PROFILE_MAX_DEPTH      24
+
+typedef struct {
+    const void *caller;             /* Return address of the kmalloc() call */
+    char cache[24];
+    size_t object_size;             /* 0 for large allocations */
+    uint64_t calls, bytes, failures;
+} alloc_site_info_t;
+
+typedef struct {
+    char name[24];
+    size_t object_size;             /* 0 for large allocations */
+    uint64_t calls[ALLOC_HIST_BUCKETS];     /* By requested size within the class */
+    uint64_t bytes[ALLOC_HIST_BUCKETS];
+    uint64_t failures;
+    uint64_t untracked;             /* Calls whose site did not fit the site table */
+} alloc_size_hist_t;
+
+/* One allocating stack; counts are of samples, not scaled by the rate */
+typedef struct {
+    uint64_t alloc_objs, alloc_bytes;
+    uint64_t inuse_objs, inuse_bytes;
+    unsigned int depth;
+    const void *stack[HEAP_PROFILE_MAX_DEPTH];  /* Innermost first, from the kmalloc() caller */
+} heap_profile_stack_t;
+
+int kmalloc_site_info(unsigned int *pos, alloc_site_info_t *info);
+int kmalloc_size_hist(unsigned int index, alloc_size_hist_t *hist);
+
+int64_t heap_profile_next_sample(void);
+bool heap_profile_sample(const void *ptr, size_t size, const void *caller);
+bool heap_profile_free(const void *ptr);
+void heap_profile_set_rate(size_t bytes);
+size_t heap_profile_rate(void);
+int heap_profile_stack(unsigned int *pos, heap_profile_stack_t *st);
+uint64_t heap_profile_dropped(void);
+#endif
+
 /* Page allocator */
-struct page;
+struct address_space;
+
+/* One descriptor per physical page (mem_map) */
+typedef struct page {
+    uint32_t flags;                 /* PG_* */
+    int32_t count;                  /* References; 0 while free */
+    uint32_t order;                 /* Block order (head pages) */
+    struct address_space *mapping;  /* Page cache owner, or NULL */
+    uint64_t index;                 /* Offset within mapping, in pages */
+    struct page *next, *prev;       /* Buddy free list, or mapping's page list */
+    struct page *hash_next;         /* Page cache hash chain */
+    struct page *lru_next, *lru_prev;
+} page_t;
+
+#define PG_buddy        (1U << 0)   /* Head of a free buddy block */
+#define PG_uptodate     (1U << 1)
+#define PG_dirty        (1U << 2)
+#define PG_lru          (1U << 3)   /* On an LRU list */
+#define PG_active       (1U << 4)   /* On an active list */
+#define PG_referenced   (1U << 5)   /* Used since reclaim last looked */
+#define PG_swapbacked   (1U << 6)   /* No backing file (shmem) */
+
+struct page *alloc_pages(gfp_flags_t gfp, unsigned int order);
 struct page *page_alloc(unsigned int order);
 void page_free(struct page *page);
 void *page_to_virt(struct page *page);
 struct page *virt_to_page(void *vaddr);
+unsigned long nr_free_pages(void);
+unsigned long nr_total_pages(void);
+unsigned long nr_free_blocks(unsigned int order);
+
+#define MAX_ORDER       10          /* Orders 0 .. MAX_ORDER-1 */
+
+/*
+ * NUMA nodes: numa=fake=N splits memory (mem=, default PHYS_MEM_SIZE)
+ * into N equal nodes, each with its own buddy allocator and watermarks.
+ * CPUs are spread over the nodes in contiguous ranges.
+ */
+#define MAX_NUMNODES    8
+
+typedef uint32_t nodemask_t;        /* Bit n: node n */
+
+/* Memory policies for set_mempolicy() */
+enum mempolicy_mode {
+    MPOL_LOCAL,                     /* The running CPU's node, then the nearest */
+    MPOL_INTERLEAVE,                /* Round-robin over the mask */
+    MPOL_BIND,                      /* Only nodes in the mask */
+};
+
+typedef struct {
+    uint64_t numa_hit;              /* Allocated here as intended */
+    uint64_t numa_miss;             /* Allocated here, intended elsewhere */
+    uint64_t numa_foreign;          /* Intended here, allocated elsewhere */
+    uint64_t interleave_hit;
+    uint64_t local_node;            /* Allocated here by a CPU of this node */
+    uint64_t other_node;            /* Allocated here by a CPU of another node */
+} numa_stats_t;
+
+int nr_online_nodes(void);
+int cpu_to_node(unsigned int cpu);
+int numa_node_id(void);
+int page_to_nid(const struct page *page);
+int node_host_node(int nid);        /* Host NUMA node backing it, or -1 */
+unsigned long node_present_pages(int nid);
+unsigned long node_free_pages(int nid);
+unsigned long node_free_blocks(int nid, unsigned int order);
+void numa_get_stats(int nid, numa_stats_t *st);
+struct page *alloc_pages_node(int nid, gfp_flags_t gfp, unsigned int order);
+int set_mempolicy(enum mempolicy_mode mode, nodemask_t nodes);
+int get_mempolicy(enum mempolicy_mode *mode, nodemask_t *nodes);
+
+/* Zone watermarks, in free pages */
+enum zone_watermarks {
+    WMARK_MIN,                      /* Only reclaimers and GFP_ATOMIC go below */
+    WMARK_LOW,                      /* kswapd wakes below this */
+    WMARK_HIGH,                     /* kswapd sleeps again above this */
+    NR_WMARK,
+};
+
+unsigned long zone_watermark(int nid, enum zone_watermarks which);
+bool zone_watermark_ok(int nid, unsigned int order, unsigned long mark);
+
+/* Page cache (kernel/mm/page.c) */
+typedef struct address_space_operations {
+    /* Fill a freshly added page; NULL means new pages read as zeroes */
+    int (*readpage)(struct address_space *mapping, page_t *page);
+    /* Charge (nr > 0) or uncharge (nr < 0) pages; may refuse with -ENOSPC */
+    int (*reserve)(struct address_space *mapping, long nr);
+} address_space_operations_t;
+
+typedef struct address_space {
+    struct inode *host;
+    const address_space_operations_t *a_ops;
+    struct page *pages;             /* Cached pages, any order */
+    unsigned long nrpages;
+    unsigned int flags;             /* AS_* */
+} address_space_t;
+
+#define AS_SHMEM        (1U << 0)   /* Memory-only (tmpfs) pages */
+
+void get_page(page_t *page);
+void put_page(page_t *page);
+page_t *find_get_page(address_space_t *mapping, uint64_t index);
+page_t *find_or_create_page(address_space_t *mapping, uint64_t index, int *err);
+void truncate_inode_pages(address_space_t *mapping, uint64_t start);
+unsigned long nr_pagecache_pages(void);
+unsigned long nr_shmem_pages(void);
+
+/* LRU lists: shmem pages are anonymous, everything else file-backed */
+enum lru_list {
+    LRU_INACTIVE_ANON,
+    LRU_ACTIVE_ANON,
+    LRU_INACTIVE_FILE,
+    LRU_ACTIVE_FILE,
+    NR_LRU_LISTS,
+};
+
+unsigned long nr_lru_pages(enum lru_list lru);
+unsigned long shrink_page_cache(int nid, unsigned long nr_to_reclaim, int priority,
+                                unsigned long *nr_scanned);
+
+/* Page reclaim (kernel/mm/vmscan.c) */
+#define DEF_PRIORITY        12      /* First pass scans 1/4096 of a list */
+#define SWAP_CLUSTER_MAX    32UL    /* Pages per reclaim batch */
+
+/* Event counters for /proc/vmstat */
+enum vm_event_item {
+    PGSCAN_KSWAPD,
+    PGSTEAL_KSWAPD,
+    PGSCAN_DIRECT,
+    PGSTEAL_DIRECT,
+    ALLOCSTALL,                     /* Allocations that reclaimed directly */
+    KSWAPD_WAKEUP,
+    PGACTIVATE,
+    PGDEACTIVATE,
+    PGROTATED,                      /* Busy or dirty: back to the list head */
+    PGFAULT,                        /* User page faults */
+    PGMAJFAULT,                     /* Of those, ones that read the file */
+    NR_VM_EVENT_ITEMS,
+};
+
+void count_vm_events(enum vm_event_item item, unsigned long delta);
+uint64_t vm_event_count(enum vm_event_item item);
+const char *vm_event_name(enum vm_event_item item);
+
+void wakeup_kswapd(int nid);
+unsigned long try_to_free_pages(int nid, unsigned int order);
 
 /* Scheduler */
 typedef enum {
@@ -77,13 +369,47 @@ typedef enum {
     TASK_DEAD,
 } task_state_t;
 
+/* Thread context and lazy FPU state (kernel/arch/x86_64/context.c) */
+#define THREAD_SIZE     (16 * 1024)     /* Kernel stack per thread */
+
+typedef struct fpu {
+    void *state;                /* XSAVE area; NULL until the first FPU use */
+    unsigned int last_cpu;      /* CPU that last loaded it */
+    bool active;                /* Loaded and in use this slice */
+} fpu_t;
+
+typedef struct thread_struct {
+    uint64_t sp;                /* Saved kernel stack pointer */
+    uint64_t fsbase;            /* TLS: FS base, loaded on switch in */
+    fpu_t fpu;
+} thread_struct_t;
+
+typedef struct {
+    uint64_t switches;
+    uint64_t traps;             /* First FPU use after a switch (#NM) */
+    uint64_t saves;
+    uint64_t restores;
+    uint64_t lazy_hits;         /* Traps that found their state still loaded */
+} fpu_stats_t;
+
+int copy_thread(thread_struct_t *thread, void *stack, size_t size,
+                void (*fn)(void *arg), void *arg);
+void switch_to(thread_struct_t *prev, thread_struct_t *next);
+void fpu_init(void);
+int fpu_activate(thread_struct_t *thread);
+void fpu_release(thread_struct_t *thread);
+const char *fpu_mode_name(void);
+size_t fpu_state_size(void);
+void fpu_get_stats(unsigned int cpu, fpu_stats_t *stats);
+
 struct task_struct {
     pid_t pid;
     pid_t ppid;
     task_state_t state;
     int priority;       /* -20 (high) to +19 (low) */
     uint64_t vruntime;  /* Virtual runtime */
-    void *stack;
+    void *stack;        /* Kernel stack, THREAD_SIZE bytes */
+    thread_struct_t thread;
     void *mm;           /* Memory management */
     void *files;        /* Open file descriptors */
 };
@@ -92,15 +418,52 @@ pid_t do_fork(void);
 int do_exec(const char *filename, char *const argv[]);
 void do_exit(int code);
 void schedule(void);
+void scheduler_tick(void);
+pid_t do_getpid(void);
+pid_t do_getppid(void);
+tid_t do_gettid(void);
+
+/* Process snapshot for introspection (procfs) */
+typedef struct {
+    pid_t pid;
+    pid_t tgid;                 /* Thread group; pid for a group leader */
+    pid_t ppid;
+    char name[32];
+    task_state_t state;
+    int priority;
+    uint64_t vruntime;
+    int timeslice;
+} process_info_t;
+
+int process_get_info(pid_t pid, process_info_t *info);
+int process_iterate(int *cursor, process_info_t *info);
+int process_release(pid_t pid);
+
+/* Emulated CPUs: in hosted builds each runs on a host thread (kernel/core/main.c) */
+#define NR_CPUS         8
+
+unsigned int smp_processor_id(void);
+void cpu_bind(unsigned int cpu);
 
 /* Synchronization */
 typedef struct {
     volatile int val;
 } spinlock_t;
 
+#define SPINLOCK_INIT { 0 }
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
 void spin_lock(spinlock_t *lock);
 void spin_unlock(spinlock_t *lock);
 int spin_trylock(spinlock_t *lock);
+void cond_resched(void);
 
 typedef struct {
     volatile int count;
@@ -110,40 +473,1614 @@ int sem_init(semaphore_t *sem, int value);
 void sem_wait(semaphore_t *sem);
 void sem_post(semaphore_t *sem);
 
+/*
+ * Futexes: wait until woken while *uaddr still holds an expected value.
+ * A futex_q with a wake callback waits asynchronously: futex_wake()
+ * unlinks it and calls wake instead of releasing a sleeping caller.
+ */
+typedef struct futex_q {
+    uint32_t *uaddr;
+    void (*wake)(struct futex_q *q);
+    struct futex_q *next;
+    int woken;
+} futex_q_t;
+
+int futex_wait(uint32_t *uaddr, uint32_t val);
+int futex_wait_until(uint32_t *uaddr, uint32_t val, uint64_t deadline);
+int futex_wake(uint32_t *uaddr, int nr);
+int futex_queue(futex_q_t *q, uint32_t *uaddr, uint32_t val);
+bool futex_unqueue(futex_q_t *q);
+
 /* IPC */
 typedef int pipe_t;
 int pipe_create(pipe_t *read_fd, pipe_t *write_fd);
 int pipe_write(pipe_t fd, const void *buf, size_t len);
 int pipe_read(pipe_t fd, void *buf, size_t len);
+int do_pipe2(int fds[2], int flags);
 
 /* Virtual File System */
-typedef struct inode {
+struct inode;
+struct file;
+struct super_block;
+typedef struct inode inode_t;
+typedef struct file file_t;
+typedef struct super_block super_block_t;
+
+/* Called once per directory entry; nonzero stops the walk */
+typedef int (*filldir_t)(void *ctx, const char *name, size_t len, uint32_t ino, uint16_t mode);
+
+typedef struct inode_operations {
+    int (*lookup)(inode_t *dir, const char *name, size_t len, inode_t **res);
+    int (*create)(inode_t *dir, const char *name, size_t len, uint16_t mode, inode_t **res);
+    int (*mkdir)(inode_t *dir, const char *name, size_t len, uint16_t mode);
+    int (*unlink)(inode_t *dir, const char *name, size_t len);
+    int (*rmdir)(inode_t *dir, const char *name, size_t len);
+    int (*truncate)(inode_t *inode, uint64_t size);
+} inode_operations_t;
+
+/* One scatter/gather segment (matches vos_iovec_t) */
+typedef struct iovec {
+    void *iov_base;
+    size_t iov_len;
+} iovec_t;
+
+#define IOV_MAX     1024
+
+/* Position within an iovec array; copies consume it from the front */
+typedef struct iov_iter {
+    const iovec_t *iov;
+    unsigned long nr_segs;
+    size_t iov_offset;  /* Bytes of iov[0] already consumed */
+    size_t count;       /* Bytes left in the whole transfer */
+} iov_iter_t;
+
+void iov_iter_init(iov_iter_t *i, const iovec_t *iov, unsigned long nr_segs, size_t count);
+size_t copy_to_iter(const void *src, size_t bytes, iov_iter_t *i);
+size_t copy_from_iter(void *dst, size_t bytes, iov_iter_t *i);
+size_t iov_iter_zero(size_t bytes, iov_iter_t *i);
+
+/* One read or write in flight: its file, position and IOCB_* flags */
+typedef struct kiocb {
+    file_t *ki_filp;
+    uint64_t ki_pos;
+    int ki_flags;
+} kiocb_t;
+
+#define IOCB_NOWAIT     (1 << 0)    /* Return -EAGAIN rather than wait for I/O */
+
+/* preadv2 flags (match VOS_RWF_*) */
+#define RWF_NOWAIT      0x08
+
+typedef struct file_operations {
+    int (*open)(inode_t *inode, file_t *file);
+    void (*release)(inode_t *inode, file_t *file);
+    int64_t (*read)(file_t *file, void *buf, size_t count, uint64_t *pos);
+    int64_t (*write)(file_t *file, const void *buf, size_t count, uint64_t *pos);
+    /* Vectored forms; files without them cannot honour IOCB_NOWAIT */
+    int64_t (*read_iter)(kiocb_t *iocb, iov_iter_t *iter);
+    int64_t (*write_iter)(kiocb_t *iocb, iov_iter_t *iter);
+    int (*fsync)(file_t *file);
+    int (*readdir)(file_t *file, filldir_t filldir, void *ctx);
+} file_operations_t;
+
+typedef struct super_operations {
+    void (*evict_inode)(inode_t *inode);    /* Last reference dropped */
+    int (*sync_fs)(super_block_t *sb);
+    void (*put_super)(super_block_t *sb);
+} super_operations_t;
+
+struct inode {
     uint32_t ino;
-    uint32_t size;
+    uint64_t size;
     uint16_t mode;      /* File type & permissions */
+    uint32_t nlink;
     uint32_t uid, gid;
     uint32_t atime, mtime, ctime;
+    int count;          /* References (open files, lookups, links) */
+    super_block_t *sb;
+    const inode_operations_t *i_op;
+    const file_operations_t *i_fop;
+    address_space_t i_data;     /* Page cache for this inode */
+    uint64_t i_version; /* Bumped on each change to the contents */
+    void *i_exec;       /* Parsed ELF headers (kernel/fs/exec.c) */
     void *fs_data;      /* Filesystem-specific */
-} inode_t;
+};
+
+static inline void inode_inc_iversion(inode_t *inode) {
+    __atomic_add_fetch(&inode->i_version, 1, __ATOMIC_RELEASE);
+}
+
+#define S_IFMT      0xF000
+#define S_IFDIR     0x4000
+#define S_IFREG     0x8000
+#define S_IFIFO     0x1000
+#define S_ISDIR(m)  (((m) & S_IFMT) == S_IFDIR)
+#define S_ISREG(m)  (((m) & S_IFMT) == S_IFREG)
+#define S_ISFIFO(m) (((m) & S_IFMT) == S_IFIFO)
+
+/* Open flags (match VOS_O_*) */
+#define O_RDONLY    0x00
+#define O_WRONLY    0x01
+#define O_RDWR      0x02
+#define O_ACCMODE   0x03
+#define O_APPEND    0x08
+#define O_CREAT     0x100
+#define O_EXCL      0x200
+#define O_NONBLOCK  0x800
+#define O_TRUNC     0x1000
+
+struct file {
+    inode_t *inode;
+    const file_operations_t *f_op;
+    uint64_t f_pos;
+    int f_flags;
+    int f_count;
+    void *private_data;
+};
+
+void get_file(file_t *file);
+void fput(file_t *file);
+file_t *alloc_file_pseudo(inode_t *inode, int flags, const file_operations_t *fop);
+
+/*
+ * Per-process file descriptor tables (kernel/fs/file.c)
+ *
+ * fd -> file_t array plus an open-fd bitmap, with a second bitmap
+ * marking full words so the lowest free fd is a couple of ctz scans.
+ * Updates take file_lock; lookups (fget) take no lock. A table that
+ * grows is replaced, and the old one is kept until the files_struct
+ * dies so lock-free readers never see it freed.
+ */
+#define NR_OPEN_DEFAULT 64          /* Embedded table size */
+#define NR_OPEN_MAX     (1U << 20)
+
+typedef struct fdtable {
+    unsigned int max_fds;
+    file_t **fd;
+    unsigned long *open_fds;        /* One bit per fd */
+    unsigned long *full_fds_bits;   /* One bit per full open_fds word */
+    struct fdtable *retired;        /* Older, smaller tables */
+} fdtable_t;
+
+typedef struct files_struct {
+    int count;
+    spinlock_t file_lock;
+    fdtable_t *fdt;
+    unsigned int next_fd;           /* No free fd below this */
+    fdtable_t fdtab;
+    file_t *fd_array[NR_OPEN_DEFAULT];
+    unsigned long open_fds_init[1];
+    unsigned long full_fds_bits_init[1];
+} files_struct_t;
+
+files_struct_t *files_alloc(void);
+files_struct_t *init_files_struct(void);
+files_struct_t *dup_fd(files_struct_t *old, int *err);
+void put_files_struct(files_struct_t *files);
+files_struct_t *current_files(void);
+files_struct_t *get_task_files(pid_t pid);
+int alloc_fd(files_struct_t *files, unsigned int start);
+void put_unused_fd(files_struct_t *files, unsigned int fd);
+void fd_install(files_struct_t *files, unsigned int fd, file_t *file);
+int replace_fd(files_struct_t *files, unsigned int fd, file_t *file);
+int close_fd(files_struct_t *files, unsigned int fd);
+file_t *fget_files(files_struct_t *files, unsigned int fd);
+file_t *fget(unsigned int fd);
+
+/* Layout matches vos_stat_t */
+typedef struct {
+    uint32_t ino;
+    uint32_t size;
+    uint16_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t atime;
+    uint32_t mtime;
+    uint32_t ctime;
+} stat_t;
+
+#define SEEK_SET    0
+#define SEEK_CUR    1
+#define SEEK_END    2
+
+int do_open(const char *path, int flags, uint16_t mode);
+int do_close(int fd);
+int64_t do_read(int fd, void *buf, size_t count);
+int64_t do_write(int fd, const void *buf, size_t count);
+int64_t do_lseek(int fd, int64_t offset, int whence);
+int64_t do_readv(int fd, const iovec_t *iov, int iovcnt);
+int64_t do_writev(int fd, const iovec_t *iov, int iovcnt);
+int64_t do_pread(int fd, void *buf, size_t count, int64_t offset);
+int64_t do_pwrite(int fd, const void *buf, size_t count, int64_t offset);
+int64_t do_preadv2(int fd, const iovec_t *iov, int iovcnt, int64_t offset, int flags);
+int do_fsync(int fd);
+int do_stat(const char *path, stat_t *st);
+int do_fstat(int fd, stat_t *st);
+
+/*
+ * Submission/completion rings (kernel/fs/io_uring.c)
+ *
+ * The submitter fills SQEs and advances sq.tail; io_uring_enter()
+ * consumes them and advances sq.head. Completions are posted at cq.tail
+ * and reaped by advancing cq.head, so they can be polled without entering
+ * the kernel. Layouts match the vos_io_* types in Vos.h.
+ */
+typedef struct io_uring_sqe {
+    uint8_t opcode;         /* IORING_OP_* */
+    uint8_t flags;          /* IOSQE_* */
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;           /* File offset, -1 for the file position; futex value */
+    uint64_t addr;          /* Buffer, iovec array, path, fd pair or futex word */
+    uint32_t len;           /* Bytes, iovec count, open mode or futex wake count */
+    uint32_t op_flags;      /* Open flags, preadv2 RWF_* or pipe O_NONBLOCK */
+    uint64_t user_data;     /* Returned untouched in the CQE */
+} io_uring_sqe_t;
+
+typedef struct io_uring_cqe {
+    uint64_t user_data;
+    int32_t res;            /* What the synchronous call would have returned */
+    uint32_t flags;
+} io_uring_cqe_t;
+
+/* Each side's index pair gets its own cache line */
+typedef struct io_uring_ring {
+    uint32_t head;
+    uint32_t tail;
+} __attribute__((aligned(64))) io_uring_ring_t;
+
+typedef struct io_rings {
+    io_uring_ring_t sq, cq;
+    uint32_t sq_ring_mask, cq_ring_mask;
+    uint32_t sq_ring_entries, cq_ring_entries;
+    uint32_t cq_overflow;   /* Completions waiting for CQ space */
+    io_uring_cqe_t cqes[];
+} io_rings_t;
+
+typedef struct io_uring_params {
+    uint32_t sq_entries;    /* In: requested, rounded up to a power of two */
+    uint32_t cq_entries;    /* Out: twice sq_entries */
+    io_rings_t *rings;      /* Out */
+    io_uring_sqe_t *sqes;   /* Out: sq_entries slots, indexed by sq.tail */
+} io_uring_params_t;
+
+#define IORING_MAX_ENTRIES  4096
+
+enum {
+    IORING_OP_NOP,
+    IORING_OP_READ,
+    IORING_OP_WRITE,
+    IORING_OP_READV,
+    IORING_OP_WRITEV,
+    IORING_OP_OPENAT,
+    IORING_OP_CLOSE,
+    IORING_OP_FSYNC,
+    IORING_OP_PIPE,
+    IORING_OP_FUTEX_WAIT,
+    IORING_OP_FUTEX_WAKE,
+    IORING_OP_LAST,
+};
+
+#define IOSQE_IO_LINK           (1U << 0)   /* Next SQE starts after this one succeeds */
+#define IORING_ENTER_GETEVENTS  (1U << 0)   /* Wait for min_complete CQEs */
+
+int io_uring_setup(uint32_t entries, io_uring_params_t *p);
+int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+
+typedef struct file_system_type {
+    const char *name;
+    /* Fill in sb->root, sb->s_op and sb->fs_info for the given device */
+    int (*mount)(super_block_t *sb, const char *device);
+    struct file_system_type *next;
+} file_system_type_t;
+
+struct super_block {
+    file_system_type_t *type;
+    const super_operations_t *s_op;
+    inode_t *root;
+    void *fs_info;
+    char device[64];
+};
 
 typedef struct {
     char name[256];
     inode_t *inode;
 } dentry_t;
 
-inode_t *inode_alloc(void);
-void inode_free(inode_t *ino);
-int inode_read(inode_t *ino, void *buf, size_t count, uint32_t offset);
-int inode_write(inode_t *ino, const void *buf, size_t count, uint32_t offset);
+int register_filesystem(file_system_type_t *fs);
+inode_t *new_inode(super_block_t *sb);
+void iget(inode_t *inode);
+void iput(inode_t *inode);
+int inode_read(inode_t *ino, void *buf, size_t count, uint64_t offset);
+int inode_write(inode_t *ino, const void *buf, size_t count, uint64_t offset);
+
+int vfs_lookup(const char *path, inode_t **res);
+int vfs_mkdir(const char *path, uint16_t mode);
+int vfs_unlink(const char *path);
+int vfs_rmdir(const char *path);
+file_t *vfs_open(const char *path, int flags, uint16_t mode, int *err);
+void vfs_close(file_t *file);
+int64_t vfs_read(file_t *file, void *buf, size_t count);
+int64_t vfs_write(file_t *file, const void *buf, size_t count);
+int64_t vfs_iter_read(file_t *file, iov_iter_t *iter, uint64_t *pos, int flags);
+int64_t vfs_iter_write(file_t *file, iov_iter_t *iter, uint64_t *pos, int flags);
+int vfs_fsync(file_t *file);
+int vfs_readdir(file_t *file, filldir_t filldir, void *ctx);
+
+int64_t generic_file_read(file_t *file, void *buf, size_t count, uint64_t *pos);
+int64_t generic_file_write(file_t *file, const void *buf, size_t count, uint64_t *pos);
+int64_t generic_file_read_iter(kiocb_t *iocb, iov_iter_t *iter);
+int64_t generic_file_write_iter(kiocb_t *iocb, iov_iter_t *iter);
 
 /* Filesystem operations */
 int mount_fs(const char *device, const char *mount_point, const char *fs_type);
 int umount_fs(const char *mount_point);
 
+typedef struct {
+    char device[64];
+    char path[256];
+    char fs_type[32];
+} mount_info_t;
+
+int vfs_get_mount(int index, mount_info_t *info);
+
+/*
+ * seq_file: generated files (procfs) that stream records straight into
+ * the reader's buffer. start/next walk records by index; show emits one
+ * record with seq_printf/seq_write. A read that ends inside a record
+ * resumes there on the next call, so no intermediate buffer is needed.
+ */
+typedef struct seq_file seq_file_t;
+
+typedef struct seq_operations {
+    void *(*start)(seq_file_t *m, uint64_t *index);
+    void *(*next)(seq_file_t *m, void *v, uint64_t *index);
+    void (*stop)(seq_file_t *m, void *v);
+    int (*show)(seq_file_t *m, void *v);
+} seq_operations_t;
+
+struct seq_file {
+    char *buf;          /* Caller's buffer */
+    size_t size;
+    size_t count;       /* Bytes stored in buf */
+    size_t skip;        /* Bytes of output still to discard */
+    size_t rec_bytes;   /* Bytes of the current record produced so far */
+    bool overflow;
+    uint64_t index;     /* Record to resume at */
+    size_t rec_off;     /* Bytes of that record already returned */
+    uint64_t pos;       /* File position matching index/rec_off */
+    const seq_operations_t *op;
+    void *private;
+};
+
+int seq_open(file_t *file, const seq_operations_t *op, void *private);
+int64_t seq_read(file_t *file, void *buf, size_t count, uint64_t *pos);
+void seq_release(inode_t *inode, file_t *file);
+int seq_printf(seq_file_t *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int seq_write(seq_file_t *m, const void *data, size_t len);
+
+/* System information; layout matches vos_sysinfo_t */
+typedef struct {
+    uint32_t total_memory;      /* Pages */
+    uint32_t free_memory;
+    uint32_t used_memory;
+    uint32_t nr_processes;
+    uint32_t uptime;            /* Seconds */
+    uint32_t shared_memory;     /* tmpfs pages */
+    uint32_t cached_memory;     /* Page cache pages, including tmpfs */
+} sysinfo_t;
+
+int do_sysinfo(sysinfo_t *info);
+int nr_processes(void);
+
+/*
+ * Timekeeping (kernel/core/time.c)
+ *
+ * CLOCK_MONOTONIC counts nanoseconds since init_time(), so it doubles as
+ * uptime. With an invariant TSC it is computed from the cycle counter as
+ * mono_ns + ((tsc - cycle_last) * mult >> shift).
+ */
+#define NSEC_PER_SEC    1000000000ULL
+
+/* Matches vos_timespec_t */
+typedef struct {
+    uint32_t sec;
+    uint32_t nsec;
+} timespec_t;
+
+/*
+ * vvar: one read-only page of kernel data mapped into every process and
+ * read by the vDSO (kernel/core/vdso.c) without entering the kernel.
+ * Writers make seq odd, update, then make it even again; readers retry
+ * while seq is odd or changed under them.
+ */
+typedef struct vvar_data {
+    uint32_t seq;
+    uint32_t clock_mode;        /* VCLOCK_* */
+    uint64_t cycle_last;        /* TSC at the last update */
+    uint64_t mono_ns;           /* CLOCK_MONOTONIC at cycle_last */
+    uint32_t mult, shift;       /* TSC cycles to ns */
+    uint64_t tsc_hz;
+    pid_t pid, ppid;            /* Current process */
+} vvar_data_t;
+
+#define VCLOCK_NONE     0       /* No usable TSC: the vDSO falls back to the syscall */
+#define VCLOCK_TSC      1
+
+#define CLOCKSOURCE_MAX_SEC 600 /* Longest the anchor goes unmoved that mult/shift allow for */
+
+uint64_t ktime_get_ns(void);
+int tsc_clocksource_init(void);     /* Calibrate and switch; ktime runs on the reference clock until then */
+void clocks_calc_mult_shift(uint32_t *mult, uint32_t *shift, uint64_t from, uint64_t to,
+                            uint32_t maxsec);
+void timekeeping_update(void);
+void vvar_set_task(pid_t pid, pid_t ppid);
+const vvar_data_t *vdso_vvar_page(void);
+int do_clock_gettime(timespec_t *ts);
+
+int vdso_clock_gettime(timespec_t *ts);
+pid_t vdso_getpid(void);
+pid_t vdso_getppid(void);
+
+static inline uint64_t rdtsc_ordered(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_lfence();
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Seqlock reader side, shared by the kernel and the vDSO */
+static inline uint32_t vvar_read_begin(const vvar_data_t *v) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&v->seq, __ATOMIC_ACQUIRE)) & 1)
+        cpu_relax();
+    return seq;
+}
+
+static inline bool vvar_read_retry(const vvar_data_t *v, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&v->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* Nanoseconds since boot from a consistent vvar snapshot */
+static inline uint64_t vvar_mono_ns(const vvar_data_t *v, uint64_t cycles) {
+    uint64_t delta = cycles > v->cycle_last ? cycles - v->cycle_last : 0;
+    return v->mono_ns + (uint64_t)(((unsigned __int128)delta * v->mult) >> v->shift);
+}
+
+/* Red-black trees (kernel/lib/rbtree.c) */
+#define RB_RED          0
+#define RB_BLACK        1
+
+typedef struct rb_node {
+    struct rb_node *rb_parent;
+    struct rb_node *rb_left, *rb_right;
+    int rb_color;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t *rb_node;
+} rb_root_t;
+
+/* A tree that also tracks its leftmost (smallest) node */
+typedef struct {
+    rb_root_t rb_root;
+    rb_node_t *rb_leftmost;
+} rb_root_cached_t;
+
+#define rb_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline void rb_link_node(rb_node_t *node, rb_node_t *parent, rb_node_t **link) {
+    node->rb_parent = parent;
+    node->rb_left = node->rb_right = NULL;
+    *link = node;
+}
+
+void rb_insert_color(rb_node_t *node, rb_root_t *root);
+void rb_erase(rb_node_t *node, rb_root_t *root);
+rb_node_t *rb_first(const rb_root_t *root);
+rb_node_t *rb_next(const rb_node_t *node);
+void rb_insert_color_cached(rb_node_t *node, rb_root_cached_t *root, bool leftmost);
+void rb_erase_cached(rb_node_t *node, rb_root_cached_t *root);
+
+/*
+ * Timers
+ *
+ * timer_list (kernel/core/timer.c) is for coarse timeouts in jiffies: a
+ * per-CPU hierarchical wheel with O(1) add and delete that may fire up
+ * to 1/8 of the timeout late. hrtimer (kernel/core/hrtimer.c) is for
+ * nanosecond CLOCK_MONOTONIC deadlines, kept sorted in a per-CPU
+ * red-black tree. Callbacks run from the timer interrupt of the CPU the
+ * timer was armed on, and must not cancel themselves synchronously.
+ */
+#define HZ              1000
+#define TICK_NSEC       (NSEC_PER_SEC / HZ)
+#define KTIME_MAX       UINT64_MAX
+
+typedef struct timer_list {
+    struct timer_list *next, **pprev;   /* Wheel bucket; pprev NULL when idle */
+    uint64_t expires;                   /* In jiffies */
+    void (*function)(struct timer_list *timer);
+    uint32_t cpu;                       /* Base it is queued on */
+    uint32_t idx;                       /* Wheel bucket */
+} timer_list_t;
+
+uint64_t get_jiffies_64(void);
+void timer_setup(timer_list_t *timer, void (*function)(timer_list_t *timer));
+int mod_timer(timer_list_t *timer, uint64_t expires);
+void add_timer(timer_list_t *timer);
+int del_timer(timer_list_t *timer);
+int del_timer_sync(timer_list_t *timer);
+void run_local_timers(void);
+
+static inline bool timer_pending(const timer_list_t *timer) {
+    return __atomic_load_n(&timer->pprev, __ATOMIC_RELAXED) != NULL;
+}
+
+static inline uint64_t msecs_to_jiffies(uint64_t ms) {
+    return (ms * HZ + 999) / 1000;
+}
+
+typedef enum {
+    HRTIMER_NORESTART,
+    HRTIMER_RESTART,                    /* Callback moved expires forward */
+} hrtimer_restart_t;
+
+#define HRTIMER_MODE_ABS    0
+#define HRTIMER_MODE_REL    1
+
+#define HRTIMER_STATE_INACTIVE  0
+#define HRTIMER_STATE_ENQUEUED  1
+
+typedef struct hrtimer {
+    rb_node_t node;
+    uint64_t expires;                   /* CLOCK_MONOTONIC ns */
+    hrtimer_restart_t (*function)(struct hrtimer *timer);
+    uint32_t cpu;
+    uint32_t state;                     /* HRTIMER_STATE_* */
+} hrtimer_t;
+
+void hrtimer_init(hrtimer_t *timer, hrtimer_restart_t (*function)(hrtimer_t *timer));
+void hrtimer_start(hrtimer_t *timer, uint64_t time, int mode);
+void hrtimer_start_on(hrtimer_t *timer, uint64_t expires, unsigned int cpu);
+int hrtimer_try_to_cancel(hrtimer_t *timer);
+int hrtimer_cancel(hrtimer_t *timer);
+uint64_t hrtimer_forward(hrtimer_t *timer, uint64_t now, uint64_t interval);
+uint64_t hrtimer_next_event(unsigned int cpu);
+void hrtimer_interrupt(void);
+int do_nanosleep(const timespec_t *req);
+
+static inline bool hrtimer_active(const hrtimer_t *timer) {
+    return __atomic_load_n(&timer->state, __ATOMIC_RELAXED) == HRTIMER_STATE_ENQUEUED;
+}
+
+/*
+ * The tick: a per-CPU hrtimer every TICK_NSEC that advances jiffies and
+ * timekeeping, charges the running process and runs the timer wheel. An
+ * idle CPU stops it and sleeps until its next timer instead.
+ */
+typedef struct {
+    uint64_t ticks;                     /* Tick handler runs */
+    uint64_t interrupts;                /* Clock event interrupts taken */
+    uint64_t stops;                     /* Times the tick was stopped for idle */
+} tick_stats_t;
+
+bool tick_poll(void);
+void tick_nohz_idle_enter(void);
+void tick_nohz_idle_exit(void);
+void cpu_idle(void);
+void tick_get_stats(unsigned int cpu, tick_stats_t *stats);
+
+/*
+ * Interrupts (kernel/core/irq.c)
+ *
+ * Every vector enters do_IRQ() with a pt_regs frame and runs the
+ * handlers registered for it. Top halves only acknowledge the device
+ * and queue work; the bottom halves below run once the outermost
+ * interrupt returns. Hosted builds have no APIC: irq_inject() marks a
+ * vector pending on a CPU and irq_poll(), run by that CPU, delivers it.
+ */
+#define NR_VECTORS              256
+#define FIRST_EXTERNAL_VECTOR   0x20
+#define FIRST_DEVICE_VECTOR     0x30    /* Above the legacy PIC's; handed out by irq_alloc_vector() */
+#define LOCAL_TIMER_VECTOR      0xec
+#define IRQ_ANY_CPU             (~0U)   /* irq_alloc_vector(): the least loaded */
+
+/* Register frame built by the entry stubs (arch/x86_64/interrupts.s) */
+typedef struct pt_regs {
+    uint64_t r15, r14, r13, r12, rbp, rbx, r11, r10, r9, r8;
+    uint64_t rax, rcx, rdx, rsi, rdi;
+    uint64_t vector, error_code;
+    uint64_t rip, cs, rflags, rsp, ss;  /* Pushed by the CPU */
+} pt_regs_t;
+
+typedef enum {
+    IRQ_NONE,                           /* Not our device */
+    IRQ_HANDLED,
+} irqreturn_t;
+
+typedef irqreturn_t (*irq_handler_t)(unsigned int vector, void *dev);
+
+typedef struct {
+    const char *name;                   /* First handler's */
+    uint64_t count[NR_CPUS];
+} irq_info_t;
+
+int request_irq(unsigned int vector, irq_handler_t handler, const char *name, void *dev);
+void free_irq(unsigned int vector, void *dev);
+void do_IRQ(pt_regs_t *regs);
+void irq_deliver(unsigned int vector);
+void irq_inject(unsigned int cpu, unsigned int vector);
+unsigned int irq_poll(void);
+int irq_get_info(unsigned int vector, irq_info_t *info);
+int irq_alloc_vector(unsigned int *cpu);
+void irq_free_vector(unsigned int vector);
+
+/*
+ * Bottom halves (kernel/core/softirq.c)
+ *
+ * Softirqs are a fixed set of per-CPU handlers raised from interrupt
+ * context and run, all pending ones in a batch, when the last interrupt
+ * exits or bottom halves are re-enabled. Tasklets ride on them: a
+ * scheduled tasklet runs once, on one CPU at a time. Outside interrupt
+ * context raise_softirq() runs the handler before returning, unless
+ * local_bh_disable() is holding it back to batch.
+ */
+enum {
+    HI_SOFTIRQ,                         /* High-priority tasklets */
+    TIMER_SOFTIRQ,                      /* Timer wheel */
+    BLOCK_SOFTIRQ,                      /* Block request completion */
+    TASKLET_SOFTIRQ,
+    NR_SOFTIRQS
+};
+
+#define SOFTIRQ_OFFSET          (1U << 8)
+#define SOFTIRQ_DISABLE_OFFSET  (2 * SOFTIRQ_OFFSET)
+#define SOFTIRQ_MASK            (0xffU << 8)
+#define HARDIRQ_OFFSET          (1U << 16)
+#define HARDIRQ_MASK            (0xffU << 16)
+
+unsigned int preempt_count(void);
+
+static inline bool in_irq(void) {
+    return preempt_count() & HARDIRQ_MASK;
+}
+
+/* In a softirq, or with bottom halves disabled */
+static inline bool in_softirq(void) {
+    return preempt_count() & SOFTIRQ_MASK;
+}
+
+static inline bool in_interrupt(void) {
+    return preempt_count() & (HARDIRQ_MASK | SOFTIRQ_MASK);
+}
+
+void irq_enter(void);
+void irq_exit(void);
+void open_softirq(unsigned int nr, void (*action)(void));
+void raise_softirq(unsigned int nr);
+void do_softirq(void);
+bool local_softirq_pending(void);
+void local_bh_disable(void);
+void local_bh_enable(void);
+const char *softirq_name(unsigned int nr);
+uint64_t softirq_count(unsigned int nr, unsigned int cpu);
+
+#define TASKLET_STATE_SCHED     (1U << 0)   /* Queued to run */
+#define TASKLET_STATE_RUN       (1U << 1)   /* Running on some CPU */
+
+typedef struct tasklet_struct {
+    struct tasklet_struct *next;
+    uint32_t state;
+    int32_t count;                      /* Disabled while nonzero */
+    void (*func)(struct tasklet_struct *t);
+} tasklet_t;
+
+void tasklet_setup(tasklet_t *t, void (*func)(tasklet_t *t));
+void tasklet_schedule(tasklet_t *t);
+void tasklet_hi_schedule(tasklet_t *t);
+void tasklet_disable(tasklet_t *t);
+void tasklet_enable(tasklet_t *t);
+void tasklet_kill(tasklet_t *t);
+
+/*
+ * Workqueues (kernel/core/workqueue.c): deferred work that runs in
+ * process context and may sleep. Bound queues run work on the CPU that
+ * queued it, unbound queues on a pool of up to max_active workers,
+ * ordered queues one item at a time in queueing order.
+ */
+struct workqueue;
+struct worker_pool;
+
+typedef struct work_struct {
+    struct work_struct *next;
+    void (*func)(struct work_struct *work);
+    uint32_t pending;
+    struct workqueue *wq;               /* Last queued on */
+    struct worker_pool *pool;
+} work_struct_t;
+
+typedef struct delayed_work {
+    work_struct_t work;
+    timer_list_t timer;
+    struct workqueue *wq;
+    int cpu;
+} delayed_work_t;
+
+typedef struct workqueue workqueue_t;
+
+#define WQ_UNBOUND      (1U << 0)       /* Not tied to the queueing CPU */
+#define WQ_ORDERED      (1U << 1)       /* One at a time, in order; implies WQ_UNBOUND */
+
+typedef struct {
+    uint64_t workers;
+    uint64_t executed;
+    uint64_t stolen;                    /* Taken from a sibling's deque */
+    uint64_t created_on_block;          /* Workers started because one blocked */
+} wq_stats_t;
+
+workqueue_t *alloc_workqueue(const char *name, unsigned int flags, int max_active);
+workqueue_t *alloc_ordered_workqueue(const char *name);
+void destroy_workqueue(workqueue_t *wq);
+bool queue_work(workqueue_t *wq, work_struct_t *work);
+bool queue_work_on(int cpu, workqueue_t *wq, work_struct_t *work);
+void flush_workqueue(workqueue_t *wq);
+void workqueue_get_stats(workqueue_t *wq, wq_stats_t *st);
+
+void init_work(work_struct_t *work, void (*func)(work_struct_t *work));
+bool schedule_work(work_struct_t *work);
+bool flush_work(work_struct_t *work);
+bool process_scheduled_works(unsigned int cpu);
+
+void init_delayed_work(delayed_work_t *dwork, void (*func)(work_struct_t *work));
+bool queue_delayed_work(workqueue_t *wq, delayed_work_t *dwork, unsigned long delay);
+bool queue_delayed_work_on(int cpu, workqueue_t *wq, delayed_work_t *dwork, unsigned long delay);
+bool schedule_delayed_work(delayed_work_t *dwork, unsigned long delay);
+bool cancel_delayed_work(delayed_work_t *dwork);
+bool cancel_delayed_work_sync(delayed_work_t *dwork);
+bool flush_delayed_work(delayed_work_t *dwork);
+
+/* A worker is about to block, or is back; keeps its pool's concurrency up */
+void wq_worker_sleeping(void);
+void wq_worker_running(void);
+
+/*
+ * Console driver (kernel/drivers/console.c): the printk console. VGA text
+ * is repainted from a screen model once per batch, the serial port sends
+ * from a transmit ring without waiting, and hosted builds write to stdout.
+ */
+#define CON_VGA         (1U << 0)   /* console=tty0 */
+#define CON_SERIAL      (1U << 1)   /* console=ttyS0[,baud] */
+#define CON_STDOUT      (1U << 2)   /* console=stdout, hosted only */
+
+typedef struct {
+    uint64_t bytes;                 /* Written to the console */
+    uint64_t lines;                 /* Drawn on the screen */
+    uint64_t scrolls;
+    uint64_t repaints;              /* Copies of the dirty rectangle to video memory */
+    uint64_t cells;                 /* Cells those copied */
+    uint64_t serial_dropped;        /* Bytes the transmit ring had no room for */
+    uint64_t serial_queued;         /* Bytes waiting for the line */
+} console_stats_t;
+
+int console_driver_init(void);
+void console_write(const char *buf, size_t len);
+unsigned int console_backends(void);
+int console_set_backends(unsigned int mask);    /* CON_* */
+void console_set_baud(unsigned int baud);
+void console_set_output(void *file);            /* Hosted: a FILE *, NULL = stdout */
+int console_read_screen(unsigned int row, char *buf, size_t len);
+void console_get_stats(console_stats_t *st);
+void console_reset_stats(void);
+
+/*
+ * MMIO (kernel/lib/iomap.c): device register access. Hosted builds back
+ * BARs with host memory; a device model claims its registers with
+ * iomem_emulate() and sees every access to them.
+ */
+typedef struct {
+    uint32_t (*read)(void *opaque, size_t off, unsigned int size);
+    void (*write)(void *opaque, size_t off, uint32_t val, unsigned int size);
+} iomem_ops_t;
+
+uint8_t ioread8(const volatile void *addr);
+uint16_t ioread16(const volatile void *addr);
+uint32_t ioread32(const volatile void *addr);
+void iowrite8(uint8_t val, volatile void *addr);
+void iowrite16(uint16_t val, volatile void *addr);
+void iowrite32(uint32_t val, volatile void *addr);
+int iomem_emulate(volatile void *base, size_t size, const iomem_ops_t *ops, void *opaque);
+void iomem_unemulate(volatile void *base);
+
+/*
+ * PCI (kernel/drivers/pci.c): functions found by pci_scan_devices(),
+ * with their BARs sized and capabilities located. Config space goes
+ * through ECAM when its window is known (pci.ecam=), through ports
+ * 0xCF8/0xCFC otherwise; hosted builds load an ECAM image instead
+ * (pci.image=).
+ */
+#define PCI_DEVFN(slot, fn)     ((((slot) & 0x1f) << 3) | ((fn) & 0x07))
+#define PCI_SLOT(devfn)         (((devfn) >> 3) & 0x1f)
+#define PCI_FUNC(devfn)         ((devfn) & 0x07)
+#define PCI_ANY_ID              0xffff
+#define PCI_NUM_BARS            6
+
+#define PCI_COMMAND             0x04
+#define PCI_COMMAND_IO          0x0001
+#define PCI_COMMAND_MEMORY      0x0002
+#define PCI_COMMAND_MASTER      0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+
+#define PCI_CAP_ID_PM           0x01
+#define PCI_CAP_ID_MSI          0x05
+#define PCI_CAP_ID_VNDR         0x09
+#define PCI_CAP_ID_EXP          0x10
+#define PCI_CAP_ID_MSIX         0x11
+#define PCI_EXT_CAP_ID_ERR      0x0001
+
+#define PCI_BAR_IO              (1U << 0)
+#define PCI_BAR_MEM64           (1U << 1)
+#define PCI_BAR_PREFETCH        (1U << 2)
+
+#define PCI_ACCESS_ECAM         0
+#define PCI_ACCESS_CONF1        1   /* Ports 0xCF8/0xCFC: 256 bytes per function */
+
+typedef struct {
+    uint64_t start, size;           /* size 0: not implemented */
+    unsigned int flags;             /* PCI_BAR_* */
+    void *virt;                     /* Set by pci_iomap() */
+} pci_bar_t;
+
+typedef struct {
+    uint8_t vector;
+    uint8_t cpu;
+} pci_irq_t;
+
+typedef struct pci_dev {
+    uint8_t bus, devfn;
+    uint16_t vendor, device;
+    uint32_t class;                 /* Base class, subclass, programming interface */
+    uint8_t revision;
+    uint8_t hdr_type;               /* 0 endpoint, 1 bridge; multi-function bit cleared */
+    uint8_t secondary;              /* Bridges: the bus behind them */
+    uint8_t msi_cap, msix_cap, pcie_cap;    /* Capability offsets, 0 if absent */
+    pci_bar_t bar[PCI_NUM_BARS];
+    unsigned int nr_irqs;           /* MSI-X vectors from pci_alloc_irq_vectors() */
+    pci_irq_t *irqs;
+    void *driver_data;
+    struct pci_dev *next;
+} pci_dev_t;
+
+int pci_scan_devices(void);         /* Functions found, or -errno */
+int pci_ecam_load_image(const char *path);
+int pci_set_config_access(int mode);
+uint64_t pci_config_accesses(void);
+pci_dev_t *pci_get_device(uint16_t vendor, uint16_t device, pci_dev_t *from);
+int pci_read_config_byte(pci_dev_t *dev, unsigned int where, uint8_t *val);
+int pci_read_config_word(pci_dev_t *dev, unsigned int where, uint16_t *val);
+int pci_read_config_dword(pci_dev_t *dev, unsigned int where, uint32_t *val);
+int pci_write_config_byte(pci_dev_t *dev, unsigned int where, uint8_t val);
+int pci_write_config_word(pci_dev_t *dev, unsigned int where, uint16_t val);
+int pci_write_config_dword(pci_dev_t *dev, unsigned int where, uint32_t val);
+unsigned int pci_find_capability(pci_dev_t *dev, unsigned int cap);
+unsigned int pci_find_ext_capability(pci_dev_t *dev, unsigned int cap);
+int pci_enable_device(pci_dev_t *dev);      /* Memory and I/O decode, bus mastering */
+void *pci_iomap(pci_dev_t *dev, unsigned int bar);
+
+/*
+ * MSI-X: one vector per table entry, each aimed at a CPU by
+ * irq_alloc_vector(). PCI_IRQ_AFFINITY aims entry i at CPU i instead,
+ * for devices with a queue per CPU.
+ */
+#define PCI_IRQ_AFFINITY        (1U << 0)
+
+int pci_alloc_irq_vectors(pci_dev_t *dev, unsigned int min, unsigned int max, unsigned int flags);
+int pci_irq_vector(pci_dev_t *dev, unsigned int nr);
+void pci_free_irq_vectors(pci_dev_t *dev);
+void pci_msix_signal(pci_dev_t *dev, unsigned int entry);  /* Emulated devices raise entry */
+
+/* Hosted: config space for a device model's function on bus 0 */
+int pci_emulate_function(const void *cfg, size_t len);     /* Its devfn */
+void pci_remove_emulated_function(unsigned int devfn);
+
+/* Block devices (kernel/drivers/block.c) */
+struct block_device;
+
+struct block_request;
+
+typedef struct block_device_ops {
+    int (*read)(struct block_device *bdev, uint64_t offset, void *buf, size_t len);
+    int (*write)(struct block_device *bdev, uint64_t offset, const void *buf, size_t len);
+    int (*flush)(struct block_device *bdev);
+    /* Queue rq and complete it from an interrupt; NULL runs it synchronously */
+    int (*submit)(struct block_device *bdev, struct block_request *rq);
+} block_device_ops_t;
+
+typedef struct block_device {
+    char name[32];
+    uint64_t size;              /* Capacity in bytes */
+    const block_device_ops_t *ops;
+    void *private;
+    struct block_device *next;
+} block_device_t;
+
+int block_device_register(block_device_t *bdev);
+void block_device_unregister(block_device_t *bdev);
+block_device_t *block_device_lookup(const char *name);
+block_device_t *block_device_create_ram(const char *name, uint64_t size);
+block_device_t *block_device_create_file(const char *name, const char *path);
+int block_read(block_device_t *bdev, uint64_t offset, void *buf, size_t len);
+int block_write(block_device_t *bdev, uint64_t offset, const void *buf, size_t len);
+int block_flush(block_device_t *bdev);
+
+/*
+ * Asynchronous requests. The device calls block_complete_request() from
+ * its interrupt handler; end_io runs later in BLOCK_SOFTIRQ, batched
+ * with every other completion on that CPU.
+ */
+#define BLOCK_OP_READ   0
+#define BLOCK_OP_WRITE  1
+#define BLOCK_OP_FLUSH  2
+
+typedef struct block_request {
+    block_device_t *bdev;
+    int op;                             /* BLOCK_OP_* */
+    uint64_t offset;
+    void *buf;
+    size_t len;
+    int error;
+    void (*end_io)(struct block_request *rq);
+    void *private;
+    struct block_request *next;
+} block_request_t;
+
+int block_submit(block_request_t *rq);
+void block_complete_request(block_request_t *rq);
+
+/*
+ * Virtio (kernel/drivers/virtio.c): the virtio 1.x PCI transport and its
+ * virtqueues, split or packed. A buffer is a scatter/gather list, the
+ * segments the device reads before those it writes; with
+ * VIRTIO_F_RING_INDIRECT_DESC a buffer of several segments takes one
+ * ring slot, pointing at a descriptor table of its own. With
+ * VIRTIO_F_RING_EVENT_IDX each side publishes how far the other may get
+ * before it wants to hear about it, so a busy queue runs without kicks
+ * or interrupts.
+ */
+#define VIRTIO_PCI_VENDOR_ID            0x1af4
+#define VIRTIO_PCI_DEVICE_ID(type)      (0x1040 + (type))
+#define VIRTIO_ID_BLOCK                 2
+
+#define VIRTIO_F(bit)                   (1ULL << (bit))
+#define VIRTIO_F_RING_INDIRECT_DESC     28
+#define VIRTIO_F_RING_EVENT_IDX         29
+#define VIRTIO_F_VERSION_1              32
+#define VIRTIO_F_RING_PACKED            34
+
+typedef struct {
+    void *addr;
+    uint32_t len;
+} virtio_sg_t;
+
+struct virtio_device;
+
+typedef struct virtqueue {
+    void (*callback)(struct virtqueue *vq);     /* From the queue's interrupt */
+    struct virtio_device *vdev;
+    unsigned int index;
+    unsigned int num;                   /* Ring slots */
+    unsigned int num_free;
+    unsigned int cpu;                   /* Its interrupt goes here */
+    void *priv;
+    uint64_t kicks;
+    uint64_t interrupts;
+} virtqueue_t;
+
+typedef struct virtio_device {
+    pci_dev_t *pci;
+    uint64_t features;                  /* Negotiated */
+    volatile uint8_t *common, *isr, *config, *notify;
+    uint32_t notify_mult;
+    unsigned int nvqs;
+    virtqueue_t **vqs;
+} virtio_device_t;
+
+static inline bool virtio_has_feature(const virtio_device_t *vdev, unsigned int bit) {
+    return (vdev->features >> bit) & 1;
+}
+
+int virtio_pci_probe(virtio_device_t *vdev, pci_dev_t *pci);
+int virtio_negotiate_features(virtio_device_t *vdev, uint64_t wanted);
+uint8_t virtio_cread8(virtio_device_t *vdev, unsigned int off);
+uint16_t virtio_cread16(virtio_device_t *vdev, unsigned int off);
+uint32_t virtio_cread32(virtio_device_t *vdev, unsigned int off);
+uint64_t virtio_cread64(virtio_device_t *vdev, unsigned int off);
+int virtio_find_vqs(virtio_device_t *vdev, unsigned int nvqs, unsigned int max_size,
+                    void (*callback)(virtqueue_t *vq));
+void virtio_device_ready(virtio_device_t *vdev);
+void virtio_reset_device(virtio_device_t *vdev);   /* And frees its queues */
+
+int virtqueue_add_sgs(virtqueue_t *vq, const virtio_sg_t *sg, unsigned int out, unsigned int in,
+                      void *data);
+bool virtqueue_kick_prepare(virtqueue_t *vq);
+void virtqueue_notify(virtqueue_t *vq);
+void *virtqueue_get_buf(virtqueue_t *vq, uint32_t *len);
+void virtqueue_disable_cb(virtqueue_t *vq);
+bool virtqueue_enable_cb(virtqueue_t *vq);  /* False if buffers came back meanwhile */
+
+/*
+ * The device side, for hosted device models. virtio_model_add() puts a
+ * virtio-pci function for the model in config space; once a scan has
+ * found it, virtio_model_attach() traps its registers. The transport
+ * answers feature and queue setup; the model hears of each kick through
+ * notify() and works the queue with vring_pop() and vring_push().
+ */
+#define VRING_ELEM_MAX_SG   256
+
+typedef struct {
+    uint16_t id;                        /* Buffer ID */
+    uint16_t ndescs;                    /* Ring slots it took */
+    unsigned int out, in;               /* Read, then written, segments in sg; 0 if malformed */
+    virtio_sg_t sg[VRING_ELEM_MAX_SG];
+} vring_elem_t;
+
+struct virtio_model_state;
+
+typedef struct virtio_model {
+    uint16_t device_type;               /* VIRTIO_ID_* */
+    uint64_t features;                  /* Offered */
+    unsigned int nvqs;
+    uint16_t queue_size;                /* Largest the driver may choose, a power of two */
+    const void *config;                 /* Device-specific, read-only to the driver */
+    size_t config_len;
+    void (*notify)(struct virtio_model *m, unsigned int q);
+    void (*set_status)(struct virtio_model *m, uint8_t status);    /* DRIVER_OK, or 0 on reset */
+    void *priv;
+    struct virtio_model_state *state;
+} virtio_model_t;
+
+int virtio_model_add(virtio_model_t *m);
+int virtio_model_attach(virtio_model_t *m);
+void virtio_model_remove(virtio_model_t *m);
+uint64_t virtio_model_features(virtio_model_t *m);     /* Negotiated */
+bool virtio_model_queue_ready(virtio_model_t *m, unsigned int q);
+bool vring_pop(virtio_model_t *m, unsigned int q, vring_elem_t *elem);
+void vring_push(virtio_model_t *m, unsigned int q, const vring_elem_t *elem, uint32_t len);
+void vring_flush(virtio_model_t *m, unsigned int q);   /* Publish pushes, interrupt if asked */
+bool vring_enable_notify(virtio_model_t *m, unsigned int q);   /* True if more already waits */
+void vring_disable_notify(virtio_model_t *m, unsigned int q);
+
+/*
+ * virtio-blk (kernel/drivers/virtio_blk.c): a block device per function,
+ * with a virtqueue per CPU. Hosted builds can put a model disk over an
+ * image file on the bus (virtio_blk.image=) offering a choice of ring
+ * features.
+ */
+int virtio_blk_init(void);              /* Bind the functions the last scan found */
+void virtio_blk_exit(void);
+int virtio_blk_model_init(void);
+int virtio_blk_model_create(const char *path, uint64_t ring_features);
+void virtio_blk_model_destroy(void);
+
+/* Buffer cache: one buffer_head per cached filesystem block */
+#define BH_Uptodate     (1U << 0)
+#define BH_Dirty        (1U << 1)
+#define BH_JBD          (1U << 2)   /* Owned by the journal */
+
+typedef struct buffer_head {
+    block_device_t *b_bdev;
+    uint64_t b_blocknr;
+    uint32_t b_size;
+    uint32_t b_state;
+    int b_count;
+    uint8_t *b_data;
+    void *b_private;            /* Journal bookkeeping */
+    struct buffer_head *b_hash_next;
+    struct buffer_head *b_lru_prev, *b_lru_next;
+} buffer_head_t;
+
+buffer_head_t *getblk(block_device_t *bdev, uint64_t blocknr, uint32_t size);
+buffer_head_t *bread(block_device_t *bdev, uint64_t blocknr, uint32_t size);
+void brelse(buffer_head_t *bh);
+void get_bh(buffer_head_t *bh);
+void mark_buffer_dirty(buffer_head_t *bh);
+int sync_dirty_buffer(buffer_head_t *bh);
+int sync_blockdev(block_device_t *bdev);
+void invalidate_bdev(block_device_t *bdev);
+
+/* ext4 (kernel/fs/ext4.c) */
+typedef struct ext4_fs ext4_fs_t;
+
+#define EXT4_MOUNT_RDONLY       (1U << 0)
+#define EXT4_MOUNT_GROUP_COMMIT (1U << 1)   /* Batch concurrent fsyncs */
+
+typedef struct {
+    uint64_t commits;           /* Journal transactions committed */
+    uint64_t blocks_logged;     /* Metadata blocks written to the log */
+    uint64_t fsync_batched;     /* fsyncs satisfied by another's commit */
+} ext4_journal_stats_t;
+
+int ext4_mount(const char *device, unsigned int flags, ext4_fs_t **out);
+int ext4_umount(ext4_fs_t *fs);
+int ext4_shutdown(ext4_fs_t *fs);
+int ext4_lookup(ext4_fs_t *fs, const char *path, uint32_t *ino);
+int ext4_create(ext4_fs_t *fs, const char *path, uint16_t mode, uint32_t *ino);
+int ext4_mkdir(ext4_fs_t *fs, const char *path, uint16_t mode);
+int ext4_unlink(ext4_fs_t *fs, const char *path);
+int ext4_rmdir(ext4_fs_t *fs, const char *path);
+int ext4_read(ext4_fs_t *fs, uint32_t ino, void *buf, size_t count, uint64_t offset);
+int ext4_write(ext4_fs_t *fs, uint32_t ino, const void *buf, size_t count, uint64_t offset);
+int ext4_fsync(ext4_fs_t *fs, uint32_t ino);
+int ext4_sync_fs(ext4_fs_t *fs);
+int ext4_stat(ext4_fs_t *fs, uint32_t ino, inode_t *st);
+void ext4_journal_stats(ext4_fs_t *fs, ext4_journal_stats_t *stats);
+
+/*
+ * Tracing (kernel/core/trace.c): static tracepoints writing fixed-size
+ * binary records into per-CPU rings. Each event has a static key
+ * tested with a not-taken branch hint, in the shape of Linux's
+ * static_branch_unlikely(); without CONFIG_TRACING the tracepoints and
+ * their arguments compile to nothing.
+ */
+typedef struct {
+    int enabled;
+} static_key_t;
+
+#define static_branch_unlikely(key) \
+    __builtin_expect(__atomic_load_n(&(key)->enabled, __ATOMIC_RELAXED), 0)
+
+#define TRACE_MAX_ARGS  5
+
+/* name, category, flags, then one name per argument ("" = unused) */
+#define TRACE_EVENT_LIST(E) \
+    E(sched_switch,  "sched", 0,          "prev_pid", "next_pid", "", "", "") \
+    E(mm_page_alloc, "mm",    0,          "pfn", "order", "gfp", "nid", "") \
+    E(mm_page_free,  "mm",    0,          "pfn", "order", "", "", "") \
+    E(kmalloc,       "mm",    0,          "call_site", "ptr", "bytes_req", "bytes_alloc", "") \
+    E(kfree,         "mm",    0,          "call_site", "ptr", "", "", "") \
+    E(inode_read,    "vfs",   TRACE_SPAN, "ino", "offset", "count", "ret", "") \
+    E(inode_write,   "vfs",   TRACE_SPAN, "ino", "offset", "count", "ret", "") \
+    E(pipe_read,     "ipc",   TRACE_SPAN, "ino", "count", "ret", "", "") \
+    E(pipe_write,    "ipc",   TRACE_SPAN, "ino", "count", "ret", "", "")
+
+#define TRACE_SPAN      (1U << 0)   /* args[TRACE_MAX_ARGS - 1] is the trace_clock() start */
+
+enum trace_event_id {
+#define TRACE_EVENT_ID(name, ...) TRACE_##name,
+    TRACE_EVENT_LIST(TRACE_EVENT_ID)
+#undef TRACE_EVENT_ID
+    NR_TRACE_EVENTS
+};
+
+/* One record as read back */
+typedef struct {
+    uint64_t ts;                    /* ktime_get_ns() time base; so are span starts */
+    uint16_t id;                    /* enum trace_event_id */
+    uint16_t cpu;
+    uint64_t args[TRACE_MAX_ARGS];
+} trace_entry_t;
+
+extern static_key_t g_trace_keys[NR_TRACE_EVENTS];
+
+void trace_event_write(enum trace_event_id id, uint64_t a0, uint64_t a1, uint64_t a2,
+                       uint64_t a3, uint64_t a4);
+uint64_t trace_clock(void);
+int trace_init(void);
+int trace_event_enable(const char *name, bool enable);     /* "all" for every event */
+void trace_reset(void);
+int trace_read(unsigned int cpu, uint64_t *pos, trace_entry_t *entry);
+uint64_t trace_lost(unsigned int cpu);
+const char *trace_event_name(unsigned int id);
+int trace_write_json(int (*write)(void *ctx, const char *buf, size_t len), void *ctx);
+
+#ifdef CONFIG_TRACING
+#define trace_enabled(name) static_branch_unlikely(&g_trace_keys[TRACE_##name])
+#define __trace(name, a0, a1, a2, a3, a4) do { \
+        if (trace_enabled(name)) \
+            trace_event_write(TRACE_##name, (uint64_t)(a0), (uint64_t)(a1), (uint64_t)(a2), \
+                              (uint64_t)(a3), (uint64_t)(a4)); \
+    } while (0)
+/* Start time for a TRACE_SPAN event, read only while the event is on */
+#define trace_span_start(name) (trace_enabled(name) ? trace_clock() : 0)
+#else
+#define trace_enabled(name) 0
+/* Arguments are still type-checked and count as used, but generate no code */
+#define __trace(name, a0, a1, a2, a3, a4) do { \
+        if (0) { (void)(a0); (void)(a1); (void)(a2); (void)(a3); (void)(a4); } \
+    } while (0)
+#define trace_span_start(name) ((uint64_t)0)
+#endif
+
+#define trace_sched_switch(prev, next)          __trace(sched_switch, prev, next, 0, 0, 0)
+#define trace_mm_page_alloc(pfn, order, gfp, nid) __trace(mm_page_alloc, pfn, order, gfp, nid, 0)
+#define trace_mm_page_free(pfn, order)          __trace(mm_page_free, pfn, order, 0, 0, 0)
+#define trace_kmalloc(site, ptr, req, alloc)    __trace(kmalloc, site, ptr, req, alloc, 0)
+#define trace_kfree(site, ptr)                  __trace(kfree, site, ptr, 0, 0, 0)
+#define trace_inode_read(ino, off, count, ret, start) \
+    __trace(inode_read, ino, off, count, ret, start)
+#define trace_inode_write(ino, off, count, ret, start) \
+    __trace(inode_write, ino, off, count, ret, start)
+#define trace_pipe_read(ino, count, ret, start)  __trace(pipe_read, ino, count, ret, 0, start)
+#define trace_pipe_write(ino, count, ret, start) __trace(pipe_write, ino, count, ret, 0, start)
+
+/*
+ * Address spaces (kernel/mm/vma.c): a process's mappings as VMAs in an
+ * rbtree sorted by address, over a four-level page table filled in on
+ * demand. A file mapping's pages come from the inode's page cache; a
+ * private one shares the cached page until the first write copies it.
+ * Anonymous memory is zero-filled on first touch.
+ */
+#define TASK_SIZE       (1ULL << 47)        /* End of user space */
+#define STACK_TOP       TASK_SIZE
+#define MMAP_MIN_ADDR   0x10000ULL
+
+#define VM_READ         (1U << 0)
+#define VM_WRITE        (1U << 1)
+#define VM_EXEC         (1U << 2)
+#define VM_SHARED       (1U << 3)           /* Writes go to the file's pages */
+
+#define MAP_FIXED       (1U << 0)           /* Exactly at addr, replacing what was there */
+
+#define FAULT_FLAG_WRITE        (1U << 0)
+#define FAULT_FLAG_INSTRUCTION  (1U << 1)
+
+struct mm_struct;
+
+typedef struct vm_area {
+    uint64_t vm_start, vm_end;              /* [start, end), page aligned */
+    unsigned int vm_flags;                  /* VM_* */
+    inode_t *vm_file;                       /* Referenced; NULL for anonymous memory */
+    uint64_t vm_pgoff;                      /* File page mapped at vm_start */
+    struct mm_struct *vm_mm;
+    rb_node_t vm_rb;
+} vm_area_t;
+
+typedef struct mm_struct {
+    rb_root_t mm_rb;                        /* VMAs by address */
+    vm_area_t *mmap_cache;                  /* Last find_vma() hit */
+    unsigned int map_count;
+    uint64_t *pgd;
+    spinlock_t lock;                        /* VMAs, page table and counters */
+    int users;
+    uint64_t mmap_base;                     /* Unfixed mappings go below this */
+    uint64_t start_code, end_code, start_data, end_data;
+    uint64_t start_brk, brk, start_stack;
+    uint64_t arg_start, arg_end, env_start, env_end;
+    uint64_t entry;                         /* First user instruction */
+    unsigned long rss;                      /* Pages mapped */
+    unsigned long nr_ptes;                  /* Page-table pages */
+    uint64_t min_flt, maj_flt;              /* Faults served from memory / that read the file */
+} mm_struct_t;
+
+mm_struct_t *mm_alloc(void);
+mm_struct_t *dup_mm(mm_struct_t *old, int *err);
+void mmget(mm_struct_t *mm);
+void mmput(mm_struct_t *mm);
+vm_area_t *find_vma(mm_struct_t *mm, uint64_t addr);   /* First ending above addr; caller holds lock */
+int64_t do_mmap(mm_struct_t *mm, uint64_t addr, uint64_t len, unsigned int vm_flags,
+                unsigned int flags, inode_t *file, uint64_t pgoff);
+int do_munmap(mm_struct_t *mm, uint64_t addr, uint64_t len);
+int handle_mm_fault(mm_struct_t *mm, uint64_t addr, unsigned int fault_flags);
+int copy_to_mm(mm_struct_t *mm, uint64_t addr, const void *src, size_t len);
+int copy_from_mm(mm_struct_t *mm, void *dst, uint64_t addr, size_t len);
+int clear_mm(mm_struct_t *mm, uint64_t addr, size_t len);
+
+/* The running process's address space, and exec's swap of a process's (0: current) */
+mm_struct_t *current_mm(void);
+int exec_mm_replace(pid_t pid, mm_struct_t *mm, const char *comm, mm_struct_t **old);
+
+/*
+ * ELF64 executables (kernel/fs/exec.c). exec maps each PT_LOAD segment
+ * of the file (and of its PT_INTERP, if any) into a fresh mm without
+ * reading it: pages arrive through faults. ET_DYN images go at a random
+ * base unless norandmaps=1. Parsed headers stay on the inode until its
+ * contents change, so an exec of a binary already run needs no header
+ * reads at all.
+ */
+#define EI_NIDENT       16
+#define ELFCLASS64      2
+#define ELFDATA2LSB     1
+#define EV_CURRENT      1
+#define ET_EXEC         2
+#define ET_DYN          3
+#define EM_X86_64       62
+
+#define PT_LOAD         1
+#define PT_INTERP       3
+#define PT_PHDR         6
+#define PT_GNU_STACK    0x6474e551
+
+#define PF_X            (1U << 0)
+#define PF_W            (1U << 1)
+#define PF_R            (1U << 2)
+
+typedef struct {
+    uint8_t e_ident[EI_NIDENT];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+} Elf64_Phdr;
+
+/* Auxiliary vector tags */
+#define AT_NULL         0
+#define AT_PHDR         3
+#define AT_PHENT        4
+#define AT_PHNUM        5
+#define AT_PAGESZ       6
+#define AT_BASE         7
+#define AT_FLAGS        8
+#define AT_ENTRY        9
+#define AT_UID          11
+#define AT_EUID         12
+#define AT_GID          13
+#define AT_EGID         14
+#define AT_PLATFORM     15
+#define AT_HWCAP        16
+#define AT_CLKTCK       17
+#define AT_SECURE       23
+#define AT_RANDOM       25
+#define AT_EXECFN       31
+
+#define ARG_MAX         (128 * 1024)        /* argv and envp strings together */
+#define STACK_SIZE_DEFAULT  (8ULL << 20)
+
+typedef struct {
+    uint64_t execs;
+    uint64_t hdr_cache_hits;                /* Headers taken from the inode */
+    uint64_t hdr_cache_misses;              /* Parsed from the file */
+} exec_stats_t;
+
+int exec_load(mm_struct_t *mm, const char *filename, char *const argv[], char *const envp[]);
+int do_execve(const char *filename, char *const argv[], char *const envp[]);
+void exec_cache_drop(inode_t *inode);
+void exec_get_stats(exec_stats_t *stats);
+
+/*
+ * spawn (kernel/core/scheduler.c): a new process running path, built
+ * directly rather than by fork and exec. The child starts from a copy
+ * of the caller's descriptor table, runs the file actions against it in
+ * order, and gets an address space from exec_load(); nothing of the
+ * caller's memory is copied. On any failure no child exists.
+ */
+enum spawn_file_action_type {
+    SPAWN_FA_CLOSE,                         /* close(fd) */
+    SPAWN_FA_DUP2,                          /* dup2(srcfd, fd) */
+    SPAWN_FA_OPEN,                          /* open(path, flags, mode) at fd */
+};
+
+/* Layout matches vos_spawn_action_t */
+typedef struct {
+    int action;                             /* SPAWN_FA_* */
+    int fd;
+    int srcfd;
+    int flags;
+    uint16_t mode;
+    const char *path;
+} spawn_file_action_t;
+
+#define SPAWN_SETPRIORITY   (1U << 0)
+#define SPAWN_SETSIGMASK    (1U << 1)
+
+/* Layout matches vos_spawnattr_t */
+typedef struct {
+    unsigned int flags;                     /* SPAWN_SET*: which fields apply */
+    int priority;
+    uint64_t sigmask;                       /* Bit n-1 blocks signal n */
+} spawn_attr_t;
+
+int spawn_file_action(files_struct_t *files, const spawn_file_action_t *fa);
+pid_t do_spawn(const char *path, const spawn_file_action_t *actions, unsigned int nactions,
+               const spawn_attr_t *attr, char *const argv[], char *const envp[]);
+
+/*
+ * Threads (kernel/core/scheduler.c): do_clone() starts a task running
+ * fn(arg) that shares whatever the flags say with the caller, by
+ * reference rather than by copy. CLONE_THREAD puts it in the caller's
+ * thread group: getpid() returns the group's id (the leader's tid), only
+ * leaders show up in /proc, and a finished thread is reaped by the
+ * scheduler rather than waited for. Every task's kernel stack comes from
+ * a cache of THREAD_SIZE blocks, the top THREAD_TLS_SIZE bytes of which
+ * hold its default thread-local storage unless CLONE_SETTLS names other.
+ * Flag values are Linux's.
+ */
+#define CLONE_VM        0x00000100          /* Share the address space */
+#define CLONE_FILES     0x00000400          /* Share the descriptor table */
+#define CLONE_SIGHAND   0x00000800          /* Share signal handlers; needs CLONE_VM */
+#define CLONE_THREAD    0x00010000          /* Same thread group; needs CLONE_SIGHAND */
+#define CLONE_SETTLS    0x00080000          /* tls is the new FS base */
+
+#define THREAD_TLS_SIZE 512                 /* Default TLS block: data, then the TCB */
+
+#define NR_SIGNALS      64
+typedef void (*k_sighandler_t)(int sig);
+#define KSIG_DFL        ((k_sighandler_t)0)
+#define KSIG_IGN        ((k_sighandler_t)1)
+
+typedef struct {
+    k_sighandler_t handler;
+    uint64_t mask;                          /* Blocked while the handler runs */
+    unsigned int flags;
+} k_sigaction_t;
+
+/* Signal dispositions, shared between CLONE_SIGHAND tasks */
+typedef struct sighand_struct {
+    int count;
+    spinlock_t lock;                        /* Also the sharers' pending sets and masks */
+    k_sigaction_t action[NR_SIGNALS];             /* action[n - 1] is signal n's */
+    uint32_t wait_seq;                      /* Futex word: bumped as signals arrive */
+    int nr_waiters;                         /* In sigtimedwait or a signalfd read */
+} sighand_struct_t;
+
+tid_t do_clone(unsigned long flags, void (*fn)(void *arg), void *arg, uint64_t tls);
+uint64_t current_tls(void);
+
+/*
+ * Signals (kernel/core/signal.c). Each task has its own pending set and
+ * blocked mask. A thread group also has a shared pending set, kept on
+ * its leader, for signals sent to the process as a whole; any thread
+ * that does not block one may take it. Signals below KSIGRTMIN coalesce
+ * into one pending bit each. Real-time ones queue every instance with
+ * its siginfo, up to SIGQUEUE_MAX across the system.
+ *
+ * A task with an unblocked signal pending has TIF_SIGPENDING set, and
+ * g_current_ti_flags points at the current task's flags. The check on
+ * the way back to user code, exit_to_user_mode() in entry.h, is one load
+ * and one branch when nothing is due; the slow path runs handlers and
+ * default actions. Default actions terminate or stop the whole group,
+ * continue it, or do nothing. Numbers and flag values are Linux's.
+ */
+#define SIGHUP          1
+#define SIGINT          2
+#define SIGQUIT         3
+#define SIGILL          4
+#define SIGTRAP         5
+#define SIGABRT         6
+#define SIGBUS          7
+#define SIGFPE          8
+#define SIGKILL         9
+#define SIGUSR1         10
+#define SIGSEGV         11
+#define SIGUSR2         12
+#define SIGPIPE         13
+#define SIGALRM         14
+#define SIGTERM         15
+#define SIGSTKFLT       16
+#define SIGCHLD         17
+#define SIGCONT         18
+#define SIGSTOP         19
+#define SIGTSTP         20
+#define SIGTTIN         21
+#define SIGTTOU         22
+#define SIGURG          23
+#define SIGXCPU         24
+#define SIGXFSZ         25
+#define SIGVTALRM       26
+#define SIGPROF         27
+#define SIGWINCH        28
+#define SIGPOLL         29
+#define SIGPWR          30
+#define SIGSYS          31
+#define KSIGRTMIN       32                  /* First queued (real-time) signal */
+#define KSIGRTMAX       NR_SIGNALS
+
+#define SIGMASK(sig)    (1ULL << ((sig) - 1))
+
+#define SIGQUEUE_MAX    4096                /* Queued siginfos, system-wide */
+
+#define KSA_NODEFER     0x40000000          /* Don't block the signal in its handler */
+#define KSA_RESETHAND   0x80000000          /* Back to KSIG_DFL once delivered */
+
+#define KSIG_BLOCK      0                   /* do_sigprocmask() how */
+#define KSIG_UNBLOCK    1
+#define KSIG_SETMASK    2
+
+#define KSI_USER        0                   /* kill() */
+#define KSI_KERNEL      0x80
+#define KSI_QUEUE       (-1)                /* sigqueue() */
+#define KSI_TKILL       (-6)                /* tkill() */
+
+/* Layout matches vos_siginfo_t; also the record a signalfd read returns */
+typedef struct {
+    int32_t signo;
+    int32_t code;                           /* KSI_*: how it was sent */
+    pid_t pid;                              /* Sender's tgid */
+    uint32_t pad;
+    uint64_t value;                         /* sigqueue() payload */
+} k_siginfo_t;
+
+typedef struct sigqueue {
+    struct sigqueue *next;
+    k_siginfo_t info;
+} sigqueue_t;
+
+typedef struct {
+    uint64_t signal;                        /* Bit n-1: signal n pending */
+    sigqueue_t *head, **tail;               /* Their siginfos, oldest first */
+} sigpending_t;
+
+int do_kill(pid_t pid, int sig);
+int do_tkill(tid_t tid, int sig);
+int do_sigqueue(pid_t pid, int sig, uint64_t value);
+int do_sigaction(int sig, const k_sigaction_t *act, k_sigaction_t *oact);
+int do_sigprocmask(int how, const uint64_t *set, uint64_t *oset);
+int do_sigpending(uint64_t *set);
+int do_sigtimedwait(uint64_t set, k_siginfo_t *info, int64_t timeout_ns);
+int do_signalfd(int fd, uint64_t mask, int flags);
+
+/*
+ * Initcalls (kernel/core/initcall.c): boot steps that name the steps they
+ * need rather than relying on their place in kernel_main(). A run starts
+ * each step on an unbound workqueue as soon as the last of its
+ * dependencies has finished, and returns when every step has, except
+ * the INITCALL_NOWAIT ones. A step whose dependency failed is skipped.
+ * initcall.serial on the command line runs them one after another on
+ * the boot CPU instead. Timings go to the boot report, /proc/initcalls.
+ */
+#define INITCALL_MAX_DEPS   4
+#define INITCALL_FATAL      (1U << 0)   /* Panic if it fails */
+#define INITCALL_NOWAIT     (1U << 1)   /* The run does not wait; nothing may depend on it */
+
+typedef struct initcall {
+    const char *name;
+    int (*fn)(void);
+    const char *deps[INITCALL_MAX_DEPS];    /* Names; unused slots NULL */
+    unsigned int flags;
+} initcall_t;
+
+typedef struct {
+    const char *name;
+    int ret;                            /* -ECANCELED if skipped */
+    unsigned int cpu;                   /* Ran on */
+    bool done;
+    uint64_t ready_ns;                  /* Since the run began: dependencies met */
+    uint64_t start_ns;
+    uint64_t end_ns;
+} initcall_record_t;
+
+typedef struct {
+    unsigned int nr;
+    bool serial;
+    uint64_t wall_ns;                   /* Until the last waited-for step finished */
+    uint64_t busy_ns;                   /* Sum of the steps' run times */
+    uint64_t critical_ns;               /* Longest chain of dependencies */
+} initcall_summary_t;
+
+int initcalls_run(const initcall_t *calls, size_t n);
+int initcall_get_record(unsigned int index, initcall_record_t *rec);
+void initcall_get_summary(initcall_summary_t *sum);
+
 /* Initialization functions */
 void kernel_main(void);
 void init_cpu(void);
 void init_memory(void);
+void init_time_early(void);
+void init_time(void);
+void init_softirq(void);
+void init_timers(void);
+void init_workqueues(void);
 void init_scheduler(void);
 void init_vfs(void);
 void init_drivers(void);
@@ -0,0 +1,69 @@
+/**
+ * Kernel command line
+ *
+ * The boot loader (or the hosted harness) hands over one string of
+ * space-separated name=value words. Subsystems look up their own
+ * parameters while they initialise; unknown words are ignored.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+static char g_boot_command_line[COMMAND_LINE_SIZE];
+
+void setup_command_line(const char *cmdline) {
+    size_t len = cmdline ? strlen(cmdline) : 0;
+    if (len >= COMMAND_LINE_SIZE) len = COMMAND_LINE_SIZE - 1;
+    memcpy(g_boot_command_line, cmdline ? cmdline : "", len);
+    g_boot_command_line[len] = '\0';
+}
+
+const char *boot_command_line(void) {
+    return g_boot_command_line;
+}
+
+/* Copy the value of the last name=value word into val; false if absent */
+bool boot_param(const char *name, char *val, size_t len) {
+    size_t name_len = strlen(name);
+    const char *p = g_boot_command_line;
+    bool found = false;
+
+    while (*p) {
+        while (*p == ' ') p++;
+        const char *word = p;
+        while (*p && *p != ' ') p++;
+        if ((size_t)(p - word) > name_len && !strncmp(word, name, name_len) &&
+            word[name_len] == '=') {
+            size_t n = (size_t)(p - word) - name_len - 1;
+            if (n >= len) n = len - 1;
+            memcpy(val, word + name_len + 1, n);
+            val[n] = '\0';
+            found = true;
+        }
+    }
+    return found;
+}
+
+/* Parse a size with an optional K, M or G suffix, as in mem=512M */
+uint64_t memparse(const char *s, char **end) {
+    uint64_t val = 0;
+    while (*s >= '0' && *s <= '9')
+        val = val * 10 + (uint64_t)(*s++ - '0');
+
+    switch (*s) {
+    case 'G': case 'g':
+        val <<= 10;
+        /* fallthrough */
+    case 'M': case 'm':
+        val <<= 10;
+        /* fallthrough */
+    case 'K': case 'k':
+        val <<= 10;
+        s++;
+        break;
+    default:
+        break;
+    }
+    if (end) *end = (char *)s;
+    return val;
+}
@@ -0,0 +1,154 @@
+/**
+ * iomap - register access to memory-mapped devices
+ *
+ * Drivers read and write device registers only through ioread*() and
+ * iowrite*(), never by dereferencing a mapped BAR, so each access is
+ * exactly one load or store of the width the device expects.
+ *
+ * Hosted builds have nothing behind a BAR: pci_iomap() hands out zeroed
+ * host memory. A device model that needs to see its registers accessed
+ * (a select register that changes what the next read returns, a
+ * doorbell) claims the range with iomem_emulate(), and accesses inside
+ * it become calls into the model, as a hypervisor traps them. Accesses
+ * anywhere else stay plain memory.
+ */
+
+#include <kernel.h>
+
+#ifdef __unix__
+#define IOMEM_MAX_REGIONS   16
+
+typedef struct {
+    uintptr_t base;
+    size_t size;                    /* 0: free slot */
+    const iomem_ops_t *ops;
+    void *opaque;
+} iomem_region_t;
+
+static struct {
+    spinlock_t lock;                /* Serializes claims; lookups read without it */
+    unsigned int nr;                /* Slots ever used */
+    iomem_region_t regions[IOMEM_MAX_REGIONS];
+} g_iomem = { .lock = SPINLOCK_INIT };
+
+static const iomem_region_t *iomem_find(const volatile void *addr, size_t *off) {
+    uintptr_t a = (uintptr_t)addr;
+    unsigned int nr = __atomic_load_n(&g_iomem.nr, __ATOMIC_ACQUIRE);
+
+    for (unsigned int i = 0; i < nr; i++) {
+        const iomem_region_t *r = &g_iomem.regions[i];
+        size_t size = __atomic_load_n(&r->size, __ATOMIC_ACQUIRE);
+        if (a - r->base < size) {
+            *off = a - r->base;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Route [base, base + size) to ops; -EBUSY if it overlaps a claimed range */
+int iomem_emulate(volatile void *base, size_t size, const iomem_ops_t *ops, void *opaque) {
+    uintptr_t b = (uintptr_t)base;
+    iomem_region_t *slot = NULL;
+
+    if (!size || !ops || !ops->read || !ops->write) return -EINVAL;
+    spin_lock(&g_iomem.lock);
+    for (unsigned int i = 0; i < g_iomem.nr; i++) {
+        iomem_region_t *r = &g_iomem.regions[i];
+        if (!r->size) {
+            if (!slot) slot = r;
+        } else if (b < r->base + r->size && r->base < b + size) {
+            spin_unlock(&g_iomem.lock);
+            return -EBUSY;
+        }
+    }
+    if (!slot && g_iomem.nr < IOMEM_MAX_REGIONS) slot = &g_iomem.regions[g_iomem.nr];
+    if (!slot) {
+        spin_unlock(&g_iomem.lock);
+        return -ENOSPC;
+    }
+    slot->base = b;
+    slot->ops = ops;
+    slot->opaque = opaque;
+    __atomic_store_n(&slot->size, size, __ATOMIC_RELEASE);
+    if (slot == &g_iomem.regions[g_iomem.nr])
+        __atomic_store_n(&g_iomem.nr, g_iomem.nr + 1, __ATOMIC_RELEASE);
+    spin_unlock(&g_iomem.lock);
+    return 0;
+}
+
+/* Give the range claimed at base back to plain memory */
+void iomem_unemulate(volatile void *base) {
+    spin_lock(&g_iomem.lock);
+    for (unsigned int i = 0; i < g_iomem.nr; i++) {
+        iomem_region_t *r = &g_iomem.regions[i];
+        if (r->size && r->base == (uintptr_t)base)
+            __atomic_store_n(&r->size, 0, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&g_iomem.lock);
+}
+
+/* Hand an access inside a claimed range to its model; false for plain memory */
+static inline bool iomem_trap_read(const volatile void *addr, unsigned int size, uint32_t *val) {
+    size_t off;
+    const iomem_region_t *r = iomem_find(addr, &off);
+    if (!r) return false;
+    *val = r->ops->read(r->opaque, off, size);
+    return true;
+}
+
+static inline bool iomem_trap_write(volatile void *addr, unsigned int size, uint32_t val) {
+    size_t off;
+    const iomem_region_t *r = iomem_find(addr, &off);
+    if (!r) return false;
+    r->ops->write(r->opaque, off, val, size);
+    return true;
+}
+
+#define IOREAD(addr, type) ({                                               \
+    uint32_t __val;                                                         \
+    iomem_trap_read((addr), sizeof(type), &__val) ? (type)__val             \
+                                                  : *(const volatile type *)(addr); \
+})
+
+#define IOWRITE(val, addr, type) do {                                       \
+    if (!iomem_trap_write((addr), sizeof(type), (val)))                     \
+        *(volatile type *)(addr) = (val);                                   \
+} while (0)
+#else
+int iomem_emulate(volatile void *base, size_t size, const iomem_ops_t *ops, void *opaque) {
+    (void)base; (void)size; (void)ops; (void)opaque;
+    return -ENODEV;
+}
+
+void iomem_unemulate(volatile void *base) {
+    (void)base;
+}
+
+#define IOREAD(addr, type)          (*(const volatile type *)(addr))
+#define IOWRITE(val, addr, type)    (*(volatile type *)(addr) = (val))
+#endif
+
+uint8_t ioread8(const volatile void *addr) {
+    return IOREAD(addr, uint8_t);
+}
+
+uint16_t ioread16(const volatile void *addr) {
+    return IOREAD(addr, uint16_t);
+}
+
+uint32_t ioread32(const volatile void *addr) {
+    return IOREAD(addr, uint32_t);
+}
+
+void iowrite8(uint8_t val, volatile void *addr) {
+    IOWRITE(val, addr, uint8_t);
+}
+
+void iowrite16(uint16_t val, volatile void *addr) {
+    IOWRITE(val, addr, uint16_t);
+}
+
+void iowrite32(uint32_t val, volatile void *addr) {
+    IOWRITE(val, addr, uint32_t);
+}
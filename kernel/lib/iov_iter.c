@@ -0,0 +1,56 @@
+/**
+ * iov_iter - cursor over a scatter/gather segment array
+ *
+ * Producers copy straight between page cache pages and the caller's
+ * segments, advancing the cursor as they go, so vectored and plain I/O
+ * share one copy loop and nothing is staged in a bounce buffer.
+ */
+
+#include <kernel.h>
+#include <string.h>
+
+void iov_iter_init(iov_iter_t *i, const iovec_t *iov, unsigned long nr_segs, size_t count) {
+    i->iov = iov;
+    i->nr_segs = nr_segs;
+    i->iov_offset = 0;
+    i->count = count;
+}
+
+/* Copy up to bytes between buf and the segments; a NULL buf zero-fills them */
+static size_t iterate(iov_iter_t *i, size_t bytes, char *buf, bool to_iter) {
+    size_t done = 0;
+
+    if (bytes > i->count) bytes = i->count;
+    while (done < bytes && i->nr_segs) {
+        size_t avail = i->iov->iov_len - i->iov_offset;
+        size_t n = bytes - done < avail ? bytes - done : avail;
+        char *seg = (char *)i->iov->iov_base + i->iov_offset;
+
+        if (n) {
+            if (!buf) memset(seg, 0, n);
+            else if (to_iter) memcpy(seg, buf + done, n);
+            else memcpy(buf + done, seg, n);
+        }
+        done += n;
+        i->iov_offset += n;
+        if (i->iov_offset == i->iov->iov_len) {
+            i->iov++;
+            i->nr_segs--;
+            i->iov_offset = 0;
+        }
+    }
+    i->count -= done;
+    return done;
+}
+
+size_t copy_to_iter(const void *src, size_t bytes, iov_iter_t *i) {
+    return iterate(i, bytes, (char *)src, true);
+}
+
+size_t copy_from_iter(void *dst, size_t bytes, iov_iter_t *i) {
+    return iterate(i, bytes, dst, false);
+}
+
+size_t iov_iter_zero(size_t bytes, iov_iter_t *i) {
+    return iterate(i, bytes, NULL, true);
+}
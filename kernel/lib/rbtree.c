@@ -0,0 +1,215 @@
+/**
+ * Red-black trees
+ *
+ * Intrusive: callers embed an rb_node_t, walk down to the insertion
+ * point themselves, rb_link_node() there and then rb_insert_color() to
+ * rebalance. Every path from the root to a leaf has the same number of
+ * black nodes and no red node has a red child, so the height stays
+ * within 2 log2(n + 1).
+ */
+
+#include <kernel.h>
+
+static inline bool rb_is_black(const rb_node_t *node) {
+    return !node || node->rb_color == RB_BLACK;
+}
+
+/* Point old's parent (or the root) at new */
+static void rb_change_child(rb_node_t *old, rb_node_t *new, rb_node_t *parent, rb_root_t *root) {
+    if (!parent)
+        root->rb_node = new;
+    else if (parent->rb_left == old)
+        parent->rb_left = new;
+    else
+        parent->rb_right = new;
+}
+
+static void rb_rotate_left(rb_node_t *x, rb_root_t *root) {
+    rb_node_t *y = x->rb_right;
+
+    x->rb_right = y->rb_left;
+    if (y->rb_left) y->rb_left->rb_parent = x;
+    rb_change_child(x, y, x->rb_parent, root);
+    y->rb_parent = x->rb_parent;
+    y->rb_left = x;
+    x->rb_parent = y;
+}
+
+static void rb_rotate_right(rb_node_t *x, rb_root_t *root) {
+    rb_node_t *y = x->rb_left;
+
+    x->rb_left = y->rb_right;
+    if (y->rb_right) y->rb_right->rb_parent = x;
+    rb_change_child(x, y, x->rb_parent, root);
+    y->rb_parent = x->rb_parent;
+    y->rb_right = x;
+    x->rb_parent = y;
+}
+
+void rb_insert_color(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *parent;
+
+    node->rb_color = RB_RED;
+    while ((parent = node->rb_parent) && parent->rb_color == RB_RED) {
+        rb_node_t *gparent = parent->rb_parent;   /* A red node is never the root */
+
+        if (parent == gparent->rb_left) {
+            rb_node_t *uncle = gparent->rb_right;
+            if (!rb_is_black(uncle)) {
+                parent->rb_color = uncle->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_right) {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            rb_rotate_right(gparent, root);
+        } else {
+            rb_node_t *uncle = gparent->rb_left;
+            if (!rb_is_black(uncle)) {
+                parent->rb_color = uncle->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_left) {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->rb_node->rb_color = RB_BLACK;
+}
+
+/* node (possibly NULL) under parent is one black short; restore the balance */
+static void rb_erase_color(rb_node_t *node, rb_node_t *parent, rb_root_t *root) {
+    while (node != root->rb_node && rb_is_black(node)) {
+        if (node == parent->rb_left) {
+            rb_node_t *sibling = parent->rb_right;
+            if (sibling->rb_color == RB_RED) {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                rb_rotate_left(parent, root);
+                sibling = parent->rb_right;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_right)) {
+                sibling->rb_left->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                rb_rotate_right(sibling, root);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_right->rb_color = RB_BLACK;
+            rb_rotate_left(parent, root);
+        } else {
+            rb_node_t *sibling = parent->rb_left;
+            if (sibling->rb_color == RB_RED) {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                rb_rotate_right(parent, root);
+                sibling = parent->rb_left;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_left)) {
+                sibling->rb_right->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                rb_rotate_left(sibling, root);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_left->rb_color = RB_BLACK;
+            rb_rotate_right(parent, root);
+        }
+        node = root->rb_node;
+    }
+    if (node) node->rb_color = RB_BLACK;
+}
+
+void rb_erase(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *child, *parent;
+    int color = node->rb_color;
+
+    if (!node->rb_left || !node->rb_right) {
+        child = node->rb_left ? node->rb_left : node->rb_right;
+        parent = node->rb_parent;
+        rb_change_child(node, child, parent, root);
+        if (child) child->rb_parent = parent;
+    } else {
+        /* Two children: the in-order successor takes node's place */
+        rb_node_t *succ = node->rb_right;
+        while (succ->rb_left)
+            succ = succ->rb_left;
+
+        color = succ->rb_color;
+        child = succ->rb_right;
+        if (succ->rb_parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->rb_parent;
+            parent->rb_left = child;
+            if (child) child->rb_parent = parent;
+            succ->rb_right = node->rb_right;
+            succ->rb_right->rb_parent = succ;
+        }
+        rb_change_child(node, succ, node->rb_parent, root);
+        succ->rb_parent = node->rb_parent;
+        succ->rb_left = node->rb_left;
+        succ->rb_left->rb_parent = succ;
+        succ->rb_color = node->rb_color;
+    }
+    if (color == RB_BLACK)
+        rb_erase_color(child, parent, root);
+}
+
+rb_node_t *rb_first(const rb_root_t *root) {
+    rb_node_t *node = root->rb_node;
+    if (!node) return NULL;
+    while (node->rb_left)
+        node = node->rb_left;
+    return node;
+}
+
+rb_node_t *rb_next(const rb_node_t *node) {
+    if (node->rb_right) {
+        node = node->rb_right;
+        while (node->rb_left)
+            node = node->rb_left;
+        return (rb_node_t *)node;
+    }
+    rb_node_t *parent;
+    while ((parent = node->rb_parent) && node == parent->rb_right)
+        node = parent;
+    return parent;
+}
+
+void rb_insert_color_cached(rb_node_t *node, rb_root_cached_t *root, bool leftmost) {
+    if (leftmost) root->rb_leftmost = node;
+    rb_insert_color(node, &root->rb_root);
+}
+
+void rb_erase_cached(rb_node_t *node, rb_root_cached_t *root) {
+    if (root->rb_leftmost == node) root->rb_leftmost = rb_next(node);
+    rb_erase(node, &root->rb_root);
+}
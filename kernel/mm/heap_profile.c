@@ -0,0 +1,248 @@
+/**
+ * Sampling heap profiler
+ *
+ * kmalloc() hands the profiler one allocation per sampling interval.
+ * Intervals are drawn from an exponential distribution with mean
+ * heap_profile_rate() bytes, so every allocated byte is equally likely
+ * to be picked and an object of size s is sampled with probability
+ * 1 - e^(-s/rate). That is the model pprof's heap_v2 format assumes when
+ * it scales samples back up, so counts here stay unscaled.
+ *
+ * Samples with the same allocating stack share a bucket counting the
+ * objects and bytes allocated and still in use. Live samples are kept
+ * in a hash by address until kfree(); slabs count their sampled
+ * objects, so frees of everything else never get here.
+ *
+ * Stacks are captured by walking frame pointers (kernel-core is built
+ * with -fno-omit-frame-pointer), which costs tens of nanoseconds where
+ * an unwinder would cost microseconds. Hosted builds may reach host
+ * frames without them, so there the walk stays inside the thread's
+ * stack and a bogus frame ends it at worst.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE     /* pthread_getattr_np */
+#endif
+#include <kernel.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef CONFIG_ALLOC_PROFILING
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#define HEAP_STACK_BITS     10
+#define HEAP_STACK_SLOTS    (1U << HEAP_STACK_BITS)
+#define HEAP_OBJ_BITS       12
+#define HEAP_OBJ_BUCKETS    (1U << HEAP_OBJ_BITS)
+#define HEAP_MAX_FRAME_GAP  (1UL << 20)     /* Frame pointers further apart end the walk */
+
+typedef struct heap_sample {
+    const void *ptr;
+    size_t size;
+    heap_profile_stack_t *bucket;
+    struct heap_sample *next;
+} heap_sample_t;
+
+static struct {
+    spinlock_t lock;
+    size_t rate;
+    heap_profile_stack_t stacks[HEAP_STACK_SLOTS];  /* Open addressing by stack hash */
+    heap_sample_t *live[HEAP_OBJ_BUCKETS];
+    uint64_t dropped;                               /* Samples with no room for their stack */
+} g_heap_profile = { .lock = SPINLOCK_INIT, .rate = HEAP_PROFILE_DEFAULT_RATE };
+
+static _Thread_local uint64_t t_prng;
+
+static uint64_t prng_next(void) {
+    uint64_t x = t_prng;
+    if (!x) x = ((uintptr_t)&t_prng ^ ktime_get_ns()) | 1;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    t_prng = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Bytes until the next sample: rate * -ln(u) for u uniform in (0, 1],
+ * in 16.16 fixed point so the allocator never touches the FPU. log2 of
+ * the mantissa uses t + 0.3466 t (1 - t), good to about 1%. With
+ * sampling off, threads still come back every default interval so they
+ * notice when it is turned on.
+ */
+int64_t heap_profile_next_sample(void) {
+    uint64_t rate = __atomic_load_n(&g_heap_profile.rate, __ATOMIC_RELAXED);
+    if (!rate) return HEAP_PROFILE_DEFAULT_RATE;
+
+    uint64_t q = (prng_next() >> 38) + 1;               /* u = q / 2^26 */
+    unsigned int e = 63 - (unsigned int)__builtin_clzll(q);
+    uint64_t t = ((q << 16) >> e) - 65536;              /* Mantissa - 1 */
+    uint64_t log2q = ((uint64_t)e << 16) + t + (((t * (65536 - t)) >> 16) * 22713 >> 16);
+    uint64_t neg_log2u = (26ULL << 16) - log2q;
+    return (int64_t)((((rate * neg_log2u) >> 16) * 45426) >> 16) + 1;   /* * ln 2 */
+}
+
+#ifdef __linux__
+static _Thread_local uintptr_t t_stack_lo, t_stack_hi;
+
+/* This thread's stack, looked up once; empty if the host will not say */
+static void stack_bounds(uintptr_t *lo, uintptr_t *hi) {
+    if (!t_stack_hi) {
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        t_stack_lo = t_stack_hi = 1;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                t_stack_lo = (uintptr_t)addr;
+                t_stack_hi = (uintptr_t)addr + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+    *lo = t_stack_lo;
+    *hi = t_stack_hi;
+}
+#else
+static void stack_bounds(uintptr_t *lo, uintptr_t *hi) {
+    *lo = 1;
+    *hi = UINTPTR_MAX;
+}
+#endif
+
+static unsigned int capture_stack(const void **stack, const void *caller) {
+    void *frames[HEAP_PROFILE_MAX_DEPTH + 8];
+    int n = 0;
+    uintptr_t lo, hi;
+
+    stack_bounds(&lo, &hi);
+    void **fp = __builtin_frame_address(0);
+    while (n < (int)(sizeof(frames) / sizeof(frames[0])) && (uintptr_t)fp >= lo &&
+           (uintptr_t)fp <= hi - 2 * sizeof(void *) && fp[1]) {
+        frames[n++] = fp[1];
+        void **next = *fp;
+        if (next <= fp || (uintptr_t)next - (uintptr_t)fp > HEAP_MAX_FRAME_GAP) break;
+        fp = next;
+    }
+
+    /* Drop the allocator's own frames: the stack starts at the kmalloc() caller */
+    int first = 0;
+    while (first < n && frames[first] != caller)
+        first++;
+    if (first == n) {
+        /* The walk lost the chain before reaching it */
+        stack[0] = caller;
+        return 1;
+    }
+    unsigned int depth = 0;
+    for (int i = first; i < n && depth < HEAP_PROFILE_MAX_DEPTH; i++)
+        stack[depth++] = frames[i];
+    return depth;
+}
+
+/* Caller holds the lock; NULL once every slot holds another stack */
+static heap_profile_stack_t *stack_bucket(const void *const *stack, unsigned int depth) {
+    uint64_t h = depth;
+    for (unsigned int i = 0; i < depth; i++)
+        h = (h ^ (uintptr_t)stack[i]) * 0x100000001B3ULL;
+    h ^= h >> 29;
+
+    for (unsigned int i = 0; i < HEAP_STACK_SLOTS; i++) {
+        heap_profile_stack_t *b = &g_heap_profile.stacks[(h + i) & (HEAP_STACK_SLOTS - 1)];
+        if (!b->depth) {
+            b->depth = depth;
+            memcpy(b->stack, stack, depth * sizeof(stack[0]));
+            return b;
+        }
+        if (b->depth == depth && !memcmp(b->stack, stack, depth * sizeof(stack[0])))
+            return b;
+    }
+    return NULL;
+}
+
+static inline uint32_t obj_hash(const void *ptr) {
+    return (uint32_t)(((uintptr_t)ptr * 0x9E3779B97F4A7C15ULL) >> (64 - HEAP_OBJ_BITS));
+}
+
+/* Record ptr, just allocated by caller; true if it is now tracked until freed */
+bool heap_profile_sample(const void *ptr, size_t size, const void *caller) {
+    if (!heap_profile_rate()) return false;
+
+    const void *stack[HEAP_PROFILE_MAX_DEPTH];
+    unsigned int depth = capture_stack(stack, caller);
+
+    /* Host memory: the profiler must not recurse into kmalloc() */
+    heap_sample_t *s = malloc(sizeof(*s));
+    if (!s) return false;
+
+    spin_lock(&g_heap_profile.lock);
+    heap_profile_stack_t *b = stack_bucket(stack, depth);
+    if (!b) {
+        g_heap_profile.dropped++;
+        spin_unlock(&g_heap_profile.lock);
+        free(s);
+        return false;
+    }
+    b->alloc_objs++;
+    b->alloc_bytes += size;
+    b->inuse_objs++;
+    b->inuse_bytes += size;
+
+    heap_sample_t **head = &g_heap_profile.live[obj_hash(ptr)];
+    *s = (heap_sample_t){ .ptr = ptr, .size = size, .bucket = b, .next = *head };
+    *head = s;
+    spin_unlock(&g_heap_profile.lock);
+    return true;
+}
+
+/* ptr is being freed from a slab with sampled objects; true if it was one */
+bool heap_profile_free(const void *ptr) {
+    spin_lock(&g_heap_profile.lock);
+    heap_sample_t **link = &g_heap_profile.live[obj_hash(ptr)];
+    while (*link && (*link)->ptr != ptr)
+        link = &(*link)->next;
+
+    heap_sample_t *s = *link;
+    if (s) {
+        *link = s->next;
+        s->bucket->inuse_objs--;
+        s->bucket->inuse_bytes -= s->size;
+    }
+    spin_unlock(&g_heap_profile.lock);
+
+    free(s);
+    return s != NULL;
+}
+
+/* Mean bytes between samples; 0 stops sampling. Threads switch at their next sample. */
+void heap_profile_set_rate(size_t bytes) {
+    __atomic_store_n(&g_heap_profile.rate, bytes, __ATOMIC_RELAXED);
+}
+
+size_t heap_profile_rate(void) {
+    return __atomic_load_n(&g_heap_profile.rate, __ATOMIC_RELAXED);
+}
+
+/* The first stack bucket at or after *pos, which is advanced to it; -ENOENT past the last */
+int heap_profile_stack(unsigned int *pos, heap_profile_stack_t *st) {
+    spin_lock(&g_heap_profile.lock);
+    for (unsigned int i = *pos; i < HEAP_STACK_SLOTS; i++) {
+        if (g_heap_profile.stacks[i].depth) {
+            *st = g_heap_profile.stacks[i];
+            spin_unlock(&g_heap_profile.lock);
+            *pos = i;
+            return 0;
+        }
+    }
+    spin_unlock(&g_heap_profile.lock);
+    return -ENOENT;
+}
+
+uint64_t heap_profile_dropped(void) {
+    return __atomic_load_n(&g_heap_profile.dropped, __ATOMIC_RELAXED);
+}
+
+#endif /* CONFIG_ALLOC_PROFILING */
@@ -1,14 +1,472 @@
 /**
- * Page management
+ * Page cache
+ *
+ * File data lives in order-0 pages from the buddy allocator, indexed by
+ * (address_space, page index) in one global hash. Each cached page also
+ * sits on its mapping's page list so truncation does not scan the hash.
+ * The cache holds one reference per page; lookups take another.
+ *
+ * Memory-only filesystems (tmpfs) set AS_SHMEM: their pages are the only
+ * copy of the data, and a_ops->reserve charges them against the
+ * filesystem's size limit before they are allocated.
+ *
+ * Cached pages also sit on one of four LRU lists, as in Linux: shmem
+ * pages on the anon lists, the rest on the file lists. New pages start
+ * inactive and referenced; the next lookup activates them. Reclaim
+ * takes clean, unused pages off the inactive file tail and refills
+ * that list from the active one while it is the smaller, so pages used
+ * once are dropped before a working set that repeats. Anon pages only
+ * age: without swap they cannot be reclaimed. Each NUMA node has its
+ * own set of lists, so reclaim for one node frees that node's pages.
  */
 
 #include <kernel.h>
+#include <string.h>
 
-struct page *page_alloc(unsigned int order) {
-    /* TODO */
-    return NULL;
+#define PAGECACHE_HASH_BITS 14
+#define PAGECACHE_HASH_SIZE (1U << PAGECACHE_HASH_BITS)
+
+typedef struct {
+    page_t *head, *tail;            /* Most recently added at head */
+    unsigned long nr;
+} lru_vec_t;
+
+typedef struct {
+    page_t *hash[PAGECACHE_HASH_SIZE];
+    spinlock_t lock;                /* Hash, mapping lists and LRU lists */
+    unsigned long nr_pages;
+    unsigned long nr_shmem;
+    lru_vec_t lru[MAX_NUMNODES][NR_LRU_LISTS];
+} page_cache_t;
+
+static page_cache_t g_page_cache;
+
+static inline uint32_t page_hash(const address_space_t *mapping, uint64_t index) {
+    uint64_t key = (uint64_t)(uintptr_t)mapping ^ (index * 0x9E3779B97F4A7C15ULL);
+    key ^= key >> 29;
+    key *= 0xBF58476D1CE4E5B9ULL;
+    return (uint32_t)(key >> (64 - PAGECACHE_HASH_BITS));
+}
+
+void get_page(page_t *page) {
+    __atomic_add_fetch(&page->count, 1, __ATOMIC_RELAXED);
+}
+
+void put_page(page_t *page) {
+    if (__atomic_sub_fetch(&page->count, 1, __ATOMIC_ACQ_REL) == 0)
+        page_free(page);
+}
+
+/* ============================================================================
+ * LRU lists (caller holds g_page_cache.lock)
+ *
+ * Writers set PG_dirty without the lock, so flags change atomically.
+ * ============================================================================ */
+
+static inline void page_set_flags(page_t *page, uint32_t bits) {
+    __atomic_fetch_or(&page->flags, bits, __ATOMIC_RELAXED);
+}
+
+static inline void page_clear_flags(page_t *page, uint32_t bits) {
+    __atomic_fetch_and(&page->flags, ~bits, __ATOMIC_RELAXED);
+}
+
+static inline enum lru_list page_lru(const page_t *page) {
+    uint32_t flags = __atomic_load_n(&page->flags, __ATOMIC_RELAXED);
+    enum lru_list lru = (flags & PG_swapbacked) ? LRU_INACTIVE_ANON : LRU_INACTIVE_FILE;
+    return (flags & PG_active) ? lru + 1 : lru;
+}
+
+static void lru_add(page_t *page, enum lru_list lru) {
+    lru_vec_t *vec = &g_page_cache.lru[page_to_nid(page)][lru];
+    page->lru_prev = NULL;
+    page->lru_next = vec->head;
+    if (vec->head) vec->head->lru_prev = page;
+    else vec->tail = page;
+    vec->head = page;
+    vec->nr++;
+}
+
+static void lru_del(page_t *page, enum lru_list lru) {
+    lru_vec_t *vec = &g_page_cache.lru[page_to_nid(page)][lru];
+    if (page->lru_prev) page->lru_prev->lru_next = page->lru_next;
+    else vec->head = page->lru_next;
+    if (page->lru_next) page->lru_next->lru_prev = page->lru_prev;
+    else vec->tail = page->lru_prev;
+    page->lru_next = page->lru_prev = NULL;
+    vec->nr--;
+}
+
+/* Move page to the head of lru, which it may already be on */
+static void lru_move(page_t *page, enum lru_list lru) {
+    lru_del(page, page_lru(page));
+    if (lru == LRU_ACTIVE_ANON || lru == LRU_ACTIVE_FILE) page_set_flags(page, PG_active);
+    else page_clear_flags(page, PG_active);
+    lru_add(page, lru);
+}
+
+/* A second use while inactive and referenced promotes the page */
+static void __mark_page_accessed(page_t *page) {
+    uint32_t flags = __atomic_load_n(&page->flags, __ATOMIC_RELAXED);
+
+    if ((flags & (PG_lru | PG_active | PG_referenced)) == (PG_lru | PG_referenced)) {
+        page_clear_flags(page, PG_referenced);
+        lru_move(page, page_lru(page) + 1);
+        count_vm_events(PGACTIVATE, 1);
+    } else if (!(flags & PG_referenced)) {
+        page_set_flags(page, PG_referenced);
+    }
+}
+
+/* Caller holds g_page_cache.lock */
+static page_t *__find_page(address_space_t *mapping, uint64_t index) {
+    page_t *page = g_page_cache.hash[page_hash(mapping, index)];
+    while (page && !(page->mapping == mapping && page->index == index))
+        page = page->hash_next;
+    return page;
+}
+
+static void __add_page(address_space_t *mapping, page_t *page, uint64_t index) {
+    page_t **bucket = &g_page_cache.hash[page_hash(mapping, index)];
+
+    page->mapping = mapping;
+    page->index = index;
+    page->hash_next = *bucket;
+    *bucket = page;
+
+    page->prev = NULL;
+    page->next = mapping->pages;
+    if (page->next) page->next->prev = page;
+    mapping->pages = page;
+
+    mapping->nrpages++;
+    g_page_cache.nr_pages++;
+    if (mapping->flags & AS_SHMEM) {
+        g_page_cache.nr_shmem++;
+        page_set_flags(page, PG_swapbacked);
+    }
+    page_set_flags(page, PG_lru);
+    lru_add(page, page_lru(page));
+}
+
+static void __remove_page(address_space_t *mapping, page_t *page) {
+    page_t **link = &g_page_cache.hash[page_hash(mapping, page->index)];
+    while (*link != page) link = &(*link)->hash_next;
+    *link = page->hash_next;
+    page->hash_next = NULL;
+
+    if (page->prev) page->prev->next = page->next;
+    else mapping->pages = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->next = page->prev = NULL;
+
+    lru_del(page, page_lru(page));
+    page_clear_flags(page, PG_lru | PG_active | PG_referenced);
+
+    mapping->nrpages--;
+    g_page_cache.nr_pages--;
+    if (mapping->flags & AS_SHMEM) g_page_cache.nr_shmem--;
+}
+
+/* Find a cached page and take a reference to it */
+page_t *find_get_page(address_space_t *mapping, uint64_t index) {
+    spin_lock(&g_page_cache.lock);
+    page_t *page = __find_page(mapping, index);
+    if (page) {
+        get_page(page);
+        __mark_page_accessed(page);
+    }
+    spin_unlock(&g_page_cache.lock);
+    return page;
+}
+
+/*
+ * Find or instantiate the page at index. New pages are charged through
+ * a_ops->reserve, then filled by a_ops->readpage or zeroed. Returns a
+ * referenced page, or NULL with *err set.
+ */
+page_t *find_or_create_page(address_space_t *mapping, uint64_t index, int *err) {
+    const address_space_operations_t *a_ops = mapping->a_ops;
+    page_t *page = find_get_page(mapping, index);
+    if (page) return page;
+
+    if (a_ops && a_ops->reserve) {
+        int ret = a_ops->reserve(mapping, 1);
+        if (ret < 0) {
+            if (err) *err = ret;
+            return NULL;
+        }
+    }
+
+    page_t *new_page = page_alloc(0);
+    if (!new_page) {
+        if (a_ops && a_ops->reserve) a_ops->reserve(mapping, -1);
+        if (err) *err = -ENOMEM;
+        return NULL;
+    }
+
+    void *data = page_to_virt(new_page);
+    if (a_ops && a_ops->readpage) {
+        new_page->index = index;
+        int ret = a_ops->readpage(mapping, new_page);
+        if (ret < 0) {
+            page_free(new_page);
+            if (a_ops->reserve) a_ops->reserve(mapping, -1);
+            if (err) *err = ret;
+            return NULL;
+        }
+    } else {
+        memset(data, 0, PAGE_SIZE);
+    }
+    new_page->flags |= PG_uptodate;
+
+    spin_lock(&g_page_cache.lock);
+    page = __find_page(mapping, index);
+    if (page) {
+        /* Lost a race with another instantiation */
+        get_page(page);
+        spin_unlock(&g_page_cache.lock);
+        page_free(new_page);
+        if (a_ops && a_ops->reserve) a_ops->reserve(mapping, -1);
+        return page;
+    }
+    __add_page(mapping, new_page, index);
+    __mark_page_accessed(new_page);
+    get_page(new_page);     /* Caller's reference; the cache keeps the first */
+    spin_unlock(&g_page_cache.lock);
+    return new_page;
 }
 
-void page_free(struct page *page) {
-    /* TODO */
+/* Drop every cached page at or beyond page index start */
+void truncate_inode_pages(address_space_t *mapping, uint64_t start) {
+    page_t *victims = NULL;
+    long nr = 0;
+
+    spin_lock(&g_page_cache.lock);
+    page_t *page = mapping->pages;
+    while (page) {
+        page_t *next = page->next;
+        if (page->index >= start) {
+            __remove_page(mapping, page);
+            page->next = victims;
+            victims = page;
+            nr++;
+        }
+        page = next;
+    }
+    spin_unlock(&g_page_cache.lock);
+
+    while (victims) {
+        page = victims;
+        victims = page->next;
+        page->next = NULL;
+        page->mapping = NULL;
+        put_page(page);
+    }
+    if (nr && mapping->a_ops && mapping->a_ops->reserve)
+        mapping->a_ops->reserve(mapping, -nr);
+}
+
+unsigned long nr_pagecache_pages(void) {
+    return g_page_cache.nr_pages;
+}
+
+unsigned long nr_shmem_pages(void) {
+    return g_page_cache.nr_shmem;
+}
+
+unsigned long nr_lru_pages(enum lru_list lru) {
+    unsigned long nr = 0;
+    if (lru >= NR_LRU_LISTS) return 0;
+    for (int nid = 0; nid < MAX_NUMNODES; nid++)
+        nr += __atomic_load_n(&g_page_cache.lru[nid][lru].nr, __ATOMIC_RELAXED);
+    return nr;
+}
+
+/* Refill the inactive file list from the active tail; caller holds the lock */
+static void shrink_active_list(int nid, unsigned long nr_to_scan) {
+    lru_vec_t *active = &g_page_cache.lru[nid][LRU_ACTIVE_FILE];
+    unsigned long moved = 0;
+
+    while (moved < nr_to_scan && active->tail) {
+        lru_move(active->tail, LRU_INACTIVE_FILE);
+        moved++;
+    }
+    count_vm_events(PGDEACTIVATE, moved);
+}
+
+/**
+ * Reclaim up to nr_to_reclaim clean, unused file pages from the tail of
+ * node nid's inactive list. One call scans at most list >> priority pages (at
+ * least SWAP_CLUSTER_MAX) and drops the lock between batches, so no
+ * caller waits long for it. Returns the pages freed; *nr_scanned says
+ * how many were looked at.
+ */
+unsigned long shrink_page_cache(int nid, unsigned long nr_to_reclaim, int priority,
+                                unsigned long *nr_scanned) {
+    if (nid < 0 || nid >= MAX_NUMNODES) {
+        *nr_scanned = 0;
+        return 0;
+    }
+    lru_vec_t *inactive = &g_page_cache.lru[nid][LRU_INACTIVE_FILE];
+    lru_vec_t *active = &g_page_cache.lru[nid][LRU_ACTIVE_FILE];
+    unsigned long reclaimed = 0, scanned = 0, rotated = 0;
+
+    spin_lock(&g_page_cache.lock);
+    unsigned long nr_to_scan = (inactive->nr + active->nr) >> priority;
+    spin_unlock(&g_page_cache.lock);
+    if (nr_to_scan < SWAP_CLUSTER_MAX) nr_to_scan = SWAP_CLUSTER_MAX;
+
+    while (scanned < nr_to_scan && reclaimed < nr_to_reclaim) {
+        page_t *victims = NULL;
+        unsigned long batch = 0;
+
+        spin_lock(&g_page_cache.lock);
+        if (inactive->nr < active->nr)
+            shrink_active_list(nid, SWAP_CLUSTER_MAX);
+        while (batch < SWAP_CLUSTER_MAX && inactive->tail) {
+            page_t *page = inactive->tail;
+            batch++;
+            /* Someone holds a reference, or the data exists nowhere else yet */
+            if (__atomic_load_n(&page->count, __ATOMIC_RELAXED) > 1 ||
+                (__atomic_load_n(&page->flags, __ATOMIC_RELAXED) & PG_dirty)) {
+                lru_move(page, LRU_INACTIVE_FILE);
+                rotated++;
+                continue;
+            }
+            __remove_page(page->mapping, page);
+            page->next = victims;
+            victims = page;
+        }
+        spin_unlock(&g_page_cache.lock);
+        if (!batch) break;
+        scanned += batch;
+
+        while (victims) {
+            page_t *page = victims;
+            victims = page->next;
+            page->next = NULL;
+            page->mapping = NULL;
+            put_page(page);
+            reclaimed++;
+        }
+    }
+
+    count_vm_events(PGROTATED, rotated);
+    *nr_scanned = scanned;
+    return reclaimed;
+}
+
+/*
+ * Read through the page cache straight into the caller's segments; holes
+ * in memory-only mappings read as zero. With IOCB_NOWAIT a page that
+ * would have to be read in ends the transfer: short, or -EAGAIN if
+ * nothing was copied.
+ */
+int64_t generic_file_read_iter(kiocb_t *iocb, iov_iter_t *iter) {
+    inode_t *inode = iocb->ki_filp->inode;
+    address_space_t *mapping = &inode->i_data;
+    uint64_t off = iocb->ki_pos;
+    size_t count = iter->count;
+    size_t done = 0;
+
+    if (off >= inode->size) return 0;
+    if (count > inode->size - off) count = (size_t)(inode->size - off);
+
+    while (done < count) {
+        uint64_t index = off >> PAGE_SHIFT;
+        size_t in_page = (size_t)(off & (PAGE_SIZE - 1));
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > count - done) chunk = count - done;
+
+        page_t *page = find_get_page(mapping, index);
+        if (!page && mapping->a_ops && mapping->a_ops->readpage) {
+            int err = -EAGAIN;
+            if (!(iocb->ki_flags & IOCB_NOWAIT))
+                page = find_or_create_page(mapping, index, &err);
+            if (!page) {
+                if (done) break;
+                return err;
+            }
+        }
+
+        if (page) {
+            copy_to_iter((char *)page_to_virt(page) + in_page, chunk, iter);
+            put_page(page);
+        } else {
+            iov_iter_zero(chunk, iter);
+        }
+
+        done += chunk;
+        off += chunk;
+    }
+
+    iocb->ki_pos = off;
+    return (int64_t)done;
+}
+
+/*
+ * Copy from the caller's segments into cached pages, instantiating them
+ * as needed, and extend i_size. Under IOCB_NOWAIT a missing page that
+ * would first have to be read in ends the write early.
+ */
+int64_t generic_file_write_iter(kiocb_t *iocb, iov_iter_t *iter) {
+    inode_t *inode = iocb->ki_filp->inode;
+    address_space_t *mapping = &inode->i_data;
+    uint64_t off = iocb->ki_pos;
+    size_t count = iter->count;
+    size_t done = 0;
+    int err = 0;
+
+    while (done < count) {
+        uint64_t index = off >> PAGE_SHIFT;
+        size_t in_page = (size_t)(off & (PAGE_SIZE - 1));
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > count - done) chunk = count - done;
+
+        page_t *page;
+        if ((iocb->ki_flags & IOCB_NOWAIT) && mapping->a_ops && mapping->a_ops->readpage) {
+            page = find_get_page(mapping, index);
+            err = -EAGAIN;
+        } else {
+            page = find_or_create_page(mapping, index, &err);
+        }
+        if (!page) break;
+
+        copy_from_iter((char *)page_to_virt(page) + in_page, chunk, iter);
+        page_set_flags(page, PG_dirty);
+        put_page(page);
+
+        done += chunk;
+        off += chunk;
+    }
+
+    if (done == 0 && count) return err;
+
+    if (done) inode_inc_iversion(inode);
+    if (off > inode->size) inode->size = off;
+    iocb->ki_pos = off;
+    return (int64_t)done;
+}
+
+int64_t generic_file_read(file_t *file, void *buf, size_t count, uint64_t *pos) {
+    iovec_t iov = { .iov_base = buf, .iov_len = count };
+    kiocb_t iocb = { .ki_filp = file, .ki_pos = *pos };
+    iov_iter_t iter;
+
+    iov_iter_init(&iter, &iov, 1, count);
+    int64_t ret = generic_file_read_iter(&iocb, &iter);
+    if (ret > 0) *pos = iocb.ki_pos;
+    return ret;
+}
+
+int64_t generic_file_write(file_t *file, const void *buf, size_t count, uint64_t *pos) {
+    iovec_t iov = { .iov_base = (void *)buf, .iov_len = count };
+    kiocb_t iocb = { .ki_filp = file, .ki_pos = *pos };
+    iov_iter_t iter;
+
+    iov_iter_init(&iter, &iov, 1, count);
+    int64_t ret = generic_file_write_iter(&iocb, &iter);
+    if (ret > 0) *pos = iocb.ki_pos;
+    return ret;
 }
@@ -1,7 +1,547 @@
 /**
  * Virtual memory areas
+ *
+ * An mm is a set of non-overlapping VMAs, kept in an rbtree by address,
+ * and a page table that starts out empty. Nothing is mapped until it is
+ * touched: handle_mm_fault() finds the VMA, checks the access against
+ * its flags and fills in one entry.
+ *
+ * The page table is a four-level radix tree of 512-entry tables, like
+ * the hardware's. A leaf entry holds the page_t of the mapped page with
+ * PTE_PRESENT and PTE_WRITE in its low bits; the mapping holds a
+ * reference on the page. File pages are mapped straight out of the page
+ * cache, read-only unless the VMA is shared, so the first write to a
+ * private file mapping copies the page (copy-on-write). An anonymous
+ * page nobody else holds is simply made writable.
+ *
+ * A fault that has to read the file drops mm->lock for the read, then
+ * checks that the VMA and entry are still as it left them.
  */
 
 #include <kernel.h>
+#include <string.h>
 
-/* Stubs */
+#define PTRS_PER_TABLE  512
+#define PT_LEVELS       4
+
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_WRITE       (1ULL << 1)
+#define PTE_FLAGS       (PTE_PRESENT | PTE_WRITE)
+
+#define PAGE_ALIGN(x)   (((x) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1))
+
+static inline unsigned int pt_index(uint64_t addr, int level) {
+    return (unsigned int)(addr >> (PAGE_SHIFT + 9 * level)) & (PTRS_PER_TABLE - 1);
+}
+
+static inline page_t *pte_page(uint64_t pte) {
+    return (page_t *)(uintptr_t)(pte & ~PTE_FLAGS);
+}
+
+static inline uint64_t mk_pte(page_t *page, bool writable) {
+    return (uint64_t)(uintptr_t)page | PTE_PRESENT | (writable ? PTE_WRITE : 0);
+}
+
+static uint64_t *pt_alloc(mm_struct_t *mm) {
+    page_t *page = page_alloc(0);
+    if (!page) return NULL;
+    uint64_t *table = page_to_virt(page);
+    memset(table, 0, PAGE_SIZE);
+    mm->nr_ptes++;
+    return table;
+}
+
+/* The leaf entry for addr; with alloc, missing tables are created */
+static uint64_t *pte_offset(mm_struct_t *mm, uint64_t addr, bool alloc) {
+    uint64_t *table = mm->pgd;
+    for (int level = PT_LEVELS - 1; level > 0; level--) {
+        uint64_t *entry = &table[pt_index(addr, level)];
+        if (!(*entry & PTE_PRESENT)) {
+            if (!alloc) return NULL;
+            uint64_t *next = pt_alloc(mm);
+            if (!next) return NULL;
+            *entry = (uint64_t)(uintptr_t)next | PTE_PRESENT;
+        }
+        table = (uint64_t *)(uintptr_t)(*entry & ~PTE_FLAGS);
+    }
+    return &table[pt_index(addr, 0)];
+}
+
+/* Unmap [start, end) below a table covering from base; free tables too with free_tables */
+static void zap_table(mm_struct_t *mm, uint64_t *table, int level, uint64_t base,
+                      uint64_t start, uint64_t end, bool free_tables) {
+    uint64_t span = 1ULL << (PAGE_SHIFT + 9 * level);
+    for (unsigned int i = 0; i < PTRS_PER_TABLE; i++) {
+        uint64_t lo = base + i * span, hi = lo + span;
+        if (hi <= start || lo >= end || !(table[i] & PTE_PRESENT)) continue;
+        if (level == 0) {
+            put_page(pte_page(table[i]));
+            table[i] = 0;
+            mm->rss--;
+            continue;
+        }
+        uint64_t *next = (uint64_t *)(uintptr_t)(table[i] & ~PTE_FLAGS);
+        zap_table(mm, next, level - 1, lo, start, end, free_tables);
+        if (free_tables) {
+            page_free(virt_to_page(next));
+            mm->nr_ptes--;
+            table[i] = 0;
+        }
+    }
+}
+
+mm_struct_t *mm_alloc(void) {
+    mm_struct_t *mm = kmalloc(sizeof(*mm), GFP_KERNEL);
+    if (!mm) return NULL;
+    memset(mm, 0, sizeof(*mm));
+    mm->pgd = pt_alloc(mm);
+    if (!mm->pgd) {
+        kfree(mm);
+        return NULL;
+    }
+    mm->users = 1;
+    mm->mmap_base = STACK_TOP - STACK_SIZE_DEFAULT - (128ULL << 20);
+    return mm;
+}
+
+void mmget(mm_struct_t *mm) {
+    __atomic_add_fetch(&mm->users, 1, __ATOMIC_RELAXED);
+}
+
+static void vma_free(vm_area_t *vma) {
+    if (vma->vm_file) iput(vma->vm_file);
+    kfree(vma);
+}
+
+void mmput(mm_struct_t *mm) {
+    if (!mm || __atomic_sub_fetch(&mm->users, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    rb_node_t *node = rb_first(&mm->mm_rb);
+    while (node) {
+        vm_area_t *vma = rb_entry(node, vm_area_t, vm_rb);
+        node = rb_next(node);
+        vma_free(vma);
+    }
+    zap_table(mm, mm->pgd, PT_LEVELS - 1, 0, 0, TASK_SIZE, true);
+    page_free(virt_to_page(mm->pgd));
+    kfree(mm);
+}
+
+/* Share the present pages of vma's range; private writable ones become read-only in both */
+static int copy_table(mm_struct_t *dst, uint64_t *dtab, uint64_t *stab, int level, uint64_t base,
+                      const vm_area_t *vma) {
+    uint64_t span = 1ULL << (PAGE_SHIFT + 9 * level);
+    for (unsigned int i = 0; i < PTRS_PER_TABLE; i++) {
+        uint64_t lo = base + i * span, hi = lo + span;
+        if (hi <= vma->vm_start || lo >= vma->vm_end || !(stab[i] & PTE_PRESENT)) continue;
+        if (level == 0) {
+            if (!(vma->vm_flags & VM_SHARED)) stab[i] &= ~PTE_WRITE;
+            get_page(pte_page(stab[i]));
+            dtab[i] = stab[i];
+            dst->rss++;
+            continue;
+        }
+        if (!(dtab[i] & PTE_PRESENT)) {
+            uint64_t *next = pt_alloc(dst);
+            if (!next) return -ENOMEM;
+            dtab[i] = (uint64_t)(uintptr_t)next | PTE_PRESENT;
+        }
+        int ret = copy_table(dst, (uint64_t *)(uintptr_t)(dtab[i] & ~PTE_FLAGS),
+                             (uint64_t *)(uintptr_t)(stab[i] & ~PTE_FLAGS), level - 1, lo, vma);
+        if (ret < 0) return ret;
+    }
+    return 0;
+}
+
+static void vma_link(mm_struct_t *mm, vm_area_t *vma);
+
+/*
+ * fork's copy: the same VMAs, and page tables sharing every mapped
+ * page. Private pages are write-protected on both sides, so whichever
+ * writes first copies; the cost is the page tables, not the memory.
+ */
+mm_struct_t *dup_mm(mm_struct_t *old, int *err) {
+    mm_struct_t *mm = mm_alloc();
+    if (!mm) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+
+    spin_lock(&old->lock);
+    mm->mmap_base = old->mmap_base;
+    mm->start_code = old->start_code;
+    mm->end_code = old->end_code;
+    mm->start_data = old->start_data;
+    mm->end_data = old->end_data;
+    mm->start_brk = old->start_brk;
+    mm->brk = old->brk;
+    mm->start_stack = old->start_stack;
+    mm->arg_start = old->arg_start;
+    mm->arg_end = old->arg_end;
+    mm->env_start = old->env_start;
+    mm->env_end = old->env_end;
+    mm->entry = old->entry;
+
+    int ret = 0;
+    for (rb_node_t *node = rb_first(&old->mm_rb); node && ret == 0; node = rb_next(node)) {
+        const vm_area_t *src = rb_entry(node, vm_area_t, vm_rb);
+        vm_area_t *vma = kmalloc(sizeof(*vma), GFP_KERNEL);
+        if (!vma) {
+            ret = -ENOMEM;
+            break;
+        }
+        *vma = *src;
+        vma->vm_mm = mm;
+        if (vma->vm_file) iget(vma->vm_file);
+        vma_link(mm, vma);
+        ret = copy_table(mm, mm->pgd, old->pgd, PT_LEVELS - 1, 0, src);
+    }
+    spin_unlock(&old->lock);
+
+    if (ret < 0) {
+        mmput(mm);
+        *err = ret;
+        return NULL;
+    }
+    return mm;
+}
+
+/* ============================================================================
+ * VMAs (caller holds mm->lock)
+ * ============================================================================ */
+
+vm_area_t *find_vma(mm_struct_t *mm, uint64_t addr) {
+    vm_area_t *cached = mm->mmap_cache;
+    if (cached && cached->vm_start <= addr && addr < cached->vm_end) return cached;
+
+    vm_area_t *best = NULL;
+    rb_node_t *node = mm->mm_rb.rb_node;
+    while (node) {
+        vm_area_t *vma = rb_entry(node, vm_area_t, vm_rb);
+        if (vma->vm_end > addr) {
+            best = vma;
+            if (vma->vm_start <= addr) break;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    if (best && best->vm_start <= addr) mm->mmap_cache = best;
+    return best;
+}
+
+static void vma_link(mm_struct_t *mm, vm_area_t *vma) {
+    rb_node_t **link = &mm->mm_rb.rb_node, *parent = NULL;
+    while (*link) {
+        parent = *link;
+        vm_area_t *cur = rb_entry(parent, vm_area_t, vm_rb);
+        link = vma->vm_start < cur->vm_start ? &parent->rb_left : &parent->rb_right;
+    }
+    rb_link_node(&vma->vm_rb, parent, link);
+    rb_insert_color(&vma->vm_rb, &mm->mm_rb);
+    mm->map_count++;
+}
+
+static void vma_unlink(mm_struct_t *mm, vm_area_t *vma) {
+    rb_erase(&vma->vm_rb, &mm->mm_rb);
+    if (mm->mmap_cache == vma) mm->mmap_cache = NULL;
+    mm->map_count--;
+}
+
+/* Remove [start, end) from every VMA it touches, splitting where it cuts one in two */
+static int __do_munmap(mm_struct_t *mm, uint64_t start, uint64_t end) {
+    vm_area_t *vma = find_vma(mm, start);
+
+    /* The only allocation comes first, so a failure changes nothing */
+    if (vma && vma->vm_start < start && vma->vm_end > end) {
+        vm_area_t *tail = kmalloc(sizeof(*tail), GFP_KERNEL);
+        if (!tail) return -ENOMEM;
+        *tail = *vma;
+        tail->vm_start = end;
+        if (tail->vm_file) {
+            iget(tail->vm_file);
+            tail->vm_pgoff += (end - vma->vm_start) >> PAGE_SHIFT;
+        }
+        vma->vm_end = start;
+        vma_link(mm, tail);
+        zap_table(mm, mm->pgd, PT_LEVELS - 1, 0, start, end, false);
+        return 0;
+    }
+
+    while (vma && vma->vm_start < end) {
+        rb_node_t *next = rb_next(&vma->vm_rb);
+        if (vma->vm_start < start) {
+            vma->vm_end = start;
+        } else if (vma->vm_end > end) {
+            if (vma->vm_file) vma->vm_pgoff += (end - vma->vm_start) >> PAGE_SHIFT;
+            vma->vm_start = end;
+        } else {
+            vma_unlink(mm, vma);
+            vma_free(vma);
+        }
+        vma = next ? rb_entry(next, vm_area_t, vm_rb) : NULL;
+    }
+    zap_table(mm, mm->pgd, PT_LEVELS - 1, 0, start, end, false);
+    return 0;
+}
+
+/* Highest free range of len bytes below mmap_base (or at a free hint) */
+static uint64_t get_unmapped_area(mm_struct_t *mm, uint64_t hint, uint64_t len) {
+    if (hint) {
+        vm_area_t *vma = find_vma(mm, hint);
+        if (hint >= MMAP_MIN_ADDR && hint + len <= TASK_SIZE &&
+            (!vma || vma->vm_start >= hint + len))
+            return hint;
+    }
+
+    uint64_t best = 0, gap_start = MMAP_MIN_ADDR;
+    for (rb_node_t *node = rb_first(&mm->mm_rb); ; node = rb_next(node)) {
+        uint64_t gap_end = node ? rb_entry(node, vm_area_t, vm_rb)->vm_start : TASK_SIZE;
+        if (gap_end > mm->mmap_base) gap_end = mm->mmap_base;
+        if (gap_end > gap_start && gap_end - gap_start >= len) best = gap_end - len;
+        if (!node || gap_end == mm->mmap_base) break;
+        gap_start = rb_entry(node, vm_area_t, vm_rb)->vm_end;
+    }
+    return best;
+}
+
+/*
+ * Map len bytes of file from page pgoff (anonymous memory if file is
+ * NULL) with VM_* permissions. MAP_FIXED puts it at addr, unmapping
+ * whatever was there; otherwise addr is a hint. Returns the address or
+ * -errno.
+ */
+int64_t do_mmap(mm_struct_t *mm, uint64_t addr, uint64_t len, unsigned int vm_flags,
+                unsigned int flags, inode_t *file, uint64_t pgoff) {
+    if (!len || len > TASK_SIZE) return -EINVAL;
+    len = PAGE_ALIGN(len);
+    if (addr & (PAGE_SIZE - 1)) {
+        if (flags & MAP_FIXED) return -EINVAL;
+        addr = PAGE_ALIGN(addr);
+    }
+    if (file && !S_ISREG(file->mode)) return -EACCES;
+
+    vm_area_t *vma = kmalloc(sizeof(*vma), GFP_KERNEL);
+    if (!vma) return -ENOMEM;
+
+    spin_lock(&mm->lock);
+    if (flags & MAP_FIXED) {
+        if (addr < MMAP_MIN_ADDR || addr > TASK_SIZE - len) {
+            spin_unlock(&mm->lock);
+            kfree(vma);
+            return -EINVAL;
+        }
+        int ret = __do_munmap(mm, addr, addr + len);
+        if (ret < 0) {
+            spin_unlock(&mm->lock);
+            kfree(vma);
+            return ret;
+        }
+    } else {
+        addr = get_unmapped_area(mm, addr, len);
+        if (!addr) {
+            spin_unlock(&mm->lock);
+            kfree(vma);
+            return -ENOMEM;
+        }
+    }
+
+    memset(vma, 0, sizeof(*vma));
+    vma->vm_start = addr;
+    vma->vm_end = addr + len;
+    vma->vm_flags = vm_flags;
+    vma->vm_mm = mm;
+    if (file) {
+        iget(file);
+        vma->vm_file = file;
+        vma->vm_pgoff = pgoff;
+    }
+    vma_link(mm, vma);
+    spin_unlock(&mm->lock);
+    return (int64_t)addr;
+}
+
+int do_munmap(mm_struct_t *mm, uint64_t addr, uint64_t len) {
+    if ((addr & (PAGE_SIZE - 1)) || !len || addr >= TASK_SIZE || len > TASK_SIZE - addr)
+        return -EINVAL;
+    spin_lock(&mm->lock);
+    int ret = __do_munmap(mm, addr, addr + PAGE_ALIGN(len));
+    spin_unlock(&mm->lock);
+    return ret;
+}
+
+/* ============================================================================
+ * Faults
+ * ============================================================================ */
+
+static page_t *alloc_user_page(const void *src) {
+    page_t *page = page_alloc(0);
+    if (!page) return NULL;
+    if (src) memcpy(page_to_virt(page), src, PAGE_SIZE);
+    else memset(page_to_virt(page), 0, PAGE_SIZE);
+    return page;
+}
+
+/* Write to a present, read-only entry of a writable VMA */
+static int do_wp_page(vm_area_t *vma, uint64_t *pte) {
+    page_t *old = pte_page(*pte);
+
+    if (vma->vm_flags & VM_SHARED) {
+        __atomic_fetch_or(&old->flags, PG_dirty, __ATOMIC_RELAXED);
+        if (vma->vm_file) inode_inc_iversion(vma->vm_file);
+        *pte |= PTE_WRITE;
+        return 0;
+    }
+    /* Ours alone: no page cache owner and no other mapping */
+    if (!old->mapping && __atomic_load_n(&old->count, __ATOMIC_ACQUIRE) == 1) {
+        *pte |= PTE_WRITE;
+        return 0;
+    }
+    page_t *copy = alloc_user_page(page_to_virt(old));
+    if (!copy) return -ENOMEM;
+    *pte = mk_pte(copy, true);
+    put_page(old);
+    return 0;
+}
+
+/*
+ * Resolve a fault at addr: 0 once an entry allows the access, -EFAULT
+ * for an address with no VMA or an access the VMA forbids (or a file
+ * page wholly past EOF), else the error allocating or reading the page.
+ */
+int handle_mm_fault(mm_struct_t *mm, uint64_t addr, unsigned int fault_flags) {
+    bool write = fault_flags & FAULT_FLAG_WRITE;
+    unsigned int need = write ? VM_WRITE : (fault_flags & FAULT_FLAG_INSTRUCTION) ? VM_EXEC : VM_READ;
+    bool major = false;
+    int ret = 0;
+
+    addr &= ~(uint64_t)(PAGE_SIZE - 1);
+    spin_lock(&mm->lock);
+retry:;
+    vm_area_t *vma = find_vma(mm, addr);
+    if (!vma || vma->vm_start > addr || !(vma->vm_flags & need)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    uint64_t *pte = pte_offset(mm, addr, true);
+    if (!pte) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (*pte & PTE_PRESENT) {
+        /* Raced with another fault, or the copy-on-write case */
+        if (write && !(*pte & PTE_WRITE)) ret = do_wp_page(vma, pte);
+        goto out;
+    }
+
+    page_t *page;
+    if (!vma->vm_file) {
+        page = alloc_user_page(NULL);
+        if (!page) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        *pte = mk_pte(page, vma->vm_flags & VM_WRITE);
+        mm->rss++;
+        goto out;
+    }
+
+    inode_t *file = vma->vm_file;
+    uint64_t index = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+    if (index >= PAGE_ALIGN(file->size) >> PAGE_SHIFT) {
+        ret = -EFAULT;
+        goto out;
+    }
+    page = find_get_page(&file->i_data, index);
+    if (!page) {
+        /* Read it with the lock dropped, then start over */
+        iget(file);
+        spin_unlock(&mm->lock);
+        page = find_or_create_page(&file->i_data, index, &ret);
+        iput(file);
+        spin_lock(&mm->lock);
+        if (!page) goto out;
+        put_page(page);             /* The cache keeps it for the retry */
+        major = true;
+        goto retry;
+    }
+
+    if (write && !(vma->vm_flags & VM_SHARED)) {
+        page_t *copy = alloc_user_page(page_to_virt(page));
+        put_page(page);
+        if (!copy) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        page = copy;
+    } else if (write) {
+        __atomic_fetch_or(&page->flags, PG_dirty, __ATOMIC_RELAXED);
+        inode_inc_iversion(file);
+    }
+    *pte = mk_pte(page, write);
+    mm->rss++;
+out:
+    if (ret == 0) {
+        if (major) mm->maj_flt++;
+        else mm->min_flt++;
+    }
+    spin_unlock(&mm->lock);
+    if (ret == 0) {
+        count_vm_events(PGFAULT, 1);
+        if (major) count_vm_events(PGMAJFAULT, 1);
+    }
+    return ret;
+}
+
+/* ============================================================================
+ * Kernel access to user memory, faulting pages in as a user access would
+ * ============================================================================ */
+
+enum mm_access { MM_READ, MM_WRITE, MM_CLEAR };
+
+static int access_mm(mm_struct_t *mm, uint64_t addr, void *buf, size_t len, enum mm_access op) {
+    bool write = op != MM_READ;
+    size_t done = 0;
+
+    if (addr >= TASK_SIZE || len > TASK_SIZE - addr) return -EFAULT;
+    while (done < len) {
+        uint64_t at = addr + done;
+        size_t in_page = (size_t)(at & (PAGE_SIZE - 1));
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > len - done) chunk = len - done;
+
+        spin_lock(&mm->lock);
+        uint64_t *pte = pte_offset(mm, at, false);
+        if (!pte || !(*pte & PTE_PRESENT) || (write && !(*pte & PTE_WRITE))) {
+            spin_unlock(&mm->lock);
+            int ret = handle_mm_fault(mm, at, write ? FAULT_FLAG_WRITE : 0);
+            if (ret < 0) return ret;
+            continue;
+        }
+        page_t *page = pte_page(*pte);
+        get_page(page);
+        spin_unlock(&mm->lock);
+
+        char *p = (char *)page_to_virt(page) + in_page;
+        if (op == MM_READ) memcpy((char *)buf + done, p, chunk);
+        else if (op == MM_WRITE) memcpy(p, (const char *)buf + done, chunk);
+        else memset(p, 0, chunk);
+        put_page(page);
+        done += chunk;
+    }
+    return 0;
+}
+
+int copy_to_mm(mm_struct_t *mm, uint64_t addr, const void *src, size_t len) {
+    return access_mm(mm, addr, (void *)src, len, MM_WRITE);
+}
+
+int copy_from_mm(mm_struct_t *mm, void *dst, uint64_t addr, size_t len) {
+    return access_mm(mm, addr, dst, len, MM_READ);
+}
+
+int clear_mm(mm_struct_t *mm, uint64_t addr, size_t len) {
+    return access_mm(mm, addr, NULL, len, MM_CLEAR);
+}
@@ -0,0 +1,166 @@
+/**
+ * Page reclaim
+ *
+ * kswapd sleeps until an allocation finds fewer than `low` pages free,
+ * then reclaims until `high` pages are free and sleeps again. Most
+ * allocations under pressure therefore never wait for reclaim. One that
+ * still finds the zone at `min` reclaims for itself (direct reclaim):
+ * one SWAP_CLUSTER_MAX batch, scanning more of the LRU at each lower
+ * priority until it has it.
+ *
+ * What can be reclaimed is the clean, unused page cache on the inactive
+ * file list (kernel/mm/page.c). After MAX_RECLAIM_FAILURES balancing
+ * runs that free nothing, kswapd stops answering wakeups until direct
+ * reclaim makes progress again, instead of rescanning a list that has
+ * nothing left to give.
+ *
+ * Watermarks, LRU lists and failure counts are per NUMA node. One
+ * kswapd serves them all: a wakeup marks its node pending, and each
+ * pass balances every pending node in turn.
+ *
+ * Hosted builds run kswapd as a host thread on CPU 0.
+ */
+
+#include <kernel.h>
+#include <string.h>
+#ifdef __unix__
+#include <pthread.h>
+#endif
+
+#define MAX_RECLAIM_FAILURES    16
+
+typedef struct {
+    uint32_t wait;                  /* Futex word, bumped by wakeup_kswapd() */
+    nodemask_t pending;             /* Nodes woken and not yet balanced */
+    bool started;
+    int failures[MAX_NUMNODES];     /* Balancing runs in a row that freed nothing */
+#ifdef __unix__
+    pthread_t thread;
+#endif
+} kswapd_t;
+
+static kswapd_t g_kswapd;
+static uint64_t g_vm_events[NR_VM_EVENT_ITEMS];
+
+static const char *const g_vm_event_names[NR_VM_EVENT_ITEMS] = {
+    [PGSCAN_KSWAPD]  = "pgscan_kswapd",
+    [PGSTEAL_KSWAPD] = "pgsteal_kswapd",
+    [PGSCAN_DIRECT]  = "pgscan_direct",
+    [PGSTEAL_DIRECT] = "pgsteal_direct",
+    [ALLOCSTALL]     = "allocstall",
+    [KSWAPD_WAKEUP]  = "kswapd_wakeup",
+    [PGACTIVATE]     = "pgactivate",
+    [PGDEACTIVATE]   = "pgdeactivate",
+    [PGROTATED]      = "pgrotated",
+    [PGFAULT]        = "pgfault",
+    [PGMAJFAULT]     = "pgmajfault",
+};
+
+void count_vm_events(enum vm_event_item item, unsigned long delta) {
+    if (item < NR_VM_EVENT_ITEMS && delta)
+        __atomic_fetch_add(&g_vm_events[item], delta, __ATOMIC_RELAXED);
+}
+
+uint64_t vm_event_count(enum vm_event_item item) {
+    return item < NR_VM_EVENT_ITEMS ? __atomic_load_n(&g_vm_events[item], __ATOMIC_RELAXED) : 0;
+}
+
+const char *vm_event_name(enum vm_event_item item) {
+    return item < NR_VM_EVENT_ITEMS ? g_vm_event_names[item] : NULL;
+}
+
+/* Called by allocations that found fewer than `low` pages free on nid */
+void wakeup_kswapd(int nid) {
+    nodemask_t bit = 1U << nid;
+    if (!g_kswapd.started || nid < 0 || nid >= nr_online_nodes() ||
+        (__atomic_load_n(&g_kswapd.pending, __ATOMIC_ACQUIRE) & bit) ||
+        __atomic_load_n(&g_kswapd.failures[nid], __ATOMIC_RELAXED) >= MAX_RECLAIM_FAILURES)
+        return;
+    if (__atomic_fetch_or(&g_kswapd.pending, bit, __ATOMIC_ACQ_REL) & bit)
+        return;
+    count_vm_events(KSWAPD_WAKEUP, 1);
+    __atomic_fetch_add(&g_kswapd.wait, 1, __ATOMIC_RELEASE);
+    futex_wake(&g_kswapd.wait, 1);
+}
+
+/* Reclaim until nid has `high` pages free or a full-priority pass finds nothing */
+static unsigned long balance_pgdat(int nid) {
+    unsigned long high = zone_watermark(nid, WMARK_HIGH);
+    unsigned long total = 0;
+    int priority = DEF_PRIORITY;
+
+    while (priority >= 0 && !zone_watermark_ok(nid, 0, high)) {
+        unsigned long scanned;
+        unsigned long reclaimed = shrink_page_cache(nid, SWAP_CLUSTER_MAX, priority, &scanned);
+        count_vm_events(PGSCAN_KSWAPD, scanned);
+        count_vm_events(PGSTEAL_KSWAPD, reclaimed);
+        total += reclaimed;
+        if (!scanned) break;
+        /* Scan harder only while a batch comes up short */
+        if (reclaimed < SWAP_CLUSTER_MAX) priority--;
+    }
+    return total;
+}
+
+#ifdef __unix__
+static void *kswapd(void *arg) {
+    (void)arg;
+    cpu_bind(0);
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&g_kswapd.wait, __ATOMIC_ACQUIRE);
+        nodemask_t pending = __atomic_load_n(&g_kswapd.pending, __ATOMIC_ACQUIRE);
+        if (!pending) {
+            futex_wait(&g_kswapd.wait, seq);
+            continue;
+        }
+
+        while (pending) {
+            int nid = __builtin_ctz(pending);
+            pending &= pending - 1;
+
+            if (balance_pgdat(nid)) __atomic_store_n(&g_kswapd.failures[nid], 0, __ATOMIC_RELAXED);
+            else __atomic_fetch_add(&g_kswapd.failures[nid], 1, __ATOMIC_RELAXED);
+            __atomic_fetch_and(&g_kswapd.pending, ~(1U << nid), __ATOMIC_RELEASE);
+
+            /* Allocations kept going meanwhile; they may already be below low again */
+            if (!zone_watermark_ok(nid, 0, zone_watermark(nid, WMARK_LOW)))
+                wakeup_kswapd(nid);
+        }
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * Direct reclaim on node nid for an allocation of 2^order pages that
+ * found it at `min`: free at least a batch, or as much as a full scan at every
+ * priority can. Returns the pages freed.
+ */
+unsigned long try_to_free_pages(int nid, unsigned int order) {
+    unsigned long target = SWAP_CLUSTER_MAX > (1UL << order) ? SWAP_CLUSTER_MAX : 1UL << order;
+    unsigned long total = 0;
+
+    count_vm_events(ALLOCSTALL, 1);
+    for (int priority = DEF_PRIORITY; priority >= 0 && total < target; priority--) {
+        unsigned long scanned;
+        unsigned long reclaimed = shrink_page_cache(nid, target - total, priority, &scanned);
+        count_vm_events(PGSCAN_DIRECT, scanned);
+        count_vm_events(PGSTEAL_DIRECT, reclaimed);
+        total += reclaimed;
+    }
+    if (total && nid >= 0 && nid < MAX_NUMNODES)
+        __atomic_store_n(&g_kswapd.failures[nid], 0, __ATOMIC_RELAXED);
+    return total;
+}
+
+/* Start kswapd; without host threads all reclaim is direct */
+int kswapd_init(void) {
+    memset(g_vm_events, 0, sizeof(g_vm_events));
+#ifdef __unix__
+    if (g_kswapd.started) return 0;
+    if (pthread_create(&g_kswapd.thread, NULL, kswapd, NULL) != 0)
+        return -EAGAIN;
+    g_kswapd.started = true;
+#endif
+    return 0;
+}
@@ -4,6 +4,20 @@
  */
 
 #include "Vos.h"
+#include <entry.h>
+
+#ifdef __unix__
+#include <sys/mman.h>
+#endif
+
+/*
+ * Wrappers that enter the kernel return through here: this is the return
+ * to user mode, where pending signals are delivered.
+ */
+static inline int64_t syscall_exit(int64_t ret) {
+    exit_to_user_mode();
+    return ret;
+}
 
 /* ============================================================================
  * Logging Functions
@@ -67,18 +81,100 @@ void vos_slab_free(void *ptr, size_t size) {
     kmem_cache_free(ptr, size);
 }
 
+#ifdef __unix__
+/*
+ * Hosted, library code runs in the host process and its mappings must be
+ * the host's: the kernel's VMAs describe a simulated address space.
+ */
+void *vos_mmap(void *addr, size_t len, int prot, int flags) {
+    void *p = mmap(addr, len, prot, flags, -1, 0);
+    return p == MAP_FAILED ? VOS_MAP_FAILED : p;
+}
+
+int vos_munmap(void *addr, size_t len) {
+    return munmap(addr, len) ? -VOS_EINVAL : 0;
+}
+
+int vos_mprotect(void *addr, size_t len, int prot) {
+    return mprotect(addr, len, prot) ? -VOS_EINVAL : 0;
+}
+#endif
+
 /* ============================================================================
  * Process Management (Stubs)
  * ============================================================================ */
 
 vos_pid_t vos_fork(void) {
     extern vos_pid_t do_fork(void);
-    return do_fork();
+    return syscall_exit(do_fork());
 }
 
 int vos_exec(const char *filename, char *const argv[]) {
     extern int do_exec(const char *filename, char *const argv[]);
-    return do_exec(filename, argv);
+    return syscall_exit(do_exec(filename, argv));
+}
+
+vos_pid_t vos_spawn(const char *path, const vos_spawn_file_actions_t *actions,
+                    const vos_spawnattr_t *attr, char *const argv[], char *const envp[]) {
+    /* The action and attribute structs share the kernel's layout */
+    extern vos_pid_t do_spawn(const char *path, const void *actions, unsigned int nactions,
+                              const void *attr, char *const argv[], char *const envp[]);
+    if (!path || (actions && actions->count > VOS_SPAWN_MAX_ACTIONS)) return -VOS_EINVAL;
+    return syscall_exit(do_spawn(path, actions ? actions->actions : NULL,
+                                 actions ? actions->count : 0, attr, argv, envp));
+}
+
+void vos_spawn_file_actions_init(vos_spawn_file_actions_t *actions) {
+    actions->count = 0;
+}
+
+static vos_spawn_action_t *spawn_action_add(vos_spawn_file_actions_t *actions, int action, vos_fd_t fd) {
+    if (actions->count >= VOS_SPAWN_MAX_ACTIONS) return NULL;
+    vos_spawn_action_t *fa = &actions->actions[actions->count++];
+    *fa = (vos_spawn_action_t){ .action = action, .fd = fd };
+    return fa;
+}
+
+int vos_spawn_file_actions_addclose(vos_spawn_file_actions_t *actions, vos_fd_t fd) {
+    if (fd < 0) return -VOS_EBADF;
+    return spawn_action_add(actions, VOS_SPAWN_CLOSE, fd) ? 0 : -VOS_ENOMEM;
+}
+
+int vos_spawn_file_actions_adddup2(vos_spawn_file_actions_t *actions, vos_fd_t srcfd, vos_fd_t fd) {
+    if (fd < 0 || srcfd < 0) return -VOS_EBADF;
+    vos_spawn_action_t *fa = spawn_action_add(actions, VOS_SPAWN_DUP2, fd);
+    if (!fa) return -VOS_ENOMEM;
+    fa->srcfd = srcfd;
+    return 0;
+}
+
+int vos_spawn_file_actions_addopen(vos_spawn_file_actions_t *actions, vos_fd_t fd,
+                                   const char *path, int flags, int mode) {
+    if (fd < 0) return -VOS_EBADF;
+    if (!path) return -VOS_EINVAL;
+    vos_spawn_action_t *fa = spawn_action_add(actions, VOS_SPAWN_OPEN, fd);
+    if (!fa) return -VOS_ENOMEM;
+    fa->flags = flags;
+    fa->mode = (uint16_t)mode;
+    fa->path = path;
+    return 0;
+}
+
+void vos_spawnattr_init(vos_spawnattr_t *attr) {
+    *attr = (vos_spawnattr_t){ 0 };
+}
+
+int vos_spawnattr_setpriority(vos_spawnattr_t *attr, int priority) {
+    if (priority < -20 || priority > 19) return -VOS_EINVAL;
+    attr->priority = priority;
+    attr->flags |= VOS_SPAWN_SETPRIORITY;
+    return 0;
+}
+
+int vos_spawnattr_setsigmask(vos_spawnattr_t *attr, vos_sigset_t mask) {
+    attr->sigmask = mask;
+    attr->flags |= VOS_SPAWN_SETSIGMASK;
+    return 0;
 }
 
 void vos_exit(int code) {
@@ -95,13 +191,14 @@ vos_pid_t vos_waitpid(vos_pid_t pid, int *status) {
 }
 
 vos_pid_t vos_getpid(void) {
-    /* TODO: Implement via syscall */
-    return 1;
+    /* vDSO: read from the vvar page, no kernel entry */
+    extern int32_t vdso_getpid(void);
+    return vdso_getpid();
 }
 
 vos_pid_t vos_getppid(void) {
-    /* TODO: Implement via syscall */
-    return 1;
+    extern int32_t vdso_getppid(void);
+    return vdso_getppid();
 }
 
 int vos_get_process_info(vos_pid_t pid, vos_process_info_t *info) {
@@ -110,9 +207,24 @@ int vos_get_process_info(vos_pid_t pid, vos_process_info_t *info) {
     return -VOS_ENOTIMPL;
 }
 
+vos_tid_t vos_clone(unsigned long flags, void (*fn)(void *arg), void *arg, void *tls) {
+    extern vos_tid_t do_clone(unsigned long flags, void (*fn)(void *arg), void *arg, uint64_t tls);
+    return syscall_exit(do_clone(flags, fn, arg, (uint64_t)(uintptr_t)tls));
+}
+
+vos_tid_t vos_thread_create(void (*fn)(void *arg), void *arg) {
+    return vos_clone(VOS_CLONE_THREAD_FLAGS, fn, arg, NULL);
+}
+
+vos_tid_t vos_gettid(void) {
+    extern vos_tid_t do_gettid(void);
+    return syscall_exit(do_gettid());
+}
+
 void vos_yield(void) {
     extern void schedule(void);
     schedule();
+    syscall_exit(0);
 }
 
 /* ============================================================================
@@ -120,64 +232,88 @@ void vos_yield(void) {
  * ============================================================================ */
 
 vos_fd_t vos_open(const char *path, int flags, int mode) {
-    (void)path;
-    (void)flags;
-    (void)mode;
-    return -VOS_ENOTIMPL;
+    extern int do_open(const char *path, int flags, uint16_t mode);
+    return syscall_exit(do_open(path, flags, (uint16_t)mode));
 }
 
 int vos_close(vos_fd_t fd) {
-    (void)fd;
-    return -VOS_ENOTIMPL;
+    extern int do_close(int fd);
+    return syscall_exit(do_close(fd));
 }
 
 ssize_t vos_read(vos_fd_t fd, void *buf, size_t count) {
-    (void)fd;
-    (void)buf;
-    (void)count;
-    return -VOS_ENOTIMPL;
+    extern int64_t do_read(int fd, void *buf, size_t count);
+    return (ssize_t)syscall_exit(do_read(fd, buf, count));
 }
 
 ssize_t vos_write(vos_fd_t fd, const void *buf, size_t count) {
-    (void)fd;
-    (void)buf;
-    (void)count;
-    return -VOS_ENOTIMPL;
+    extern int64_t do_write(int fd, const void *buf, size_t count);
+    return (ssize_t)syscall_exit(do_write(fd, buf, count));
 }
 
 off_t vos_lseek(vos_fd_t fd, off_t offset, int whence) {
-    (void)fd;
-    (void)offset;
-    (void)whence;
-    return -VOS_ENOTIMPL;
+    extern int64_t do_lseek(int fd, int64_t offset, int whence);
+    return (off_t)syscall_exit(do_lseek(fd, offset, whence));
+}
+
+ssize_t vos_readv(vos_fd_t fd, const vos_iovec_t *iov, int iovcnt) {
+    extern int64_t do_readv(int fd, const vos_iovec_t *iov, int iovcnt);
+    return (ssize_t)syscall_exit(do_readv(fd, iov, iovcnt));
+}
+
+ssize_t vos_writev(vos_fd_t fd, const vos_iovec_t *iov, int iovcnt) {
+    extern int64_t do_writev(int fd, const vos_iovec_t *iov, int iovcnt);
+    return (ssize_t)syscall_exit(do_writev(fd, iov, iovcnt));
+}
+
+ssize_t vos_pread(vos_fd_t fd, void *buf, size_t count, off_t offset) {
+    extern int64_t do_pread(int fd, void *buf, size_t count, int64_t offset);
+    return (ssize_t)syscall_exit(do_pread(fd, buf, count, offset));
+}
+
+ssize_t vos_pwrite(vos_fd_t fd, const void *buf, size_t count, off_t offset) {
+    extern int64_t do_pwrite(int fd, const void *buf, size_t count, int64_t offset);
+    return (ssize_t)syscall_exit(do_pwrite(fd, buf, count, offset));
+}
+
+ssize_t vos_preadv2(vos_fd_t fd, const vos_iovec_t *iov, int iovcnt, off_t offset, int flags) {
+    extern int64_t do_preadv2(int fd, const vos_iovec_t *iov, int iovcnt, int64_t offset, int flags);
+    return (ssize_t)syscall_exit(do_preadv2(fd, iov, iovcnt, offset, flags));
+}
+
+int vos_fsync(vos_fd_t fd) {
+    extern int do_fsync(int fd);
+    return syscall_exit(do_fsync(fd));
 }
 
 int vos_stat(const char *path, vos_stat_t *stat) {
-    (void)path;
-    (void)stat;
-    return -VOS_ENOTIMPL;
+    extern int do_stat(const char *path, vos_stat_t *stat);
+    if (!path || !stat) return -VOS_EINVAL;
+    return syscall_exit(do_stat(path, stat));
 }
 
 int vos_fstat(vos_fd_t fd, vos_stat_t *stat) {
-    (void)fd;
-    (void)stat;
-    return -VOS_ENOTIMPL;
+    extern int do_fstat(int fd, vos_stat_t *stat);
+    if (!stat) return -VOS_EINVAL;
+    return syscall_exit(do_fstat(fd, stat));
 }
 
 int vos_mkdir(const char *path, int mode) {
-    (void)path;
-    (void)mode;
-    return -VOS_ENOTIMPL;
+    extern int vfs_mkdir(const char *path, uint16_t mode);
+    if (!path) return -VOS_EINVAL;
+    return syscall_exit(vfs_mkdir(path, (uint16_t)mode));
 }
 
 int vos_unlink(const char *path) {
-    (void)path;
-    return -VOS_ENOTIMPL;
+    extern int vfs_unlink(const char *path);
+    if (!path) return -VOS_EINVAL;
+    return syscall_exit(vfs_unlink(path));
 }
 
 int vos_rmdir(const char *path) {
-    (void)path;
-    return -VOS_ENOTIMPL;
+    extern int vfs_rmdir(const char *path);
+    if (!path) return -VOS_EINVAL;
+    return syscall_exit(vfs_rmdir(path));
 }
 
 int vos_chdir(const char *path) {
@@ -193,12 +329,12 @@ char *vos_getcwd(char *buf, size_t size) {
 
 int vos_mount(const char *device, const char *mount_point, const char *fs_type) {
     extern int mount_fs(const char *device, const char *mount_point, const char *fs_type);
-    return mount_fs(device, mount_point, fs_type);
+    return syscall_exit(mount_fs(device, mount_point, fs_type));
 }
 
 int vos_umount(const char *mount_point) {
     extern int umount_fs(const char *mount_point);
-    return umount_fs(mount_point);
+    return syscall_exit(umount_fs(mount_point));
 }
 
 /* ============================================================================
@@ -235,23 +371,165 @@ void vos_sem_post(vos_semaphore_t *sem) {
     sem_post(sem);
 }
 
+int vos_futex_wait(uint32_t *uaddr, uint32_t val) {
+    extern int futex_wait(uint32_t *uaddr, uint32_t val);
+    if (!uaddr) return -VOS_EINVAL;
+    return syscall_exit(futex_wait(uaddr, val));
+}
+
+int vos_futex_wake(uint32_t *uaddr, int nr) {
+    extern int futex_wake(uint32_t *uaddr, int nr);
+    if (!uaddr) return -VOS_EINVAL;
+    return syscall_exit(futex_wake(uaddr, nr));
+}
+
 /* ============================================================================
- * IPC (Stubs)
+ * IPC
  * ============================================================================ */
 
 int vos_pipe(vos_fd_t *read_fd, vos_fd_t *write_fd) {
     extern int pipe_create(vos_fd_t *read_fd, vos_fd_t *write_fd);
-    return pipe_create(read_fd, write_fd);
+    return syscall_exit(pipe_create(read_fd, write_fd));
 }
 
 ssize_t vos_pipe_write(vos_fd_t fd, const void *buf, size_t len) {
     extern int pipe_write(vos_fd_t fd, const void *buf, size_t len);
-    return pipe_write(fd, buf, len);
+    return syscall_exit(pipe_write(fd, buf, len));
 }
 
 ssize_t vos_pipe_read(vos_fd_t fd, void *buf, size_t len) {
     extern int pipe_read(vos_fd_t fd, void *buf, size_t len);
-    return pipe_read(fd, buf, len);
+    return syscall_exit(pipe_read(fd, buf, len));
+}
+
+/* ============================================================================
+ * Asynchronous I/O Rings
+ * ============================================================================ */
+
+/* Matches io_uring_params_t */
+typedef struct {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    vos_io_rings_t *rings;
+    vos_io_sqe_t *sqes;
+} vos_io_params_t;
+
+int vos_io_ring_init(unsigned int entries, vos_io_ring_t *ring) {
+    extern int io_uring_setup(uint32_t entries, vos_io_params_t *p);
+    vos_io_params_t p;
+    if (!ring) return -VOS_EINVAL;
+
+    int fd = (int)syscall_exit(io_uring_setup(entries, &p));
+    if (fd < 0) return fd;
+    ring->fd = fd;
+    ring->rings = p.rings;
+    ring->sqes = p.sqes;
+    ring->sqe_tail = p.rings->sq.tail;
+    return 0;
+}
+
+int vos_io_ring_exit(vos_io_ring_t *ring) {
+    return vos_close(ring->fd);
+}
+
+vos_io_sqe_t *vos_io_get_sqe(vos_io_ring_t *ring) {
+    vos_io_rings_t *r = ring->rings;
+    uint32_t head = __atomic_load_n(&r->sq.head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= r->sq_ring_entries) return NULL;
+
+    vos_io_sqe_t *sqe = &ring->sqes[ring->sqe_tail++ & r->sq_ring_mask];
+    *sqe = (vos_io_sqe_t){ .opcode = VOS_IORING_OP_NOP };
+    return sqe;
+}
+
+static void io_prep_rw(vos_io_sqe_t *sqe, int op, vos_fd_t fd, const void *addr,
+                       uint32_t len, off_t off) {
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = (uint64_t)off;
+}
+
+void vos_io_prep_read(vos_io_sqe_t *sqe, vos_fd_t fd, void *buf, uint32_t len, off_t off) {
+    io_prep_rw(sqe, VOS_IORING_OP_READ, fd, buf, len, off);
+}
+
+void vos_io_prep_write(vos_io_sqe_t *sqe, vos_fd_t fd, const void *buf, uint32_t len, off_t off) {
+    io_prep_rw(sqe, VOS_IORING_OP_WRITE, fd, buf, len, off);
+}
+
+void vos_io_prep_readv(vos_io_sqe_t *sqe, vos_fd_t fd, const vos_iovec_t *iov, int iovcnt, off_t off) {
+    io_prep_rw(sqe, VOS_IORING_OP_READV, fd, iov, (uint32_t)iovcnt, off);
+}
+
+void vos_io_prep_writev(vos_io_sqe_t *sqe, vos_fd_t fd, const vos_iovec_t *iov, int iovcnt, off_t off) {
+    io_prep_rw(sqe, VOS_IORING_OP_WRITEV, fd, iov, (uint32_t)iovcnt, off);
+}
+
+void vos_io_prep_open(vos_io_sqe_t *sqe, const char *path, int flags, int mode) {
+    io_prep_rw(sqe, VOS_IORING_OP_OPENAT, -1, path, (uint32_t)mode, 0);
+    sqe->op_flags = (uint32_t)flags;
+}
+
+void vos_io_prep_close(vos_io_sqe_t *sqe, vos_fd_t fd) {
+    io_prep_rw(sqe, VOS_IORING_OP_CLOSE, fd, NULL, 0, 0);
+}
+
+void vos_io_prep_fsync(vos_io_sqe_t *sqe, vos_fd_t fd) {
+    io_prep_rw(sqe, VOS_IORING_OP_FSYNC, fd, NULL, 0, 0);
+}
+
+void vos_io_prep_pipe(vos_io_sqe_t *sqe, vos_fd_t fds[2], int flags) {
+    io_prep_rw(sqe, VOS_IORING_OP_PIPE, -1, fds, 0, 0);
+    sqe->op_flags = (uint32_t)flags;
+}
+
+void vos_io_prep_futex_wait(vos_io_sqe_t *sqe, uint32_t *uaddr, uint32_t val) {
+    io_prep_rw(sqe, VOS_IORING_OP_FUTEX_WAIT, -1, uaddr, 0, (off_t)val);
+}
+
+void vos_io_prep_futex_wake(vos_io_sqe_t *sqe, uint32_t *uaddr, int nr) {
+    io_prep_rw(sqe, VOS_IORING_OP_FUTEX_WAKE, -1, uaddr, (uint32_t)nr, 0);
+}
+
+static int io_enter(vos_io_ring_t *ring, unsigned int wait_nr, unsigned int flags) {
+    extern int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+    vos_io_rings_t *r = ring->rings;
+
+    /* Publish the filled SQEs before the kernel can see the new tail */
+    uint32_t to_submit = ring->sqe_tail - r->sq.tail;
+    __atomic_store_n(&r->sq.tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return syscall_exit(io_uring_enter(ring->fd, to_submit, wait_nr, flags));
+}
+
+int vos_io_submit(vos_io_ring_t *ring) {
+    return io_enter(ring, 0, 0);
+}
+
+int vos_io_submit_and_wait(vos_io_ring_t *ring, unsigned int wait_nr) {
+    return io_enter(ring, wait_nr, wait_nr ? 1U : 0U);   /* IORING_ENTER_GETEVENTS */
+}
+
+int vos_io_peek_cqe(vos_io_ring_t *ring, vos_io_cqe_t **cqe) {
+    vos_io_rings_t *r = ring->rings;
+    uint32_t head = r->cq.head;
+    if (head == __atomic_load_n(&r->cq.tail, __ATOMIC_ACQUIRE)) return -VOS_EAGAIN;
+    *cqe = &r->cqes[head & r->cq_ring_mask];
+    return 0;
+}
+
+int vos_io_wait_cqe(vos_io_ring_t *ring, vos_io_cqe_t **cqe) {
+    int ret = vos_io_peek_cqe(ring, cqe);
+    if (ret != -VOS_EAGAIN) return ret;
+    ret = vos_io_submit_and_wait(ring, 1);
+    if (ret < 0) return ret;
+    return vos_io_peek_cqe(ring, cqe);
+}
+
+void vos_io_cqe_seen(vos_io_ring_t *ring, vos_io_cqe_t *cqe) {
+    (void)cqe;
+    __atomic_store_n(&ring->rings->cq.head, ring->rings->cq.head + 1, __ATOMIC_RELEASE);
 }
 
 /* ============================================================================
@@ -259,34 +537,79 @@ ssize_t vos_pipe_read(vos_fd_t fd, void *buf, size_t len) {
  * ============================================================================ */
 
 int vos_clock_gettime(vos_timespec_t *ts) {
-    (void)ts;
-    return -VOS_ENOTIMPL;
+    /* vDSO: TSC plus vvar calibration; traps only without a usable TSC */
+    extern int vdso_clock_gettime(vos_timespec_t *ts);
+    return vdso_clock_gettime(ts);
 }
 
 int vos_sleep(uint32_t seconds) {
-    (void)seconds;
-    return -VOS_ENOTIMPL;
+    vos_timespec_t ts = { seconds, 0 };
+    return vos_nanosleep(&ts);
 }
 
 int vos_nanosleep(const vos_timespec_t *ts) {
-    (void)ts;
-    return -VOS_ENOTIMPL;
+    /* hrtimer on this CPU; the CPU idles tickless until it fires */
+    extern int do_nanosleep(const vos_timespec_t *req);
+    return syscall_exit(do_nanosleep(ts));
 }
 
 /* ============================================================================
- * Signal Handling (Stubs)
+ * Signal Handling
  * ============================================================================ */
 
+/* vos_sigaction_t and vos_siginfo_t share the kernel's layouts */
+
 vos_signal_handler_t vos_signal(int sig, vos_signal_handler_t handler) {
-    (void)sig;
-    (void)handler;
-    return NULL;
+    vos_sigaction_t act = { .handler = handler }, oact;
+    if (vos_sigaction(sig, &act, &oact) < 0) return VOS_SIG_ERR;
+    return oact.handler;
+}
+
+int vos_sigaction(int sig, const vos_sigaction_t *act, vos_sigaction_t *oact) {
+    extern int do_sigaction(int sig, const void *act, void *oact);
+    return syscall_exit(do_sigaction(sig, act, oact));
 }
 
 int vos_kill(vos_pid_t pid, int sig) {
-    (void)pid;
-    (void)sig;
-    return -VOS_ENOTIMPL;
+    extern int do_kill(vos_pid_t pid, int sig);
+    return syscall_exit(do_kill(pid, sig));
+}
+
+int vos_tkill(vos_tid_t tid, int sig) {
+    extern int do_tkill(vos_tid_t tid, int sig);
+    return syscall_exit(do_tkill(tid, sig));
+}
+
+int vos_sigqueue(vos_pid_t pid, int sig, uint64_t value) {
+    extern int do_sigqueue(vos_pid_t pid, int sig, uint64_t value);
+    return syscall_exit(do_sigqueue(pid, sig, value));
+}
+
+int vos_sigprocmask(int how, const vos_sigset_t *set, vos_sigset_t *oset) {
+    extern int do_sigprocmask(int how, const uint64_t *set, uint64_t *oset);
+    return syscall_exit(do_sigprocmask(how, set, oset));
+}
+
+int vos_sigpending(vos_sigset_t *set) {
+    extern int do_sigpending(uint64_t *set);
+    if (!set) return -VOS_EINVAL;
+    return syscall_exit(do_sigpending(set));
+}
+
+int vos_sigwaitinfo(vos_sigset_t set, vos_siginfo_t *info) {
+    extern int do_sigtimedwait(uint64_t set, void *info, int64_t timeout_ns);
+    return syscall_exit(do_sigtimedwait(set, info, -1));
+}
+
+int vos_sigtimedwait(vos_sigset_t set, vos_siginfo_t *info, const vos_timespec_t *timeout) {
+    extern int do_sigtimedwait(uint64_t set, void *info, int64_t timeout_ns);
+    int64_t ns = timeout ? (int64_t)timeout->sec * 1000000000 + timeout->nsec : -1;
+    return syscall_exit(do_sigtimedwait(set, info, ns));
+}
+
+vos_fd_t vos_signalfd(vos_fd_t fd, vos_sigset_t mask, int flags) {
+    extern int do_signalfd(int fd, uint64_t mask, int flags);
+    return syscall_exit(do_signalfd(fd, mask, flags));
 }
 
 /* ============================================================================
@@ -294,8 +617,9 @@ int vos_kill(vos_pid_t pid, int sig) {
  * ============================================================================ */
 
 int vos_sysinfo(vos_sysinfo_t *info) {
-    (void)info;
-    return -VOS_ENOTIMPL;
+    extern int do_sysinfo(vos_sysinfo_t *info);
+    if (!info) return -VOS_EINVAL;
+    return syscall_exit(do_sysinfo(info));
 }
 
 uint32_t vos_sysconf_nprocs(void) {
@@ -22,6 +22,10 @@
 typedef long off_t;
 #define __off_t_defined
 #endif
+#ifndef __ssize_t_defined
+typedef long ssize_t;
+#define __ssize_t_defined
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -87,12 +91,16 @@ void vos_panic(const char *fmt, ...);
 #define VOS_OK              0       /**< Success */
 #define VOS_ENOMEM          12      /**< Out of memory */
 #define VOS_ENOENT          2       /**< No such file or directory */
+#define VOS_ESRCH           3       /**< No such process */
+#define VOS_EINTR           4       /**< Interrupted by a signal */
 #define VOS_EACCES          13      /**< Permission denied */
 #define VOS_EBUSY           16      /**< Device or resource busy */
 #define VOS_EINVAL          22      /**< Invalid argument */
 #define VOS_ENOTIMPL        38      /**< Function not implemented */
 #define VOS_EBADF           9       /**< Bad file descriptor */
 #define VOS_EAGAIN          11      /**< Try again */
+#define VOS_EPIPE           32      /**< Read end of pipe closed */
+#define VOS_ECANCELED       125     /**< Linked operation cancelled */
 
 /* ============================================================================
  * Type Definitions
@@ -155,6 +163,44 @@ void *vos_slab_alloc(size_t size);
  */
 void vos_slab_free(void *ptr, size_t size);
 
+/*
+ * Anonymous mappings, hosted builds only: library code runs in the host
+ * process there, so its mappings are the host's. A bare-metal build has
+ * no mapping call for library code yet and leaves these out.
+ */
+#ifdef __unix__
+#define VOS_PROT_NONE       0x0
+#define VOS_PROT_READ       0x1
+#define VOS_PROT_WRITE      0x2
+#define VOS_PROT_EXEC       0x4
+
+#define VOS_MAP_PRIVATE     0x02
+#define VOS_MAP_ANONYMOUS   0x20
+#define VOS_MAP_FAILED      ((void *)-1)
+
+/**
+ * Map anonymous memory, zero-filled and page aligned
+ * @param addr Placement hint, or NULL
+ * @param len Length in bytes
+ * @param prot VOS_PROT_* flags
+ * @param flags VOS_MAP_PRIVATE | VOS_MAP_ANONYMOUS
+ * @return Start of the mapping, or VOS_MAP_FAILED
+ */
+void *vos_mmap(void *addr, size_t len, int prot, int flags);
+
+/**
+ * Unmap memory mapped by vos_mmap
+ * @return Error code
+ */
+int vos_munmap(void *addr, size_t len);
+
+/**
+ * Change the protection of mapped pages, e.g. VOS_PROT_NONE for a guard page
+ * @return Error code
+ */
+int vos_mprotect(void *addr, size_t len, int prot);
+#endif
+
 /** @} */
 
 /* ============================================================================
@@ -197,6 +243,99 @@ vos_pid_t vos_fork(void);
  */
 int vos_exec(const char *filename, char *const argv[]);
 
+typedef uint64_t vos_sigset_t;      /**< Signal mask: bit n-1 stands for signal n */
+
+#define VOS_SPAWN_MAX_ACTIONS   16  /**< Most file actions per spawn */
+
+/** One step applied to the child's descriptor table before it runs */
+typedef struct {
+    int action;                 /**< VOS_SPAWN_CLOSE, _DUP2 or _OPEN */
+    int fd;                     /**< Descriptor the action targets */
+    int srcfd;                  /**< VOS_SPAWN_DUP2: descriptor to copy */
+    int flags;                  /**< VOS_SPAWN_OPEN: open flags */
+    uint16_t mode;              /**< VOS_SPAWN_OPEN: mode for creation */
+    const char *path;           /**< VOS_SPAWN_OPEN: path, must outlive the spawn */
+} vos_spawn_action_t;
+
+#define VOS_SPAWN_CLOSE     0
+#define VOS_SPAWN_DUP2      1
+#define VOS_SPAWN_OPEN      2
+
+typedef struct {
+    unsigned int count;
+    vos_spawn_action_t actions[VOS_SPAWN_MAX_ACTIONS];
+} vos_spawn_file_actions_t;
+
+#define VOS_SPAWN_SETPRIORITY   0x1     /**< Use priority rather than the caller's */
+#define VOS_SPAWN_SETSIGMASK    0x2     /**< Use sigmask rather than the caller's */
+
+typedef struct {
+    unsigned int flags;         /**< VOS_SPAWN_SET* */
+    int priority;               /**< Priority (-20 to +19) */
+    vos_sigset_t sigmask;       /**< Blocked signals */
+} vos_spawnattr_t;
+
+/**
+ * Start a new process running a program, without copying the caller
+ *
+ * Equivalent to vos_fork() followed in the child by the file actions and
+ * vos_exec(), but done as one kernel operation: the caller's address
+ * space is never duplicated, so the cost does not grow with its size.
+ * The child inherits the caller's descriptors, priority and signal mask
+ * unless the file actions or attributes say otherwise.
+ * @param path Path to executable
+ * @param actions File actions, applied in order (NULL for none)
+ * @param attr Attributes (NULL for defaults)
+ * @param argv Command-line arguments
+ * @param envp Environment
+ * @return Child PID, or error code (no child is created on failure)
+ */
+vos_pid_t vos_spawn(const char *path, const vos_spawn_file_actions_t *actions,
+                    const vos_spawnattr_t *attr, char *const argv[], char *const envp[]);
+
+/**
+ * Empty a file action list
+ * @param actions List to initialise
+ */
+void vos_spawn_file_actions_init(vos_spawn_file_actions_t *actions);
+
+/**
+ * Add a close of fd to the list
+ * @return Error code (VOS_ENOMEM when the list is full)
+ */
+int vos_spawn_file_actions_addclose(vos_spawn_file_actions_t *actions, vos_fd_t fd);
+
+/**
+ * Add a dup2(srcfd, fd) to the list
+ * @return Error code
+ */
+int vos_spawn_file_actions_adddup2(vos_spawn_file_actions_t *actions, vos_fd_t srcfd, vos_fd_t fd);
+
+/**
+ * Add an open of path at fd to the list; path is not copied
+ * @return Error code
+ */
+int vos_spawn_file_actions_addopen(vos_spawn_file_actions_t *actions, vos_fd_t fd,
+                                   const char *path, int flags, int mode);
+
+/**
+ * Reset attributes to "inherit everything"
+ * @param attr Attributes to initialise
+ */
+void vos_spawnattr_init(vos_spawnattr_t *attr);
+
+/**
+ * Start the child at a given priority
+ * @return Error code (VOS_EINVAL outside -20..19)
+ */
+int vos_spawnattr_setpriority(vos_spawnattr_t *attr, int priority);
+
+/**
+ * Start the child with a given signal mask
+ * @return Error code
+ */
+int vos_spawnattr_setsigmask(vos_spawnattr_t *attr, vos_sigset_t mask);
+
 /**
  * Exit the current process
  * @param code Exit status code
@@ -212,7 +351,7 @@ void vos_exit(int code) __attribute__((noreturn));
 vos_pid_t vos_waitpid(vos_pid_t pid, int *status);
 
 /**
- * Get current process ID
+ * Get current process ID, without entering the kernel
  * @return Current PID
  */
 vos_pid_t vos_getpid(void);
@@ -231,6 +370,43 @@ vos_pid_t vos_getppid(void);
  */
 int vos_get_process_info(vos_pid_t pid, vos_process_info_t *info);
 
+#define VOS_CLONE_VM        0x00000100  /**< Share the address space */
+#define VOS_CLONE_FILES     0x00000400  /**< Share the descriptor table */
+#define VOS_CLONE_SIGHAND   0x00000800  /**< Share signal handlers (needs VOS_CLONE_VM) */
+#define VOS_CLONE_THREAD    0x00010000  /**< Join the caller's thread group (needs VOS_CLONE_SIGHAND) */
+#define VOS_CLONE_SETTLS    0x00080000  /**< Use tls as the thread pointer */
+
+/** What vos_thread_create() shares */
+#define VOS_CLONE_THREAD_FLAGS \
+    (VOS_CLONE_VM | VOS_CLONE_FILES | VOS_CLONE_SIGHAND | VOS_CLONE_THREAD)
+
+/**
+ * Start a task running fn(arg)
+ *
+ * Whatever the flags name is shared with the caller by reference; the
+ * rest is copied as by vos_fork(). The task exits when fn returns.
+ * Without VOS_CLONE_SETTLS the kernel sets up a zeroed thread-local
+ * storage block for it, with the thread pointer at its end.
+ * @param flags VOS_CLONE_* flags
+ * @param fn Function the task runs
+ * @param arg Argument for fn
+ * @param tls Thread pointer, with VOS_CLONE_SETTLS
+ * @return Thread ID of the new task, or error code
+ */
+vos_tid_t vos_clone(unsigned long flags, void (*fn)(void *arg), void *arg, void *tls);
+
+/**
+ * Start a thread in the current process running fn(arg)
+ * @return Thread ID, or error code
+ */
+vos_tid_t vos_thread_create(void (*fn)(void *arg), void *arg);
+
+/**
+ * Get current thread ID (equal to vos_getpid() in the main thread)
+ * @return Current TID
+ */
+vos_tid_t vos_gettid(void);
+
 /**
  * Yield CPU to next process
  */
@@ -253,6 +429,7 @@ void vos_yield(void);
 #define VOS_O_APPEND        0x08
 #define VOS_O_CREAT         0x100
 #define VOS_O_EXCL          0x200
+#define VOS_O_NONBLOCK      0x800
 #define VOS_O_TRUNC         0x1000
 
 typedef struct {
@@ -272,6 +449,15 @@ typedef struct {
     uint16_t mode;
 } vos_dirent_t;
 
+/** Scatter/gather segment for the vectored calls */
+typedef struct {
+    void *iov_base;             /**< Segment start */
+    size_t iov_len;             /**< Segment length in bytes */
+} vos_iovec_t;
+
+#define VOS_IOV_MAX         1024    /**< Most segments per call */
+#define VOS_RWF_NOWAIT      0x08    /**< vos_preadv2: fail with VOS_EAGAIN rather than wait for I/O */
+
 /**
  * Open a file
  * @param path File path
@@ -315,6 +501,63 @@ ssize_t vos_write(vos_fd_t fd, const void *buf, size_t count);
  */
 off_t vos_lseek(vos_fd_t fd, off_t offset, int whence);
 
+/**
+ * Read into several buffers with one call
+ * @param fd File descriptor
+ * @param iov Segments, filled in order
+ * @param iovcnt Number of segments (at most VOS_IOV_MAX)
+ * @return Number of bytes read or error code
+ */
+ssize_t vos_readv(vos_fd_t fd, const vos_iovec_t *iov, int iovcnt);
+
+/**
+ * Write several buffers with one call
+ * @param fd File descriptor
+ * @param iov Segments, written in order as one contiguous run
+ * @param iovcnt Number of segments (at most VOS_IOV_MAX)
+ * @return Number of bytes written or error code
+ */
+ssize_t vos_writev(vos_fd_t fd, const vos_iovec_t *iov, int iovcnt);
+
+/**
+ * Read at an offset without using or moving the file position
+ * @param fd File descriptor
+ * @param buf Buffer to read into
+ * @param count Number of bytes to read
+ * @param offset File offset to read from
+ * @return Number of bytes read or error code
+ */
+ssize_t vos_pread(vos_fd_t fd, void *buf, size_t count, off_t offset);
+
+/**
+ * Write at an offset without using or moving the file position
+ * @param fd File descriptor
+ * @param buf Buffer to write
+ * @param count Number of bytes to write
+ * @param offset File offset to write at
+ * @return Number of bytes written or error code
+ */
+ssize_t vos_pwrite(vos_fd_t fd, const void *buf, size_t count, off_t offset);
+
+/**
+ * Vectored positional read with flags
+ * @param fd File descriptor
+ * @param iov Segments, filled in order
+ * @param iovcnt Number of segments (at most VOS_IOV_MAX)
+ * @param offset File offset, or -1 to use and advance the file position
+ * @param flags VOS_RWF_* flags; with VOS_RWF_NOWAIT only cached data is
+ *              returned, and VOS_EAGAIN if none is
+ * @return Number of bytes read or error code
+ */
+ssize_t vos_preadv2(vos_fd_t fd, const vos_iovec_t *iov, int iovcnt, off_t offset, int flags);
+
+/**
+ * Flush a file's data to stable storage
+ * @param fd File descriptor
+ * @return Error code
+ */
+int vos_fsync(vos_fd_t fd);
+
 /**
  * Get file status
  * @param path File path
@@ -446,6 +689,22 @@ void vos_sem_wait(vos_semaphore_t *sem);
  */
 void vos_sem_post(vos_semaphore_t *sem);
 
+/**
+ * Wait on a futex word
+ * @param uaddr Futex word
+ * @param val Value *uaddr is expected to hold
+ * @return 0 once woken, or -VOS_EAGAIN if *uaddr no longer equals val
+ */
+int vos_futex_wait(uint32_t *uaddr, uint32_t val);
+
+/**
+ * Wake waiters on a futex word
+ * @param uaddr Futex word
+ * @param nr Most waiters to wake
+ * @return Number of waiters woken
+ */
+int vos_futex_wake(uint32_t *uaddr, int nr);
+
 /** @} */
 
 /* ============================================================================
@@ -485,6 +744,251 @@ ssize_t vos_pipe_read(vos_fd_t fd, void *buf, size_t len);
 
 /** @} */
 
+/* ============================================================================
+ * Asynchronous I/O Rings
+ * ============================================================================ */
+
+/**
+ * @defgroup IoRing Asynchronous I/O Rings
+ *
+ * Queue operations as SQEs, submit any number with one kernel entry, and
+ * reap CQEs by polling the completion ring. Each CQE carries the SQE's
+ * user_data and the result the synchronous call would have returned.
+ * @{
+ */
+
+#define VOS_IORING_OP_NOP           0
+#define VOS_IORING_OP_READ          1   /**< addr=buf, len, off (-1: file position) */
+#define VOS_IORING_OP_WRITE         2
+#define VOS_IORING_OP_READV         3   /**< addr=vos_iovec_t array, len=count */
+#define VOS_IORING_OP_WRITEV        4
+#define VOS_IORING_OP_OPENAT        5   /**< addr=path, op_flags=flags, len=mode */
+#define VOS_IORING_OP_CLOSE         6
+#define VOS_IORING_OP_FSYNC         7
+#define VOS_IORING_OP_PIPE          8   /**< addr=vos_fd_t[2], op_flags=VOS_O_NONBLOCK */
+#define VOS_IORING_OP_FUTEX_WAIT    9   /**< addr=word, off=expected value */
+#define VOS_IORING_OP_FUTEX_WAKE    10  /**< addr=word, len=most to wake */
+
+#define VOS_IOSQE_IO_LINK   (1U << 0)   /**< Start the next SQE only if this one succeeds */
+
+typedef struct {
+    uint8_t opcode;             /**< VOS_IORING_OP_* */
+    uint8_t flags;              /**< VOS_IOSQE_* */
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t op_flags;
+    uint64_t user_data;         /**< Copied to the CQE */
+} vos_io_sqe_t;
+
+typedef struct {
+    uint64_t user_data;
+    int32_t res;                /**< Result or negative error code */
+    uint32_t flags;
+} vos_io_cqe_t;
+
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+} __attribute__((aligned(64))) vos_io_ring_index_t;
+
+/** Ring indices and CQEs shared with the kernel */
+typedef struct {
+    vos_io_ring_index_t sq, cq;
+    uint32_t sq_ring_mask, cq_ring_mask;
+    uint32_t sq_ring_entries, cq_ring_entries;
+    uint32_t cq_overflow;       /**< Completions waiting for CQ space */
+    vos_io_cqe_t cqes[];
+} vos_io_rings_t;
+
+typedef struct {
+    vos_fd_t fd;
+    vos_io_rings_t *rings;
+    vos_io_sqe_t *sqes;
+    uint32_t sqe_tail;          /**< SQEs handed out, published on submit */
+} vos_io_ring_t;
+
+/**
+ * Create a ring
+ * @param entries Submission ring size (rounded up to a power of two, at most 4096)
+ * @param ring Ring to initialise
+ * @return Error code
+ */
+int vos_io_ring_init(unsigned int entries, vos_io_ring_t *ring);
+
+/**
+ * Destroy a ring; operations still in flight are cancelled
+ * @param ring Ring
+ * @return Error code
+ */
+int vos_io_ring_exit(vos_io_ring_t *ring);
+
+/**
+ * Get a blank SQE to fill in
+ * @param ring Ring
+ * @return SQE, or NULL if the submission ring is full
+ */
+vos_io_sqe_t *vos_io_get_sqe(vos_io_ring_t *ring);
+
+/** Fill an SQE: VOS_IORING_OP_READ into buf at off (-1 for the file position) */
+void vos_io_prep_read(vos_io_sqe_t *sqe, vos_fd_t fd, void *buf, uint32_t len, off_t off);
+/** Fill an SQE: VOS_IORING_OP_WRITE */
+void vos_io_prep_write(vos_io_sqe_t *sqe, vos_fd_t fd, const void *buf, uint32_t len, off_t off);
+/** Fill an SQE: VOS_IORING_OP_READV */
+void vos_io_prep_readv(vos_io_sqe_t *sqe, vos_fd_t fd, const vos_iovec_t *iov, int iovcnt, off_t off);
+/** Fill an SQE: VOS_IORING_OP_WRITEV */
+void vos_io_prep_writev(vos_io_sqe_t *sqe, vos_fd_t fd, const vos_iovec_t *iov, int iovcnt, off_t off);
+/** Fill an SQE: VOS_IORING_OP_OPENAT; the CQE result is the new fd */
+void vos_io_prep_open(vos_io_sqe_t *sqe, const char *path, int flags, int mode);
+/** Fill an SQE: VOS_IORING_OP_CLOSE */
+void vos_io_prep_close(vos_io_sqe_t *sqe, vos_fd_t fd);
+/** Fill an SQE: VOS_IORING_OP_FSYNC */
+void vos_io_prep_fsync(vos_io_sqe_t *sqe, vos_fd_t fd);
+/** Fill an SQE: VOS_IORING_OP_PIPE, storing the read and write ends in fds */
+void vos_io_prep_pipe(vos_io_sqe_t *sqe, vos_fd_t fds[2], int flags);
+/** Fill an SQE: VOS_IORING_OP_FUTEX_WAIT, completing once woken */
+void vos_io_prep_futex_wait(vos_io_sqe_t *sqe, uint32_t *uaddr, uint32_t val);
+/** Fill an SQE: VOS_IORING_OP_FUTEX_WAKE */
+void vos_io_prep_futex_wake(vos_io_sqe_t *sqe, uint32_t *uaddr, int nr);
+
+/**
+ * Publish the SQEs filled since the last submit and enter the kernel once
+ * @param ring Ring
+ * @return Number of SQEs consumed or error code
+ */
+int vos_io_submit(vos_io_ring_t *ring);
+
+/**
+ * Submit, then wait until at least wait_nr CQEs are ready
+ * @param ring Ring
+ * @param wait_nr CQEs to wait for
+ * @return Number of SQEs consumed or error code
+ */
+int vos_io_submit_and_wait(vos_io_ring_t *ring, unsigned int wait_nr);
+
+/**
+ * Poll for a completion without entering the kernel
+ * @param ring Ring
+ * @param cqe Set to the oldest unreaped CQE
+ * @return Error code; -VOS_EAGAIN if none is ready
+ */
+int vos_io_peek_cqe(vos_io_ring_t *ring, vos_io_cqe_t **cqe);
+
+/**
+ * Wait for a completion
+ * @param ring Ring
+ * @param cqe Set to the oldest unreaped CQE
+ * @return Error code; -VOS_EAGAIN if nothing in flight can complete
+ */
+int vos_io_wait_cqe(vos_io_ring_t *ring, vos_io_cqe_t **cqe);
+
+/**
+ * Release a CQE returned by peek or wait, freeing its slot
+ * @param ring Ring
+ * @param cqe CQE
+ */
+void vos_io_cqe_seen(vos_io_ring_t *ring, vos_io_cqe_t *cqe);
+
+/** @} */
+
+/* ============================================================================
+ * Coroutines
+ * ============================================================================ */
+
+/**
+ * @defgroup Coroutines Coroutine Runtime
+ *
+ * Stackful coroutines multiplexed onto a few worker threads, one per
+ * CPU. Each worker runs its own queue and steals half of another's when
+ * it runs dry. A coroutine that waits (vos_co_await, or I/O through
+ * vos_co_submit) parks: its worker runs something else, and I/O is
+ * issued through the worker's submission ring so one kernel entry
+ * covers every coroutine that queued an operation since the last one.
+ * Hosted, stacks are vos_mmap'd with a VOS_PROT_NONE guard page below
+ * them, so an overflow faults instead of corrupting a neighbour;
+ * elsewhere they come from the heap, unguarded.
+ *
+ * Everything except vos_co_run must be called from a coroutine.
+ * @{
+ */
+
+typedef struct vos_co vos_co_t;
+typedef void *(*vos_co_fn_t)(void *arg);
+
+#define VOS_CO_STACK_SIZE   (64 * 1024)     /**< Usable stack per coroutine */
+#define VOS_CO_MAX_WORKERS  8               /**< One per CPU at most */
+
+typedef struct {
+    uint64_t spawned;           /**< Coroutines started */
+    uint64_t switches;          /**< Switches into a coroutine */
+    uint64_t steals;            /**< Coroutines taken from another worker's queue */
+    uint64_t io_parked;         /**< Operations a coroutine parked for */
+    uint64_t io_enters;         /**< Ring submissions that carried them */
+} vos_co_stats_t;
+
+/**
+ * Run main(arg) as a coroutine on nr_workers workers, returning once it
+ * and every coroutine it started have finished
+ * @param nr_workers Worker threads, 1 to VOS_CO_MAX_WORKERS; the caller is the first
+ * @param main First coroutine
+ * @param arg Argument for main
+ * @param result Set to main's return value (may be NULL)
+ * @return Error code
+ */
+int vos_co_run(unsigned int nr_workers, vos_co_fn_t main, void *arg, void **result);
+
+/**
+ * Start a coroutine on the current worker
+ * @param fn Function it runs
+ * @param arg Argument for fn
+ * @return Handle for vos_co_await, or NULL if out of memory
+ */
+vos_co_t *vos_co_spawn(vos_co_fn_t fn, void *arg);
+
+/**
+ * Let other coroutines run; this one goes to the back of the queue
+ */
+void vos_co_yield(void);
+
+/**
+ * Park until co finishes, then free it
+ *
+ * Every coroutine is awaited at most once; ones never awaited are freed
+ * when vos_co_run returns.
+ * @param co Coroutine from vos_co_spawn
+ * @return co's return value
+ */
+void *vos_co_await(vos_co_t *co);
+
+/**
+ * Get an SQE on the current worker's ring, to fill in and pass straight
+ * to vos_co_submit (nothing may park in between)
+ * @return SQE
+ */
+vos_io_sqe_t *vos_co_get_sqe(void);
+
+/**
+ * Issue a filled SQE and park until it completes
+ * @param sqe SQE from vos_co_get_sqe; its user_data is the runtime's
+ * @return The CQE's result
+ */
+int vos_co_submit(vos_io_sqe_t *sqe);
+
+/** vos_pread that parks the coroutine rather than blocking the worker */
+ssize_t vos_co_pread(vos_fd_t fd, void *buf, size_t count, off_t offset);
+/** vos_pwrite that parks the coroutine rather than blocking the worker */
+ssize_t vos_co_pwrite(vos_fd_t fd, const void *buf, size_t count, off_t offset);
+
+/**
+ * Counters summed over the workers of the current or last run
+ * @param stats Filled in
+ */
+void vos_co_get_stats(vos_co_stats_t *stats);
+
+/** @} */
+
 /* ============================================================================
  * Time & Clock
  * ============================================================================ */
@@ -500,7 +1004,7 @@ typedef struct {
 } vos_timespec_t;
 
 /**
- * Get monotonic clock time
+ * Get monotonic clock time (time since boot), without entering the kernel
  * @param ts Pointer to timespec structure
  * @return Error code
  */
@@ -533,28 +1037,153 @@ int vos_nanosleep(const vos_timespec_t *ts);
 
 typedef void (*vos_signal_handler_t)(int sig);
 
-#define VOS_SIGTERM 15      /**< Termination signal */
-#define VOS_SIGKILL 9       /**< Kill signal */
+#define VOS_SIG_DFL ((vos_signal_handler_t)0)   /**< Default action */
+#define VOS_SIG_IGN ((vos_signal_handler_t)1)   /**< Ignore */
+#define VOS_SIG_ERR ((vos_signal_handler_t)-1)  /**< vos_signal() failed */
+
+#define VOS_SIGHUP  1       /**< Hangup */
 #define VOS_SIGINT  2       /**< Interrupt signal */
-#define VOS_SIGSEGV 11      /**< Segmentation fault */
 #define VOS_SIGABRT 6       /**< Abort signal */
+#define VOS_SIGKILL 9       /**< Kill signal */
+#define VOS_SIGUSR1 10      /**< User-defined */
+#define VOS_SIGSEGV 11      /**< Segmentation fault */
+#define VOS_SIGUSR2 12      /**< User-defined */
+#define VOS_SIGPIPE 13      /**< Write to a pipe with no reader */
+#define VOS_SIGALRM 14      /**< Timer */
+#define VOS_SIGTERM 15      /**< Termination signal */
+#define VOS_SIGCHLD 17      /**< Child stopped or exited (ignored by default) */
+#define VOS_SIGCONT 18      /**< Continue if stopped */
+#define VOS_SIGSTOP 19      /**< Stop; cannot be caught or ignored */
+#define VOS_SIGTSTP 20      /**< Stop from the terminal */
+#define VOS_SIGRTMIN 32     /**< First real-time signal: each one sent is queued */
+#define VOS_SIGRTMAX 64     /**< Last real-time signal */
+
+/** Bit standing for sig in a vos_sigset_t */
+#define VOS_SIGMASK(sig)    (1ULL << ((sig) - 1))
+
+#define VOS_SA_NODEFER      0x40000000  /**< Don't block the signal while its handler runs */
+#define VOS_SA_RESETHAND    0x80000000  /**< Restore VOS_SIG_DFL once delivered */
+
+/** Layout matches the kernel's k_sigaction_t */
+typedef struct {
+    vos_signal_handler_t handler;   /**< Function, VOS_SIG_DFL or VOS_SIG_IGN */
+    vos_sigset_t mask;              /**< Also blocked while the handler runs */
+    unsigned int flags;             /**< VOS_SA_* */
+} vos_sigaction_t;
+
+#define VOS_SIG_BLOCK       0       /**< vos_sigprocmask: add set to the mask */
+#define VOS_SIG_UNBLOCK     1       /**< vos_sigprocmask: remove set from the mask */
+#define VOS_SIG_SETMASK     2       /**< vos_sigprocmask: replace the mask */
+
+#define VOS_SI_USER         0       /**< Sent by vos_kill */
+#define VOS_SI_KERNEL       0x80    /**< Raised by the kernel, or its siginfo was not queued */
+#define VOS_SI_QUEUE        (-1)    /**< Sent by vos_sigqueue */
+#define VOS_SI_TKILL        (-6)    /**< Sent by vos_tkill */
+
+/** A signal taken synchronously; also the record a signalfd read returns */
+typedef struct {
+    int32_t signo;
+    int32_t code;                   /**< VOS_SI_*: how it was sent */
+    vos_pid_t pid;                  /**< Sender's process ID */
+    uint32_t pad;
+    uint64_t value;                 /**< vos_sigqueue() payload */
+} vos_siginfo_t;
+
+#define VOS_SFD_NONBLOCK    0x800   /**< vos_signalfd: reads fail with VOS_EAGAIN rather than wait */
 
 /**
  * Register signal handler
  * @param sig Signal number
- * @param handler Handler function
- * @return Previous handler or error
+ * @param handler Handler function, VOS_SIG_DFL or VOS_SIG_IGN
+ * @return Previous handler, or VOS_SIG_ERR
  */
 vos_signal_handler_t vos_signal(int sig, vos_signal_handler_t handler);
 
+/**
+ * Examine and change a signal's disposition
+ * @param sig Signal number (not VOS_SIGKILL or VOS_SIGSTOP if act is set)
+ * @param act New disposition, or NULL
+ * @param oact Set to the old one, unless NULL
+ * @return Error code
+ */
+int vos_sigaction(int sig, const vos_sigaction_t *act, vos_sigaction_t *oact);
+
 /**
  * Send signal to process
+ *
+ * Whichever of its threads does not block the signal takes it. If the
+ * default action is fatal, every thread goes.
  * @param pid Process ID
- * @param sig Signal number
+ * @param sig Signal number, or 0 to check that pid exists
  * @return Error code
  */
 int vos_kill(vos_pid_t pid, int sig);
 
+/**
+ * Send signal to one thread
+ * @param tid Thread ID
+ * @param sig Signal number
+ * @return Error code
+ */
+int vos_tkill(vos_tid_t tid, int sig);
+
+/**
+ * Send signal to process with a value, which its siginfo carries
+ * @param pid Process ID
+ * @param sig Signal number; real-time signals queue every instance
+ * @param value Payload
+ * @return Error code (VOS_EAGAIN if too many are queued)
+ */
+int vos_sigqueue(vos_pid_t pid, int sig, uint64_t value);
+
+/**
+ * Examine and change the calling thread's blocked signals; signals it
+ * unblocks that are pending are delivered before this returns
+ * @param how VOS_SIG_BLOCK, VOS_SIG_UNBLOCK or VOS_SIG_SETMASK
+ * @param set Signals, or NULL to only read the mask
+ * @param oset Set to the old mask, unless NULL
+ * @return Error code
+ */
+int vos_sigprocmask(int how, const vos_sigset_t *set, vos_sigset_t *oset);
+
+/**
+ * Get the signals that are pending and blocked
+ * @param set Filled in
+ * @return Error code
+ */
+int vos_sigpending(vos_sigset_t *set);
+
+/**
+ * Take a pending signal in set without running its handler, waiting
+ * for one if need be. The signals should be blocked, or they may be
+ * delivered first.
+ * @param set Signals to wait for
+ * @param info Filled in, unless NULL
+ * @return Signal number, or error code (VOS_EINTR if another signal arrived)
+ */
+int vos_sigwaitinfo(vos_sigset_t set, vos_siginfo_t *info);
+
+/**
+ * vos_sigwaitinfo() with a time limit
+ * @param set Signals to wait for
+ * @param info Filled in, unless NULL
+ * @param timeout Longest wait; zero only polls
+ * @return Signal number, or error code (VOS_EAGAIN on timeout)
+ */
+int vos_sigtimedwait(vos_sigset_t set, vos_siginfo_t *info, const vos_timespec_t *timeout);
+
+/**
+ * Read signals as vos_siginfo_t records from a file descriptor, for
+ * event loops (a read through a submission ring completes when one
+ * arrives). Reads take the reader's pending signals in mask, which
+ * should be blocked.
+ * @param fd -1 for a new descriptor, or a signalfd to give a new mask
+ * @param mask Signals to read
+ * @param flags 0 or VOS_SFD_NONBLOCK
+ * @return File descriptor or error code
+ */
+vos_fd_t vos_signalfd(vos_fd_t fd, vos_sigset_t mask, int flags);
+
 /** @} */
 
 /* ============================================================================
@@ -572,6 +1201,8 @@ typedef struct {
     uint32_t used_memory;       /**< Used memory in pages */
     uint32_t nr_processes;      /**< Number of processes */
     uint32_t uptime;            /**< System uptime in seconds */
+    uint32_t shared_memory;     /**< tmpfs pages (included in cached_memory) */
+    uint32_t cached_memory;     /**< Page cache pages */
 } vos_sysinfo_t;
 
 /**
@@ -0,0 +1,621 @@
+/**
+ * @file VosCo.c
+ * @brief Coroutine Runtime (M:N green threads over worker threads)
+ *
+ * Each worker runs a loop on its own thread's stack: pop a coroutine from
+ * its run queue, switch to it, and when it switches back act on why it
+ * did (yield, park or exit). A coroutine only ever switches to the loop
+ * of the worker it is running on, never straight to another coroutine,
+ * so anything that must happen after it is off its stack - dropping the
+ * lock a waker will take, freeing the stack - is done by the loop.
+ *
+ * Run queues are intrusive FIFOs under a per-worker lock. Only the owner
+ * pushes; a worker whose queue is empty and that has no I/O to reap takes
+ * half of another's, oldest first. A worker with nothing to run, steal
+ * or reap sleeps: on its ring if it has I/O in flight, else on a futex
+ * that a push bumps whenever some worker is asleep, and that the last
+ * coroutine's exit bumps to let every loop return.
+ *
+ * I/O goes through a submission ring per worker. A coroutine fills an
+ * SQE with its own address as user_data and parks; the loop submits once
+ * its queue runs dry, so every operation queued meanwhile shares one
+ * kernel entry, and requeues each coroutine as its CQE is reaped.
+ *
+ * The switch saves only the callee-saved registers and the stack
+ * pointer; floating-point control state is the worker's, shared by every
+ * coroutine it runs.
+ */
+
+#include "Vos.h"
+
+#ifdef __unix__
+#include <pthread.h>
+#endif
+
+#define CO_GUARD_SIZE       4096
+#define CO_STACK_CACHE_MAX  64      /* Per worker */
+#define CO_RING_ENTRIES     64
+#define CO_STEAL_MAX        64
+
+typedef enum {
+    CO_YIELD,                   /* Back on the run queue */
+    CO_PARK,                    /* Waiting; whoever wakes it requeues it */
+    CO_EXIT,
+} co_why_t;
+
+/*
+ * Sits in the top bytes of the stack's memory, above the first frame, so
+ * an overflow runs into the guard page rather than into this.
+ */
+typedef struct co_stack {
+    struct co_stack *next;      /* Stack cache */
+    void *base;                 /* Start of the mapping or allocation */
+    bool mapped;                /* vos_mmap'd with a guard page, else vos_malloc'd */
+} __attribute__((aligned(16))) co_stack_t;
+
+struct vos_co {
+    void *sp;                   /* Saved while switched out */
+    vos_co_fn_t fn;
+    void *arg;
+    void *result;
+    co_stack_t *stack;
+    vos_co_t *next;             /* Run queue */
+    vos_spinlock_t lock;        /* done, waiter and the zombie links */
+    bool done;
+    vos_co_t *waiter;           /* Parked in vos_co_await on this one */
+    vos_co_t *zombie_next, **zombie_pprev;
+    int32_t io_res;
+};
+
+typedef struct {
+    unsigned int idx;
+    void *sp;                   /* The loop's, while a coroutine runs */
+    vos_co_t *current;
+    co_why_t why;
+    vos_spinlock_t *unlock;     /* Dropped once a parking coroutine is off its stack */
+
+    vos_spinlock_t lock;        /* Run queue */
+    vos_co_t *head, *tail;
+    unsigned int nr_queued;
+
+    vos_io_ring_t ring;
+    unsigned int nr_inflight;   /* Parked on a CQE, submitted or not */
+    co_stack_t *stacks;
+    unsigned int nr_stacks;
+    vos_co_stats_t stats;
+#ifdef __unix__
+    pthread_t thread;
+#endif
+} __attribute__((aligned(64))) co_worker_t;
+
+static struct {
+    co_worker_t workers[VOS_CO_MAX_WORKERS];
+    unsigned int nr_workers;
+    int live;                   /* Spawned and not finished */
+    uint32_t idle_seq;          /* Futex word idle workers sleep on */
+    int nr_idle;                /* Asleep on idle_seq, or about to be */
+    vos_spinlock_t zombie_lock;
+    vos_co_t *zombies;          /* Finished, not yet awaited */
+} g_co;
+
+static _Thread_local co_worker_t *t_worker;
+
+/*
+ * A coroutine can resume on another thread than it parked on, and the
+ * compiler may keep a thread-local's address in a register across what
+ * looks to it like an ordinary call. Reading it out of line each time
+ * keeps coroutine code from using the old thread's worker.
+ */
+static __attribute__((noinline)) co_worker_t *co_worker(void) {
+    return t_worker;
+}
+
+/* ============================================================================
+ * Context switch
+ * ============================================================================ */
+
+#ifdef VOS_ARCH_X86_64
+/* Save callee-saved registers on the current stack, store rsp in *from, load to */
+void __vos_co_switch_asm(void **from, void *to);
+void __vos_co_start_asm(void);
+void __vos_co_main(vos_co_t *co);
+
+__asm__(
+    ".text\n"
+    ".globl __vos_co_switch_asm\n"
+    ".type __vos_co_switch_asm, @function\n"
+    "__vos_co_switch_asm:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size __vos_co_switch_asm, .-__vos_co_switch_asm\n"
+    /* First switch to a coroutine lands here with it in rbx */
+    ".globl __vos_co_start_asm\n"
+    ".type __vos_co_start_asm, @function\n"
+    "__vos_co_start_asm:\n"
+    "    movq %rbx, %rdi\n"
+    "    andq $-16, %rsp\n"
+    "    call __vos_co_main\n"
+    "    ud2\n"
+    ".size __vos_co_start_asm, .-__vos_co_start_asm\n"
+);
+
+/* Lay out a frame for __vos_co_switch_asm to pop: six registers, then __vos_co_start_asm */
+static void co_init_frame(vos_co_t *co, void *stack_top) {
+    uint64_t *sp = (uint64_t *)((uintptr_t)stack_top & ~(uintptr_t)15);
+    *--sp = 0;
+    *--sp = (uint64_t)(uintptr_t)__vos_co_start_asm;
+    *--sp = 0;                          /* rbp */
+    *--sp = (uint64_t)(uintptr_t)co;    /* rbx */
+    *--sp = 0;                          /* r12 */
+    *--sp = 0;                          /* r13 */
+    *--sp = 0;                          /* r14 */
+    *--sp = 0;                          /* r15 */
+    co->sp = sp;
+}
+
+static inline void co_switch(void **from, void *to) {
+    __vos_co_switch_asm(from, to);
+}
+
+#else
+/* vos_co_run refuses to start here, so nothing is ever switched to */
+static void co_init_frame(vos_co_t *co, void *stack_top) {
+    (void)stack_top;
+    co->sp = NULL;
+}
+
+static inline void co_switch(void **from, void *to) {
+    (void)from;
+    (void)to;
+}
+#endif
+
+/* ============================================================================
+ * Stacks
+ * ============================================================================ */
+
+static co_stack_t *co_stack_alloc(co_worker_t *w) {
+    co_stack_t *stack = w->stacks;
+    if (stack) {
+        w->stacks = stack->next;
+        w->nr_stacks--;
+        return stack;
+    }
+
+    char *base;
+#ifdef __unix__
+    size_t len = CO_GUARD_SIZE + VOS_CO_STACK_SIZE;
+    base = vos_mmap(NULL, len, VOS_PROT_READ | VOS_PROT_WRITE,
+                          VOS_MAP_PRIVATE | VOS_MAP_ANONYMOUS);
+    if (base != VOS_MAP_FAILED) {
+        /* Without the guard an overflow would run on into whatever is mapped below */
+        if (vos_mprotect(base, CO_GUARD_SIZE, VOS_PROT_NONE) < 0) {
+            vos_munmap(base, len);
+            return NULL;
+        }
+        stack = (co_stack_t *)(base + len) - 1;
+        stack->base = base;
+        stack->mapped = true;
+        return stack;
+    }
+#endif
+    /* No mmap: an unguarded stack from the heap */
+    base = vos_malloc(VOS_CO_STACK_SIZE, VOS_GFP_KERNEL);
+    if (!base) return NULL;
+    stack = (co_stack_t *)(base + VOS_CO_STACK_SIZE) - 1;
+    stack->base = base;
+    stack->mapped = false;
+    return stack;
+}
+
+static void co_stack_release(co_stack_t *stack) {
+#ifdef __unix__
+    if (stack->mapped) {
+        vos_munmap(stack->base, CO_GUARD_SIZE + VOS_CO_STACK_SIZE);
+        return;
+    }
+#endif
+    vos_free(stack->base);
+}
+
+static void co_stack_free(co_worker_t *w, co_stack_t *stack) {
+    if (w->nr_stacks >= CO_STACK_CACHE_MAX) {
+        co_stack_release(stack);
+        return;
+    }
+    stack->next = w->stacks;
+    w->stacks = stack;
+    w->nr_stacks++;
+}
+
+/* ============================================================================
+ * Run queues
+ * ============================================================================ */
+
+static void co_wake_idle(int nr) {
+    __atomic_add_fetch(&g_co.idle_seq, 1, __ATOMIC_RELEASE);
+    vos_futex_wake(&g_co.idle_seq, nr);
+}
+
+static void runq_push(co_worker_t *w, vos_co_t *co) {
+    co->next = NULL;
+    vos_spin_lock(&w->lock);
+    if (w->tail) w->tail->next = co;
+    else w->head = co;
+    w->tail = co;
+    w->nr_queued++;
+    /* Under the lock, so runq_any() in co_idle sees this push or we see it */
+    bool wake = __atomic_load_n(&g_co.nr_idle, __ATOMIC_RELAXED) != 0;
+    vos_spin_unlock(&w->lock);
+    if (wake) co_wake_idle(1);
+}
+
+/* Whether any queue holds work, each read under its lock: see runq_push */
+static bool runq_any(void) {
+    for (unsigned int i = 0; i < g_co.nr_workers; i++) {
+        co_worker_t *v = &g_co.workers[i];
+        vos_spin_lock(&v->lock);
+        bool any = v->head != NULL;
+        vos_spin_unlock(&v->lock);
+        if (any) return true;
+    }
+    return false;
+}
+
+static vos_co_t *runq_pop(co_worker_t *w) {
+    if (!__atomic_load_n(&w->head, __ATOMIC_RELAXED)) return NULL;
+
+    vos_spin_lock(&w->lock);
+    vos_co_t *co = w->head;
+    if (co) {
+        w->head = co->next;
+        if (!w->head) w->tail = NULL;
+        w->nr_queued--;
+    }
+    vos_spin_unlock(&w->lock);
+    return co;
+}
+
+/* Move half of a busier worker's queue onto ours and return the first of it */
+static vos_co_t *runq_steal(co_worker_t *w) {
+    for (unsigned int i = 1; i < g_co.nr_workers; i++) {
+        co_worker_t *victim = &g_co.workers[(w->idx + i) % g_co.nr_workers];
+        if (!__atomic_load_n(&victim->head, __ATOMIC_RELAXED)) continue;
+        if (!vos_spin_trylock(&victim->lock)) continue;
+
+        unsigned int n = (victim->nr_queued + 1) / 2;
+        if (n > CO_STEAL_MAX) n = CO_STEAL_MAX;
+        vos_co_t *first = victim->head, *last = first;
+        for (unsigned int k = 1; k < n; k++) last = last->next;
+        if (first) {
+            victim->head = last->next;
+            if (!victim->head) victim->tail = NULL;
+            victim->nr_queued -= n;
+        }
+        vos_spin_unlock(&victim->lock);
+        if (!first) continue;
+
+        w->stats.steals += n;
+        vos_co_t *co = first->next;
+        last->next = NULL;
+        if (n > 1) {
+            vos_spin_lock(&w->lock);
+            if (w->tail) w->tail->next = co;
+            else w->head = co;
+            w->tail = last;
+            w->nr_queued += n - 1;
+            vos_spin_unlock(&w->lock);
+        }
+        return first;
+    }
+    return NULL;
+}
+
+/* ============================================================================
+ * I/O
+ * ============================================================================ */
+
+/* Submit what is queued and requeue the coroutines whose operations completed */
+static void co_io_poll(co_worker_t *w) {
+    if (!w->nr_inflight) return;
+
+    /* Enter even with nothing new: operations that would block are retried */
+    if (w->ring.sqe_tail != w->ring.rings->sq.tail) w->stats.io_enters++;
+    vos_io_submit(&w->ring);
+
+    vos_io_cqe_t *cqe;
+    while (vos_io_peek_cqe(&w->ring, &cqe) == 0) {
+        vos_co_t *co = (vos_co_t *)(uintptr_t)cqe->user_data;
+        co->io_res = cqe->res;
+        vos_io_cqe_seen(&w->ring, cqe);
+        w->nr_inflight--;
+        runq_push(w, co);
+    }
+}
+
+/* ============================================================================
+ * Scheduling
+ * ============================================================================ */
+
+/* Switch from the running coroutine back to its worker's loop */
+static void co_switch_out(co_why_t why, vos_spinlock_t *unlock) {
+    co_worker_t *w = co_worker();
+    vos_co_t *co = w->current;
+    w->why = why;
+    w->unlock = unlock;
+    co_switch(&co->sp, w->sp);
+}
+
+void __vos_co_main(vos_co_t *co) {
+    co->result = co->fn(co->arg);
+    co_switch_out(CO_EXIT, NULL);
+}
+
+/* co has returned: free its stack and hand its result to the awaiter, if any */
+static void co_finish(co_worker_t *w, vos_co_t *co) {
+    co_stack_free(w, co->stack);
+    co->stack = NULL;
+
+    vos_spin_lock(&co->lock);
+    co->done = true;
+    vos_co_t *waiter = co->waiter;
+    if (!waiter) {
+        vos_spin_lock(&g_co.zombie_lock);
+        co->zombie_next = g_co.zombies;
+        if (g_co.zombies) g_co.zombies->zombie_pprev = &co->zombie_next;
+        co->zombie_pprev = &g_co.zombies;
+        g_co.zombies = co;
+        vos_spin_unlock(&g_co.zombie_lock);
+    }
+    vos_spin_unlock(&co->lock);
+
+    if (waiter) runq_push(w, waiter);
+    if (__atomic_sub_fetch(&g_co.live, 1, __ATOMIC_RELEASE) == 0) co_wake_idle(INT32_MAX);
+}
+
+/*
+ * Nothing to run, steal or reap. With I/O in flight, wait on the ring for
+ * a completion; otherwise sleep until a push or the last exit bumps
+ * idle_seq. Either way the caller looks again.
+ */
+static void co_idle(co_worker_t *w) {
+    if (w->nr_inflight) {
+        vos_io_submit_and_wait(&w->ring, 1);
+        return;
+    }
+
+    uint32_t seq = __atomic_load_n(&g_co.idle_seq, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&g_co.nr_idle, 1, __ATOMIC_RELAXED);
+    /* A push that missed nr_idle is visible here */
+    if (__atomic_load_n(&g_co.live, __ATOMIC_ACQUIRE) && !runq_any())
+        vos_futex_wait(&g_co.idle_seq, seq);
+    __atomic_sub_fetch(&g_co.nr_idle, 1, __ATOMIC_RELAXED);
+}
+
+static void co_loop(co_worker_t *w) {
+    t_worker = w;
+
+    for (;;) {
+        vos_co_t *co = runq_pop(w);
+        if (!co) {
+            co_io_poll(w);
+            co = runq_pop(w);
+        }
+        if (!co) co = runq_steal(w);
+        if (!co) {
+            if (!__atomic_load_n(&g_co.live, __ATOMIC_ACQUIRE)) break;
+            co_idle(w);
+            continue;
+        }
+
+        w->current = co;
+        w->stats.switches++;
+        co_switch(&w->sp, co->sp);
+        w->current = NULL;
+
+        switch (w->why) {
+        case CO_YIELD:
+            runq_push(w, co);
+            break;
+        case CO_PARK:
+            if (w->unlock) vos_spin_unlock(w->unlock);
+            break;
+        case CO_EXIT:
+            co_finish(w, co);
+            break;
+        }
+    }
+}
+
+#ifdef __unix__
+static void *co_worker_thread(void *arg) {
+    extern void cpu_bind(unsigned int cpu);
+    co_worker_t *w = arg;
+    cpu_bind(w->idx);
+    co_loop(w);
+    return NULL;
+}
+#endif
+
+/* ============================================================================
+ * API
+ * ============================================================================ */
+
+static vos_co_t *co_create(co_worker_t *w, vos_co_fn_t fn, void *arg) {
+    vos_co_t *co = vos_malloc(sizeof(*co), VOS_GFP_KERNEL);
+    if (!co) return NULL;
+    *co = (vos_co_t){ .fn = fn, .arg = arg };
+    co->stack = co_stack_alloc(w);
+    if (!co->stack) {
+        vos_free(co);
+        return NULL;
+    }
+    co_init_frame(co, co->stack);
+
+    w->stats.spawned++;
+    __atomic_add_fetch(&g_co.live, 1, __ATOMIC_RELAXED);
+    runq_push(w, co);
+    return co;
+}
+
+vos_co_t *vos_co_spawn(vos_co_fn_t fn, void *arg) {
+    co_worker_t *w = co_worker();
+    if (!fn || !w) return NULL;
+    return co_create(w, fn, arg);
+}
+
+void vos_co_yield(void) {
+    co_switch_out(CO_YIELD, NULL);
+}
+
+void *vos_co_await(vos_co_t *co) {
+    co_worker_t *w = co_worker();
+
+    vos_spin_lock(&co->lock);
+    if (co->done) {
+        vos_spin_lock(&g_co.zombie_lock);
+        *co->zombie_pprev = co->zombie_next;
+        if (co->zombie_next) co->zombie_next->zombie_pprev = co->zombie_pprev;
+        vos_spin_unlock(&g_co.zombie_lock);
+        vos_spin_unlock(&co->lock);
+    } else {
+        /* co_finish takes the lock only once we are off our stack */
+        co->waiter = w->current;
+        co_switch_out(CO_PARK, &co->lock);
+    }
+
+    void *result = co->result;
+    vos_free(co);
+    return result;
+}
+
+vos_io_sqe_t *vos_co_get_sqe(void) {
+    co_worker_t *w = co_worker();
+    vos_io_sqe_t *sqe = vos_io_get_sqe(&w->ring);
+    if (!sqe) {
+        /* Full: what is queued goes in now; its CQEs wait for the loop */
+        vos_io_submit(&w->ring);
+        w->stats.io_enters++;
+        sqe = vos_io_get_sqe(&w->ring);
+    }
+    return sqe;
+}
+
+int vos_co_submit(vos_io_sqe_t *sqe) {
+    co_worker_t *w = co_worker();
+    vos_co_t *co = w->current;
+    sqe->user_data = (uint64_t)(uintptr_t)co;
+    w->nr_inflight++;
+    w->stats.io_parked++;
+    co_switch_out(CO_PARK, NULL);
+    return co->io_res;
+}
+
+ssize_t vos_co_pread(vos_fd_t fd, void *buf, size_t count, off_t offset) {
+    vos_io_sqe_t *sqe = vos_co_get_sqe();
+    if (!sqe) return -VOS_EAGAIN;
+    vos_io_prep_read(sqe, fd, buf, (uint32_t)count, offset);
+    return vos_co_submit(sqe);
+}
+
+ssize_t vos_co_pwrite(vos_fd_t fd, const void *buf, size_t count, off_t offset) {
+    vos_io_sqe_t *sqe = vos_co_get_sqe();
+    if (!sqe) return -VOS_EAGAIN;
+    vos_io_prep_write(sqe, fd, buf, (uint32_t)count, offset);
+    return vos_co_submit(sqe);
+}
+
+void vos_co_get_stats(vos_co_stats_t *stats) {
+    *stats = (vos_co_stats_t){ 0 };
+    for (unsigned int i = 0; i < g_co.nr_workers; i++) {
+        const vos_co_stats_t *s = &g_co.workers[i].stats;
+        stats->spawned += s->spawned;
+        stats->switches += s->switches;
+        stats->steals += s->steals;
+        stats->io_parked += s->io_parked;
+        stats->io_enters += s->io_enters;
+    }
+}
+
+int vos_co_run(unsigned int nr_workers, vos_co_fn_t main, void *arg, void **result) {
+#ifndef VOS_ARCH_X86_64
+    (void)nr_workers;
+    (void)main;
+    (void)arg;
+    (void)result;
+    return -VOS_ENOTIMPL;
+#else
+    if (!main || nr_workers == 0 || nr_workers > VOS_CO_MAX_WORKERS) return -VOS_EINVAL;
+    if (t_worker) return -VOS_EINVAL;   /* Not from inside a run */
+#ifndef __unix__
+    nr_workers = 1;                     /* No threads to run more on */
+#endif
+
+    g_co.nr_workers = nr_workers;
+    g_co.live = 0;
+    g_co.nr_idle = 0;
+    g_co.zombies = NULL;
+    int ret = 0;
+    unsigned int nr_rings = 0;
+    for (unsigned int i = 0; i < nr_workers; i++) {
+        co_worker_t *w = &g_co.workers[i];
+        *w = (co_worker_t){ .idx = i };
+        /* Rings get their fds here, before any worker thread exists */
+        ret = vos_io_ring_init(CO_RING_ENTRIES, &w->ring);
+        if (ret < 0) break;
+        nr_rings++;
+    }
+
+    vos_co_t *first = ret < 0 ? NULL : co_create(&g_co.workers[0], main, arg);
+    if (!first && ret == 0) ret = -VOS_ENOMEM;
+
+    if (ret == 0) {
+        unsigned int started = 1;
+#ifdef __unix__
+        for (; started < nr_workers; started++) {
+            co_worker_t *w = &g_co.workers[started];
+            if (pthread_create(&w->thread, NULL, co_worker_thread, w) != 0) break;
+        }
+#endif
+        co_loop(&g_co.workers[0]);
+        t_worker = NULL;
+#ifdef __unix__
+        for (unsigned int i = 1; i < started; i++)
+            pthread_join(g_co.workers[i].thread, NULL);
+#endif
+        (void)started;
+        if (result) *result = first->result;
+    }
+
+    /* Everything has finished; free what was never awaited */
+    while (g_co.zombies) {
+        vos_co_t *co = g_co.zombies;
+        g_co.zombies = co->zombie_next;
+        vos_free(co);
+    }
+    for (unsigned int i = 0; i < nr_workers; i++) {
+        co_worker_t *w = &g_co.workers[i];
+        while (w->stacks) {
+            co_stack_t *stack = w->stacks;
+            w->stacks = stack->next;
+            co_stack_release(stack);
+        }
+        w->nr_stacks = 0;
+        if (i < nr_rings) vos_io_ring_exit(&w->ring);
+    }
+    return ret;
+#endif
+}
@@ -10,54 +10,3754 @@
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <pthread.h>
+#ifdef __unix__
+#include <spawn.h>
+#include <sys/wait.h>
+#endif
+#include <kernel.h>
+#include <Vos.h>
 
-/* Forward declarations */
-extern void kernel_main(void);
-
-/* Kernel stubs for testing */
-void pr_info(const char *fmt, ...) {
-    printf("[INFO] ");
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-}
-
-void pr_err(const char *fmt, ...) {
-    printf("[ERROR] ");
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-}
-
-void pr_debug(const char *fmt, ...) {
-    #ifdef DEBUG
-    printf("[DEBUG] ");
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-    #endif
-}
-
-void pr_panic(const char *fmt, ...) {
-    printf("[PANIC] ");
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-    printf("\nKernel halted.\n");
+/* pr_panic() ends here */
+void halt(void) {
     exit(1);
 }
 
-void halt(void) {
-    printf("[HALT] System halted.\n");
-    exit(0);
+/* ============================================================================
+ * Benchmarks: test-kernel bench <name> [args]
+ * ============================================================================ */
+
+static double now_sec(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_init(void) {
+    extern int block_driver_init(void);
+    init_memory();
+    init_time();
+    init_softirq();
+    init_timers();
+    init_workqueues();
+    printk_init();
+    trace_init();
+    init_vfs();
+    block_driver_init();
+}
+
+typedef struct {
+    ext4_fs_t *fs;
+    int id;
+    int first, count;
+    bool fsync;
+    int err;
+} ext4_bench_worker_t;
+
+static void *ext4_create_worker(void *arg) {
+    ext4_bench_worker_t *w = arg;
+    char path[64], data[4096];
+
+    for (int i = w->first; i < w->first + w->count && !w->err; i++) {
+        uint32_t ino;
+        snprintf(path, sizeof(path), "/bench/d%d/f%d", w->id, i);
+        memset(data, 'a' + i % 26, sizeof(data));
+        int ret = ext4_create(w->fs, path, 0644, &ino);
+        if (ret == 0) ret = ext4_write(w->fs, ino, data, sizeof(data), 0);
+        if (ret >= 0 && w->fsync) ret = ext4_fsync(w->fs, ino);
+        if (ret < 0) {
+            printf("%s: error %d\n", path, ret);
+            w->err = ret;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ext4-create <image> [files] [threads] [crash]
+ *
+ * Create 4 KiB files in a fresh directory per thread. With more than one
+ * thread every file is fsynced, exercising group commit. "crash" stops
+ * without checkpointing so the image needs journal replay.
+ */
+static int bench_ext4_create(int argc, char **argv) {
+    if (argc < 1) return -EINVAL;
+    int nr_files = argc > 1 ? atoi(argv[1]) : 100000;
+    int nr_threads = argc > 2 ? atoi(argv[2]) : 1;
+    bool crash = argc > 3 && strcmp(argv[3], "crash") == 0;
+    if (nr_files <= 0 || nr_threads <= 0 || nr_threads > 64) return -EINVAL;
+
+    if (!block_device_create_file("bench0", argv[0])) {
+        printf("cannot open %s\n", argv[0]);
+        return -ENOENT;
+    }
+    ext4_fs_t *fs;
+    int ret = ext4_mount("bench0", nr_threads > 1 ? EXT4_MOUNT_GROUP_COMMIT : 0, &fs);
+    if (ret < 0) {
+        printf("mount failed: %d\n", ret);
+        return ret;
+    }
+    ret = ext4_mkdir(fs, "/bench", 0755);
+    for (int t = 0; t < nr_threads && (ret == 0 || ret == -EEXIST); t++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/bench/d%d", t);
+        ret = ext4_mkdir(fs, path, 0755);
+    }
+    if (ret < 0 && ret != -EEXIST) {
+        printf("mkdir failed: %d\n", ret);
+        ext4_umount(fs);
+        return ret;
+    }
+
+    ext4_bench_worker_t workers[64];
+    pthread_t threads[64];
+    double start = now_sec();
+    for (int t = 0; t < nr_threads; t++) {
+        workers[t] = (ext4_bench_worker_t){
+            .fs = fs, .id = t, .fsync = nr_threads > 1,
+            .first = t * (nr_files / nr_threads),
+            .count = nr_files / nr_threads + (t == nr_threads - 1 ? nr_files % nr_threads : 0),
+        };
+        pthread_create(&threads[t], NULL, ext4_create_worker, &workers[t]);
+    }
+    ret = 0;
+    for (int t = 0; t < nr_threads; t++) {
+        pthread_join(threads[t], NULL);
+        if (workers[t].err) ret = workers[t].err;
+    }
+    if (ret == 0) ret = ext4_sync_fs(fs);
+    double elapsed = now_sec() - start;
+
+    ext4_journal_stats_t st;
+    ext4_journal_stats(fs, &st);
+    printf("ext4-create: %d files, %d threads: %.3f s, %.0f files/s\n",
+           nr_files, nr_threads, elapsed, nr_files / elapsed);
+    printf("  journal: %llu commits, %llu blocks logged, %llu fsyncs batched\n",
+           (unsigned long long)st.commits, (unsigned long long)st.blocks_logged,
+           (unsigned long long)st.fsync_batched);
+
+    int err = crash ? ext4_shutdown(fs) : ext4_umount(fs);
+    return ret ? ret : err;
+}
+
+/*
+ * tmpfs-smallfile [files] [bytes] [rounds]
+ *
+ * Create, write and close small files on a tmpfs root, then unlink them
+ * all, reporting each phase's rate and the page cache usage in between.
+ */
+static int bench_tmpfs_smallfile(int argc, char **argv) {
+    int nr_files = argc > 0 ? atoi(argv[0]) : 20000;
+    int size = argc > 1 ? atoi(argv[1]) : 1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : 3;
+    if (nr_files <= 0 || size < 0 || size > 65536 || rounds <= 0) return -EINVAL;
+
+    int ret = mount_fs("size=50%", "/", "tmpfs");
+    if (ret == 0) ret = vfs_mkdir("/bench", 0755);
+    if (ret < 0) {
+        printf("tmpfs setup failed: %d\n", ret);
+        return ret;
+    }
+
+    char *data = malloc((size_t)size + 1);
+    if (!data) return -ENOMEM;
+    memset(data, 'x', (size_t)size);
+
+    char path[64];
+    sysinfo_t si;
+    for (int r = 0; r < rounds && ret == 0; r++) {
+        double start = now_sec();
+        for (int i = 0; i < nr_files && ret == 0; i++) {
+            snprintf(path, sizeof(path), "/bench/f%d", i);
+            file_t *f = vfs_open(path, O_WRONLY | O_CREAT | O_EXCL, 0644, &ret);
+            if (!f) break;
+            int64_t n = vfs_write(f, data, (size_t)size);
+            if (n < 0) ret = (int)n;
+            vfs_close(f);
+        }
+        double created = now_sec();
+        do_sysinfo(&si);
+        for (int i = 0; i < nr_files && ret == 0; i++) {
+            snprintf(path, sizeof(path), "/bench/f%d", i);
+            ret = vfs_unlink(path);
+        }
+        double done = now_sec();
+        if (ret < 0) {
+            printf("%s: error %d\n", path, ret);
+            break;
+        }
+
+        printf("tmpfs-smallfile: round %d, %d x %d B: create+write %.0f files/s, unlink %.0f files/s\n",
+               r, nr_files, size, nr_files / (created - start), nr_files / (done - created));
+        printf("  after create: shmem %u pages, cached %u pages, free %u pages\n",
+               si.shared_memory, si.cached_memory, si.free_memory);
+    }
+
+    do_sysinfo(&si);
+    printf("  after unlink: shmem %u pages, free %u/%u pages\n",
+           si.shared_memory, si.free_memory, si.total_memory);
+    if (ret == 0 && si.shared_memory != 0) {
+        printf("tmpfs pages leaked\n");
+        ret = -EIO;
+    }
+
+    free(data);
+    int err = vfs_rmdir("/bench");
+    if (err == 0) err = umount_fs("/");
+    return ret ? ret : err;
+}
+
+typedef struct {
+    char names[256][16];
+    int count;
+} proc_batch_t;
+
+static int proc_collect(void *ctx, const char *name, size_t len, uint32_t ino, uint16_t mode) {
+    proc_batch_t *b = ctx;
+    (void)ino;
+    if (!S_ISDIR(mode) || name[0] < '0' || name[0] > '9' || len >= sizeof(b->names[0]))
+        return 0;
+    if (b->count == 256) return 1;
+    memcpy(b->names[b->count], name, len);
+    b->names[b->count++][len] = '\0';
+    return 0;
+}
+
+/*
+ * procfs-stat [procs] [rounds]
+ *
+ * Fork up to procs processes, then time full scans of /proc/<pid>/stat:
+ * readdir /proc in batches and open, read and close each stat file.
+ */
+static int bench_procfs_stat(int argc, char **argv) {
+    int nr_procs = argc > 0 ? atoi(argv[0]) : 10000;
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    if (nr_procs <= 0 || nr_procs >= PID_MAX || rounds <= 0) return -EINVAL;
+
+    init_scheduler();
+    for (int i = 0; i < nr_procs; i++) {
+        pid_t pid = do_fork();
+        if (pid < 0) {
+            printf("fork failed: %d\n", pid);
+            return pid;
+        }
+    }
+
+    int ret = mount_fs("size=16M", "/", "tmpfs");
+    if (ret == 0) ret = vfs_mkdir("/proc", 0555);
+    if (ret == 0) ret = mount_fs("proc", "/proc", "procfs");
+    if (ret < 0) {
+        printf("procfs setup failed: %d\n", ret);
+        return ret;
+    }
+
+    static proc_batch_t batch;
+    char path[48], line[256];
+    for (int r = 0; r < rounds && ret == 0; r++) {
+        size_t bytes = 0;
+        int seen = 0;
+        double start = now_sec();
+
+        file_t *dir = vfs_open("/proc", O_RDONLY, 0, &ret);
+        if (!dir) break;
+        do {
+            batch.count = 0;
+            ret = vfs_readdir(dir, proc_collect, &batch);
+            for (int i = 0; i < batch.count && ret == 0; i++) {
+                snprintf(path, sizeof(path), "/proc/%s/stat", batch.names[i]);
+                file_t *f = vfs_open(path, O_RDONLY, 0, &ret);
+                if (!f) break;
+                int64_t n = vfs_read(f, line, sizeof(line));
+                if (n <= 0) ret = n < 0 ? (int)n : -EIO;
+                bytes += (size_t)(n > 0 ? n : 0);
+                vfs_close(f);
+                seen++;
+            }
+        } while (ret == 0 && batch.count > 0);
+        vfs_close(dir);
+        double elapsed = now_sec() - start;
+
+        if (ret < 0) {
+            printf("scan failed: %d\n", ret);
+            break;
+        }
+        printf("procfs-stat: round %d, %d processes: %.3f ms, %.2f us/process, %zu bytes\n",
+               r, seen, elapsed * 1e3, elapsed * 1e6 / seen, bytes);
+        if (seen != nr_processes()) {
+            printf("saw %d of %d processes\n", seen, nr_processes());
+            ret = -EIO;
+        }
+    }
+
+    /* One pass over the fixed files, printed for inspection */
+    const char *files[] = { "/proc/meminfo", "/proc/buddyinfo", "/proc/mounts",
+                            "/proc/interrupts", "/proc/softirqs",
+#ifdef CONFIG_ALLOC_PROFILING
+                            "/proc/allocinfo",
+#endif
+    };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]) && ret == 0; i++) {
+        file_t *f = vfs_open(files[i], O_RDONLY, 0, &ret);
+        if (!f) break;
+        int64_t n;
+        printf("%s:\n", files[i]);
+        while ((n = vfs_read(f, line, sizeof(line) - 1)) > 0) {
+            line[n] = '\0';
+            fputs(line, stdout);
+        }
+        vfs_close(f);
+    }
+
+    int err = umount_fs("/proc");
+    if (err == 0) err = vfs_rmdir("/proc");
+    if (err == 0) err = umount_fs("/");
+    return ret ? ret : err;
+}
+
+typedef struct {
+    int nr_fds;
+    long lookups;
+    unsigned int seed;
+    long misses;
+    volatile int *stop;
+} fd_bench_worker_t;
+
+static inline unsigned int xorshift32(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void *fd_lookup_worker(void *arg) {
+    fd_bench_worker_t *w = arg;
+    for (long i = 0; i < w->lookups; i++) {
+        file_t *f = fget(xorshift32(&w->seed) % (unsigned int)w->nr_fds);
+        if (f) fput(f);
+        else w->misses++;
+    }
+    return NULL;
+}
+
+/* Close a random fd and reopen: the lowest free fd must come straight back */
+static void *fd_churn_worker(void *arg) {
+    fd_bench_worker_t *w = arg;
+    for (long i = 0; !*w->stop; i++) {
+        int fd = (int)(xorshift32(&w->seed) % (unsigned int)w->nr_fds);
+        int ret = do_close(fd);
+        int nfd = ret == 0 ? do_open("/fdbench", O_RDONLY, 0) : ret;
+        if (nfd != fd) {
+            printf("churn: closed %d, reopened as %d\n", fd, nfd);
+            w->misses = -1;
+            break;
+        }
+        w->lookups = i + 1;
+    }
+    return NULL;
+}
+
+/*
+ * fd-table [fds] [threads] [lookups]
+ *
+ * Open fds descriptors on one file, then time lock-free fget/fput of
+ * random fds, alone and with threads racing a close/reopen churner.
+ */
+static int bench_fd_table(int argc, char **argv) {
+    int nr_fds = argc > 0 ? atoi(argv[0]) : 100000;
+    int nr_threads = argc > 1 ? atoi(argv[1]) : 4;
+    long lookups = argc > 2 ? atol(argv[2]) : 10000000;
+    if (nr_fds <= 0 || (unsigned int)nr_fds > NR_OPEN_MAX || nr_threads <= 0 ||
+        nr_threads > 64 || lookups <= 0)
+        return -EINVAL;
+
+    int ret = mount_fs("size=1M", "/", "tmpfs");
+    int fd = ret < 0 ? ret : do_open("/fdbench", O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("setup failed: %d\n", fd);
+        return fd;
+    }
+    do_close(fd);
+
+    double start = now_sec();
+    for (int i = 0; i < nr_fds; i++) {
+        if ((fd = do_open("/fdbench", O_RDONLY, 0)) != i) {
+            printf("open %d returned %d\n", i, fd);
+            return fd < 0 ? fd : -EIO;
+        }
+    }
+    double elapsed = now_sec() - start;
+    printf("fd-table: open %d fds: %.0f opens/s\n", nr_fds, nr_fds / elapsed);
+
+    fd_bench_worker_t one = { .nr_fds = nr_fds, .lookups = lookups, .seed = 1 };
+    start = now_sec();
+    fd_lookup_worker(&one);
+    elapsed = now_sec() - start;
+    printf("  fget+fput, 1 thread: %.1f ns/lookup\n", elapsed * 1e9 / lookups);
+
+    volatile int stop = 0;
+    fd_bench_worker_t workers[65];
+    pthread_t threads[65];
+    for (int t = 0; t <= nr_threads; t++) {
+        workers[t] = (fd_bench_worker_t){
+            .nr_fds = nr_fds, .lookups = lookups / nr_threads, .seed = 2 + t, .stop = &stop,
+        };
+    }
+    start = now_sec();
+    pthread_create(&threads[nr_threads], NULL, fd_churn_worker, &workers[nr_threads]);
+    for (int t = 0; t < nr_threads; t++)
+        pthread_create(&threads[t], NULL, fd_lookup_worker, &workers[t]);
+    long misses = 0;
+    for (int t = 0; t < nr_threads; t++) {
+        pthread_join(threads[t], NULL);
+        misses += workers[t].misses;
+    }
+    elapsed = now_sec() - start;
+    stop = 1;
+    pthread_join(threads[nr_threads], NULL);
+    if (workers[nr_threads].misses < 0) ret = -EIO;
+
+    printf("  fget+fput, %d threads + churn: %.1f ns/lookup, %ld misses, "
+           "%.0f close+open/s\n", nr_threads, elapsed * 1e9 / lookups, misses,
+           workers[nr_threads].lookups / elapsed);
+
+    start = now_sec();
+    for (int i = 0; i < nr_fds; i++) {
+        if (do_close(i) < 0 && ret == 0) ret = -EBADF;
+    }
+    elapsed = now_sec() - start;
+    printf("  close %d fds: %.0f closes/s\n", nr_fds, nr_fds / elapsed);
+
+    int err = vfs_unlink("/fdbench");
+    if (err == 0) err = umount_fs("/");
+    return ret ? ret : err;
+}
+
+/*
+ * iovec-write [records] [size] [rounds]
+ *
+ * Write a batch of small records to a tmpfs file one do_write per record,
+ * then as a single do_writev, and read the batch back with preadv2.
+ */
+static int bench_iovec_write(int argc, char **argv) {
+    int nr_recs = argc > 0 ? atoi(argv[0]) : 64;
+    int size = argc > 1 ? atoi(argv[1]) : 64;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+    if (nr_recs <= 0 || nr_recs > IOV_MAX || size <= 0 || size > 65536 || rounds <= 0)
+        return -EINVAL;
+
+    int ret = mount_fs("size=16M", "/", "tmpfs");
+    int fd = ret < 0 ? ret : do_open("/records", O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("setup failed: %d\n", fd);
+        return fd;
+    }
+
+    size_t batch = (size_t)nr_recs * (size_t)size;
+    char *recs = malloc(batch);
+    char *back = malloc(batch);
+    iovec_t *iov = malloc((size_t)nr_recs * sizeof(*iov));
+    if (!recs || !back || !iov) return -ENOMEM;
+    for (int i = 0; i < nr_recs; i++) {
+        memset(recs + (size_t)i * size, 'a' + i % 26, (size_t)size);
+        iov[i] = (iovec_t){ .iov_base = recs + (size_t)i * size, .iov_len = (size_t)size };
+    }
+
+    double start = now_sec();
+    for (int r = 0; r < rounds && ret == 0; r++) {
+        do_lseek(fd, 0, SEEK_SET);
+        for (int i = 0; i < nr_recs; i++) {
+            if (do_write(fd, iov[i].iov_base, iov[i].iov_len) != size) {
+                ret = -EIO;
+                break;
+            }
+        }
+    }
+    double single = now_sec() - start;
+
+    start = now_sec();
+    for (int r = 0; r < rounds && ret == 0; r++) {
+        do_lseek(fd, 0, SEEK_SET);
+        if (do_writev(fd, iov, nr_recs) != (int64_t)batch) ret = -EIO;
+    }
+    double vectored = now_sec() - start;
+
+    /* Read back in two segments split mid-record, without moving f_pos */
+    iovec_t halves[2] = {
+        { .iov_base = back, .iov_len = batch / 2 + 1 },
+        { .iov_base = back + batch / 2 + 1, .iov_len = batch - batch / 2 - 1 },
+    };
+    if (ret == 0 && (do_preadv2(fd, halves, 2, 0, RWF_NOWAIT) != (int64_t)batch ||
+                     memcmp(recs, back, batch) != 0 ||
+                     do_lseek(fd, 0, SEEK_CUR) != (int64_t)batch)) {
+        printf("read-back mismatch\n");
+        ret = -EIO;
+    }
+
+    if (ret == 0) {
+        double n = (double)rounds * nr_recs;
+        printf("iovec-write: %d rounds of %d x %d B\n", rounds, nr_recs, size);
+        printf("  write per record: %.0f records/s (%.1f ns/record)\n",
+               n / single, single * 1e9 / n);
+        printf("  writev per batch: %.0f records/s (%.1f ns/record), %.1fx\n",
+               n / vectored, vectored * 1e9 / n, single / vectored);
+    }
+
+    free(iov);
+    free(back);
+    free(recs);
+    do_close(fd);
+    int err = vfs_unlink("/records");
+    if (err == 0) err = umount_fs("/");
+    return ret ? ret : err;
+}
+
+typedef struct {
+    int fd;
+    io_rings_t *rings;
+    io_uring_sqe_t *sqes;
+    uint32_t sqe_tail;
+} bench_ring_t;
+
+static io_uring_sqe_t *ring_sqe(bench_ring_t *ring, uint8_t op, int fd, void *addr,
+                                uint32_t len, uint64_t off, uint64_t user_data) {
+    io_uring_sqe_t *sqe = &ring->sqes[ring->sqe_tail++ & ring->rings->sq_ring_mask];
+    *sqe = (io_uring_sqe_t){ .opcode = op, .fd = fd, .addr = (uint64_t)(uintptr_t)addr,
+                             .len = len, .off = off, .user_data = user_data };
+    return sqe;
+}
+
+static int ring_submit(bench_ring_t *ring, uint32_t wait_nr) {
+    uint32_t n = ring->sqe_tail - ring->rings->sq.tail;
+    __atomic_store_n(&ring->rings->sq.tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return io_uring_enter(ring->fd, n, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/* Reap one CQE by polling; false if none is ready */
+static bool ring_reap(bench_ring_t *ring, io_uring_cqe_t *out) {
+    io_rings_t *r = ring->rings;
+    uint32_t head = r->cq.head;
+    if (head == __atomic_load_n(&r->cq.tail, __ATOMIC_ACQUIRE)) return false;
+    *out = r->cqes[head & r->cq_ring_mask];
+    __atomic_store_n(&r->cq.head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Pipes, links and futexes through the ring; returns 0 if all behave */
+static int ring_selftest(bench_ring_t *ring) {
+    io_uring_cqe_t cqe;
+    int fds[2] = { -1, -1 };
+    char buf[16] = { 0 };
+    uint32_t word = 0;
+
+    ring_sqe(ring, IORING_OP_PIPE, -1, fds, 0, 0, 1);
+    if (ring_submit(ring, 1) != 1 || !ring_reap(ring, &cqe) || cqe.res != 0) return -EIO;
+
+    /* A read of an empty pipe and a futex wait both park until released */
+    ring_sqe(ring, IORING_OP_READ, fds[0], buf, 5, (uint64_t)-1, 2);
+    ring_sqe(ring, IORING_OP_FUTEX_WAIT, -1, &word, 0, 0, 3);
+    if (ring_submit(ring, 0) != 2 || ring_reap(ring, &cqe)) return -EIO;
+
+    ring_sqe(ring, IORING_OP_WRITE, fds[1], "hello", 5, (uint64_t)-1, 4);
+    ring_sqe(ring, IORING_OP_FUTEX_WAKE, -1, &word, 1, 0, 5);
+    if (ring_submit(ring, 4) != 2) return -EIO;
+    int seen = 0;
+    while (ring_reap(ring, &cqe)) {
+        int expect = cqe.user_data == 2 || cqe.user_data == 4 ? 5 :
+                     cqe.user_data == 5 ? 1 : 0;
+        if (cqe.res != expect) return -EIO;
+        seen |= 1 << cqe.user_data;
+    }
+    if (seen != 0x3C || memcmp(buf, "hello", 5) != 0) return -EIO;
+
+    /* A failed link cancels the rest of its chain */
+    ring_sqe(ring, IORING_OP_WRITE, fds[1], "x", 1, 0, 6)->flags = IOSQE_IO_LINK;
+    ring_sqe(ring, IORING_OP_CLOSE, fds[0], NULL, 0, 0, 7);
+    ring_sqe(ring, IORING_OP_CLOSE, fds[1], NULL, 0, 0, 8);
+    if (ring_submit(ring, 3) != 3) return -EIO;
+    int32_t res[3];
+    for (int i = 0; i < 3; i++) {
+        if (!ring_reap(ring, &cqe)) return -EIO;
+        res[cqe.user_data - 6] = cqe.res;
+    }
+    if (res[0] != -ESPIPE || res[1] != -ECANCELED || res[2] != 0) return -EIO;
+    return do_close(fds[0]);
+}
+
+/*
+ * io-ring [ops] [batch] [size]
+ *
+ * Random positional reads and writes of size bytes against a 1 MiB tmpfs
+ * file: one do_pread/do_pwrite per op, then batch ops per ring enter.
+ */
+static int bench_io_ring(int argc, char **argv) {
+    long nr_ops = argc > 0 ? atol(argv[0]) : 1000000;
+    int batch = argc > 1 ? atoi(argv[1]) : 64;
+    int size = argc > 2 ? atoi(argv[2]) : 512;
+    if (nr_ops <= 0 || batch <= 0 || batch > IORING_MAX_ENTRIES || size <= 0 || size > 65536)
+        return -EINVAL;
+
+    const uint64_t file_size = 1 << 20;
+    int ret = mount_fs("size=8M", "/", "tmpfs");
+    int fd = ret < 0 ? ret : do_open("/ring", O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("setup failed: %d\n", fd);
+        return fd;
+    }
+    char *buf = calloc((size_t)batch, (size_t)size);
+    if (!buf) return -ENOMEM;
+    do_pwrite(fd, buf, 1, file_size - 1);
+
+    io_uring_params_t p = { 0 };
+    bench_ring_t ring = { 0 };
+    ring.fd = io_uring_setup((uint32_t)batch, &p);
+    if (ring.fd < 0) return ring.fd;
+    ring.rings = p.rings;
+    ring.sqes = p.sqes;
+
+    ret = ring_selftest(&ring);
+    if (ret < 0) printf("io-ring: pipe/link/futex checks failed\n");
+
+    unsigned int seed = 1;
+    uint64_t slots = (file_size - (uint64_t)size) / (uint64_t)size;
+    for (int write = 0; write < 2 && ret == 0; write++) {
+        double start = now_sec();
+        for (long i = 0; i < nr_ops && ret == 0; i++) {
+            uint64_t off = xorshift32(&seed) % slots * (uint64_t)size;
+            int64_t n = write ? do_pwrite(fd, buf, (size_t)size, (int64_t)off)
+                              : do_pread(fd, buf, (size_t)size, (int64_t)off);
+            if (n != size) ret = -EIO;
+        }
+        double sync = now_sec() - start;
+
+        start = now_sec();
+        for (long done = 0; done < nr_ops && ret == 0; ) {
+            int n = nr_ops - done < batch ? (int)(nr_ops - done) : batch;
+            for (int i = 0; i < n; i++) {
+                uint64_t off = xorshift32(&seed) % slots * (uint64_t)size;
+                ring_sqe(&ring, write ? IORING_OP_WRITE : IORING_OP_READ, fd,
+                         buf + (size_t)i * size, (uint32_t)size, off, (uint64_t)i);
+            }
+            if (ring_submit(&ring, (uint32_t)n) != n) ret = -EIO;
+            io_uring_cqe_t cqe;
+            for (int i = 0; i < n && ret == 0; i++) {
+                if (!ring_reap(&ring, &cqe) || cqe.res != size) ret = -EIO;
+            }
+            done += n;
+        }
+        double async = now_sec() - start;
+
+        /* Here a kernel entry is a plain call; the ring's gain is in how few it needs */
+        if (ret == 0)
+            printf("io-ring: %s %ld x %d B: sync %.0f ops/s, ring (batch %d) %.0f ops/s, %.2fx; "
+                   "kernel entries %ld vs %ld\n", write ? "write" : "read", nr_ops, size,
+                   nr_ops / sync, batch, nr_ops / async, sync / async, nr_ops,
+                   (nr_ops + batch - 1) / batch);
+    }
+
+    do_close(ring.fd);
+    do_close(fd);
+    free(buf);
+    int err = vfs_unlink("/ring");
+    if (err == 0) err = umount_fs("/");
+    return ret ? ret : err;
+}
+
+typedef struct {
+    volatile bool stop;
+    long updates;
+} vdso_writer_t;
+
+/* Keep the vvar seqlock busy the way the tick and the scheduler would */
+static void *vdso_writer(void *arg) {
+    vdso_writer_t *w = arg;
+    while (!w->stop) {
+        timekeeping_update();
+        vvar_set_task(do_getpid(), do_getppid());
+        w->updates++;
+    }
+    return NULL;
+}
+
+/*
+ * mult/shift for TSCs below, at and above 1 GHz: mult fits in 32 bits
+ * (a sub-GHz rate once overflowed it), CLOCKSOURCE_MAX_SEC of cycles
+ * times mult fits in 64, and a second and the whole interval convert
+ * to within 1 ppm.
+ */
+static int vdso_check_mult_shift(void) {
+    static const uint64_t rates[] = { 32768, 14318180, 100000000, 733333333, 999999999,
+                                      1000000000, 2400000000ULL, 3900000000ULL, 6000000000ULL };
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        uint64_t hz = rates[i];
+        uint32_t mult, shift;
+        clocks_calc_mult_shift(&mult, &shift, hz, NSEC_PER_SEC, CLOCKSOURCE_MAX_SEC);
+        vvar_data_t v = { .mult = mult, .shift = shift };
+        unsigned __int128 max_product = (unsigned __int128)hz * CLOCKSOURCE_MAX_SEC * mult;
+        uint64_t sec = vvar_mono_ns(&v, hz);
+        uint64_t max = vvar_mono_ns(&v, hz * CLOCKSOURCE_MAX_SEC);
+        uint64_t max_ns = NSEC_PER_SEC * CLOCKSOURCE_MAX_SEC;
+        if (mult == 0 || (max_product >> 64) != 0 ||
+            (sec > NSEC_PER_SEC ? sec - NSEC_PER_SEC : NSEC_PER_SEC - sec) > NSEC_PER_SEC / 1000000 ||
+            (max > max_ns ? max - max_ns : max_ns - max) > max_ns / 1000000) {
+            printf("vdso: mult/shift check failed at %llu Hz (mult %u, shift %u)\n",
+                   (unsigned long long)hz, mult, shift);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+static int bench_vdso(int argc, char **argv) {
+    long calls = argc > 0 ? atol(argv[0]) : 10000000;
+    if (calls <= 0) return -EINVAL;
+
+    int ret = vdso_check_mult_shift();
+    if (ret < 0) return ret;
+    timespec_t ts, prev = {0, 0};
+    uint64_t sink = 0;
+
+    double start = now_sec();
+    for (long i = 0; i < calls && ret == 0; i++) {
+        vdso_clock_gettime(&ts);
+        if (ts.sec < prev.sec || (ts.sec == prev.sec && ts.nsec < prev.nsec)) ret = -EIO;
+        prev = ts;
+    }
+    double vdso = now_sec() - start;
+
+    start = now_sec();
+    for (long i = 0; i < calls; i++) {
+        do_clock_gettime(&ts);
+        sink += ts.nsec;
+    }
+    double sys = now_sec() - start;
+
+    struct timespec hts;
+    start = now_sec();
+    for (long i = 0; i < calls; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &hts);
+        sink += (uint64_t)hts.tv_nsec;
+    }
+    double host = now_sec() - start;
+
+    start = now_sec();
+    for (long i = 0; i < calls; i++) sink += (uint64_t)vdso_getpid();
+    double vpid = now_sec() - start;
+
+    start = now_sec();
+    for (long i = 0; i < calls; i++) sink += (uint64_t)do_getpid();
+    double spid = now_sec() - start;
+
+    /* Readers must never see a torn anchor while it moves under them */
+    vdso_writer_t w = { .stop = false };
+    pthread_t thread;
+    pthread_create(&thread, NULL, vdso_writer, &w);
+    prev = (timespec_t){0, 0};
+    for (long i = 0; i < calls && ret == 0; i++) {
+        vdso_clock_gettime(&ts);
+        if (ts.sec < prev.sec || (ts.sec == prev.sec && ts.nsec < prev.nsec)) ret = -EIO;
+        prev = ts;
+    }
+    w.stop = true;
+    pthread_join(thread, NULL);
+    if (ret < 0) {
+        printf("vdso: clock went backwards at %u.%09u\n", ts.sec, ts.nsec);
+        return ret;
+    }
+
+    const vvar_data_t *v = vdso_vvar_page();
+    printf("vdso: clocksource %s (%lu Hz, mult %u, shift %u)\n",
+           v && v->clock_mode == VCLOCK_TSC ? "tsc" : "ref", v ? (unsigned long)v->tsc_hz : 0UL,
+           v ? v->mult : 0U, v ? v->shift : 0U);
+    printf("vdso: clock_gettime %.1f ns/call, syscall %.1f ns/call, host %.1f ns/call\n",
+           vdso * 1e9 / calls, sys * 1e9 / calls, host * 1e9 / calls);
+    printf("vdso: getpid %.1f ns/call, syscall %.1f ns/call\n",
+           vpid * 1e9 / calls, spid * 1e9 / calls);
+    printf("vdso: monotonic across %ld concurrent vvar updates (%lu)\n", w.updates,
+           (unsigned long)(sink & 1));
+    return 0;
+}
+
+static void bench_timer_fn(timer_list_t *timer) {
+    (void)timer;
+}
+
+static hrtimer_restart_t bench_hrtimer_fn(hrtimer_t *timer) {
+    (void)timer;
+    return HRTIMER_NORESTART;
+}
+
+/* Ticks and interrupts this CPU takes over ms, idle or busy */
+static void bench_tick_window(uint64_t ms, bool idle, tick_stats_t *delta) {
+    tick_stats_t before, after;
+
+    tick_get_stats(smp_processor_id(), &before);
+    if (idle) {
+        timer_list_t timer;
+        timer_setup(&timer, bench_timer_fn);
+        mod_timer(&timer, get_jiffies_64() + msecs_to_jiffies(ms));
+        while (timer_pending(&timer))
+            cpu_idle();
+    } else {
+        uint64_t end = ktime_get_ns() + ms * 1000000;
+        while (ktime_get_ns() < end)
+            tick_poll();
+    }
+    tick_get_stats(smp_processor_id(), &after);
+    delta->ticks = after.ticks - before.ticks;
+    delta->interrupts = after.interrupts - before.interrupts;
+}
+
+static int bench_timers(int argc, char **argv) {
+    long nr = argc > 0 ? atol(argv[0]) : 1000000;
+    if (nr <= 0) return -EINVAL;
+
+    timer_list_t *timers = calloc((size_t)nr, sizeof(*timers));
+    hrtimer_t *hrtimers = calloc((size_t)nr, sizeof(*hrtimers));
+    uint64_t *expiry = malloc((size_t)nr * sizeof(*expiry));
+    if (!timers || !hrtimers || !expiry) {
+        free(timers);
+        free(hrtimers);
+        free(expiry);
+        return -ENOMEM;
+    }
+
+    /* Timeouts from 1 ms to ~17 min so every wheel level and deep trees are hit */
+    unsigned int seed = 1;
+    uint64_t j0 = get_jiffies_64();
+    for (long i = 0; i < nr; i++) {
+        expiry[i] = 1 + xorshift32(&seed) % (1U << 20);
+        timer_setup(&timers[i], bench_timer_fn);
+        hrtimer_init(&hrtimers[i], bench_hrtimer_fn);
+    }
+
+    /* Cancel in a scattered order, as timeouts complete in practice */
+    long stride = 7919;
+    while (nr % stride == 0)
+        stride += 2;
+
+    double start = now_sec();
+    for (long i = 0; i < nr; i++)
+        mod_timer(&timers[i], j0 + expiry[i]);
+    double wheel_start = now_sec() - start;
+
+    start = now_sec();
+    for (long i = 0; i < nr; i++)
+        mod_timer(&timers[i], j0 + expiry[nr - 1 - i]);
+    double wheel_mod = now_sec() - start;
+
+    start = now_sec();
+    long cancelled = 0;
+    for (long i = 0, k = 0; i < nr; i++, k = (k + stride) % nr)
+        cancelled += del_timer(&timers[k]);
+    double wheel_cancel = now_sec() - start;
+
+    uint64_t t0 = ktime_get_ns();
+    start = now_sec();
+    for (long i = 0; i < nr; i++)
+        hrtimer_start(&hrtimers[i], t0 + expiry[i] * TICK_NSEC + i % 1000, HRTIMER_MODE_ABS);
+    double hr_start = now_sec() - start;
+
+    start = now_sec();
+    long hr_cancelled = 0;
+    for (long i = 0, k = 0; i < nr; i++, k = (k + stride) % nr)
+        hr_cancelled += hrtimer_cancel(&hrtimers[k]);
+    double hr_cancel = now_sec() - start;
+
+    tick_stats_t busy, idle;
+    bench_tick_window(100, false, &busy);
+    bench_tick_window(100, true, &idle);
+
+    free(timers);
+    free(hrtimers);
+    free(expiry);
+    if (cancelled != nr || hr_cancelled != nr) {
+        printf("timers: cancelled %ld wheel / %ld hrtimers of %ld\n", cancelled, hr_cancelled, nr);
+        return -EIO;
+    }
+
+    printf("timers: %ld concurrent\n", nr);
+    printf("timers: wheel   start %.1f ns, re-arm %.1f ns, cancel %.1f ns\n",
+           wheel_start * 1e9 / nr, wheel_mod * 1e9 / nr, wheel_cancel * 1e9 / nr);
+    printf("timers: hrtimer start %.1f ns, cancel %.1f ns\n",
+           hr_start * 1e9 / nr, hr_cancel * 1e9 / nr);
+    printf("timers: 100 ms busy: %lu ticks; 100 ms idle: %lu ticks, %lu interrupts\n",
+           (unsigned long)busy.ticks, (unsigned long)idle.ticks, (unsigned long)idle.interrupts);
+    return 0;
+}
+
+#define STORM_LOCAL_VECTOR  0x40
+#define STORM_DEV_VECTOR    0x50    /* + cpu */
+
+/* One emulated device per polling CPU: finished requests wait here for its interrupt */
+typedef struct {
+    unsigned int cpu;
+    block_request_t *done;          /* Lock-free stack written by the "hardware" */
+    tasklet_t tasklet;
+    uint64_t tasklet_runs;
+    uint64_t completed;
+    uint64_t lat_sum, lat_max;
+    uint64_t irqs, block_runs;      /* Counts when the storm starts */
+    volatile bool stop;
+} storm_dev_t;
+
+static uint64_t g_storm_local;
+
+static irqreturn_t storm_local_irq(unsigned int vector, void *dev) {
+    (void)vector;
+    (void)dev;
+    g_storm_local++;
+    return IRQ_HANDLED;
+}
+
+static void storm_tasklet(tasklet_t *t) {
+    storm_dev_t *d = (storm_dev_t *)((char *)t - offsetof(storm_dev_t, tasklet));
+    d->tasklet_runs++;
+}
+
+/* Top half: hand every finished request to the block layer and return */
+static irqreturn_t storm_dev_irq(unsigned int vector, void *dev) {
+    (void)vector;
+    storm_dev_t *d = dev;
+    block_request_t *rq = __atomic_exchange_n(&d->done, NULL, __ATOMIC_ACQUIRE);
+    if (!rq) return IRQ_NONE;
+    while (rq) {
+        block_request_t *next = rq->next;
+        block_complete_request(rq);
+        rq = next;
+    }
+    tasklet_schedule(&d->tasklet);
+    return IRQ_HANDLED;
+}
+
+static void storm_end_io(block_request_t *rq) {
+    storm_dev_t *d = rq->bdev->private;
+    uint64_t lat = ktime_get_ns() - (uint64_t)(uintptr_t)rq->private;
+    d->lat_sum += lat;
+    if (lat > d->lat_max) d->lat_max = lat;
+    __atomic_store_n(&d->completed, d->completed + 1, __ATOMIC_RELEASE);
+}
+
+static void *storm_cpu(void *arg) {
+    storm_dev_t *d = arg;
+    cpu_bind(d->cpu);
+    while (!d->stop) {
+        if (!irq_poll()) cond_resched();
+    }
+    return NULL;
+}
+
+static int bench_irq_storm(int argc, char **argv) {
+    long nr = argc > 0 ? atol(argv[0]) : 1000000;
+    int cpus = argc > 1 ? atoi(argv[1]) : 2;
+    if (nr <= 0 || cpus < 1 || cpus >= NR_CPUS) return -EINVAL;
+
+    /* Dispatch cost on this CPU: entry, chain walk, irq_exit */
+    int ret = request_irq(STORM_LOCAL_VECTOR, storm_local_irq, "storm-local", &g_storm_local);
+    if (ret < 0) return ret;
+    double start = now_sec();
+    for (long i = 0; i < nr; i++)
+        irq_deliver(STORM_LOCAL_VECTOR);
+    double local = now_sec() - start;
+    free_irq(STORM_LOCAL_VECTOR, &g_storm_local);
+
+    block_request_t *rqs = calloc((size_t)nr, sizeof(*rqs));
+    storm_dev_t *devs = calloc((size_t)cpus, sizeof(*devs));
+    block_device_t *bdevs = calloc((size_t)cpus, sizeof(*bdevs));
+    pthread_t threads[NR_CPUS];
+    if (!rqs || !devs || !bdevs) {
+        free(rqs);
+        free(devs);
+        free(bdevs);
+        return -ENOMEM;
+    }
+
+    for (int c = 0; c < cpus; c++) {
+        devs[c].cpu = (unsigned int)c + 1;
+        tasklet_setup(&devs[c].tasklet, storm_tasklet);
+        bdevs[c].private = &devs[c];
+        request_irq(STORM_DEV_VECTOR + (unsigned int)c, storm_dev_irq, "storm-dev", &devs[c]);
+        pthread_create(&threads[c], NULL, storm_cpu, &devs[c]);
+    }
+
+    /* One request in flight: injection to end_io on another CPU, unloaded */
+    long pings = nr < 10000 ? nr : 10000;
+    start = now_sec();
+    for (long i = 0; i < pings; i++) {
+        block_request_t *rq = &rqs[i];
+        rq->bdev = &bdevs[0];
+        rq->end_io = storm_end_io;
+        rq->private = (void *)(uintptr_t)ktime_get_ns();
+        __atomic_store_n(&devs[0].done, rq, __ATOMIC_RELEASE);
+        irq_inject(devs[0].cpu, STORM_DEV_VECTOR);
+        while (__atomic_load_n(&devs[0].completed, __ATOMIC_ACQUIRE) <= (uint64_t)i)
+            cond_resched();
+    }
+    double ping = now_sec() - start;
+    devs[0].completed = devs[0].lat_sum = devs[0].lat_max = devs[0].tasklet_runs = 0;
+    memset(rqs, 0, (size_t)pings * sizeof(*rqs));
+    for (int c = 0; c < cpus; c++) {
+        irq_info_t info;
+        devs[c].irqs = irq_get_info(STORM_DEV_VECTOR + (unsigned int)c, &info) == 0 ?
+                       info.count[devs[c].cpu] : 0;
+        devs[c].block_runs = softirq_count(BLOCK_SOFTIRQ, devs[c].cpu);
+    }
+
+    /* The "hardware": finish requests round-robin and raise each device's vector */
+    start = now_sec();
+    for (long i = 0; i < nr; i++) {
+        int c = (int)(i % cpus);
+        block_request_t *rq = &rqs[i];
+        rq->bdev = &bdevs[c];
+        rq->end_io = storm_end_io;
+        rq->private = (void *)(uintptr_t)ktime_get_ns();
+        rq->next = __atomic_load_n(&devs[c].done, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&devs[c].done, &rq->next, rq, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        irq_inject(devs[c].cpu, STORM_DEV_VECTOR + (unsigned int)c);
+    }
+    double inject = now_sec() - start;
+
+    for (int c = 0; c < cpus; c++) {
+        long expect = nr / cpus + (c < nr % cpus ? 1 : 0);
+        while (__atomic_load_n(&devs[c].completed, __ATOMIC_ACQUIRE) < (uint64_t)expect)
+            cond_resched();
+    }
+    double total = now_sec() - start;
+
+    uint64_t completed = 0, lat_sum = 0, lat_max = 0, tasklet_runs = 0, irqs = 0, block_runs = 0;
+
+    for (int c = 0; c < cpus; c++) {
+        devs[c].stop = true;
+        pthread_join(threads[c], NULL);
+        irq_info_t info;
+        if (irq_get_info(STORM_DEV_VECTOR + (unsigned int)c, &info) == 0)
+            irqs += info.count[devs[c].cpu] - devs[c].irqs;
+        free_irq(STORM_DEV_VECTOR + (unsigned int)c, &devs[c]);
+        tasklet_kill(&devs[c].tasklet);
+        completed += devs[c].completed;
+        lat_sum += devs[c].lat_sum;
+        tasklet_runs += devs[c].tasklet_runs;
+        if (devs[c].lat_max > lat_max) lat_max = devs[c].lat_max;
+        block_runs += softirq_count(BLOCK_SOFTIRQ, devs[c].cpu) - devs[c].block_runs;
+    }
+    free(rqs);
+    free(devs);
+    free(bdevs);
+
+    printf("irq-storm: local dispatch %.1f ns/irq\n", local * 1e9 / nr);
+    printf("irq-storm: cross-cpu round trip %.2f us (inject, top half, BLOCK_SOFTIRQ, end_io)\n",
+           ping * 1e6 / pings);
+    printf("irq-storm: %ld completions over %d cpus: injected %.2f M/s, completed %.2f M/s\n",
+           nr, cpus, nr / inject / 1e6, completed / total / 1e6);
+    printf("irq-storm: %lu interrupts, %lu BLOCK_SOFTIRQ runs (%.1f end_io per run), "
+           "%lu tasklet runs\n", (unsigned long)irqs, (unsigned long)block_runs,
+           block_runs ? (double)completed / block_runs : 0.0, (unsigned long)tasklet_runs);
+    printf("irq-storm: completion latency avg %.1f us, max %.1f us\n",
+           completed ? lat_sum / 1e3 / completed : 0.0, lat_max / 1e3);
+    return completed == (uint64_t)nr ? 0 : -EIO;
+}
+
+/*
+ * ctx-switch [switches]
+ *
+ * Two kernel threads on their own stacks switch to each other directly,
+ * integer-only, both using the FPU, or one of each. FPU users keep a
+ * private MXCSR rounding mode, which must survive every switch.
+ */
+
+#define CTX_MXCSR_RZ    0x7f80      /* Defaults plus round toward zero */
+#define CTX_MXCSR_DEF   0x1f80
+
+typedef struct {
+    thread_struct_t main, threads[2];
+    long switches;
+    unsigned int fp_mask;           /* Bit n: thread n uses the FPU */
+    double acc[2];
+    long errors;
+} ctx_bench_t;
+
+static ctx_bench_t g_ctx;
+
+static void ctx_thread(void *arg) {
+    unsigned int self = (unsigned int)(uintptr_t)arg;
+    thread_struct_t *me = &g_ctx.threads[self], *peer = &g_ctx.threads[!self];
+    unsigned int mxcsr = self ? CTX_MXCSR_DEF : CTX_MXCSR_RZ;
+    bool fp = g_ctx.fp_mask & (1U << self);
+    long n = 0;
+
+    if (fp) {
+        fpu_activate(me);
+        __builtin_ia32_ldmxcsr(mxcsr);
+    }
+    /* Thread 0 does half the switches, then hands back to main */
+    while (self || n < g_ctx.switches / 2) {
+        if (fp) {
+            fpu_activate(me);
+            if (__builtin_ia32_stmxcsr() != mxcsr) g_ctx.errors++;
+            g_ctx.acc[self] += 1.5;
+        }
+        n++;
+        switch_to(me, peer);
+    }
+    if (g_ctx.acc[0] != (fp ? n * 1.5 : 0.0)) g_ctx.errors++;
+    switch_to(me, &g_ctx.main);
+    for (;;)
+        switch_to(me, &g_ctx.main);
+}
+
+/* ns per switch for one pairing; fills the FPU counters it caused */
+static double ctx_run(void *stacks[2], long switches, unsigned int fp_mask, fpu_stats_t *delta) {
+    fpu_stats_t before, after;
+
+    memset(&g_ctx, 0, sizeof(g_ctx));
+    g_ctx.switches = switches;
+    g_ctx.fp_mask = fp_mask;
+    for (unsigned int t = 0; t < 2; t++)
+        copy_thread(&g_ctx.threads[t], stacks[t], THREAD_SIZE, ctx_thread, (void *)(uintptr_t)t);
+
+    fpu_get_stats(smp_processor_id(), &before);
+    double start = now_sec();
+    switch_to(&g_ctx.main, &g_ctx.threads[0]);
+    double elapsed = now_sec() - start;
+    fpu_get_stats(smp_processor_id(), &after);
+
+    __builtin_ia32_ldmxcsr(CTX_MXCSR_DEF);
+    for (unsigned int t = 0; t < 2; t++)
+        fpu_release(&g_ctx.threads[t]);
+    delta->switches = after.switches - before.switches;
+    delta->traps = after.traps - before.traps;
+    delta->saves = after.saves - before.saves;
+    delta->restores = after.restores - before.restores;
+    delta->lazy_hits = after.lazy_hits - before.lazy_hits;
+    return elapsed * 1e9 / (double)delta->switches;
+}
+
+static int bench_ctx_switch(int argc, char **argv) {
+    long switches = argc > 0 ? atol(argv[0]) : 10000000;
+    if (switches < 2) return -EINVAL;
+
+    void *stacks[2] = { kmalloc(THREAD_SIZE, GFP_KERNEL), kmalloc(THREAD_SIZE, GFP_KERNEL) };
+    if (!stacks[0] || !stacks[1]) {
+        kfree(stacks[0]);
+        kfree(stacks[1]);
+        return -ENOMEM;
+    }
+
+    static const struct {
+        const char *name;
+        unsigned int fp_mask;
+    } modes[] = {
+        { "integer-only", 0 },
+        { "both FPU", 3 },
+        { "FPU + integer", 1 },
+    };
+
+    fpu_init();
+    printf("ctx-switch: FPU state via %s, %zu bytes\n", fpu_mode_name(), fpu_state_size());
+    int ret = 0;
+    double int_ns = 0;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        fpu_stats_t st;
+        double ns = ctx_run(stacks, switches, modes[m].fp_mask, &st);
+        if (m == 0) int_ns = ns;
+        printf("ctx-switch: %-13s %6.1f ns/switch, %6.2f M switches/s; "
+               "%lu saves, %lu restores, %lu lazy hits\n",
+               modes[m].name, ns, 1e3 / ns, (unsigned long)st.saves,
+               (unsigned long)st.restores, (unsigned long)st.lazy_hits);
+        if (g_ctx.errors) {
+            printf("ctx-switch: %s: %ld corrupted FPU states\n", modes[m].name, g_ctx.errors);
+            ret = -EIO;
+        }
+    }
+
+    /* What schedule() used to spend per "switch": its 100000-nop loop */
+    double start = now_sec();
+    for (int i = 0; i < 100000; i++)
+        __asm__ volatile("nop");
+    double nop_loop = now_sec() - start;
+    printf("ctx-switch: schedule() nop loop %.1f us per slice, %.0fx a real switch\n",
+           nop_loop * 1e6, nop_loop * 1e9 / int_ns);
+
+    kfree(stacks[0]);
+    kfree(stacks[1]);
+    return ret;
+}
+
+/*
+ * workqueue [items] [max-workers]
+ *
+ * An unbound queue at 1, 2, 4 ... max-workers workers: throughput,
+ * enqueue-to-execute latency and the wakeup cost of an idle worker.
+ * Then what concurrency management is for: bound items that sleep,
+ * strict order on an ordered queue, delayed work that must not run
+ * early, and fan-out from inside a worker that siblings steal from.
+ */
+
+typedef struct {
+    work_struct_t work;
+    uint64_t queued;                /* ktime_get_ns(), or jiffies for delayed items */
+    uint64_t latency;
+    long seq;
+    delayed_work_t dwork;
+} wq_item_t;
+
+static long g_wq_done;
+static long g_wq_next_seq;
+static long g_wq_errors;
+static workqueue_t *g_wq_fanout;
+static wq_item_t *g_wq_children;
+static long g_wq_nr_children;
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void wq_item_fn(work_struct_t *work) {
+    wq_item_t *it = (wq_item_t *)work;
+    it->latency = ktime_get_ns() - it->queued;
+    __atomic_fetch_add(&g_wq_done, 1, __ATOMIC_RELEASE);
+}
+
+static void wq_sleep_fn(work_struct_t *work) {
+    timespec_t req = { .sec = 0, .nsec = 1000000 };
+    do_nanosleep(&req);
+    wq_item_fn(work);
+}
+
+/* Ordered queue: only one item runs at a time, so the plain increment is safe */
+static void wq_ordered_fn(work_struct_t *work) {
+    wq_item_t *it = (wq_item_t *)work;
+    if (it->seq != g_wq_next_seq) g_wq_errors++;
+    g_wq_next_seq = it->seq + 1;
+    __atomic_fetch_add(&g_wq_done, 1, __ATOMIC_RELEASE);
+}
+
+static void wq_delayed_fn(work_struct_t *work) {
+    wq_item_t *it = (wq_item_t *)((char *)work - offsetof(wq_item_t, dwork.work));
+    if (get_jiffies_64() < it->queued + (uint64_t)it->seq)
+        __atomic_fetch_add(&g_wq_errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_wq_done, 1, __ATOMIC_RELEASE);
+}
+
+/* A couple of microseconds of real work per child, so there is something to steal */
+static void wq_child_fn(work_struct_t *work) {
+    uint64_t end = ktime_get_ns() + 2000;
+    while (ktime_get_ns() < end)
+        cpu_relax();
+    wq_item_fn(work);
+}
+
+static void wq_fanout_fn(work_struct_t *work) {
+    (void)work;
+    for (long i = 0; i < g_wq_nr_children; i++) {
+        g_wq_children[i].queued = ktime_get_ns();
+        queue_work(g_wq_fanout, &g_wq_children[i].work);
+    }
+}
+
+static void wq_wait_done(long n) {
+    while (__atomic_load_n(&g_wq_done, __ATOMIC_ACQUIRE) < n)
+        cond_resched();
+}
+
+static int bench_workqueue(int argc, char **argv) {
+    long nr = argc > 0 ? atol(argv[0]) : 200000;
+    int max_workers = argc > 1 ? atoi(argv[1]) : 16;
+    if (nr <= 0 || max_workers < 1 || max_workers > 64) return -EINVAL;
+
+    wq_item_t *items = calloc((size_t)nr, sizeof(*items));
+    uint64_t *lat = malloc((size_t)nr * sizeof(*lat));
+    if (!items || !lat) {
+        free(items);
+        free(lat);
+        return -ENOMEM;
+    }
+
+    int ret = 0;
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        workqueue_t *wq = alloc_workqueue("bench-unbound", WQ_UNBOUND, workers);
+        if (!wq) {
+            ret = -ENOMEM;
+            break;
+        }
+        g_wq_done = 0;
+        double start = now_sec();
+        for (long i = 0; i < nr; i++) {
+            init_work(&items[i].work, wq_item_fn);
+            items[i].queued = ktime_get_ns();
+            queue_work(wq, &items[i].work);
+        }
+        flush_workqueue(wq);
+        double elapsed = now_sec() - start;
+
+        uint64_t sum = 0;
+        for (long i = 0; i < nr; i++) {
+            lat[i] = items[i].latency;
+            sum += lat[i];
+        }
+        qsort(lat, (size_t)nr, sizeof(*lat), cmp_u64);
+
+        /* One item at a time: every queue_work() has to wake an idle worker */
+        long pings = nr < 2000 ? nr : 2000;
+        uint64_t wake_sum = 0;
+        for (long i = 0; i < pings; i++) {
+            items[i].queued = ktime_get_ns();
+            queue_work(wq, &items[i].work);
+            flush_work(&items[i].work);
+            wake_sum += items[i].latency;
+        }
+
+        wq_stats_t st;
+        workqueue_get_stats(wq, &st);
+        destroy_workqueue(wq);
+        printf("workqueue: unbound x%-2d %7.2f M items/s, latency avg %7.1f us, "
+               "p50 %7.1f us, p99 %7.1f us; idle wakeup %5.1f us (%lu workers)\n",
+               workers, nr / elapsed / 1e6, sum / 1e3 / nr, lat[nr / 2] / 1e3,
+               lat[nr * 99 / 100] / 1e3, wake_sum / 1e3 / pings, (unsigned long)st.workers);
+    }
+
+    /* Bound: items that sleep 1 ms must not serialise behind each other */
+    if (ret == 0) {
+        long sleepers = nr < 32 ? nr : 32;
+        workqueue_t *wq = alloc_workqueue("bench-bound", 0, 0);
+        wq_stats_t before, after;
+        workqueue_get_stats(wq, &before);
+        g_wq_done = 0;
+        double start = now_sec();
+        for (long i = 0; i < sleepers; i++) {
+            init_work(&items[i].work, wq_sleep_fn);
+            items[i].queued = ktime_get_ns();
+            queue_work_on(1, wq, &items[i].work);
+        }
+        flush_workqueue(wq);
+        double elapsed = now_sec() - start;
+        workqueue_get_stats(wq, &after);
+        destroy_workqueue(wq);
+        printf("workqueue: bound, %ld items sleeping 1 ms on cpu 1: %.1f ms "
+               "(%.1f ms serialised), %lu workers started on block\n",
+               sleepers, elapsed * 1e3, sleepers * 1.0,
+               (unsigned long)(after.created_on_block - before.created_on_block));
+    }
+
+    /* Ordered: queueing order is execution order */
+    if (ret == 0) {
+        workqueue_t *wq = alloc_ordered_workqueue("bench-ordered");
+        g_wq_done = g_wq_next_seq = g_wq_errors = 0;
+        double start = now_sec();
+        for (long i = 0; i < nr; i++) {
+            init_work(&items[i].work, wq_ordered_fn);
+            items[i].seq = i;
+            queue_work(wq, &items[i].work);
+        }
+        flush_workqueue(wq);
+        double elapsed = now_sec() - start;
+        destroy_workqueue(wq);
+        printf("workqueue: ordered %.2f M items/s, %ld out of order\n",
+               nr / elapsed / 1e6, g_wq_errors);
+        if (g_wq_errors) ret = -EIO;
+    }
+
+    /* Delayed: 1..16 jiffies; this CPU's tick fires them, so idle here */
+    if (ret == 0) {
+        long delayed = nr < 16 ? nr : 16;
+        g_wq_done = g_wq_errors = 0;
+        tick_poll();                /* jiffies only move when this CPU takes its tick */
+        double start = now_sec();
+        for (long i = 0; i < delayed; i++) {
+            init_delayed_work(&items[i].dwork, wq_delayed_fn);
+            items[i].seq = i + 1;
+            items[i].queued = get_jiffies_64();
+            schedule_delayed_work(&items[i].dwork, (unsigned long)items[i].seq);
+        }
+        /* The last timer expires last; its work may still be on its way to a worker */
+        while (timer_pending(&items[delayed - 1].dwork.timer))
+            cpu_idle();
+        wq_wait_done(delayed);
+        double elapsed = now_sec() - start;
+        printf("workqueue: %ld delayed items over %.1f ms, %ld early\n",
+               delayed, elapsed * 1e3, g_wq_errors);
+        if (g_wq_errors) ret = -EIO;
+    }
+
+    /* Fan-out: one item queues the rest onto its worker's deque; siblings steal */
+    if (ret == 0) {
+        g_wq_fanout = alloc_workqueue("bench-fanout", WQ_UNBOUND, max_workers);
+        g_wq_nr_children = nr - 1 < 20000 ? nr - 1 : 20000;
+        g_wq_children = items + 1;
+        g_wq_done = 0;
+        for (long i = 0; i <= g_wq_nr_children; i++)
+            init_work(&items[i].work, i ? wq_child_fn : wq_fanout_fn);
+        double start = now_sec();
+        queue_work(g_wq_fanout, &items[0].work);
+        wq_wait_done(g_wq_nr_children);
+        flush_workqueue(g_wq_fanout);
+        double elapsed = now_sec() - start;
+        wq_stats_t st;
+        workqueue_get_stats(g_wq_fanout, &st);
+        destroy_workqueue(g_wq_fanout);
+        printf("workqueue: fan-out of %ld from a worker: %.1f ms, %lu stolen by %lu workers\n",
+               g_wq_nr_children, elapsed * 1e3, (unsigned long)st.stolen,
+               (unsigned long)st.workers);
+    }
+
+    free(items);
+    free(lat);
+    return ret;
+}
+
+/*
+ * mem-pressure [stream-MB] [hot-MB]
+ *
+ * Streams a file several times the size of memory through the page
+ * cache while a smaller hot file is re-read, then pins most of memory
+ * with page_alloc() while the cache is full. Reports allocation latency
+ * percentiles for both phases, how much reclaim kswapd did versus the
+ * allocating thread, and whether the hot file stayed cached.
+ */
+
+static int mp_readpage(address_space_t *mapping, page_t *page) {
+    (void)mapping;
+    uint64_t *data = page_to_virt(page);
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(*data); i++)
+        data[i] = page->index;
+    return 0;
+}
+
+static const address_space_operations_t mp_aops = {
+    .readpage = mp_readpage,
+};
+
+static void mp_report(const char *phase, uint64_t *lat, long n) {
+    if (!n) return;
+    qsort(lat, (size_t)n, sizeof(*lat), cmp_u64);
+    printf("mem-pressure: %-7s %8ld allocs, p50 %6.2f us, p99 %7.2f us, "
+           "p99.9 %8.2f us, max %8.2f us\n", phase, n, lat[n / 2] / 1e3,
+           lat[n * 99 / 100] / 1e3, lat[n * 999 / 1000] / 1e3, lat[n - 1] / 1e3);
+}
+
+static void mp_vm_events(uint64_t ev[NR_VM_EVENT_ITEMS]) {
+    for (unsigned int i = 0; i < NR_VM_EVENT_ITEMS; i++)
+        ev[i] = vm_event_count(i);
+}
+
+static int bench_mem_pressure(int argc, char **argv) {
+    long stream_mb = argc > 0 ? atol(argv[0]) : 1024;
+    long hot_mb = argc > 1 ? atol(argv[1]) : 32;
+    unsigned long total = nr_total_pages();
+    if (stream_mb <= 0 || hot_mb < 0 || (unsigned long)hot_mb * 256 > total / 4) return -EINVAL;
+
+    long stream_pages = stream_mb * 256, hot_pages = hot_mb * 256;
+    long max_pin = (long)(total * 3 / 4);
+    uint64_t *lat = malloc((size_t)(stream_pages > max_pin ? stream_pages : max_pin) * sizeof(*lat));
+    page_t **pinned = malloc((size_t)max_pin * sizeof(*pinned));
+    if (!lat || !pinned) {
+        free(lat);
+        free(pinned);
+        return -ENOMEM;
+    }
+
+    address_space_t hot = { .a_ops = &mp_aops }, cold = { .a_ops = &mp_aops };
+    uint64_t ev0[NR_VM_EVENT_ITEMS], ev1[NR_VM_EVENT_ITEMS];
+    int err = 0, ret = 0;
+
+    unsigned long wmark[NR_WMARK] = { 0 };
+    for (int nid = 0; nid < nr_online_nodes(); nid++) {
+        for (int w = 0; w < NR_WMARK; w++)
+            wmark[w] += zone_watermark(nid, (enum zone_watermarks)w);
+    }
+    printf("mem-pressure: %lu pages on %d node(s), watermarks min %lu low %lu high %lu\n", total,
+           nr_online_nodes(), wmark[WMARK_MIN], wmark[WMARK_LOW], wmark[WMARK_HIGH]);
+
+    /* Read the hot file twice so it is active before the stream starts */
+    for (int pass = 0; pass < 2; pass++) {
+        for (long i = 0; i < hot_pages; i++) {
+            page_t *page = find_or_create_page(&hot, (uint64_t)i, &err);
+            if (page) put_page(page);
+        }
+    }
+
+    /* Phase 1: every stream page is a cache miss that needs a free page */
+    mp_vm_events(ev0);
+    long hot_hits = 0, hot_reads = 0, n = 0;
+    double start = now_sec();
+    for (long i = 0; i < stream_pages; i++) {
+        uint64_t t0 = ktime_get_ns();
+        page_t *page = find_or_create_page(&cold, (uint64_t)i, &err);
+        lat[n++] = ktime_get_ns() - t0;
+        if (!page) {
+            printf("mem-pressure: stream page %ld: %d\n", i, err);
+            ret = err;
+            break;
+        }
+        put_page(page);
+
+        if (hot_pages && i % 8 == 0) {
+            uint64_t index = (uint64_t)(hot_reads++ % hot_pages);
+            page = find_get_page(&hot, index);
+            if (page) hot_hits++;
+            else page = find_or_create_page(&hot, index, &err);
+            if (page) put_page(page);
+        }
+    }
+    double stream_time = now_sec() - start;
+    mp_vm_events(ev1);
+    printf("mem-pressure: streamed %ld MB in %.2f s (%.0f MB/s); hot set %ld MB, "
+           "%.1f%% of re-reads cached\n", stream_mb, stream_time, stream_mb / stream_time,
+           hot_mb, hot_reads ? 100.0 * hot_hits / hot_reads : 100.0);
+    mp_report("stream", lat, n);
+    printf("mem-pressure: stream  kswapd reclaimed %lu pages in %lu wakeups, direct %lu in "
+           "%lu stalls; %lu activated, %lu deactivated\n",
+           (unsigned long)(ev1[PGSTEAL_KSWAPD] - ev0[PGSTEAL_KSWAPD]),
+           (unsigned long)(ev1[KSWAPD_WAKEUP] - ev0[KSWAPD_WAKEUP]),
+           (unsigned long)(ev1[PGSTEAL_DIRECT] - ev0[PGSTEAL_DIRECT]),
+           (unsigned long)(ev1[ALLOCSTALL] - ev0[ALLOCSTALL]),
+           (unsigned long)(ev1[PGACTIVATE] - ev0[PGACTIVATE]),
+           (unsigned long)(ev1[PGDEACTIVATE] - ev0[PGDEACTIVATE]));
+
+    /* Phase 2: pin three quarters of memory while the cache holds the rest */
+    mp_vm_events(ev0);
+    long nr_pinned = 0;
+    while (ret == 0 && nr_pinned < max_pin) {
+        uint64_t t0 = ktime_get_ns();
+        page_t *page = page_alloc(0);
+        lat[nr_pinned] = ktime_get_ns() - t0;
+        if (!page) break;
+        pinned[nr_pinned++] = page;
+    }
+    mp_vm_events(ev1);
+    printf("mem-pressure: pinned %ld of %ld pages, %lu left cached, %lu free\n",
+           nr_pinned, max_pin, nr_pagecache_pages(), nr_free_pages());
+    mp_report("pin", lat, nr_pinned);
+    printf("mem-pressure: pin     kswapd reclaimed %lu pages in %lu wakeups, direct %lu in "
+           "%lu stalls\n",
+           (unsigned long)(ev1[PGSTEAL_KSWAPD] - ev0[PGSTEAL_KSWAPD]),
+           (unsigned long)(ev1[KSWAPD_WAKEUP] - ev0[KSWAPD_WAKEUP]),
+           (unsigned long)(ev1[PGSTEAL_DIRECT] - ev0[PGSTEAL_DIRECT]),
+           (unsigned long)(ev1[ALLOCSTALL] - ev0[ALLOCSTALL]));
+    if (ret == 0 && nr_pinned < max_pin) ret = -ENOMEM;
+
+    for (long i = 0; i < nr_pinned; i++)
+        page_free(pinned[i]);
+    truncate_inode_pages(&cold, 0);
+    truncate_inode_pages(&hot, 0);
+    free(lat);
+    free(pinned);
+    return ret;
+}
+
+/*
+ * numa [allocs]
+ *
+ * Needs --cmdline=numa=fake=N. One thread per node, on a CPU of that
+ * node, allocates, touches and frees batches of pages first on its own
+ * node and then on the next one, and reports the rate of each along
+ * with the per-node hit/miss counters. Then checks that interleave
+ * spreads a run of allocations evenly and that bind keeps them on the
+ * bound node.
+ */
+#define NUMA_BATCH 64
+
+typedef struct {
+    int nid, target;
+    long allocs;
+    double secs;
+    long misplaced;
+} numa_worker_t;
+
+static void *numa_worker(void *arg) {
+    numa_worker_t *w = arg;
+    page_t *batch[NUMA_BATCH];
+    unsigned int cpu = 0;
+    while (cpu_to_node(cpu) != w->nid) cpu++;
+    cpu_bind(cpu);
+
+    double start = now_sec();
+    for (long done = 0; done < w->allocs; done += NUMA_BATCH) {
+        int n = 0;
+        for (; n < NUMA_BATCH; n++) {
+            batch[n] = alloc_pages_node(w->target, GFP_KERNEL, 0);
+            if (!batch[n]) break;
+            memset(page_to_virt(batch[n]), (int)done, PAGE_SIZE);
+            if (page_to_nid(batch[n]) != w->target) w->misplaced++;
+        }
+        while (n--) page_free(batch[n]);
+    }
+    w->secs = now_sec() - start;
+    return NULL;
+}
+
+/* Allocate n pages under the current policy and count them per node */
+static long numa_policy_run(long n, long per_node[MAX_NUMNODES]) {
+    page_t **pages = malloc((size_t)n * sizeof(*pages));
+    long got = 0;
+    if (!pages) return 0;
+    memset(per_node, 0, MAX_NUMNODES * sizeof(long));
+    for (; got < n; got++) {
+        pages[got] = alloc_pages(GFP_KERNEL, 0);
+        if (!pages[got]) break;
+        per_node[page_to_nid(pages[got])]++;
+    }
+    for (long i = 0; i < got; i++)
+        page_free(pages[i]);
+    free(pages);
+    return got;
+}
+
+static int bench_numa(int argc, char **argv) {
+    long allocs = argc > 0 ? atol(argv[0]) : 1000000;
+    int nodes = nr_online_nodes();
+    if (nodes < 2) {
+        printf("numa: one node; run as: test-kernel --cmdline=numa=fake=4 bench numa\n");
+        return -EINVAL;
+    }
+    if (allocs < NUMA_BATCH) return -EINVAL;
+
+    printf("numa: %d nodes of %lu MB;", nodes, (node_present_pages(0) * PAGE_SIZE) >> 20);
+    bool distinct = false;
+    for (int nid = 0; nid < nodes; nid++) {
+        int host = node_host_node(nid);
+        distinct |= host >= 0 && host != node_host_node(0);
+        if (host >= 0) printf(" %d->host %d", nid, host);
+        else printf(" %d->unbound", nid);
+    }
+    printf("\n");
+    if (!distinct)
+        printf("numa: nodes share one host node; local and remote cost the same here\n");
+
+    numa_stats_t st0[MAX_NUMNODES], st1[MAX_NUMNODES];
+    for (int pass = 0; pass < 2; pass++) {
+        numa_worker_t workers[MAX_NUMNODES];
+        pthread_t threads[MAX_NUMNODES];
+        for (int nid = 0; nid < nodes; nid++)
+            numa_get_stats(nid, &st0[nid]);
+        for (int nid = 0; nid < nodes; nid++) {
+            workers[nid] = (numa_worker_t){
+                .nid = nid, .target = pass ? (nid + 1) % nodes : nid, .allocs = allocs,
+            };
+            pthread_create(&threads[nid], NULL, numa_worker, &workers[nid]);
+        }
+        for (int nid = 0; nid < nodes; nid++)
+            pthread_join(threads[nid], NULL);
+
+        for (int nid = 0; nid < nodes; nid++) {
+            numa_worker_t *w = &workers[nid];
+            numa_get_stats(nid, &st1[nid]);
+            printf("numa: %-6s node %d -> %d: %6.2f M pages/s, %5.0f ns/page, %ld misplaced; "
+                   "hit %lu miss %lu local %lu other %lu\n",
+                   pass ? "remote" : "local", w->nid, w->target, w->allocs / w->secs / 1e6,
+                   w->secs * 1e9 / w->allocs, w->misplaced,
+                   (unsigned long)(st1[nid].numa_hit - st0[nid].numa_hit),
+                   (unsigned long)(st1[nid].numa_miss - st0[nid].numa_miss),
+                   (unsigned long)(st1[nid].local_node - st0[nid].local_node),
+                   (unsigned long)(st1[nid].other_node - st0[nid].other_node));
+        }
+    }
+
+    /* Policies: interleave over every node, then bind to the last one */
+    nodemask_t all = (nodemask_t)((1U << nodes) - 1);
+    long per_node[MAX_NUMNODES], n = 1024L * nodes;
+    int ret = 0;
+
+    set_mempolicy(MPOL_INTERLEAVE, all);
+    long got = numa_policy_run(n, per_node);
+    printf("numa: interleave %ld pages:", got);
+    for (int nid = 0; nid < nodes; nid++) {
+        printf(" %ld", per_node[nid]);
+        if (per_node[nid] != got / nodes) ret = -EIO;
+    }
+    printf("\n");
+
+    set_mempolicy(MPOL_BIND, 1U << (nodes - 1));
+    got = numa_policy_run(n, per_node);
+    printf("numa: bind node %d %ld pages, %ld on it\n", nodes - 1, got, per_node[nodes - 1]);
+    if (per_node[nodes - 1] != got || got != n) ret = -EIO;
+
+    if (set_mempolicy(MPOL_BIND, 0) != -EINVAL || set_mempolicy(MPOL_BIND, 1U << nodes) != -EINVAL)
+        ret = -EIO;
+    set_mempolicy(MPOL_LOCAL, 0);
+    return ret;
+}
+
+/*
+ * kmalloc [ops] [sample-bytes] [profile-out]
+ *
+ * Replaces objects in a table of live kmalloc() allocations from four
+ * call sites (small, medium, page-sized and large requests) and reports
+ * the cost per free+alloc. Built with CONFIG_ALLOC_PROFILING it runs the
+ * loop with sampling off and at sample-bytes (default 512 KiB), then
+ * prints the busiest call sites, the size histograms and the heap
+ * profile's estimate of live memory, and writes the profile in pprof's
+ * legacy heap format to profile-out if given. Compare against a build
+ * without the option for the cost of the counters themselves.
+ */
+#define KM_LIVE     8192
+#define KM_ROUNDS   10
+
+static __attribute__((noinline)) void *km_alloc_small(uint64_t r) {
+    return kmalloc(16 + r % 113, GFP_KERNEL);
+}
+
+static __attribute__((noinline)) void *km_alloc_medium(uint64_t r) {
+    return kmalloc(200 + r % 1300, GFP_KERNEL);
+}
+
+static __attribute__((noinline)) void *km_alloc_page(uint64_t r) {
+    (void)r;
+    return kmalloc(4096, GFP_KERNEL);
+}
+
+static __attribute__((noinline)) void *km_alloc_large(uint64_t r) {
+    return kmalloc(8192 + r % 57344, GFP_KERNEL);
+}
+
+static uint64_t km_rand(uint64_t *x) {
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Thread CPU time: other tenants of the host would swamp a few percent */
+static double km_cpu_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ns per free+alloc; *live_bytes is what the table holds afterwards */
+static double km_run(void **live, size_t *sizes, long ops, uint64_t *live_bytes) {
+    uint64_t x = 88172645463325252ULL;
+    double start = km_cpu_sec();
+    for (long i = 0; i < ops; i++) {
+        uint64_t r = km_rand(&x);
+        unsigned int slot = (unsigned int)(r >> 48) % KM_LIVE;
+        unsigned int kind = (unsigned int)(r >> 32) % 100;
+        kfree(live[slot]);
+
+        void *p;
+        if (kind < 60) p = km_alloc_small(r);
+        else if (kind < 90) p = km_alloc_medium(r);
+        else if (kind < 99) p = km_alloc_page(r);
+        else p = km_alloc_large(r);
+        if (p) *(volatile char *)p = 1;
+        live[slot] = p;
+        sizes[slot] = kind < 60 ? 16 + r % 113 : kind < 90 ? 200 + r % 1300 :
+                      kind < 99 ? 4096 : 8192 + r % 57344;
+    }
+    double ns = (km_cpu_sec() - start) * 1e9 / ops;
+
+    *live_bytes = 0;
+    for (unsigned int i = 0; i < KM_LIVE; i++)
+        if (live[i]) *live_bytes += sizes[i];
+    return ns;
+}
+
+#ifdef CONFIG_ALLOC_PROFILING
+/* e^-x without libm: halve into range, sum the series, square back */
+static double km_exp_neg(double x) {
+    int k = 0;
+    while (x > 0.5) {
+        x /= 2;
+        k++;
+    }
+    double term = 1, sum = 1;
+    for (int i = 1; i < 12; i++) {
+        term *= -x / i;
+        sum += term;
+    }
+    while (k--) sum *= sum;
+    return sum;
+}
+
+/* Scale a stack's sampled bytes back up as pprof does for heap_v2 */
+static double km_unsample(uint64_t objs, uint64_t bytes, size_t rate) {
+    if (!objs) return 0;
+    double avg = (double)bytes / (double)objs;
+    return (double)bytes / (1 - km_exp_neg(avg / (double)rate));
+}
+
+static int km_write_pprof(const char *path, size_t rate) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -EIO;
+
+    heap_profile_stack_t st;
+    uint64_t tot[4] = { 0 };
+    for (unsigned int pos = 0; heap_profile_stack(&pos, &st) == 0; pos++) {
+        tot[0] += st.inuse_objs;
+        tot[1] += st.inuse_bytes;
+        tot[2] += st.alloc_objs;
+        tot[3] += st.alloc_bytes;
+    }
+    fprintf(f, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+            (unsigned long long)tot[0], (unsigned long long)tot[1],
+            (unsigned long long)tot[2], (unsigned long long)tot[3], rate);
+    for (unsigned int pos = 0; heap_profile_stack(&pos, &st) == 0; pos++) {
+        fprintf(f, "%llu: %llu [%llu: %llu] @", (unsigned long long)st.inuse_objs,
+                (unsigned long long)st.inuse_bytes, (unsigned long long)st.alloc_objs,
+                (unsigned long long)st.alloc_bytes);
+        for (unsigned int i = 0; i < st.depth; i++)
+            fprintf(f, " %p", st.stack[i]);
+        fputc('\n', f);
+    }
+
+    /* pprof maps the addresses back to the binary through these */
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        fprintf(f, "\nMAPPED_LIBRARIES:\n");
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+            fwrite(buf, 1, n, f);
+        fclose(maps);
+    }
+    return fclose(f) == 0 ? 0 : -EIO;
+}
+
+static int km_site_cmp(const void *a, const void *b) {
+    const alloc_site_info_t *x = a, *y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static void km_report(size_t rate, uint64_t live_bytes) {
+    alloc_site_info_t sites[64];
+    int nr_sites = 0;
+    for (unsigned int pos = 0; nr_sites < 64 && kmalloc_site_info(&pos, &sites[nr_sites]) == 0; pos++)
+        nr_sites++;
+    qsort(sites, (size_t)nr_sites, sizeof(sites[0]), km_site_cmp);
+    printf("kmalloc: top call sites by bytes\n");
+    for (int i = 0; i < nr_sites && i < 8; i++)
+        printf("kmalloc:   %-14s %p %10llu calls %12llu bytes %4llu failed\n", sites[i].cache,
+               sites[i].caller, (unsigned long long)sites[i].calls,
+               (unsigned long long)sites[i].bytes, (unsigned long long)sites[i].failures);
+
+    printf("kmalloc: requested sizes per class (%d buckets; fill = requested / handed out)\n",
+           ALLOC_HIST_BUCKETS);
+    alloc_size_hist_t h;
+    for (unsigned int i = 0; kmalloc_size_hist(i, &h) == 0; i++) {
+        uint64_t calls = 0, bytes = 0;
+        for (int b = 0; b < ALLOC_HIST_BUCKETS; b++) {
+            calls += h.calls[b];
+            bytes += h.bytes[b];
+        }
+        if (!calls) continue;
+        printf("kmalloc:   %-14s %10llu", h.name, (unsigned long long)calls);
+        for (int b = 0; b < ALLOC_HIST_BUCKETS; b++)
+            printf(" %5.1f%%", 100.0 * (double)h.calls[b] / (double)calls);
+        if (h.object_size)
+            printf("  fill %5.1f%%", 100.0 * (double)bytes / ((double)calls * (double)h.object_size));
+        printf("\n");
+    }
+
+    heap_profile_stack_t st;
+    unsigned int nr_stacks = 0;
+    uint64_t samples = 0;
+    double est = 0;
+    for (unsigned int pos = 0; heap_profile_stack(&pos, &st) == 0; pos++) {
+        nr_stacks++;
+        samples += st.alloc_objs;
+        est += km_unsample(st.inuse_objs, st.inuse_bytes, rate);
+    }
+    printf("kmalloc: heap profile: %llu samples in %u stacks (%llu dropped); live %.1f MB, "
+           "estimated %.1f MB\n", (unsigned long long)samples, nr_stacks,
+           (unsigned long long)heap_profile_dropped(), live_bytes / 1048576.0, est / 1048576.0);
+}
+#endif
+
+static int bench_kmalloc(int argc, char **argv) {
+    long ops = argc > 0 ? atol(argv[0]) : 2000000;
+    long rate = argc > 1 ? atol(argv[1]) : 512 * 1024;
+    const char *out = argc > 2 ? argv[2] : NULL;
+    if (ops < KM_ROUNDS || rate < 0) return -EINVAL;
+
+    void **live = calloc(KM_LIVE, sizeof(*live));
+    size_t *sizes = calloc(KM_LIVE, sizeof(*sizes));
+    if (!live || !sizes) {
+        free(live);
+        free(sizes);
+        return -ENOMEM;
+    }
+
+    /* Best of KM_ROUNDS for each setting, alternating so drift hits both alike */
+    uint64_t live_bytes = 0;
+    double base = 1e30, sampled = 1e30;
+    km_run(live, sizes, ops / KM_ROUNDS, &live_bytes);
+    for (int i = 0; i < KM_ROUNDS; i++) {
+#ifdef CONFIG_ALLOC_PROFILING
+        heap_profile_set_rate(0);
+#endif
+        double ns = km_run(live, sizes, ops / KM_ROUNDS, &live_bytes);
+        if (ns < base) base = ns;
+#ifdef CONFIG_ALLOC_PROFILING
+        heap_profile_set_rate((size_t)rate);
+        ns = km_run(live, sizes, ops / KM_ROUNDS, &live_bytes);
+        if (ns < sampled) sampled = ns;
+#endif
+    }
+#ifdef CONFIG_ALLOC_PROFILING
+    printf("kmalloc: %ld ops, profiling compiled in\n", ops);
+    printf("kmalloc: counters only       %6.1f ns/op\n", base);
+    printf("kmalloc: sampling every %ld B %6.1f ns/op (%+.1f%%)\n", rate, sampled,
+           100.0 * (sampled - base) / base);
+    if (rate) km_report((size_t)rate, live_bytes);
+
+    int ret = 0;
+    if (out) {
+        ret = km_write_pprof(out, (size_t)rate);
+        if (ret == 0) printf("kmalloc: wrote %s (go tool pprof <binary> %s)\n", out, out);
+        else printf("kmalloc: %s: %d\n", out, ret);
+    }
+#else
+    (void)sampled;
+    printf("kmalloc: %ld ops, profiling not compiled in (CONFIG_ALLOC_PROFILING)\n", ops);
+    printf("kmalloc: %6.1f ns/op, %.1f MB live\n", base, live_bytes / 1048576.0);
+    if (out) printf("kmalloc: no profile to write to %s\n", out);
+    int ret = 0;
+#endif
+
+    for (unsigned int i = 0; i < KM_LIVE; i++)
+        kfree(live[i]);
+    free(live);
+    free(sizes);
+    return ret;
+}
+
+/*
+ * trace [events] [json-out]
+ *
+ * Cost of a tracepoint switched off and on, measured through kmalloc()
+ * and kfree(); then a short mixed workload on three CPUs with every
+ * event on, written out as Chrome trace JSON (chrome://tracing or
+ * ui.perfetto.dev) if a path is given.
+ */
+#define TRACE_ROUNDS    10
+
+#ifdef CONFIG_TRACING
+/* ns per kmalloc()+kfree() pair */
+static double tr_pairs(long pairs) {
+    double start = km_cpu_sec();
+    for (long i = 0; i < pairs; i++) {
+        void *p = kmalloc(64, GFP_KERNEL);
+        *(volatile char *)p = 1;
+        kfree(p);
+    }
+    return (km_cpu_sec() - start) * 1e9 / pairs;
+}
+
+static void *tr_worker(void *arg) {
+    cpu_bind((unsigned int)(uintptr_t)arg);
+    for (int i = 0; i < 2000; i++) {
+        page_t *page = page_alloc(i % 3);
+        void *p = kmalloc(16 + (size_t)i % 2000, GFP_KERNEL);
+        kfree(p);
+        page_free(page);
+    }
+    return NULL;
+}
+
+static int tr_write(void *ctx, const char *buf, size_t len) {
+    return fwrite(buf, 1, len, ctx) == len ? 0 : -EIO;
+}
+
+/* Pipes, tmpfs I/O and allocations on CPU 0 while CPUs 1 and 2 allocate */
+static int tr_workload(void) {
+    int ret = mount_fs("size=4M", "/", "tmpfs");
+    if (ret < 0) return ret;
+    file_t *f = vfs_open("/trace-data", O_RDWR | O_CREAT, 0644, &ret);
+    if (!f) return ret;
+
+    int fds[2];
+    if ((ret = do_pipe2(fds, 0)) < 0) return ret;
+
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++)
+        pthread_create(&threads[i], NULL, tr_worker, (void *)(uintptr_t)(i + 1));
+
+    char buf[2048];
+    memset(buf, 't', sizeof(buf));
+    for (int i = 0; i < 500; i++) {
+        size_t len = 64 + (size_t)i * 7 % 1900;
+        pipe_write(fds[1], buf, len);
+        pipe_read(fds[0], buf, len);
+        inode_write(f->inode, buf, len, (uint64_t)i * 512);
+        inode_read(f->inode, buf, len, (uint64_t)i * 256);
+    }
+
+    for (int i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+    do_close(fds[0]);
+    do_close(fds[1]);
+    vfs_close(f);
+    return 0;
+}
+#endif
+
+static int bench_trace(int argc, char **argv) {
+    long events = argc > 0 ? atol(argv[0]) : 2000000;
+    const char *out = argc > 1 ? argv[1] : NULL;
+    if (events < 2 * TRACE_ROUNDS) return -EINVAL;
+
+#ifdef CONFIG_TRACING
+    /* Best of TRACE_ROUNDS each way, alternating so drift hits both alike */
+    long pairs = events / 2 / TRACE_ROUNDS;
+    double off = 1e30, on = 1e30;
+    tr_pairs(pairs);
+    for (int i = 0; i < TRACE_ROUNDS; i++) {
+        trace_event_enable("all", false);
+        double ns = tr_pairs(pairs);
+        if (ns < off) off = ns;
+        trace_event_enable("kmalloc", true);
+        trace_event_enable("kfree", true);
+        ns = tr_pairs(pairs);
+        if (ns < on) on = ns;
+    }
+    trace_event_enable("all", false);
+    printf("trace: %ld events, kmalloc+kfree %.1f ns with tracepoints off, %.1f ns on\n",
+           events, off, on);
+    printf("trace: %.1f ns per enabled event (target < 50)\n", (on - off) / 2);
+
+    trace_reset();
+    trace_event_enable("all", true);
+    int ret = tr_workload();
+    trace_event_enable("all", false);
+    if (ret < 0) {
+        printf("trace: workload failed: %d\n", ret);
+        return ret;
+    }
+
+    uint64_t counts[NR_TRACE_EVENTS] = { 0 }, total = 0, lost = 0;
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        trace_entry_t e;
+        for (uint64_t pos = 0; trace_read(cpu, &pos, &e) == 0; total++)
+            counts[e.id]++;
+        lost += trace_lost(cpu);
+    }
+    printf("trace: workload recorded %llu events, %llu overwritten\n",
+           (unsigned long long)total, (unsigned long long)lost);
+    for (unsigned int id = 0; id < NR_TRACE_EVENTS; id++)
+        printf("trace:   %-14s %8llu\n", trace_event_name(id), (unsigned long long)counts[id]);
+
+    if (out) {
+        FILE *fp = fopen(out, "w");
+        ret = fp ? trace_write_json(tr_write, fp) : -EIO;
+        if (fp && fclose(fp) != 0) ret = -EIO;
+        if (ret == 0) printf("trace: wrote %s\n", out);
+        else printf("trace: %s: %d\n", out, ret);
+    }
+    return ret;
+#else
+    (void)out;
+    printf("trace: tracepoints not compiled in (CONFIG_TRACING)\n");
+    return 0;
+#endif
+}
+
+/*
+ * printk [messages] [processes] [console-file]
+ *
+ * Verbose logging (loglevel=8) to console-file (default /dev/null),
+ * printing from each caller as the stubs used to against queueing for
+ * the flusher: per-call latency, scheduler rounds with its per-slice
+ * debug line, and whole boots of this binary.
+ */
+#define PK_ROUNDS   5
+
+#ifdef __unix__
+static void pk_console_write(console_t *con, const char *buf, size_t len) {
+    fwrite(buf, 1, len, con->data);
+    fflush(con->data);
+}
+
+/* Median and 99th percentile ns per pr_debug(), and wall ns per message until printed */
+static void pk_latency(long messages, uint64_t *lat, double *med, double *p99, double *wall) {
+    double start = now_sec();
+    for (long i = 0; i < messages; i++) {
+        uint64_t t0 = ktime_get_ns();
+        pr_debug("printk bench: message %ld of %ld, lat[%ld]\n", i, messages, i % 64);
+        lat[i] = ktime_get_ns() - t0;
+    }
+    console_flush();
+    *wall = (now_sec() - start) * 1e9 / messages;
+    qsort(lat, (size_t)messages, sizeof(lat[0]), cmp_u64);
+    *med = (double)lat[messages / 2];
+    *p99 = (double)lat[messages * 99 / 100];
+}
+
+/* schedule() calls per second; each is ten slices, each logs a line */
+static double pk_schedule(int rounds) {
+    double start = now_sec();
+    for (int i = 0; i < rounds; i++)
+        schedule();
+    console_flush();
+    return rounds / (now_sec() - start);
+}
+
+/* Wall seconds for one boot of this binary, kernel output to fd; -1 if it failed, with its wait status */
+static double pk_boot(const char *cmdline, int fd, int *status) {
+    char arg[128];
+    snprintf(arg, sizeof(arg), "--cmdline=%s", cmdline);
+    char *argv[] = { "test-kernel", arg, NULL };
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fd, 1);
+
+    double start = now_sec();
+    pid_t pid;
+    *status = -1;
+    if (posix_spawn(&pid, "/proc/self/exe", &fa, NULL, argv, NULL) == 0)
+        waitpid(pid, status, 0);
+    posix_spawn_file_actions_destroy(&fa);
+    return *status == 0 ? now_sec() - start : -1;
+}
+
+/* How a boot went wrong, from its wait status, and the last line it printed if known */
+static void pk_boot_report(const char *what, int status, const char *last) {
+    if (status == -1)
+        printf("%s failed: could not start\n", what);
+    else if (WIFSIGNALED(status))
+        printf("%s failed: killed by signal %d\n", what, WTERMSIG(status));
+    else if (WEXITSTATUS(status))
+        printf("%s failed: exit status %d\n", what, WEXITSTATUS(status));
+    else
+        printf("%s failed: no initcall summary\n", what);
+    if (last && *last) printf("  last output: %s%s", last, strchr(last, '\n') ? "" : "\n");
+}
+#endif
+
+static int bench_printk(int argc, char **argv) {
+    long messages = argc > 0 ? atol(argv[0]) : 20000;
+    int procs = argc > 1 ? atoi(argv[1]) : 4;
+    const char *path = argc > 2 ? argv[2] : "/dev/null";
+    if (messages < 100 || procs < 1) return -EINVAL;
+
+#ifdef __unix__
+    FILE *out = fopen(path, "a");
+    uint64_t *lat = malloc((size_t)messages * sizeof(*lat));
+    if (!out || !lat) {
+        if (out) fclose(out);
+        free(lat);
+        return out ? -ENOMEM : -EIO;
+    }
+    console_t con = { .name = "bench", .write = pk_console_write, .data = out };
+
+    init_scheduler();
+    for (int i = 0; i < procs; i++)
+        do_fork();
+
+    int level = printk_loglevel();
+    printk_set_loglevel(LOGLEVEL_DEBUG + 1);
+    register_console(&con);
+
+    /* Best of PK_ROUNDS each way, alternating so drift hits both alike */
+    static const char *const modes[] = { "synchronous", "flusher" };
+    double med[2] = { 1e30, 1e30 }, p99[2] = { 1e30, 1e30 }, wall[2] = { 1e30, 1e30 };
+    double sched[2] = { 0, 0 };
+    for (int r = 0; r < PK_ROUNDS; r++) {
+        for (int m = 0; m < 2; m++) {
+            printk_set_sync(m == 0);
+            double a, b, c;
+            pk_latency(messages / PK_ROUNDS, lat, &a, &b, &c);
+            if (a < med[m]) med[m] = a;
+            if (b < p99[m]) p99[m] = b;
+            if (c < wall[m]) wall[m] = c;
+            double rate = pk_schedule(20);
+            if (rate > sched[m]) sched[m] = rate;
+        }
+    }
+    printk_set_sync(false);
+    register_console(NULL);
+    printk_set_loglevel(level);
+
+    printf("printk: %ld messages to %s at loglevel 8\n", messages, path);
+    for (int m = 0; m < 2; m++)
+        printf("printk: %-11s  pr_debug() median %6.0f ns, p99 %7.0f ns; %6.0f ns/msg until printed; "
+               "schedule() %6.0f rounds/s\n", modes[m], med[m], p99[m], wall[m], sched[m]);
+
+    /* Best of PK_ROUNDS boots each way; any boot that fails fails the bench */
+    double boot[2] = { -1, -1 };
+    int failed = 0;
+    for (int r = 0; r < PK_ROUNDS; r++) {
+        for (int m = 0; m < 2; m++) {
+            int status;
+            double t = pk_boot(m == 0 ? "loglevel=8 printk.synchronous=1" : "loglevel=8",
+                               fileno(out), &status);
+            if (t < 0) {
+                if (!failed++) pk_boot_report(m == 0 ? "printk: synchronous boot" : "printk: flusher boot",
+                                              status, NULL);
+            } else if (boot[m] < 0 || t < boot[m]) {
+                boot[m] = t;
+            }
+        }
+    }
+    if (failed)
+        printf("printk: %d of %d boots failed\n", failed, 2 * PK_ROUNDS);
+    if (boot[0] >= 0 && boot[1] >= 0)
+        printf("printk: boot with loglevel=8: synchronous %.2f ms, flusher %.2f ms\n",
+               boot[0] * 1e3, boot[1] * 1e3);
+    printf("printk: %llu messages dropped\n", (unsigned long long)printk_dropped());
+
+    fclose(out);
+    free(lat);
+    return failed ? -EIO : 0;
+#else
+    (void)path;
+    printf("printk: needs a hosted Unix build\n");
+    return 0;
+#endif
+}
+
+/*
+ * console [lines] [line-length]
+ *
+ * Lines per second through each console backend, written straight to
+ * the driver in printk-sized batches and logged through printk in
+ * bursts a quarter of its ring long, each printed before the next.
+ * Host output goes to /dev/null; "serial,115200" paces the emulated
+ * UART like a real line, so its ring overflows rather than holding the
+ * writer up.
+ */
+#define CON_ROUNDS  3
+#define CON_BATCH   4096
+#define CON_BURST   1024
+
+static void con_line(char *buf, int len, long n) {
+    int k = snprintf(buf, (size_t)len, "console bench line %08ld ", n);
+    if (k > len - 1) k = len - 1;
+    memset(buf + k, '=', (size_t)(len - 1 - k));
+    buf[len - 1] = '\n';
+}
+
+/* Lines per second written in whole-line batches of up to CON_BATCH bytes */
+static double con_direct(long lines, int len) {
+    char batch[CON_BATCH];
+    size_t fill = 0;
+    double start = now_sec();
+    for (long i = 0; i < lines; i++) {
+        if (fill + (size_t)len > sizeof(batch)) {
+            console_write(batch, fill);
+            fill = 0;
+        }
+        con_line(batch + fill, len, i);
+        fill += (size_t)len;
+    }
+    console_write(batch, fill);
+    return lines / (now_sec() - start);
+}
+
+/* Lines per second logged with pr_info() and printed */
+static double con_printk(long lines, int len) {
+    char line[256];
+    double start = now_sec();
+    for (long i = 0; i < lines; i++) {
+        con_line(line, len, i);
+        pr_info("%.*s", len, line);
+        if (i % CON_BURST == CON_BURST - 1) console_flush();
+    }
+    console_flush();
+    return lines / (now_sec() - start);
+}
+
+static int bench_console(int argc, char **argv) {
+    long lines = argc > 0 ? atol(argv[0]) : 100000;
+    int len = argc > 1 ? atoi(argv[1]) : 72;
+    if (lines < 100 || len < 2 || len > 200) return -EINVAL;
+
+    FILE *out = fopen("/dev/null", "w");
+    if (!out) return -EIO;
+    console_set_output(out);
+    int ret = console_driver_init();
+    if (ret < 0) {
+        fclose(out);
+        return ret;
+    }
+    printk_set_sync(false);
+
+    static const struct {
+        const char *name;
+        unsigned int mask;
+        unsigned int baud;
+    } backends[] = {
+        { "vga", CON_VGA, 0 },
+        { "serial", CON_SERIAL, 0 },
+        { "serial,115200", CON_SERIAL, 115200 },
+        { "stdout", CON_STDOUT, 0 },
+    };
+
+    printf("console: %ld lines of %d bytes, best of %d\n", lines, len, CON_ROUNDS);
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        console_set_baud(backends[b].baud);
+        console_set_backends(backends[b].mask);
+
+        double direct = 0, logged = 0;
+        console_stats_t st;
+        uint64_t dropped = printk_dropped();
+        console_reset_stats();
+        for (int r = 0; r < CON_ROUNDS; r++) {
+            double d = con_direct(lines, len);
+            if (d > direct) direct = d;
+            double l = con_printk(lines, len);
+            if (l > logged) logged = l;
+        }
+        console_get_stats(&st);
+        dropped = printk_dropped() - dropped;
+
+        printf("console: %-14s direct %9.0f lines/s (%6.1f MB/s), printk %9.0f lines/s",
+               backends[b].name, direct, direct * len / 1e6, logged);
+        if (backends[b].mask & CON_VGA)
+            printf(", %.1f cells copied/line", (double)st.cells / (double)st.lines);
+        if (backends[b].mask & CON_SERIAL)
+            printf(", %llu bytes dropped by the UART",
+                   (unsigned long long)st.serial_dropped);
+        printf(", %llu records dropped by printk\n", (unsigned long long)dropped);
+    }
+
+    /* The 80x25 screen must end on the last line written, wrapped, above the cursor's row */
+    char want[256], got[128];
+    int rows = (len - 1 + 79) / 80, row = 24 - (rows ? rows : 1);
+    console_set_backends(CON_VGA);
+    con_direct(lines, len);
+    con_line(want, len, lines - 1);
+    want[len - 1 < 80 ? len - 1 : 80] = '\0';
+    console_read_screen((unsigned int)row, got, sizeof(got));
+    if (strcmp(want, got) != 0) {
+        printf("console: VGA row %d is \"%s\", expected \"%s\"\n", row, got, want);
+        ret = -EIO;
+    }
+
+    console_set_baud(0);
+    register_console(NULL);
+    console_set_output(NULL);
+    fclose(out);
+    return ret;
+}
+
+/*
+ * pci [root-ports] [slots] [image]
+ *
+ * Writes a synthetic ECAM image (default /tmp/pci-ecam.img): a host
+ * bridge and root-ports PCIe root ports on bus 0, each with slots NVMe
+ * functions behind it, every other slot a two-function device. Times a
+ * full enumeration through ECAM and through emulated conf1 ports, then
+ * gives each device MSI-X vectors and shows where they land and are
+ * delivered.
+ */
+#define PB_ROUNDS       20
+#define PB_CFG_BYTES    0x200       /* Header, capabilities and the first extended one */
+#define PB_QUEUES       4           /* MSI-X vectors asked for per device */
+
+static void pb_put(uint8_t *cfg, unsigned int off, uint32_t v, size_t size) {
+    memcpy(cfg + off, &v, size);
+}
+
+static int pb_write(FILE *fp, unsigned int bus, unsigned int devfn, const uint8_t *cfg) {
+    long off = (long)bus << 20 | (long)devfn << 12;
+    if (fseek(fp, off, SEEK_SET) != 0 || fwrite(cfg, 1, PB_CFG_BYTES, fp) != PB_CFG_BYTES)
+        return -EIO;
+    return 0;
+}
+
+/* NVMe function k: 16 KiB 64-bit BAR0 holding the MSI-X table and PBA, 4 KiB BAR2, I/O BAR4 */
+static void pb_nvme(uint8_t *cfg, unsigned int k, bool multi) {
+    memset(cfg, 0, PB_CFG_BYTES);
+    pb_put(cfg, 0x00, 0x00101b36, 4);
+    pb_put(cfg, 0x06, 0x0010, 2);                       /* Capability list */
+    pb_put(cfg, 0x08, 0x01080202, 4);                   /* NVMe, revision 2 */
+    cfg[0x0e] = multi ? 0x80 : 0x00;
+    uint64_t bar0 = 0x800000000ULL + (2ULL * k + 1) * 0x4000;
+    pb_put(cfg, 0x10, (uint32_t)bar0 | 0x4, 4);
+    pb_put(cfg, 0x14, (uint32_t)(bar0 >> 32), 4);
+    pb_put(cfg, 0x18, 0xc0000000U + (2U * k + 1) * 0x1000, 4);
+    if (k < 384) pb_put(cfg, 0x20, (0x4000U + (2U * k + 1) * 0x20) | 0x1, 4);
+    cfg[0x34] = 0x40;
+    pb_put(cfg, 0x40, 0x5001, 2);                       /* PM, next 0x50 */
+    pb_put(cfg, 0x50, 0x6011, 2);                       /* MSI-X, next 0x60 */
+    pb_put(cfg, 0x52, 15, 2);                           /* 16 entries */
+    pb_put(cfg, 0x54, 0x2000, 4);                       /* Table in BAR0 */
+    pb_put(cfg, 0x58, 0x3000, 4);                       /* PBA in BAR0 */
+    pb_put(cfg, 0x60, 0x0010, 2);                       /* PCI Express, last */
+    pb_put(cfg, 0x100, 0x00010001, 4);                  /* AER, last */
+}
+
+static int pb_image(const char *path, unsigned int ports, unsigned int slots, unsigned int *nfn) {
+    FILE *fp = fopen(path, "w+b");
+    if (!fp) return -EIO;
+    uint8_t cfg[PB_CFG_BYTES];
+    int ret = 0;
+    unsigned int k = 0;
+
+    memset(cfg, 0, sizeof(cfg));
+    pb_put(cfg, 0x00, 0x29c08086, 4);                   /* Host bridge */
+    pb_put(cfg, 0x08, 0x06000000, 4);
+    ret |= pb_write(fp, 0, 0, cfg);
+    for (unsigned int p = 1; p <= ports; p++) {
+        memset(cfg, 0, sizeof(cfg));
+        pb_put(cfg, 0x00, 0x000c1b36, 4);               /* PCIe root port */
+        pb_put(cfg, 0x06, 0x0010, 2);
+        pb_put(cfg, 0x08, 0x06040000, 4);
+        cfg[0x0e] = 0x01;
+        pb_put(cfg, 0x18, p << 8 | p << 16, 4);         /* Primary 0, secondary = subordinate = p */
+        cfg[0x34] = 0x40;
+        pb_put(cfg, 0x40, 0x0010, 2);
+        ret |= pb_write(fp, 0, PCI_DEVFN(p, 0), cfg);
+
+        for (unsigned int s = 0; s < slots; s++) {
+            for (unsigned int fn = 0; fn < (s & 1 ? 2U : 1U); fn++) {
+                pb_nvme(cfg, k++, s & 1);
+                ret |= pb_write(fp, p, PCI_DEVFN(s, fn), cfg);
+            }
+        }
+    }
+    if (fclose(fp) != 0) ret = -EIO;
+    *nfn = 1 + ports + k;
+    return ret ? -EIO : 0;
+}
+
+/* Best time of PB_ROUNDS scans and config accesses per scan */
+static int pb_scan(int mode, double *best, uint64_t *accesses) {
+    int found = -ENODEV;
+    *best = 1e30;
+    if (pci_set_config_access(mode) < 0) return -ENODEV;
+    for (int r = 0; r < PB_ROUNDS; r++) {
+        uint64_t a = pci_config_accesses();
+        double t = km_cpu_sec();
+        found = pci_scan_devices();
+        t = km_cpu_sec() - t;
+        *accesses = pci_config_accesses() - a;
+        if (t < *best) *best = t;
+    }
+    return found;
+}
+
+static unsigned int g_pb_delivered[NR_CPUS], g_pb_misrouted;
+
+static irqreturn_t pb_irq(unsigned int vector, void *dev) {
+    const pci_irq_t *irq = dev;
+    (void)vector;
+    if (irq->cpu == smp_processor_id()) g_pb_delivered[irq->cpu]++;
+    else g_pb_misrouted++;
+    return IRQ_HANDLED;
+}
+
+static int bench_pci(int argc, char **argv) {
+    int ports = argc > 0 ? atoi(argv[0]) : 16;
+    int slots = argc > 1 ? atoi(argv[1]) : 8;
+    const char *path = argc > 2 ? argv[2] : "/tmp/pci-ecam.img";
+    if (ports < 1 || ports > 31 || slots < 1 || slots > 32) return -EINVAL;
+
+    unsigned int nfn;
+    int ret = pb_image(path, (unsigned int)ports, (unsigned int)slots, &nfn);
+    if (ret == 0) ret = pci_ecam_load_image(path);
+    if (ret < 0) {
+        printf("pci: %s: %d\n", path, ret);
+        return ret;
+    }
+    printf("pci: %s: %d root ports, %u functions\n", path, ports, nfn);
+
+    int level = printk_loglevel();
+    printk_set_loglevel(LOGLEVEL_INFO);
+    static const char *const modes[] = { "ECAM", "conf1" };
+    for (int m = PCI_ACCESS_CONF1; m >= PCI_ACCESS_ECAM; m--) {
+        double t;
+        uint64_t acc = 0;
+        int found = pb_scan(m, &t, &acc);
+        if (found != (int)nfn) {
+            printf("pci: %s scan found %d functions\n", modes[m], found);
+            ret = -EIO;
+        }
+        printf("pci: %-5s  full enumeration %8.1f us, %6.0f ns/function, %llu config accesses%s\n",
+               modes[m], t * 1e6, t * 1e9 / nfn, (unsigned long long)acc,
+               m == PCI_ACCESS_CONF1 ? " (two port accesses each)" : "");
+    }
+    printk_set_loglevel(level);
+
+    /* The last scan went through ECAM: check what it made of the first NVMe function */
+    pci_dev_t *nvme = pci_get_device(0x1b36, 0x0010, NULL);
+    if (!nvme || nvme->bar[0].size != 0x4000 || !(nvme->bar[0].flags & PCI_BAR_MEM64) ||
+        nvme->bar[0].start != 0x800004000ULL || nvme->bar[2].size != 0x1000 ||
+        nvme->bar[4].size != 0x20 || !(nvme->bar[4].flags & PCI_BAR_IO) || nvme->msix_cap != 0x50 ||
+        nvme->pcie_cap != 0x60 || pci_find_ext_capability(nvme, PCI_EXT_CAP_ID_ERR) != 0x100 ||
+        pci_find_capability(nvme, PCI_CAP_ID_PM) != 0x40) {
+        printf("pci: first NVMe function decoded wrongly\n");
+        return -EIO;
+    }
+
+    /* MSI-X: PB_QUEUES vectors a device until they run out */
+    unsigned int per_cpu[NR_CPUS] = { 0 }, devices = 0, vectors = 0;
+    for (pci_dev_t *dev = NULL; (dev = pci_get_device(0x1b36, 0x0010, dev)) != NULL;) {
+        if (pci_alloc_irq_vectors(dev, 1, PB_QUEUES, 0) < 0) break;
+        devices++;
+        for (unsigned int i = 0; i < dev->nr_irqs; i++) {
+            per_cpu[dev->irqs[i].cpu]++;
+            request_irq(dev->irqs[i].vector, pb_irq, "pci-bench", &dev->irqs[i]);
+            pci_msix_signal(dev, i);
+            vectors++;
+        }
+    }
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        cpu_bind(cpu);
+        irq_poll();
+    }
+    cpu_bind(0);
+
+    printf("pci: MSI-X: %u vectors for %u devices\n", vectors, devices);
+    printf("pci:   CPU     ");
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) printf(" %5u", cpu);
+    printf("\npci:   vectors ");
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) printf(" %5u", per_cpu[cpu]);
+    printf("\npci:   received");
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) printf(" %5u", g_pb_delivered[cpu]);
+    printf("\n");
+    if (g_pb_misrouted) {
+        printf("pci: %u interrupts arrived on the wrong CPU\n", g_pb_misrouted);
+        ret = -EIO;
+    }
+
+    for (pci_dev_t *dev = NULL; (dev = pci_get_device(0x1b36, 0x0010, dev)) != NULL;) {
+        for (unsigned int i = 0; i < dev->nr_irqs; i++)
+            free_irq(dev->irqs[i].vector, &dev->irqs[i]);
+        pci_free_irq_vectors(dev);
+    }
+    return ret;
+}
+
+/*
+ * virtio-blk [ops] [block-size] [depth] [cpus] [image]
+ *
+ * Random block-size I/O (one write in four) from cpus submitters, each
+ * bound to its own CPU and keeping depth requests in flight, over an
+ * image file (default /tmp/virtio-blk.img, 64 MiB). Runs first against
+ * the file backend directly, then through the virtio-blk driver and the
+ * hosted device model with split rings, split rings with indirect
+ * descriptors and event indexes, and packed rings with both. Reports
+ * IOPS and the kicks and interrupts each request cost.
+ */
+#define VB_IMAGE_BYTES  (64ULL << 20)
+
+typedef struct {
+    block_request_t rq;
+    bool busy;
+} vb_slot_t;
+
+typedef struct {
+    block_device_t *bdev;
+    unsigned int cpu;
+    long ops;
+    int depth;
+    size_t bs;
+    uint8_t *buf;                       /* depth blocks */
+    vb_slot_t *slots;
+    long completed;
+    int errors;
+} vb_worker_t;
+
+static void vb_end_io(block_request_t *rq) {
+    vb_worker_t *w = rq->private;
+    if (rq->error) w->errors++;
+    w->completed++;
+    ((vb_slot_t *)rq)->busy = false;
+}
+
+static void *vb_submitter(void *arg) {
+    vb_worker_t *w = arg;
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (w->cpu + 1);
+    uint64_t blocks = w->bdev->size / w->bs;
+    long issued = 0;
+
+    cpu_bind(w->cpu);
+    while (w->completed < w->ops) {
+        for (int i = 0; i < w->depth && issued < w->ops; i++) {
+            vb_slot_t *slot = &w->slots[i];
+            if (slot->busy) continue;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            slot->busy = true;
+            slot->rq = (block_request_t){
+                .bdev = w->bdev, .op = issued % 4 == 3 ? BLOCK_OP_WRITE : BLOCK_OP_READ,
+                .offset = x % blocks * w->bs, .buf = w->buf + (size_t)i * w->bs,
+                .len = w->bs, .end_io = vb_end_io, .private = w,
+            };
+            issued++;
+            if (block_submit(&slot->rq) < 0) {
+                w->errors++;
+                w->completed++;
+                slot->busy = false;
+            }
+        }
+        if (!irq_poll()) cond_resched();
+    }
+    return NULL;
+}
+
+/* IOPS over the whole run; every submitter's CPU ends where it started */
+static double vb_run(block_device_t *bdev, long ops, size_t bs, int depth, int cpus, int *errors) {
+    vb_worker_t workers[NR_CPUS];
+    pthread_t threads[NR_CPUS];
+
+    memset(workers, 0, sizeof(workers));
+    for (int c = 0; c < cpus; c++) {
+        vb_worker_t *w = &workers[c];
+        w->bdev = bdev;
+        w->cpu = (unsigned int)c;
+        w->ops = ops / cpus;
+        w->depth = depth;
+        w->bs = bs;
+        w->buf = aligned_alloc(PAGE_SIZE, (size_t)depth * bs);
+        w->slots = calloc((size_t)depth, sizeof(*w->slots));
+        if (w->buf) memset(w->buf, 0x5a, (size_t)depth * bs);
+    }
+    double start = now_sec();
+    for (int c = 0; c < cpus; c++)
+        pthread_create(&threads[c], NULL, vb_submitter, &workers[c]);
+    for (int c = 0; c < cpus; c++)
+        pthread_join(threads[c], NULL);
+    double t = now_sec() - start;
+    cpu_bind(0);
+
+    long done = 0;
+    *errors = 0;
+    for (int c = 0; c < cpus; c++) {
+        done += workers[c].completed;
+        *errors += workers[c].errors;
+        free(workers[c].buf);
+        free(workers[c].slots);
+    }
+    return done / t;
+}
+
+static int bench_virtio_blk(int argc, char **argv) {
+    long ops = argc > 0 ? atol(argv[0]) : 100000;
+    long bs = argc > 1 ? atol(argv[1]) : 4096;
+    int depth = argc > 2 ? atoi(argv[2]) : 16;
+    int cpus = argc > 3 ? atoi(argv[3]) : 4;
+    const char *path = argc > 4 ? argv[4] : "/tmp/virtio-blk.img";
+    if (ops < 1 || bs < 512 || bs % 512 || bs > (64L << 10) || depth < 1 || depth > 128 ||
+        cpus < 1 || cpus > NR_CPUS)
+        return -EINVAL;
+
+    FILE *fp = fopen(path, "w+b");
+    if (!fp || fseek(fp, (long)VB_IMAGE_BYTES - 1, SEEK_SET) != 0 || fputc(0, fp) == EOF) {
+        printf("virtio-blk: cannot create %s\n", path);
+        if (fp) fclose(fp);
+        return -EIO;
+    }
+    fclose(fp);
+    printf("virtio-blk: %s, %ld ops of %ld bytes, %d CPUs at depth %d\n",
+           path, ops, bs, cpus, depth);
+
+    int errors, ret = 0;
+    block_device_t *file = block_device_create_file("vbfile", path);
+    if (!file) return -EIO;
+    double base = vb_run(file, ops, (size_t)bs, depth, cpus, &errors);
+    block_device_unregister(file);
+    printf("virtio-blk: %-28s %9.0f IOPS\n", "file backend", base);
+    if (errors) ret = -EIO;
+
+    static const struct {
+        const char *name;
+        uint64_t features;
+    } configs[] = {
+        { "split", 0 },
+        { "split, indirect, event idx",
+          VIRTIO_F(VIRTIO_F_RING_INDIRECT_DESC) | VIRTIO_F(VIRTIO_F_RING_EVENT_IDX) },
+        { "packed, indirect, event idx",
+          VIRTIO_F(VIRTIO_F_RING_PACKED) | VIRTIO_F(VIRTIO_F_RING_INDIRECT_DESC) |
+          VIRTIO_F(VIRTIO_F_RING_EVENT_IDX) },
+    };
+    int level = printk_loglevel();
+    printk_set_loglevel(LOGLEVEL_WARNING);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        int err = virtio_blk_model_create(path, configs[i].features);
+        if (err == 0) pci_scan_devices();
+        if (err == 0) err = virtio_blk_init();
+        pci_dev_t *pci = pci_get_device(VIRTIO_PCI_VENDOR_ID, VIRTIO_PCI_DEVICE_ID(VIRTIO_ID_BLOCK), NULL);
+        virtio_device_t *vdev = pci ? pci->driver_data : NULL;     /* Leads the driver's state */
+        if (err < 0 || !vdev) {
+            printf("virtio-blk: %s: cannot bring the device up: %d\n", configs[i].name, err);
+            virtio_blk_exit();
+            virtio_blk_model_destroy();
+            ret = -EIO;
+            continue;
+        }
+
+        double iops = vb_run(block_device_lookup("vda"), ops, (size_t)bs, depth, cpus, &errors);
+        uint64_t kicks = 0, irqs = 0;
+        for (unsigned int q = 0; q < vdev->nvqs; q++) {
+            kicks += vdev->vqs[q]->kicks;
+            irqs += vdev->vqs[q]->interrupts;
+        }
+        printf("virtio-blk: %-28s %9.0f IOPS (%3.0f%%), %.3f kicks and %.3f interrupts per request\n",
+               configs[i].name, iops, iops * 100 / base, (double)kicks / ops, (double)irqs / ops);
+        if (errors) {
+            printf("virtio-blk: %s: %d requests failed\n", configs[i].name, errors);
+            ret = -EIO;
+        }
+        virtio_blk_exit();
+        virtio_blk_model_destroy();
+    }
+    printk_set_loglevel(level);
+    remove(path);
+    return ret;
+}
+
+/*
+ * boot [rounds]
+ *
+ * Boots this binary rounds times with the initcall graph run one step
+ * at a time on the boot CPU (initcall.serial=1), as kernel_main() did
+ * before, and rounds times in parallel. Reports the median wall time of
+ * the whole boot and the median time the kernel spent in its initcalls
+ * before it went on to mount root and start init.
+ */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int bench_boot(int argc, char **argv) {
+    int rounds = argc > 0 ? atoi(argv[0]) : 20;
+    if (rounds < 1 || rounds > 1000) return -EINVAL;
+
+#ifdef __unix__
+    static const char *const modes[] = { "initcall.serial=1", "" };
+    double *wall = malloc((size_t)rounds * sizeof(*wall));
+    double *init = malloc((size_t)rounds * sizeof(*init));
+    double median[2] = { 0 };
+    int ret = 0;
+    if (!wall || !init) {
+        free(wall);
+        free(init);
+        return -ENOMEM;
+    }
+
+    for (int m = 0; m < 2 && ret == 0; m++) {
+        for (int r = 0; r < rounds; r++) {
+            FILE *out = tmpfile();
+            if (!out) {
+                ret = -EIO;
+                break;
+            }
+            int status;
+            wall[r] = pk_boot(modes[m], fileno(out), &status);
+            init[r] = -1;
+            rewind(out);
+            char line[256], last[256] = "";
+            unsigned int nr;
+            unsigned long long us;
+            while (fgets(line, sizeof(line), out)) {
+                if (sscanf(line, "[INFO] ✓ %u initcalls in %llu us", &nr, &us) == 2) init[r] = us / 1e6;
+                if (line[0] != '\n') memcpy(last, line, sizeof(last));
+            }
+            fclose(out);
+            if (wall[r] < 0 || init[r] < 0) {
+                char what[64];
+                snprintf(what, sizeof(what), "boot: %s boot %d", m ? "parallel" : "serial", r);
+                pk_boot_report(what, status, last);
+                ret = -EIO;
+                break;
+            }
+        }
+        if (ret < 0) break;
+        qsort(wall, (size_t)rounds, sizeof(*wall), cmp_double);
+        qsort(init, (size_t)rounds, sizeof(*init), cmp_double);
+        median[m] = init[rounds / 2];
+        printf("boot: %-8s  boot %7.2f ms (best %7.2f), initcalls %7.2f ms (best %7.2f)\n",
+               m ? "parallel" : "serial", wall[rounds / 2] * 1e3, wall[0] * 1e3,
+               init[rounds / 2] * 1e3, init[0] * 1e3);
+    }
+    if (ret == 0)
+        printf("boot: initcalls %.1fx faster in parallel\n", median[0] / median[1]);
+    free(wall);
+    free(init);
+    return ret;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/*
+ * exec [rounds] [small-KB] [large-KB]
+ *
+ * exec a small static binary and a large PIE with an interpreter, all
+ * generated on tmpfs: first checking the image (argv, envp and auxv on
+ * the stack, segment contents, copy-on-write .data, zeroed .bss), then
+ * timing exec plus a first touch of the entry page three ways: copying
+ * every segment into anonymous memory up front, demand-mapped with the
+ * headers parsed afresh, and demand-mapped with the headers cached on
+ * the inode.
+ */
+typedef struct {
+    uint64_t base;                  /* vaddr of file offset 0 */
+    uint64_t size;                  /* File */
+    uint64_t text_size;             /* r-x segment, headers included */
+    uint64_t data_off, data_vaddr, data_filesz, data_memsz;
+    uint64_t entry;
+} exec_image_t;
+
+static uint8_t exec_pattern(uint64_t off) {
+    return (uint8_t)(off ^ (off >> 8) ^ 0x5a);
+}
+
+static int exec_write_image(const char *path, uint16_t type, size_t text_kb, const char *interp,
+                            exec_image_t *img) {
+    Elf64_Phdr ph[5];
+    unsigned int n = 0;
+    size_t interp_len = interp ? strlen(interp) + 1 : 0;
+
+    memset(img, 0, sizeof(*img));
+    img->base = type == ET_EXEC ? 0x400000 : 0;
+    img->text_size = (text_kb * 1024 + PAGE_SIZE - 1) & PAGE_MASK;
+    if (img->text_size < PAGE_SIZE) img->text_size = PAGE_SIZE;
+    img->data_off = img->text_size;
+    img->data_vaddr = img->base + img->text_size + PAGE_SIZE;
+    img->data_filesz = PAGE_SIZE + 0x100;   /* .bss starts part way into a page */
+    img->data_memsz = img->data_filesz + 64 * 1024;
+    img->size = img->data_off + img->data_filesz + 0x200;     /* Trailing bytes share the page */
+
+    uint64_t hdr = sizeof(Elf64_Ehdr) + 5 * sizeof(Elf64_Phdr) + interp_len;
+    img->entry = img->base + ((hdr + 15) & ~15ULL);
+
+    ph[n++] = (Elf64_Phdr){ .p_type = PT_PHDR, .p_flags = PF_R, .p_offset = sizeof(Elf64_Ehdr),
+                            .p_vaddr = img->base + sizeof(Elf64_Ehdr),
+                            .p_filesz = 5 * sizeof(Elf64_Phdr), .p_memsz = 5 * sizeof(Elf64_Phdr),
+                            .p_align = 8 };
+    if (interp)
+        ph[n++] = (Elf64_Phdr){ .p_type = PT_INTERP, .p_flags = PF_R,
+                                .p_offset = sizeof(Elf64_Ehdr) + 5 * sizeof(Elf64_Phdr),
+                                .p_filesz = interp_len, .p_memsz = interp_len, .p_align = 1 };
+    ph[n++] = (Elf64_Phdr){ .p_type = PT_LOAD, .p_flags = PF_R | PF_X, .p_vaddr = img->base,
+                            .p_filesz = img->text_size, .p_memsz = img->text_size,
+                            .p_align = PAGE_SIZE };
+    ph[n++] = (Elf64_Phdr){ .p_type = PT_LOAD, .p_flags = PF_R | PF_W, .p_offset = img->data_off,
+                            .p_vaddr = img->data_vaddr, .p_filesz = img->data_filesz,
+                            .p_memsz = img->data_memsz, .p_align = PAGE_SIZE };
+    ph[n++] = (Elf64_Phdr){ .p_type = PT_GNU_STACK, .p_flags = PF_R | PF_W };
+    if (!interp) {
+        /* Keep the header size fixed; a second PT_GNU_STACK is harmless */
+        ph[n] = ph[n - 1];
+        n++;
+    }
+
+    Elf64_Ehdr eh = {
+        .e_ident = { 0x7f, 'E', 'L', 'F', ELFCLASS64, ELFDATA2LSB, EV_CURRENT },
+        .e_type = type, .e_machine = EM_X86_64, .e_version = EV_CURRENT,
+        .e_entry = img->entry, .e_phoff = sizeof(Elf64_Ehdr), .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_phentsize = sizeof(Elf64_Phdr), .e_phnum = (uint16_t)n,
+    };
+
+    uint8_t *buf = malloc(img->size);
+    if (!buf) return -ENOMEM;
+    for (uint64_t i = 0; i < img->size; i++) buf[i] = exec_pattern(i);
+    memcpy(buf, &eh, sizeof(eh));
+    memcpy(buf + sizeof(eh), ph, sizeof(ph));
+    if (interp) memcpy(buf + sizeof(eh) + sizeof(ph), interp, interp_len);
+
+    int ret;
+    file_t *f = vfs_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755, &ret);
+    if (f) {
+        int64_t w = vfs_write(f, buf, img->size);
+        ret = w < 0 ? (int)w : w == (int64_t)img->size ? 0 : -EIO;
+        vfs_close(f);
+    }
+    free(buf);
+    return ret;
+}
+
+static uint64_t exec_auxv(mm_struct_t *mm, uint64_t type) {
+    uint64_t p = mm->start_stack, v = 1;
+    for (int nulls = 0; nulls < 2; p += 8)          /* Past argv[] and envp[] */
+        if (copy_from_mm(mm, &v, p + 8, 8) < 0 || !v) nulls++;
+    for (p += 8; copy_from_mm(mm, &v, p, 8) == 0 && v != AT_NULL; p += 16)
+        if (v == type && copy_from_mm(mm, &v, p + 8, 8) == 0) return v;
+    return 0;
+}
+
+static int exec_check(const char *path, const exec_image_t *img, const exec_image_t *ld,
+                      char *const args[], char *const envs[]) {
+    mm_struct_t *mm = mm_alloc();
+    uint8_t got[64], want[64];
+    uint64_t v = 0;
+    char str[16];
+    const char *what = "exec";
+    if (!mm) return -ENOMEM;
+
+    int ret = exec_load(mm, path, args, envs);
+    if (ret < 0) goto out;
+    ret = -EIO;
+    what = "argc/argv/envp";
+    if (copy_from_mm(mm, &v, mm->start_stack, 8) < 0 || v != 3 || (mm->start_stack & 15)) goto out;
+    if (copy_from_mm(mm, &v, mm->start_stack + 8, 8) < 0 ||
+        copy_from_mm(mm, str, v, strlen(args[0]) + 1) < 0 || strcmp(str, args[0])) goto out;
+    if (copy_from_mm(mm, &v, mm->start_stack + 5 * 8, 8) < 0 ||
+        copy_from_mm(mm, str, v, strlen(envs[0]) + 1) < 0 || strcmp(str, envs[0])) goto out;
+
+    what = "auxv";
+    uint64_t bias = exec_auxv(mm, AT_ENTRY) - img->entry;
+    if (img->base && bias) goto out;
+    if (exec_auxv(mm, AT_PHDR) != bias + img->base + sizeof(Elf64_Ehdr) ||
+        exec_auxv(mm, AT_PAGESZ) != PAGE_SIZE || !exec_auxv(mm, AT_RANDOM)) goto out;
+    uint64_t at_base = exec_auxv(mm, AT_BASE);
+    if (ld ? mm->entry != at_base + ld->entry : (at_base || mm->entry != bias + img->entry))
+        goto out;
+
+    what = "text";
+    for (unsigned int i = 0; i < sizeof(want); i++)
+        want[i] = exec_pattern(img->entry - img->base + i);
+    if (copy_from_mm(mm, got, bias + img->entry, sizeof(got)) < 0 || memcmp(got, want, sizeof(got)))
+        goto out;
+    if (copy_to_mm(mm, bias + img->entry, got, 1) != -EFAULT) goto out;
+
+    what = ".data copy-on-write";
+    uint64_t data = bias + img->data_vaddr;
+    memset(got, 0xee, 8);
+    if (copy_to_mm(mm, data, got, 8) < 0 || copy_from_mm(mm, want, data, 8) < 0 ||
+        memcmp(got, want, 8)) goto out;
+    inode_t *inode;
+    if (vfs_lookup(path, &inode) < 0) goto out;
+    int r = inode_read(inode, want, 8, img->data_off);
+    iput(inode);
+    if (r != 8 || want[0] != exec_pattern(img->data_off)) goto out;
+
+    what = ".bss";
+    for (uint64_t off = img->data_filesz; off < img->data_memsz; off += 0x80) {
+        if (copy_from_mm(mm, got, data + off, 1) < 0 || got[0]) goto out;
+    }
+    ret = 0;
+out:
+    if (ret < 0) printf("exec: %s: %s check failed (%d)\n", path, what, ret);
+    mmput(mm);
+    return ret;
+}
+
+/* Without demand paging: every segment read into anonymous memory before the first instruction */
+static int exec_eager(mm_struct_t *mm, const char *path, const exec_image_t *img, uint8_t *buf) {
+    inode_t *inode;
+    int ret = vfs_lookup(path, &inode);
+    if (ret < 0) return ret;
+    ret = inode_read(inode, buf, img->size, 0);
+    iput(inode);
+    if (ret != (int)img->size) return ret < 0 ? ret : -EIO;
+
+    uint64_t bias = img->base ? 0 : 0x555555554000ULL;
+    unsigned int rwx = VM_READ | VM_WRITE | VM_EXEC;
+    int64_t r;
+    if ((r = do_mmap(mm, bias + img->base, img->text_size, rwx, MAP_FIXED, NULL, 0)) < 0 ||
+        (r = do_mmap(mm, bias + img->data_vaddr, img->data_memsz, rwx, MAP_FIXED, NULL, 0)) < 0 ||
+        (r = do_mmap(mm, STACK_TOP - STACK_SIZE_DEFAULT, STACK_SIZE_DEFAULT, VM_READ | VM_WRITE,
+                     MAP_FIXED, NULL, 0)) < 0)
+        return (int)r;
+    if ((ret = copy_to_mm(mm, bias + img->base, buf, img->text_size)) < 0 ||
+        (ret = copy_to_mm(mm, bias + img->data_vaddr, buf + img->data_off, img->data_filesz)) < 0 ||
+        (ret = copy_to_mm(mm, STACK_TOP - 256, buf, 256)) < 0)
+        return ret;
+    mm->entry = bias + img->entry;
+    return 0;
+}
+
+static int bench_exec(int argc, char **argv) {
+    int rounds = argc > 0 ? atoi(argv[0]) : 200;
+    int small_kb = argc > 1 ? atoi(argv[1]) : 16;
+    int large_kb = argc > 2 ? atoi(argv[2]) : 16384;
+    if (rounds < 1 || small_kb < 1 || large_kb < 1 || large_kb > 65536) return -EINVAL;
+
+    static const char *const names[] = { "small", "large" };
+    static const char *const paths[] = { "/bin/small", "/bin/large" };
+    static const char *const modes[] = { "eager copy", "lazy, cold headers", "lazy, cached headers" };
+    char *args[] = { "prog", "-v", "arg", NULL };
+    char *envs[] = { "PATH=/bin", "HOME=/", NULL };
+    exec_image_t img[2], ld;
+    sysinfo_t si;
+
+    int ret = mount_fs("size=50%", "/", "tmpfs");
+    if (ret == 0) ret = vfs_mkdir("/bin", 0755);
+    if (ret == 0) ret = vfs_mkdir("/lib", 0755);
+    if (ret == 0) ret = exec_write_image("/lib/ld.so", ET_DYN, 64, NULL, &ld);
+    if (ret == 0) ret = exec_write_image(paths[0], ET_EXEC, (size_t)small_kb, NULL, &img[0]);
+    if (ret == 0) ret = exec_write_image(paths[1], ET_DYN, (size_t)large_kb, "/lib/ld.so", &img[1]);
+    if (ret < 0) {
+        printf("exec setup failed: %d\n", ret);
+        return ret;
+    }
+    for (int b = 0; b < 2 && ret == 0; b++)
+        ret = exec_check(paths[b], &img[b], b ? &ld : NULL, args, envs);
+
+    double *t = malloc((size_t)rounds * sizeof(*t));
+    uint8_t *buf = malloc(img[1].size > img[0].size ? img[1].size : img[0].size);
+    if (!t || !buf) ret = -ENOMEM;
+
+    for (int b = 0; b < 2 && ret == 0; b++) {
+        printf("exec: %s: %llu KiB %s%s\n", names[b], (unsigned long long)img[b].size / 1024,
+               img[b].base ? "static" : "PIE", b ? " + interpreter" : "");
+        for (int m = 0; m < 3 && ret == 0; m++) {
+            uint64_t faults = 0, rss = 0;
+            for (int r = 0; r < rounds && ret == 0; r++) {
+                inode_t *inode;
+                if (m == 1 && vfs_lookup(paths[b], &inode) == 0) {
+                    exec_cache_drop(inode);
+                    iput(inode);
+                }
+                mm_struct_t *mm = mm_alloc();
+                if (!mm) {
+                    ret = -ENOMEM;
+                    break;
+                }
+                double start = now_sec();
+                ret = m ? exec_load(mm, paths[b], args, envs) : exec_eager(mm, paths[b], &img[b], buf);
+                uint8_t first[16];
+                if (ret == 0) ret = copy_from_mm(mm, first, mm->entry, sizeof(first));
+                t[r] = now_sec() - start;
+                faults += mm->min_flt + mm->maj_flt;
+                rss += mm->rss;
+                mmput(mm);
+            }
+            if (ret < 0) break;
+            qsort(t, (size_t)rounds, sizeof(*t), cmp_double);
+            printf("  %-22s %9.1f us (best %9.1f), %5.1f faults, %7.1f pages mapped\n", modes[m],
+                   t[rounds / 2] * 1e6, t[0] * 1e6, (double)faults / rounds, (double)rss / rounds);
+        }
+    }
+    if (ret < 0) printf("exec: error %d\n", ret);
+
+    exec_stats_t st;
+    exec_get_stats(&st);
+    printf("exec: %llu execs, headers cached %llu, parsed %llu; %llu page faults, %llu major\n",
+           (unsigned long long)st.execs, (unsigned long long)st.hdr_cache_hits,
+           (unsigned long long)st.hdr_cache_misses, (unsigned long long)vm_event_count(PGFAULT),
+           (unsigned long long)vm_event_count(PGMAJFAULT));
+
+    free(t);
+    free(buf);
+    int err = vfs_unlink(paths[0]);
+    if (err == 0) err = vfs_unlink(paths[1]);
+    if (err == 0) err = vfs_unlink("/lib/ld.so");
+    do_sysinfo(&si);
+    if (err == 0 && si.shared_memory != 0) {
+        printf("exec: %u tmpfs pages still referenced\n", si.shared_memory);
+        err = -EIO;
+    }
+    if (err == 0) err = vfs_rmdir("/lib");
+    if (err == 0) err = vfs_rmdir("/bin");
+    if (err == 0) err = umount_fs("/");
+    return ret ? ret : err;
+}
+
+/*
+ * The spawn and clone benches run as a launcher: pid 1 on a fresh tmpfs,
+ * exec'd from a small static binary at path, with anonymous memory
+ * grown to order.
+ */
+static pid_t launcher_start(const char *path, char *const args[], char *const envs[]) {
+    exec_image_t img;
+
+    init_scheduler();
+    int ret = mount_fs("size=50%", "/", "tmpfs");
+    if (ret == 0) ret = vfs_mkdir("/bin", 0755);
+    if (ret == 0) ret = exec_write_image(path, ET_EXEC, 16, NULL, &img);
+    pid_t pid = ret == 0 ? do_fork() : ret;
+    if (pid > 0 && (ret = do_execve(path, args, envs)) < 0) return ret;
+    return pid;
+}
+
+/* A fresh mapping of mb MiB in place of the last one, every page touched */
+static int launcher_grow(uint64_t *heap, uint64_t *heap_len, long mb) {
+    mm_struct_t *mm = current_mm();
+    if (*heap_len) do_munmap(mm, *heap, *heap_len);
+    *heap_len = (uint64_t)mb << 20;
+    if (!mb) return 0;
+    int64_t addr = do_mmap(mm, 0, *heap_len, VM_READ | VM_WRITE, 0, NULL, 0);
+    if (addr < 0) return (int)addr;
+    *heap = (uint64_t)addr;
+    return clear_mm(mm, *heap, *heap_len);
+}
+
+/* Exit the launcher, remove files[] and check the tmpfs has no pages left in use */
+static int launcher_stop(const char *bench, const char *const files[]) {
+    sysinfo_t si;
+    int err = 0;
+
+    do_exit(0);                             /* Drops the launcher's memory */
+    for (unsigned int i = 0; err == 0 && files[i]; i++)
+        err = vfs_unlink(files[i]);
+    do_sysinfo(&si);
+    if (err == 0 && si.shared_memory != 0) {
+        printf("%s: %u tmpfs pages still referenced\n", bench, si.shared_memory);
+        err = -EIO;
+    }
+    if (err == 0) err = vfs_rmdir("/bin");
+    if (err == 0) err = umount_fs("/");
+    return err;
+}
+
+/*
+ * spawn [spawns] [rss-MB...]
+ *
+ * A launcher process (pid 1, exec'd from a small static binary) grows its
+ * anonymous memory to each RSS in turn and starts spawns children of the
+ * same binary, each with the same three file actions, two ways: fork
+ * followed by the child's side of exec (file actions, load, replace the
+ * duplicated address space), and spawn, which never copies the launcher.
+ * Children are reaped as they are made. The file actions, attributes and
+ * the failure path are checked first.
+ */
+static const spawn_file_action_t g_spawn_actions[] = {
+    { .action = SPAWN_FA_OPEN, .fd = 3, .flags = O_WRONLY | O_CREAT, .mode = 0644,
+      .path = "/spawn.log" },
+    { .action = SPAWN_FA_DUP2, .fd = 7, .srcfd = 3 },
+    { .action = SPAWN_FA_CLOSE, .fd = 3 },
+};
+#define SPAWN_NR_ACTIONS (sizeof(g_spawn_actions) / sizeof(g_spawn_actions[0]))
+
+/* fork, then what the child would do before running the program */
+static pid_t spawn_by_fork(const char *path, char *const args[], char *const envs[]) {
+    pid_t pid = do_fork();
+    if (pid < 0) return pid;
+
+    int ret = 0;
+    files_struct_t *files = get_task_files(pid);
+    for (unsigned int i = 0; files && ret == 0 && i < SPAWN_NR_ACTIONS; i++)
+        ret = spawn_file_action(files, &g_spawn_actions[i]);
+    put_files_struct(files);
+
+    mm_struct_t *mm = mm_alloc(), *old = NULL;
+    if (!mm) ret = -ENOMEM;
+    if (ret == 0) ret = exec_load(mm, path, args, envs);
+    if (ret == 0) ret = exec_mm_replace(pid, mm, "small", &old);
+    if (ret < 0) {
+        mmput(mm);
+        process_release(pid);
+        return ret;
+    }
+    mmput(old);
+    return pid;
+}
+
+static int spawn_check(const char *path, char *const args[], char *const envs[]) {
+    spawn_attr_t attr = { .flags = SPAWN_SETPRIORITY | SPAWN_SETSIGMASK, .priority = 5,
+                          .sigmask = 1ULL << (15 - 1) };
+    process_info_t info;
+    inode_t *log;
+    const char *what = "spawn";
+    int nr = nr_processes();
+
+    pid_t pid = do_spawn(path, g_spawn_actions, SPAWN_NR_ACTIONS, &attr, args, envs);
+    if (pid < 0) goto out;
+    files_struct_t *files = get_task_files(pid);
+    file_t *moved = files ? fget_files(files, 7) : NULL;
+    file_t *closed = files ? fget_files(files, 3) : NULL;
+    int ret = vfs_lookup("/spawn.log", &log);
+    what = "file actions";
+    bool ok = ret == 0 && moved && moved->inode == log && !closed;
+    if (ret == 0) iput(log);
+    if (moved) fput(moved);
+    if (closed) fput(closed);
+    put_files_struct(files);
+    if (!ok) goto out;
+    what = "attributes";
+    if (process_get_info(pid, &info) < 0 || info.priority != 5 || strcmp(info.name, "small")) goto out;
+    what = "release";
+    if (process_release(pid) < 0) goto out;
+
+    what = "failure";
+    spawn_file_action_t bad = { .action = SPAWN_FA_DUP2, .fd = 4, .srcfd = 99 };
+    if (do_spawn("/bin/missing", NULL, 0, NULL, args, envs) != -ENOENT ||
+        do_spawn(path, &bad, 1, NULL, args, envs) != -EBADF ||
+        (attr.priority = 20, do_spawn(path, NULL, 0, &attr, args, envs)) != -EINVAL ||
+        nr_processes() != nr) goto out;
+    return 0;
+out:
+    printf("spawn: %s check failed (%d)\n", what, pid);
+    return pid < 0 ? pid : -EIO;
+}
+
+static int bench_spawn(int argc, char **argv) {
+    int spawns = argc > 0 ? atoi(argv[0]) : 2000;
+    static char *def_rss[] = { "0", "16", "64", "128" };
+    if (argc > 1) {
+        argc--;
+        argv++;
+    } else {
+        argc = 4;
+        argv = def_rss;
+    }
+    if (spawns < 1) return -EINVAL;
+
+    const char *path = "/bin/small";
+    static const char *const files[] = { "/bin/small", "/spawn.log", NULL };
+    char *args[] = { "small", NULL };
+    char *envs[] = { "PATH=/bin", NULL };
+
+    int ret = launcher_start(path, args, envs);
+    if (ret < 0 || (ret = spawn_check(path, args, envs)) < 0) {
+        printf("spawn setup failed: %d\n", ret);
+        return ret;
+    }
+
+    printf("spawn: %d children of %s, %u file actions each\n", spawns, path,
+           (unsigned int)SPAWN_NR_ACTIONS);
+    uint64_t heap = 0, heap_len = 0;
+    for (int a = 0; a < argc && ret == 0; a++) {
+        long mb = atol(argv[a]);
+        if (mb < 0 || mb > 4096) {
+            ret = -EINVAL;
+            break;
+        }
+        if ((ret = launcher_grow(&heap, &heap_len, mb)) < 0) break;
+
+        double rate[2] = { 0, 0 };
+        for (int m = 0; m < 2 && ret == 0; m++) {
+            double start = now_sec();
+            for (int i = 0; i < spawns && ret == 0; i++) {
+                pid_t pid = m ? do_spawn(path, g_spawn_actions, SPAWN_NR_ACTIONS, NULL, args, envs)
+                              : spawn_by_fork(path, args, envs);
+                ret = pid < 0 ? pid : process_release(pid);
+            }
+            rate[m] = spawns / (now_sec() - start);
+        }
+        if (ret < 0) break;
+        printf("  parent RSS %5llu MiB (%7llu pages): fork+exec %9.0f/s, spawn %9.0f/s (%.1fx)\n",
+               (unsigned long long)mb, (unsigned long long)current_mm()->rss, rate[0], rate[1],
+               rate[1] / rate[0]);
+    }
+    if (ret < 0) printf("spawn: error %d\n", ret);
+
+    int err = launcher_stop("spawn", files);
+    return ret ? ret : err;
+}
+
+/*
+ * clone [tasks] [rss-MB] [fds]
+ *
+ * Thread creation against process creation. The launcher grows to
+ * rss-MB of anonymous memory and fds open files, then creates tasks
+ * tasks at once and reaps them, by fork (copies the address space and
+ * descriptor table) and as threads (CLONE_VM | CLONE_FILES |
+ * CLONE_SIGHAND | CLONE_THREAD: three references and a cached stack).
+ * Threads are first run once through schedule() to check what they see.
+ */
+typedef struct {
+    tid_t tid;
+    pid_t pid;
+    mm_struct_t *mm;
+    files_struct_t *files;
+    uint64_t tls;
+    bool tls_ok;
+} clone_seen_t;
+
+static void clone_thread_fn(void *arg) {
+    clone_seen_t *seen = arg;
+    seen->tid = do_gettid();
+    seen->pid = do_getpid();
+    seen->mm = current_mm();
+    seen->files = current_files();
+    seen->tls = current_tls();
+    /* Default TLS: the TCB points to itself and the data below it is zeroed */
+    const uint64_t *tcb = (const uint64_t *)(uintptr_t)seen->tls;
+    seen->tls_ok = tcb && tcb[0] == seen->tls && tcb[-1] == 0 &&
+                   tcb[-(int)((THREAD_TLS_SIZE - 64) / 8)] == 0;
+}
+
+static void clone_noop_fn(void *arg) {
+    (void)arg;
+}
+
+static int clone_check(pid_t launcher) {
+    clone_seen_t seen[2];
+    uint64_t tls_block[8];
+    process_info_t info;
+    const char *what = "clone";
+    int ret = 0;
+
+    memset(seen, 0, sizeof(seen));
+    tid_t tid[2];
+    tid[0] = do_clone(CLONE_VM | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD, clone_thread_fn,
+                      &seen[0], 0);
+    tid[1] = do_clone(CLONE_VM | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SETTLS,
+                      clone_thread_fn, &seen[1], (uint64_t)(uintptr_t)tls_block);
+    if (tid[0] < 0 || tid[1] < 0) {
+        ret = tid[0] < 0 ? tid[0] : tid[1];
+        goto out;
+    }
+    ret = -EIO;
+    what = "thread group";
+    if (process_get_info(tid[0], &info) < 0 || info.tgid != launcher || info.ppid != do_getppid())
+        goto out;
+
+    schedule();                             /* Runs each thread once; they exit and are reaped */
+    what = "thread context";
+    for (int i = 0; i < 2; i++)
+        if (seen[i].tid != tid[i] || seen[i].pid != launcher || seen[i].mm != current_mm() ||
+            seen[i].files != current_files()) goto out;
+    what = "TLS";
+    if (!seen[0].tls_ok || seen[1].tls != (uint64_t)(uintptr_t)tls_block) goto out;
+    what = "reaping";
+    if (nr_processes() != 1 || process_get_info(tid[0], &info) != -ENOENT) goto out;
+
+    what = "flags";
+    if (do_clone(CLONE_VM | CLONE_THREAD, clone_noop_fn, NULL, 0) != -EINVAL ||
+        do_clone(CLONE_SIGHAND, clone_noop_fn, NULL, 0) != -EINVAL) goto out;
+    pid_t pid = do_clone(0, clone_noop_fn, NULL, 0);
+    if (pid < 0 || process_get_info(pid, &info) < 0 || info.tgid != pid || info.ppid != launcher ||
+        process_release(pid) < 0) goto out;
+    ret = 0;
+out:
+    if (ret < 0) printf("clone: %s check failed (%d)\n", what, ret);
+    return ret;
+}
+
+static int bench_clone(int argc, char **argv) {
+    int tasks = argc > 0 ? atoi(argv[0]) : 1000;
+    long rss_mb = argc > 1 ? atol(argv[1]) : 32;
+    int nr_fds = argc > 2 ? atoi(argv[2]) : 64;
+    if (tasks < 1 || tasks >= PID_MAX - 1 || rss_mb < 0 || rss_mb > 4096 || nr_fds < 0) return -EINVAL;
+
+    const char *path = "/bin/small";
+    static const char *const files[] = { "/bin/small", NULL };
+    char *args[] = { "small", NULL };
+    char *envs[] = { "PATH=/bin", NULL };
+    uint64_t heap = 0, heap_len = 0;
+
+    pid_t launcher = launcher_start(path, args, envs);
+    int ret = launcher < 0 ? launcher : clone_check(launcher);
+    if (ret == 0) ret = launcher_grow(&heap, &heap_len, rss_mb);
+    for (int i = 0; i < nr_fds && ret >= 0; i++)
+        ret = do_open(path, O_RDONLY, 0);
+    if (ret < 0) {
+        printf("clone setup failed: %d\n", ret);
+        return ret;
+    }
+    ret = 0;
+
+    pid_t *ids = malloc((size_t)tasks * sizeof(*ids));
+    if (!ids) return -ENOMEM;
+    printf("clone: %d tasks at once; launcher has %lu pages mapped, %d files open\n", tasks,
+           current_mm()->rss, nr_fds);
+    static const char *const modes[] = { "fork", "thread" };
+    double us[2][2];
+    for (int m = 0; m < 2 && ret == 0; m++) {
+        double start = now_sec();
+        for (int i = 0; i < tasks && ret == 0; i++) {
+            ids[i] = m ? do_clone(CLONE_VM | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD,
+                                  clone_noop_fn, NULL, 0)
+                       : do_fork();
+            if (ids[i] < 0) {
+                ret = ids[i];
+                tasks = i;
+            }
+        }
+        double mid = now_sec();
+        for (int i = 0; i < tasks; i++) {
+            int r = process_release(ids[i]);
+            if (ret == 0) ret = r;
+        }
+        us[m][0] = (mid - start) * 1e6 / tasks;
+        us[m][1] = (now_sec() - mid) * 1e6 / tasks;
+        if (ret == 0)
+            printf("  %-6s  create %8.2f us, reap %8.2f us\n", modes[m], us[m][0], us[m][1]);
+    }
+    if (ret == 0) printf("  thread creation %.1fx cheaper than fork\n", us[0][0] / us[1][0]);
+    else printf("clone: error %d\n", ret);
+
+    free(ids);
+    int err = launcher_stop("clone", files);
+    return ret ? ret : err;
+}
+
+typedef struct {
+    int coroutines;
+    int yields;
+    int io_ops;
+    vos_fd_t fd;
+    long bad;
+} co_bench_t;
+
+static co_bench_t g_co_bench;
+
+static void *co_yield_fn(void *arg) {
+    for (int i = 0; i < g_co_bench.yields; i++)
+        vos_co_yield();
+    return (char *)arg + 1;
+}
+
+/* Awaits a child that may well finish on another worker */
+static void *co_nested_fn(void *arg) {
+    vos_co_t *child = vos_co_spawn(co_yield_fn, arg);
+    return child ? vos_co_await(child) : NULL;
+}
+
+static void *co_yield_main(void *arg) {
+    (void)arg;
+    vos_co_t **cos = malloc((size_t)g_co_bench.coroutines * sizeof(*cos));
+    if (!cos) return NULL;
+    for (int i = 0; i < g_co_bench.coroutines; i++)
+        cos[i] = vos_co_spawn(i % 8 ? co_yield_fn : co_nested_fn, (void *)(uintptr_t)(2 * i));
+    for (int i = 0; i < g_co_bench.coroutines; i++) {
+        if (!cos[i] || vos_co_await(cos[i]) != (void *)(uintptr_t)(2 * i + 1))
+            g_co_bench.bad++;
+    }
+    free(cos);
+    return cos;
+}
+
+/* Write a block, read it back; each coroutine parks on every operation */
+static void *co_io_fn(void *arg) {
+    int idx = (int)(uintptr_t)arg;
+    char wbuf[512], rbuf[512];
+    off_t off = (off_t)idx * (off_t)sizeof(wbuf);
+    memset(wbuf, 'a' + idx % 26, sizeof(wbuf));
+    if (vos_co_pwrite(g_co_bench.fd, wbuf, sizeof(wbuf), off) != (ssize_t)sizeof(wbuf) ||
+        vos_co_pread(g_co_bench.fd, rbuf, sizeof(rbuf), off) != (ssize_t)sizeof(rbuf) ||
+        memcmp(wbuf, rbuf, sizeof(rbuf)) != 0)
+        __atomic_add_fetch(&g_co_bench.bad, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void *co_io_main(void *arg) {
+    (void)arg;
+    for (int i = 0; i < g_co_bench.io_ops; i++) {
+        if (!vos_co_spawn(co_io_fn, (void *)(uintptr_t)i))    /* Freed when the run ends */
+            g_co_bench.bad++;
+    }
+    return NULL;
+}
+
+/*
+ * coroutines [coroutines] [yields] [io-coroutines]
+ *
+ * Switch rate of the coroutine runtime on 1, 2, 4 and 8 workers: every
+ * coroutine yields in a loop and the first one awaits them all (every
+ * eighth through a child of its own). Then a batch of coroutines each
+ * write and read back a block on tmpfs through the workers' rings,
+ * showing how many parked operations each kernel entry carried.
+ */
+static int bench_coroutines(int argc, char **argv) {
+    g_co_bench.coroutines = argc > 0 ? atoi(argv[0]) : 1000;
+    g_co_bench.yields = argc > 1 ? atoi(argv[1]) : 1000;
+    g_co_bench.io_ops = argc > 2 ? atoi(argv[2]) : 4096;
+    if (g_co_bench.coroutines < 1 || g_co_bench.yields < 0 || g_co_bench.io_ops < 1 ||
+        g_co_bench.io_ops > 16384)
+        return -EINVAL;
+
+    vos_co_stats_t stats;
+    void *result;
+    int ret = 0;
+    printf("coroutines: %d x %d yields, %d KiB stacks\n", g_co_bench.coroutines,
+           g_co_bench.yields, VOS_CO_STACK_SIZE / 1024);
+    for (unsigned int workers = 1; workers <= VOS_CO_MAX_WORKERS && ret == 0; workers *= 2) {
+        g_co_bench.bad = 0;
+        double start = now_sec();
+        ret = vos_co_run(workers, co_yield_main, NULL, &result);
+        double sec = now_sec() - start;
+        vos_co_get_stats(&stats);
+        if (ret == 0 && (!result || g_co_bench.bad)) ret = -EIO;
+        if (ret == 0)
+            printf("  %u worker%s  %10.0f switches/s  (%llu switches, %llu stolen)\n", workers,
+                   workers > 1 ? "s" : " ", stats.switches / sec,
+                   (unsigned long long)stats.switches, (unsigned long long)stats.steals);
+    }
+
+    size_t file_size = (size_t)g_co_bench.io_ops * 512;
+    char *fill = ret < 0 ? NULL : calloc(1, file_size);
+    if (ret == 0) ret = fill ? mount_fs("size=16M", "/", "tmpfs") : -ENOMEM;
+    g_co_bench.fd = ret < 0 ? ret : do_open("/co", O_RDWR | O_CREAT, 0644);
+    if (ret == 0 && g_co_bench.fd >= 0) {
+        /* Allocate every page up front so the coroutines only overwrite */
+        if (do_pwrite(g_co_bench.fd, fill, file_size, 0) != (int64_t)file_size) ret = -EIO;
+        for (unsigned int workers = 1; workers <= 4 && ret == 0; workers *= 4) {
+            g_co_bench.bad = 0;
+            double start = now_sec();
+            ret = vos_co_run(workers, co_io_main, NULL, NULL);
+            double sec = now_sec() - start;
+            vos_co_get_stats(&stats);
+            if (ret == 0 && g_co_bench.bad) ret = -EIO;
+            if (ret == 0)
+                printf("  I/O, %u worker%s  %10.0f ops/s  (%llu parked, %llu ring entries, "
+                       "%.1f per entry)\n", workers, workers > 1 ? "s" : " ",
+                       stats.io_parked / sec, (unsigned long long)stats.io_parked,
+                       (unsigned long long)stats.io_enters,
+                       (double)stats.io_parked / (double)(stats.io_enters ? stats.io_enters : 1));
+        }
+        do_close(g_co_bench.fd);
+        int err = vfs_unlink("/co");
+        if (err == 0) err = umount_fs("/");
+        if (ret == 0) ret = err;
+    } else if (ret == 0) {
+        ret = g_co_bench.fd;
+    }
+    free(fill);
+    if (ret < 0) printf("coroutines: error %d (%ld bad results)\n", ret, g_co_bench.bad);
+    return ret;
+}
+
+static volatile int g_sig_caught;
+static volatile tid_t g_sig_caught_by;
+
+static void sig_count_handler(int sig) {
+    if (sig == VOS_SIGUSR1) g_sig_caught++;
+}
+
+static void sig_tid_handler(int sig) {
+    (void)sig;
+    g_sig_caught_by = do_gettid();
+}
+
+static void sig_ran_fn(void *arg) {
+    *(bool *)arg = true;
+}
+
+/* Stop, continue and terminate a forked worker; signal tasks before they first run */
+static int signals_check_tasks(void) {
+    process_info_t info;
+    const char *what = "fork";
+    bool ran = false;
+    int ret;
+
+    pid_t pid = do_fork();
+    if (pid < 0) {
+        ret = pid;
+        goto out;
+    }
+    ret = -EIO;
+    what = "stop";
+    if (do_kill(pid, SIGSTOP) < 0) goto out;
+    schedule();                             /* The worker stops itself on its way back to user code */
+    if (process_get_info(pid, &info) < 0 || info.state != TASK_STOPPED) goto out;
+    what = "continue";
+    if (do_kill(pid, SIGCONT) < 0 || process_get_info(pid, &info) < 0 || info.state != TASK_RUNNABLE)
+        goto out;
+    what = "terminate";
+    if (do_kill(pid, SIGTERM) < 0) goto out;
+    schedule();
+    if (process_get_info(pid, &info) < 0 || info.state != TASK_DEAD || process_release(pid) < 0)
+        goto out;
+
+    what = "kill before running";
+    pid = do_clone(0, sig_ran_fn, &ran, 0);
+    if (pid < 0 || do_kill(pid, SIGKILL) < 0) goto out;
+    schedule();
+    if (ran || process_get_info(pid, &info) < 0 || info.state != TASK_DEAD || process_release(pid) < 0)
+        goto out;
+
+    /* A thread-directed signal runs the group's handler on that thread, before its body */
+    what = "tkill";
+    k_sigaction_t act = { .handler = sig_tid_handler };
+    g_sig_caught_by = 0;
+    if (do_sigaction(SIGUSR2, &act, NULL) < 0) goto out;
+    tid_t tid = do_clone(CLONE_VM | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD, sig_ran_fn, &ran, 0);
+    if (tid < 0 || do_tkill(tid, SIGUSR2) < 0) goto out;
+    schedule();
+    act.handler = KSIG_DFL;
+    do_sigaction(SIGUSR2, &act, NULL);
+    if (g_sig_caught_by != tid || !ran || nr_processes() != 1) goto out;
+    ret = 0;
+out:
+    if (ret < 0) printf("signals: %s check failed (%d)\n", what, ret);
+    return ret;
+}
+
+/* Signals queued to the launcher, then taken synchronously: by sigtimedwait, a signalfd and a ring */
+static int signals_check_queue(pid_t launcher, int nr, double *rate) {
+    const vos_sigset_t set = VOS_SIGMASK(VOS_SIGUSR2) | VOS_SIGMASK(VOS_SIGRTMIN) |
+                             VOS_SIGMASK(VOS_SIGRTMIN + 1);
+    const vos_timespec_t poll = { 0, 0 }, ms = { 0, 1000000 };
+    vos_sigset_t old, pending;
+    vos_siginfo_t info, rec[8];
+    vos_io_ring_t ring = { .fd = -1 };
+    vos_fd_t sfd = -1, bfd = -1;
+    const char *what = "mask";
+    int ret = vos_sigprocmask(VOS_SIG_BLOCK, &set, &old);
+    if (ret < 0) goto out;
+
+    ret = -EIO;
+    what = "queue";
+    double start = now_sec();
+    for (int i = 0; i < nr; i++) {
+        if (vos_sigqueue(launcher, VOS_SIGRTMIN + (i & 1), (uint64_t)i) < 0 ||
+            vos_kill(launcher, VOS_SIGUSR2) < 0) goto out;
+    }
+    if (vos_sigpending(&pending) < 0 || pending != set) goto out;
+
+    /* Lowest number first, one SIGUSR2 for all the kills, then each queue in order */
+    what = "order";
+    if (vos_sigtimedwait(set, &info, &poll) != VOS_SIGUSR2 || info.code != VOS_SI_USER ||
+        info.pid != launcher) goto out;
+    for (int i = 0; i < nr; i++) {
+        int want = i < (nr + 1) / 2 ? 2 * i : 2 * (i - (nr + 1) / 2) + 1;
+        if (vos_sigtimedwait(set, &info, &poll) != VOS_SIGRTMIN + (want & 1) ||
+            info.code != VOS_SI_QUEUE || info.value != (uint64_t)want) goto out;
+    }
+    *rate = 2.0 * nr / (now_sec() - start);
+    what = "timeout";
+    double waited = now_sec();
+    if (vos_sigtimedwait(set, &info, &poll) != -VOS_EAGAIN ||
+        vos_sigtimedwait(set, &info, &ms) != -VOS_EAGAIN || now_sec() - waited < 0.001) goto out;
+
+    what = "signalfd";
+    sfd = vos_signalfd(-1, VOS_SIGMASK(VOS_SIGRTMIN), VOS_SFD_NONBLOCK);
+    if (sfd < 0 || vos_read(sfd, rec, sizeof(rec)) != -VOS_EAGAIN) goto out;
+    for (int i = 0; i < 4; i++)
+        if (vos_sigqueue(launcher, VOS_SIGRTMIN, 100 + (uint64_t)i) < 0) goto out;
+    if (vos_read(sfd, rec, sizeof(rec)) != 4 * (ssize_t)sizeof(rec[0])) goto out;
+    for (int i = 0; i < 4; i++)
+        if (rec[i].signo != VOS_SIGRTMIN || rec[i].value != 100 + (uint64_t)i) goto out;
+
+    /* A blocking signalfd read parks in the ring until a signal comes */
+    what = "signalfd ring";
+    vos_io_cqe_t *cqe;
+    bfd = vos_signalfd(-1, VOS_SIGMASK(VOS_SIGRTMIN), 0);
+    if (bfd < 0 || vos_io_ring_init(8, &ring) < 0) goto out;
+    vos_io_prep_read(vos_io_get_sqe(&ring), bfd, rec, sizeof(rec), (off_t)-1);
+    if (vos_io_submit(&ring) != 1 || vos_io_peek_cqe(&ring, &cqe) != -VOS_EAGAIN ||
+        vos_sigqueue(launcher, VOS_SIGRTMIN, 7) < 0 || vos_io_wait_cqe(&ring, &cqe) < 0 ||
+        cqe->res != (int32_t)sizeof(rec[0]) || rec[0].value != 7) goto out;
+    vos_io_cqe_seen(&ring, cqe);
+    ret = 0;
+out:
+    if (ring.fd >= 0) vos_io_ring_exit(&ring);
+    if (bfd >= 0) vos_close(bfd);
+    if (sfd >= 0) vos_close(sfd);
+    vos_sigprocmask(VOS_SIG_SETMASK, &old, NULL);
+    if (ret < 0) printf("signals: %s check failed (%d)\n", what, ret);
+    return ret;
+}
+
+/*
+ * signals [calls] [signals]
+ *
+ * What the signal check on the return to user code costs: calls calls
+ * of gettid straight into the kernel, against the same calls through
+ * the library wrapper, which return through the check; idle and with a
+ * blocked signal pending, neither of which leaves the fast path (best
+ * of three rounds). Then
+ * signals to the launcher itself: caught by a handler on the way back
+ * from kill, and real-time signals queued and taken in order by
+ * sigtimedwait. Workers are stopped, continued and killed first, and
+ * signalfd reads checked, directly and parked in an I/O ring.
+ */
+static int bench_signals(int argc, char **argv) {
+    int calls = argc > 0 ? atoi(argv[0]) : 10000000;
+    int nr = argc > 1 ? atoi(argv[1]) : 2000;
+    if (calls < 1 || nr < 1 || nr >= SIGQUEUE_MAX) return -EINVAL;
+
+    const char *path = "/bin/small";
+    static const char *const files[] = { "/bin/small", NULL };
+    char *args[] = { "small", NULL };
+    char *envs[] = { "PATH=/bin", NULL };
+    volatile tid_t sink = 0;
+    double ns[3], queue_rate = 0;
+
+    pid_t launcher = launcher_start(path, args, envs);
+    int ret = launcher < 0 ? launcher : signals_check_tasks();
+    if (ret == 0) ret = signals_check_queue(launcher, nr, &queue_rate);
+    if (ret < 0) {
+        printf("signals setup failed: %d\n", ret);
+        return ret;
+    }
+
+    /* Best of three rounds each */
+    vos_sigset_t usr2 = VOS_SIGMASK(VOS_SIGUSR2);
+    for (int m = 0; m < 3; m++) {
+        if (m == 2 && (vos_sigprocmask(VOS_SIG_BLOCK, &usr2, NULL) < 0 ||
+                       vos_kill(launcher, VOS_SIGUSR2) < 0)) ret = -EIO;
+        ns[m] = 0;
+        for (int round = 0; round < 3; round++) {
+            double start = now_sec();
+            for (int i = 0; i < calls; i++)
+                sink = m ? vos_gettid() : do_gettid();
+            double t = (now_sec() - start) * 1e9 / calls;
+            if (!round || t < ns[m]) ns[m] = t;
+        }
+    }
+    if (ret == 0 && sink != launcher) ret = -EIO;
+    printf("signals: %d gettid calls\n", calls);
+    printf("  direct %.2f ns, wrapper + return check %.2f ns (+%.2f), blocked signal pending %.2f ns\n",
+           ns[0], ns[1], ns[1] - ns[0], ns[2]);
+
+    /* Each kill comes back through the slow path and runs the handler */
+    vos_sigaction_t act = { .handler = sig_count_handler };
+    g_sig_caught = 0;
+    if (ret == 0) ret = vos_sigaction(VOS_SIGUSR1, &act, NULL);
+    double start = now_sec();
+    for (int i = 0; i < nr && ret == 0; i++)
+        ret = vos_kill(launcher, VOS_SIGUSR1);
+    double sec = now_sec() - start;
+    if (ret == 0 && g_sig_caught != nr) ret = -EIO;
+    if (ret == 0 && (vos_signal(VOS_SIGUSR1, VOS_SIG_IGN) != sig_count_handler ||
+                     vos_kill(launcher, VOS_SIGUSR1) < 0 || g_sig_caught != nr ||
+                     vos_signal(VOS_SIGKILL, VOS_SIG_IGN) != VOS_SIG_ERR)) ret = -EIO;
+    if (ret == 0) {
+        printf("  kill to self, handled %10.0f/s (%.0f ns each)\n", nr / sec, sec * 1e9 / nr);
+        printf("  sigqueue + sigtimedwait %8.0f/s, %d real-time signals in order\n", queue_rate, nr);
+    } else {
+        printf("signals: error %d (%d handled)\n", ret, g_sig_caught);
+    }
+
+    int err = launcher_stop("signals", files);
+    return ret ? ret : err;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+    const char *usage;
+} g_benches[] = {
+    { "ext4-create", bench_ext4_create, "<image> [files] [threads] [crash]" },
+    { "tmpfs-smallfile", bench_tmpfs_smallfile, "[files] [bytes] [rounds]" },
+    { "procfs-stat", bench_procfs_stat, "[procs] [rounds]" },
+    { "fd-table", bench_fd_table, "[fds] [threads] [lookups]" },
+    { "iovec-write", bench_iovec_write, "[records] [size] [rounds]" },
+    { "io-ring", bench_io_ring, "[ops] [batch] [size]" },
+    { "vdso", bench_vdso, "[calls]" },
+    { "timers", bench_timers, "[timers]" },
+    { "irq-storm", bench_irq_storm, "[interrupts] [cpus]" },
+    { "ctx-switch", bench_ctx_switch, "[switches]" },
+    { "workqueue", bench_workqueue, "[items] [max-workers]" },
+    { "mem-pressure", bench_mem_pressure, "[stream-MB] [hot-MB]" },
+    { "numa", bench_numa, "[allocs]" },
+    { "kmalloc", bench_kmalloc, "[ops] [sample-bytes] [profile-out]" },
+    { "trace", bench_trace, "[events] [json-out]" },
+    { "printk", bench_printk, "[messages] [processes] [console-file]" },
+    { "console", bench_console, "[lines] [line-length]" },
+    { "pci", bench_pci, "[root-ports] [slots] [image]" },
+    { "virtio-blk", bench_virtio_blk, "[ops] [block-size] [depth] [cpus] [image]" },
+    { "boot", bench_boot, "[rounds]" },
+    { "exec", bench_exec, "[rounds] [small-KB] [large-KB]" },
+    { "spawn", bench_spawn, "[spawns] [rss-MB...]" },
+    { "clone", bench_clone, "[tasks] [rss-MB] [fds]" },
+    { "coroutines", bench_coroutines, "[coroutines] [yields] [io-coroutines]" },
+    { "signals", bench_signals, "[calls] [signals]" },
+};
+
+static int run_bench(int argc, char **argv) {
+    for (size_t i = 0; argc > 0 && i < sizeof(g_benches) / sizeof(g_benches[0]); i++) {
+        if (strcmp(argv[0], g_benches[i].name) == 0) {
+            bench_init();
+            int ret = g_benches[i].run(argc - 1, argv + 1);
+            console_flush();
+            if (ret == -EINVAL)
+                printf("usage: bench %s %s\n", g_benches[i].name, g_benches[i].usage);
+            return ret < 0 ? 1 : 0;
+        }
+    }
+    printf("Benchmarks:\n");
+    for (size_t i = 0; i < sizeof(g_benches) / sizeof(g_benches[0]); i++)
+        printf("  bench %s %s\n", g_benches[i].name, g_benches[i].usage);
+    return 1;
 }
 
 /* Test main */
-int main(void) {
+int main(int argc, char **argv) {
+    /* --cmdline="mem=512M numa=fake=2" stands in for the boot loader's command line */
+    if (argc > 1 && strncmp(argv[1], "--cmdline=", 10) == 0) {
+        setup_command_line(argv[1] + 10);
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return run_bench(argc - 2, argv + 2);
+
     printf("========================================\n");
     printf("VSS-CO OS Kernel Test Harness\n");
     printf("========================================\n\n");
@@ -72,6 +3772,7 @@ int main(void) {
     
     /* Run kernel */
     kernel_main();
+    console_flush();
     
     printf("\n========================================\n");
     printf("Test completed.\n");